@@ -64,20 +64,42 @@ First checked in.
 
 #include "EmptyFSMountArgs.h"
 
-#include <kern/assert.h>
-#include <libkern/libkern.h>
-#include <libkern/OSMalloc.h>
-#include <libkern/locks.h>
-#include <mach/mach_types.h>
-#include <sys/errno.h>
-#include <sys/mount.h>
-#include <sys/vnode.h>
-#include <sys/vnode_if.h>
-#include <sys/kernel_types.h>
-#include <sys/stat.h>
-#include <sys/dirent.h>
-#include <sys/proc.h>
-#include <sys/fcntl.h>
+// When EMPTYFS_USER_KPI is set, this file is being built as part of a user-space 
+// harness (see "EmptyFSUserKPI.h"), which supplies stand-ins for the kernel KPI. 
+// Otherwise it's being built as a KEXT, and we use the real thing.
+
+#if EMPTYFS_USER_KPI
+
+    #include "EmptyFSUserKPI.h"
+
+#else
+
+    #include <kern/assert.h>
+    #include <libkern/libkern.h>
+    #include <libkern/OSMalloc.h>
+    #include <libkern/locks.h>
+    #include <mach/mach_types.h>
+    #include <sys/errno.h>
+    #include <sys/mount.h>
+    #include <sys/vnode.h>
+    #include <sys/vnode_if.h>
+    #include <sys/kernel_types.h>
+    #include <sys/stat.h>
+    #include <sys/dirent.h>
+    #include <sys/proc.h>
+    #include <sys/fcntl.h>
+    #include <sys/buf.h>
+    #include <sys/disk.h>
+    #include <sys/ubc.h>
+    #include <kern/clock.h>
+    #include <kern/cpu_number.h>
+    #include <kern/thread.h>
+    #include <machine/machine_routines.h>
+
+#endif
+
+#include "EmptyFSFormat.h"
+#include "EmptyFSStats.h"
 
 /////////////////////////////////////////////////////////////////////
 #pragma mark ***** Source Code Notes
@@ -160,11 +182,13 @@ First checked in.
     inode number (file number in the case of MFS).  Getting the mechanics of 
     this table right is the most difficult part of implementing a VFS plug-in.
     
-    In the case of EmptyFS, there can only be one possible vnode (the root 
-    vnode) and thus we don't need a hash table.  Rather, we store information 
-    about the root vnode in the mount point itself.  Also, we don't actually 
-    need an FSNode data structure, because we don't need any state for our 
-    file system objects.
+    In EmptyFS, this table is implemented in the "FSNode Hash" section, below. 
+    The root directory gets no special treatment; it's looked up in the hash 
+    just like any other object (although VFSOPRoot has a fast path that 
+    usually avoids the hash entirely).  The hash is 
+    shared by all EmptyFS volumes, is split into separately locked stripes 
+    so that unrelated lookups don't contend with each other, and grows as 
+    the number of FSNodes increases.
 */
 
 /////////////////////////////////////////////////////////////////////
@@ -204,7 +228,7 @@ First checked in.
                     lineNumber,
                     flagsStr,
                     knownFlagsStr,
-                    flags & ~knownFlags
+                    (unsigned long long) (flags & ~knownFlags)
                 );
             }
             
@@ -314,6 +338,658 @@ static kern_return_t InitMemoryAndLocks(void)
     return err;
 }
 
+static void MemoryBarrier(void)
+    // Stops the compiler and CPU from reordering loads with other loads, or 
+    // stores with other stores, across this point.  That's all that our 
+    // lock-free protocols (the trace rings and the volume counters) need.
+{
+    #if defined(__ppc__) || defined(__ppc64__)
+        __asm__ __volatile__ ("sync" : : : "memory");
+    #elif defined(__i386__) || defined(__x86_64__)
+        // x86 doesn't reorder loads with other loads, or stores with 
+        // other stores, so we only have to stop the compiler.
+        __asm__ __volatile__ ("" : : : "memory");
+    #else
+        __sync_synchronize();
+    #endif
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Statistics
+
+// We collect the operation statistics described in "EmptyFSStats.h".  Each 
+// instrumented operation calls OpStart on entry and OpEnd on exit (see 
+// "Tracing", below), and OpEnd calls StatsOpEnd if collection is enabled. 
+// When collection (and tracing) is disabled, OpStart returns 0 and OpEnd 
+// does nothing, so the only cost is a test of gStatsEnabled (and of 
+// gTraceMountCount).  When it's enabled, the cost is two reads of the time 
+// base and a few increments of counters that belong to the current CPU, 
+// which typically stay in that CPU's cache.  The event counters 
+// (EMPTYFS_STATS_COUNTER_LIST) work the same way; code that wants to count 
+// something calls StatsCount.
+//
+// We don't disable preemption (KEXTs can't), so a thread can be rescheduled 
+// onto another CPU between calling cpu_number and updating the counters. 
+// If that happens at just the wrong time, two CPUs can update the same 
+// counters concurrently, and one of the updates can be lost.  That's an 
+// acceptable inaccuracy for statistics, and a lot cheaper than atomic 
+// operations.  Likewise, VFSOPSysctl reads the counters without any 
+// synchronisation, so a snapshot taken while operations are in progress 
+// is only approximately consistent.
+//
+// If a machine has more than kStatsMaxCPUs CPUs, the extra CPUs share 
+// counters with the others, which is correct modulo the inaccuracy 
+// described above.  The total size of the statistics is about 80 KB, which 
+// we allocate when the KEXT loads.
+
+enum {
+    kStatsMaxCPUs = 16                  // must be a power of two
+};
+
+struct StatsPerCPU {
+    EmptyFSOpStats  fOps[kEmptyFSOpCount];
+    uint64_t        fCounters[kEmptyFSCounterCount];
+};
+typedef struct StatsPerCPU StatsPerCPU;
+
+static StatsPerCPU *                gStatsPerCPU = NULL;        // kStatsMaxCPUs entries
+static volatile uint32_t            gStatsEnabled = FALSE;
+static mach_timebase_info_data_t    gStatsTimebase;
+
+static void StatsTerm(void)
+    // Disposes of the per-CPU statistics.
+{
+    gStatsEnabled = FALSE;
+    if (gStatsPerCPU != NULL) {
+        OSFree(gStatsPerCPU, sizeof(*gStatsPerCPU) * kStatsMaxCPUs, gOSMallocTag);
+        gStatsPerCPU = NULL;
+    }
+}
+
+static errno_t StatsInit(void)
+    // Allocates the per-CPU statistics.  Collection starts out disabled.
+{
+    errno_t     err;
+
+    err = 0;
+    gStatsPerCPU = (StatsPerCPU *) OSMalloc(sizeof(*gStatsPerCPU) * kStatsMaxCPUs, gOSMallocTag);
+    if (gStatsPerCPU == NULL) {
+        err = ENOMEM;
+    } else {
+        memset(gStatsPerCPU, 0, sizeof(*gStatsPerCPU) * kStatsMaxCPUs);
+        clock_timebase_info(&gStatsTimebase);
+    }
+    return err;
+}
+
+static uint64_t StatsNanosecondsFromAbsolute(uint64_t abstime)
+    // Converts a mach_absolute_time value, or difference, to ns.
+{
+    if (gStatsTimebase.numer != gStatsTimebase.denom) {
+        absolutetime_to_nanoseconds(abstime, &abstime);
+    }
+    return abstime;
+}
+
+static void StatsOpEnd(uint32_t op, uint64_t elapsed, errno_t err)
+    // Records the completion of operation op, which took elapsed ns and 
+    // returned err.
+{
+    uint32_t            bucket;
+    EmptyFSOpStats *    stats;
+
+    assert(op < kEmptyFSOpCount);
+
+    // The bucket is the base 2 logarithm of the elapsed time.
+    
+    bucket = 0;
+    if (elapsed != 0) {
+        bucket = 63 - (uint32_t) __builtin_clzll(elapsed);
+        if (bucket >= kEmptyFSStatsBucketCount) {
+            bucket = kEmptyFSStatsBucketCount - 1;
+        }
+    }
+
+    stats = &gStatsPerCPU[cpu_number() & (kStatsMaxCPUs - 1)].fOps[op];
+    stats->fCount     += 1;
+    stats->fTotalTime += elapsed;
+    stats->fHistogram[bucket] += 1;
+    if (err != 0) {
+        stats->fErrors += 1;
+    }
+}
+
+static void StatsCount(uint32_t counter, uint64_t amount)
+    // Adds amount to one of the event counters, if collection is enabled.
+{
+    assert(counter < kEmptyFSCounterCount);
+
+    if (gStatsEnabled) {
+        gStatsPerCPU[cpu_number() & (kStatsMaxCPUs - 1)].fCounters[counter] += amount;
+    }
+}
+
+static void StatsSnapshot(EmptyFSStats *snapshot)
+    // Fills in snapshot with the sum of the statistics for all CPUs.
+{
+    int                     cpu;
+    uint32_t                op;
+    uint32_t                bucket;
+    uint32_t                counter;
+    const EmptyFSOpStats *  src;
+    EmptyFSOpStats *        dst;
+
+    assert(snapshot != NULL);
+
+    memset(snapshot, 0, sizeof(*snapshot));
+    snapshot->fVersion     = kEmptyFSStatsVersion;
+    snapshot->fOpCount     = kEmptyFSOpCount;
+    snapshot->fBucketCount = kEmptyFSStatsBucketCount;
+    snapshot->fEnabled     = gStatsEnabled;
+    snapshot->fCounterCount = kEmptyFSCounterCount;
+    for (cpu = 0; cpu < kStatsMaxCPUs; cpu++) {
+        for (op = 0; op < kEmptyFSOpCount; op++) {
+            src = &gStatsPerCPU[cpu].fOps[op];
+            dst = &snapshot->fOps[op];
+            
+            dst->fCount     += src->fCount;
+            dst->fErrors    += src->fErrors;
+            dst->fTotalTime += src->fTotalTime;
+            for (bucket = 0; bucket < kEmptyFSStatsBucketCount; bucket++) {
+                dst->fHistogram[bucket] += src->fHistogram[bucket];
+            }
+        }
+        for (counter = 0; counter < kEmptyFSCounterCount; counter++) {
+            snapshot->fCounters[counter] += gStatsPerCPU[cpu].fCounters[counter];
+        }
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Object Zones
+
+// A mounted volume can have as many FSNodes as the system has vnodes, which 
+// on a big machine is millions, and each directory FSNode has a lookup 
+// cache too.  Allocating each of these with OSMalloc costs a trip through 
+// the kernel's general purpose allocator, which takes a global lock, adds 
+// a header to every object, and packs objects together without regard to 
+// cache lines, so two FSNodes that are busy on different CPUs can share a 
+// line.  Instead, we allocate these objects from zones, which are a 
+// simplified version of the slab allocator with per-CPU magazines 
+// (Bonwick & Adams, "Magazines and Vmem", USENIX 2001).
+//
+// A zone hands out objects of one size, rounded up to a multiple of 
+// kCacheLineSize and aligned on a cache line, so no two objects share a 
+// line.  It gets them by carving up slabs of kZoneSlabSize bytes, which it 
+// allocates with OSMalloc.  A free object goes back on the zone's free 
+// list rather than back to OSMalloc.  A zone never gives its slabs back 
+// until it's destroyed (when the KEXT unloads), just like the kernel's own 
+// zones.  That's fine for FSNodes, because their number is limited by the 
+// number of vnodes, so the high water mark is bounded.
+//
+// The free list is protected by the zone's lock, and taking that lock on 
+// every allocation would just move the contention from OSMalloc to us. 
+// So each CPU has two magazines, each of which is a stack of up to 
+// kZoneMagazineSize objects, and allocations and frees use those without 
+// touching the zone lock.  When the loaded magazine is empty (for an 
+// allocation) or full (for a free), the CPU swaps it with the previous 
+// magazine if that helps.  Otherwise it exchanges a magazine with the 
+// zone's depot, which keeps lists of full and empty magazines, under the 
+// zone lock.  Keeping two magazines means that a CPU that alternates 
+// allocations and frees on a magazine boundary doesn't go to the depot 
+// each time.  Only if the depot can't help does an allocation go to the 
+// free list (or a new slab) and a free go back to the free list.
+//
+// The kernel's magazine layer disables preemption to protect each CPU's 
+// magazines, and KEXTs can't do that.  Instead, each CPU's magazines have 
+// a mutex.  A thread that's moved to another CPU after calling cpu_number 
+// just uses the first CPU's magazines, under that CPU's lock, so the lock 
+// is almost never contended.
+//
+// A zone can have a constructor and a destructor.  The constructor runs 
+// once for each object, when its slab is carved up, and the destructor 
+// runs when the zone is destroyed.  In between, an object keeps its 
+// constructed state across a free and the next allocation, so the 
+// constructor is the place to set up things, like locks, that are 
+// expensive to create and that every user of the object needs.  An object 
+// must be returned to ZoneFree in its constructed state.
+//
+// Zone locking order: a CPU's magazine lock, then the zone lock.  Both are 
+// leaf locks as far as the rest of EmptyFS is concerned.
+
+enum {
+    kCacheLineSize      = 64,           // must be a power of two
+    kZoneMagazineSize   = 14,           // objects per magazine; a magazine is then 128 bytes (on LP64)
+    kZoneSlabSize       = 64 * 1024,
+    kZoneMaxCPUs        = 64            // must be a power of two; CPUs beyond this share magazines
+};
+
+// CacheLineAligned puts a field at the start of a cache line, so that it and 
+// the fields after it don't share a line with the fields before it.
+
+#define CacheLineAligned __attribute__ ((aligned (kCacheLineSize)))
+
+typedef errno_t (*ZoneConstructor)(void *object);
+typedef void    (*ZoneDestructor)(void *object);
+
+struct ZoneMagazine {
+    struct ZoneMagazine *   fNext;                      // next magazine in the depot list
+    uint32_t                fCount;                     // number of objects in fObjects
+    void *                  fObjects[kZoneMagazineSize];
+};
+typedef struct ZoneMagazine ZoneMagazine;
+
+struct ZonePerCPU {
+    lck_mtx_t *     fLock;              // protects the other fields
+    ZoneMagazine *  fLoaded;            // magazine that allocations and frees use first, or NULL
+    ZoneMagazine *  fPrevious;          // magazine that we swap with fLoaded, or NULL
+    char            fPad[kCacheLineSize - 3 * sizeof(void *)];  // each CPU gets its own cache line
+};
+typedef struct ZonePerCPU ZonePerCPU;
+
+struct ZoneSlab {
+    struct ZoneSlab *   fNext;          // next slab in the zone
+};
+typedef struct ZoneSlab ZoneSlab;
+
+struct Zone {
+    const char *        fName;          // [1] for debugging
+    uint32_t            fObjectSize;    // [1] size of an object, a multiple of kCacheLineSize
+    uint32_t            fLinkOffset;    // [1] offset within a free object of its free list link
+    ZoneConstructor     fConstructor;   // [1] may be NULL
+    ZoneDestructor      fDestructor;    // [1] may be NULL
+    lck_mtx_t *         fLock;          // [1] protects the fields marked [2]
+    void *              fFreeList;      // [2] free objects that aren't in a magazine; see ZoneLink
+    ZoneSlab *          fSlabs;         // [2] every slab that we've allocated
+    ZoneMagazine *      fFullMagazines;     // [2] the depot
+    ZoneMagazine *      fEmptyMagazines;    // [2]
+    SInt32 volatile     fInUse;         // number of objects allocated and not yet freed
+    ZonePerCPU          fCPUs[kZoneMaxCPUs] CacheLineAligned;   // [3] indexed by cpu_number
+};
+typedef struct Zone Zone;
+
+// Zone Notes
+// ----------
+// [1] This field is immutable.
+//
+// [2] This field is protected by fLock.
+//
+// [3] Each element is protected by its own fLock.  A zone is allocated on 
+//     a cache line boundary (see ZoneCreate), so each element has a line 
+//     to itself, and doesn't share one with the fields above.
+
+static void ** ZoneLink(const Zone *zone, void *object)
+    // Returns the address of the free list link in object.  If the zone has 
+    // no constructor, it's the first word of the object.  Otherwise the 
+    // object's contents must survive being on the free list, so ZoneCreate 
+    // adds a word for the link at the end of the object.
+{
+    return (void **) ( (char *) object + zone->fLinkOffset );
+}
+
+static void * ZoneObjectFromSlab(void *slab, uint32_t index, uint32_t objectSize)
+    // Returns the address of object index within slab.  The first object 
+    // starts on the first cache line after the ZoneSlab header.
+{
+    uintptr_t   first;
+
+    first = ( (uintptr_t) slab + sizeof(ZoneSlab) + (kCacheLineSize - 1) ) & ~ (uintptr_t) (kCacheLineSize - 1);
+    return (void *) (first + (uintptr_t) index * objectSize);
+}
+
+static uint32_t ZoneObjectsPerSlab(const Zone *zone)
+    // Returns the number of objects that fit in a slab.  We allow for the 
+    // worst case alignment of the slab that OSMalloc gives us.
+{
+    return (kZoneSlabSize - sizeof(ZoneSlab) - (kCacheLineSize - 1)) / zone->fObjectSize;
+}
+
+static errno_t ZoneGrow(Zone *zone)
+    // Allocates a new slab for zone, constructs each of its objects, and 
+    // adds them to the zone's free list.  The caller must not hold the zone 
+    // lock, because OSMalloc and the constructor can block.
+{
+    errno_t     err;
+    ZoneSlab *  slab;
+    uint32_t    objectCount;
+    uint32_t    objectIndex;
+    void *      object;
+    void *      first;
+    void *      last;
+
+    assert(zone != NULL);
+
+    err = 0;
+    objectCount = ZoneObjectsPerSlab(zone);
+    objectIndex = 0;
+    slab = OSMalloc(kZoneSlabSize, gOSMallocTag);
+    if (slab == NULL) {
+        err = ENOMEM;
+    } else {
+        for (objectIndex = 0; objectIndex < objectCount; objectIndex++) {
+            object = ZoneObjectFromSlab(slab, objectIndex, zone->fObjectSize);
+            memset(object, 0, zone->fObjectSize);
+            if (zone->fConstructor != NULL) {
+                err = zone->fConstructor(object);
+                if (err != 0) {
+                    break;
+                }
+            }
+        }
+    }
+
+    // Link the new objects together (in address order, which is kindest 
+    // to the cache when they're allocated in sequence) and add them to the 
+    // front of the free list.  If a constructor failed, destroy the objects 
+    // that we did construct and give up on the slab.
+
+    if (err == 0) {
+        for (objectIndex = 0; objectIndex < (objectCount - 1); objectIndex++) {
+            object = ZoneObjectFromSlab(slab, objectIndex, zone->fObjectSize);
+            *ZoneLink(zone, object) = ZoneObjectFromSlab(slab, objectIndex + 1, zone->fObjectSize);
+        }
+        first = ZoneObjectFromSlab(slab, 0, zone->fObjectSize);
+        last  = ZoneObjectFromSlab(slab, objectCount - 1, zone->fObjectSize);
+
+        lck_mtx_lock(zone->fLock);
+        *ZoneLink(zone, last) = zone->fFreeList;
+        zone->fFreeList = first;
+        slab->fNext = zone->fSlabs;
+        zone->fSlabs = slab;
+        lck_mtx_unlock(zone->fLock);
+    } else if (slab != NULL) {
+        if (zone->fDestructor != NULL) {
+            while (objectIndex > 0) {
+                objectIndex -= 1;
+                zone->fDestructor( ZoneObjectFromSlab(slab, objectIndex, zone->fObjectSize) );
+            }
+        }
+        OSFree(slab, kZoneSlabSize, gOSMallocTag);
+    }
+    return err;
+}
+
+static void ZoneDestroy(Zone *zone)
+    // Destroys a zone created by ZoneCreate.  Every object allocated from the 
+    // zone must have been freed.  This is safe to call with a zone that 
+    // ZoneCreate only partially set up.
+{
+    uint32_t        cpu;
+    ZoneMagazine *  magazine;
+    ZoneMagazine *  nextMagazine;
+    ZoneSlab *      slab;
+    uint32_t        objectCount;
+    uint32_t        objectIndex;
+
+    assert(zone != NULL);
+    assert(zone->fInUse == 0);
+
+    // Free the magazines.  Their objects are all on slabs, so we don't need 
+    // to do anything with them individually.
+
+    for (cpu = 0; cpu < kZoneMaxCPUs; cpu++) {
+        if (zone->fCPUs[cpu].fLoaded != NULL) {
+            OSFree(zone->fCPUs[cpu].fLoaded, sizeof(ZoneMagazine), gOSMallocTag);
+        }
+        if (zone->fCPUs[cpu].fPrevious != NULL) {
+            OSFree(zone->fCPUs[cpu].fPrevious, sizeof(ZoneMagazine), gOSMallocTag);
+        }
+        if (zone->fCPUs[cpu].fLock != NULL) {
+            lck_mtx_free(zone->fCPUs[cpu].fLock, gLockGroup);
+        }
+    }
+    for (magazine = zone->fFullMagazines; magazine != NULL; magazine = nextMagazine) {
+        nextMagazine = magazine->fNext;
+        OSFree(magazine, sizeof(ZoneMagazine), gOSMallocTag);
+    }
+    for (magazine = zone->fEmptyMagazines; magazine != NULL; magazine = nextMagazine) {
+        nextMagazine = magazine->fNext;
+        OSFree(magazine, sizeof(ZoneMagazine), gOSMallocTag);
+    }
+
+    // Destroy the objects and free the slabs.
+
+    objectCount = ZoneObjectsPerSlab(zone);
+    while (zone->fSlabs != NULL) {
+        slab = zone->fSlabs;
+        zone->fSlabs = slab->fNext;
+        if (zone->fDestructor != NULL) {
+            for (objectIndex = 0; objectIndex < objectCount; objectIndex++) {
+                zone->fDestructor( ZoneObjectFromSlab(slab, objectIndex, zone->fObjectSize) );
+            }
+        }
+        OSFree(slab, kZoneSlabSize, gOSMallocTag);
+    }
+
+    if (zone->fLock != NULL) {
+        lck_mtx_free(zone->fLock, gLockGroup);
+    }
+
+    // OSMalloc only promises pointer alignment, so ZoneCreate over-allocated 
+    // by a cache line and stashed the real address just before the zone.
+
+    OSFree( ((void **) zone)[-1], sizeof(Zone) + kCacheLineSize, gOSMallocTag);
+}
+
+static errno_t ZoneCreate(
+    const char *        name,
+    size_t              objectSize,
+    ZoneConstructor     constructor,
+    ZoneDestructor      destructor,
+    Zone **             zonePtr
+)
+    // Creates a zone for objects of objectSize bytes.  constructor and 
+    // destructor may be NULL.  The zone starts out empty; it gets its first 
+    // slab on the first allocation.  This must be called after 
+    // InitMemoryAndLocks because it uses gOSMallocTag and gLockGroup.
+{
+    errno_t     err;
+    void *      mem;
+    Zone *      zone;
+    uint32_t    cpu;
+
+    assert(name != NULL);
+    assert(objectSize >= sizeof(void *));
+    assert( zonePtr != NULL);
+    assert(*zonePtr == NULL);
+
+    err = 0;
+    zone = NULL;
+    mem = OSMalloc(sizeof(Zone) + kCacheLineSize, gOSMallocTag);
+    if (mem == NULL) {
+        err = ENOMEM;
+    } else {
+        // Round up to the next cache line boundary that leaves room for the 
+        // real address, which ZoneDestroy needs.  OSMalloc's result is at 
+        // least pointer aligned, so there's always room.
+
+        zone = (Zone *) ( ((uintptr_t) mem + kCacheLineSize) & ~ (uintptr_t) (kCacheLineSize - 1) );
+        memset(zone, 0, sizeof(*zone));
+        ((void **) zone)[-1] = mem;
+
+        if (constructor != NULL) {
+            objectSize += sizeof(void *);
+        }
+        zone->fName        = name;
+        zone->fObjectSize  = (uint32_t) ( (objectSize + (kCacheLineSize - 1)) & ~ (size_t) (kCacheLineSize - 1) );
+        zone->fLinkOffset  = (constructor != NULL) ? (uint32_t) (zone->fObjectSize - sizeof(void *)) : 0;
+        zone->fConstructor = constructor;
+        zone->fDestructor  = destructor;
+        assert(ZoneObjectsPerSlab(zone) >= 2);
+
+        zone->fLock = lck_mtx_alloc_init(gLockGroup, LCK_ATTR_NULL);
+        if (zone->fLock == NULL) {
+            err = ENOMEM;
+        }
+        for (cpu = 0; (err == 0) && (cpu < kZoneMaxCPUs); cpu++) {
+            zone->fCPUs[cpu].fLock = lck_mtx_alloc_init(gLockGroup, LCK_ATTR_NULL);
+            if (zone->fCPUs[cpu].fLock == NULL) {
+                err = ENOMEM;
+            }
+        }
+        if (err != 0) {
+            ZoneDestroy(zone);
+            zone = NULL;
+        }
+    }
+    if (err == 0) {
+        *zonePtr = zone;
+    }
+
+    assert( (err == 0) == (*zonePtr != NULL) );
+
+    return err;
+}
+
+static void * ZoneAlloc(Zone *zone)
+    // Allocates an object from zone.  Returns NULL if there's no memory.  The 
+    // object is in its constructed state or, if the zone has no constructor, 
+    // is full of junk; either way, the caller must initialise it.
+{
+    void *          object;
+    ZonePerCPU *    perCPU;
+    ZoneMagazine *  magazine;
+
+    assert(zone != NULL);
+
+    object = NULL;
+    perCPU = &zone->fCPUs[cpu_number() & (kZoneMaxCPUs - 1)];
+
+    lck_mtx_lock(perCPU->fLock);
+
+    // If the loaded magazine is empty, try the previous one and then the 
+    // depot.  A full magazine from the depot becomes the loaded magazine, 
+    // the loaded (empty) magazine becomes the previous one, and the previous 
+    // one goes back to the depot.
+
+    if ( (perCPU->fLoaded == NULL) || (perCPU->fLoaded->fCount == 0) ) {
+        if ( (perCPU->fPrevious != NULL) && (perCPU->fPrevious->fCount != 0) ) {
+            magazine = perCPU->fLoaded;
+            perCPU->fLoaded = perCPU->fPrevious;
+            perCPU->fPrevious = magazine;
+        } else {
+            lck_mtx_lock(zone->fLock);
+            magazine = zone->fFullMagazines;
+            if (magazine != NULL) {
+                zone->fFullMagazines = magazine->fNext;
+                if (perCPU->fPrevious != NULL) {
+                    perCPU->fPrevious->fNext = zone->fEmptyMagazines;
+                    zone->fEmptyMagazines = perCPU->fPrevious;
+                }
+                perCPU->fPrevious = perCPU->fLoaded;
+                perCPU->fLoaded = magazine;
+            }
+            lck_mtx_unlock(zone->fLock);
+        }
+    }
+    magazine = perCPU->fLoaded;
+    if ( (magazine != NULL) && (magazine->fCount != 0) ) {
+        magazine->fCount -= 1;
+        object = magazine->fObjects[magazine->fCount];
+    }
+
+    lck_mtx_unlock(perCPU->fLock);
+
+    // If the magazine layer couldn't help, go to the free list, growing the 
+    // zone if that's empty.  Another CPU might take the new objects before 
+    // we get to them, so we loop.
+    
+    while (object == NULL) {
+        lck_mtx_lock(zone->fLock);
+        object = zone->fFreeList;
+        if (object != NULL) {
+            zone->fFreeList = *ZoneLink(zone, object);
+        }
+        lck_mtx_unlock(zone->fLock);
+
+        if ( (object == NULL) && (ZoneGrow(zone) != 0) ) {
+            break;
+        }
+    }
+    if (object != NULL) {
+        (void) OSIncrementAtomic(&zone->fInUse);
+    }
+    return object;
+}
+
+static void ZoneFree(Zone *zone, void *object)
+    // Returns object, which must have been allocated from zone, to the zone.
+{
+    ZonePerCPU *    perCPU;
+    ZoneMagazine *  magazine;
+    ZoneMagazine *  newMagazine;
+    boolean_t       done;
+
+    assert(zone != NULL);
+    assert(object != NULL);
+    assert( ((uintptr_t) object & (kCacheLineSize - 1)) == 0 );
+
+    (void) OSDecrementAtomic(&zone->fInUse);
+
+    done = FALSE;
+    newMagazine = NULL;
+    perCPU = &zone->fCPUs[cpu_number() & (kZoneMaxCPUs - 1)];
+
+    lck_mtx_lock(perCPU->fLock);
+
+    // If the loaded magazine is full, try the previous one and then the 
+    // depot, the mirror image of ZoneAlloc.  If the depot has no empty 
+    // magazines, we make one.  OSMalloc can block, but we're only holding 
+    // our CPU's lock, and it's rare (the number of magazines levels off 
+    // quickly).
+
+    if ( (perCPU->fLoaded == NULL) || (perCPU->fLoaded->fCount == kZoneMagazineSize) ) {
+        if ( (perCPU->fPrevious != NULL) && (perCPU->fPrevious->fCount == 0) ) {
+            magazine = perCPU->fLoaded;
+            perCPU->fLoaded = perCPU->fPrevious;
+            perCPU->fPrevious = magazine;
+        } else {
+            lck_mtx_lock(zone->fLock);
+            magazine = zone->fEmptyMagazines;
+            if (magazine != NULL) {
+                zone->fEmptyMagazines = magazine->fNext;
+            }
+            lck_mtx_unlock(zone->fLock);
+
+            if (magazine == NULL) {
+                newMagazine = OSMalloc(sizeof(*newMagazine), gOSMallocTag);
+                if (newMagazine != NULL) {
+                    newMagazine->fCount = 0;
+                    magazine = newMagazine;
+                }
+            }
+            if (magazine != NULL) {
+                if (perCPU->fPrevious != NULL) {
+                    assert(perCPU->fPrevious->fCount == kZoneMagazineSize);
+                    lck_mtx_lock(zone->fLock);
+                    perCPU->fPrevious->fNext = zone->fFullMagazines;
+                    zone->fFullMagazines = perCPU->fPrevious;
+                    lck_mtx_unlock(zone->fLock);
+                }
+                perCPU->fPrevious = perCPU->fLoaded;
+                perCPU->fLoaded = magazine;
+            }
+        }
+    }
+    magazine = perCPU->fLoaded;
+    if ( (magazine != NULL) && (magazine->fCount < kZoneMagazineSize) ) {
+        magazine->fObjects[magazine->fCount] = object;
+        magazine->fCount += 1;
+        done = TRUE;
+    }
+
+    lck_mtx_unlock(perCPU->fLock);
+
+    // If we couldn't get a magazine with room, put the object on the free list.
+
+    if ( ! done ) {
+        lck_mtx_lock(zone->fLock);
+        *ZoneLink(zone, object) = zone->fFreeList;
+        zone->fFreeList = object;
+        lck_mtx_unlock(zone->fLock);
+    }
+}
+
 /////////////////////////////////////////////////////////////////////
 #pragma mark ***** Core Data Structures
 
@@ -334,30 +1010,95 @@ enum {
     kEmptyFSMountBadMagic = 'M!Mn'
 };
 
+// The volume counters are the volume attributes that change as the volume is 
+// modified.  See "Volume Counter Notes", below.
+
+enum {
+    kVolumeCounterFreeBlocks = 0,
+    kVolumeCounterFreeFiles,            // free file records
+    kVolumeCounterDirectories,
+    kVolumeCounterCount
+};
+
+struct VolumeCountersPerCPU {
+    volatile SInt32     fDelta[kVolumeCounterCount];        // changes not yet folded into fCounterBase
+    uint32_t            fPad[16 - kVolumeCounterCount];     // each CPU gets its own (64 byte) cache line
+};
+typedef struct VolumeCountersPerCPU VolumeCountersPerCPU;
+
 struct EmptyFSMount {
     uint32_t        fMagic;             // [1] must be kEmptyFSMountMagic
     mount_t         fMountPoint;        // [1] back pointer to the mount_t
     uint32_t        fDebugLevel;        // [1] [3] debug level from mount arguments
+    boolean_t       fTracing;           // [1] [3] true if we record operations in the trace buffer
     dev_t           fBlockRDevNum;      // [1] raw dev_t of the device we're mounted on
     vnode_t         fBlockDevVNode;     // [1] a vnode for the above; we have a use count reference on this
-    char            fVolumeName[30];    // [1] volume name (UTF-8)
-    struct vfs_attr fAttr;              // [1] pre-calculate volume attributes
+    EmptyFSSuperblock fSuperblock;      // [1] the volume's superblock, in host byte order
+    uint32_t        fBlockSize;         // [1] fSuperblock.fBlockSize, for convenience
+    uint32_t        fDevBlockSize;      // [1] block size of the device (DKIOCGETBLOCKSIZE)
+    uint32_t        fDevBlocksPerBlock; // [1] fBlockSize / fDevBlockSize
+    char            fVolumeName[kEmptyFSVolumeNameSize];    // [1] volume name (UTF-8), from the superblock
+    struct vfs_attr fAttr;              // [1] pre-calculate volume attributes, except the volume counters
     
-    lck_mtx_t *     fRootMutex;         // [1] protects following fields
+    SInt32          fFSNodeCount;       // [2] number of FSNodes that exist for this volume
+    SInt32          fMappedCount;       // [2] number of those FSNodes that are memory mapped
     
-    boolean_t       fRootAttaching;     // [2] true if someone is attaching a root vnode
-    boolean_t       fRootWaiting;       // [2] true if someone is waiting for such an attach to complete
-    vnode_t         fRootVNode;         // [2] the root vnode; we hold /no/ proper references to this, 
-                                        //     and must reconfirm its existance each time
+    vnode_t volatile    fRootVNodeHint; // [4] the root vnode, if any; we hold /no/ references to this
+    uint32_t volatile   fRootVIDHint;   // [4] vnode_vid of fRootVNodeHint
+
+    lck_mtx_t *         fCounterLock;                           // [1] serialises folds
+    uint32_t volatile   fCounterFoldSeq;                        // [5] odd while a fold is in progress
+    UInt32 volatile     fCounterCPUCount;                       // [5] fCounterDeltas beyond this are all zero
+    int64_t             fCounterBase[kVolumeCounterCount];      // [5] counter values, less the per-CPU deltas
+    VolumeCountersPerCPU fCounterDeltas[kStatsMaxCPUs];         // [5] per-CPU changes to the counters
+
+    boolean_t           fWritable;      // [1] true if the volume is mounted read/write; see "Write Notes"
+    union AllocGroupSlot * fAllocGroups; // [1] the allocation groups; see "Allocation Notes"
+    uint32_t            fAllocGroupCount;   // [1] number of elements in fAllocGroups
+    uint64_t            fAllocGroupBlocks;  // [1] blocks per group; group N starts at block N * fAllocGroupBlocks
+    lck_mtx_t *         fAllocLock;     // [1] protects the free records in the file table, and the fields marked [6]
+    uint32_t            fFileNumHint;   // [6] file number at which to start the next search for a free record
+    uint32_t            fFreeFileRecords;   // [6] number of free records in the file table
+    uint32_t volatile   fFileTableInitCount;    // [8] records below this file number are initialised; see "Allocation Notes"
+    uint64_t            fUnloadedFreeBlocks;    // [6] free blocks in the allocation groups that aren't loaded
+    lck_mtx_t *         fRecordLock;    // [1] serialises FSNodeWriteRecord; see "FSNode Notes"
+    struct OrphanEntry * fOrphanHead;   // [9] the orphan list, in on-disk order; see "Orphan Notes"
+    uint32_t            fOrphanFileNum; // [9] file number of the first orphan, or zero
+    lck_mtx_t *         fDirtyLock;     // [1] protects the fields marked [7]
+    struct FSNode *     fDirtyHead;     // [7] FSNodes with data or records to write, oldest first
+    struct FSNode *     fDirtyTail;     // [7] last FSNode on that list
+    uint64_t            fDirtyBytes;    // [7] bytes written to those FSNodes since they were queued
+    boolean_t           fFlusherStop;   // [7] set by unmount to tell the flusher thread to exit
+    boolean_t           fFlusherRunning;// [7] true from mount until the flusher thread exits
+    struct Journal *    fJournal;       // [1] the metadata journal, or NULL; see "Journal Notes"
 };
 typedef struct EmptyFSMount EmptyFSMount;
 
+// The on-disk format of the volume (the superblock, the file table, and so on) is 
+// described in "EmptyFSFormat.h".  Everything we read from the volume is 
+// converted to host byte order and validated before we use it.  The file number 
+// of the root directory is kEmptyFSRootFileNum.  This is traditional (it matches 
+// UFS and HFS Plus), and file numbers 0 and 1 are left unused.
+
 // Root VNode Notes
 // ----------------
-// In a typical VFS plug-in, the root vnode is accessed via the hash layer, exactly 
-// like any other vnode.  In this trivial file system, I haven't implemented a hash 
-// layer (simply because I don't need it), thus I store the root vnode information 
-// in the mount point.
+// The root vnode is accessed via the FSNode hash layer (see "FSNode Hash", below), 
+// exactly like any other vnode.  It's distinguished only by its file number 
+// (kEmptyFSRootFileNum), which tells us to mark it as the root when we create it.
+//
+// However, VFSOPRoot is called every time a path lookup crosses onto our volume, 
+// so it's worth having a faster way in.  Once the root vnode exists, we record 
+// it, and its vnode ID (vid), in the mount point.  VFSOPRoot reads this hint 
+// without taking any locks and calls vnode_getwithvid on it.  If that works, 
+// and the resulting vnode is the root of this mount, we're done.  
+// 
+// The hint can be stale in all sorts of ways: the vnode may have been reclaimed 
+// and reused for some other object (possibly on another volume), or we may see 
+// the vnode from one update and the vid from another.  vnode_getwithvid, followed 
+// by the vnode_mount and vnode_isvroot checks, catches all of these.  Calling 
+// vnode_getwithvid on a stale vnode is safe because VFS never frees vnode memory; 
+// it just recycles it.  If any of the checks fail, we fall back to the hash, 
+// which also handles the case where we have to attach a new root vnode.
 
 // Other Notes
 // -----------
@@ -365,13 +1106,37 @@ typedef struct EmptyFSMount EmptyFSMount;
 //     process, and is not modified after that.  Thus, it doesn't need to be 
 //     protected from concurrent access.
 //
-// [2] This field is protected by the fRootMutex lock.
+// [2] This field is only accessed using atomic operations (OSIncrementAtomic and 
+//     friends).  It's only used to check, at unmount time, that we didn't leak 
+//     any FSNodes, or lose track of a mapping.
+//
+// [4] This field is written with the lock of the root FSNode's hash stripe held, 
+//     but is read without any locks by the VFSOPRoot fast path.  See the 
+//     "Root VNode Notes", above, for why this is OK.
+//
+// [5] These fields implement the volume counters, and are only accessed by the 
+//     EmptyFSMountCounterXxx routines.  See "Volume Counter Notes", below.
+//
+// [6] These fields are protected by fAllocLock, which also protects the 
+//     free records in the file table.  The bitmap is protected by the 
+//     allocation groups' locks.  See "Allocation Notes", below.
+//
+// [7] These fields are protected by fDirtyLock.  See "Flusher Notes", below.
+//
+// [8] This field is set up from the superblock at mount time and, on a 
+//     writable volume, only increases after that, with fAllocLock held. 
+//     EmptyFSMountReadFileRecord reads it without any locks; see "Allocation 
+//     Notes" for why that's OK.
 //
-// [3] fDebugLevel isn't really used.  I've included it for two reasons: 
-//     a) if you use EmptyFS as a template for your own VFS plug-in, it will be useful 
-//        to have a handy debug switch
-//     b) it's a good example of how to pass information from your mount tool to your 
-//        KEXT
+// [9] These fields are protected by fRecordLock, and only change within a 
+//     transaction handle; see "Orphan Notes".
+//
+// [3] fDebugLevel is a good example of how to pass information from your mount tool 
+//     to your KEXT.  If the level (the bits in kEmptyFSDebugLevelMask) is non-zero, 
+//     we record the operations on the volume in the trace buffer (see "Tracing"), 
+//     and set fTracing to say so.  The kEmptyFSDebugNoFastPaths bit (see 
+//     "EmptyFSMountArgs.h") disables optimised code paths (like the VFSOPRoot fast 
+//     path) so that you can measure what they buy you.
 
 static EmptyFSMount *   EmptyFSMountFromMount(mount_t mp)
     // Gets the EmptyFSMount from a mount_t.
@@ -389,48 +1154,310 @@ static EmptyFSMount *   EmptyFSMountFromMount(mount_t mp)
     return result;
 }
 
-static void EmptyFSMountInitGetAttrListGoop(EmptyFSMount *mtmp)
-    // Initialises the f_capabilities and f_attributes fields of the 
-    // fAttr field of the EmptyFSMount with the appropriate static values. 
-    // This is in a separate routine because it's so big; I didn't want 
-    // to confuse EmptyFSInitAttr with all of this stuff.
+// Volume Counter Notes
+// --------------------
+// The number of free blocks, free file records, and directories change as 
+// the volume is modified, and VFSOPGetattr (that is, statfs) has to return 
+// their current values.  statfs is called a lot (we advertise 
+// VOL_CAP_FMT_FAST_STATFS, which tells clients that it's cheap), so it must 
+// not take a lock that the code changing the counts also takes, and it must 
+// not scan the allocation structures.
+//
+// So each counter is a 64-bit base value plus a 32-bit delta per CPU. 
+// Changing a counter (EmptyFSMountCounterAdd) atomically adds to the current 
+// CPU's delta.  That's an atomic operation on a cache line that belongs to 
+// that CPU, so it's uncontended.  It has to be atomic (unlike the statistics) 
+// because we can be moved to another CPU at any time, and these counts have 
+// to be exact.  Reading the counters (EmptyFSMountGetCounters) adds up the 
+// base and all of the deltas, without taking any locks.
+//
+// A CPU's delta can drift a long way from zero (consider one CPU that always 
+// allocates and another that always frees), so when one gets too big we fold 
+// it into the base (EmptyFSMountCounterFold).  Folding is rare, so it's 
+// serialised by fCounterLock.  Because it moves a value from a delta to the 
+// base, a reader that looks at both while a fold is in progress could see 
+// the value twice or not at all.  So folds bracket their work with increments 
+// of fCounterFoldSeq, and readers retry if that changes under them, like a 
+// seqlock.  This also covers readers on 32-bit CPUs, which can't read the 
+// 64-bit base atomically.
+//
+// Summing the deltas for every possible CPU would make statfs noticeably 
+// slower, so fCounterCPUCount records how many of them have ever been used, 
+// and readers only sum those.  A writer raises fCounterCPUCount before it 
+// touches a new CPU's delta, so a reader can never miss a non-zero delta. 
+// On a volume that's never modified, readers don't look at any deltas.
+//
+// Everything that allocates or frees blocks or file records must go through 
+// the counters.  Allocation is paid for in advance: before a thread takes 
+// any space, it reserves it with EmptyFSMountCounterReserve, which fails with 
+// ENOSPC if the counter would go negative.  That's how write gets ENOSPC 
+// even though, with delayed allocation, it doesn't allocate any blocks (see 
+// "Delayed Allocation Notes").  Freeing space adds it back with 
+// EmptyFSMountCounterAdd, after the bitmap or file table has been updated. 
+// On a journalled volume, freed blocks only go back once the journal says 
+// they can be reused, so the free block counter can be a little below the 
+// number of clear bits in the bitmap; see "Journal Notes".
+
+enum {
+    kVolumeCounterFoldThreshold = 0x10000000        // fold a delta when its magnitude exceeds this
+};
+
+// kVolumeCounterAttributes is the set of volume attributes (VFSATTR_f_xxx) 
+// that are derived from the volume counters.
+
+enum {
+    kVolumeCounterAttributes = VFSATTR_f_objcount | VFSATTR_f_filecount | VFSATTR_f_dircount 
+                             | VFSATTR_f_bfree    | VFSATTR_f_bavail    | VFSATTR_f_bused 
+                             | VFSATTR_f_ffree
+};
+
+static errno_t EmptyFSMountCountersInit(EmptyFSMount *mtmp)
+    // Sets up the volume counters from the superblock.
 {
-    mtmp->fAttr.f_capabilities.capabilities[VOL_CAPABILITIES_FORMAT]     = 0
-//      | VOL_CAP_FMT_PERSISTENTOBJECTIDS
-//      | VOL_CAP_FMT_SYMBOLICLINKS
-//      | VOL_CAP_FMT_HARDLINKS
-//      | VOL_CAP_FMT_JOURNAL
-//      | VOL_CAP_FMT_JOURNAL_ACTIVE
-        | VOL_CAP_FMT_NO_ROOT_TIMES
-//      | VOL_CAP_FMT_SPARSE_FILES
-//      | VOL_CAP_FMT_ZERO_RUNS
-        | VOL_CAP_FMT_CASE_SENSITIVE
-        | VOL_CAP_FMT_CASE_PRESERVING
-        | VOL_CAP_FMT_FAST_STATFS
-        | VOL_CAP_FMT_2TB_FILESIZE
-        ;
-    mtmp->fAttr.f_capabilities.valid[VOL_CAPABILITIES_FORMAT]            = 0
-        | VOL_CAP_FMT_PERSISTENTOBJECTIDS
-        | VOL_CAP_FMT_SYMBOLICLINKS
-        | VOL_CAP_FMT_HARDLINKS
-        | VOL_CAP_FMT_JOURNAL
-        | VOL_CAP_FMT_JOURNAL_ACTIVE
-        | VOL_CAP_FMT_NO_ROOT_TIMES
-        | VOL_CAP_FMT_SPARSE_FILES
-        | VOL_CAP_FMT_ZERO_RUNS
-        | VOL_CAP_FMT_CASE_SENSITIVE
-        | VOL_CAP_FMT_CASE_PRESERVING
-        | VOL_CAP_FMT_FAST_STATFS
-        | VOL_CAP_FMT_2TB_FILESIZE
-        ;
-    mtmp->fAttr.f_capabilities.capabilities[VOL_CAPABILITIES_INTERFACES] = 0
-//      | VOL_CAP_INT_SEARCHFS
-        | VOL_CAP_INT_ATTRLIST
-//      | VOL_CAP_INT_NFSEXPORT
-//      | VOL_CAP_INT_READDIRATTR
-//      | VOL_CAP_INT_EXCHANGEDATA
-//      | VOL_CAP_INT_COPYFILE
-//      | VOL_CAP_INT_ALLOCATE
+    errno_t     err;
+
+    assert(mtmp != NULL);
+    assert(mtmp->fCounterLock == NULL);
+
+    err = 0;
+    mtmp->fCounterLock = lck_mtx_alloc_init(gLockGroup, LCK_ATTR_NULL);
+    if (mtmp->fCounterLock == NULL) {
+        err = ENOMEM;
+    } else {
+        mtmp->fCounterFoldSeq = 0;
+        mtmp->fCounterCPUCount = 0;
+        mtmp->fCounterBase[kVolumeCounterFreeBlocks]  = (int64_t) mtmp->fSuperblock.fFreeBlockCount;
+        mtmp->fCounterBase[kVolumeCounterFreeFiles]   = (int64_t) mtmp->fSuperblock.fFreeFileCount;
+        mtmp->fCounterBase[kVolumeCounterDirectories] = (int64_t) mtmp->fSuperblock.fDirectoryCount;
+        memset(mtmp->fCounterDeltas, 0, sizeof(mtmp->fCounterDeltas));
+    }
+    return err;
+}
+
+static void EmptyFSMountCountersTerm(EmptyFSMount *mtmp)
+    // Undoes EmptyFSMountCountersInit.
+{
+    assert(mtmp != NULL);
+
+    if (mtmp->fCounterLock != NULL) {
+        lck_mtx_free(mtmp->fCounterLock, gLockGroup);
+        mtmp->fCounterLock = NULL;
+    }
+}
+
+static void EmptyFSMountCounterFold(EmptyFSMount *mtmp, uint32_t counter, VolumeCountersPerCPU *perCPU)
+    // Moves the delta for counter in perCPU into the base value.
+{
+    SInt32      delta;
+
+    lck_mtx_lock(mtmp->fCounterLock);
+
+    mtmp->fCounterFoldSeq += 1;
+    MemoryBarrier();
+
+    // Other threads can still add to the delta (on this CPU or, if they've 
+    // been moved, another), so we have to swap it out atomically.
+    
+    do {
+        delta = perCPU->fDelta[counter];
+    } while ( ! OSCompareAndSwap( (UInt32) delta, 0, (volatile UInt32 *) &perCPU->fDelta[counter]) );
+    mtmp->fCounterBase[counter] += delta;
+
+    MemoryBarrier();
+    mtmp->fCounterFoldSeq += 1;
+
+    lck_mtx_unlock(mtmp->fCounterLock);
+}
+
+static void EmptyFSMountCounterAdd(EmptyFSMount *mtmp, uint32_t counter, SInt32 delta)
+    // Adds delta to the volume counter counter.
+{
+    uint32_t                cpu;
+    uint32_t                cpuCount;
+    VolumeCountersPerCPU *  perCPU;
+    SInt32                  newDelta;
+
+    assert(mtmp != NULL);
+    assert(counter < kVolumeCounterCount);
+    assert( (delta < kVolumeCounterFoldThreshold) && (delta > -kVolumeCounterFoldThreshold) );
+
+    cpu = (uint32_t) cpu_number() & (kStatsMaxCPUs - 1);
+    if (cpu >= mtmp->fCounterCPUCount) {
+        do {
+            cpuCount = mtmp->fCounterCPUCount;
+        } while ( (cpu >= cpuCount) && ! OSCompareAndSwap(cpuCount, cpu + 1, &mtmp->fCounterCPUCount) );
+        MemoryBarrier();
+    }
+    
+    perCPU = &mtmp->fCounterDeltas[cpu];
+    newDelta = OSAddAtomic(delta, &perCPU->fDelta[counter]) + delta;
+    if ( (newDelta > kVolumeCounterFoldThreshold) || (newDelta < -kVolumeCounterFoldThreshold) ) {
+        EmptyFSMountCounterFold(mtmp, counter, perCPU);
+    }
+}
+
+static void EmptyFSMountSumCounters(EmptyFSMount *mtmp, int64_t sums[kVolumeCounterCount])
+    // Gets the current values of all of the volume counters, which may be 
+    // transiently negative.  This doesn't take any locks, although it may 
+    // have to retry if it races with a fold.
+{
+    uint32_t    seq;
+    uint32_t    counter;
+    uint32_t    cpu;
+    uint32_t    cpuCount;
+
+    assert(mtmp != NULL);
+    assert(sums != NULL);
+
+    do {
+        seq = mtmp->fCounterFoldSeq;
+        MemoryBarrier();
+        
+        for (counter = 0; counter < kVolumeCounterCount; counter++) {
+            sums[counter] = mtmp->fCounterBase[counter];
+        }
+        cpuCount = mtmp->fCounterCPUCount;
+        MemoryBarrier();
+        for (cpu = 0; cpu < cpuCount; cpu++) {
+            for (counter = 0; counter < kVolumeCounterCount; counter++) {
+                sums[counter] += mtmp->fCounterDeltas[cpu].fDelta[counter];
+            }
+        }
+        
+        MemoryBarrier();
+    } while ( (seq & 1) || (seq != mtmp->fCounterFoldSeq) );
+}
+
+static void EmptyFSMountGetCounters(EmptyFSMount *mtmp, uint64_t values[kVolumeCounterCount])
+    // Gets the current values of all of the volume counters.
+{
+    uint32_t    counter;
+    int64_t     sums[kVolumeCounterCount];
+
+    assert(values != NULL);
+
+    EmptyFSMountSumCounters(mtmp, sums);
+
+    // A counter can only be transiently negative, if we see a free before the 
+    // corresponding allocation on another CPU.  Don't let that leak out as a 
+    // huge unsigned number.
+    
+    for (counter = 0; counter < kVolumeCounterCount; counter++) {
+        values[counter] = (sums[counter] < 0) ? 0 : (uint64_t) sums[counter];
+    }
+}
+
+static void EmptyFSMountCounterAdjust(EmptyFSMount *mtmp, uint32_t counter, int64_t delta)
+    // Adds delta, which can be bigger than EmptyFSMountCounterAdd allows, 
+    // to the volume counter counter.
+{
+    SInt32      chunk;
+
+    while (delta != 0) {
+        if (delta >= kVolumeCounterFoldThreshold) {
+            chunk = kVolumeCounterFoldThreshold - 1;
+        } else if (delta <= -kVolumeCounterFoldThreshold) {
+            chunk = -(kVolumeCounterFoldThreshold - 1);
+        } else {
+            chunk = (SInt32) delta;
+        }
+        EmptyFSMountCounterAdd(mtmp, counter, chunk);
+        delta -= chunk;
+    }
+}
+
+static errno_t EmptyFSMountCounterReserve(EmptyFSMount *mtmp, uint32_t counter, uint64_t count)
+    // Takes count from the volume counter counter (free blocks or free 
+    // file records), failing with ENOSPC if there isn't that much left.
+    //
+    // We subtract first and check afterwards, so two threads that race 
+    // for the last few blocks can both fail when one of them could have 
+    // succeeded.  That's only possible on a nearly full volume, and it's 
+    // no worse than the usual race between statfs and write.
+{
+    errno_t     err;
+    int64_t     sums[kVolumeCounterCount];
+
+    assert(mtmp != NULL);
+    assert( (counter == kVolumeCounterFreeBlocks) || (counter == kVolumeCounterFreeFiles) );
+    assert( (int64_t) count >= 0 );
+
+    err = 0;
+    if (count != 0) {
+        EmptyFSMountCounterAdjust(mtmp, counter, - (int64_t) count);
+        EmptyFSMountSumCounters(mtmp, sums);
+        if (sums[counter] < 0) {
+            EmptyFSMountCounterAdjust(mtmp, counter, (int64_t) count);
+            err = ENOSPC;
+        }
+    }
+    return err;
+}
+
+#if EMPTYFS_USER_KPI
+
+    // This lets "EmptyFSBench.c" measure statfs while other threads change 
+    // the counters, and check that they add up, without having to write 
+    // any files.  It's only used on read-only mounts, where nothing else 
+    // changes them.
+
+    extern void EmptyFSUserKPICounterAdd(mount_t mp, uint32_t counter, int32_t delta);
+
+    extern void EmptyFSUserKPICounterAdd(mount_t mp, uint32_t counter, int32_t delta)
+    {
+        EmptyFSMountCounterAdd(EmptyFSMountFromMount(mp), counter, delta);
+    }
+
+#endif
+
+static void EmptyFSMountInitGetAttrListGoop(EmptyFSMount *mtmp)
+    // Initialises the f_capabilities and f_attributes fields of the 
+    // fAttr field of the EmptyFSMount with the appropriate static values. 
+    // This is in a separate routine because it's so big; I didn't want 
+    // to confuse EmptyFSInitAttr with all of this stuff.
+{
+    mtmp->fAttr.f_capabilities.capabilities[VOL_CAPABILITIES_FORMAT]     = 0
+        | VOL_CAP_FMT_PERSISTENTOBJECTIDS
+//      | VOL_CAP_FMT_SYMBOLICLINKS
+//      | VOL_CAP_FMT_HARDLINKS
+//      | VOL_CAP_FMT_JOURNAL           // set below, if the volume has a journal
+//      | VOL_CAP_FMT_JOURNAL_ACTIVE    // set below, if we're using it
+//      | VOL_CAP_FMT_NO_ROOT_TIMES
+//      | VOL_CAP_FMT_SPARSE_FILES
+//      | VOL_CAP_FMT_ZERO_RUNS
+        | VOL_CAP_FMT_CASE_SENSITIVE
+        | VOL_CAP_FMT_CASE_PRESERVING
+        | VOL_CAP_FMT_FAST_STATFS
+        | VOL_CAP_FMT_2TB_FILESIZE
+        ;
+    if (mtmp->fSuperblock.fROCompatFeatures & kEmptyFSROCompatJournal) {
+        mtmp->fAttr.f_capabilities.capabilities[VOL_CAPABILITIES_FORMAT] |= VOL_CAP_FMT_JOURNAL;
+        if (mtmp->fJournal != NULL) {
+            mtmp->fAttr.f_capabilities.capabilities[VOL_CAPABILITIES_FORMAT] |= VOL_CAP_FMT_JOURNAL_ACTIVE;
+        }
+    }
+    mtmp->fAttr.f_capabilities.valid[VOL_CAPABILITIES_FORMAT]            = 0
+        | VOL_CAP_FMT_PERSISTENTOBJECTIDS
+        | VOL_CAP_FMT_SYMBOLICLINKS
+        | VOL_CAP_FMT_HARDLINKS
+        | VOL_CAP_FMT_JOURNAL
+        | VOL_CAP_FMT_JOURNAL_ACTIVE
+        | VOL_CAP_FMT_NO_ROOT_TIMES
+        | VOL_CAP_FMT_SPARSE_FILES
+        | VOL_CAP_FMT_ZERO_RUNS
+        | VOL_CAP_FMT_CASE_SENSITIVE
+        | VOL_CAP_FMT_CASE_PRESERVING
+        | VOL_CAP_FMT_FAST_STATFS
+        | VOL_CAP_FMT_2TB_FILESIZE
+        ;
+    mtmp->fAttr.f_capabilities.capabilities[VOL_CAPABILITIES_INTERFACES] = 0
+//      | VOL_CAP_INT_SEARCHFS
+        | VOL_CAP_INT_ATTRLIST
+        | VOL_CAP_INT_NFSEXPORT
+        | VOL_CAP_INT_READDIRATTR
+//      | VOL_CAP_INT_EXCHANGEDATA
+//      | VOL_CAP_INT_COPYFILE
+        | VOL_CAP_INT_ALLOCATE
 //      | VOL_CAP_INT_VOL_RENAME
 //      | VOL_CAP_INT_ADVLOCK
 //      | VOL_CAP_INT_FLOCK
@@ -463,9 +1490,9 @@ static void EmptyFSMountInitGetAttrListGoop(EmptyFSMount *mtmp)
         | ATTR_CMN_PAROBJID
 //      | ATTR_CMN_SCRIPT
         | ATTR_CMN_CRTIME
-//      | ATTR_CMN_MODTIME
-//      | ATTR_CMN_CHGTIME
-//      | ATTR_CMN_ACCTIME
+        | ATTR_CMN_MODTIME
+        | ATTR_CMN_CHGTIME
+        | ATTR_CMN_ACCTIME
 //      | ATTR_CMN_BKUPTIME
 //      | ATTR_CMN_FNDRINFO
         | ATTR_CMN_OWNERID
@@ -499,14 +1526,14 @@ static void EmptyFSMountInitGetAttrListGoop(EmptyFSMount *mtmp)
         | ATTR_VOL_ATTRIBUTES
         ;
     mtmp->fAttr.f_attributes.validattr.dirattr     = 0
-//      | ATTR_DIR_LINKCOUNT
+        | ATTR_DIR_LINKCOUNT
 //      | ATTR_DIR_ENTRYCOUNT
 //      | ATTR_DIR_MOUNTSTATUS
         ;
     mtmp->fAttr.f_attributes.validattr.fileattr    = 0
-//      | ATTR_FILE_LINKCOUNT
+        | ATTR_FILE_LINKCOUNT
         | ATTR_FILE_TOTALSIZE
-//      | ATTR_FILE_ALLOCSIZE
+        | ATTR_FILE_ALLOCSIZE
         | ATTR_FILE_IOBLOCKSIZE
 //      | ATTR_FILE_DEVTYPE
 //      | ATTR_FILE_FORKCOUNT
@@ -527,29 +1554,60 @@ static void EmptyFSMountInitGetAttrListGoop(EmptyFSMount *mtmp)
     mtmp->fAttr.f_attributes.nativeattr.forkattr   = mtmp->fAttr.f_attributes.validattr.forkattr;
 }
 
+static int64_t NanosecondsFromTimespec(const struct timespec *ts)
+    // Converts a timespec to an on-disk time (nanoseconds since 1 Jan 1970).
+{
+    return ((int64_t) ts->tv_sec * 1000000000LL) + ts->tv_nsec;
+}
+
+static void TimespecFromNanoseconds(int64_t nanoseconds, struct timespec *ts)
+    // Converts an on-disk time (nanoseconds since 1 Jan 1970) to a timespec.
+{
+    ts->tv_sec  = (time_t) (nanoseconds / 1000000000LL);
+    ts->tv_nsec = (long)   (nanoseconds % 1000000000LL);
+    if (ts->tv_nsec < 0) {
+        ts->tv_sec  -= 1;
+        ts->tv_nsec += 1000000000L;
+    }
+}
+
+// f_iosize is the I/O size that we recommend to our clients.  Programs like 
+// cp and the stdio library use it to size their buffers, so a small value 
+// (like our block size) means lots of small reads, each of which has to go 
+// through VFS, even though the cluster layer would happily issue much bigger 
+// I/Os.  kEmptyFSPreferredIOSize matches the largest I/O that the cluster 
+// layer issues in one go.
+
+enum {
+    kEmptyFSPreferredIOSize = 1024 * 1024
+};
+
 static void EmptyFSInitAttr(EmptyFSMount *mtmp)
-    // Initialises the fAttr field of the EmptyFSMount with the appropriate 
-    // static values.  This is done at initialisation time, so we don't have 
-    // to worry about concurrency.
-{
-    mtmp->fAttr.f_objcount    = 1;
-    mtmp->fAttr.f_filecount   = 0;
-    mtmp->fAttr.f_dircount    = 1;
-    mtmp->fAttr.f_maxobjcount = 1;
-    mtmp->fAttr.f_bsize       = 4096;
-    mtmp->fAttr.f_iosize      = 4096;
-    mtmp->fAttr.f_blocks      = 1;
-    mtmp->fAttr.f_bfree       = 0;
-    mtmp->fAttr.f_bavail      = 0;
-    mtmp->fAttr.f_bused       = 1;
-    mtmp->fAttr.f_files       = 1;
-    mtmp->fAttr.f_ffree       = 0;
+    // Initialises the fAttr field of the EmptyFSMount from the superblock. 
+    // This is done at initialisation time, so we don't have to worry about 
+    // concurrency.  These values never change; the ones that do (free blocks, 
+    // free files, and the object counts that depend on them) come from the 
+    // volume counters instead.
+    //
+    // The file table has a fixed number of records, so it's the file table 
+    // that determines f_files, not the free space.  The two reserved records 
+    // (file numbers 0 and 1) aren't counted.
+{
+    const EmptyFSSuperblock *   sb;
+
+    sb = &mtmp->fSuperblock;
+
+    mtmp->fAttr.f_files       = sb->fFileCount - kEmptyFSFirstFileNum;
+    mtmp->fAttr.f_maxobjcount = mtmp->fAttr.f_files;
+    mtmp->fAttr.f_bsize       = mtmp->fBlockSize;
+    mtmp->fAttr.f_iosize      = (mtmp->fBlockSize > kEmptyFSPreferredIOSize) ? mtmp->fBlockSize : kEmptyFSPreferredIOSize;
+    mtmp->fAttr.f_blocks      = sb->fBlockCount;
     mtmp->fAttr.f_fsid.val[0] = mtmp->fBlockRDevNum;
     mtmp->fAttr.f_fsid.val[1] = vfs_typenum(mtmp->fMountPoint);
 //  mtmp->fAttr.f_owner = xxx;
     EmptyFSMountInitGetAttrListGoop(mtmp);      // f_capabilities and f_attributes
-    nanotime(&mtmp->fAttr.f_create_time);
-//  mtmp->fAttr.f_modify_time = xxx;
+    TimespecFromNanoseconds(sb->fCreateTime, &mtmp->fAttr.f_create_time);
+    TimespecFromNanoseconds(sb->fModifyTime, &mtmp->fAttr.f_modify_time);
 //  mtmp->fAttr.f_access_time = xxx;
 //  mtmp->fAttr.f_backup_time = xxx;
     mtmp->fAttr.f_fssubtype = 0;
@@ -558,752 +1616,11654 @@ static void EmptyFSInitAttr(EmptyFSMount *mtmp)
 //  mtmp->fAttr.f_carbon_fsid = xxx;
 }
 
-static errno_t EmptyFSMountGetRootVNodeCreatingIfNecessary(EmptyFSMount *mtmp, vnode_t *vnPtr)
-    // Returns the root vnode for the volume, creating it if necessary.  The resulting 
-    // vnode has a I/O reference count, which the caller is responsible for releasing 
-    // (using vnode_put) or passing along to its caller.
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Volume Access
+
+// All of our I/O goes through the buffer cache, using buf_meta_bread on the 
+// device vnode.  buf_meta_bread wants a block number in units of the device's 
+// block size, not ours, so we keep both sizes in the EmptyFSMount.  Our block 
+// size is always a multiple of the device's, which EmptyFSMountReadSuperblock 
+// checks.
+
+static errno_t EmptyFSMountReadSuperblock(EmptyFSMount *mtmp, vfs_context_t context)
+    // Reads the superblock from the volume, checks that it's something we 
+    // can mount, and uses it to set up the fSuperblock, fBlockSize, 
+    // fDevBlockSize, fDevBlocksPerBlock and fVolumeName fields of mtmp.
 {
-    errno_t         err;
-    errno_t         junk;
-    vnode_t         resultVN;
-    uint32_t        vid;
-    
-    // Pre-conditions
-    
+    errno_t     err;
+    vnode_t     devvp;
+    uint32_t    devBlockSize;
+    uint64_t    devBlockCount;
+    buf_t       bp;
+
     assert(mtmp != NULL);
-    assert( vnPtr != NULL);
-    assert(*vnPtr == NULL);
-    
-    // resultVN holds vnode we're going to return in *vnPtr.  If this ever goes non-NULL, 
-    // we're done.
-    
-    resultVN = NULL;
+    assert(mtmp->fBlockDevVNode != NULL);
+    assert(context != NULL);
+
+    devvp = mtmp->fBlockDevVNode;
+
+    // Find out about the device.
     
-    // First lock the revelant fields of the mount point.
+    err = VNOP_IOCTL(devvp, DKIOCGETBLOCKSIZE, (caddr_t) &devBlockSize, 0, context);
+    if (err == 0) {
+        err = VNOP_IOCTL(devvp, DKIOCGETBLOCKCOUNT, (caddr_t) &devBlockCount, 0, context);
+    }
+    if ( (err == 0) && ( (devBlockSize < kEmptyFSSuperblockSize) || (devBlockSize > kEmptyFSMaxBlockSize) ) ) {
+        err = EINVAL;
+    }
+
+    // Read the superblock.  It lives in the first device block.  We invalidate 
+    // the buffer when we're done with it because we read it with the device's 
+    // block size, and we don't want it lingering in the cache, overlapping the 
+    // (larger) buffers that we'll read later on.
+    // 
+    // Note that buf_meta_bread returns a buffer even if it fails, and we have 
+    // to release it.
     
-    lck_mtx_lock(mtmp->fRootMutex);
+    if (err == 0) {
+        bp = NULL;
+        err = buf_meta_bread(devvp, kEmptyFSSuperblockOffset, (int) devBlockSize, NOCRED, &bp);
+        if (err == 0) {
+            memcpy(&mtmp->fSuperblock, (const void *) buf_dataptr(bp), sizeof(mtmp->fSuperblock));
+        }
+        if (bp != NULL) {
+            buf_markinvalid(bp);
+            buf_brelse(bp);
+        }
+    }
 
-    do {
-        // Loop invariants (-:
-        
-        assert(resultVN == NULL);       // no point looping if we already have a result
+    // Check it.  EmptyFSSuperblockVerify checks its checksum, if it has one, 
+    // which has to be done before we swap it.  EmptyFSSuperblockValidate 
+    // checks the superblock for internal consistency; we also have to check 
+    // that it's consistent with the device.  We don't check fState or the 
+    // read-only compatible features here; they only matter for a read/write 
+    // mount, and VFSOPMount decides whether it's going to be one.
+    
+    if (err == 0) {
+        err = EmptyFSSuperblockVerify(&mtmp->fSuperblock);
+        if (err != 0) {
+            printf("EmptyFS:EmptyFSMountReadSuperblock: bad superblock checksum\n");
+        }
+    }
+    if (err == 0) {
+        EmptyFSSwapSuperblock(&mtmp->fSuperblock);
+        err = EmptyFSSuperblockValidate(&mtmp->fSuperblock);
+        if (err == ENOTSUP) {
+            printf("EmptyFS:EmptyFSMountReadSuperblock: unsupported volume version %u.%u or features %#x\n", 
+                (unsigned int) mtmp->fSuperblock.fMajorVersion, 
+                (unsigned int) mtmp->fSuperblock.fMinorVersion, 
+                (unsigned int) mtmp->fSuperblock.fIncompatFeatures
+            );
+        }
+    }
+    if (err == 0) {
+        if (    ( (mtmp->fSuperblock.fBlockSize % devBlockSize) != 0 )
+             || ( mtmp->fSuperblock.fBlockCount > ((devBlockCount * devBlockSize) / mtmp->fSuperblock.fBlockSize) ) ) {
+            err = EINVAL;
+        }
+    }
+    if (err == 0) {
+        mtmp->fBlockSize         = mtmp->fSuperblock.fBlockSize;
+        mtmp->fDevBlockSize      = devBlockSize;
+        mtmp->fDevBlocksPerBlock = mtmp->fBlockSize / devBlockSize;
+        mtmp->fFileTableInitCount = EmptyFSFileTableInitCount(&mtmp->fSuperblock);
         
-        // lck_mtx_assert is only available in the "com.apple.kpi.unsupported" KPI, so 
-        // we only use it in debug builds.  Our "Info.plist" file is preprocessed to 
-        // require the "com.apple.kpi.unsupported" KPI in this case.
-        #if MACH_ASSSERT
-            lck_mtx_assert(mtmp->fRootMutex, LCK_MTX_ASSERT_OWNED);
-        #endif
-
-        if (mtmp->fRootAttaching) {
-            // If someone else is already trying to create the root vnode, wait for 
-            // them to get done.  Note that msleep will unlock and relock mtmp->fRootMutex, 
-            // so once it returns we have to loop and start again from scratch.
+        assert(sizeof(mtmp->fVolumeName) == sizeof(mtmp->fSuperblock.fVolumeName));
+        memcpy(mtmp->fVolumeName, mtmp->fSuperblock.fVolumeName, sizeof(mtmp->fVolumeName));
+    }
     
-            mtmp->fRootWaiting = TRUE;
-            
-            (void) msleep(&mtmp->fRootVNode, mtmp->fRootMutex, PINOD, "EmptyFSMountGetRootVNodeCreatingIfNecessary", NULL);
-            
-            err = EAGAIN;
-        } else if (mtmp->fRootVNode == NULL) {
-            vnode_t                 newVN;
-            struct vnode_fsparam    params;
+    return err;
+}
 
-            // There is no root vnode, so create it.  While we're creating it, we 
-            // drop our lock (to avoid the possibility of deadlock), so we set 
-            // fRootAttaching to stall anyone else entering the code (and eliminate 
-            // the possibility of two people trying to create the same vnode).
-            
-            mtmp->fRootAttaching = TRUE;
-            
-            lck_mtx_unlock(mtmp->fRootMutex);
+static errno_t EmptyFSMountReadMetaBlock(EmptyFSMount *mtmp, uint64_t blockNum, buf_t *bpPtr)
+    // Reads block blockNum of the volume (in units of our block size) into 
+    // the buffer cache.  On success, *bpPtr is the buffer, which the caller 
+    // must release using buf_brelse.  On failure, *bpPtr is NULL.
+    //
+    // If the block came from the disk, rather than the cache, we check its 
+    // checksums (see "Metadata Checksums" in "EmptyFSFormat.h").  A block 
+    // that's in the cache was either checked when it was read or sealed by 
+    // EmptyFSMountModifyMetaBlockEnd when it was changed, so checking it 
+    // again would just waste time on the hottest path in the file system.  
+    // If the check fails, we invalidate the buffer, so that the next read 
+    // goes back to the disk rather than finding the bad data in the cache.
+{
+    errno_t     err;
+    buf_t       bp;
 
-            newVN = NULL;
+    assert(mtmp != NULL);
+    assert(bpPtr != NULL);
 
-            params.vnfs_mp         = mtmp->fMountPoint;
-            params.vnfs_vtype      = VDIR;
-            params.vnfs_str        = NULL;
-            params.vnfs_dvp        = NULL;
-            params.vnfs_fsnode     = NULL;
-            params.vnfs_vops       = gVNodeOperations;
-            params.vnfs_markroot   = TRUE;
-            params.vnfs_marksystem = FALSE;
-            params.vnfs_rdev       = 0;                                 // we don't currently support VBLK or VCHR
-            params.vnfs_filesize   = 0;                                 // not relevant for a directory
-            params.vnfs_cnp        = NULL;
-            params.vnfs_flags      = VNFS_NOCACHE | VNFS_CANTCACHE;     // do no vnode name caching
-            
-            err = vnode_create(VNCREATE_FLAVOR, sizeof(params), &params, &newVN);
-            
-            assert( (err == 0) == (newVN != NULL) );
-            
-            lck_mtx_lock(mtmp->fRootMutex);
-            
-            if (err == 0) {
-                // If we successfully create the vnode, it's time to install it as 
-                // the root.  No one else should have been able to get here, so 
-                // mtmp->fRootVNode should still be NULL.  If it's not, that's bad. 
-            
-                assert(mtmp->fRootVNode == NULL);
-                mtmp->fRootVNode = newVN;
-                
-                // Also let the VFS layer know that we have a soft reference to 
-                // the vnode.
-                
-                junk = vnode_addfsref(newVN);
-                assert(junk == 0);
-                
-                // If anyone got hung up on mtmp->fRootAttaching, unblock them.
-                
-                assert(mtmp->fRootAttaching);
-                mtmp->fRootAttaching = FALSE;
-                if (mtmp->fRootWaiting) {
-                    wakeup(&mtmp->fRootVNode);
-                    mtmp->fRootWaiting = FALSE;
-                }
-                
-                // Set up the function result.  Note that vnode_create creates the 
-                // vnode with an I/O reference count, so we can just return it 
-                // directly.
-                
-                resultVN = mtmp->fRootVNode;
-                err = 0;
+    bp = NULL;
+    if (blockNum >= mtmp->fSuperblock.fBlockCount) {
+        err = EIO;
+    } else {
+        err = buf_meta_bread(
+            mtmp->fBlockDevVNode, 
+            (daddr64_t) (blockNum * mtmp->fDevBlocksPerBlock), 
+            (int) mtmp->fBlockSize, 
+            NOCRED, 
+            &bp
+        );
+        if ( (err == 0) && ! buf_fromcache(bp) && (mtmp->fSuperblock.fROCompatFeatures & kEmptyFSROCompatMetadataChecksums) ) {
+            StatsCount(kEmptyFSCounterMetaChecksumVerify, 1);
+            err = EmptyFSMetaBlockVerify(&mtmp->fSuperblock, blockNum, (const void *) buf_dataptr(bp));
+            if (err != 0) {
+                StatsCount(kEmptyFSCounterMetaChecksumError, 1);
+                printf("EmptyFS:EmptyFSMountReadMetaBlock: bad checksum in block %llu\n", (unsigned long long) blockNum);
+                buf_markinvalid(bp);
             }
-        } else {
-            vnode_t     candidateVN;
-            
-            // We already have a root vnode.  Drop our lock (again, to avoid deadlocks) 
-            // and get a reference on it, using the vnode ID (vid) to confirm that it's 
-            // still valid.  If that works, we're all set.  Otherwise, let's just start 
-            // again from scratch.
+        }
+        if ( (err != 0) && (bp != NULL) ) {
+            buf_brelse(bp);
+            bp = NULL;
+        }
+    }
+    *bpPtr = bp;
 
-            candidateVN = mtmp->fRootVNode;
-            
-            vid = vnode_vid(candidateVN);
-            
-            lck_mtx_unlock(mtmp->fRootMutex);
-                
-            err = vnode_getwithvid(candidateVN, vid);
+    assert( (err == 0) == (*bpPtr != NULL) );
 
-            if (err == 0) {
-                // All ok.   vnode_getwithvid has taken an I/O reference count on the 
-                // vnode, so we can just return it to the caller.  This reference 
-                // prevents the vnode from being reclaimed in the interim.
-                
-                resultVN = candidateVN;
-                assert(err == 0);
-            } else {
-                // vnode_getwithvid failed.  This is most likely because the vnode 
-                // has been reclaimed between dropping the lock and calling vnode_getwithvid. 
-                // That's cool.  We just loop again, and this time we'll get the updated 
-                // results (hopefully).
-                
-                err = EAGAIN;
-            }
-            
-            // We need to reacquire the lock because that's the loop invariant.  
-            // Strictly speaking we don't need to do this in the 'success' case, 
-            // but it makes the code simpler (and I don't care about the trivial 
-            // performance cost in this sample).
-            
-            lck_mtx_lock(mtmp->fRootMutex);
-        }
-        
-        // resultVN should only be set if everything is OK.
-        
-        assert( (err == 0) == (resultVN != NULL) );
-    } while (err == EAGAIN);
+    return err;
+}
 
-    lck_mtx_unlock(mtmp->fRootMutex);
+// A FileTableCursor lets a caller read a sequence of file records without 
+// going back to the buffer cache for each one.  It holds on to the last 
+// file table block that it read, and reuses it if the next record is in 
+// the same block.  This matters to VNOPReaddirattr, which reads the record 
+// of every entry in a directory, and the records of a directory's entries 
+// are usually allocated together.  Initialise the cursor to all zeros, and 
+// call FileTableCursorDone when you're finished with it.
+
+struct FileTableCursor {
+    buf_t       fBuffer;                // the file table block, or NULL
+    uint64_t    fBlockNum;              // block number of fBuffer; meaningless if it's NULL
+};
+typedef struct FileTableCursor FileTableCursor;
 
-    if (err == 0) {
-        *vnPtr = resultVN;
-    }
-    
-    // Post-conditions
-    
-    assert( (err == 0) == (*vnPtr != NULL) );
+static void FileTableCursorDone(FileTableCursor *cursor)
+    // Releases the buffer, if any, held by cursor.
+{
+    assert(cursor != NULL);
 
-    return err;
+    if (cursor->fBuffer != NULL) {
+        buf_brelse(cursor->fBuffer);
+        cursor->fBuffer = NULL;
+    }
 }
 
-static void EmptyFSMountDetachRootVNode(EmptyFSMount *mtmp, vnode_t vn)
-    // Called by higher-level code within our VFS plug-in to reclaim a vnode, 
-    // that is, for us to 'forget' about it.  We only 'know' about one vnode, 
-    // the root vnode, so this code is much easier than it would be in a 
-    // real file system.
+static errno_t EmptyFSMountReadFileRecord(EmptyFSMount *mtmp, FileTableCursor *cursor, uint64_t fileNum, EmptyFSFileRecord *recPtr)
+    // Reads the file record for fileNum into *recPtr, converting it to host 
+    // byte order and checking it.  Returns ENOENT if the file number is out 
+    // of range or the record is free, and EIO if it's corrupt.  cursor 
+    // is updated to hold the file table block containing the record. 
+    // A record in the uninitialised part of the file table is free, and 
+    // reads as all zeros without any I/O; cursor is left alone.
 {
-    int     junk;
-    
+    errno_t                     err;
+    const EmptyFSSuperblock *   sb;
+    uint64_t                    blockNum;
+    uint32_t                    offset;
+
     assert(mtmp != NULL);
-    assert(vn != NULL);
+    assert(cursor != NULL);
+    assert(recPtr != NULL);
+
+    sb = &mtmp->fSuperblock;
+
+    err = 0;
+    if ( (fileNum < kEmptyFSFirstFileNum) || (fileNum >= sb->fFileCount) ) {
+        err = ENOENT;
+    } else if (fileNum >= mtmp->fFileTableInitCount) {
+        memset(recPtr, 0, sizeof(*recPtr));
+        err = ENOENT;
+    }
+    if (err == 0) {
+        EmptyFSFileRecordLocation(sb, (uint32_t) fileNum, &blockNum, &offset);
+        if ( (cursor->fBuffer == NULL) || (cursor->fBlockNum != blockNum) ) {
+            FileTableCursorDone(cursor);
+            err = EmptyFSMountReadMetaBlock(mtmp, blockNum, &cursor->fBuffer);
+            cursor->fBlockNum = blockNum;
+        }
+    }
+    if (err == 0) {
+        memcpy(recPtr, ((const char *) buf_dataptr(cursor->fBuffer)) + offset, sizeof(*recPtr));
+        
+        EmptyFSSwapFileRecord(recPtr);
+        if (recPtr->fMode == 0) {
+            err = ENOENT;
+        } else {
+            err = EmptyFSFileRecordValidate(sb, recPtr);
+        }
+    }
+    return err;
+}
+
+static errno_t EmptyFSMountModifyMetaBlockStart(EmptyFSMount *mtmp, uint64_t blockNum, buf_t *bpPtr);
+static void EmptyFSMountModifyMetaBlockEnd(EmptyFSMount *mtmp, buf_t bp);
+    // forward declarations
+
+static errno_t EmptyFSMountWriteFileRecord(EmptyFSMount *mtmp, uint64_t fileNum, const EmptyFSFileRecord *rec)
+    // Writes *rec (in host byte order) to the file record for fileNum.  The 
+    // write is delayed (buf_bdwrite); the buffer cache writes the block when 
+    // it's evicted or at the next sync, or, on a journalled volume, once the 
+    // transaction has been committed.  The caller must hold a transaction 
+    // handle (see "Journal Notes"), and must not be holding the file table 
+    // block in a FileTableCursor, because that buffer is busy.
+{
+    errno_t                     err;
+    const EmptyFSSuperblock *   sb;
+    uint64_t                    blockNum;
+    uint32_t                    offset;
+    buf_t                       bp;
+    EmptyFSFileRecord *         diskRec;
+
+    assert(mtmp != NULL);
+    assert(mtmp->fWritable);
+    assert(rec != NULL);
+
+    sb = &mtmp->fSuperblock;
+    assert( (fileNum >= kEmptyFSFirstFileNum) && (fileNum < mtmp->fFileTableInitCount) );
+
+    EmptyFSFileRecordLocation(sb, (uint32_t) fileNum, &blockNum, &offset);
+    err = EmptyFSMountReadMetaBlock(mtmp, blockNum, &bp);
+    if (err == 0) {
+        err = EmptyFSMountModifyMetaBlockStart(mtmp, blockNum, &bp);
+    }
+    if (err == 0) {
+        diskRec = (EmptyFSFileRecord *) (((char *) buf_dataptr(bp)) + offset);
+        *diskRec = *rec;
+        EmptyFSSwapFileRecord(diskRec);
+        EmptyFSMountModifyMetaBlockEnd(mtmp, bp);
+    }
+    return err;
+}
+
+static buf_t EmptyFSMountGetMetaBlock(EmptyFSMount *mtmp, uint64_t blockNum)
+    // Gets a buffer for block blockNum of the volume without reading it, for 
+    // a block whose entire contents the caller is about to write (a new 
+    // overflow extent block, directory block or directory index node, a 
+    // block being replayed from the journal, or the journal header).  The caller fills it in and 
+    // releases it with buf_bdwrite or buf_bwrite.
+{
+    buf_t   bp;
+
+    assert(mtmp != NULL);
+    assert(blockNum >= mtmp->fSuperblock.fBitmapStart);
+    assert(blockNum <  mtmp->fSuperblock.fBlockCount);
+
+    bp = buf_getblk(
+        mtmp->fBlockDevVNode, 
+        (daddr64_t) (blockNum * mtmp->fDevBlocksPerBlock), 
+        (int) mtmp->fBlockSize, 
+        0, 
+        0, 
+        BLK_META
+    );
+    assert(bp != NULL);
+    return bp;
+}
+
+static errno_t EmptyFSMountWriteSuperblock(EmptyFSMount *mtmp, boolean_t clean)
+    // Writes the superblock, synchronously, with the free counts from the 
+    // volume counters, the head of the orphan list, and the size of the 
+    // initialised part of the file table.  If clean is false, the volume is marked as in use, 
+    // so that a crash leaves it marked as needing a check.  If clean is true, 
+    // it's marked as cleanly unmounted, which is only right once everything 
+    // else has been written.
+    //
+    // The superblock shares the first device block with nothing else, but 
+    // it's only the first kEmptyFSSuperblockSize bytes of it, so we read the 
+    // device block, update the superblock, and write the block back.  As in 
+    // EmptyFSMountReadSuperblock, we invalidate the buffer afterwards.
+{
+    errno_t             err;
+    uint64_t            counters[kVolumeCounterCount];
+    struct timespec     now;
+    EmptyFSSuperblock   sb;
+    buf_t               bp;
+
+    assert(mtmp != NULL);
+    assert(mtmp->fWritable);
+
+    EmptyFSMountGetCounters(mtmp, counters);
+    nanotime(&now);
+
+    sb = mtmp->fSuperblock;
+    sb.fFreeBlockCount = counters[kVolumeCounterFreeBlocks];
+    sb.fFreeFileCount  = (uint32_t) counters[kVolumeCounterFreeFiles];
+    sb.fDirectoryCount = (uint32_t) counters[kVolumeCounterDirectories];
+    sb.fOrphanFileNum  = mtmp->fOrphanFileNum;
+    sb.fModifyTime     = NanosecondsFromTimespec(&now);
+    if (sb.fROCompatFeatures & kEmptyFSROCompatLazyFileTable) {
+        if (mtmp->fFileTableInitCount == sb.fFileCount) {
+            sb.fROCompatFeatures   &= ~kEmptyFSROCompatLazyFileTable;
+            sb.fFileTableInitBlocks = 0;
+        } else {
+            sb.fFileTableInitBlocks = mtmp->fFileTableInitCount / EmptyFSFileRecordsPerBlock(&sb);
+        }
+    }
+    if (clean) {
+        sb.fState |=  kEmptyFSStateClean;
+    } else {
+        sb.fState &= ~kEmptyFSStateClean;
+    }
+    EmptyFSSwapSuperblock(&sb);
+    EmptyFSSuperblockSeal(&sb);
+    
+    bp = NULL;
+    err = buf_meta_bread(mtmp->fBlockDevVNode, kEmptyFSSuperblockOffset, (int) mtmp->fDevBlockSize, NOCRED, &bp);
+    if (err == 0) {
+        memcpy( (void *) buf_dataptr(bp), &sb, sizeof(sb));
+        buf_markinvalid(bp);
+        err = buf_bwrite(bp);
+    } else if (bp != NULL) {
+        buf_brelse(bp);
+    }
+    return err;
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Journal
+
+// Journal Notes
+// -------------
+// A volume with the kEmptyFSROCompatJournal feature has a write-ahead 
+// metadata journal, whose format is described in "EmptyFSFormat.h".  When 
+// such a volume is mounted read/write, every change to a metadata block 
+// (the bitmap, the file table, directory blocks, directory index nodes 
+// and overflow extent blocks) goes to the journal before it goes home.  A 
+// crash leaves the volume in the state of the last transaction that made 
+// it to the journal, so VFSOPMount only has to replay the journal, which 
+// takes time proportional to the size of the journal rather than the size 
+// of the volume.  The journal brings the orphan list up to date too, and 
+// VFSOPMount then frees the files on it (see "Orphan Notes"), which takes 
+// time in proportion to the number of them, so that doesn't change.
+//
+// An operation that modifies metadata does so within a transaction handle 
+// (EmptyFSMountTransactionBegin and EmptyFSMountTransactionEnd), and 
+// brackets each change to a block with EmptyFSMountModifyMetaBlockStart and 
+// EmptyFSMountModifyMetaBlockEnd.  Every handle belongs to the running 
+// transaction, of which there's only ever one, and which collects the 
+// changes of every operation on the volume until it's committed.  So a 
+// commit writes the changes of many operations with one device flush 
+// (group commit), and a block that's changed many times is logged once.
+//
+// EmptyFSMountModifyMetaBlockEnd sets B_LOCKED on the buffer, which stops 
+// the buffer cache from writing it home before it's in the journal. 
+// Committing (EmptyFSMountJournalCommit) goes like this:
+//
+//   1. Raise the barrier, which stops new handles from starting, and wait 
+//      for the existing ones to end, so that the transaction only holds 
+//      complete operations.
+//   2. Take the transaction's blocks, and the volume's counts, and start a 
+//      new running transaction.  Lower the barrier.
+//   3. Copy the blocks to the journal, as one or more records, and flush 
+//      the device's cache.
+//   4. Clear B_LOCKED on the blocks, and release them with buf_bdwrite, so 
+//      that the buffer cache writes them home whenever it likes.
+//
+// A block that has been committed, but might not have been written home 
+// yet, is owned by the transaction that last committed it.  Checkpointing 
+// (EmptyFSMountJournalCheckpoint) writes the owned blocks home, flushes the 
+// device's cache, and then moves the start of the journal, in its header, 
+// past the last committed transaction, which frees the space that the 
+// journal was using.  The flusher thread commits every time it runs, and 
+// checkpoints when the journal is half full or the volume goes quiet.  A 
+// commit that doesn't fit in the journal checkpoints first.
+//
+// A block can be changed by the running transaction while its committed 
+// contents are still waiting to be written home.  Linux's jbd keeps a 
+// frozen copy of the committed contents in that case.  We're simpler: 
+// EmptyFSMountModifyMetaBlockStart writes the committed contents home, 
+// synchronously, before it lets the caller change the buffer.  That costs 
+// at most one write per block per commit, and means that a block is never 
+// both owned and in the running transaction.  Likewise, it waits for a 
+// block that's being committed.
+//
+// Blocks that are freed can't be reused until the free is in the journal, 
+// otherwise a crash could leave them in two files.  So EmptyFSMountFreeBlocks 
+// clears their bits but keeps them out of the free extent trees, on the 
+// journal's list of pending frees, until the transaction that freed them 
+// is committed or, if they held metadata, checkpointed (otherwise a replay 
+// could write their old contents over their new ones).  Other journalling 
+// file systems write revoke records instead.
+//
+// The last record of each transaction holds the volume's free block, free 
+// file and directory counts, and the head of its orphan list (see "Orphan 
+// Notes"), taken while the barrier is up, so they match the metadata in 
+// the journal, and a replay doesn't have to recount.  In memory, these 
+// travel together as an array indexed by kVolumeCounterXxx and 
+// kJournalCountOrphans.
+//
+// Replaying the journal (EmptyFSMountJournalInit) has three steps. 
+// JournalScan reads the records, checking each one, to find the end of the 
+// last complete transaction, and notes where each record starts. 
+// JournalReplayPlan reads their descriptors again and, for each home block, 
+// notes the last record that writes it.  Then JournalReplay shares the 
+// records out between a few threads, each of which reads a record and 
+// writes home just the blocks that it's the last writer of.  Because each 
+// home block is written by exactly one record, the threads don't have to 
+// coordinate and the order in which they run doesn't matter, and a block 
+// that many transactions changed is only written once.
+//
+// The journal's fLock is a leaf: nothing else is taken while holding it, 
+// although we msleep on it.  fCheckpointLock serialises checkpoints, and 
+// is held while writing buffers.  A handle comes after an FSNode's 
+// fWriteLock, but before every other lock (see "Write Notes").  A thread 
+// must never start a second handle while it holds one, or commit while it 
+// holds one, because the commit would wait for it.  And a thread holds at 
+// most one metadata buffer when it calls EmptyFSMountModifyMetaBlockStart, 
+// which may have to release it and read it again.
+//
+// On a volume that has no journal, or is mounted read-only, fJournal is 
+// NULL and these routines do nothing, except that 
+// EmptyFSMountModifyMetaBlockEnd still calls buf_bdwrite.  Such a volume 
+// relies on the superblock's clean flag; see VFSOPMount.
+
+enum {
+    kJournalCountOrphans = kVolumeCounterCount,     // the head of the orphan list, which isn't a count, but goes with them
+    kJournalCountCount
+};
+
+enum {
+    kJournalHashSize    = 1024,             // buckets in fHash; must be a power of two
+    kJournalMaxIOSize   = 64 * 1024,        // biggest write that we make to the journal
+    kJournalReplayThreads       = 4,        // most threads that a replay uses, including the mounting thread
+    kJournalReplayRecordsPerThread = 8      // don't start a thread for fewer records than this
+};
+
+// JournalBlock fState values.
+
+enum {
+    kJournalBlockIdle       = 0,            // not in a transaction
+    kJournalBlockRunning    = 1,            // changed by the running transaction
+    kJournalBlockCommitting = 2             // being copied to the journal
+};
+
+// A JournalBlock tracks a metadata block that's in the running or the 
+// committing transaction, or is owned by a committed one.  It's in the 
+// journal's hash, and on at most one of its lists.  JournalBlocks are only 
+// freed by a checkpoint, once they're idle and unowned.
+
+struct JournalBlock {
+    struct JournalBlock *   fHashNext;      // next entry in this hash chain
+    struct JournalBlock *   fListNext;      // next entry in the running, or committing, transaction
+    struct JournalBlock *   fOwnedNext;     // next entry on the owned list
+    struct JournalBlock *   fOwnedPrev;     // previous entry on the owned list
+    uint64_t                fBlockNum;      // the metadata block
+    uint64_t                fOwner;         // transaction that owns the block, or 0
+    int                     fState;         // kJournalBlockXxx
+};
+typedef struct JournalBlock JournalBlock;
+
+// A JournalFree is a run of blocks that's been freed, but can't be reused 
+// until the transaction that freed it is committed or, if it held metadata, 
+// checkpointed.  EmptyFSMountFreeBlocks creates them, and 
+// EmptyFSMountReleaseFrees gives the blocks back to their allocation group.
+
+struct JournalFree {
+    struct JournalFree *    fNext;          // next entry on the list
+    uint64_t                fStart;         // first block of the run
+    uint64_t                fCount;         // its length
+    uint64_t                fTxn;           // transaction that freed it
+    boolean_t               fMetadata;      // true if the run held metadata
+};
+typedef struct JournalFree JournalFree;
+
+// Positions in the journal (fHead, fTail, and so on) are journal-relative 
+// block numbers, from 1 to fBlocks - 1, because block 0 is the header.  The 
+// journal is empty when fHead equals fTail, so it holds at most fBlocks - 2 
+// blocks of records.
+
+struct Journal {
+    lck_mtx_t *     fLock;                  // protects the fields marked [1]
+    lck_mtx_t *     fCheckpointLock;        // serialises checkpoints
+    uint64_t        fStart;                 // first block of the journal on the volume
+    uint64_t        fBlocks;                // its length, including the header
+    uint32_t        fCapacity;              // maximum number of data blocks in a record
+    uint32_t        fRunningLimit;          // commit once the running transaction has this many blocks
+
+    uint32_t        fActiveHandles;         // [1] handles on the running transaction
+    boolean_t       fBarrier;               // [1] true while a commit waits for those to end
+    boolean_t       fCommitting;            // [1] true while a commit is in progress
+    uint64_t        fRunningTxn;            // [1] the running transaction
+    uint64_t        fCommittedTxn;          // [1] the last committed transaction
+    uint64_t        fCheckpointedTxn;       // [1] the last checkpointed transaction
+
+    JournalBlock *  fRunning;               // [1] blocks changed by the running transaction
+    uint32_t        fRunningCount;          // [1] length of fRunning
+    JournalBlock *  fOwnedHead;             // [1] owned blocks, in the order in which they were committed
+    JournalBlock *  fOwnedTail;             // [1] last block on that list
+    JournalFree *   fFreeHead;              // [1] pending frees, in the order in which they were freed
+    JournalFree *   fFreeTail;              // [1] last entry on that list
+    JournalBlock *  fSpare;                 // [1] a preallocated JournalBlock, or NULL
+
+    uint64_t        fHead;                  // [2] where the next record goes
+    uint64_t        fSequence;              // [2] sequence number of that record
+    uint64_t        fTail;                  // [1] first record that's still needed (the header's fStart)
+    uint64_t        fCommittedHead;         // [1] fHead as of the last commit
+    uint64_t        fCommittedSequence;     // [1] fSequence as of the last commit
+    uint64_t        fCommittedCounts[kJournalCountCount];  // [1] the volume's counts as of the last commit
+
+    JournalBlock *  fHash[kJournalHashSize];    // [1] every JournalBlock, by fBlockNum
+};
+typedef struct Journal Journal;
+
+// [1] This field is protected by fLock.
+//
+// [2] This field is only used by the thread that's committing (the one that 
+//     set fCommitting), so it doesn't need a lock.
+
+static uint64_t JournalAdvance(const Journal *jnl, uint64_t pos, uint64_t count)
+    // Returns the position count blocks after pos, wrapping from the end of 
+    // the journal back to block 1.
+{
+    assert( (pos >= 1) && (pos < jnl->fBlocks) );
+    assert(count < jnl->fBlocks);
+
+    pos += count;
+    if (pos >= jnl->fBlocks) {
+        pos -= jnl->fBlocks - 1;
+    }
+    return pos;
+}
+
+static uint64_t JournalUsed(const Journal *jnl, uint64_t head, uint64_t tail)
+    // Returns the number of blocks of records between tail and head.
+{
+    return (head >= tail) ? (head - tail) : (head + (jnl->fBlocks - 1) - tail);
+}
+
+static JournalBlock * JournalFindBlock(Journal *jnl, uint64_t blockNum)
+    // Returns the JournalBlock for blockNum, or NULL if there isn't one. 
+    // The caller must hold fLock.
+{
+    JournalBlock *  jb;
+
+    jb = jnl->fHash[blockNum & (kJournalHashSize - 1)];
+    while ( (jb != NULL) && (jb->fBlockNum != blockNum) ) {
+        jb = jb->fHashNext;
+    }
+    return jb;
+}
+
+static void JournalOwnedAppend(Journal *jnl, JournalBlock *jb, uint64_t txn)
+    // Makes txn the owner of jb, and puts it on the end of the owned list. 
+    // The caller must hold fLock.
+{
+    assert(jb->fOwner == 0);
+    assert(txn != 0);
+
+    jb->fOwner     = txn;
+    jb->fOwnedNext = NULL;
+    jb->fOwnedPrev = jnl->fOwnedTail;
+    if (jnl->fOwnedTail == NULL) {
+        jnl->fOwnedHead = jb;
+    } else {
+        jnl->fOwnedTail->fOwnedNext = jb;
+    }
+    jnl->fOwnedTail = jb;
+}
+
+static void JournalOwnedRemove(Journal *jnl, JournalBlock *jb)
+    // Takes jb off the owned list, leaving it unowned.  The caller must 
+    // hold fLock.
+{
+    assert(jb->fOwner != 0);
+
+    if (jb->fOwnedPrev == NULL) {
+        jnl->fOwnedHead = jb->fOwnedNext;
+    } else {
+        jb->fOwnedPrev->fOwnedNext = jb->fOwnedNext;
+    }
+    if (jb->fOwnedNext == NULL) {
+        jnl->fOwnedTail = jb->fOwnedPrev;
+    } else {
+        jb->fOwnedNext->fOwnedPrev = jb->fOwnedPrev;
+    }
+    jb->fOwnedNext = NULL;
+    jb->fOwnedPrev = NULL;
+    jb->fOwner     = 0;
+}
+
+static void JournalTakeFrees(Journal *jnl, uint64_t txn, boolean_t metadata, JournalFree **freesPtr)
+    // Moves the pending frees made by txn or earlier onto the front of 
+    // *freesPtr, skipping the ones that held metadata unless metadata is 
+    // true.  The caller must hold fLock.
+{
+    JournalFree **  linkPtr;
+    JournalFree *   prev;
+    JournalFree *   jf;
+
+    prev = NULL;
+    linkPtr = &jnl->fFreeHead;
+    while ( (jf = *linkPtr) != NULL ) {
+        if ( (jf->fTxn <= txn) && (metadata || ! jf->fMetadata) ) {
+            *linkPtr = jf->fNext;
+            jf->fNext = *freesPtr;
+            *freesPtr = jf;
+        } else {
+            prev = jf;
+            linkPtr = &jf->fNext;
+        }
+    }
+    jnl->fFreeTail = prev;
+}
+
+static daddr64_t JournalDevBlock(EmptyFSMount *mtmp, uint64_t pos)
+    // Returns the device block (in units of fDevBlockSize) of journal 
+    // block pos.
+{
+    return (daddr64_t) ((mtmp->fJournal->fStart + pos) * mtmp->fDevBlocksPerBlock);
+}
+
+static errno_t EmptyFSMountSynchronizeCache(EmptyFSMount *mtmp)
+    // Asks the device to write its cache to permanent storage.  This is what 
+    // makes writes to the journal durable, and orders them with respect to 
+    // the writes that follow.
+{
+    assert(mtmp != NULL);
+
+    return VNOP_IOCTL(mtmp->fBlockDevVNode, DKIOCSYNCHRONIZECACHE, NULL, FWRITE, vfs_context_current());
+}
+
+static errno_t JournalWriteHeader(EmptyFSMount *mtmp, uint64_t start, uint64_t sequence, const uint64_t counts[kJournalCountCount])
+    // Writes the journal header, synchronously.  The caller must make sure 
+    // that every block logged before start is home first, and flush the 
+    // device's cache afterwards.
+{
+    buf_t                   bp;
+    EmptyFSJournalHeader *  header;
+
+    bp = EmptyFSMountGetMetaBlock(mtmp, mtmp->fJournal->fStart);
+    header = (EmptyFSJournalHeader *) buf_dataptr(bp);
+    memset(header, 0, mtmp->fBlockSize);
+    header->fMagic          = kEmptyFSJournalHeaderMagic;
+    header->fStart          = start;
+    header->fSequence       = sequence;
+    header->fFreeBlockCount = counts[kVolumeCounterFreeBlocks];
+    header->fFreeFileCount  = (uint32_t) counts[kVolumeCounterFreeFiles];
+    header->fDirectoryCount = (uint32_t) counts[kVolumeCounterDirectories];
+    header->fOrphanFileNum  = (uint32_t) counts[kJournalCountOrphans];
+    EmptyFSSwapJournalHeader(header);
+    header->fChecksum = EmptyFSSwapLE32( EmptyFSJournalHeaderChecksum(header) );
+    return buf_bwrite(bp);
+}
+
+static errno_t EmptyFSMountJournalCommit(EmptyFSMount *mtmp, uint64_t txn);
+static void EmptyFSMountJournalCounts(EmptyFSMount *mtmp, uint64_t counts[kJournalCountCount]);
+static void EmptyFSMountReleaseFrees(EmptyFSMount *mtmp, JournalFree *frees);
+    // forward declarations
+
+static void EmptyFSMountTransactionBegin(EmptyFSMount *mtmp)
+    // Starts a transaction handle; see "Journal Notes".  If the running 
+    // transaction is already big, this commits it first.  The caller must 
+    // not hold a handle, or any lock other than an FSNode's fWriteLock.
+{
+    Journal *   jnl;
+    boolean_t   done;
+
+    assert(mtmp != NULL);
+
+    jnl = mtmp->fJournal;
+    if (jnl != NULL) {
+        lck_mtx_lock(jnl->fLock);
+        done = FALSE;
+        do {
+            if (jnl->fBarrier) {
+                (void) msleep(&jnl->fBarrier, jnl->fLock, PINOD, "EmptyFS:barrier", NULL);
+            } else if (jnl->fRunningCount >= jnl->fRunningLimit) {
+                lck_mtx_unlock(jnl->fLock);
+                (void) EmptyFSMountJournalCommit(mtmp, 0);
+                lck_mtx_lock(jnl->fLock);
+            } else {
+                jnl->fActiveHandles += 1;
+                done = TRUE;
+            }
+        } while ( ! done );
+        lck_mtx_unlock(jnl->fLock);
+    }
+}
+
+static uint64_t EmptyFSMountTransactionEnd(EmptyFSMount *mtmp)
+    // Ends a transaction handle, and returns the transaction that it was 
+    // part of, which the caller can pass to EmptyFSMountJournalCommit to 
+    // make its changes durable.  Returns 0 if the volume has no journal.
+{
+    Journal *   jnl;
+    uint64_t    txn;
+    boolean_t   wake;
+
+    assert(mtmp != NULL);
+
+    jnl = mtmp->fJournal;
+    txn = 0;
+    if (jnl != NULL) {
+        lck_mtx_lock(jnl->fLock);
+        assert(jnl->fActiveHandles != 0);
+        txn = jnl->fRunningTxn;
+        jnl->fActiveHandles -= 1;
+        wake = (jnl->fActiveHandles == 0) && jnl->fBarrier;
+        lck_mtx_unlock(jnl->fLock);
+
+        if (wake) {
+            wakeup(&jnl->fActiveHandles);
+        }
+    }
+    return txn;
+}
+
+static errno_t EmptyFSMountModifyMetaBlockStart(EmptyFSMount *mtmp, uint64_t blockNum, buf_t *bpPtr)
+    // Called, with a transaction handle, before changing metadata block 
+    // blockNum, whose buffer (*bpPtr) the caller holds, and which must be 
+    // the only buffer that it holds.  Adds the block to the running 
+    // transaction.  This may have to release the buffer and read it again, 
+    // so the caller must not have changed it yet, and must use *bpPtr 
+    // afterwards.  On error, the buffer has been released and *bpPtr is 
+    // NULL.  The caller finishes with EmptyFSMountModifyMetaBlockEnd or, 
+    // if it decides not to change the block after all, buf_brelse.
+{
+    errno_t         err;
+    Journal *       jnl;
+    JournalBlock *  jb;
+    JournalBlock *  spare;
+    JournalBlock ** bucket;
+    uint64_t        owner;
+    boolean_t       done;
+
+    assert(mtmp != NULL);
+    assert(bpPtr != NULL);
+    assert(*bpPtr != NULL);
+
+    jnl = mtmp->fJournal;
+    err = 0;
+    if (jnl != NULL) {
+        lck_mtx_lock(jnl->fLock);
+        assert(jnl->fActiveHandles != 0);
+
+        // Each time we drop fLock, the block's state can change (and, if 
+        // it's idle and unowned, a checkpoint can free its JournalBlock), 
+        // so we look it up again each time around the loop.
+
+        done = FALSE;
+        while ( (err == 0) && ! done ) {
+            jb = JournalFindBlock(jnl, blockNum);
+            if ( (jb == NULL) && (jnl->fSpare == NULL) ) {
+
+                // We need a new JournalBlock.  Allocate it without the lock.
+
+                lck_mtx_unlock(jnl->fLock);
+                spare = OSMalloc(sizeof(*spare), gOSMallocTag);
+                lck_mtx_lock(jnl->fLock);
+                if (spare == NULL) {
+                    err = ENOMEM;
+                } else if (jnl->fSpare == NULL) {
+                    jnl->fSpare = spare;
+                } else {
+                    OSFree(spare, sizeof(*spare), gOSMallocTag);
+                }
+            } else if (jb == NULL) {
+                jb = jnl->fSpare;
+                jnl->fSpare = NULL;
+                memset(jb, 0, sizeof(*jb));
+                jb->fBlockNum = blockNum;
+                jb->fState    = kJournalBlockIdle;
+                bucket = &jnl->fHash[blockNum & (kJournalHashSize - 1)];
+                jb->fHashNext = *bucket;
+                *bucket = jb;
+            } else if (jb->fState == kJournalBlockCommitting) {
+
+                // Wait for the commit, which needs the buffer, to finish, 
+                // and then read the block again.
+
+                lck_mtx_unlock(jnl->fLock);
+                buf_brelse(*bpPtr);
+                *bpPtr = NULL;
+                lck_mtx_lock(jnl->fLock);
+                while (    ( (jb = JournalFindBlock(jnl, blockNum)) != NULL )
+                        && (jb->fState == kJournalBlockCommitting) ) {
+                    (void) msleep(&jnl->fCommittedTxn, jnl->fLock, PINOD, "EmptyFS:commitwait", NULL);
+                }
+                lck_mtx_unlock(jnl->fLock);
+                err = EmptyFSMountReadMetaBlock(mtmp, blockNum, bpPtr);
+                lck_mtx_lock(jnl->fLock);
+            } else if (jb->fOwner != 0) {
+
+                // The block's committed contents might not be home yet. 
+                // Write them there, and then read the block again.  Holding 
+                // the buffer stops a checkpoint from writing it at the same 
+                // time, but the checkpoint may have made the block unowned 
+                // by the time we get the lock back.
+
+                assert(jb->fState == kJournalBlockIdle);
+                owner = jb->fOwner;
+                lck_mtx_unlock(jnl->fLock);
+                err = buf_bwrite(*bpPtr);
+                *bpPtr = NULL;
+                lck_mtx_lock(jnl->fLock);
+                if (err == 0) {
+                    jb = JournalFindBlock(jnl, blockNum);
+                    if ( (jb != NULL) && (jb->fOwner == owner) ) {
+                        JournalOwnedRemove(jnl, jb);
+                    }
+                    lck_mtx_unlock(jnl->fLock);
+                    err = EmptyFSMountReadMetaBlock(mtmp, blockNum, bpPtr);
+                    lck_mtx_lock(jnl->fLock);
+                }
+            } else {
+                if (jb->fState == kJournalBlockIdle) {
+                    jb->fState = kJournalBlockRunning;
+                    jb->fListNext = jnl->fRunning;
+                    jnl->fRunning = jb;
+                    jnl->fRunningCount += 1;
+                }
+                done = TRUE;
+            }
+        }
+        lck_mtx_unlock(jnl->fLock);
+
+        if ( (err != 0) && (*bpPtr != NULL) ) {
+            buf_brelse(*bpPtr);
+            *bpPtr = NULL;
+        }
+    }
+
+    assert( (err == 0) == (*bpPtr != NULL) );
+
+    return err;
+}
+
+static void EmptyFSMountModifyMetaBlockEnd(EmptyFSMount *mtmp, buf_t bp)
+    // Called after changing a metadata block that was passed to 
+    // EmptyFSMountModifyMetaBlockStart.  Seals the block (that is, updates 
+    // its checksums; see "Metadata Checksums" in "EmptyFSFormat.h") and 
+    // releases the buffer with a delayed write.  On a journalled volume, the 
+    // buffer stays in the cache, and isn't written, until the transaction 
+    // has been committed.  Every change to a metadata block comes through 
+    // here, so the block is always sealed by the time that it's journalled 
+    // or written home, and the copy in the cache is always consistent.
+{
+    assert(mtmp != NULL);
+    assert(bp != NULL);
+
+    EmptyFSMetaBlockSeal(&mtmp->fSuperblock, (uint64_t) buf_blkno(bp) / mtmp->fDevBlocksPerBlock, (void *) buf_dataptr(bp));
+    if (mtmp->fJournal != NULL) {
+        buf_setflags(bp, B_LOCKED);
+    }
+    buf_bdwrite(bp);
+}
+
+static void EmptyFSMountJournalDeferFree(EmptyFSMount *mtmp, JournalFree *jf)
+    // Adds jf, which EmptyFSMountFreeBlocks has filled out (except for 
+    // fTxn), to the pending frees of the running transaction.  The caller 
+    // must hold a transaction handle.
+{
+    Journal *   jnl;
+
+    assert(mtmp != NULL);
+    assert(jf != NULL);
+
+    jnl = mtmp->fJournal;
+    assert(jnl != NULL);
+
+    lck_mtx_lock(jnl->fLock);
+    assert(jnl->fActiveHandles != 0);
+    jf->fTxn  = jnl->fRunningTxn;
+    jf->fNext = NULL;
+    if (jnl->fFreeTail == NULL) {
+        jnl->fFreeHead = jf;
+    } else {
+        jnl->fFreeTail->fNext = jf;
+    }
+    jnl->fFreeTail = jf;
+    lck_mtx_unlock(jnl->fLock);
+}
+
+static errno_t JournalCheckpoint(EmptyFSMount *mtmp, JournalFree **freesPtr)
+    // Writes every block owned by a committed transaction home, and then 
+    // moves the start of the journal past the last committed transaction. 
+    // Adds the pending frees that are now safe to *freesPtr.  The caller 
+    // releases those with EmptyFSMountReleaseFrees, but not while it's 
+    // committing, because that takes allocation group locks, and someone 
+    // holding one of those may be waiting for the commit.
+{
+    errno_t         err;
+    Journal *       jnl;
+    uint64_t        target;
+    uint64_t        start;
+    uint64_t        sequence;
+    uint64_t        counts[kJournalCountCount];
+    JournalBlock *  jb;
+    JournalBlock *  next;
+    JournalBlock ** linkPtr;
+    uint32_t        index;
+    uint64_t        blockNum;
+    uint64_t        owner;
+    boolean_t       owned;
+    buf_t           bp;
+
+    jnl = mtmp->fJournal;
+
+    lck_mtx_lock(jnl->fCheckpointLock);
+    lck_mtx_lock(jnl->fLock);
+
+    target   = jnl->fCommittedTxn;
+    start    = jnl->fCommittedHead;
+    sequence = jnl->fCommittedSequence;
+    memcpy(counts, jnl->fCommittedCounts, sizeof(counts));
+
+    err = 0;
+    if (target > jnl->fCheckpointedTxn) {
+
+        // Write the owned blocks home.  The list is in commit order, so the 
+        // blocks that we need are at the front.  Only a checkpoint frees 
+        // JournalBlocks, so jb stays valid while we drop the lock, but its 
+        // owner can change.
+
+        while (    (err == 0)
+                && ( (jb = jnl->fOwnedHead) != NULL )
+                && (jb->fOwner <= target) ) {
+            blockNum = jb->fBlockNum;
+            owner    = jb->fOwner;
+            lck_mtx_unlock(jnl->fLock);
+
+            err = EmptyFSMountReadMetaBlock(mtmp, blockNum, &bp);
+
+            lck_mtx_lock(jnl->fLock);
+            if (err == 0) {
+                owned = (jb->fOwner == owner);
+                lck_mtx_unlock(jnl->fLock);
+
+                if (owned) {
+                    err = buf_bwrite(bp);
+                } else {
+                    buf_brelse(bp);
+                }
+
+                lck_mtx_lock(jnl->fLock);
+                if ( (err == 0) && (jb->fOwner == owner) ) {
+                    JournalOwnedRemove(jnl, jb);
+                }
+            }
+        }
+        lck_mtx_unlock(jnl->fLock);
+
+        // Make sure that they're on the disk before the header says that 
+        // the journal doesn't have them, and that the header is on the disk 
+        // before any of those journal blocks are reused.
+
+        if (err == 0) {
+            err = EmptyFSMountSynchronizeCache(mtmp);
+        }
+        if (err == 0) {
+            err = JournalWriteHeader(mtmp, start, sequence, counts);
+        }
+        if (err == 0) {
+            err = EmptyFSMountSynchronizeCache(mtmp);
+        }
+
+        lck_mtx_lock(jnl->fLock);
+        if (err == 0) {
+            jnl->fTail = start;
+            jnl->fCheckpointedTxn = target;
+
+            // Free the JournalBlocks that no longer track anything.
+
+            for (index = 0; index < kJournalHashSize; index++) {
+                linkPtr = &jnl->fHash[index];
+                while ( (jb = *linkPtr) != NULL ) {
+                    next = jb->fHashNext;
+                    if ( (jb->fState == kJournalBlockIdle) && (jb->fOwner == 0) ) {
+                        *linkPtr = next;
+                        OSFree(jb, sizeof(*jb), gOSMallocTag);
+                    } else {
+                        linkPtr = &jb->fHashNext;
+                    }
+                }
+            }
+
+            JournalTakeFrees(jnl, target, TRUE, freesPtr);
+        }
+    }
+
+    lck_mtx_unlock(jnl->fLock);
+    lck_mtx_unlock(jnl->fCheckpointLock);
+
+    return err;
+}
+
+static buf_t JournalGetBlocks(EmptyFSMount *mtmp, uint64_t pos, uint32_t count)
+    // Gets a buffer for count blocks of the journal, starting at pos, 
+    // without reading them.  The blocks must not wrap.
+{
+    buf_t   bp;
+
+    assert( (pos + count) <= mtmp->fJournal->fBlocks );
+
+    bp = buf_getblk(mtmp->fBlockDevVNode, JournalDevBlock(mtmp, pos), (int) (count * mtmp->fBlockSize), 0, 0, BLK_META);
+    assert(bp != NULL);
+    return bp;
+}
+
+static errno_t JournalReadBlocks(EmptyFSMount *mtmp, uint64_t pos, uint32_t count, buf_t *bpPtr)
+    // Reads count blocks of the journal, starting at pos, which must not 
+    // wrap.  As for EmptyFSMountReadMetaBlock, *bpPtr is NULL on failure.
+{
+    errno_t     err;
+    buf_t       bp;
+
+    assert( (pos + count) <= mtmp->fJournal->fBlocks );
+
+    bp = NULL;
+    err = buf_meta_bread(mtmp->fBlockDevVNode, JournalDevBlock(mtmp, pos), (int) (count * mtmp->fBlockSize), NOCRED, &bp);
+    if ( (err != 0) && (bp != NULL) ) {
+        buf_brelse(bp);
+        bp = NULL;
+    }
+    *bpPtr = bp;
+    return err;
+}
+
+static uint32_t JournalMaxRun(EmptyFSMount *mtmp)
+    // Returns the number of blocks that we read or write in one journal I/O.
+{
+    uint32_t    result;
+
+    result = kJournalMaxIOSize / mtmp->fBlockSize;
+    if (result == 0) {
+        result = 1;
+    }
+    return result;
+}
+
+static errno_t JournalWriteRecords(EmptyFSMount *mtmp, JournalBlock *list, uint32_t count, const uint64_t counts[kJournalCountCount])
+    // Writes the count blocks on list to the journal, starting at fHead, as 
+    // one transaction whose last record holds counts, and moves fHead and 
+    // fSequence past it.  The caller must be committing, and must have made 
+    // sure that there's room.  This doesn't flush the device's cache.
+    //
+    // We copy the blocks from their buffers, which are locked in the cache, 
+    // into buffers for the journal blocks, so that runs of journal blocks 
+    // are written with one I/O.  The journal buffers are invalidated when 
+    // they're written, because they're of varying sizes and would otherwise 
+    // overlap each other in the cache.
+{
+    errno_t                 err;
+    Journal *               jnl;
+    uint32_t                blockSize;
+    uint32_t                maxRun;
+    uint64_t                pos;
+    uint64_t                sequence;
+    uint32_t                remaining;
+    uint32_t                thisCount;
+    uint32_t                index;
+    uint32_t                run;
+    uint32_t                runIndex;
+    uint32_t                crc;
+    JournalBlock *          jb;
+    JournalBlock *          cursor;
+    buf_t                   descBuf;
+    buf_t                   dataBuf;
+    buf_t                   homeBuf;
+    EmptyFSJournalRecord *  record;
+    uint64_t *              blockNums;
+    char *                  dataPtr;
+
+    assert(mtmp != NULL);
+    assert(list != NULL);
+    assert(count != 0);
+
+    jnl = mtmp->fJournal;
+    blockSize = mtmp->fBlockSize;
+    maxRun = JournalMaxRun(mtmp);
+    pos = jnl->fHead;
+    sequence = jnl->fSequence;
+    remaining = count;
+    jb = list;
+
+    err = 0;
+    while ( (err == 0) && (remaining != 0) ) {
+        thisCount = (remaining > jnl->fCapacity) ? jnl->fCapacity : remaining;
+
+        // Fill out the descriptor.
+
+        descBuf = JournalGetBlocks(mtmp, pos, 1);
+        record = (EmptyFSJournalRecord *) buf_dataptr(descBuf);
+        memset(record, 0, blockSize);
+        record->fMagic      = kEmptyFSJournalRecordMagic;
+        record->fSequence   = sequence;
+        record->fFlags      = (thisCount < remaining) ? kEmptyFSJournalRecordContinued : 0;
+        record->fBlockCount = thisCount;
+        if (thisCount == remaining) {
+            record->fFreeBlockCount = counts[kVolumeCounterFreeBlocks];
+            record->fFreeFileCount  = (uint32_t) counts[kVolumeCounterFreeFiles];
+            record->fDirectoryCount = (uint32_t) counts[kVolumeCounterDirectories];
+            record->fOrphanFileNum  = (uint32_t) counts[kJournalCountOrphans];
+        }
+        blockNums = (uint64_t *) (((char *) record) + kEmptyFSJournalRecordHeaderSize);
+        cursor = jb;
+        for (index = 0; index < thisCount; index++) {
+            blockNums[index] = EmptyFSSwapLE64(cursor->fBlockNum);
+            cursor = cursor->fListNext;
+        }
+        EmptyFSSwapJournalRecord(record);
+        crc = EmptyFSJournalRecordChecksum(record, blockSize);
+
+        // Copy the data blocks in runs that don't wrap, continuing the 
+        // checksum.  Reading the blocks just finds them in the cache.
+
+        index = 0;
+        while ( (err == 0) && (index < thisCount) ) {
+            uint64_t    dataPos;
+
+            dataPos = JournalAdvance(jnl, pos, 1 + index);
+            run = thisCount - index;
+            if (run > maxRun) {
+                run = maxRun;
+            }
+            if (run > (jnl->fBlocks - dataPos)) {
+                run = (uint32_t) (jnl->fBlocks - dataPos);
+            }
+            dataBuf = JournalGetBlocks(mtmp, dataPos, run);
+            dataPtr = (char *) buf_dataptr(dataBuf);
+            for (runIndex = 0; (err == 0) && (runIndex < run); runIndex++) {
+                err = EmptyFSMountReadMetaBlock(mtmp, jb->fBlockNum, &homeBuf);
+                if (err == 0) {
+                    memcpy(dataPtr, (const void *) buf_dataptr(homeBuf), blockSize);
+                    buf_brelse(homeBuf);
+                    crc = EmptyFSChecksum(crc, dataPtr, blockSize);
+                    dataPtr += blockSize;
+                    jb = jb->fListNext;
+                }
+            }
+            buf_markinvalid(dataBuf);
+            if (err == 0) {
+                err = buf_bwrite(dataBuf);
+            } else {
+                buf_brelse(dataBuf);
+            }
+            index += run;
+        }
+
+        // Now that we know the checksum, write the descriptor.
+
+        buf_markinvalid(descBuf);
+        if (err == 0) {
+            record->fChecksum = EmptyFSSwapLE32(crc);
+            err = buf_bwrite(descBuf);
+        } else {
+            buf_brelse(descBuf);
+        }
+
+        pos = JournalAdvance(jnl, pos, 1 + thisCount);
+        sequence  += 1;
+        remaining -= thisCount;
+    }
+    if (err == 0) {
+        jnl->fHead     = pos;
+        jnl->fSequence = sequence;
+    }
+    return err;
+}
+
+static errno_t EmptyFSMountJournalCommit(EmptyFSMount *mtmp, uint64_t txn)
+    // Commits transaction txn, or the running transaction if txn is 0, and 
+    // waits until it's in the journal; see "Journal Notes".  If it's already 
+    // committed, or it changed nothing, this returns straight away.  The 
+    // caller must not hold a transaction handle, or any lock other than an 
+    // FSNode's fWriteLock.
+    //
+    // If the transaction won't fit in the journal, or writing to the journal 
+    // fails, we checkpoint and then write the transaction's blocks home 
+    // directly.  That's not atomic, so we complain about it, but the volume 
+    // is only at risk if we crash before we're done.
+{
+    errno_t         err;
+    errno_t         junk;
+    Journal *       jnl;
+    boolean_t       done;
+    boolean_t       commit;
+    boolean_t       inPlace;
+    JournalBlock *  list;
+    JournalBlock *  jb;
+    uint32_t        count;
+    uint64_t        need;
+    uint64_t        counts[kJournalCountCount];
+    JournalFree *   frees;
+    buf_t           bp;
+
+    assert(mtmp != NULL);
+
+    jnl = mtmp->fJournal;
+    err = 0;
+    if (jnl != NULL) {
+        lck_mtx_lock(jnl->fLock);
+
+        // Wait for any commit in progress, which might be the one we want.
+
+        if (txn == 0) {
+            txn = jnl->fRunningTxn;
+        }
+        commit = FALSE;
+        done = FALSE;
+        do {
+            if (jnl->fCommittedTxn >= txn) {
+                done = TRUE;
+            } else if (jnl->fCommitting) {
+                (void) msleep(&jnl->fCommittedTxn, jnl->fLock, PINOD, "EmptyFS:commit", NULL);
+            } else {
+                assert(txn == jnl->fRunningTxn);
+                commit = (jnl->fRunning != NULL);
+                done = TRUE;
+            }
+        } while ( ! done );
+
+        // Raise the barrier and wait for the handles to end.
+
+        if (commit) {
+            jnl->fCommitting = TRUE;
+            jnl->fBarrier    = TRUE;
+            while (jnl->fActiveHandles != 0) {
+                (void) msleep(&jnl->fActiveHandles, jnl->fLock, PINOD, "EmptyFS:handles", NULL);
+            }
+        }
+        lck_mtx_unlock(jnl->fLock);
+
+        if (commit) {
+
+            // With the barrier up, the counts match the transaction.  Then 
+            // take the transaction, start a new one, and lower the barrier.
+
+            EmptyFSMountJournalCounts(mtmp, counts);
+
+            lck_mtx_lock(jnl->fLock);
+            list  = jnl->fRunning;
+            count = jnl->fRunningCount;
+            txn   = jnl->fRunningTxn;
+            for (jb = list; jb != NULL; jb = jb->fListNext) {
+                assert(jb->fState == kJournalBlockRunning);
+                jb->fState = kJournalBlockCommitting;
+            }
+            jnl->fRunning       = NULL;
+            jnl->fRunningCount  = 0;
+            jnl->fRunningTxn   += 1;
+            jnl->fBarrier       = FALSE;
+            need = ((count + jnl->fCapacity - 1) / jnl->fCapacity) + count;
+            lck_mtx_unlock(jnl->fLock);
+
+            wakeup(&jnl->fBarrier);
+
+            // Write the transaction to the journal, making room first if 
+            // we have to.  Checkpointing empties the journal.
+
+            frees = NULL;
+            if ( need > (jnl->fBlocks - 2) ) {
+                err = EFBIG;
+            } else {
+                lck_mtx_lock(jnl->fLock);
+                done = ( need <= (jnl->fBlocks - 2 - JournalUsed(jnl, jnl->fHead, jnl->fTail)) );
+                lck_mtx_unlock(jnl->fLock);
+
+                if ( ! done ) {
+                    err = JournalCheckpoint(mtmp, &frees);
+                }
+                if (err == 0) {
+                    err = JournalWriteRecords(mtmp, list, count, counts);
+                }
+                if (err == 0) {
+                    err = EmptyFSMountSynchronizeCache(mtmp);
+                }
+            }
+            inPlace = (err != 0);
+            if (inPlace) {
+                printf("EmptyFS:EmptyFSMountJournalCommit: can't journal transaction %llu (error %d); writing it in place\n", (unsigned long long) txn, err);
+                err = JournalCheckpoint(mtmp, &frees);
+            }
+
+            // Release the blocks so that they can be written home or, if 
+            // we're bypassing the journal, write them home now.
+
+            for (jb = list; jb != NULL; jb = jb->fListNext) {
+                junk = EmptyFSMountReadMetaBlock(mtmp, jb->fBlockNum, &bp);
+                assert(junk == 0);              // it's locked in the cache
+                if (junk == 0) {
+                    buf_clearflags(bp, B_LOCKED);
+                    if (inPlace) {
+                        junk = buf_bwrite(bp);
+                        if (err == 0) {
+                            err = junk;
+                        }
+                    } else {
+                        buf_bdwrite(bp);
+                    }
+                }
+            }
+            if (inPlace) {
+                junk = EmptyFSMountSynchronizeCache(mtmp);
+                if (err == 0) {
+                    err = junk;
+                }
+            }
+
+            // The transaction is committed.  Its blocks become owned (unless 
+            // they're already home), and the data blocks that it freed can 
+            // be reused.
+
+            lck_mtx_lock(jnl->fLock);
+            while ( (jb = list) != NULL ) {
+                list = jb->fListNext;
+                jb->fListNext = NULL;
+                jb->fState = kJournalBlockIdle;
+                if ( ! inPlace ) {
+                    JournalOwnedAppend(jnl, jb, txn);
+                }
+            }
+            jnl->fCommittedTxn = txn;
+            if ( ! inPlace ) {
+                jnl->fCommittedHead     = jnl->fHead;
+                jnl->fCommittedSequence = jnl->fSequence;
+            }
+            memcpy(jnl->fCommittedCounts, counts, sizeof(counts));
+            jnl->fCommitting = FALSE;
+            JournalTakeFrees(jnl, txn, FALSE, &frees);
+            lck_mtx_unlock(jnl->fLock);
+
+            wakeup(&jnl->fCommittedTxn);
+
+            // If we bypassed the journal, its header's counts are now out of 
+            // date, and checkpointing again fixes that.
+
+            if (inPlace) {
+                junk = JournalCheckpoint(mtmp, &frees);
+                if (err == 0) {
+                    err = junk;
+                }
+            }
+
+            EmptyFSMountReleaseFrees(mtmp, frees);
+        }
+    }
+    return err;
+}
+
+static errno_t EmptyFSMountJournalCheckpoint(EmptyFSMount *mtmp)
+    // Checkpoints the journal, if the volume has one, and releases the 
+    // pending frees that that makes safe.  See "Journal Notes".  The caller 
+    // must not hold any locks, or a transaction handle.
+{
+    errno_t         err;
+    JournalFree *   frees;
+
+    assert(mtmp != NULL);
+
+    err = 0;
+    if (mtmp->fJournal != NULL) {
+        frees = NULL;
+        err = JournalCheckpoint(mtmp, &frees);
+        EmptyFSMountReleaseFrees(mtmp, frees);
+    }
+    return err;
+}
+
+static boolean_t EmptyFSMountJournalWantsCheckpoint(EmptyFSMount *mtmp)
+    // Returns true if the flusher should checkpoint the journal, which it 
+    // should if the journal is more than half full, or if there's something 
+    // to checkpoint and nothing is happening on the volume.
+{
+    Journal *   jnl;
+    boolean_t   result;
+
+    assert(mtmp != NULL);
+
+    jnl = mtmp->fJournal;
+    result = FALSE;
+    if (jnl != NULL) {
+        lck_mtx_lock(jnl->fLock);
+        if (jnl->fCommittedTxn > jnl->fCheckpointedTxn) {
+            result =    ( JournalUsed(jnl, jnl->fCommittedHead, jnl->fTail) > ((jnl->fBlocks - 2) / 2) )
+                     || ( (jnl->fRunning == NULL) && ! jnl->fCommitting );
+        }
+        lck_mtx_unlock(jnl->fLock);
+    }
+    return result;
+}
+
+static boolean_t EmptyFSMountJournalReclaim(EmptyFSMount *mtmp)
+    // Called when reserving blocks fails with ENOSPC.  If there are freed 
+    // blocks waiting on the journal, this commits and checkpoints, which 
+    // returns them to the free block counter, and returns true, in which 
+    // case the caller should try again.  The caller must not hold any lock 
+    // other than an FSNode's fWriteLock, or a transaction handle.
+{
+    Journal *   jnl;
+    boolean_t   result;
+
+    assert(mtmp != NULL);
+
+    jnl = mtmp->fJournal;
+    result = FALSE;
+    if (jnl != NULL) {
+        lck_mtx_lock(jnl->fLock);
+        result = (jnl->fFreeHead != NULL);
+        lck_mtx_unlock(jnl->fLock);
+
+        if (result) {
+            (void) EmptyFSMountJournalCommit(mtmp, 0);
+            (void) EmptyFSMountJournalCheckpoint(mtmp);
+        }
+    }
+    return result;
+}
+
+static errno_t JournalScan(
+    EmptyFSMount *  mtmp,
+    uint64_t        start,
+    uint64_t        sequence,
+    uint64_t *      records,
+    uint32_t        maxRecords,
+    uint64_t *      endPtr,
+    uint64_t *      endSequencePtr,
+    uint64_t        counts[kJournalCountCount]
+)
+    // Reads the records of the journal, starting at start with sequence 
+    // number sequence, until it finds the end of the journal (a record 
+    // that's not valid).  Sets *endPtr and *endSequencePtr to the position 
+    // and sequence number just after the last complete transaction, and 
+    // counts to that transaction's counts; if there's no complete 
+    // transaction, they're left alone.  Also sets records[n] to the 
+    // position of the record with sequence number sequence + n, for up to 
+    // maxRecords records.  See "Journal Notes".
+{
+    errno_t                 err;
+    const EmptyFSSuperblock * sb;
+    Journal *               jnl;
+    boolean_t               done;
+    uint32_t                blockSize;
+    uint32_t                maxRun;
+    char *                  desc;
+    EmptyFSJournalRecord    record;
+    const uint64_t *        blockNums;
+    uint64_t                home;
+    uint64_t                pos;
+    uint64_t                dataPos;
+    uint32_t                index;
+    uint32_t                run;
+    uint32_t                runIndex;
+    uint32_t                recordCount;
+    uint32_t                crc;
+    buf_t                   bp;
+    const char *            dataPtr;
+
+    sb = &mtmp->fSuperblock;
+    jnl = mtmp->fJournal;
+    blockSize = mtmp->fBlockSize;
+    maxRun = JournalMaxRun(mtmp);
+
+    // We keep a copy of the descriptor, so that we can see the block 
+    // numbers while we read the data.
+
+    err = 0;
+    desc = OSMalloc(blockSize, gOSMallocTag);
+    if (desc == NULL) {
+        err = ENOMEM;
+    }
+
+    pos = start;
+    recordCount = 0;
+    done = FALSE;
+    while ( (err == 0) && ! done && (recordCount < maxRecords) ) {
+        err = JournalReadBlocks(mtmp, pos, 1, &bp);
+        if (err == 0) {
+            memcpy(desc, (const void *) buf_dataptr(bp), blockSize);
+            buf_markinvalid(bp);
+            buf_brelse(bp);
+
+            memcpy(&record, desc, sizeof(record));
+            EmptyFSSwapJournalRecord(&record);
+            done = (EmptyFSJournalRecordValidate(sb, &record, sequence) != 0);
+        }
+
+        // A record that writes outside the metadata is corrupt.  We treat 
+        // it as the end of the journal, like any other bad record.
+
+        blockNums = (const uint64_t *) (desc + kEmptyFSJournalRecordHeaderSize);
+        for (index = 0; (err == 0) && ! done && (index < record.fBlockCount); index++) {
+            home = EmptyFSSwapLE64(blockNums[index]);
+            done =    (home < sb->fBitmapStart)
+                   || (home >= sb->fBlockCount)
+                   || ( (home >= jnl->fStart) && (home < (jnl->fStart + jnl->fBlocks)) );
+        }
+
+        // Read the data, checking the checksum.
+
+        if ( (err == 0) && ! done ) {
+            crc = EmptyFSJournalRecordChecksum(desc, blockSize);
+            index = 0;
+            while ( (err == 0) && (index < record.fBlockCount) ) {
+                dataPos = JournalAdvance(jnl, pos, 1 + index);
+                run = record.fBlockCount - index;
+                if (run > maxRun) {
+                    run = maxRun;
+                }
+                if (run > (jnl->fBlocks - dataPos)) {
+                    run = (uint32_t) (jnl->fBlocks - dataPos);
+                }
+                err = JournalReadBlocks(mtmp, dataPos, run, &bp);
+                if (err == 0) {
+                    dataPtr = (const char *) buf_dataptr(bp);
+                    for (runIndex = 0; runIndex < run; runIndex++) {
+                        crc = EmptyFSChecksum(crc, dataPtr, blockSize);
+                        dataPtr += blockSize;
+                    }
+                    buf_markinvalid(bp);
+                    buf_brelse(bp);
+                }
+                index += run;
+            }
+            if ( (err == 0) && (crc != EmptyFSSwapLE32( ((const EmptyFSJournalRecord *) desc)->fChecksum )) ) {
+                done = TRUE;
+            }
+        }
+
+        // Move on to the next record, noting the end of each transaction.
+
+        if ( (err == 0) && ! done ) {
+            records[recordCount] = pos;
+            recordCount += 1;
+            pos = JournalAdvance(jnl, pos, 1 + record.fBlockCount);
+            sequence += 1;
+            if ( ! (record.fFlags & kEmptyFSJournalRecordContinued) ) {
+                *endPtr         = pos;
+                *endSequencePtr = sequence;
+                counts[kVolumeCounterFreeBlocks]   = record.fFreeBlockCount;
+                counts[kVolumeCounterFreeFiles]    = record.fFreeFileCount;
+                counts[kVolumeCounterDirectories]  = record.fDirectoryCount;
+                counts[kJournalCountOrphans]       = record.fOrphanFileNum;
+            }
+        }
+    }
+
+    if (desc != NULL) {
+        OSFree(desc, blockSize, gOSMallocTag);
+    }
+    return err;
+}
+
+// A JournalReplayState is the state of a replay, shared by the threads that are 
+// doing it.  fEntries is an open hash table, with linear probing, of every 
+// home block that the replay writes, and the index (in fRecords) of the 
+// last record that writes it.  It's built before the threads start, so 
+// they only read it.
+
+struct JournalReplayEntry {
+    uint64_t        fBlockNum;              // the home block, or 0 if the entry is free
+    uint32_t        fRecord;                // index of the last record that writes it
+};
+typedef struct JournalReplayEntry JournalReplayEntry;
+
+struct JournalReplayState {
+    EmptyFSMount *          fMount;
+    const uint64_t *        fRecords;       // position of each record, from JournalScan
+    uint32_t                fRecordCount;   // number of records to replay
+    JournalReplayEntry *    fEntries;       // see above
+    uint32_t                fEntryCount;    // length of fEntries; a power of two
+    SInt32 volatile         fNextRecord;    // next record that a thread should take; atomic
+    lck_mtx_t *             fLock;          // protects fRunning and fErr
+    uint32_t                fRunning;       // threads that haven't finished yet
+    errno_t                 fErr;           // the first error that any of them hit
+};
+typedef struct JournalReplayState JournalReplayState;
+
+static JournalReplayEntry * JournalReplayLookup(JournalReplayState *replay, uint64_t blockNum)
+    // Returns the entry for blockNum or, if there isn't one, the free entry 
+    // where it belongs.  The table is at least twice as big as the number 
+    // of blocks in the journal, so it never fills up.
+{
+    uint32_t                index;
+    JournalReplayEntry *    entry;
+
+    assert(blockNum != 0);
+
+    index = (uint32_t) (blockNum * 0x9E3779B97F4A7C15ULL >> 32) & (replay->fEntryCount - 1);
+    for (;;) {
+        entry = &replay->fEntries[index];
+        if ( (entry->fBlockNum == blockNum) || (entry->fBlockNum == 0) ) {
+            break;
+        }
+        index = (index + 1) & (replay->fEntryCount - 1);
+    }
+    return entry;
+}
+
+static errno_t JournalReplayPlan(JournalReplayState *replay)
+    // Reads the descriptor of each record that's to be replayed, in order, 
+    // and records it as the last writer of each of its blocks.
+{
+    errno_t                 err;
+    EmptyFSMount *          mtmp;
+    uint32_t                recordIndex;
+    uint32_t                index;
+    buf_t                   bp;
+    EmptyFSJournalRecord    record;
+    const uint64_t *        blockNums;
+    JournalReplayEntry *    entry;
+
+    mtmp = replay->fMount;
+
+    err = 0;
+    for (recordIndex = 0; (err == 0) && (recordIndex < replay->fRecordCount); recordIndex++) {
+        err = JournalReadBlocks(mtmp, replay->fRecords[recordIndex], 1, &bp);
+        if (err == 0) {
+            memcpy(&record, (const void *) buf_dataptr(bp), sizeof(record));
+            EmptyFSSwapJournalRecord(&record);
+            blockNums = (const uint64_t *) (((const char *) buf_dataptr(bp)) + kEmptyFSJournalRecordHeaderSize);
+            for (index = 0; index < record.fBlockCount; index++) {
+                entry = JournalReplayLookup(replay, EmptyFSSwapLE64(blockNums[index]));
+                entry->fBlockNum = EmptyFSSwapLE64(blockNums[index]);
+                entry->fRecord   = recordIndex;
+            }
+            buf_markinvalid(bp);
+            buf_brelse(bp);
+        }
+    }
+    return err;
+}
+
+static errno_t JournalReplayRecord(JournalReplayState *replay, uint32_t recordIndex, char *desc)
+    // Writes home, with delayed writes, the blocks of a record that it's 
+    // the last writer of.  desc is a buffer of one block.  JournalScan has 
+    // already checked the record, but we check the checksum again, because 
+    // it's cheap, and we'd rather fail than write garbage over the metadata.
+{
+    errno_t                 err;
+    EmptyFSMount *          mtmp;
+    Journal *               jnl;
+    uint32_t                blockSize;
+    uint32_t                maxRun;
+    EmptyFSJournalRecord    record;
+    const uint64_t *        blockNums;
+    uint64_t                pos;
+    uint64_t                dataPos;
+    uint64_t                home;
+    uint32_t                index;
+    uint32_t                run;
+    uint32_t                runIndex;
+    uint32_t                owned;
+    uint32_t                crc;
+    buf_t                   bp;
+    buf_t                   homeBuf;
+    const char *            dataPtr;
+
+    mtmp = replay->fMount;
+    jnl = mtmp->fJournal;
+    blockSize = mtmp->fBlockSize;
+    maxRun = JournalMaxRun(mtmp);
+    pos = replay->fRecords[recordIndex];
+
+    err = JournalReadBlocks(mtmp, pos, 1, &bp);
+    if (err == 0) {
+        memcpy(desc, (const void *) buf_dataptr(bp), blockSize);
+        buf_markinvalid(bp);
+        buf_brelse(bp);
+
+        memcpy(&record, desc, sizeof(record));
+        EmptyFSSwapJournalRecord(&record);
+        blockNums = (const uint64_t *) (desc + kEmptyFSJournalRecordHeaderSize);
+
+        // If a later record writes all of this record's blocks, there's 
+        // nothing to do.
+
+        owned = 0;
+        for (index = 0; index < record.fBlockCount; index++) {
+            if ( JournalReplayLookup(replay, EmptyFSSwapLE64(blockNums[index]))->fRecord == recordIndex ) {
+                owned += 1;
+            }
+        }
+
+        if (owned != 0) {
+            crc = EmptyFSJournalRecordChecksum(desc, blockSize);
+            index = 0;
+            while ( (err == 0) && (index < record.fBlockCount) ) {
+                dataPos = JournalAdvance(jnl, pos, 1 + index);
+                run = record.fBlockCount - index;
+                if (run > maxRun) {
+                    run = maxRun;
+                }
+                if (run > (jnl->fBlocks - dataPos)) {
+                    run = (uint32_t) (jnl->fBlocks - dataPos);
+                }
+                err = JournalReadBlocks(mtmp, dataPos, run, &bp);
+                if (err == 0) {
+                    dataPtr = (const char *) buf_dataptr(bp);
+                    for (runIndex = 0; runIndex < run; runIndex++) {
+                        crc = EmptyFSChecksum(crc, dataPtr, blockSize);
+                        home = EmptyFSSwapLE64(blockNums[index + runIndex]);
+                        if ( JournalReplayLookup(replay, home)->fRecord == recordIndex ) {
+                            homeBuf = EmptyFSMountGetMetaBlock(mtmp, home);
+                            memcpy( (void *) buf_dataptr(homeBuf), dataPtr, blockSize);
+                            buf_bdwrite(homeBuf);
+                        }
+                        dataPtr += blockSize;
+                    }
+                    buf_markinvalid(bp);
+                    buf_brelse(bp);
+                }
+                index += run;
+            }
+            if ( (err == 0) && (crc != EmptyFSSwapLE32( ((const EmptyFSJournalRecord *) desc)->fChecksum )) ) {
+                err = EIO;                  // it was fine when we scanned it
+            }
+        }
+    }
+    return err;
+}
+
+static errno_t JournalReplayRun(JournalReplayState *replay)
+    // Replays records, taking the next one each time, until they're all 
+    // done or some thread hits an error.  Every replay thread runs this, 
+    // including the mounting thread.
+{
+    errno_t     err;
+    uint32_t    blockSize;
+    char *      desc;
+    SInt32      recordIndex;
+
+    blockSize = replay->fMount->fBlockSize;
+
+    err = 0;
+    desc = OSMalloc(blockSize, gOSMallocTag);
+    if (desc == NULL) {
+        err = ENOMEM;
+    }
+    while ( (err == 0) && (replay->fErr == 0) ) {
+        recordIndex = OSIncrementAtomic(&replay->fNextRecord);
+        if ( (uint32_t) recordIndex >= replay->fRecordCount ) {
+            break;
+        }
+        err = JournalReplayRecord(replay, (uint32_t) recordIndex, desc);
+    }
+    if (desc != NULL) {
+        OSFree(desc, blockSize, gOSMallocTag);
+    }
+    return err;
+}
+
+static void JournalReplayThread(void *parameter, wait_result_t wresult)
+    // The body of a replay thread.  Runs JournalReplayRun, and then tells 
+    // JournalReplay that it's finished.
+{
+    JournalReplayState *    replay;
+    errno_t                 err;
+
+    replay = (JournalReplayState *) parameter;
+    assert(replay != NULL);
+    (void) wresult;
+
+    err = JournalReplayRun(replay);
+
+    // We must not touch replay after dropping the lock, because 
+    // JournalReplay can then free it.
+
+    lck_mtx_lock(replay->fLock);
+    if ( (err != 0) && (replay->fErr == 0) ) {
+        replay->fErr = err;
+    }
+    replay->fRunning -= 1;
+    wakeup(&replay->fRunning);
+    lck_mtx_unlock(replay->fLock);
+
+    (void) thread_terminate(current_thread());
+}
+
+static errno_t JournalReplay(EmptyFSMount *mtmp, const uint64_t *records, uint32_t recordCount)
+    // Writes home, with delayed writes, the blocks of the first recordCount 
+    // records of the journal, whose positions JournalScan found.  The caller 
+    // is responsible for flushing them.  See "Journal Notes".
+{
+    errno_t             err;
+    JournalReplayState  replay;
+    size_t              entriesSize;
+    uint32_t            threadCount;
+    uint32_t            index;
+    kern_return_t       kr;
+    thread_t            thread;
+
+    assert(mtmp != NULL);
+    assert(records != NULL);
+
+    memset(&replay, 0, sizeof(replay));
+    replay.fMount       = mtmp;
+    replay.fRecords     = records;
+    replay.fRecordCount = recordCount;
+
+    // There can't be more home blocks than blocks in the journal.
+
+    replay.fEntryCount = 1;
+    while ( replay.fEntryCount < (2 * mtmp->fJournal->fBlocks) ) {
+        replay.fEntryCount *= 2;
+    }
+    entriesSize = replay.fEntryCount * sizeof(JournalReplayEntry);
+
+    err = 0;
+    replay.fEntries = OSMalloc(entriesSize, gOSMallocTag);
+    replay.fLock    = lck_mtx_alloc_init(gLockGroup, LCK_ATTR_NULL);
+    if ( (replay.fEntries == NULL) || (replay.fLock == NULL) ) {
+        err = ENOMEM;
+    }
+    if (err == 0) {
+        memset(replay.fEntries, 0, entriesSize);
+        err = JournalReplayPlan(&replay);
+    }
+
+    // Start the other threads, if there are enough records to make them 
+    // worthwhile, and then do our share.  If we can't start a thread, the 
+    // rest just do more.
+
+    if (err == 0) {
+        threadCount = recordCount / kJournalReplayRecordsPerThread;
+        if (threadCount > kJournalReplayThreads) {
+            threadCount = kJournalReplayThreads;
+        }
+        for (index = 1; index < threadCount; index++) {
+            lck_mtx_lock(replay.fLock);
+            replay.fRunning += 1;
+            lck_mtx_unlock(replay.fLock);
+
+            kr = kernel_thread_start(JournalReplayThread, &replay, &thread);
+            if (kr == KERN_SUCCESS) {
+                thread_deallocate(thread);
+            } else {
+                lck_mtx_lock(replay.fLock);
+                replay.fRunning -= 1;
+                lck_mtx_unlock(replay.fLock);
+                break;
+            }
+        }
+
+        err = JournalReplayRun(&replay);
+
+        lck_mtx_lock(replay.fLock);
+        if ( (err != 0) && (replay.fErr == 0) ) {
+            replay.fErr = err;
+        }
+        while (replay.fRunning != 0) {
+            (void) msleep(&replay.fRunning, replay.fLock, PINOD, "EmptyFS:replay", NULL);
+        }
+        err = replay.fErr;
+        lck_mtx_unlock(replay.fLock);
+    }
+
+    if (replay.fLock != NULL) {
+        lck_mtx_free(replay.fLock, gLockGroup);
+    }
+    if (replay.fEntries != NULL) {
+        OSFree(replay.fEntries, entriesSize, gOSMallocTag);
+    }
+    return err;
+}
+
+static errno_t EmptyFSMountJournalInit(EmptyFSMount *mtmp)
+    // Sets up the journal of a volume that's being mounted read/write.  If 
+    // the volume wasn't cleanly unmounted, this replays the journal first, 
+    // and sets the counts in fSuperblock from it.  Either way, it writes a 
+    // new journal header.  Must be called before the volume counters and the 
+    // allocation groups are set up, because they depend on what it writes.
+{
+    errno_t                 err;
+    Journal *               jnl;
+    EmptyFSSuperblock *     sb;
+    buf_t                   bp;
+    EmptyFSJournalHeader    header;
+    uint64_t                counts[kJournalCountCount];
+    uint64_t                start;
+    uint64_t                sequence;
+    uint64_t                end;
+    uint64_t                endSequence;
+    uint64_t *              records;
+    uint32_t                maxRecords;
+
+    assert(mtmp != NULL);
+    assert(mtmp->fWritable);
+    assert(mtmp->fJournal == NULL);
+
+    sb = &mtmp->fSuperblock;
+    assert(sb->fROCompatFeatures & kEmptyFSROCompatJournal);
+
+    err = 0;
+    jnl = OSMalloc(sizeof(*jnl), gOSMallocTag);
+    if (jnl == NULL) {
+        err = ENOMEM;
+    } else {
+        memset(jnl, 0, sizeof(*jnl));
+        jnl->fStart        = sb->fJournalStart;
+        jnl->fBlocks       = sb->fJournalBlocks;
+        jnl->fCapacity     = EmptyFSJournalRecordCapacity(sb);
+        jnl->fRunningLimit = (uint32_t) ((jnl->fBlocks - 1) / 4);
+        jnl->fRunningTxn   = 1;
+        jnl->fLock           = lck_mtx_alloc_init(gLockGroup, LCK_ATTR_NULL);
+        jnl->fCheckpointLock = lck_mtx_alloc_init(gLockGroup, LCK_ATTR_NULL);
+        mtmp->fJournal = jnl;               // so that EmptyFSMountJournalTerm cleans up
+        if ( (jnl->fLock == NULL) || (jnl->fCheckpointLock == NULL) ) {
+            err = ENOMEM;
+        }
+    }
+
+    // Read and check the header.
+
+    if (err == 0) {
+        err = EmptyFSMountReadMetaBlock(mtmp, jnl->fStart, &bp);
+    }
+    if (err == 0) {
+        memcpy(&header, (const void *) buf_dataptr(bp), sizeof(header));
+        buf_brelse(bp);
+
+        if ( EmptyFSJournalHeaderChecksum(&header) != EmptyFSSwapLE32(header.fChecksum) ) {
+            err = EIO;
+        } else {
+            EmptyFSSwapJournalHeader(&header);
+            err = EmptyFSJournalHeaderValidate(sb, &header);
+        }
+        if (err != 0) {
+            printf("EmptyFS:EmptyFSMountJournalInit: journal header is corrupt\n");
+        }
+    }
+
+    // If the volume wasn't cleanly unmounted, find the last complete 
+    // transaction, and then replay everything up to it.  Once the blocks 
+    // are home, the counts from the journal (and the head of the orphan 
+    // list) are the volume's counts.  Every 
+    // record is at least two blocks long, which bounds the number of 
+    // records.
+
+    if (err == 0) {
+        start    = header.fStart;
+        sequence = header.fSequence;
+        if ( ! (sb->fState & kEmptyFSStateClean) ) {
+            end         = start;
+            endSequence = sequence;
+            counts[kVolumeCounterFreeBlocks]  = header.fFreeBlockCount;
+            counts[kVolumeCounterFreeFiles]   = header.fFreeFileCount;
+            counts[kVolumeCounterDirectories] = header.fDirectoryCount;
+            counts[kJournalCountOrphans]      = header.fOrphanFileNum;
+
+            maxRecords = (uint32_t) (jnl->fBlocks / 2);
+            records = OSMalloc(maxRecords * sizeof(uint64_t), gOSMallocTag);
+            if (records == NULL) {
+                err = ENOMEM;
+            }
+            if (err == 0) {
+                err = JournalScan(mtmp, start, sequence, records, maxRecords, &end, &endSequence, counts);
+            }
+            if ( (err == 0) && (endSequence != sequence) ) {
+                err = JournalReplay(mtmp, records, (uint32_t) (endSequence - sequence));
+                if (err == 0) {
+                    buf_flushdirtyblks(mtmp->fBlockDevVNode, TRUE, BUF_SKIP_LOCKED, "EmptyFS:replay");
+                    err = EmptyFSMountSynchronizeCache(mtmp);
+                }
+            }
+            if (err == 0) {
+                printf("EmptyFS:EmptyFSMountJournalInit: replayed %llu journal records\n", (unsigned long long) (endSequence - header.fSequence));
+                start    = end;
+                sequence = endSequence;
+                sb->fFreeBlockCount = counts[kVolumeCounterFreeBlocks];
+                sb->fFreeFileCount  = (uint32_t) counts[kVolumeCounterFreeFiles];
+                sb->fDirectoryCount = (uint32_t) counts[kVolumeCounterDirectories];
+                sb->fOrphanFileNum  = (uint32_t) counts[kJournalCountOrphans];
+            } else {
+                printf("EmptyFS:EmptyFSMountJournalInit: journal replay failed with error %d\n", err);
+            }
+            if (records != NULL) {
+                OSFree(records, maxRecords * sizeof(uint64_t), gOSMallocTag);
+            }
+        }
+    }
+
+    // Write a new header, which empties the journal.  The sequence numbers 
+    // skip ahead by the size of the journal, because a crash in the middle 
+    // of a commit can leave valid records from the incomplete transaction 
+    // beyond the end, and we must never mistake them for new ones.
+
+    if (err == 0) {
+        sequence += jnl->fBlocks;
+        counts[kVolumeCounterFreeBlocks]  = sb->fFreeBlockCount;
+        counts[kVolumeCounterFreeFiles]   = sb->fFreeFileCount;
+        counts[kVolumeCounterDirectories] = sb->fDirectoryCount;
+        counts[kJournalCountOrphans]      = sb->fOrphanFileNum;
+
+        err = JournalWriteHeader(mtmp, start, sequence, counts);
+        if (err == 0) {
+            err = EmptyFSMountSynchronizeCache(mtmp);
+        }
+    }
+    if (err == 0) {
+        jnl->fHead              = start;
+        jnl->fSequence          = sequence;
+        jnl->fTail              = start;
+        jnl->fCommittedHead     = start;
+        jnl->fCommittedSequence = sequence;
+        memcpy(jnl->fCommittedCounts, counts, sizeof(counts));
+    }
+    return err;
+}
+
+static void EmptyFSMountJournalTerm(EmptyFSMount *mtmp)
+    // Undoes EmptyFSMountJournalInit.  By the time the volume is unmounted, 
+    // everything has been committed and checkpointed, so all that's left 
+    // to do is free memory.
+{
+    Journal *       jnl;
+    uint32_t        index;
+    JournalBlock *  jb;
+    JournalFree *   jf;
+
+    assert(mtmp != NULL);
+
+    jnl = mtmp->fJournal;
+    if (jnl != NULL) {
+        assert(jnl->fActiveHandles == 0);
+        assert(jnl->fRunning == NULL);
+
+        for (index = 0; index < kJournalHashSize; index++) {
+            while ( (jb = jnl->fHash[index]) != NULL ) {
+                jnl->fHash[index] = jb->fHashNext;
+                OSFree(jb, sizeof(*jb), gOSMallocTag);
+            }
+        }
+        if (jnl->fSpare != NULL) {
+            OSFree(jnl->fSpare, sizeof(*jnl->fSpare), gOSMallocTag);
+        }
+        while ( (jf = jnl->fFreeHead) != NULL ) {
+            jnl->fFreeHead = jf->fNext;
+            OSFree(jf, sizeof(*jf), gOSMallocTag);
+        }
+        if (jnl->fLock != NULL) {
+            lck_mtx_free(jnl->fLock, gLockGroup);
+        }
+        if (jnl->fCheckpointLock != NULL) {
+            lck_mtx_free(jnl->fCheckpointLock, gLockGroup);
+        }
+        OSFree(jnl, sizeof(*jnl), gOSMallocTag);
+        mtmp->fJournal = NULL;
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Allocation
+
+// Allocation Notes
+// ----------------
+// The on-disk record of which blocks are in use is the bitmap, but we don't 
+// search it.  Instead, when a volume is mounted read/write, we divide its 
+// blocks into allocation groups and, for each group, build two B-trees of 
+// its free extents from the bitmap: one ordered by start block (fByOffset), 
+// which finds the free extent that contains or follows a given block, and 
+// one ordered by length (fBySize), which finds the smallest free extent that 
+// can hold a request.  This is the same arrangement that XFS uses, except 
+// that our trees only live in memory; the bitmap is still the truth, and we 
+// update it, through the buffer cache, as we allocate and free.
+//
+// Each group has its own lock, which protects its trees, its counts, and 
+// the bits of the bitmap that cover it.  Nothing ever holds two group locks 
+// at once.  Groups are sized so that two groups never share a byte of the 
+// bitmap and, on volumes big enough to have more than one bitmap block per 
+// group, never share a bitmap block, so the buffer cache doesn't serialise 
+// them either.  Allocating a file's first blocks starts in the group that 
+// belongs to the current CPU, and extending a file starts in the group that 
+// holds its last extent, so threads that are writing different files on 
+// different CPUs usually work in different groups and never contend.
+//
+// Reading the whole bitmap to build the trees would make mounting take 
+// time in proportion to the size of the volume, so a group's trees are 
+// built (AllocGroupLoad) the first time that something allocates or frees 
+// blocks in it, and the flusher loads the others in the background, one 
+// group per pass.  Until then, fLargestFree is the size of the group, so 
+// EmptyFSMountAllocBlocks still tries it.  A group's bitmap doesn't change 
+// until it's loaded, so the free blocks in the groups that haven't been 
+// loaded are the superblock's count, less what the loaded groups found, 
+// and that's how EmptyFSMountJournalCounts counts them.  Loading a group 
+// takes fAllocLock and then the group's lock.
+//
+// Each allocation (EmptyFSMountAllocBlocks) tries, in order:
+//
+//   1. to extend the file in place: if the block right after its last 
+//      extent (the hint) is free, we take the free extent that starts there
+//   2. the smallest free extent in the preferred group that's big enough 
+//      for the whole request (best fit)
+//   3. the same in each of the other groups
+//   4. the biggest free extent on the volume, which is less than was asked 
+//      for; the caller asks again for the rest, starting at the block after 
+//      it, so that if that's the start of the next group, and it's free, 
+//      the file's extent carries on into the next group
+//
+// Combined with delayed allocation (see "Delayed Allocation Notes"), which 
+// asks for as much of the file as has been written since it was last 
+// flushed, this puts most files in one extent, and big files in as few as 
+// the free space allows.  Files can also reserve space in advance with 
+// VNOPAllocate (F_PREALLOCATE).
+//
+// The callers must already have reserved the space with 
+// EmptyFSMountCounterReserve, so these routines don't touch the volume 
+// counters; if the search fails despite the reservation, the counters and 
+// the bitmap disagree, and we return ENOSPC.  Likewise, the routines that 
+// free space don't touch the counters, because some of their callers are 
+// undoing an allocation that they still hold a reservation for.
+//
+// File records are allocated from the file table with the volume's 
+// fAllocLock held.  We don't keep a map of free records; the search is first 
+// fit, starting from a hint that's just past the last record we allocated.
+//
+// On a volume with a lazily initialised file table (see "Lazy File Table" in 
+// "EmptyFSFormat.h"), the records from fFileTableInitCount on are free, and 
+// EmptyFSMountReadFileRecord says so without reading them.  Before we hand 
+// one out, EmptyFSMountFileTableInit zeroes the file table up to the end of 
+// the next kFileTableInitChunk blocks, with synchronous writes that bypass 
+// the journal (zeros are what the blocks should hold whatever happens), 
+// flushes the device's cache, raises fFileTableInitCount, and writes the 
+// superblock that records it, putting the count back if that fails.  So 
+// the record itself, which goes through the journal as usual, is never 
+// written to a block that the superblock on disk says is uninitialised, 
+// and a thread that sees the new count without taking fAllocLock reads 
+// zeros from the blocks that it covers.  The flusher initialises one chunk 
+// per pass in the background, so that most allocations never wait for it, 
+// and the first superblock written after the whole table is initialised 
+// clears the feature.
+//
+// Blocks that are allocated for file data or directories aren't marked 
+// in the bitmap straight away.  They're taken out of the trees, and counted 
+// in the group's fUnmarkedBlocks, and FSNodeWriteRecord marks them when it 
+// writes the record that points to them, in the same transaction (see 
+// "Journal Notes").  So a crash never leaves blocks marked as in use that no 
+// file owns.  Blocks that are freed on a journalled volume are unmarked 
+// straight away, but are counted in fPendingFreeBlocks, rather than going 
+// back into the trees, until the journal says that they can be reused.  For 
+// each group, fFreeBlocks + fUnmarkedBlocks + fPendingFreeBlocks is the 
+// number of clear bits in its part of the bitmap.
+//
+// Everything here is written with buf_bdwrite, via 
+// EmptyFSMountModifyMetaBlockEnd.  On a journalled volume, the journal 
+// orders those writes.  Otherwise nothing orders them with respect to each 
+// other, or to the file data, so a crash can leave the volume inconsistent. 
+// That's what the superblock's clean flag is for; see VFSOPMount.
+
+// A BitmapCursor holds on to the bitmap block that the last bit was in, 
+// much like a FileTableCursor.  Initialise it to all zeros, and call 
+// BitmapCursorDone when you're finished with it, which writes the block 
+// if you changed it.  If you're going to change the bitmap, tell 
+// BitmapCursorSeek, so that it can add each block to the running 
+// transaction before you change it; that needs a transaction handle.
+
+struct BitmapCursor {
+    buf_t       fBuffer;                // the bitmap block, or NULL
+    uint64_t    fIndex;                 // index of fBuffer within the bitmap; meaningless if it's NULL
+    boolean_t   fDirty;                 // true if fBuffer has been modified
+};
+typedef struct BitmapCursor BitmapCursor;
+
+static void BitmapCursorDone(EmptyFSMount *mtmp, BitmapCursor *cursor)
+    // Releases the buffer, if any, held by cursor, writing it if it's dirty.
+{
+    assert(mtmp != NULL);
+    assert(cursor != NULL);
+
+    if (cursor->fBuffer != NULL) {
+        if (cursor->fDirty) {
+            EmptyFSMountModifyMetaBlockEnd(mtmp, cursor->fBuffer);
+        } else {
+            buf_brelse(cursor->fBuffer);
+        }
+        cursor->fBuffer = NULL;
+        cursor->fDirty  = FALSE;
+    }
+}
+
+static errno_t BitmapCursorSeek(
+    EmptyFSMount *  mtmp, 
+    BitmapCursor *  cursor, 
+    uint64_t        block, 
+    boolean_t       forWrite, 
+    uint8_t **      bytePtr, 
+    uint8_t *       maskPtr
+)
+    // Makes sure that cursor holds the bitmap block that covers block, and 
+    // returns a pointer to the byte, and the bit within that byte, for block. 
+    // If forWrite is true, the block is ready to be changed.
+{
+    errno_t     err;
+    uint64_t    bitsPerBlock;
+    uint64_t    index;
+    uint64_t    bit;
+
+    assert(mtmp != NULL);
+    assert(cursor != NULL);
+    assert(block < mtmp->fSuperblock.fBlockCount);
+    assert(bytePtr != NULL);
+    assert(maskPtr != NULL);
+
+    bitsPerBlock = (uint64_t) mtmp->fBlockSize * 8;
+    index = block / bitsPerBlock;
+
+    err = 0;
+    if ( (cursor->fBuffer == NULL) || (cursor->fIndex != index) ) {
+        BitmapCursorDone(mtmp, cursor);
+        err = EmptyFSMountReadMetaBlock(mtmp, mtmp->fSuperblock.fBitmapStart + index, &cursor->fBuffer);
+        if ( (err == 0) && forWrite ) {
+            err = EmptyFSMountModifyMetaBlockStart(mtmp, mtmp->fSuperblock.fBitmapStart + index, &cursor->fBuffer);
+        }
+        cursor->fIndex = index;
+    }
+    if (err == 0) {
+        bit = block % bitsPerBlock;
+        *bytePtr = ((uint8_t *) buf_dataptr(cursor->fBuffer)) + (bit / 8);
+        *maskPtr = (uint8_t) (1 << (bit % 8));
+    }
+    return err;
+}
+
+static errno_t EmptyFSMountMarkBlocks(EmptyFSMount *mtmp, uint64_t start, uint64_t count, boolean_t inUse, uint64_t *doneCountPtr)
+    // Sets (if inUse is true) or clears the bitmap bits for count blocks, 
+    // starting at start, and sets *doneCountPtr to the number of bits it 
+    // changed, which is less than count only if reading the bitmap failed. 
+    // The caller must hold the lock of the allocation group that contains 
+    // the blocks, and a transaction handle.
+{
+    errno_t         err;
+    uint64_t        index;
+    BitmapCursor    cursor;
+    uint8_t *       bytePtr;
+    uint8_t         mask;
+
+    assert(mtmp != NULL);
+    assert(start >= mtmp->fSuperblock.fDataStart);
+    assert(count <= (mtmp->fSuperblock.fBlockCount - start));
+    assert(doneCountPtr != NULL);
+
+    memset(&cursor, 0, sizeof(cursor));
+
+    err = 0;
+    for (index = 0; index < count; index++) {
+        err = BitmapCursorSeek(mtmp, &cursor, start + index, TRUE, &bytePtr, &mask);
+        if (err != 0) {
+            break;
+        }
+        if (inUse) {
+            assert( ! (*bytePtr & mask) );
+            *bytePtr |= mask;
+        } else {
+            assert(*bytePtr & mask);
+            *bytePtr &= ~mask;
+        }
+        cursor.fDirty = TRUE;
+    }
+    BitmapCursorDone(mtmp, &cursor);
+    *doneCountPtr = index;
+
+    return err;
+}
+
+// Extent Tree Notes
+// -----------------
+// An ExtentTree is a B-tree (in the original sense: internal nodes hold keys 
+// too) of ExtentKeys, each a pair of 64-bit numbers compared major first. 
+// The by-offset tree's keys are (start, length) and the by-size tree's are 
+// (length, start), so every key is unique.  The tree is a set; there are no 
+// values.  The code is the textbook algorithm (Cormen et al, chapter 18), 
+// which splits full nodes on the way down when inserting and tops up 
+// minimal nodes on the way down when removing, so neither ever has to back 
+// up the tree.
+//
+// Inserting can need a new node at each level, plus a new root, and we 
+// don't want to fail half way through updating two trees.  So all nodes 
+// come from a list of spare nodes in the allocation group, and 
+// AllocGroupReserveNodes tops up that list, before a group's trees are 
+// changed, with enough nodes for the worst case.  Nodes freed by removals 
+// go back on the list.
+
+enum {
+    kExtentTreeMinDegree = 8,                               // t, in the textbook
+    kExtentTreeMaxKeys   = (2 * kExtentTreeMinDegree) - 1,
+    kExtentTreeMaxSpares = 64                               // free nodes beyond this go back to the system
+};
+
+struct ExtentKey {
+    uint64_t    fMajor;
+    uint64_t    fMinor;
+};
+typedef struct ExtentKey ExtentKey;
+
+struct ExtentTreeNode {
+    uint32_t                fKeyCount;
+    boolean_t               fLeaf;
+    ExtentKey               fKeys[kExtentTreeMaxKeys];
+    struct ExtentTreeNode * fChildren[kExtentTreeMaxKeys + 1];     // unused in a leaf, except that fChildren[0] links the spare list
+};
+typedef struct ExtentTreeNode ExtentTreeNode;
+
+struct ExtentTree {
+    ExtentTreeNode *    fRoot;          // NULL if the tree is empty
+    uint32_t            fHeight;        // 0 if the tree is empty, 1 if the root is a leaf
+};
+typedef struct ExtentTree ExtentTree;
+
+// An AllocGroup is the state for one allocation group.  The groups are 
+// allocated as an array, one per AllocGroupSlot, so that each is at least 
+// a cache line away from the next and groups that are busy on different 
+// CPUs don't fight over cache lines.
+
+struct AllocGroup {
+    lck_mtx_t *         fLock;          // protects everything else here, and the group's bits in the bitmap
+    uint64_t            fStart;         // the group's first block
+    uint64_t            fEnd;           // one past its last block
+    uint64_t            fFreeBlocks;    // total length of the extents in the trees
+    uint64_t            fUnmarkedBlocks;    // blocks allocated but not yet marked in the bitmap
+    uint64_t            fPendingFreeBlocks; // blocks unmarked in the bitmap but not yet in the trees
+    uint64_t volatile   fLargestFree;   // length of the longest of them; also read without fLock, as a hint
+    boolean_t volatile  fLoaded;        // true once the trees have been built; also read without fLock
+    ExtentTree          fByOffset;      // free extents, keyed by (start, length)
+    ExtentTree          fBySize;        // free extents, keyed by (length, start)
+    ExtentTreeNode *    fSpareNodes;    // see "Extent Tree Notes"
+    uint32_t            fSpareCount;
+};
+typedef struct AllocGroup AllocGroup;
+
+union AllocGroupSlot {
+    AllocGroup  fGroup;
+    char        fPad[128];
+};
+
+enum {
+    kAllocGroupMaxCount  = 64,              // one per CPU, but no more than this
+    kAllocGroupMinBlocks = 1024             // don't make groups smaller than this
+};
+
+static int ExtentKeyCompare(const ExtentKey *lhs, const ExtentKey *rhs)
+    // Returns -1, 0 or 1 as lhs is less than, equal to, or greater than rhs.
+{
+    int     result;
+
+    if (lhs->fMajor != rhs->fMajor) {
+        result = (lhs->fMajor < rhs->fMajor) ? -1 : 1;
+    } else if (lhs->fMinor != rhs->fMinor) {
+        result = (lhs->fMinor < rhs->fMinor) ? -1 : 1;
+    } else {
+        result = 0;
+    }
+    return result;
+}
+
+static uint32_t ExtentTreeNodeSearch(const ExtentTreeNode *node, const ExtentKey *key, boolean_t after)
+    // Returns the index of the first key in node that's greater than or 
+    // equal to key or, if after is true, just greater than key.  The 
+    // nodes are small, so a linear search is as fast as anything.
+{
+    uint32_t    index;
+    int         order;
+
+    for (index = 0; index < node->fKeyCount; index++) {
+        order = ExtentKeyCompare(&node->fKeys[index], key);
+        if ( (order > 0) || ( (order == 0) && ! after ) ) {
+            break;
+        }
+    }
+    return index;
+}
+
+static ExtentTreeNode * AllocGroupGetNode(AllocGroup *ag, boolean_t leaf)
+    // Takes a node from the group's spare list.  There must be one; see 
+    // AllocGroupReserveNodes.
+{
+    ExtentTreeNode *    node;
+
+    assert(ag->fSpareNodes != NULL);
+
+    node = ag->fSpareNodes;
+    ag->fSpareNodes  = node->fChildren[0];
+    ag->fSpareCount -= 1;
+
+    node->fKeyCount    = 0;
+    node->fLeaf        = leaf;
+    node->fChildren[0] = NULL;
+    return node;
+}
+
+static void AllocGroupPutNode(AllocGroup *ag, ExtentTreeNode *node)
+    // Returns a node that's no longer in a tree to the group's spare list, 
+    // or to the system if the list is long enough already.
+{
+    if (ag->fSpareCount >= kExtentTreeMaxSpares) {
+        OSFree(node, sizeof(*node), gOSMallocTag);
+    } else {
+        node->fChildren[0] = ag->fSpareNodes;
+        ag->fSpareNodes  = node;
+        ag->fSpareCount += 1;
+    }
+}
+
+static errno_t AllocGroupReserveNodes(AllocGroup *ag)
+    // Makes sure that the group's spare list has enough nodes for any 
+    // single change to its free extents: removing an extent and adding up 
+    // to two, in both trees.  Each insertion can need one node per level 
+    // plus one, and the first can make the tree one level taller.
+{
+    errno_t             err;
+    uint32_t            needed;
+    ExtentTreeNode *    node;
+
+    needed = 2 * (ag->fByOffset.fHeight + ag->fBySize.fHeight + 4);
+
+    err = 0;
+    while (ag->fSpareCount < needed) {
+        node = OSMalloc(sizeof(*node), gOSMallocTag);
+        if (node == NULL) {
+            err = ENOMEM;
+            break;
+        }
+        node->fChildren[0] = ag->fSpareNodes;
+        ag->fSpareNodes  = node;
+        ag->fSpareCount += 1;
+    }
+    return err;
+}
+
+static void ExtentTreeSplitChild(AllocGroup *ag, ExtentTreeNode *parent, uint32_t index)
+    // Splits parent's full child at index into two, moving the middle key up 
+    // into parent, which must not be full.
+{
+    ExtentTreeNode *    left;
+    ExtentTreeNode *    right;
+
+    left = parent->fChildren[index];
+    assert(left->fKeyCount == kExtentTreeMaxKeys);
+    assert(parent->fKeyCount < kExtentTreeMaxKeys);
+
+    right = AllocGroupGetNode(ag, left->fLeaf);
+    right->fKeyCount = kExtentTreeMinDegree - 1;
+    memcpy(right->fKeys, &left->fKeys[kExtentTreeMinDegree], right->fKeyCount * sizeof(ExtentKey));
+    if ( ! left->fLeaf ) {
+        memcpy(right->fChildren, &left->fChildren[kExtentTreeMinDegree], kExtentTreeMinDegree * sizeof(ExtentTreeNode *));
+    }
+    left->fKeyCount = kExtentTreeMinDegree - 1;
+
+    memmove(&parent->fChildren[index + 2], &parent->fChildren[index + 1], (parent->fKeyCount - index) * sizeof(ExtentTreeNode *));
+    parent->fChildren[index + 1] = right;
+    memmove(&parent->fKeys[index + 1], &parent->fKeys[index], (parent->fKeyCount - index) * sizeof(ExtentKey));
+    parent->fKeys[index] = left->fKeys[kExtentTreeMinDegree - 1];
+    parent->fKeyCount += 1;
+}
+
+static void ExtentTreeInsert(AllocGroup *ag, ExtentTree *tree, const ExtentKey *key)
+    // Adds key, which must not already be there, to tree.
+{
+    ExtentTreeNode *    node;
+    ExtentTreeNode *    newRoot;
+    uint32_t            index;
+
+    if (tree->fRoot == NULL) {
+        tree->fRoot   = AllocGroupGetNode(ag, TRUE);
+        tree->fHeight = 1;
+    } else if (tree->fRoot->fKeyCount == kExtentTreeMaxKeys) {
+        newRoot = AllocGroupGetNode(ag, FALSE);
+        newRoot->fChildren[0] = tree->fRoot;
+        ExtentTreeSplitChild(ag, newRoot, 0);
+        tree->fRoot    = newRoot;
+        tree->fHeight += 1;
+    }
+
+    node = tree->fRoot;
+    while (TRUE) {
+        index = ExtentTreeNodeSearch(node, key, FALSE);
+        assert( (index == node->fKeyCount) || (ExtentKeyCompare(&node->fKeys[index], key) != 0) );
+        if (node->fLeaf) {
+            memmove(&node->fKeys[index + 1], &node->fKeys[index], (node->fKeyCount - index) * sizeof(ExtentKey));
+            node->fKeys[index] = *key;
+            node->fKeyCount += 1;
+            break;
+        }
+        if (node->fChildren[index]->fKeyCount == kExtentTreeMaxKeys) {
+            ExtentTreeSplitChild(ag, node, index);
+            if ( ExtentKeyCompare(key, &node->fKeys[index]) > 0 ) {
+                index += 1;
+            }
+        }
+        node = node->fChildren[index];
+    }
+}
+
+static void ExtentTreeMergeChildren(AllocGroup *ag, ExtentTreeNode *parent, uint32_t index)
+    // Merges parent's children at index and index + 1, and the key between 
+    // them, into the first of them, and frees the second.
+{
+    ExtentTreeNode *    left;
+    ExtentTreeNode *    right;
+
+    left  = parent->fChildren[index];
+    right = parent->fChildren[index + 1];
+    assert( (left->fKeyCount + right->fKeyCount + 1) <= kExtentTreeMaxKeys );
+
+    left->fKeys[left->fKeyCount] = parent->fKeys[index];
+    memcpy(&left->fKeys[left->fKeyCount + 1], right->fKeys, right->fKeyCount * sizeof(ExtentKey));
+    if ( ! left->fLeaf ) {
+        memcpy(&left->fChildren[left->fKeyCount + 1], right->fChildren, (right->fKeyCount + 1) * sizeof(ExtentTreeNode *));
+    }
+    left->fKeyCount += right->fKeyCount + 1;
+
+    memmove(&parent->fKeys[index], &parent->fKeys[index + 1], (parent->fKeyCount - index - 1) * sizeof(ExtentKey));
+    memmove(&parent->fChildren[index + 1], &parent->fChildren[index + 2], (parent->fKeyCount - index - 1) * sizeof(ExtentTreeNode *));
+    parent->fKeyCount -= 1;
+
+    AllocGroupPutNode(ag, right);
+}
+
+static ExtentTreeNode * ExtentTreeFillChild(AllocGroup *ag, ExtentTreeNode *parent, uint32_t index)
+    // Makes sure that parent's child at index has at least kExtentTreeMinDegree 
+    // keys, so that a key can be removed from it, by borrowing a key from a 
+    // sibling or, if neither has one to spare, merging with one.  Returns the 
+    // child that now covers the keys that the child at index did.
+{
+    ExtentTreeNode *    child;
+    ExtentTreeNode *    sibling;
+
+    child = parent->fChildren[index];
+    if (child->fKeyCount >= kExtentTreeMinDegree) {
+        // do nothing
+    } else if ( (index > 0) && (parent->fChildren[index - 1]->fKeyCount >= kExtentTreeMinDegree) ) {
+        sibling = parent->fChildren[index - 1];
+        memmove(&child->fKeys[1], &child->fKeys[0], child->fKeyCount * sizeof(ExtentKey));
+        child->fKeys[0] = parent->fKeys[index - 1];
+        if ( ! child->fLeaf ) {
+            memmove(&child->fChildren[1], &child->fChildren[0], (child->fKeyCount + 1) * sizeof(ExtentTreeNode *));
+            child->fChildren[0] = sibling->fChildren[sibling->fKeyCount];
+        }
+        child->fKeyCount += 1;
+        parent->fKeys[index - 1] = sibling->fKeys[sibling->fKeyCount - 1];
+        sibling->fKeyCount -= 1;
+    } else if ( (index < parent->fKeyCount) && (parent->fChildren[index + 1]->fKeyCount >= kExtentTreeMinDegree) ) {
+        sibling = parent->fChildren[index + 1];
+        child->fKeys[child->fKeyCount] = parent->fKeys[index];
+        if ( ! child->fLeaf ) {
+            child->fChildren[child->fKeyCount + 1] = sibling->fChildren[0];
+            memmove(&sibling->fChildren[0], &sibling->fChildren[1], sibling->fKeyCount * sizeof(ExtentTreeNode *));
+        }
+        child->fKeyCount += 1;
+        parent->fKeys[index] = sibling->fKeys[0];
+        memmove(&sibling->fKeys[0], &sibling->fKeys[1], (sibling->fKeyCount - 1) * sizeof(ExtentKey));
+        sibling->fKeyCount -= 1;
+    } else if (index < parent->fKeyCount) {
+        ExtentTreeMergeChildren(ag, parent, index);
+    } else {
+        ExtentTreeMergeChildren(ag, parent, index - 1);
+        child = parent->fChildren[index - 1];
+    }
+    return child;
+}
+
+static void ExtentTreeRemove(AllocGroup *ag, ExtentTree *tree, const ExtentKey *key)
+    // Removes key, which must be there, from tree.
+{
+    ExtentTreeNode *    node;
+    ExtentTreeNode *    sub;
+    uint32_t            index;
+    ExtentKey           target;
+
+    assert(tree->fRoot != NULL);
+
+    target = *key;
+    node = tree->fRoot;
+    while (TRUE) {
+        index = ExtentTreeNodeSearch(node, &target, FALSE);
+        if ( (index < node->fKeyCount) && (ExtentKeyCompare(&node->fKeys[index], &target) == 0) ) {
+            if (node->fLeaf) {
+                memmove(&node->fKeys[index], &node->fKeys[index + 1], (node->fKeyCount - index - 1) * sizeof(ExtentKey));
+                node->fKeyCount -= 1;
+                break;
+            }
+
+            // The key is in an internal node.  Replace it with its predecessor 
+            // or successor, if the subtree that holds that can spare a key, 
+            // and then go on to remove that from the subtree.  Otherwise merge 
+            // the subtrees around it, which moves it down into the merged node.
+
+            if (node->fChildren[index]->fKeyCount >= kExtentTreeMinDegree) {
+                sub = node->fChildren[index];
+                while ( ! sub->fLeaf ) {
+                    sub = sub->fChildren[sub->fKeyCount];
+                }
+                node->fKeys[index] = sub->fKeys[sub->fKeyCount - 1];
+                target = node->fKeys[index];
+                node = node->fChildren[index];
+            } else if (node->fChildren[index + 1]->fKeyCount >= kExtentTreeMinDegree) {
+                sub = node->fChildren[index + 1];
+                while ( ! sub->fLeaf ) {
+                    sub = sub->fChildren[0];
+                }
+                node->fKeys[index] = sub->fKeys[0];
+                target = node->fKeys[index];
+                node = node->fChildren[index + 1];
+            } else {
+                ExtentTreeMergeChildren(ag, node, index);
+                node = node->fChildren[index];
+            }
+        } else {
+            assert( ! node->fLeaf );            // the key must be there
+            node = ExtentTreeFillChild(ag, node, index);
+        }
+    }
+
+    // If the root is now empty, the tree gets shorter.
+
+    node = tree->fRoot;
+    if (node->fKeyCount == 0) {
+        if (node->fLeaf) {
+            tree->fRoot = NULL;
+        } else {
+            tree->fRoot = node->fChildren[0];
+        }
+        tree->fHeight -= 1;
+        AllocGroupPutNode(ag, node);
+    }
+}
+
+static boolean_t ExtentTreeLowerBound(const ExtentTree *tree, const ExtentKey *key, ExtentKey *foundPtr)
+    // Finds the smallest key in tree that's greater than or equal to key.
+{
+    boolean_t               found;
+    const ExtentTreeNode *  node;
+    uint32_t                index;
+
+    found = FALSE;
+    node = tree->fRoot;
+    while (node != NULL) {
+        index = ExtentTreeNodeSearch(node, key, FALSE);
+        if (index < node->fKeyCount) {
+            *foundPtr = node->fKeys[index];
+            found = TRUE;
+            if ( ExtentKeyCompare(foundPtr, key) == 0 ) {
+                break;
+            }
+        }
+        node = node->fLeaf ? NULL : node->fChildren[index];
+    }
+    return found;
+}
+
+static boolean_t ExtentTreeFloor(const ExtentTree *tree, const ExtentKey *key, ExtentKey *foundPtr)
+    // Finds the largest key in tree that's less than or equal to key.
+{
+    boolean_t               found;
+    const ExtentTreeNode *  node;
+    uint32_t                index;
+
+    found = FALSE;
+    node = tree->fRoot;
+    while (node != NULL) {
+        index = ExtentTreeNodeSearch(node, key, TRUE);
+        if (index > 0) {
+            *foundPtr = node->fKeys[index - 1];
+            found = TRUE;
+            if ( ExtentKeyCompare(foundPtr, key) == 0 ) {
+                break;
+            }
+        }
+        node = node->fLeaf ? NULL : node->fChildren[index];
+    }
+    return found;
+}
+
+static void ExtentTreeFreeNodes(ExtentTreeNode *node)
+    // Frees node and everything below it.
+{
+    uint32_t    index;
+
+    if ( ! node->fLeaf ) {
+        for (index = 0; index <= node->fKeyCount; index++) {
+            ExtentTreeFreeNodes(node->fChildren[index]);
+        }
+    }
+    OSFree(node, sizeof(*node), gOSMallocTag);
+}
+
+static void AllocGroupUpdateLargest(AllocGroup *ag)
+    // Recalculates fLargestFree from the by-size tree.
+{
+    static const ExtentKey  kMaxKey = { UINT64_MAX, UINT64_MAX };
+    ExtentKey               largest;
+
+    if ( ExtentTreeFloor(&ag->fBySize, &kMaxKey, &largest) ) {
+        ag->fLargestFree = largest.fMajor;
+    } else {
+        ag->fLargestFree = 0;
+    }
+}
+
+static void AllocGroupInsertFree(AllocGroup *ag, uint64_t start, uint64_t count)
+    // Adds the extent to both trees, without merging.
+{
+    ExtentKey   key;
+
+    key.fMajor = start;
+    key.fMinor = count;
+    ExtentTreeInsert(ag, &ag->fByOffset, &key);
+    key.fMajor = count;
+    key.fMinor = start;
+    ExtentTreeInsert(ag, &ag->fBySize, &key);
+}
+
+static void AllocGroupRemoveFree(AllocGroup *ag, uint64_t start, uint64_t count)
+    // Removes the extent, which must be there, from both trees.
+{
+    ExtentKey   key;
+
+    key.fMajor = start;
+    key.fMinor = count;
+    ExtentTreeRemove(ag, &ag->fByOffset, &key);
+    key.fMajor = count;
+    key.fMinor = start;
+    ExtentTreeRemove(ag, &ag->fBySize, &key);
+}
+
+static void AllocGroupAddFree(AllocGroup *ag, uint64_t start, uint64_t count)
+    // Records that the count blocks at start, which must lie within the 
+    // group, are free, merging them with the free extents on either side. 
+    // The caller must hold fLock and have called AllocGroupReserveNodes.
+{
+    ExtentKey   key;
+    ExtentKey   neighbour;
+
+    assert( (start >= ag->fStart) && (count != 0) && ((start + count) <= ag->fEnd) );
+
+    ag->fFreeBlocks += count;
+
+    key.fMajor = start;
+    key.fMinor = 0;
+    if ( ExtentTreeFloor(&ag->fByOffset, &key, &neighbour) ) {
+        assert( (neighbour.fMajor + neighbour.fMinor) <= start );
+        if ( (neighbour.fMajor + neighbour.fMinor) == start ) {
+            AllocGroupRemoveFree(ag, neighbour.fMajor, neighbour.fMinor);
+            start  = neighbour.fMajor;
+            count += neighbour.fMinor;
+        }
+    }
+    key.fMajor = start + count;
+    key.fMinor = 0;
+    if ( ExtentTreeLowerBound(&ag->fByOffset, &key, &neighbour) && (neighbour.fMajor == (start + count)) ) {
+        AllocGroupRemoveFree(ag, neighbour.fMajor, neighbour.fMinor);
+        count += neighbour.fMinor;
+    }
+    AllocGroupInsertFree(ag, start, count);
+
+    AllocGroupUpdateLargest(ag);
+}
+
+static void AllocGroupTakeFree(AllocGroup *ag, const ExtentKey *extent, uint64_t start, uint64_t count)
+    // Records that the count blocks at start, which lie within the free 
+    // extent extent (a by-offset key), are in use.  The caller must hold 
+    // fLock and have called AllocGroupReserveNodes.
+{
+    uint64_t    extentEnd;
+
+    extentEnd = extent->fMajor + extent->fMinor;
+    assert( (start >= extent->fMajor) && ((start + count) <= extentEnd) );
+
+    AllocGroupRemoveFree(ag, extent->fMajor, extent->fMinor);
+    if (start > extent->fMajor) {
+        AllocGroupInsertFree(ag, extent->fMajor, start - extent->fMajor);
+    }
+    if ( (start + count) < extentEnd ) {
+        AllocGroupInsertFree(ag, start + count, extentEnd - (start + count));
+    }
+    ag->fFreeBlocks -= count;
+
+    AllocGroupUpdateLargest(ag);
+}
+
+static AllocGroup * EmptyFSMountAllocGroup(EmptyFSMount *mtmp, uint32_t index)
+    // Returns the allocation group at index.
+{
+    assert(index < mtmp->fAllocGroupCount);
+    return &mtmp->fAllocGroups[index].fGroup;
+}
+
+static errno_t AllocGroupLoad(EmptyFSMount *mtmp, AllocGroup *ag)
+    // Builds ag's free extent trees from its part of the bitmap, unless 
+    // that's already been done.  See "Allocation Notes".  The caller must 
+    // not hold fAllocLock, or any group's lock.
+{
+    errno_t         err;
+    uint64_t        block;
+    uint64_t        runEnd;
+    BitmapCursor    cursor;
+    uint8_t *       bytePtr;
+    uint8_t         mask;
+
+    assert(mtmp != NULL);
+    assert(ag != NULL);
+
+    // The fast path.  fLoaded is only set with fLock held, and our caller 
+    // takes fLock before looking at the trees, so this is safe.
+
+    err = 0;
+    if ( ! ag->fLoaded ) {
+        lck_mtx_lock(mtmp->fAllocLock);
+        lck_mtx_lock(ag->fLock);
+
+        // As in the other bitmap scans, we skip a whole byte at a time 
+        // where we can.  The cursor only reads the bitmap, so this doesn't 
+        // need a transaction handle.
+
+        memset(&cursor, 0, sizeof(cursor));
+        block = ag->fStart;
+        while ( ! ag->fLoaded && (err == 0) && (block < ag->fEnd) ) {
+            err = BitmapCursorSeek(mtmp, &cursor, block, FALSE, &bytePtr, &mask);
+            if (err != 0) {
+                break;
+            }
+            if ( (mask == 1) && (*bytePtr == 0xFF) && ((block + 8) <= ag->fEnd) ) {
+                block += 8;
+                continue;
+            }
+            if (*bytePtr & mask) {
+                block += 1;
+                continue;
+            }
+
+            // block is free.  Find the end of the run.
+
+            runEnd = block + 1;
+            while ( runEnd < ag->fEnd ) {
+                err = BitmapCursorSeek(mtmp, &cursor, runEnd, FALSE, &bytePtr, &mask);
+                if (err != 0) {
+                    break;
+                }
+                if ( (mask == 1) && (*bytePtr == 0) && ((runEnd + 8) <= ag->fEnd) ) {
+                    runEnd += 8;
+                } else if ( ! (*bytePtr & mask) ) {
+                    runEnd += 1;
+                } else {
+                    break;
+                }
+            }
+            if (err == 0) {
+                err = AllocGroupReserveNodes(ag);
+            }
+            if (err == 0) {
+                AllocGroupAddFree(ag, block, runEnd - block);
+            }
+            block = runEnd;
+        }
+        BitmapCursorDone(mtmp, &cursor);
+
+        // If that failed, throw away what we built, so that the next caller 
+        // can try again.
+
+        if ( ! ag->fLoaded ) {
+            if (err == 0) {
+
+                // If the superblock's count was wrong, the journal's count 
+                // is off too, but don't make it worse by wrapping.
+
+                if (mtmp->fUnloadedFreeBlocks >= ag->fFreeBlocks) {
+                    mtmp->fUnloadedFreeBlocks -= ag->fFreeBlocks;
+                } else {
+                    mtmp->fUnloadedFreeBlocks = 0;
+                }
+                ag->fLoaded = TRUE;
+            } else {
+                if (ag->fByOffset.fRoot != NULL) {
+                    ExtentTreeFreeNodes(ag->fByOffset.fRoot);
+                }
+                if (ag->fBySize.fRoot != NULL) {
+                    ExtentTreeFreeNodes(ag->fBySize.fRoot);
+                }
+                memset(&ag->fByOffset, 0, sizeof(ag->fByOffset));
+                memset(&ag->fBySize,   0, sizeof(ag->fBySize));
+                ag->fFreeBlocks  = 0;
+                ag->fLargestFree = ag->fEnd - ag->fStart;
+            }
+        }
+
+        lck_mtx_unlock(ag->fLock);
+        lck_mtx_unlock(mtmp->fAllocLock);
+    }
+    return err;
+}
+
+static void EmptyFSMountAllocPreload(EmptyFSMount *mtmp, uint32_t maxGroups)
+    // Loads up to maxGroups allocation groups that haven't been loaded yet. 
+    // Errors are ignored; a group that fails to load is tried again the 
+    // next time that it's needed.
+{
+    uint32_t        index;
+    AllocGroup *    ag;
+
+    assert(mtmp != NULL);
+
+    for (index = 0; (index < mtmp->fAllocGroupCount) && (maxGroups != 0); index++) {
+        ag = EmptyFSMountAllocGroup(mtmp, index);
+        if ( ! ag->fLoaded ) {
+            (void) AllocGroupLoad(mtmp, ag);
+            maxGroups -= 1;
+        }
+    }
+}
+
+// The allocation strategies of AllocGroupAlloc, in the order that 
+// EmptyFSMountAllocBlocks tries them.  See "Allocation Notes".
+
+enum {
+    kAllocExtendOrFit   = 1,            // extend in place at the hint, or the best fit for the whole request
+    kAllocFit           = 2,            // the best fit for the whole request
+    kAllocLargest       = 3             // the largest extent
+};
+
+static errno_t AllocGroupAlloc(
+    EmptyFSMount *  mtmp,
+    AllocGroup *    ag,
+    int             strategy,
+    uint64_t        hint,
+    uint64_t        wanted,
+    boolean_t       mark,
+    uint64_t *      startPtr,
+    uint64_t *      countPtr
+)
+    // Tries to allocate up to wanted blocks from ag, using strategy, and, 
+    // if mark is true, marks them as in use in the bitmap.  Returns ENOSPC 
+    // if the strategy doesn't find anything.
+{
+    errno_t     err;
+    ExtentKey   key;
+    ExtentKey   extent;
+    boolean_t   found;
+    uint64_t    start;
+    uint64_t    count;
+    uint64_t    marked;
+
+    err = AllocGroupLoad(mtmp, ag);
+
+    lck_mtx_lock(ag->fLock);
+
+    if (err == 0) {
+        err = AllocGroupReserveNodes(ag);
+    }
+    if (err == 0) {
+        found = FALSE;
+        start = 0;
+        count = 0;
+
+        // Extend in place: the hint is free if it's in a free extent.
+
+        if ( (strategy == kAllocExtendOrFit) && (hint >= ag->fStart) && (hint < ag->fEnd) ) {
+            key.fMajor = hint;
+            key.fMinor = UINT64_MAX;
+            if (    ExtentTreeFloor(&ag->fByOffset, &key, &extent)
+                 && ( (extent.fMajor + extent.fMinor) > hint ) ) {
+                found = TRUE;
+                start = hint;
+                count = extent.fMajor + extent.fMinor - hint;
+            }
+        }
+
+        // Best fit: the smallest extent that's at least wanted blocks long. 
+        // Of those that are the same length, this gets the lowest.
+
+        if ( ! found && (strategy != kAllocLargest) ) {
+            key.fMajor = wanted;
+            key.fMinor = 0;
+            if ( ExtentTreeLowerBound(&ag->fBySize, &key, &extent) ) {
+                found = TRUE;
+                start = extent.fMinor;
+                count = extent.fMajor;
+                extent.fMajor = start;
+                extent.fMinor = count;
+            }
+        }
+
+        // Largest: the last key in the by-size tree.
+
+        if ( ! found && (strategy == kAllocLargest) && (ag->fLargestFree != 0) ) {
+            key.fMajor = UINT64_MAX;
+            key.fMinor = UINT64_MAX;
+            found = ExtentTreeFloor(&ag->fBySize, &key, &extent);
+            assert(found);
+            start = extent.fMinor;
+            count = extent.fMajor;
+            extent.fMajor = start;
+            extent.fMinor = count;
+        }
+
+        if ( ! found ) {
+            err = ENOSPC;
+        } else {
+            if (count > wanted) {
+                count = wanted;
+            }
+            if (mark) {
+                err = EmptyFSMountMarkBlocks(mtmp, start, count, TRUE, &marked);
+            } else {
+                ag->fUnmarkedBlocks += count;
+                marked = count;
+            }
+
+            // A read error part way through just ends the run, as long as 
+            // we got at least one block.
+            
+            if (marked != 0) {
+                err = 0;
+                AllocGroupTakeFree(ag, &extent, start, marked);
+                *startPtr = start;
+                *countPtr = marked;
+            }
+        }
+    }
+
+    lck_mtx_unlock(ag->fLock);
+
+    return err;
+}
+
+static errno_t EmptyFSMountAllocBlocks(
+    EmptyFSMount *  mtmp,
+    uint64_t        hint,
+    uint64_t        wanted,
+    boolean_t       mark,
+    uint64_t *      startPtr,
+    uint64_t *      countPtr
+)
+    // Allocates a run of up to wanted blocks, and no more than an extent can 
+    // hold.  The run may be shorter than wanted if the free space is 
+    // fragmented.  hint is the block that the caller would most like 
+    // the run to start at (typically the one after the file's last extent), 
+    // or zero if it has no preference.  The caller must have reserved the 
+    // blocks; see "Allocation Notes".  If mark is true, the blocks are 
+    // marked in the bitmap, which needs a transaction handle; otherwise 
+    // the caller must mark them later, with EmptyFSMountMarkAllocated.
+{
+    errno_t         err;
+    uint32_t        groupCount;
+    uint32_t        first;
+    uint32_t        index;
+    uint32_t        attempt;
+    uint64_t        largest;
+    AllocGroup *    ag;
+    AllocGroup *    best;
+
+    assert(mtmp != NULL);
+    assert(mtmp->fWritable);
+    assert(wanted != 0);
+    assert(startPtr != NULL);
+    assert(countPtr != NULL);
+
+    if (wanted > UINT32_MAX) {
+        wanted = UINT32_MAX;
+    }
+
+    groupCount = mtmp->fAllocGroupCount;
+    if ( (hint >= mtmp->fSuperblock.fDataStart) && (hint < mtmp->fSuperblock.fBlockCount) ) {
+        first = (uint32_t) (hint / mtmp->fAllocGroupBlocks);
+    } else {
+        first = (uint32_t) cpu_number() % groupCount;
+    }
+
+    // Try the preferred group, then any group that looks like it has an 
+    // extent big enough for the whole request.  fLargestFree can change 
+    // as soon as we look at it, but it's only a hint; AllocGroupAlloc 
+    // checks again with the lock held.
+
+    err = AllocGroupAlloc(mtmp, EmptyFSMountAllocGroup(mtmp, first), kAllocExtendOrFit, hint, wanted, mark, startPtr, countPtr);
+    for (index = 1; (err == ENOSPC) && (index < groupCount); index++) {
+        ag = EmptyFSMountAllocGroup(mtmp, (first + index) % groupCount);
+        if (ag->fLargestFree >= wanted) {
+            err = AllocGroupAlloc(mtmp, ag, kAllocFit, hint, wanted, mark, startPtr, countPtr);
+        }
+    }
+
+    // No group can satisfy the whole request in one extent, so take the 
+    // biggest extent there is.  For that, fLargestFree has to be real, so 
+    // load any groups that haven't been loaded.  We may race with other 
+    // threads for the extent, so try a few times before giving up.
+
+    if (err == ENOSPC) {
+        EmptyFSMountAllocPreload(mtmp, groupCount);
+    }
+    for (attempt = 0; (err == ENOSPC) && (attempt < groupCount); attempt++) {
+        best = NULL;
+        largest = 0;
+        for (index = 0; index < groupCount; index++) {
+            ag = EmptyFSMountAllocGroup(mtmp, (first + index) % groupCount);
+            if (ag->fLargestFree > largest) {
+                best = ag;
+                largest = ag->fLargestFree;
+            }
+        }
+        if (best == NULL) {
+            break;
+        }
+        err = AllocGroupAlloc(mtmp, best, kAllocLargest, hint, wanted, mark, startPtr, countPtr);
+    }
+
+    assert( (err != 0) || ( (*countPtr != 0) && (*countPtr <= wanted) ) );
+
+    return err;
+}
+
+// Options for EmptyFSMountFreeBlocks.
+
+enum {
+    kFreeBlocksUnmarked = 0x1,          // the blocks were never marked in the bitmap
+    kFreeBlocksRelease  = 0x2,          // add them to the free block counter, too
+    kFreeBlocksMetadata = 0x4           // they held metadata; see "Journal Notes"
+};
+
+static errno_t EmptyFSMountFreeBlocks(EmptyFSMount *mtmp, uint64_t start, uint64_t count, uint32_t options)
+    // Frees count blocks, starting at start.  If options contains 
+    // kFreeBlocksUnmarked, the blocks were allocated but never marked in 
+    // the bitmap, so this just puts them back in the trees; otherwise it 
+    // clears their bits, which needs a transaction handle.  Unless options 
+    // contains kFreeBlocksRelease, this doesn't add them to the free block 
+    // counter, because the caller is undoing an allocation that it still 
+    // holds a reservation for; see "Allocation Notes".
+    //
+    // On a journalled volume, blocks that were marked and are being 
+    // released don't become free until the journal says so, and 
+    // kFreeBlocksMetadata says how long that takes.  If this fails, some or 
+    // all of the blocks are still marked as in use.
+{
+    errno_t         err;
+    AllocGroup *    ag;
+    uint64_t        thisCount;
+    uint64_t        cleared;
+    boolean_t       defer;
+    JournalFree *   jf;
+
+    assert(mtmp != NULL);
+    assert(mtmp->fWritable);
+    assert(start >= mtmp->fSuperblock.fDataStart);
+    assert(count <= (mtmp->fSuperblock.fBlockCount - start));
+    AssertKnownFlags(options, kFreeBlocksUnmarked | kFreeBlocksRelease | kFreeBlocksMetadata);
+
+    defer = (mtmp->fJournal != NULL) && (options & kFreeBlocksRelease) && ! (options & kFreeBlocksUnmarked);
+
+    // The run can cross from one group into the next, so free it a group 
+    // at a time.
+
+    err = 0;
+    while ( (err == 0) && (count != 0) ) {
+        ag = EmptyFSMountAllocGroup(mtmp, (uint32_t) (start / mtmp->fAllocGroupBlocks));
+        thisCount = ag->fEnd - start;
+        if (thisCount > count) {
+            thisCount = count;
+        }
+
+        jf = NULL;
+        if (defer) {
+            jf = OSMalloc(sizeof(*jf), gOSMallocTag);
+            if (jf == NULL) {
+                err = ENOMEM;
+                break;
+            }
+        }
+
+        // If the group isn't loaded, we have to load it first; otherwise 
+        // loading it later would find these blocks free.
+
+        cleared = 0;
+        err = AllocGroupLoad(mtmp, ag);
+        lck_mtx_lock(ag->fLock);
+        if (err == 0) {
+            err = AllocGroupReserveNodes(ag);
+        }
+        if (err == 0) {
+            if (options & kFreeBlocksUnmarked) {
+                assert(ag->fUnmarkedBlocks >= thisCount);
+                ag->fUnmarkedBlocks -= thisCount;
+                AllocGroupAddFree(ag, start, thisCount);
+                cleared = thisCount;
+            } else {
+                err = EmptyFSMountMarkBlocks(mtmp, start, thisCount, FALSE, &cleared);
+                if ( (cleared != 0) && (jf != NULL) ) {
+                    ag->fPendingFreeBlocks += cleared;
+                } else if (cleared != 0) {
+                    AllocGroupAddFree(ag, start, cleared);
+                }
+            }
+        }
+        lck_mtx_unlock(ag->fLock);
+
+        if ( (jf != NULL) && (cleared != 0) ) {
+            jf->fStart    = start;
+            jf->fCount    = cleared;
+            jf->fMetadata = (options & kFreeBlocksMetadata) != 0;
+            EmptyFSMountJournalDeferFree(mtmp, jf);
+        } else {
+            if (jf != NULL) {
+                OSFree(jf, sizeof(*jf), gOSMallocTag);
+            }
+            if ( (options & kFreeBlocksRelease) && (cleared != 0) ) {
+                EmptyFSMountCounterAdjust(mtmp, kVolumeCounterFreeBlocks, (int64_t) cleared);
+            }
+        }
+
+        start += thisCount;
+        count -= thisCount;
+    }
+    return err;
+}
+
+static void EmptyFSMountReleaseFrees(EmptyFSMount *mtmp, JournalFree *frees)
+    // Returns the blocks of a list of pending frees, which the journal has 
+    // decided can be reused, to their allocation groups and the free block 
+    // counter, and frees the list.  The caller must not hold any locks.
+{
+    JournalFree *   jf;
+    AllocGroup *    ag;
+
+    assert(mtmp != NULL);
+
+    while ( (jf = frees) != NULL ) {
+        frees = jf->fNext;
+
+        // A pending free never crosses a group boundary; see 
+        // EmptyFSMountFreeBlocks.  If we can't get the tree nodes, the 
+        // blocks are leaked until the next mount, which is better than 
+        // losing them altogether.
+
+        ag = EmptyFSMountAllocGroup(mtmp, (uint32_t) (jf->fStart / mtmp->fAllocGroupBlocks));
+        lck_mtx_lock(ag->fLock);
+        assert(ag->fLoaded);
+        assert(ag->fPendingFreeBlocks >= jf->fCount);
+        if ( AllocGroupReserveNodes(ag) == 0 ) {
+            ag->fPendingFreeBlocks -= jf->fCount;
+            AllocGroupAddFree(ag, jf->fStart, jf->fCount);
+            lck_mtx_unlock(ag->fLock);
+
+            EmptyFSMountCounterAdjust(mtmp, kVolumeCounterFreeBlocks, (int64_t) jf->fCount);
+        } else {
+            lck_mtx_unlock(ag->fLock);
+        }
+        OSFree(jf, sizeof(*jf), gOSMallocTag);
+    }
+}
+
+static errno_t EmptyFSMountMarkAllocated(EmptyFSMount *mtmp, uint64_t start, uint64_t count, uint64_t *doneCountPtr)
+    // Marks count blocks, starting at start, which were allocated without 
+    // being marked, as in use in the bitmap.  Sets *doneCountPtr to the 
+    // number of blocks that were marked, which is less than count only on 
+    // error.  The caller must hold a transaction handle.
+{
+    errno_t         err;
+    AllocGroup *    ag;
+    uint64_t        thisCount;
+    uint64_t        marked;
+
+    assert(mtmp != NULL);
+    assert(mtmp->fWritable);
+    assert(start >= mtmp->fSuperblock.fDataStart);
+    assert(count <= (mtmp->fSuperblock.fBlockCount - start));
+    assert(doneCountPtr != NULL);
+
+    *doneCountPtr = 0;
+    err = 0;
+    while ( (err == 0) && (count != 0) ) {
+        ag = EmptyFSMountAllocGroup(mtmp, (uint32_t) (start / mtmp->fAllocGroupBlocks));
+        thisCount = ag->fEnd - start;
+        if (thisCount > count) {
+            thisCount = count;
+        }
+
+        lck_mtx_lock(ag->fLock);
+        assert(ag->fLoaded);
+        err = EmptyFSMountMarkBlocks(mtmp, start, thisCount, TRUE, &marked);
+        assert(ag->fUnmarkedBlocks >= marked);
+        ag->fUnmarkedBlocks -= marked;
+        lck_mtx_unlock(ag->fLock);
+
+        *doneCountPtr += marked;
+        start += thisCount;
+        count -= thisCount;
+    }
+    return err;
+}
+
+static void EmptyFSMountJournalCounts(EmptyFSMount *mtmp, uint64_t counts[kJournalCountCount])
+    // Gets the volume's counts, as they should be recorded in the journal 
+    // (see "Journal Notes").  The free block count is the number of clear 
+    // bits in the bitmap, which isn't the same as the free block counter: 
+    // that leaves out blocks that are reserved, or waiting to be freed. 
+    // Likewise, the free file count comes from the file table, not the 
+    // counter.  Called by EmptyFSMountJournalCommit with the barrier up, 
+    // so no one is changing the bitmap, the file table or the orphan list.  Holding 
+    // fAllocLock stops groups being loaded while we add them up.
+{
+    uint64_t        values[kVolumeCounterCount];
+    uint64_t        freeBlocks;
+    uint32_t        index;
+    AllocGroup *    ag;
+
+    assert(mtmp != NULL);
+
+    EmptyFSMountGetCounters(mtmp, values);
+
+    lck_mtx_lock(mtmp->fAllocLock);
+
+    freeBlocks = mtmp->fUnloadedFreeBlocks;
+    for (index = 0; index < mtmp->fAllocGroupCount; index++) {
+        ag = EmptyFSMountAllocGroup(mtmp, index);
+        lck_mtx_lock(ag->fLock);
+        if (ag->fLoaded) {
+            freeBlocks += ag->fFreeBlocks + ag->fUnmarkedBlocks + ag->fPendingFreeBlocks;
+        }
+        lck_mtx_unlock(ag->fLock);
+    }
+    counts[kVolumeCounterFreeBlocks] = freeBlocks;
+    counts[kVolumeCounterFreeFiles] = mtmp->fFreeFileRecords;
+
+    lck_mtx_unlock(mtmp->fAllocLock);
+
+    counts[kVolumeCounterDirectories] = values[kVolumeCounterDirectories];
+    counts[kJournalCountOrphans]      = mtmp->fOrphanFileNum;
+}
+
+static errno_t EmptyFSMountAllocInit(EmptyFSMount *mtmp)
+    // Sets up the allocation groups for a writable volume.  It doesn't 
+    // read the bitmap; each group's free extent trees are built when it's 
+    // first used.  See "Allocation Notes".
+{
+    errno_t         err;
+    uint64_t        blockCount;
+    uint64_t        dataStart;
+    uint64_t        groupBlocks;
+    uint64_t        bitsPerBlock;
+    uint32_t        groupCount;
+    uint32_t        index;
+    AllocGroup *    ag;
+
+    assert(mtmp != NULL);
+    assert(mtmp->fWritable);
+    assert(mtmp->fAllocGroups == NULL);
+
+    blockCount   = mtmp->fSuperblock.fBlockCount;
+    dataStart    = mtmp->fSuperblock.fDataStart;
+    bitsPerBlock = (uint64_t) mtmp->fBlockSize * 8;
+
+    // Work out the geometry.  Groups are numbered from block zero, so that 
+    // finding a block's group is a division, which means that the first 
+    // group loses the blocks before dataStart.  Each group is a whole 
+    // number of bitmap bytes or, if it's big enough, bitmap blocks; see 
+    // "Allocation Notes".  We want a group per CPU, so that threads on 
+    // different CPUs start in different groups, unless that would make 
+    // the groups too small.
+
+    groupCount = ml_get_max_cpus();
+    if (groupCount > kAllocGroupMaxCount) {
+        groupCount = kAllocGroupMaxCount;
+    }
+    if ( (blockCount / kAllocGroupMinBlocks) < groupCount ) {
+        groupCount = (uint32_t) (blockCount / kAllocGroupMinBlocks);
+    }
+    if (groupCount == 0) {
+        groupCount = 1;
+    }
+    groupBlocks = (blockCount + groupCount - 1) / groupCount;
+    if (groupBlocks >= bitsPerBlock) {
+        groupBlocks = ((groupBlocks + bitsPerBlock - 1) / bitsPerBlock) * bitsPerBlock;
+    } else {
+        groupBlocks = (groupBlocks + 7) & ~ (uint64_t) 7;
+    }
+    if (groupBlocks <= dataStart) {
+        groupBlocks = blockCount;           // a volume that's nearly all metadata; don't bother
+    }
+    groupCount = (uint32_t) ((blockCount + groupBlocks - 1) / groupBlocks);
+
+    err = 0;
+    mtmp->fAllocGroups = OSMalloc(groupCount * sizeof(union AllocGroupSlot), gOSMallocTag);
+    if (mtmp->fAllocGroups == NULL) {
+        err = ENOMEM;
+    } else {
+        memset(mtmp->fAllocGroups, 0, groupCount * sizeof(union AllocGroupSlot));
+        mtmp->fAllocGroupCount  = groupCount;
+        mtmp->fAllocGroupBlocks = groupBlocks;
+        for (index = 0; index < groupCount; index++) {
+            ag = EmptyFSMountAllocGroup(mtmp, index);
+            ag->fStart = (index * groupBlocks < dataStart) ? dataStart : (index * groupBlocks);
+            ag->fEnd   = ((index + 1) * groupBlocks > blockCount) ? blockCount : ((index + 1) * groupBlocks);
+            ag->fLargestFree = ag->fEnd - ag->fStart;
+            ag->fLock  = lck_mtx_alloc_init(gLockGroup, LCK_ATTR_NULL);
+            if (ag->fLock == NULL) {
+                err = ENOMEM;
+            }
+        }
+        mtmp->fUnloadedFreeBlocks = mtmp->fSuperblock.fFreeBlockCount;
+    }
+
+    return err;
+}
+
+static void EmptyFSMountAllocTerm(EmptyFSMount *mtmp)
+    // Undoes EmptyFSMountAllocInit.
+{
+    uint32_t            index;
+    AllocGroup *        ag;
+    ExtentTreeNode *    node;
+
+    assert(mtmp != NULL);
+
+    if (mtmp->fAllocGroups != NULL) {
+        for (index = 0; index < mtmp->fAllocGroupCount; index++) {
+            ag = EmptyFSMountAllocGroup(mtmp, index);
+            if (ag->fByOffset.fRoot != NULL) {
+                ExtentTreeFreeNodes(ag->fByOffset.fRoot);
+            }
+            if (ag->fBySize.fRoot != NULL) {
+                ExtentTreeFreeNodes(ag->fBySize.fRoot);
+            }
+            while ( (node = ag->fSpareNodes) != NULL ) {
+                ag->fSpareNodes = node->fChildren[0];
+                OSFree(node, sizeof(*node), gOSMallocTag);
+            }
+            if (ag->fLock != NULL) {
+                lck_mtx_free(ag->fLock, gLockGroup);
+            }
+        }
+        OSFree(mtmp->fAllocGroups, mtmp->fAllocGroupCount * sizeof(union AllocGroupSlot), gOSMallocTag);
+        mtmp->fAllocGroups = NULL;
+        mtmp->fAllocGroupCount = 0;
+    }
+}
+
+enum {
+    kFileTableInitChunk     = 256,          // file table blocks that we initialise at a time
+    kFileTableInitIOSize    = 64 * 1024     // biggest write that we make while doing it
+};
+
+static errno_t EmptyFSMountFileTableInit(EmptyFSMount *mtmp, uint32_t fileNum)
+    // Extends the initialised part of the file table so that it includes 
+    // the record for fileNum, rounding up to a whole kFileTableInitChunk 
+    // blocks.  If fileNum is already initialised, this does nothing.  The 
+    // caller must hold fAllocLock.  See "Allocation Notes".
+    //
+    // Nothing else has these blocks in the buffer cache, because no one 
+    // reads past fFileTableInitCount, so we can write runs of them with 
+    // one buffer, and invalidate it afterwards, as the journal does.
+{
+    errno_t                     err;
+    const EmptyFSSuperblock *   sb;
+    uint32_t                    perBlock;
+    uint64_t                    block;
+    uint64_t                    limit;
+    uint32_t                    run;
+    uint32_t                    maxRun;
+    uint32_t                    oldCount;
+    buf_t                       bp;
+
+    assert(mtmp != NULL);
+    assert(mtmp->fWritable);
+
+    sb = &mtmp->fSuperblock;
+    perBlock = EmptyFSFileRecordsPerBlock(sb);
+
+    err = 0;
+    if (fileNum >= mtmp->fFileTableInitCount) {
+        assert(fileNum < sb->fFileCount);
+        assert(sb->fROCompatFeatures & kEmptyFSROCompatLazyFileTable);
+        
+        block = mtmp->fFileTableInitCount / perBlock;
+        limit = ((fileNum / perBlock) + kFileTableInitChunk) / kFileTableInitChunk * kFileTableInitChunk;
+        if (limit > sb->fFileTableBlocks) {
+            limit = sb->fFileTableBlocks;
+        }
+        maxRun = kFileTableInitIOSize / mtmp->fBlockSize;
+        if (maxRun == 0) {
+            maxRun = 1;
+        }
+        while ( (err == 0) && (block < limit) ) {
+            run = ( (limit - block) < maxRun ) ? (uint32_t) (limit - block) : maxRun;
+            bp = buf_getblk(
+                mtmp->fBlockDevVNode, 
+                (daddr64_t) ((sb->fFileTableStart + block) * mtmp->fDevBlocksPerBlock), 
+                (int) (run * mtmp->fBlockSize), 
+                0, 
+                0, 
+                BLK_META
+            );
+            assert(bp != NULL);
+            buf_clear(bp);
+            buf_markinvalid(bp);
+            err = buf_bwrite(bp);
+            block += run;
+        }
+
+        // The zeros must be on the disk before a superblock that counts them, 
+        // and the superblock must be on the disk before anyone can write a 
+        // record into them.
+
+        if (err == 0) {
+            err = EmptyFSMountSynchronizeCache(mtmp);
+        }
+        if (err == 0) {
+            oldCount = mtmp->fFileTableInitCount;
+            MemoryBarrier();
+            if ( (limit * perBlock) < sb->fFileCount ) {
+                mtmp->fFileTableInitCount = (uint32_t) (limit * perBlock);
+            } else {
+                mtmp->fFileTableInitCount = sb->fFileCount;
+            }
+            err = EmptyFSMountWriteSuperblock(mtmp, FALSE);
+            if (err == 0) {
+                err = EmptyFSMountSynchronizeCache(mtmp);
+            }
+            if (err != 0) {
+                mtmp->fFileTableInitCount = oldCount;
+            }
+        }
+    }
+    return err;
+}
+
+static errno_t EmptyFSMountAllocFileRecord(EmptyFSMount *mtmp, EmptyFSFileRecord *rec, uint32_t *fileNumPtr)
+    // Finds a free file record and writes *rec (in host byte order) to it. 
+    // On return, rec->fGeneration is one more than that of the record's 
+    // previous occupant, so an NFS file handle for the old file (which 
+    // includes its generation) won't find the new one.  The caller must 
+    // have reserved the record; see "Allocation Notes", and must hold a 
+    // transaction handle.
+    //
+    // We don't keep a map of free records, so we search the file table, 
+    // starting at the hint.  The file table cursor means that each file 
+    // table block is only read once.
+{
+    errno_t             err;
+    uint32_t            fileCount;
+    uint32_t            fileNum;
+    uint32_t            scanned;
+    FileTableCursor     cursor;
+    EmptyFSFileRecord   oldRec;
+
+    assert(mtmp != NULL);
+    assert(mtmp->fWritable);
+    assert(rec != NULL);
+    assert(fileNumPtr != NULL);
+
+    fileCount = mtmp->fSuperblock.fFileCount;
+    memset(&cursor, 0, sizeof(cursor));
+
+    lck_mtx_lock(mtmp->fAllocLock);
+
+    fileNum = mtmp->fFileNumHint;
+    err = ENOSPC;
+    for (scanned = 0; scanned < (fileCount - kEmptyFSFirstFileNum); scanned++) {
+        if ( (fileNum < kEmptyFSFirstFileNum) || (fileNum >= fileCount) ) {
+            fileNum = kEmptyFSFirstFileNum;
+        }
+
+        // EmptyFSMountReadFileRecord fills in oldRec even if the record 
+        // is free, which is how we get the old generation.  We step over 
+        // corrupt records (EIO from the validation) rather than fail; 
+        // they're not free, and they're not our problem right now.
+
+        err = EmptyFSMountReadFileRecord(mtmp, &cursor, fileNum, &oldRec);
+        if (err == ENOENT) {
+            err = 0;
+            break;
+        }
+        if ( (err != 0) && (cursor.fBuffer == NULL) ) {
+            break;                          // couldn't read the file table
+        }
+        err = ENOSPC;
+        fileNum += 1;
+    }
+    FileTableCursorDone(&cursor);
+
+    if (err == 0) {
+        err = EmptyFSMountFileTableInit(mtmp, fileNum);
+    }
+    if (err == 0) {
+        rec->fGeneration = oldRec.fGeneration + 1;
+        err = EmptyFSMountWriteFileRecord(mtmp, fileNum, rec);
+    }
+    if (err == 0) {
+        mtmp->fFileNumHint = fileNum + 1;
+        mtmp->fFreeFileRecords -= 1;
+        *fileNumPtr = fileNum;
+    }
+
+    lck_mtx_unlock(mtmp->fAllocLock);
+
+    return err;
+}
+
+static void EmptyFSMountFileTableInitMore(EmptyFSMount *mtmp)
+    // Initialises the next chunk of a lazily initialised file table, if 
+    // there's any left.  Called by the flusher; see "Allocation Notes".
+{
+    errno_t     err;
+
+    assert(mtmp != NULL);
+    assert(mtmp->fWritable);
+
+    if (mtmp->fFileTableInitCount < mtmp->fSuperblock.fFileCount) {
+        lck_mtx_lock(mtmp->fAllocLock);
+        err = EmptyFSMountFileTableInit(mtmp, mtmp->fFileTableInitCount);
+        lck_mtx_unlock(mtmp->fAllocLock);
+        if (err != 0) {
+            printf("EmptyFS:EmptyFSMountFileTableInitMore: failed with error %d\n", err);
+        }
+    }
+}
+
+static errno_t EmptyFSMountFreeFileRecord(EmptyFSMount *mtmp, uint64_t fileNum, uint32_t generation)
+    // Marks the file record for fileNum as free.  We keep the generation, 
+    // so that EmptyFSMountAllocFileRecord can increment it.  This doesn't 
+    // add the record to the free file counter.  The caller must hold a 
+    // transaction handle.
+{
+    errno_t             err;
+    EmptyFSFileRecord   rec;
+
+    assert(mtmp != NULL);
+    assert(mtmp->fWritable);
+
+    memset(&rec, 0, sizeof(rec));
+    rec.fGeneration = generation;
+
+    lck_mtx_lock(mtmp->fAllocLock);
+    err = EmptyFSMountWriteFileRecord(mtmp, fileNum, &rec);
+    if (err == 0) {
+        mtmp->fFreeFileRecords += 1;
+    }
+    lck_mtx_unlock(mtmp->fAllocLock);
+
+    return err;
+}
+
+// Orphan Notes
+// ------------
+// A file that's removed while it's open keeps its blocks and its record 
+// until it's closed, when FSNodeFreeUnlinked frees them.  If the system 
+// crashes in between, they'd be lost, so the format has an orphan list 
+// (see "Orphans" in "EmptyFSFormat.h").  VNOPRemove puts the file on the 
+// list, and writes its record, in the same transaction that removes its 
+// last directory entry, and FSNodeFreeUnlinked takes it off in the same 
+// transaction that frees it.  When a writable volume is mounted, 
+// EmptyFSMountOrphanReclaim frees whatever's left on the list.  On a 
+// journalled volume, the head of the list goes through the journal with 
+// the volume counts, so replaying the journal brings the list up to date, 
+// and recovery takes time in proportion to the size of the journal and 
+// the number of orphans, not the size of the volume.  On a volume without 
+// a journal, the head only reaches the disk with the superblock, at 
+// unmount; after a crash, EmptyFSMountRecount rebuilds the list from the 
+// file table instead.
+//
+// We keep a copy of the list in memory (fOrphanHead, an OrphanEntry for 
+// each orphan, in on-disk order) so that we know which record points to 
+// which without reading them.  New orphans go at the front, which changes 
+// only the head (fOrphanFileNum) and the new orphan's own record, which 
+// VNOPRemove writes anyway.  Taking an orphan off the list changes the head 
+// if it's first and, if it isn't, the fNextOrphan of the record in front 
+// of it.  That record belongs to another file that's been removed but is 
+// still open, whose FSNode may have changes that haven't been written, so 
+// we update just that field of the record on disk.  FSNodeWriteRecord fills 
+// in fNextOrphan from the in-memory list, so neither write undoes the other.
+//
+// The list, fOrphanFileNum and the fNextOrphan fields on disk are protected 
+// by fRecordLock, and only change within a transaction handle.  So, while a 
+// commit has the barrier up, no one is changing them, and 
+// EmptyFSMountJournalCounts reads fOrphanFileNum without the lock.
+
+struct OrphanEntry {
+    struct OrphanEntry *    fNext;          // next orphan, in on-disk order
+    uint32_t                fFileNum;       // the orphan's file number
+};
+typedef struct OrphanEntry OrphanEntry;
+
+static OrphanEntry * EmptyFSMountOrphanFind(EmptyFSMount *mtmp, uint32_t fileNum)
+    // Returns fileNum's entry on the orphan list, or NULL if it's not on it. 
+    // The caller must hold fRecordLock.
+{
+    OrphanEntry *   entry;
+
+    assert(mtmp != NULL);
+
+    entry = mtmp->fOrphanHead;
+    while ( (entry != NULL) && (entry->fFileNum != fileNum) ) {
+        entry = entry->fNext;
+    }
+    return entry;
+}
+
+static uint32_t EmptyFSMountOrphanNext(EmptyFSMount *mtmp, uint32_t fileNum)
+    // Returns the file number of the orphan after fileNum on the orphan 
+    // list, which is the right value for fileNum's fNextOrphan.  Returns 
+    // zero if fileNum is last, or isn't on the list.  The caller must hold 
+    // fRecordLock.
+{
+    const OrphanEntry * entry;
+
+    entry = EmptyFSMountOrphanFind(mtmp, fileNum);
+    return ( (entry != NULL) && (entry->fNext != NULL) ) ? entry->fNext->fFileNum : 0;
+}
+
+static void EmptyFSMountOrphanAdd(EmptyFSMount *mtmp, OrphanEntry *entry, uint32_t fileNum)
+    // Puts fileNum at the front of the orphan list, using entry, which the 
+    // caller allocated (with OSMalloc) before it started changing anything, 
+    // so that this can't fail.  The caller must hold fRecordLock and a 
+    // transaction handle, and must write fileNum's record (with 
+    // FSNodeWriteRecordLocked) before it releases them.
+{
+    assert(mtmp != NULL);
+    assert(entry != NULL);
+    assert(EmptyFSMountOrphanFind(mtmp, fileNum) == NULL);
+
+    entry->fFileNum = fileNum;
+    entry->fNext = mtmp->fOrphanHead;
+    mtmp->fOrphanHead = entry;
+    mtmp->fOrphanFileNum = fileNum;
+}
+
+static errno_t EmptyFSMountOrphanRemove(EmptyFSMount *mtmp, uint32_t fileNum)
+    // Takes fileNum off the orphan list.  If it's not first, this rewrites 
+    // the fNextOrphan of the record in front of it; if that fails, fileNum 
+    // stays on the list.  Does nothing if fileNum isn't on the list.  The 
+    // caller must hold fRecordLock and a transaction handle.
+{
+    errno_t             err;
+    OrphanEntry **      entryPtr;
+    OrphanEntry *       entry;
+    OrphanEntry *       prev;
+    FileTableCursor     cursor;
+    EmptyFSFileRecord   rec;
+
+    assert(mtmp != NULL);
+
+    prev = NULL;
+    entryPtr = &mtmp->fOrphanHead;
+    while ( (*entryPtr != NULL) && ((*entryPtr)->fFileNum != fileNum) ) {
+        prev = *entryPtr;
+        entryPtr = &prev->fNext;
+    }
+    entry = *entryPtr;
+
+    err = 0;
+    if ( (entry != NULL) && (prev != NULL) ) {
+        memset(&cursor, 0, sizeof(cursor));
+        err = EmptyFSMountReadFileRecord(mtmp, &cursor, prev->fFileNum, &rec);
+        FileTableCursorDone(&cursor);
+        if (err == 0) {
+            rec.fNextOrphan = (entry->fNext != NULL) ? entry->fNext->fFileNum : 0;
+            err = EmptyFSMountWriteFileRecord(mtmp, prev->fFileNum, &rec);
+        }
+    }
+    if ( (err == 0) && (entry != NULL) ) {
+        *entryPtr = entry->fNext;
+        mtmp->fOrphanFileNum = (mtmp->fOrphanHead != NULL) ? mtmp->fOrphanHead->fFileNum : 0;
+        OSFree(entry, sizeof(*entry), gOSMallocTag);
+    }
+    return err;
+}
+
+static errno_t EmptyFSMountOrphanLoad(EmptyFSMount *mtmp)
+    // Builds the in-memory orphan list of a writable volume from the one on 
+    // disk, which starts at the superblock's fOrphanFileNum.  VFSOPMount 
+    // calls this after the journal has been replayed.  If the list on disk 
+    // is damaged (an entry that's out of range, isn't an orphan, or is 
+    // already on the list), we keep the part before the damage; the rest is 
+    // lost until fsck finds it.  Does nothing if EmptyFSMountRecount has 
+    // already built the list.
+    //
+    // Checking for repeats is quadratic in the length of the list, but the 
+    // list only holds the files that were open, and removed, at the time 
+    // of a crash.
+{
+    errno_t             err;
+    uint32_t            fileNum;
+    OrphanEntry **      tailPtr;
+    OrphanEntry *       entry;
+    FileTableCursor     cursor;
+    EmptyFSFileRecord   rec;
+
+    assert(mtmp != NULL);
+    assert(mtmp->fWritable);
+
+    err = 0;
+    if (mtmp->fOrphanHead == NULL) {
+        memset(&cursor, 0, sizeof(cursor));
+        tailPtr = &mtmp->fOrphanHead;
+        fileNum = mtmp->fSuperblock.fOrphanFileNum;
+        while ( (err == 0) && (fileNum != 0) ) {
+            if (    (EmptyFSMountReadFileRecord(mtmp, &cursor, fileNum, &rec) != 0)
+                 || ((rec.fMode & S_IFMT) == S_IFDIR) 
+                 || (rec.fLinkCount != 0) 
+                 || (EmptyFSMountOrphanFind(mtmp, fileNum) != NULL) ) {
+                printf("EmptyFS:EmptyFSMountOrphanLoad: orphan list is damaged at file %u\n", (unsigned int) fileNum);
+                break;
+            }
+            entry = OSMalloc(sizeof(*entry), gOSMallocTag);
+            if (entry == NULL) {
+                err = ENOMEM;
+            } else {
+                entry->fNext = NULL;
+                entry->fFileNum = fileNum;
+                *tailPtr = entry;
+                tailPtr = &entry->fNext;
+                fileNum = rec.fNextOrphan;
+            }
+        }
+        FileTableCursorDone(&cursor);
+    }
+    mtmp->fOrphanFileNum = (mtmp->fOrphanHead != NULL) ? mtmp->fOrphanHead->fFileNum : 0;
+    return err;
+}
+
+static void EmptyFSMountOrphanTerm(EmptyFSMount *mtmp)
+    // Frees the in-memory orphan list.  Called at unmount; anything that's 
+    // still on the list stays on it on disk, for the next mount to free.
+{
+    OrphanEntry *   entry;
+
+    assert(mtmp != NULL);
+
+    while (mtmp->fOrphanHead != NULL) {
+        entry = mtmp->fOrphanHead;
+        mtmp->fOrphanHead = entry->fNext;
+        OSFree(entry, sizeof(*entry), gOSMallocTag);
+    }
+}
+
+static errno_t EmptyFSMountRecount(EmptyFSMount *mtmp)
+    // Recomputes the superblock's free block, free file and directory 
+    // counts from the bitmap and the file table.  VFSOPMount calls this 
+    // before the volume counters are set up when it's forced to mount a 
+    // volume that wasn't cleanly unmounted, because those counts are only 
+    // written at unmount.  The head of the orphan list is only written at 
+    // unmount too, so this also rebuilds the in-memory orphan list from the 
+    // records whose link count is zero, in file number order, and points 
+    // the superblock's fOrphanFileNum at the first; see "Orphan Notes".  It 
+    // doesn't fix anything else.
+{
+    errno_t             err;
+    const EmptyFSSuperblock * sb;
+    uint64_t            block;
+    uint64_t            freeBlocks;
+    uint32_t            fileNum;
+    uint32_t            freeFiles;
+    uint32_t            dirs;
+    BitmapCursor        bitmapCursor;
+    FileTableCursor     fileCursor;
+    uint8_t *           bytePtr;
+    uint8_t             mask;
+    EmptyFSFileRecord   rec;
+    OrphanEntry **      tailPtr;
+    OrphanEntry *       entry;
+
+    assert(mtmp != NULL);
+    assert(mtmp->fOrphanHead == NULL);
+
+    sb = &mtmp->fSuperblock;
+    memset(&bitmapCursor, 0, sizeof(bitmapCursor));
+    memset(&fileCursor,   0, sizeof(fileCursor));
+
+    err = 0;
+    freeBlocks = 0;
+    for (block = sb->fDataStart; block < sb->fBlockCount; block++) {
+        err = BitmapCursorSeek(mtmp, &bitmapCursor, block, FALSE, &bytePtr, &mask);
+        if (err != 0) {
+            break;
+        }
+        if ( ! (*bytePtr & mask) ) {
+            freeBlocks += 1;
+        }
+    }
+    BitmapCursorDone(mtmp, &bitmapCursor);
+
+    freeFiles = 0;
+    dirs = 0;
+    tailPtr = &mtmp->fOrphanHead;
+    for (fileNum = kEmptyFSFirstFileNum; (err == 0) && (fileNum < sb->fFileCount); fileNum++) {
+        err = EmptyFSMountReadFileRecord(mtmp, &fileCursor, fileNum, &rec);
+        if (err == ENOENT) {
+            freeFiles += 1;
+            err = 0;
+        } else if (err == 0) {
+            if ( (rec.fMode & S_IFMT) == S_IFDIR ) {
+                dirs += 1;
+            } else if ( ((rec.fMode & S_IFMT) != S_IFDIR) && (rec.fLinkCount == 0) ) {
+                entry = OSMalloc(sizeof(*entry), gOSMallocTag);
+                if (entry == NULL) {
+                    err = ENOMEM;
+                } else {
+                    entry->fNext = NULL;
+                    entry->fFileNum = fileNum;
+                    *tailPtr = entry;
+                    tailPtr = &entry->fNext;
+                }
+            }
+        } else if (fileCursor.fBuffer != NULL) {
+            err = 0;                        // corrupt record; count it as in use
+        }
+    }
+    FileTableCursorDone(&fileCursor);
+
+    if (err == 0) {
+        if (    (freeBlocks != sb->fFreeBlockCount) 
+             || (freeFiles  != sb->fFreeFileCount) 
+             || (dirs       != sb->fDirectoryCount) ) {
+            printf("EmptyFS:EmptyFSMountRecount: counts were %llu/%u/%u, now %llu/%u/%u\n", 
+                (unsigned long long) sb->fFreeBlockCount, (unsigned int) sb->fFreeFileCount, (unsigned int) sb->fDirectoryCount, 
+                (unsigned long long) freeBlocks, (unsigned int) freeFiles, (unsigned int) dirs
+            );
+        }
+        mtmp->fSuperblock.fFreeBlockCount = freeBlocks;
+        mtmp->fSuperblock.fFreeFileCount  = freeFiles;
+        mtmp->fSuperblock.fDirectoryCount = dirs;
+        mtmp->fSuperblock.fOrphanFileNum  = (mtmp->fOrphanHead != NULL) ? mtmp->fOrphanHead->fFileNum : 0;
+    }
+    return err;
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Directory Lookup Cache
+
+// VFS has a name cache of its own, and VNOPLookup feeds it (using cache_enter),
+// so most repeated lookups never reach us at all.  However, the VFS name cache
+// is shared by every file system on the system and is sized for the system as
+// a whole, so under a lookup storm (a build, or a find over a large tree) our
+// entries get evicted and the lookups come back to us.  To absorb those without
+// searching the directory on disk, each directory FSNode has a small lookup
+// cache of its own, mapping names to file numbers.  It holds negative entries
+// (file number 0) as well as positive ones.
+//
+// The cache is set associative: a name's hash selects a set of
+// kDirCacheWayCount entries, and we replace within the set using the clock
+// algorithm (each entry has a referenced bit that's set on a hit and cleared
+// as the clock hand sweeps past).  Names longer than kDirCacheMaxNameLength
+// aren't cached; they're rare, and keeping the entries small is more important.
+//
+// The cache also remembers the directory positions that VNOPReadDir and 
+// VNOPReaddirattr most recently returned as cookies (see "Directory Cookies", 
+// below).  Each of these is known to be the position of an entry, so when a 
+// client resumes at one of them we can go straight to the entry rather than 
+// walking its directory block from the start to check the position.  Each 
+// reader that's part way through the directory tends to occupy one slot: 
+// when it resumes from a position in the cache, we replace that position 
+// with the one we return.  Otherwise we replace slots in rotation.
+//
+// Each cache has its own lock.  This is a leaf lock; we never take any other
+// lock while holding it.
+//
+// Caches come from gDirCacheZone (see "Object Zones").  The zone's 
+// constructor allocates the lock, so a cache keeps its lock while it sits 
+// in the zone, and creating a cache for a directory is just a matter of 
+// clearing the rest of it.
+
+enum {
+    kDirCacheSetCount       = 8,            // must be a power of two
+    kDirCacheWayCount       = 4,
+    kDirCacheMaxNameLength  = 31,           // matches NCHNAMLEN in the VFS name cache
+    kDirCacheCursorCount    = 8
+};
+
+struct DirCacheEntry {
+    uint32_t    fHash;                      // DirCacheHashName of fName
+    uint8_t     fNameLength;                // 0 if this entry is unused
+    uint8_t     fReferenced;                // clock algorithm's referenced bit
+    char        fName[kDirCacheMaxNameLength];
+    uint64_t    fFileNum;                   // 0 for a negative entry
+};
+typedef struct DirCacheEntry DirCacheEntry;
+
+struct DirCache {
+    lck_mtx_t *     fLock;                  // protects everything below; see DirCacheConstruct
+    uint8_t         fClockHand[kDirCacheSetCount];  // DirCacheCreate clears from here on
+    DirCacheEntry   fEntries[kDirCacheSetCount][kDirCacheWayCount];
+    uint32_t        fCursorHand;            // next slot in fCursors to replace
+    off_t           fCursors[kDirCacheCursorCount];     // byte offsets of entries; 0 if unused
+};
+typedef struct DirCache DirCache;
+
+static Zone *   gDirCacheZone = NULL;
+
+static errno_t DirCacheConstruct(void *object)
+    // The constructor for gDirCacheZone.
+{
+    errno_t     err;
+    DirCache *  cache;
+
+    err = 0;
+    cache = (DirCache *) object;
+    cache->fLock = lck_mtx_alloc_init(gLockGroup, LCK_ATTR_NULL);
+    if (cache->fLock == NULL) {
+        err = ENOMEM;
+    }
+    return err;
+}
+
+static void DirCacheDestruct(void *object)
+    // The destructor for gDirCacheZone.
+{
+    DirCache *  cache;
+
+    cache = (DirCache *) object;
+    lck_mtx_free(cache->fLock, gLockGroup);
+    cache->fLock = NULL;
+}
+
+static void DirCacheTerm(void)
+    // Disposes of gDirCacheZone.  This is safe to call even if DirCacheInit 
+    // failed.
+{
+    if (gDirCacheZone != NULL) {
+        ZoneDestroy(gDirCacheZone);
+        gDirCacheZone = NULL;
+    }
+}
+
+static errno_t DirCacheInit(void)
+    // Creates gDirCacheZone.
+{
+    return ZoneCreate("DirCache", sizeof(DirCache), DirCacheConstruct, DirCacheDestruct, &gDirCacheZone);
+}
+
+static uint32_t DirCacheHashName(const char *name, size_t nameLen)
+    // Returns the FNV-1a hash of the name.
+{
+    uint32_t    hash;
+    size_t      index;
+
+    hash = 2166136261U;
+    for (index = 0; index < nameLen; index++) {
+        hash = (hash ^ (uint8_t) name[index]) * 16777619U;
+    }
+    return hash;
+}
+
+static errno_t DirCacheCreate(DirCache **cachePtr)
+    // Allocates an empty directory lookup cache.
+{
+    errno_t     err;
+    DirCache *  cache;
+
+    assert( cachePtr != NULL);
+    assert(*cachePtr == NULL);
+
+    err = 0;
+    cache = ZoneAlloc(gDirCacheZone);
+    if (cache == NULL) {
+        err = ENOMEM;
+    } else {
+        memset(cache->fClockHand, 0, sizeof(*cache) - offsetof(DirCache, fClockHand));
+        *cachePtr = cache;
+    }
+
+    assert( (err == 0) == (*cachePtr != NULL) );
+
+    return err;
+}
+
+static void DirCacheDispose(DirCache *cache)
+    // Frees a cache allocated by DirCacheCreate.
+{
+    assert(cache != NULL);
+
+    ZoneFree(gDirCacheZone, cache);
+}
+
+static boolean_t DirCacheLookup(DirCache *cache, const char *name, size_t nameLen, uint64_t *fileNumPtr)
+    // Looks up name in the cache.  If it's found, returns true, with *fileNumPtr
+    // set to the file number (or 0 if the entry is negative).  Otherwise returns
+    // false, and you have to search the directory.
+{
+    boolean_t       found;
+    uint32_t        hash;
+    uint32_t        way;
+    DirCacheEntry * entries;
+
+    assert(cache != NULL);
+    assert(name != NULL);
+    assert(fileNumPtr != NULL);
+
+    found = FALSE;
+    if ( (nameLen > 0) && (nameLen <= kDirCacheMaxNameLength) ) {
+        hash = DirCacheHashName(name, nameLen);
+        entries = cache->fEntries[hash & (kDirCacheSetCount - 1)];
+
+        lck_mtx_lock(cache->fLock);
+
+        for (way = 0; way < kDirCacheWayCount; way++) {
+            if (    (entries[way].fHash == hash)
+                 && (entries[way].fNameLength == nameLen)
+                 && (memcmp(entries[way].fName, name, nameLen) == 0) ) {
+                entries[way].fReferenced = TRUE;
+                *fileNumPtr = entries[way].fFileNum;
+                found = TRUE;
+                break;
+            }
+        }
+
+        lck_mtx_unlock(cache->fLock);
+    }
+    return found;
+}
+
+static void DirCacheEnter(DirCache *cache, const char *name, size_t nameLen, uint64_t fileNum)
+    // Records that name maps to fileNum (or, if fileNum is 0, that name
+    // doesn't exist).  If the name is already in the cache, its entry is
+    // updated.  If the name is too long, this does nothing.
+{
+    uint32_t        hash;
+    uint32_t        set;
+    uint32_t        way;
+    DirCacheEntry * entries;
+    DirCacheEntry * victim;
+
+    assert(cache != NULL);
+    assert(name != NULL);
+
+    if ( (nameLen > 0) && (nameLen <= kDirCacheMaxNameLength) ) {
+        hash = DirCacheHashName(name, nameLen);
+        set = hash & (kDirCacheSetCount - 1);
+        entries = cache->fEntries[set];
+
+        lck_mtx_lock(cache->fLock);
+
+        // Look for an existing entry for this name, or a free entry.
+
+        victim = NULL;
+        for (way = 0; way < kDirCacheWayCount; way++) {
+            if (    (entries[way].fHash == hash)
+                 && (entries[way].fNameLength == nameLen)
+                 && (memcmp(entries[way].fName, name, nameLen) == 0) ) {
+                victim = &entries[way];
+                break;
+            }
+            if ( (victim == NULL) && (entries[way].fNameLength == 0) ) {
+                victim = &entries[way];
+            }
+        }
+
+        // If neither, run the clock hand around the set until it finds an
+        // entry that hasn't been referenced since the last time around.
+
+        while (victim == NULL) {
+            way = cache->fClockHand[set];
+            cache->fClockHand[set] = (uint8_t) ((way + 1) % kDirCacheWayCount);
+            if (entries[way].fReferenced) {
+                entries[way].fReferenced = FALSE;
+            } else {
+                victim = &entries[way];
+            }
+        }
+
+        victim->fHash       = hash;
+        victim->fNameLength = (uint8_t) nameLen;
+        victim->fReferenced = FALSE;
+        memcpy(victim->fName, name, nameLen);
+        victim->fFileNum    = fileNum;
+
+        lck_mtx_unlock(cache->fLock);
+    }
+}
+
+static boolean_t DirCacheCursorLookup(DirCache *cache, off_t offset)
+    // Returns true if offset is a directory position that we've previously 
+    // returned as a cookie (and hence is known to be the position of an entry).
+{
+    boolean_t   found;
+    uint32_t    slot;
+
+    assert(cache != NULL);
+    assert(offset > 0);
+
+    found = FALSE;
+
+    lck_mtx_lock(cache->fLock);
+
+    for (slot = 0; slot < kDirCacheCursorCount; slot++) {
+        if (cache->fCursors[slot] == offset) {
+            found = TRUE;
+            break;
+        }
+    }
+
+    lck_mtx_unlock(cache->fLock);
+
+    return found;
+}
+
+static void DirCacheCursorUpdate(DirCache *cache, off_t oldOffset, off_t newOffset)
+    // Records that newOffset, the position of an entry, has been returned as 
+    // a cookie to a reader that resumed at oldOffset (which may be 0, meaning 
+    // that the reader started at the beginning).  If oldOffset is in the 
+    // cache, newOffset replaces it.
+{
+    uint32_t    slot;
+
+    assert(cache != NULL);
+    assert(newOffset > 0);
+
+    lck_mtx_lock(cache->fLock);
+
+    for (slot = 0; slot < kDirCacheCursorCount; slot++) {
+        if ( (cache->fCursors[slot] == newOffset) || ( (oldOffset != 0) && (cache->fCursors[slot] == oldOffset) ) ) {
+            break;
+        }
+    }
+    if (slot == kDirCacheCursorCount) {
+        slot = cache->fCursorHand;
+        cache->fCursorHand = (cache->fCursorHand + 1) % kDirCacheCursorCount;
+    }
+    cache->fCursors[slot] = newOffset;
+
+    lck_mtx_unlock(cache->fLock);
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** FSNode Hash
+
+// An FSNode is the in-memory representation of a file system object (see the
+// "Terminology" notes at the top of this file).  Every FSNode that has a vnode,
+// or is in the process of getting one, lives in the FSNode hash, which is keyed
+// by the raw device number of the volume and the file number of the object.
+// There is a single hash for the entire KEXT, shared by all mounted volumes.
+
+enum {
+    kFSNodeMagic    = 'FSNd',
+    kFSNodeBadMagic = 'FS!d'
+};
+
+typedef struct FSNode FSNode;
+
+struct FSNode {
+    uint32_t        fMagic;             // [1] must be kFSNodeMagic
+    uint32_t        fHash;              // [1] FSNodeHashValue(fDevNum, fFileNum)
+    FSNode *        fHashNext;          // [2] next FSNode in this hash chain
+    uint64_t        fFileNum;           // [1] file number of the object
+    vnode_t         fVNode;             // [2] the vnode; we hold /no/ proper references to this,
+                                        //     and must reconfirm its existance each time
+    dev_t           fDevNum;            // [1] fMount->fBlockRDevNum, kept here so that hash comparisons stay local
+    uint32_t        fVID;               // [2] vnode_vid of fVNode, captured when we attached it
+    boolean_t       fAttaching;         // [2] true if someone is attaching a vnode to this FSNode
+    enum vtype      fType;              // [3] type of the object (VDIR, VREG, and so on)
+    uint16_t        fMode;              // [3] [7] the following come from the file record
+    uint16_t        fLinkCount;         // [3] [7]
+    uint64_t        fSize;              // [3] [7]
+
+    EmptyFSMount *  fMount CacheLineAligned;    // [1] the volume on which this object lives
+    lck_rw_t *      fLock;              // [1] protects the fields marked [7]; NULL on a read-only volume
+    lck_mtx_t *     fWriteLock;         // [1] serialises writes and truncates; NULL on a read-only volume
+    DirCache *      fDirCache;          // [3] directories only; see "Directory Lookup Cache"
+    uint32_t        fUID;               // [3] [7]
+    uint32_t        fGID;               // [3] [7]
+    uint64_t        fBlockCount;        // [3] [7] blocks actually allocated; see "Delayed Allocation Notes"
+    uint32_t        fParentFileNum;     // [3]
+    uint32_t        fGeneration;        // [3]
+    uint32_t        fCompressedChunkSize;   // [3] zero unless the file is compressed; see "Decompression Cache"
+    uint64_t        fChunkChecksumBlock;    // [3] zero unless the compressed file has a checksum table; ditto
+    uint32_t        fFlags;             // [3] [7]
+    boolean_t       fWaiting;           // [2] true if someone is waiting for an attach to complete
+
+    struct timespec fModifyTime CacheLineAligned;   // [3] [7]
+    struct timespec fChangeTime;        // [3] [7]
+    struct timespec fAccessTime;        // [3] [7]
+    struct timespec fCreateTime;        // [3] [7]
+
+    off_t           fReadNextOffset CacheLineAligned;   // [2] [5] offset just beyond the end of the last read
+    off_t           fReadAheadEnd;      // [2] [5] offset just beyond the end of the last read-ahead
+    uint32_t        fReadAheadWindow;   // [2] [5] current read-ahead window, in bytes; 0 if not streaming
+    boolean_t       fMapped;            // [2] [6] true between VNOPMmap and VNOPMnomap
+
+    uint64_t        fDelayedBlocks CacheLineAligned;    // [7] blocks reserved for data that has no blocks allocated yet
+    uint64_t        fMarkedBlockCount;  // [7] how many of the file's first blocks are marked in the bitmap
+    boolean_t       fRecordDirty;       // [7] true if the file record on disk is out of date
+    uint32_t        fDiskExtentCount;   // [3] [8] fExtentCount of the file record on disk
+    uint64_t        fOverflowBlock;     // [3] [8] first overflow extent block on disk, or zero
+    uint64_t        fDirIndexBlock;     // [3] [7] directories only: root of the directory index, or zero
+    uint64_t        fDirFreeHint;       // [7] directories only: see "Directory Index Notes"
+    FSNode *        fDirtyNext;         // [9] next FSNode on the volume's dirty list
+    boolean_t       fOnDirtyList;       // [9] true if this FSNode is on that list
+    uint64_t        fDirtyBytes;        // [9] bytes written to this FSNode since it was queued
+
+    uint32_t        fExtentCount;       // [3] [7] total number of extents, including overflow extents
+    EmptyFSExtent * fExtents;           // [3] [4] [7] all of the extents, in host byte order
+    uint32_t        fExtentCapacity;    // [3] [4] [7] number of extents that fExtents has room for
+    EmptyFSExtent   fInlineExtents[kEmptyFSInlineExtentCount];  // [3] [4] [7]
+};
+
+// FSNode Notes
+// ------------
+// [1] This field is immutable.  It's set up before the FSNode is added to the
+//     hash and is not modified after that.
+//
+// [2] This field is protected by the lock of the hash stripe that covers fHash
+//     (see FSNodeHashStripeForHash).
+//
+// [3] This field is set by the thread that's attaching the vnode (while fAttaching
+//     is set, no one else looks at it).  On a read-only volume it's immutable 
+//     thereafter.  On a writable volume, the ones that are also marked [7] can 
+//     change.
+//
+// [4] If all of the file's extents fit in the file record, fExtents points to 
+//     fInlineExtents.  Otherwise it points to an OSMalloc'd array of 
+//     fExtentCapacity extents, which FSNodeDispose frees.  The array grows 
+//     (doubling) as blocks are allocated, but never shrinks.
+//
+// [7] On a writable volume, this field is protected by fLock, a read/write 
+//     lock; readers take it shared and writers take it exclusive.  On a 
+//     read-only volume nothing changes these fields, so fLock is NULL and 
+//     FSNodeLockShared and friends do nothing.  fLock is never held across 
+//     a call into the cluster layer, because the cluster layer calls back 
+//     into VNOPBlockmap, which takes it too.  See "Write Notes" for the 
+//     locking order.
+//
+// [8] This field describes the file's overflow extent chain on disk, and is 
+//     protected by the volume's fRecordLock.  Only FSNodeWriteRecord, and 
+//     VNOPInactive when it frees the file, touch the chain.
+//
+// [9] This field is protected by the volume's fDirtyLock.  See "Flusher 
+//     Notes" in the "File Writing" section.
+//
+// [5] These fields track sequential reads for our read-ahead; see the 
+//     "Read-Ahead Notes" in the "File Data" section.
+//
+// [6] See "Memory Mapping Notes" in the "File Data" section.
+
+// FSNode Layout Notes
+// -------------------
+// FSNodes come from gFSNodeZone (see "Object Zones"), so each one starts on 
+// a cache line and doesn't share a line with any other.  Within the FSNode, 
+// the fields are grouped by who uses them, one group per cache line:
+//
+// o The first line has everything that a hash lookup looks at (the hash 
+//   chain, the key, and the vnode and its vid) and the attributes that are 
+//   read most often (the type, size, mode and link count).  A lookup that 
+//   hits in the hash, or an access check, touches just that line.
+//
+// o The second line has the rest of the read-mostly fields, and the third 
+//   has the times.
+//
+// o The read-ahead state is written (under the hash stripe lock) by every 
+//   read, so it gets a line to itself (along with fMapped, which is under 
+//   the same lock), rather than invalidating the lines that other CPUs are 
+//   reading.
+//
+// o The state that only writers use (delayed allocation, the dirty list, 
+//   the record on disk, and the directory index) comes next, and the 
+//   extents, which only I/O needs, come last.
+//
+// The check below makes sure that the first group still fits in a line.
+
+typedef char FSNodeFirstLineCheck[ (offsetof(FSNode, fMount) == kCacheLineSize) ? 1 : -1 ];
+
+static Zone *   gFSNodeZone = NULL;
+
+// Hash Table Notes
+// ----------------
+// The obvious way to protect the hash is with a single lock.  That works, but it
+// means that every lookup on every volume serialises on that one lock.  Instead,
+// the hash is split into kFSNodeHashStripeCount stripes, each with its own lock.
+// An FSNode whose hash value is h lives in bucket (h & (bucketCount - 1)) and is
+// protected by the lock of stripe (h & (kFSNodeHashStripeCount - 1)).  Because the
+// bucket count is a power of two that's never smaller than kFSNodeHashStripeCount,
+// all of the FSNodes in a given bucket are covered by the same stripe lock, no
+// matter how big the table gets.
+//
+// That property is what lets us grow the table without stalling everyone.  When a
+// stripe gets too heavily loaded, the thread that noticed allocates a table with
+// twice as many buckets (outside of any lock), then installs it as the current
+// table, keeping the old one around as the previous table.  From that point on,
+// finds and removes look in both tables, while inserts only go into the current
+// table.  The growing thread then moves the FSNodes across, one stripe at a time.
+// The FSNodes in an old bucket always land in new buckets covered by the same
+// stripe, so that stripe's lock is all it needs, and lookups in the other stripes
+// proceed unhindered.  Once every stripe has been moved, the previous table is
+// freed.
+//
+// The only times that we hold every stripe lock are when installing the new
+// table and when retiring the old one.  Each of these is just a handful of
+// stores.  As a consequence, the table pointers and bucket counts (gFSNodeHashBuckets
+// and friends) can be read by anyone who holds any one stripe lock.
+
+enum {
+    kFSNodeHashStripeCount    = 64,             // must be a power of two
+    kFSNodeHashInitialBuckets = 256,            // must be a power of two, >= kFSNodeHashStripeCount
+    kFSNodeHashMaxBuckets     = 256 * 1024,     // must be a power of two; caps the table at 1 or 2 MB
+    kFSNodeHashMaxChainLength = 2               // average chain length (within a stripe) that triggers a grow
+};
+
+// Each stripe is padded out to a cache line, so that one CPU taking a stripe lock
+// doesn't disturb another CPU working on the next stripe.
+
+struct FSNodeHashStripe {
+    lck_mtx_t *     fLock;              // protects fNodeCount and every FSNode covered by this stripe
+    uint32_t        fNodeCount;         // number of FSNodes covered by this stripe, in either table
+    uint8_t         fPad[kCacheLineSize - sizeof(lck_mtx_t *) - sizeof(uint32_t)];
+};
+typedef struct FSNodeHashStripe FSNodeHashStripe;
+
+static FSNodeHashStripe gFSNodeHashStripes[kFSNodeHashStripeCount];
+
+static FSNode **        gFSNodeHashBuckets;             // [A] current table
+static uint32_t         gFSNodeHashBucketCount;         // [A] number of buckets in the current table
+static FSNode **        gFSNodeHashPrevBuckets;         // [A] previous table; non-NULL only while growing
+static uint32_t         gFSNodeHashPrevBucketCount;     // [A] number of buckets in the previous table
+static UInt32           gFSNodeHashGrowing;             // [B] non-zero while some thread is growing the table
+
+// [A] Only modified with every stripe lock held, so can be read with any one
+//     stripe lock held.  Also, these are only modified by the thread that's
+//     growing the table, so that thread can read them without a lock.
+//
+// [B] Only accessed using atomic operations.  Whoever manages to change this
+//     from 0 to 1 is responsible for growing the table.
+
+static uint32_t FSNodeHashValue(dev_t devNum, uint64_t fileNum)
+    // Returns the hash value for the given file system object.  We mix
+    // the device number into the high bits of the file number and then do
+    // a multiplicative (Fibonacci) hash.  The multiply spreads small, dense,
+    // file numbers across all of the result bits, which is important because
+    // we select both the bucket and the stripe using the low bits.
+{
+    uint64_t    key;
+
+    key = fileNum ^ (((uint64_t) (uint32_t) devNum) << 32);
+    key *= 0x9E3779B97F4A7C15ULL;
+    return (uint32_t) (key >> 32);
+}
+
+static FSNodeHashStripe * FSNodeHashStripeForHash(uint32_t hash)
+    // Returns the stripe that covers the given hash value.
+{
+    return &gFSNodeHashStripes[hash & (kFSNodeHashStripeCount - 1)];
+}
+
+static void FSNodeHashLockAll(void)
+    // Takes every stripe lock.  To avoid deadlock, these are always taken in
+    // index order, and only by a thread that holds no other stripe lock.
+{
+    uint32_t    stripeIndex;
+
+    for (stripeIndex = 0; stripeIndex < kFSNodeHashStripeCount; stripeIndex++) {
+        lck_mtx_lock(gFSNodeHashStripes[stripeIndex].fLock);
+    }
+}
+
+static void FSNodeHashUnlockAll(void)
+    // Releases the locks taken by FSNodeHashLockAll.
+{
+    uint32_t    stripeIndex;
+
+    for (stripeIndex = 0; stripeIndex < kFSNodeHashStripeCount; stripeIndex++) {
+        lck_mtx_unlock(gFSNodeHashStripes[stripeIndex].fLock);
+    }
+}
+
+static void FSNodeHashTerm(void)
+    // Disposes of the FSNode hash and gFSNodeZone.  This is safe to call even 
+    // if FSNodeHashInit failed part way through.  By the time this is called 
+    // all volumes have been unmounted, so the hash must be empty.
+{
+    uint32_t    stripeIndex;
+
+    for (stripeIndex = 0; stripeIndex < kFSNodeHashStripeCount; stripeIndex++) {
+        assert(gFSNodeHashStripes[stripeIndex].fNodeCount == 0);
+        if (gFSNodeHashStripes[stripeIndex].fLock != NULL) {
+            lck_mtx_free(gFSNodeHashStripes[stripeIndex].fLock, gLockGroup);
+            gFSNodeHashStripes[stripeIndex].fLock = NULL;
+        }
+    }
+    assert(gFSNodeHashPrevBuckets == NULL);
+    assert( ! gFSNodeHashGrowing );
+    if (gFSNodeHashBuckets != NULL) {
+        OSFree(gFSNodeHashBuckets, gFSNodeHashBucketCount * sizeof(*gFSNodeHashBuckets), gOSMallocTag);
+        gFSNodeHashBuckets = NULL;
+        gFSNodeHashBucketCount = 0;
+    }
+    if (gFSNodeZone != NULL) {
+        ZoneDestroy(gFSNodeZone);
+        gFSNodeZone = NULL;
+    }
+}
+
+static errno_t FSNodeHashInit(void)
+    // Initialises the FSNode hash and creates gFSNodeZone.  This must be 
+    // called after InitMemoryAndLocks because it uses gOSMallocTag and 
+    // gLockGroup.
+{
+    errno_t     err;
+    uint32_t    stripeIndex;
+
+    assert(gFSNodeHashBuckets == NULL);
+
+    err = 0;
+    for (stripeIndex = 0; stripeIndex < kFSNodeHashStripeCount; stripeIndex++) {
+        gFSNodeHashStripes[stripeIndex].fLock = lck_mtx_alloc_init(gLockGroup, LCK_ATTR_NULL);
+        if (gFSNodeHashStripes[stripeIndex].fLock == NULL) {
+            err = ENOMEM;
+            break;
+        }
+    }
+    if (err == 0) {
+        gFSNodeHashBuckets = OSMalloc(kFSNodeHashInitialBuckets * sizeof(*gFSNodeHashBuckets), gOSMallocTag);
+        if (gFSNodeHashBuckets == NULL) {
+            err = ENOMEM;
+        } else {
+            memset(gFSNodeHashBuckets, 0, kFSNodeHashInitialBuckets * sizeof(*gFSNodeHashBuckets));
+            gFSNodeHashBucketCount = kFSNodeHashInitialBuckets;
+        }
+    }
+    if (err == 0) {
+        err = ZoneCreate("FSNode", sizeof(FSNode), NULL, NULL, &gFSNodeZone);
+    }
+
+    // Clean up.
+
+    if (err != 0) {
+        FSNodeHashTerm();
+    }
+
+    assert( (err == 0) == (gFSNodeHashBuckets != NULL) );
+
+    return err;
+}
+
+static FSNode * FSNodeHashSearchChain(FSNode *node, dev_t devNum, uint64_t fileNum, uint32_t hash)
+    // Searches the hash chain starting at node for the specified object.
+    // Returns NULL if it's not found.
+{
+    while ( (node != NULL) && ! ( (node->fHash == hash) && (node->fFileNum == fileNum) && (node->fDevNum == devNum) ) ) {
+        node = node->fHashNext;
+    }
+    return node;
+}
+
+static FSNode * FSNodeHashFindLocked(dev_t devNum, uint64_t fileNum, uint32_t hash)
+    // Returns the FSNode for the specified object, or NULL if there isn't one.
+    // The caller must hold the lock of the stripe that covers hash.
+{
+    FSNode *    node;
+
+    node = FSNodeHashSearchChain(gFSNodeHashBuckets[hash & (gFSNodeHashBucketCount - 1)], devNum, fileNum, hash);
+    if ( (node == NULL) && (gFSNodeHashPrevBuckets != NULL) ) {
+        node = FSNodeHashSearchChain(gFSNodeHashPrevBuckets[hash & (gFSNodeHashPrevBucketCount - 1)], devNum, fileNum, hash);
+    }
+    return node;
+}
+
+static void FSNodeHashInsertLocked(FSNode *node)
+    // Adds node to the current table.  The caller must hold the lock of the
+    // stripe that covers node->fHash, and is responsible for updating that
+    // stripe's fNodeCount (if appropriate).
+{
+    FSNode **   bucketPtr;
+
+    assert(node->fHashNext == NULL);
+
+    bucketPtr = &gFSNodeHashBuckets[node->fHash & (gFSNodeHashBucketCount - 1)];
+    node->fHashNext = *bucketPtr;
+    *bucketPtr = node;
+}
+
+static void FSNodeHashRemoveLocked(FSNode *node)
+    // Removes node from whichever table it's in.  The caller must hold the
+    // lock of the stripe that covers node->fHash, and is responsible for
+    // updating that stripe's fNodeCount.
+{
+    FSNode **   linkPtr;
+
+    linkPtr = &gFSNodeHashBuckets[node->fHash & (gFSNodeHashBucketCount - 1)];
+    while ( (*linkPtr != NULL) && (*linkPtr != node) ) {
+        linkPtr = &(*linkPtr)->fHashNext;
+    }
+    if (*linkPtr == NULL) {
+        // Not in the current table, so it must be in the previous one.
+
+        assert(gFSNodeHashPrevBuckets != NULL);
+        linkPtr = &gFSNodeHashPrevBuckets[node->fHash & (gFSNodeHashPrevBucketCount - 1)];
+        while ( (*linkPtr != NULL) && (*linkPtr != node) ) {
+            linkPtr = &(*linkPtr)->fHashNext;
+        }
+    }
+    assert(*linkPtr == node);
+
+    *linkPtr = node->fHashNext;
+    node->fHashNext = NULL;
+}
+
+static boolean_t FSNodeHashShouldGrowLocked(const FSNodeHashStripe *stripe)
+    // Returns true if stripe is overloaded and the caller has been elected
+    // to grow the table.  If this returns true, the caller must call
+    // FSNodeHashGrow after dropping the stripe lock.  The caller must hold
+    // stripe's lock.
+{
+    return (stripe->fNodeCount > ((gFSNodeHashBucketCount / kFSNodeHashStripeCount) * kFSNodeHashMaxChainLength))
+        && (gFSNodeHashBucketCount < kFSNodeHashMaxBuckets)
+        && (gFSNodeHashPrevBuckets == NULL)
+        && OSCompareAndSwap(0, 1, &gFSNodeHashGrowing);
+}
+
+static void FSNodeHashGrow(void)
+    // Doubles the number of buckets in the hash, as described in the
+    // "Hash Table Notes", above.  The caller must not hold any stripe locks,
+    // and must have been elected by FSNodeHashShouldGrowLocked (which ensures
+    // that only one thread grows the table at a time).  If we can't allocate
+    // the new table, we just carry on with the old one; the next insert into
+    // an overloaded stripe will try again.
+{
+    FSNode **   newBuckets;
+    uint32_t    newBucketCount;
+    FSNode **   oldBuckets;
+    uint32_t    oldBucketCount;
+    uint32_t    stripeIndex;
+    uint32_t    bucketIndex;
+    FSNode *    node;
+    boolean_t   swapped;
+
+    assert(gFSNodeHashGrowing);
+
+    // We're the only thread that modifies the table pointers, so we can
+    // read them without taking a lock (see note [A], above).
+
+    oldBuckets     = gFSNodeHashBuckets;
+    oldBucketCount = gFSNodeHashBucketCount;
+    newBucketCount = oldBucketCount * 2;
+
+    assert(gFSNodeHashPrevBuckets == NULL);
+    assert(newBucketCount <= kFSNodeHashMaxBuckets);
+
+    newBuckets = OSMalloc(newBucketCount * sizeof(*newBuckets), gOSMallocTag);
+    if (newBuckets != NULL) {
+        memset(newBuckets, 0, newBucketCount * sizeof(*newBuckets));
+
+        // Install the new table.
+
+        FSNodeHashLockAll();
+        gFSNodeHashPrevBuckets     = oldBuckets;
+        gFSNodeHashPrevBucketCount = oldBucketCount;
+        gFSNodeHashBuckets         = newBuckets;
+        gFSNodeHashBucketCount     = newBucketCount;
+        FSNodeHashUnlockAll();
+
+        // Move the FSNodes across, one stripe at a time.  Old bucket b is covered
+        // by stripe (b & (kFSNodeHashStripeCount - 1)), so the buckets for a given
+        // stripe are spaced kFSNodeHashStripeCount apart.
+
+        for (stripeIndex = 0; stripeIndex < kFSNodeHashStripeCount; stripeIndex++) {
+            lck_mtx_lock(gFSNodeHashStripes[stripeIndex].fLock);
+
+            for (bucketIndex = stripeIndex; bucketIndex < oldBucketCount; bucketIndex += kFSNodeHashStripeCount) {
+                while ( (node = oldBuckets[bucketIndex]) != NULL ) {
+                    oldBuckets[bucketIndex] = node->fHashNext;
+                    node->fHashNext = NULL;
+                    FSNodeHashInsertLocked(node);
+                }
+            }
+
+            lck_mtx_unlock(gFSNodeHashStripes[stripeIndex].fLock);
+        }
+
+        // Retire the old table.  We have to take every lock here because a thread
+        // that started a search before we emptied its stripe might still be
+        // looking at the (now empty) old bucket.
+
+        FSNodeHashLockAll();
+        gFSNodeHashPrevBuckets     = NULL;
+        gFSNodeHashPrevBucketCount = 0;
+        FSNodeHashUnlockAll();
+
+        OSFree(oldBuckets, oldBucketCount * sizeof(*oldBuckets), gOSMallocTag);
+    }
+
+    swapped = OSCompareAndSwap(1, 0, &gFSNodeHashGrowing);
+    assert(swapped);
+    (void) swapped;
+}
+
+static errno_t FSNodeCreate(EmptyFSMount *mtmp, uint64_t fileNum, uint32_t hash, FSNode **nodePtr)
+    // Allocates and initialises a new FSNode for the specified object.  The
+    // FSNode isn't added to the hash.
+{
+    errno_t     err;
+    FSNode *    node;
+
+    assert(mtmp != NULL);
+    assert( nodePtr != NULL);
+    assert(*nodePtr == NULL);
+
+    err = 0;
+    node = ZoneAlloc(gFSNodeZone);
+    if (node == NULL) {
+        err = ENOMEM;
+    } else {
+        memset(node, 0, sizeof(*node));
+        node->fMagic   = kFSNodeMagic;
+        node->fMount   = mtmp;
+        node->fDevNum  = mtmp->fBlockRDevNum;
+        node->fFileNum = fileNum;
+        node->fHash    = hash;
+        node->fType    = VNON;
+
+        if (mtmp->fWritable) {
+            node->fLock = lck_rw_alloc_init(gLockGroup, LCK_ATTR_NULL);
+            node->fWriteLock = lck_mtx_alloc_init(gLockGroup, LCK_ATTR_NULL);
+            if ( (node->fLock == NULL) || (node->fWriteLock == NULL) ) {
+                err = ENOMEM;
+            }
+        }
+
+        if (err == 0) {
+            (void) OSIncrementAtomic(&mtmp->fFSNodeCount);
+
+            *nodePtr = node;
+        } else {
+            if (node->fLock != NULL) {
+                lck_rw_free(node->fLock, gLockGroup);
+            }
+            if (node->fWriteLock != NULL) {
+                lck_mtx_free(node->fWriteLock, gLockGroup);
+            }
+            ZoneFree(gFSNodeZone, node);
+        }
+    }
+
+    assert( (err == 0) == (*nodePtr != NULL) );
+
+    return err;
+}
+
+static void FSNodeDispose(FSNode *node)
+    // Frees an FSNode that's been removed from the hash (or was never added).
+{
+    assert(node != NULL);
+    assert(node->fMagic == kFSNodeMagic);
+    assert(node->fHashNext == NULL);
+    assert( ! node->fAttaching );
+    assert(node->fVNode == NULL);
+    assert( ! node->fOnDirtyList );
+
+    if (node->fLock != NULL) {
+        lck_rw_free(node->fLock, gLockGroup);
+        node->fLock = NULL;
+    }
+    if (node->fWriteLock != NULL) {
+        lck_mtx_free(node->fWriteLock, gLockGroup);
+        node->fWriteLock = NULL;
+    }
+    if (node->fDirCache != NULL) {
+        DirCacheDispose(node->fDirCache);
+        node->fDirCache = NULL;
+    }
+    if ( (node->fExtents != NULL) && (node->fExtents != node->fInlineExtents) ) {
+        OSFree(node->fExtents, node->fExtentCapacity * sizeof(EmptyFSExtent), gOSMallocTag);
+    }
+    node->fExtents = NULL;
+
+    (void) OSDecrementAtomic(&node->fMount->fFSNodeCount);
+
+    node->fMagic = kFSNodeBadMagic;
+    ZoneFree(gFSNodeZone, node);
+}
+
+static FSNode * FSNodeFromVNode(vnode_t vn)
+    // Gets the FSNode from a vnode.
+{
+    FSNode *    result;
+
+    assert(vn != NULL);
+
+    result = (FSNode *) vnode_fsnode(vn);
+
+    assert(result != NULL);
+    assert(result->fMagic == kFSNodeMagic);
+
+    return result;
+}
+
+// The FSNode lock routines do nothing on a read-only volume, where fLock is 
+// NULL.  See note [7] in "FSNode Notes".
+
+static void FSNodeLockShared(FSNode *node)
+{
+    if (node->fLock != NULL) {
+        lck_rw_lock_shared(node->fLock);
+    }
+}
+
+static void FSNodeUnlockShared(FSNode *node)
+{
+    if (node->fLock != NULL) {
+        lck_rw_unlock_shared(node->fLock);
+    }
+}
+
+static void FSNodeLockExclusive(FSNode *node)
+{
+    if (node->fLock != NULL) {
+        lck_rw_lock_exclusive(node->fLock);
+    }
+}
+
+static void FSNodeUnlockExclusive(FSNode *node)
+{
+    if (node->fLock != NULL) {
+        lck_rw_unlock_exclusive(node->fLock);
+    }
+}
+
+static errno_t FSNodeReadOverflowExtents(FSNode *node, uint64_t overflowBlock)
+    // Reads the extents that didn't fit in the file record from the chain 
+    // of overflow extent blocks starting at overflowBlock.  node->fExtents 
+    // has already been allocated and contains the inline extents.
+{
+    errno_t                         err;
+    EmptyFSMount *                  mtmp;
+    uint32_t                        extentCount;
+    uint32_t                        perBlock;
+    buf_t                           bp;
+    const EmptyFSOverflowHeader *   diskHeader;
+    EmptyFSOverflowHeader           header;
+    uint32_t                        index;
+
+    mtmp = node->fMount;
+    perBlock = EmptyFSOverflowExtentsPerBlock(&mtmp->fSuperblock);
+
+    err = 0;
+    extentCount = kEmptyFSInlineExtentCount;
+    while ( (err == 0) && (extentCount < node->fExtentCount) ) {
+        if (overflowBlock < mtmp->fSuperblock.fDataStart) {
+            err = EIO;
+        }
+        if (err == 0) {
+            err = EmptyFSMountReadMetaBlock(mtmp, overflowBlock, &bp);
+        }
+        if (err == 0) {
+            diskHeader = (const EmptyFSOverflowHeader *) buf_dataptr(bp);
+            header = *diskHeader;
+            EmptyFSSwapOverflowHeader(&header);
+            if (    (header.fMagic != kEmptyFSOverflowMagic)
+                 || (header.fExtentCount == 0)
+                 || (header.fExtentCount > perBlock)
+                 || (header.fExtentCount > (node->fExtentCount - extentCount)) ) {
+                err = EIO;
+            } else {
+                memcpy(&node->fExtents[extentCount], diskHeader + 1, header.fExtentCount * sizeof(EmptyFSExtent));
+                EmptyFSSwapExtents(&node->fExtents[extentCount], header.fExtentCount);
+
+                // Overflow extents aren't checked by EmptyFSFileRecordValidate, 
+                // so we have to check them here.
+                
+                for (index = extentCount; index < (extentCount + header.fExtentCount); index++) {
+                    if (    (node->fExtents[index].fBlockCount == 0)
+                         || (node->fExtents[index].fStartBlock < mtmp->fSuperblock.fDataStart)
+                         || (node->fExtents[index].fStartBlock > mtmp->fSuperblock.fBlockCount)
+                         || (node->fExtents[index].fBlockCount > (mtmp->fSuperblock.fBlockCount - node->fExtents[index].fStartBlock)) ) {
+                        err = EIO;
+                    }
+                }
+                extentCount  += header.fExtentCount;
+                overflowBlock = header.fNextBlock;
+            }
+            buf_brelse(bp);
+        }
+    }
+    return err;
+}
+
+static errno_t FSNodeLoad(FSNode *node)
+    // Fills in the parts of a newly created FSNode that come from the volume.
+    // This is called while node->fAttaching is set, so nothing else can look
+    // at the node, and we're not holding any locks, so it's OK to block.
+    //
+    // We read the object's file record from the file table, check it, and 
+    // copy the interesting bits into the FSNode.  Returns ENOENT if the file 
+    // number is out of range or the record is free, and EIO if it's corrupt.
+{
+    errno_t                     err;
+    EmptyFSMount *              mtmp;
+    const EmptyFSSuperblock *   sb;
+    FileTableCursor             cursor;
+    EmptyFSFileRecord           rec;
+
+    assert(node->fAttaching);
+    assert(node->fExtents == NULL);
+
+    mtmp = node->fMount;
+    sb   = &mtmp->fSuperblock;
+
+    // Read and check the file record.
+    
+    memset(&cursor, 0, sizeof(cursor));
+    err = EmptyFSMountReadFileRecord(mtmp, &cursor, node->fFileNum, &rec);
+    FileTableCursorDone(&cursor);
+    
+    // Fill in the FSNode.
+    
+    if (err == 0) {
+        switch (rec.fMode & S_IFMT) {
+            case S_IFDIR:
+                node->fType = VDIR;
+                break;
+            case S_IFREG:
+                node->fType = VREG;
+                break;
+            case S_IFLNK:
+                node->fType = VLNK;
+                break;
+            default:
+                assert(FALSE);              // EmptyFSFileRecordValidate should have caught this
+                err = EIO;
+                break;
+        }
+    }
+    if (err == 0) {
+        node->fMode          = rec.fMode;
+        node->fLinkCount     = rec.fLinkCount;
+        node->fFlags         = rec.fFlags;
+        node->fUID           = rec.fUID;
+        node->fGID           = rec.fGID;
+        node->fSize          = rec.fSize;
+        node->fBlockCount    = rec.fBlockCount;
+        node->fMarkedBlockCount = rec.fBlockCount;
+        TimespecFromNanoseconds(rec.fCreateTime, &node->fCreateTime);
+        TimespecFromNanoseconds(rec.fModifyTime, &node->fModifyTime);
+        TimespecFromNanoseconds(rec.fChangeTime, &node->fChangeTime);
+        TimespecFromNanoseconds(rec.fAccessTime, &node->fAccessTime);
+        node->fParentFileNum = rec.fParentFileNum;
+        node->fGeneration    = rec.fGeneration;
+        node->fCompressedChunkSize = rec.fCompressedChunkSize;
+        node->fChunkChecksumBlock  = rec.fChunkChecksumBlock;
+        node->fDirIndexBlock = rec.fDirIndexBlock;
+        if ( (rec.fDirIndexBlock != 0) && (rec.fSize != 0) ) {
+            node->fDirFreeHint = (rec.fSize / sb->fBlockSize) - 1;
+        }
+
+        // Get the extents.  The common case is that they're all in the file 
+        // record.
+        
+        if (rec.fExtentCount <= kEmptyFSInlineExtentCount) {
+            node->fExtents = node->fInlineExtents;
+            node->fExtentCapacity = kEmptyFSInlineExtentCount;
+        } else if (rec.fExtentCount > (sb->fBlockCount - sb->fDataStart)) {
+            err = EIO;                      // more extents than there are blocks; don't even try to allocate
+        } else {
+            node->fExtents = OSMalloc(rec.fExtentCount * sizeof(EmptyFSExtent), gOSMallocTag);
+            if (node->fExtents == NULL) {
+                err = ENOMEM;
+            } else {
+                node->fExtentCapacity = rec.fExtentCount;
+            }
+        }
+    }
+    if (err == 0) {
+        node->fExtentCount     = rec.fExtentCount;
+        node->fDiskExtentCount = rec.fExtentCount;
+        node->fOverflowBlock   = rec.fOverflowBlock;
+        memcpy(
+            node->fExtents, 
+            rec.fExtents, 
+            ((rec.fExtentCount < kEmptyFSInlineExtentCount) ? rec.fExtentCount : kEmptyFSInlineExtentCount) * sizeof(EmptyFSExtent)
+        );
+        if (rec.fExtentCount > kEmptyFSInlineExtentCount) {
+            err = FSNodeReadOverflowExtents(node, rec.fOverflowBlock);
+        }
+    }
+    if ( (err == 0) && (rec.fCompressedChunkSize != 0) ) {
+
+        // A compressed file's extents follow different rules; each one must 
+        // be big enough for its chunk, which VNOPRead and VNOPPagein rely on.
+
+        err = EmptyFSCompressedExtentsValidate(sb, &rec, node->fExtents, node->fExtentCount);
+    } else if ( (err == 0) && (rec.fExtentCount > kEmptyFSInlineExtentCount) ) {
+        uint64_t    blocks;
+        uint32_t    index;
+        
+        // EmptyFSFileRecordValidate can't check that the file's size fits 
+        // within its extents if some of them are in overflow blocks, so we 
+        // do it here.  VNOPBlockmap relies on this.
+        
+        blocks = 0;
+        for (index = 0; index < node->fExtentCount; index++) {
+            blocks += node->fExtents[index].fBlockCount;
+        }
+        if ( (blocks != node->fBlockCount) || (node->fSize > (blocks * sb->fBlockSize)) ) {
+            err = EIO;
+        }
+    }
+    if ( (err == 0) && (node->fType == VDIR) ) {
+        err = DirCacheCreate(&node->fDirCache);
+    }
+    
+    // On failure, our caller disposes of the FSNode, which frees anything 
+    // that we allocated.
+    
+    return err;
+}
+
+static errno_t FSNodeReadDirBlock(FSNode *dirNode, uint64_t logicalBlock, buf_t *bpPtr)
+    // Reads block logicalBlock of the directory dirNode, and checks that 
+    // it's a valid directory block.  On success, *bpPtr is the buffer, which 
+    // the caller must release using buf_brelse.
+{
+    errno_t     err;
+    uint64_t    physicalBlock;
+    buf_t       bp;
+
+    assert(dirNode != NULL);
+    assert(dirNode->fType == VDIR);
+    assert(bpPtr != NULL);
+
+    bp = NULL;
+    err = EmptyFSExtentMap(dirNode->fExtents, dirNode->fExtentCount, logicalBlock, &physicalBlock, NULL);
+    if (err != 0) {
+        err = EIO;                          // directory is shorter than its size says
+    }
+    if (err == 0) {
+        err = EmptyFSMountReadMetaBlock(dirNode->fMount, physicalBlock, &bp);
+    }
+    if (err == 0) {
+        err = EmptyFSDirBlockValidate((const void *) buf_dataptr(bp), dirNode->fMount->fBlockSize);
+        if (err != 0) {
+            buf_brelse(bp);
+            bp = NULL;
+        }
+    }
+    *bpPtr = bp;
+
+    assert( (err == 0) == (*bpPtr != NULL) );
+
+    return err;
+}
+
+static errno_t DirBlockSeek(const void *block, uint32_t blockSize, uint32_t offsetInBlock, const EmptyFSDirEntry **entryPtr)
+    // Finds the entry that starts offsetInBlock bytes into the (valid) 
+    // directory block block.  An offsetInBlock of zero means the first entry. 
+    // On success, *entryPtr is the entry, or NULL if the block has no entries. 
+    // Returns EINVAL if there's no entry at that offset; the offset comes 
+    // from a directory cookie, which the client can set to anything it likes.
+{
+    errno_t                 err;
+    const EmptyFSDirEntry * entry;
+
+    assert(block != NULL);
+    assert(entryPtr != NULL);
+
+    err = 0;
+    entry = EmptyFSDirBlockNextEntry(block, blockSize, NULL);
+    if (offsetInBlock != 0) {
+        while ( (entry != NULL) && ( ((const char *) entry - (const char *) block) < offsetInBlock ) ) {
+            entry = EmptyFSDirBlockNextEntry(block, blockSize, entry);
+        }
+        if ( (entry == NULL) || ( ((const char *) entry - (const char *) block) != offsetInBlock ) ) {
+            err = EINVAL;
+        }
+    }
+    *entryPtr = entry;
+    return err;
+}
+
+// Directory Cookies
+// -----------------
+// A directory cookie (the UIO offset for VNOPReadDir and VNOPReaddirattr) has 
+// to fit in 31 bits (see the comments in VNOPReadDir for why), and has to let 
+// us resume quickly, even in a huge directory.  Internally we track our place 
+// as a byte offset into the directory's data, which takes us straight to the 
+// right directory block.  Entries are aligned to kEmptyFSDirEntryAlign bytes, 
+// so the cookie is that offset divided by kEmptyFSDirEntryAlign, plus one (so 
+// that it can't be confused with kDirCookieDot or kDirCookieDotDot; the 
+// first entry is at offset sizeof(EmptyFSDirBlockHeader), so its cookie is 2). 
+// EmptyFSFileRecordValidate ensures that no directory is bigger than 
+// kEmptyFSMaxDirSize, so every cookie is at most kDirCookieMax.
+//
+// Validating a cookie means checking that there's an entry at that offset, 
+// which DirBlockSeek does by walking the block from the start.  That's 
+// proportional to the number of entries in a block, which can be in the 
+// thousands for a big block size.  FSNodeDirBlockSeek skips the walk if the 
+// offset is one that we recently returned, as recorded in the directory's 
+// lookup cache.  Entries never move: removing a file just clears its 
+// entry's fFileNum, and adding one either reuses a free entry in place or 
+// splits the slack off the end of a used one.  So an offset that was the 
+// position of an entry always will be.
+
+enum {
+    kDirCookieDot       = 0,
+    kDirCookieDotDot    = 1,
+    kDirCookieMax       = 0x7FFFFFFF
+};
+
+static off_t DirCookieFromOffset(off_t offset)
+    // Returns the cookie for a byte offset within a directory.
+{
+    off_t   cookie;
+
+    assert(offset >= (off_t) sizeof(EmptyFSDirBlockHeader));
+    assert( (offset % kEmptyFSDirEntryAlign) == 0 );
+
+    cookie = (offset / kEmptyFSDirEntryAlign) + 1;
+
+    assert(cookie > kDirCookieDotDot);
+    assert(cookie <= kDirCookieMax);
+
+    return cookie;
+}
+
+static off_t DirOffsetFromCookie(off_t cookie)
+    // Returns the byte offset for a cookie (other than kDirCookieDot and 
+    // kDirCookieDotDot) that the client passed us.  The caller must check 
+    // that the cookie is in range, but the offset might still not be the 
+    // position of an entry; FSNodeDirBlockSeek checks that.
+{
+    assert(cookie > kDirCookieDotDot);
+    assert(cookie <= kDirCookieMax);
+
+    return (cookie - 1) * kEmptyFSDirEntryAlign;
+}
+
+static errno_t FSNodeDirBlockSeek(FSNode *dirNode, const void *block, off_t offset, const EmptyFSDirEntry **entryPtr)
+    // Like DirBlockSeek, except that offset is an offset into the directory 
+    // dirNode, and block is the directory block that contains it.  If offset 
+    // is one that we've recently returned as a cookie, we don't need to check 
+    // it.
+{
+    errno_t     err;
+    uint32_t    blockSize;
+    uint32_t    offsetInBlock;
+
+    assert(dirNode != NULL);
+    assert(dirNode->fDirCache != NULL);
+    assert(block != NULL);
+    assert(offset > 0);
+    assert(entryPtr != NULL);
+
+    blockSize     = dirNode->fMount->fBlockSize;
+    offsetInBlock = (uint32_t) (offset % blockSize);
+    if (    (offsetInBlock != 0)
+         && ! (dirNode->fMount->fDebugLevel & kEmptyFSDebugNoFastPaths)
+         && DirCacheCursorLookup(dirNode->fDirCache, offset) ) {
+        assert(offsetInBlock >= sizeof(EmptyFSDirBlockHeader));
+        *entryPtr = (const EmptyFSDirEntry *) (((const char *) block) + offsetInBlock);
+        err = 0;
+    } else {
+        err = DirBlockSeek(block, blockSize, offsetInBlock, entryPtr);
+    }
+    return err;
+}
+
+// Directory Index Notes
+// ---------------------
+// On a volume with the kEmptyFSROCompatDirIndex feature, a directory that 
+// grows to kEmptyFSDirIndexMinBlocks blocks gets an index: a B+tree, keyed 
+// by name hash, that says which directory block holds each name (see 
+// "Directory Index" in "EmptyFSFormat.h").  A lookup in an indexed directory 
+// descends the tree and then searches just the blocks whose records have 
+// the right hash, which is almost always one block, so it reads O(log n) 
+// blocks rather than all of them.  Smaller directories are searched 
+// linearly, which is quicker than walking a tree when there are only a few 
+// blocks.  The directory blocks themselves are the same either way, so 
+// VNOPReadDir, VNOPReaddirattr and their cookies don't know about the index. 
+// The kEmptyFSDebugNoFastPaths debug bit makes lookups ignore the index 
+// (creates and removes still maintain it), so that you can measure what it 
+// buys you with the lookup-scale benchmarks in "EmptyFSBench.c".
+//
+// The index is protected by the directory's fLock, just like its blocks. 
+// A lookup takes it shared.  A create or remove takes it exclusive, with a 
+// transaction handle, and changes the index in the same transaction as the 
+// directory block.  EmptyFSMountModifyMetaBlockStart mustn't be called with 
+// more than one buffer held (see "Journal Notes"), so we never hold two 
+// index nodes at once.  Instead, a descent records its path in a 
+// DirIndexPath (the node, its record count and the record index at each 
+// level), and we go back to the buffer cache for a node when we need it 
+// again.  A split moves half of the node's records into a scratch block, 
+// and then copies that into the new node.
+//
+// An insert works out, from the path, how many nodes will split, and 
+// allocates all of the new nodes before it changes anything, so that it 
+// can't run out of space part way through and leave the tree half split. 
+// A remove frees any node that it empties, other than the root, and takes 
+// that node's record out of its parent; nodes that are merely sparse aren't 
+// merged.  The root only moves when it splits.  That makes the directory's 
+// record dirty, and VNOPCreate writes it in the same transaction, just as 
+// it does when the directory grows.
+//
+// Adding an entry to a big directory mustn't search every block for room, 
+// either.  fDirFreeHint is the first block of an indexed directory that 
+// might have room.  It starts at the last block when the FSNode is loaded 
+// (so space freed before then is only reused once something is removed 
+// from an earlier block), follows each new entry, and moves back when an 
+// entry is removed from an earlier block.  Linear directories are small 
+// enough to search from the start.
+
+enum {
+    kDirIndexAnyLevel   = 0xFFFFFFFF,       // for FSNodeReadDirIndexNode, when reading a root
+    kDirIndexCandidates = 8                 // directory blocks that FSNodeDirIndexSearch collects at a time
+};
+
+struct DirIndexPath {
+    uint32_t    fDepth;                                 // number of levels; fBlocks[0] is the root
+    uint64_t    fBlocks[kEmptyFSDirIndexMaxDepth];      // the node at each level
+    uint32_t    fCounts[kEmptyFSDirIndexMaxDepth];      // its fCount
+    uint32_t    fIndexes[kEmptyFSDirIndexMaxDepth];     // the child that we followed or, in the leaf, the record
+};
+typedef struct DirIndexPath DirIndexPath;
+
+static errno_t FSNodeReadDirIndexNode(FSNode *dirNode, uint64_t blockNum, uint32_t level, buf_t *bpPtr)
+    // Reads block blockNum, a node of the index of the directory dirNode, and 
+    // checks that it's a valid node at the given level (any level, if level 
+    // is kDirIndexAnyLevel).  On success, *bpPtr is the buffer, which the 
+    // caller must release using buf_brelse.
+{
+    errno_t                         err;
+    buf_t                           bp;
+    const EmptyFSDirIndexHeader *   header;
+
+    assert(dirNode != NULL);
+    assert(dirNode->fType == VDIR);
+    assert(bpPtr != NULL);
+
+    bp = NULL;
+    err = EmptyFSMountReadMetaBlock(dirNode->fMount, blockNum, &bp);
+    if (err == 0) {
+        header = (const EmptyFSDirIndexHeader *) buf_dataptr(bp);
+        err = EmptyFSDirIndexNodeValidate(&dirNode->fMount->fSuperblock, header);
+        if ( (err == 0) && (level != kDirIndexAnyLevel) && (EmptyFSSwapLE16(header->fLevel) != level) ) {
+            err = EIO;
+        }
+        if (err != 0) {
+            buf_brelse(bp);
+            bp = NULL;
+        }
+    }
+    *bpPtr = bp;
+
+    assert( (err == 0) == (*bpPtr != NULL) );
+
+    return err;
+}
+
+static errno_t FSNodeDirIndexDescend(FSNode *dirNode, uint64_t root, uint64_t key, boolean_t after, DirIndexPath *path)
+    // Fills in path with the nodes from root down to the leaf where key 
+    // belongs.  At each interior node we follow the last child whose key is 
+    // less than key (or, if after is true, no greater than it).  The leaf's 
+    // index is that of the first record whose key is greater than or equal 
+    // to key (or, if after is true, greater than it), which may be the 
+    // leaf's record count.
+{
+    errno_t                         err;
+    buf_t                           bp;
+    const EmptyFSDirIndexHeader *   header;
+    uint32_t                        level;
+    uint32_t                        depth;
+    uint32_t                        index;
+    uint64_t                        blockNum;
+    boolean_t                       done;
+
+    assert(dirNode != NULL);
+    assert(root != 0);
+    assert(path != NULL);
+
+    err = 0;
+    blockNum = root;
+    level = kDirIndexAnyLevel;
+    depth = 0;
+    done = FALSE;
+    do {
+        err = FSNodeReadDirIndexNode(dirNode, blockNum, level, &bp);
+        if (err == 0) {
+            header = (const EmptyFSDirIndexHeader *) buf_dataptr(bp);
+            level  = EmptyFSSwapLE16(header->fLevel);
+            assert( (depth + level) < kEmptyFSDirIndexMaxDepth );
+
+            index = EmptyFSDirIndexNodeSearch(header, key, after);
+            path->fBlocks[depth] = blockNum;
+            path->fCounts[depth] = EmptyFSSwapLE16(header->fCount);
+            if (level == 0) {
+                done = TRUE;
+            } else {
+                assert(index != 0);         // EmptyFSDirIndexNodeSearch skips the first key
+                index -= 1;
+                blockNum = EmptyFSSwapLE64(EmptyFSDirIndexRecords(header)[index].fChild);
+                level -= 1;
+            }
+            path->fIndexes[depth] = index;
+            depth += 1;
+            buf_brelse(bp);
+        }
+    } while ( (err == 0) && ! done );
+    path->fDepth = depth;
+
+    return err;
+}
+
+static errno_t FSNodeDirIndexNextLeaf(FSNode *dirNode, DirIndexPath *path)
+    // Moves path from its leaf to the first record of the next leaf, in key 
+    // order.  Returns ENOENT if there isn't one.  The node at position p of 
+    // a path is at level fDepth - 1 - p of the tree.
+{
+    errno_t                         err;
+    uint32_t                        depth;
+    uint32_t                        pos;
+    buf_t                           bp;
+    uint64_t                        child;
+
+    assert(dirNode != NULL);
+    assert(path != NULL);
+    assert(path->fDepth != 0);
+
+    // Go up to the lowest node that has a child to the right of the one 
+    // that we followed.
+
+    depth = path->fDepth;
+    pos = depth - 1;
+    while ( (pos > 0) && ((path->fIndexes[pos - 1] + 1) >= path->fCounts[pos - 1]) ) {
+        pos -= 1;
+    }
+
+    // Take that child, and go down its left edge.
+
+    err = 0;
+    if (pos == 0) {
+        err = ENOENT;
+    } else {
+        path->fIndexes[pos - 1] += 1;
+        for ( ; (err == 0) && (pos < depth); pos++) {
+            err = FSNodeReadDirIndexNode(dirNode, path->fBlocks[pos - 1], depth - pos, &bp);
+            if (err == 0) {
+                child = EmptyFSSwapLE64(EmptyFSDirIndexRecords(buf_dataptr(bp))[path->fIndexes[pos - 1]].fChild);
+                buf_brelse(bp);
+                err = FSNodeReadDirIndexNode(dirNode, child, depth - 1 - pos, &bp);
+            }
+            if (err == 0) {
+                path->fBlocks[pos]  = child;
+                path->fCounts[pos]  = EmptyFSSwapLE16( ((const EmptyFSDirIndexHeader *) buf_dataptr(bp))->fCount );
+                path->fIndexes[pos] = 0;
+                buf_brelse(bp);
+            }
+        }
+    }
+    return err;
+}
+
+static errno_t FSNodeDirIndexFind(FSNode *dirNode, uint64_t key, DirIndexPath *path)
+    // Fills in path with the way to a record in the index of dirNode with 
+    // the given key.  Returns EIO if there's no such record; our caller only 
+    // looks for records that the directory's entries say must be there.
+{
+    errno_t         err;
+    uint32_t        leaf;
+    buf_t           bp;
+
+    assert(dirNode != NULL);
+    assert(dirNode->fDirIndexBlock != 0);
+    assert(path != NULL);
+
+    // Records with this key might start at the end of one leaf, so the 
+    // first one might be in the next.
+
+    err = FSNodeDirIndexDescend(dirNode, dirNode->fDirIndexBlock, key, FALSE, path);
+    leaf = path->fDepth - 1;
+    while ( (err == 0) && (path->fIndexes[leaf] == path->fCounts[leaf]) ) {
+        err = FSNodeDirIndexNextLeaf(dirNode, path);
+    }
+    if (err == ENOENT) {
+        err = EIO;
+    }
+    if (err == 0) {
+        err = FSNodeReadDirIndexNode(dirNode, path->fBlocks[leaf], 0, &bp);
+        if (err == 0) {
+            if (EmptyFSSwapLE64(EmptyFSDirIndexRecords(buf_dataptr(bp))[path->fIndexes[leaf]].fKey) != key) {
+                err = EIO;
+            }
+            buf_brelse(bp);
+        }
+    }
+    return err;
+}
+
+static errno_t FSNodeSearchDirBlock(FSNode *dirNode, uint64_t logicalBlock, const char *name, size_t nameLen, uint64_t *fileNumPtr)
+    // Searches block logicalBlock of the directory dirNode for name.  On 
+    // success, *fileNumPtr is the file number of the object, or 0 if the 
+    // name isn't in that block.
+{
+    errno_t                 err;
+    uint32_t                blockSize;
+    buf_t                   bp;
+    const void *            block;
+    const EmptyFSDirEntry * entry;
+    uint64_t                fileNum;
+
+    assert(dirNode != NULL);
+    assert(fileNumPtr != NULL);
+
+    blockSize = dirNode->fMount->fBlockSize;
+
+    fileNum = 0;
+    err = FSNodeReadDirBlock(dirNode, logicalBlock, &bp);
+    if (err == 0) {
+        block = (const void *) buf_dataptr(bp);
+        entry = NULL;
+        while ( (entry = EmptyFSDirBlockNextEntry(block, blockSize, entry)) != NULL ) {
+            if (    (entry->fFileNum != 0)
+                 && (entry->fNameLength == nameLen)
+                 && (memcmp(entry->fName, name, nameLen) == 0) ) {
+                fileNum = EmptyFSSwapLE32(entry->fFileNum);
+                break;
+            }
+        }
+        buf_brelse(bp);
+    }
+    if (err == 0) {
+        *fileNumPtr = fileNum;
+    }
+    return err;
+}
+
+static errno_t FSNodeDirIndexSearch(FSNode *dirNode, const char *name, size_t nameLen, uint64_t *fileNumPtr, uint64_t *logicalBlockPtr)
+    // Uses the index of the directory dirNode to search it for name.  On 
+    // success, *fileNumPtr is the file number of the object, or 0 if 
+    // there's no such name in the directory, and *logicalBlockPtr is the 
+    // directory block that holds it.
+{
+    errno_t                         err;
+    uint32_t                        hash;
+    DirIndexPath                    path;
+    uint32_t                        leaf;
+    buf_t                           bp;
+    const EmptyFSDirIndexHeader *   header;
+    uint32_t                        count;
+    uint32_t                        index;
+    uint64_t                        key;
+    uint64_t                        lastBlock;
+    uint64_t                        candidates[kDirIndexCandidates];
+    uint32_t                        candidateCount;
+    uint32_t                        candidateIndex;
+    uint64_t                        fileNum;
+    boolean_t                       more;
+    boolean_t                       atEnd;
+
+    assert(dirNode != NULL);
+    assert(dirNode->fDirIndexBlock != 0);
+    assert(name != NULL);
+    assert(fileNumPtr != NULL);
+    assert(logicalBlockPtr != NULL);
+
+    hash = EmptyFSDirNameHash(&dirNode->fMount->fSuperblock, name, nameLen);
+    err = FSNodeDirIndexDescend(dirNode, dirNode->fDirIndexBlock, EmptyFSDirIndexKey(hash, 0), FALSE, &path);
+    leaf = path.fDepth - 1;
+
+    fileNum   = 0;
+    lastBlock = UINT64_MAX;
+    more      = TRUE;
+    while ( (err == 0) && more && (fileNum == 0) ) {
+
+        // Note the blocks of the next few records with our hash.  We copy 
+        // them out of the leaf so that we don't hold it while we read the 
+        // directory blocks.  Records are sorted by block within a hash, so 
+        // we skip repeats by remembering the last block.
+
+        candidateCount = 0;
+        atEnd = FALSE;
+        err = FSNodeReadDirIndexNode(dirNode, path.fBlocks[leaf], 0, &bp);
+        if (err == 0) {
+            header = (const EmptyFSDirIndexHeader *) buf_dataptr(bp);
+            count  = EmptyFSSwapLE16(header->fCount);
+            for (index = path.fIndexes[leaf]; (index < count) && (candidateCount < kDirIndexCandidates); index++) {
+                key = EmptyFSSwapLE64(EmptyFSDirIndexRecords(header)[index].fKey);
+                if (EmptyFSDirIndexKeyHash(key) != hash) {
+                    more = FALSE;
+                    break;
+                }
+                if (EmptyFSDirIndexKeyBlock(key) != lastBlock) {
+                    lastBlock = EmptyFSDirIndexKeyBlock(key);
+                    candidates[candidateCount] = lastBlock;
+                    candidateCount += 1;
+                }
+            }
+            path.fIndexes[leaf] = index;
+            atEnd = (index == count);
+            buf_brelse(bp);
+        }
+
+        // Search them.
+
+        for (candidateIndex = 0; (err == 0) && (fileNum == 0) && (candidateIndex < candidateCount); candidateIndex++) {
+            err = FSNodeSearchDirBlock(dirNode, candidates[candidateIndex], name, nameLen, &fileNum);
+            if ( (err == 0) && (fileNum != 0) ) {
+                *logicalBlockPtr = candidates[candidateIndex];
+            }
+        }
+
+        // Records with our hash might carry on in the next leaf.
+
+        if ( (err == 0) && (fileNum == 0) && more && atEnd ) {
+            err = FSNodeDirIndexNextLeaf(dirNode, &path);
+            if (err == ENOENT) {
+                err = 0;
+                more = FALSE;
+            }
+        }
+    }
+    if (err == 0) {
+        *fileNumPtr = fileNum;
+    }
+    return err;
+}
+
+static errno_t FSNodeSearchDirectory(FSNode *dirNode, const char *name, size_t nameLen, uint64_t *fileNumPtr, uint64_t *logicalBlockPtr)
+    // Searches the directory dirNode for name, using its index if it has 
+    // one (see "Directory Index Notes").  On success, *fileNumPtr is the 
+    // file number of the object, or 0 if there's no such name in the 
+    // directory, and, if logicalBlockPtr isn't NULL and the name was found, 
+    // *logicalBlockPtr is the directory block that holds it.  The caller 
+    // must hold dirNode's fLock.
+{
+    errno_t                 err;
+    uint64_t                blockCount;
+    uint64_t                logicalBlock;
+    uint64_t                fileNum;
+
+    assert(dirNode != NULL);
+    assert(dirNode->fType == VDIR);
+    assert(name != NULL);
+    assert(fileNumPtr != NULL);
+
+    err = 0;
+    fileNum = 0;
+    logicalBlock = 0;
+    if (    (dirNode->fDirIndexBlock != 0)
+         && ! (dirNode->fMount->fDebugLevel & kEmptyFSDebugNoFastPaths) ) {
+        err = FSNodeDirIndexSearch(dirNode, name, nameLen, &fileNum, &logicalBlock);
+    } else {
+        blockCount = dirNode->fSize / dirNode->fMount->fBlockSize;
+        for (logicalBlock = 0; logicalBlock < blockCount; logicalBlock++) {
+            err = FSNodeSearchDirBlock(dirNode, logicalBlock, name, nameLen, &fileNum);
+            if ( (err != 0) || (fileNum != 0) ) {
+                break;
+            }
+        }
+    }
+    if (err == 0) {
+        *fileNumPtr = fileNum;
+        if ( (fileNum != 0) && (logicalBlockPtr != NULL) ) {
+            *logicalBlockPtr = logicalBlock;
+        }
+    }
+    return err;
+}
+
+static errno_t FSNodeLookupName(FSNode *dirNode, const char *name, size_t nameLen, uint64_t *fileNumPtr)
+    // Looks up name in the directory dirNode, returning the file number of 
+    // the corresponding object in *fileNumPtr, or ENOENT if there's no such 
+    // object.  "." and ".." are handled by our caller.  We consult the 
+    // directory's lookup cache first, and record the result there if we 
+    // have to search the directory.
+    //
+    // We hold the directory's fLock (shared) across both, so that a create 
+    // or remove (which updates the lookup cache with fLock held exclusive) 
+    // can't slip in between our search and our cache update, leaving a 
+    // stale entry in the cache.
+{
+    errno_t     err;
+    uint64_t    fileNum;
+
+    assert(dirNode != NULL);
+    assert(dirNode->fType == VDIR);
+    assert(dirNode->fDirCache != NULL);
+    assert(name != NULL);
+    assert(fileNumPtr != NULL);
+
+    err = 0;
+    FSNodeLockShared(dirNode);
+    if ( ! DirCacheLookup(dirNode->fDirCache, name, nameLen, &fileNum) ) {
+        err = FSNodeSearchDirectory(dirNode, name, nameLen, &fileNum, NULL);
+        if (err == 0) {
+            DirCacheEnter(dirNode->fDirCache, name, nameLen, fileNum);
+        }
+    }
+    FSNodeUnlockShared(dirNode);
+    
+    if (err == 0) {
+        if (fileNum == 0) {
+            err = ENOENT;
+        } else {
+            *fileNumPtr = fileNum;
+        }
+    }
+    return err;
+}
+
+static errno_t FSNodeAppendExtent(FSNode *node, uint64_t startBlock, uint64_t blockCount);
+    // forward declaration
+
+static errno_t FSNodeDirIndexInsert(FSNode *dirNode, uint64_t *rootPtr, uint64_t key)
+    // Adds a record with the given key to the index of the directory 
+    // dirNode, whose root is *rootPtr, splitting nodes as necessary.  If the 
+    // root splits, *rootPtr is set to the new root.  The caller must hold 
+    // dirNode's fLock exclusive, and a transaction handle.
+{
+    errno_t                 err;
+    errno_t                 junk;
+    EmptyFSMount *          mtmp;
+    uint32_t                blockSize;
+    DirIndexPath            path;
+    uint32_t                depth;
+    uint32_t                needed;
+    uint32_t                used;
+    uint64_t                newBlocks[kEmptyFSDirIndexMaxDepth + 1];
+    uint64_t                count;
+    void *                  scratch;
+    uint32_t                pos;
+    uint32_t                index;
+    uint32_t                leftCount;
+    buf_t                   bp;
+    void *                  node;
+    uint64_t                pendingKey;
+    uint64_t                pendingChild;
+    uint64_t                splitKey;
+    boolean_t               done;
+
+    assert(dirNode != NULL);
+    assert(rootPtr != NULL);
+    assert(*rootPtr != 0);
+
+    mtmp      = dirNode->fMount;
+    blockSize = mtmp->fBlockSize;
+    scratch   = NULL;
+    needed    = 0;
+    used      = 0;
+
+    err = FSNodeDirIndexDescend(dirNode, *rootPtr, key, TRUE, &path);
+    depth = path.fDepth;
+
+    // Every full node from the leaf up splits.  If they're all full, the 
+    // root splits too, and we need a new root above it, unless the tree is 
+    // already as deep as it can be.
+
+    if (err == 0) {
+        while ( (needed < depth) && (path.fCounts[depth - 1 - needed] >= EmptyFSDirIndexCapacity(&mtmp->fSuperblock)) ) {
+            needed += 1;
+        }
+        if (needed == depth) {
+            if (depth == kEmptyFSDirIndexMaxDepth) {
+                err = ENOSPC;
+                needed = 0;
+            } else {
+                needed += 1;
+            }
+        }
+    }
+
+    // Allocate the new nodes, near the root, before we change anything.  If 
+    // that fails, give back the ones that we got.
+
+    if ( (err == 0) && (needed != 0) ) {
+        scratch = OSMalloc(blockSize, gOSMallocTag);
+        if (scratch == NULL) {
+            err = ENOMEM;
+        }
+        if (err == 0) {
+            err = EmptyFSMountCounterReserve(mtmp, kVolumeCounterFreeBlocks, needed);
+        }
+        if (err == 0) {
+            for (index = 0; (err == 0) && (index < needed); index++) {
+                err = EmptyFSMountAllocBlocks(mtmp, *rootPtr, 1, TRUE, &newBlocks[index], &count);
+                assert( (err != 0) || (count == 1) );
+            }
+            if (err != 0) {
+                index -= 1;                 // the one that failed
+                while (index-- > 0) {
+                    (void) EmptyFSMountFreeBlocks(mtmp, newBlocks[index], 1, 0);
+                }
+                EmptyFSMountCounterAdd(mtmp, kVolumeCounterFreeBlocks, (SInt32) needed);
+            }
+        }
+        if (err != 0) {
+            needed = 0;
+        }
+    }
+
+    // Insert the record into the leaf.  If the leaf is full, split it, and 
+    // insert a record for the new node into the parent, and so on up.  The 
+    // node at position pos of the path is at level depth - 1 - pos.  In an 
+    // interior node, the new record goes just after the child that split.
+
+    pendingKey   = key;
+    pendingChild = 0;
+    pos  = depth;
+    done = FALSE;
+    while ( (err == 0) && ! done && (pos != 0) ) {
+        pos -= 1;
+        index = path.fIndexes[pos];
+        if (pos != (depth - 1)) {
+            index += 1;
+        }
+        err = FSNodeReadDirIndexNode(dirNode, path.fBlocks[pos], depth - 1 - pos, &bp);
+        if (err == 0) {
+            err = EmptyFSMountModifyMetaBlockStart(mtmp, path.fBlocks[pos], &bp);
+        }
+        if (err == 0) {
+            node = (void *) buf_dataptr(bp);
+            if (EmptyFSDirIndexNodeInsert(&mtmp->fSuperblock, node, index, pendingKey, pendingChild) == 0) {
+                EmptyFSMountModifyMetaBlockEnd(mtmp, bp);
+                done = TRUE;
+            } else {
+                assert(used < needed);
+
+                splitKey  = EmptyFSDirIndexNodeSplit(node, scratch, blockSize);
+                leftCount = EmptyFSSwapLE16( ((EmptyFSDirIndexHeader *) node)->fCount );
+                if (index <= leftCount) {
+                    junk = EmptyFSDirIndexNodeInsert(&mtmp->fSuperblock, node, index, pendingKey, pendingChild);
+                } else {
+                    junk = EmptyFSDirIndexNodeInsert(&mtmp->fSuperblock, scratch, index - leftCount, pendingKey, pendingChild);
+                }
+                assert(junk == 0);
+                (void) junk;
+                EmptyFSMountModifyMetaBlockEnd(mtmp, bp);
+
+                pendingKey   = splitKey;
+                pendingChild = newBlocks[used];
+                used += 1;
+
+                bp = EmptyFSMountGetMetaBlock(mtmp, pendingChild);
+                err = EmptyFSMountModifyMetaBlockStart(mtmp, pendingChild, &bp);
+                if (err == 0) {
+                    memcpy( (void *) buf_dataptr(bp), scratch, blockSize);
+                    EmptyFSMountModifyMetaBlockEnd(mtmp, bp);
+                }
+            }
+        }
+    }
+
+    // If the root split, put a new root above it, whose first child is the 
+    // old root.
+
+    if ( (err == 0) && ! done ) {
+        assert( (used + 1) == needed );
+
+        bp = EmptyFSMountGetMetaBlock(mtmp, newBlocks[used]);
+        err = EmptyFSMountModifyMetaBlockStart(mtmp, newBlocks[used], &bp);
+        if (err == 0) {
+            node = (void *) buf_dataptr(bp);
+            EmptyFSDirIndexNodeInit(node, blockSize, (uint16_t) depth);
+            junk = EmptyFSDirIndexNodeInsert(&mtmp->fSuperblock, node, 0, 0, *rootPtr);
+            assert(junk == 0);
+            junk = EmptyFSDirIndexNodeInsert(&mtmp->fSuperblock, node, 1, pendingKey, pendingChild);
+            assert(junk == 0);
+            (void) junk;
+            EmptyFSMountModifyMetaBlockEnd(mtmp, bp);
+
+            *rootPtr = newBlocks[used];
+            used += 1;
+        }
+    }
+
+    // If we failed part way through, give back the nodes that we didn't use.
+
+    if (used < needed) {
+        for (index = used; index < needed; index++) {
+            (void) EmptyFSMountFreeBlocks(mtmp, newBlocks[index], 1, 0);
+        }
+        EmptyFSMountCounterAdd(mtmp, kVolumeCounterFreeBlocks, (SInt32) (needed - used));
+    }
+    if (scratch != NULL) {
+        OSFree(scratch, blockSize, gOSMallocTag);
+    }
+    return err;
+}
+
+static errno_t FSNodeDirIndexRemove(FSNode *dirNode, uint64_t key)
+    // Removes a record with the given key from the index of the directory 
+    // dirNode, freeing any nodes that that empties, other than the root. 
+    // The caller must hold dirNode's fLock exclusive, and a transaction 
+    // handle.
+{
+    errno_t         err;
+    EmptyFSMount *  mtmp;
+    DirIndexPath    path;
+    uint32_t        depth;
+    uint32_t        pos;
+    uint32_t        index;
+    buf_t           bp;
+    void *          node;
+
+    assert(dirNode != NULL);
+    assert(dirNode->fDirIndexBlock != 0);
+
+    mtmp = dirNode->fMount;
+
+    err = FSNodeDirIndexFind(dirNode, key, &path);
+
+    // Find the lowest node that still has records once this one's gone. 
+    // Every node below it is left empty, so we free them, and remove the 
+    // record for the top one of those from this node.  If that empties the 
+    // root, it becomes an empty leaf.
+
+    if (err == 0) {
+        depth = path.fDepth;
+        pos = depth - 1;
+        while ( (pos > 0) && (path.fCounts[pos] == 1) ) {
+            pos -= 1;
+        }
+        err = FSNodeReadDirIndexNode(dirNode, path.fBlocks[pos], depth - 1 - pos, &bp);
+        if (err == 0) {
+            err = EmptyFSMountModifyMetaBlockStart(mtmp, path.fBlocks[pos], &bp);
+        }
+        if (err == 0) {
+            node = (void *) buf_dataptr(bp);
+            if ( (pos == 0) && (path.fCounts[0] == 1) ) {
+                EmptyFSDirIndexNodeInit(node, mtmp->fBlockSize, 0);
+            } else {
+                EmptyFSDirIndexNodeRemove(node, path.fIndexes[pos]);
+            }
+            EmptyFSMountModifyMetaBlockEnd(mtmp, bp);
+
+            for (index = pos + 1; index < depth; index++) {
+                (void) EmptyFSMountFreeBlocks(mtmp, path.fBlocks[index], 1, kFreeBlocksRelease | kFreeBlocksMetadata);
+            }
+        }
+    }
+    return err;
+}
+
+static void FSNodeDirIndexFreeTree(FSNode *dirNode, uint64_t root)
+    // Frees every node of the directory index whose root is root, children 
+    // first.  This is only used to back out of FSNodeDirIndexBuild, whose 
+    // index nothing points to yet, so a failure just leaks the remaining 
+    // nodes.  The caller must hold a transaction handle.
+{
+    errno_t         err;
+    EmptyFSMount *  mtmp;
+    DirIndexPath    path;
+    uint32_t        rootLevel;
+    uint32_t        pos;
+    uint64_t        child;
+    buf_t           bp;
+
+    assert(dirNode != NULL);
+    assert(root != 0);
+
+    mtmp = dirNode->fMount;
+
+    err = FSNodeReadDirIndexNode(dirNode, root, kDirIndexAnyLevel, &bp);
+    if (err == 0) {
+        rootLevel = EmptyFSSwapLE16( ((const EmptyFSDirIndexHeader *) buf_dataptr(bp))->fLevel );
+        path.fBlocks[0]  = root;
+        path.fCounts[0]  = EmptyFSSwapLE16( ((const EmptyFSDirIndexHeader *) buf_dataptr(bp))->fCount );
+        path.fIndexes[0] = 0;
+        path.fDepth      = 1;
+        buf_brelse(bp);
+    }
+
+    // The node at the end of the path is a leaf if its position is the 
+    // root's level.  Free it if it's a leaf or if we've freed all of its 
+    // children; otherwise go down to its next child.
+
+    while ( (err == 0) && (path.fDepth != 0) ) {
+        pos = path.fDepth - 1;
+        if ( (pos == rootLevel) || (path.fIndexes[pos] == path.fCounts[pos]) ) {
+            (void) EmptyFSMountFreeBlocks(mtmp, path.fBlocks[pos], 1, kFreeBlocksRelease | kFreeBlocksMetadata);
+            path.fDepth -= 1;
+            if (pos != 0) {
+                path.fIndexes[pos - 1] += 1;
+            }
+        } else {
+            err = FSNodeReadDirIndexNode(dirNode, path.fBlocks[pos], rootLevel - pos, &bp);
+            if (err == 0) {
+                child = EmptyFSSwapLE64(EmptyFSDirIndexRecords(buf_dataptr(bp))[path.fIndexes[pos]].fChild);
+                buf_brelse(bp);
+                err = FSNodeReadDirIndexNode(dirNode, child, rootLevel - pos - 1, &bp);
+            }
+            if (err == 0) {
+                path.fBlocks[pos + 1]  = child;
+                path.fCounts[pos + 1]  = EmptyFSSwapLE16( ((const EmptyFSDirIndexHeader *) buf_dataptr(bp))->fCount );
+                path.fIndexes[pos + 1] = 0;
+                path.fDepth += 1;
+                buf_brelse(bp);
+            }
+        }
+    }
+}
+
+static errno_t FSNodeDirIndexBuild(FSNode *dirNode)
+    // Creates an index for the directory dirNode, which doesn't have one, 
+    // from its entries.  On success, the directory's record is dirty.  On 
+    // failure, the directory is unchanged, and stays unindexed until the 
+    // next time that an entry is added.  The caller must hold dirNode's 
+    // fLock exclusive, and a transaction handle.
+{
+    errno_t                 err;
+    EmptyFSMount *          mtmp;
+    uint32_t                blockSize;
+    uint64_t                blockCount;
+    uint64_t                logicalBlock;
+    uint64_t                root;
+    uint64_t                count;
+    buf_t                   bp;
+    const void *            block;
+    const EmptyFSDirEntry * entry;
+    uint32_t *              hashes;
+    size_t                  hashesSize;
+    uint32_t                hashCount;
+    uint32_t                index;
+
+    assert(dirNode != NULL);
+    assert(dirNode->fType == VDIR);
+    assert(dirNode->fDirIndexBlock == 0);
+
+    mtmp       = dirNode->fMount;
+    blockSize  = mtmp->fBlockSize;
+    blockCount = dirNode->fSize / blockSize;
+    root       = 0;
+
+    // A block can't hold more entries than this.
+
+    err = 0;
+    hashesSize = (blockSize / kEmptyFSDirEntryAlign) * sizeof(*hashes);
+    hashes = OSMalloc(hashesSize, gOSMallocTag);
+    if (hashes == NULL) {
+        err = ENOMEM;
+    }
+
+    // Start with an empty leaf as the root.
+
+    if (err == 0) {
+        err = EmptyFSMountCounterReserve(mtmp, kVolumeCounterFreeBlocks, 1);
+    }
+    if (err == 0) {
+        err = EmptyFSMountAllocBlocks(mtmp, dirNode->fExtents[0].fStartBlock, 1, TRUE, &root, &count);
+        if (err == 0) {
+            bp = EmptyFSMountGetMetaBlock(mtmp, root);
+            err = EmptyFSMountModifyMetaBlockStart(mtmp, root, &bp);
+            if (err == 0) {
+                EmptyFSDirIndexNodeInit( (void *) buf_dataptr(bp), blockSize, 0);
+                EmptyFSMountModifyMetaBlockEnd(mtmp, bp);
+            } else {
+                (void) EmptyFSMountFreeBlocks(mtmp, root, 1, 0);
+                root = 0;
+            }
+        }
+        if (err != 0) {
+            EmptyFSMountCounterAdd(mtmp, kVolumeCounterFreeBlocks, 1);
+        }
+    }
+
+    // Add a record for each entry.  We can't hold a directory block while 
+    // changing the index, so we hash a block's names first.
+
+    for (logicalBlock = 0; (err == 0) && (logicalBlock < blockCount); logicalBlock++) {
+        hashCount = 0;
+        err = FSNodeReadDirBlock(dirNode, logicalBlock, &bp);
+        if (err == 0) {
+            block = (const void *) buf_dataptr(bp);
+            entry = NULL;
+            while ( (entry = EmptyFSDirBlockNextEntry(block, blockSize, entry)) != NULL ) {
+                if (entry->fFileNum != 0) {
+                    assert( hashCount < (hashesSize / sizeof(*hashes)) );
+                    hashes[hashCount] = EmptyFSDirNameHash(&mtmp->fSuperblock, (const char *) entry->fName, entry->fNameLength);
+                    hashCount += 1;
+                }
+            }
+            buf_brelse(bp);
+        }
+        for (index = 0; (err == 0) && (index < hashCount); index++) {
+            err = FSNodeDirIndexInsert(dirNode, &root, EmptyFSDirIndexKey(hashes[index], logicalBlock));
+        }
+    }
+
+    if (err == 0) {
+        dirNode->fDirIndexBlock = root;
+        dirNode->fDirFreeHint   = blockCount - 1;
+        dirNode->fRecordDirty   = TRUE;
+    } else if (root != 0) {
+        FSNodeDirIndexFreeTree(dirNode, root);
+    }
+    if (hashes != NULL) {
+        OSFree(hashes, hashesSize, gOSMallocTag);
+    }
+    return err;
+}
+
+static errno_t FSNodeDirClearEntry(FSNode *dirNode, uint64_t logicalBlock, const char *name, size_t nameLen, uint64_t *fileNumPtr)
+    // Removes the entry for name from block logicalBlock of the directory 
+    // dirNode, returning the file number that it referred to in *fileNumPtr, 
+    // or ENOENT if there's no such entry in that block.  Removing an entry 
+    // just clears its fFileNum; entries never move (see "Directory 
+    // Cookies").  The caller must hold dirNode's fLock exclusive, and a 
+    // transaction handle.
+{
+    errno_t             err;
+    errno_t             junk;
+    uint32_t            blockSize;
+    buf_t               bp;
+    void *              block;
+    EmptyFSDirEntry *   entry;
+    uint64_t            fileNum;
+    size_t              offset;
+    uint64_t            physicalBlock;
+
+    assert(dirNode != NULL);
+    assert(dirNode->fType == VDIR);
+    assert(name != NULL);
+    assert(fileNumPtr != NULL);
+
+    blockSize = dirNode->fMount->fBlockSize;
+
+    fileNum = 0;
+    err = FSNodeReadDirBlock(dirNode, logicalBlock, &bp);
+    if (err == 0) {
+        block = (void *) buf_dataptr(bp);
+        entry = NULL;
+        while ( (entry = EmptyFSDirBlockNextEntry(block, blockSize, entry)) != NULL ) {
+            if (    (entry->fFileNum != 0)
+                 && (entry->fNameLength == nameLen)
+                 && (memcmp(entry->fName, name, nameLen) == 0) ) {
+                fileNum = EmptyFSSwapLE32(entry->fFileNum);
+                break;
+            }
+        }
+        if (fileNum == 0) {
+            buf_brelse(bp);
+            err = ENOENT;
+        } else {
+
+            // Add the block to the transaction before changing it.  That 
+            // might read the block again, so we find the entry using its 
+            // offset.  Entries never move, so it's still there.
+
+            offset = (size_t) (((char *) entry) - ((char *) block));
+            junk = EmptyFSExtentMap(dirNode->fExtents, dirNode->fExtentCount, logicalBlock, &physicalBlock, NULL);
+            assert(junk == 0);              // FSNodeReadDirBlock has already mapped it
+            (void) junk;
+            err = EmptyFSMountModifyMetaBlockStart(dirNode->fMount, physicalBlock, &bp);
+            if (err == 0) {
+                entry = (EmptyFSDirEntry *) (((char *) buf_dataptr(bp)) + offset);
+                assert(EmptyFSSwapLE32(entry->fFileNum) == fileNum);
+                entry->fFileNum = 0;
+                EmptyFSMountModifyMetaBlockEnd(dirNode->fMount, bp);
+            }
+        }
+    }
+    if (err == 0) {
+        *fileNumPtr = fileNum;
+    }
+    return err;
+}
+
+static errno_t FSNodeDirAddEntry(FSNode *dirNode, const char *name, size_t nameLen, uint64_t fileNum, uint8_t type)
+    // Adds an entry for name to the directory dirNode, growing the directory 
+    // by a block if there's no room in the existing ones, and adds it to the 
+    // directory's index, creating the index if the directory has become big 
+    // enough to need one.  If this changes the directory's size or index 
+    // root, its record is dirty.  The caller must hold dirNode's fLock 
+    // exclusive, and a transaction handle, and must have checked that the 
+    // name isn't already there.
+{
+    errno_t         err;
+    errno_t         junk;
+    EmptyFSMount *  mtmp;
+    uint32_t        blockSize;
+    uint64_t        blockCount;
+    uint64_t        logicalBlock;
+    uint64_t        entryBlock;
+    buf_t           bp;
+    uint64_t        hint;
+    uint64_t        start;
+    uint64_t        count;
+    uint64_t        root;
+    uint64_t        junkFileNum;
+
+    assert(dirNode != NULL);
+    assert(dirNode->fType == VDIR);
+    assert(name != NULL);
+
+    mtmp       = dirNode->fMount;
+    blockSize  = mtmp->fBlockSize;
+    blockCount = dirNode->fSize / blockSize;
+    entryBlock = 0;
+
+    // Try the existing blocks, starting with the first one that might have 
+    // room (see "Directory Index Notes").  EmptyFSDirBlockInsertEntry returns 
+    // ENOSPC if the block is full.
+
+    logicalBlock = 0;
+    if (dirNode->fDirIndexBlock != 0) {
+        assert(dirNode->fDirFreeHint < blockCount);
+        logicalBlock = dirNode->fDirFreeHint;
+    }
+    err = ENOSPC;
+    for ( ; (err == ENOSPC) && (logicalBlock < blockCount); logicalBlock++) {
+        err = FSNodeReadDirBlock(dirNode, logicalBlock, &bp);
+        if ( (err == 0) && ! EmptyFSDirBlockHasRoom( (const void *) buf_dataptr(bp), blockSize, nameLen) ) {
+            buf_brelse(bp);
+            err = ENOSPC;
+        } else if (err == 0) {
+            junk = EmptyFSExtentMap(dirNode->fExtents, dirNode->fExtentCount, logicalBlock, &start, NULL);
+            assert(junk == 0);              // FSNodeReadDirBlock has already mapped it
+            err = EmptyFSMountModifyMetaBlockStart(mtmp, start, &bp);
+            if (err == 0) {
+                err = EmptyFSDirBlockInsertEntry( (void *) buf_dataptr(bp), blockSize, name, nameLen, (uint32_t) fileNum, type);
+                if (err == 0) {
+                    EmptyFSMountModifyMetaBlockEnd(mtmp, bp);
+                    entryBlock = logicalBlock;
+                } else {
+                    buf_brelse(bp);
+                }
+            }
+        }
+    }
+
+    // If they're all full, add a block to the end of the directory.
+
+    if ( (err == ENOSPC) && ((dirNode->fSize + blockSize) <= kEmptyFSMaxDirSize) ) {
+        err = EmptyFSMountCounterReserve(mtmp, kVolumeCounterFreeBlocks, 1);
+        if (err == 0) {
+            hint = 0;
+            if (dirNode->fExtentCount != 0) {
+                hint = dirNode->fExtents[dirNode->fExtentCount - 1].fStartBlock + dirNode->fExtents[dirNode->fExtentCount - 1].fBlockCount;
+            }
+            // The block is allocated unmarked, like a delayed allocation; 
+            // FSNodeMarkBlocks sets its bitmap bit when the directory's 
+            // record is written, in the same transaction.
+
+            err = EmptyFSMountAllocBlocks(mtmp, hint, 1, FALSE, &start, &count);
+            if (err == 0) {
+                bp = EmptyFSMountGetMetaBlock(mtmp, start);
+                err = EmptyFSMountModifyMetaBlockStart(mtmp, start, &bp);
+                if (err == 0) {
+                    err = FSNodeAppendExtent(dirNode, start, 1);
+                    if (err != 0) {
+                        buf_brelse(bp);
+                    }
+                }
+                if (err != 0) {
+                    (void) EmptyFSMountFreeBlocks(mtmp, start, 1, kFreeBlocksUnmarked);
+                }
+            }
+            if (err != 0) {
+                EmptyFSMountCounterAdd(mtmp, kVolumeCounterFreeBlocks, 1);
+            }
+        }
+        if (err == 0) {
+            EmptyFSDirBlockInit( (void *) buf_dataptr(bp), blockSize);
+            junk = EmptyFSDirBlockInsertEntry( (void *) buf_dataptr(bp), blockSize, name, nameLen, (uint32_t) fileNum, type);
+            assert(junk == 0);
+            (void) junk;
+            EmptyFSMountModifyMetaBlockEnd(mtmp, bp);
+
+            entryBlock = blockCount;
+            blockCount += 1;
+            dirNode->fBlockCount += 1;
+            dirNode->fSize       += blockSize;
+            dirNode->fRecordDirty = TRUE;
+        }
+    }
+
+    // Index the new entry.  If we can't, take it out again; a directory 
+    // that's bigger than its entries need is harmless.  If the directory 
+    // doesn't have an index but has grown big enough for one, build it, 
+    // which picks up the new entry.  Failing to build it isn't an error; 
+    // the directory just stays linear for now.
+
+    if ( (err == 0) && (dirNode->fDirIndexBlock != 0) ) {
+        root = dirNode->fDirIndexBlock;
+        err = FSNodeDirIndexInsert(dirNode, &root, EmptyFSDirIndexKey(EmptyFSDirNameHash(&mtmp->fSuperblock, name, nameLen), entryBlock));
+        if (err == 0) {
+            if (root != dirNode->fDirIndexBlock) {
+                dirNode->fDirIndexBlock = root;
+                dirNode->fRecordDirty   = TRUE;
+            }
+            dirNode->fDirFreeHint = entryBlock;
+        } else {
+            (void) FSNodeDirClearEntry(dirNode, entryBlock, name, nameLen, &junkFileNum);
+        }
+    } else if (    (err == 0)
+                && (mtmp->fSuperblock.fROCompatFeatures & kEmptyFSROCompatDirIndex)
+                && (blockCount >= kEmptyFSDirIndexMinBlocks) ) {
+        (void) FSNodeDirIndexBuild(dirNode);
+    }
+    return err;
+}
+
+static errno_t FSNodeDirRemoveEntry(FSNode *dirNode, const char *name, size_t nameLen, uint64_t *fileNumPtr)
+    // Removes the entry for name from the directory dirNode, and from its 
+    // index, returning the file number that it referred to in *fileNumPtr, 
+    // or ENOENT if there's no such entry.  The caller must hold dirNode's 
+    // fLock exclusive, and a transaction handle.
+{
+    errno_t             err;
+    uint64_t            blockCount;
+    uint64_t            logicalBlock;
+    uint64_t            fileNum;
+    uint32_t            hash;
+
+    assert(dirNode != NULL);
+    assert(dirNode->fType == VDIR);
+    assert(name != NULL);
+    assert(fileNumPtr != NULL);
+
+    blockCount = dirNode->fSize / dirNode->fMount->fBlockSize;
+
+    // In an indexed directory, the index says which block the entry is in. 
+    // We remove its index record first, so that if clearing the entry then 
+    // fails, the index is still consistent with the directory's blocks, 
+    // even though the name can't be found any more.
+
+    if (dirNode->fDirIndexBlock != 0) {
+        err = FSNodeDirIndexSearch(dirNode, name, nameLen, &fileNum, &logicalBlock);
+        if ( (err == 0) && (fileNum == 0) ) {
+            err = ENOENT;
+        }
+        if (err == 0) {
+            hash = EmptyFSDirNameHash(&dirNode->fMount->fSuperblock, name, nameLen);
+            err = FSNodeDirIndexRemove(dirNode, EmptyFSDirIndexKey(hash, logicalBlock));
+        }
+        if (err == 0) {
+            err = FSNodeDirClearEntry(dirNode, logicalBlock, name, nameLen, &fileNum);
+        }
+        if ( (err == 0) && (logicalBlock < dirNode->fDirFreeHint) ) {
+            dirNode->fDirFreeHint = logicalBlock;
+        }
+    } else {
+        err = ENOENT;
+        for (logicalBlock = 0; (err == ENOENT) && (logicalBlock < blockCount); logicalBlock++) {
+            err = FSNodeDirClearEntry(dirNode, logicalBlock, name, nameLen, &fileNum);
+        }
+    }
+    if (err == 0) {
+        *fileNumPtr = fileNum;
+    }
+    return err;
+}
+
+
+static errno_t FSNodeGetVNodeCreatingIfNecessary(
+    EmptyFSMount *          mtmp,
+    uint64_t                fileNum,
+    vnode_t                 dvp,
+    struct componentname *  cnp,
+    vnode_t *               vnPtr
+)
+    // Returns the vnode for the specified file system object on the volume,
+    // creating the FSNode and the vnode if necessary.  dvp and cnp, if not NULL,
+    // are the directory and name by which the caller found the object; we
+    // pass them along to vnode_create.  The resulting vnode has a I/O reference
+    // count, which the caller is responsible for releasing (using vnode_put) or
+    // passing along to its caller.
+    //
+    // The tricky part of this is making sure that we never create two vnodes
+    // for the same object.  We handle this by setting fAttaching on the FSNode
+    // while we create the vnode; anyone else who comes looking for that object
+    // in the meantime waits for us to finish.
+{
+    errno_t             err;
+    errno_t             junk;
+    uint32_t            hash;
+    FSNodeHashStripe *  stripe;
+    FSNode *            node;
+    FSNode *            spareNode;
+    vnode_t             resultVN;
+    boolean_t           shouldGrow;
+
+    // Pre-conditions
+
+    assert(mtmp != NULL);
+    assert(fileNum != 0);
+    assert( (cnp == NULL) || (dvp != NULL) );
+    assert( vnPtr != NULL);
+    assert(*vnPtr == NULL);
+
+    // resultVN holds vnode we're going to return in *vnPtr.  If this ever goes non-NULL,
+    // we're done.  spareNode is an FSNode that we've allocated but not (yet) put into
+    // the hash; we free it on the way out if we don't use it.
+
+    resultVN   = NULL;
+    spareNode  = NULL;
+    shouldGrow = FALSE;
+
+    hash   = FSNodeHashValue(mtmp->fBlockRDevNum, fileNum);
+    stripe = FSNodeHashStripeForHash(hash);
+
+    // First lock the stripe of the hash that covers this object.
+
+    lck_mtx_lock(stripe->fLock);
+
+    do {
+        // Loop invariants (-:
+
+        assert(resultVN == NULL);       // no point looping if we already have a result
+
+        // lck_mtx_assert is only available in the "com.apple.kpi.unsupported" KPI. 
+        // We link against that KPI in all builds (see the comments in "Info.plist"), 
+        // but the check itself is only worth making in debug builds.
+        #if MACH_ASSERT
+            lck_mtx_assert(stripe->fLock, LCK_MTX_ASSERT_OWNED);
+        #endif
+
+        node = FSNodeHashFindLocked(mtmp->fBlockRDevNum, fileNum, hash);
+        if ( (node == NULL) && (spareNode == NULL) ) {
+            // There's no FSNode for this object, and we haven't got one to hand.
+            // Allocate one with the lock dropped, then loop to check that no one
+            // beat us to it.
+
+            lck_mtx_unlock(stripe->fLock);
+
+            err = FSNodeCreate(mtmp, fileNum, hash, &spareNode);
+
+            lck_mtx_lock(stripe->fLock);
+
+            if (err == 0) {
+                err = EAGAIN;
+            }
+        } else if (node == NULL) {
+            vnode_t                 newVN;
+            struct vnode_fsparam    params;
+
+            // There's no FSNode for this object, so add ours to the hash and attach
+            // a vnode to it.  While we're creating the vnode, we drop our lock (to
+            // avoid the possibility of deadlock), so we set fAttaching to stall anyone
+            // else looking for this object (and eliminate the possibility of two people
+            // trying to create the same vnode).
+
+            node = spareNode;
+            spareNode = NULL;
+
+            node->fAttaching = TRUE;
+            FSNodeHashInsertLocked(node);
+            stripe->fNodeCount += 1;
+
+            shouldGrow = FSNodeHashShouldGrowLocked(stripe);
+
+            lck_mtx_unlock(stripe->fLock);
+
+            if (shouldGrow) {
+                FSNodeHashGrow();
+                shouldGrow = FALSE;
+            }
+
+            newVN = NULL;
+
+            err = FSNodeLoad(node);
+            if (err == 0) {
+                params.vnfs_mp         = mtmp->fMountPoint;
+                params.vnfs_vtype      = node->fType;
+                params.vnfs_str        = NULL;
+                params.vnfs_dvp        = dvp;
+                params.vnfs_fsnode     = node;
+                params.vnfs_vops       = gVNodeOperations;
+                params.vnfs_markroot   = (fileNum == kEmptyFSRootFileNum);
+                params.vnfs_marksystem = FALSE;
+                params.vnfs_rdev       = 0;                                 // we don't currently support VBLK or VCHR
+                params.vnfs_filesize   = (node->fType == VREG) ? node->fSize : 0;
+                params.vnfs_cnp        = cnp;
+                params.vnfs_flags      = VNFS_NOCACHE;                      // VNOPLookup does the cache_enter
+
+                err = vnode_create(VNCREATE_FLAVOR, sizeof(params), &params, &newVN);
+
+                assert( (err == 0) == (newVN != NULL) );
+            }
+
+            lck_mtx_lock(stripe->fLock);
+
+            // No one else should have been able to touch the FSNode while fAttaching
+            // was set.  If they did, that's bad.
+
+            assert(node->fAttaching);
+            assert(node->fVNode == NULL);
+
+            if (err == 0) {
+                // We successfully created the vnode, so it's time to install it in the
+                // FSNode.  Also let the VFS layer know that we have a soft reference to
+                // the vnode.
+
+                node->fVNode = newVN;
+                node->fVID   = vnode_vid(newVN);
+
+                junk = vnode_addfsref(newVN);
+                assert(junk == 0);
+
+                // If this is the root, publish it for the VFSOPRoot fast path.  We 
+                // set the vid first so that a reader that sees the new vnode is 
+                // likely to see the matching vid, but correctness doesn't depend 
+                // on that.
+
+                if (fileNum == kEmptyFSRootFileNum) {
+                    mtmp->fRootVIDHint   = node->fVID;
+                    mtmp->fRootVNodeHint = newVN;
+                }
+
+                // Note that vnode_create creates the vnode with an I/O reference count,
+                // so we can just return it directly.
+
+                resultVN = newVN;
+            } else {
+                // We failed, so take the FSNode back out of the hash.  We free it
+                // (via spareNode) after dropping the lock.
+
+                FSNodeHashRemoveLocked(node);
+                stripe->fNodeCount -= 1;
+
+                spareNode = node;
+            }
+
+            // If anyone got hung up on fAttaching, unblock them.  If we failed, they'll
+            // loop and not find the FSNode, and try to create it for themselves.
+
+            node->fAttaching = FALSE;
+            if (node->fWaiting) {
+                wakeup(node);
+                node->fWaiting = FALSE;
+            }
+        } else if (node->fAttaching) {
+            // If someone else is already trying to create the vnode, wait for
+            // them to get done.  Note that msleep will unlock and relock the
+            // stripe lock, so once it returns we have to loop and start again
+            // from scratch.
+
+            assert(node->fMount == mtmp);
+
+            node->fWaiting = TRUE;
+
+            (void) msleep(node, stripe->fLock, PINOD, "FSNodeGetVNodeCreatingIfNecessary", NULL);
+
+            err = EAGAIN;
+        } else {
+            vnode_t     candidateVN;
+            uint32_t    vid;
+
+            // We already have a vnode.  Drop our lock (again, to avoid deadlocks)
+            // and get a reference on it, using the vnode ID (vid) to confirm that it's
+            // still valid.  If that works, we're all set.  Otherwise, let's just start
+            // again from scratch.
+
+            assert(node->fMount == mtmp);
+            assert(node->fVNode != NULL);
+
+            candidateVN = node->fVNode;
+            vid         = node->fVID;
+
+            lck_mtx_unlock(stripe->fLock);
+
+            err = vnode_getwithvid(candidateVN, vid);
+
+            if (err == 0) {
+                // All ok.   vnode_getwithvid has taken an I/O reference count on the
+                // vnode, so we can just return it to the caller.  This reference
+                // prevents the vnode from being reclaimed in the interim.
+
+                resultVN = candidateVN;
+            } else {
+                // vnode_getwithvid failed.  This is most likely because the vnode
+                // has been reclaimed between dropping the lock and calling vnode_getwithvid.
+                // That's cool.  We just loop again, and this time we'll get the updated
+                // results (hopefully).
+
+                err = EAGAIN;
+            }
+
+            // We need to reacquire the lock because that's the loop invariant.
+
+            lck_mtx_lock(stripe->fLock);
+        }
+
+        // resultVN should only be set if everything is OK.
+
+        assert( (err == 0) == (resultVN != NULL) );
+    } while (err == EAGAIN);
+
+    lck_mtx_unlock(stripe->fLock);
+
+    // Clean up.
+
+    if (spareNode != NULL) {
+        FSNodeDispose(spareNode);
+    }
+    if (err == 0) {
+        *vnPtr = resultVN;
+    }
+
+    // Post-conditions
+
+    assert( (err == 0) == (*vnPtr != NULL) );
+
+    return err;
+}
+
+static void FSNodeDetachVNode(FSNode *node, vnode_t vn)
+    // Called by VNOPReclaim to disassociate vn from its FSNode.  In EmptyFS
+    // there's exactly one vnode per FSNode, so once the vnode is gone the FSNode
+    // is no use to anyone, and we remove it from the hash and free it.
+{
+    int                 junk;
+    FSNodeHashStripe *  stripe;
+
+    assert(node != NULL);
+    assert(vn != NULL);
+
+    stripe = FSNodeHashStripeForHash(node->fHash);
+
+    lck_mtx_lock(stripe->fLock);
+
+    // The thread that creates a vnode records it in the FSNode before releasing
+    // the I/O reference that vnode_create gave it, and VFS can't reclaim a vnode
+    // while it has an I/O reference.  Thus, by the time we get here, the attach
+    // must be complete.  The following asserts check the assumptions that make
+    // this all work.
+
+    assert( ! node->fAttaching );
+    assert(node->fVNode == vn);
+
+    // Tell VFS that we're removing our soft reference to the vnode.
+
+    junk = vnode_removefsref(vn);
+    assert(junk == 0);
+
+    node->fVNode = NULL;
+
+    // If this is the root, withdraw the VFSOPRoot hint.  A reader might 
+    // already have picked up the old value, but vnode_getwithvid will 
+    // fail for them because we're being reclaimed.
+
+    if (node->fFileNum == kEmptyFSRootFileNum) {
+        node->fMount->fRootVNodeHint = NULL;
+    }
+
+    FSNodeHashRemoveLocked(node);
+    assert(stripe->fNodeCount > 0);
+    stripe->fNodeCount -= 1;
+
+    lck_mtx_unlock(stripe->fLock);
+
+    vnode_clearfsnode(vn);
+
+    FSNodeDispose(node);
+}
+
+static errno_t EmptyFSMountGetRootVNodeFast(EmptyFSMount *mtmp, vnode_t *vnPtr)
+    // The VFSOPRoot fast path.  Returns the root vnode for the volume, with 
+    // an I/O reference, without taking any of our locks.  Returns EAGAIN 
+    // if the root vnode doesn't exist, or if the fast path can't be sure 
+    // that it has the right vnode; the caller should then fall back to 
+    // FSNodeGetVNodeCreatingIfNecessary.  See the "Root VNode Notes" for 
+    // the details.
+{
+    errno_t     err;
+    vnode_t     vn;
+    uint32_t    vid;
+    
+    assert(mtmp != NULL);
+    assert( vnPtr != NULL);
+    assert(*vnPtr == NULL);
+    
+    vn  = mtmp->fRootVNodeHint;
+    vid = mtmp->fRootVIDHint;
+    
+    err = EAGAIN;
+    if ( (vn != NULL) && ! (mtmp->fDebugLevel & kEmptyFSDebugNoFastPaths) ) {
+        if ( vnode_getwithvid(vn, vid) == 0 ) {
+            if ( (vnode_mount(vn) == mtmp->fMountPoint) && vnode_isvroot(vn) ) {
+                *vnPtr = vn;
+                err = 0;
+            } else {
+                (void) vnode_put(vn);
+            }
+        }
+    }
+    
+    assert( (err == 0) == (*vnPtr != NULL) );
+    
+    return err;
+}
+
+#if MACH_ASSERT
+
+    static boolean_t ValidVNode(vnode_t vn)
+        // Returns true if the vnode is valid on our file system; that is,
+        // it's attached to an FSNode in the hash.
+    {
+        boolean_t           result;
+        FSNode *            node;
+        FSNodeHashStripe *  stripe;
+
+        assert(vn != NULL);
+
+        node = (FSNode *) vnode_fsnode(vn);
+
+        result = (node != NULL) && (node->fMagic == kFSNodeMagic);
+        if (result) {
+            stripe = FSNodeHashStripeForHash(node->fHash);
+
+            lck_mtx_lock(stripe->fLock);
+
+            result = (node->fVNode == vn) && (node->fMount == EmptyFSMountFromMount( vnode_mount(vn) ));
+
+            lck_mtx_unlock(stripe->fLock);
+        }
+
+        return result;
+    }
+
+#endif
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Decompression Cache
+
+// A compressed file (one whose fCompressedChunkSize isn't zero; see 
+// "Compression" in "EmptyFSFormat.h") can't be read through the cluster 
+// layer, because there's no block on disk that holds any given byte of the 
+// file.  Instead, VNOPRead and VNOPPagein read it a chunk at a time through 
+// this cache, which holds decompressed chunks.  A chunk is read from disk in 
+// one I/O (its extent is contiguous), decompressed into a buffer of its own, 
+// and then copied to the client.  A chunk that's read again, by a read of a 
+// nearby range or by a page-in of the same range, is found here and not 
+// decompressed again.  Volumes with compressed files are always mounted 
+// read-only (see VFSOPMount), so a chunk never changes while it's cached.
+//
+// The cache is global, not per volume, so that its memory is shared 
+// among all of them, and it's split into kDecompCacheStripeCount stripes, 
+// each with its own lock, hash table, LRU list, and an equal share of the 
+// kDecompCacheMaxBytes budget.  An entry is keyed by the mount, file number 
+// and chunk index.  VFSOPUnmount purges a volume's entries, so a later 
+// mount that happens to get the same EmptyFSMount address can't find them.
+//
+// An entry is reference counted.  A reader takes a reference with the stripe 
+// lock held and then copies the data without it, so the lock is held just 
+// long enough to look up the entry.  Eviction only considers entries that 
+// no one's using.  We never hold a stripe lock while doing I/O or 
+// decompressing: on a miss, we read and decompress the chunk with no locks 
+// held and then insert it.  If two threads miss on the same chunk at the 
+// same time, they both decompress it, and the one that inserts second 
+// throws its copy away.  That's rare, and much simpler than making the 
+// second thread wait.
+//
+// We read the compressed data with buf_meta_bread on the device, and then 
+// invalidate the buffer.  Once it's been decompressed we've no further use 
+// for it, and it would otherwise take up buffer cache space that's better 
+// used for metadata.
+//
+// If the file has a checksum table (see "Data Checksums" in 
+// "EmptyFSFormat.h"), we check each chunk's stored data against it before 
+// decompressing it, so a damaged chunk fails with EIO rather than returning 
+// garbage (an uncompressed chunk has no other protection at all).  We read 
+// the table block through the buffer cache and leave it there, because the 
+// next chunk's checksum is almost always in the same block.  The check 
+// happens only on a miss, so a chunk that's in the cache costs nothing 
+// more.
+//
+// The kEmptyFSCounterDecompXxx counters (see "Statistics") record hits, 
+// misses, evictions and the number of bytes decompressed, and the 
+// kEmptyFSCounterDataChecksumXxx counters record the checks.
+
+enum {
+    kDecompCacheStripeCount     = 16,                   // must be a power of two
+    kDecompCacheBucketCount     = 64,                   // per stripe; must be a power of two
+    kDecompCacheMaxBytes        = 64 * 1024 * 1024      // shared equally among the stripes
+};
+
+typedef struct DecompCacheEntry DecompCacheEntry;
+
+struct DecompCacheEntry {
+    DecompCacheEntry *  fHashNext;          // next entry in this hash chain
+    DecompCacheEntry *  fLRUNext;           // next (more recently used) entry in the stripe's LRU list
+    DecompCacheEntry *  fLRUPrev;           // previous (less recently used) entry
+    uint32_t            fHash;              // DecompCacheHashValue of the key
+    uint32_t            fRefCount;          // number of readers using fData
+    EmptyFSMount *      fMount;             // the key: mount, file number and chunk index
+    uint64_t            fFileNum;
+    uint64_t            fChunkIndex;
+    uint32_t            fLength;            // bytes of data in the chunk
+    char *              fData;              // the decompressed chunk, allocated with OSMalloc
+};
+
+struct DecompCacheStripe {
+    lck_mtx_t *         fLock;              // protects everything below, and every entry in the stripe
+    uint64_t            fBytes;             // sum of fLength of the entries in the stripe
+    DecompCacheEntry *  fLRUHead;           // least recently used entry
+    DecompCacheEntry *  fLRUTail;           // most recently used entry
+    DecompCacheEntry *  fBuckets[kDecompCacheBucketCount];
+};
+typedef struct DecompCacheStripe DecompCacheStripe;
+
+static DecompCacheStripe gDecompCacheStripes[kDecompCacheStripeCount];
+
+static uint32_t DecompCacheHashValue(const EmptyFSMount *mtmp, uint64_t fileNum, uint64_t chunkIndex)
+    // Returns the hash value for the given chunk.  This is the same 
+    // multiplicative hash as FSNodeHashValue; the low bits select the stripe 
+    // and the bits above them select the bucket.
+{
+    uint64_t    key;
+
+    key = (fileNum << 24) ^ chunkIndex ^ (uint64_t) (uintptr_t) mtmp;
+    key *= 0x9E3779B97F4A7C15ULL;
+    return (uint32_t) (key >> 32);
+}
+
+static DecompCacheStripe * DecompCacheStripeForHash(uint32_t hash)
+    // Returns the stripe that covers the given hash value.
+{
+    return &gDecompCacheStripes[hash & (kDecompCacheStripeCount - 1)];
+}
+
+static DecompCacheEntry ** DecompCacheBucketForHash(DecompCacheStripe *stripe, uint32_t hash)
+    // Returns the hash chain, within stripe, for the given hash value.
+{
+    return &stripe->fBuckets[(hash / kDecompCacheStripeCount) & (kDecompCacheBucketCount - 1)];
+}
+
+static void DecompCacheFreeEntry(DecompCacheEntry *entry)
+    // Frees an entry that isn't in the cache.
+{
+    if (entry->fData != NULL) {
+        OSFree(entry->fData, entry->fLength, gOSMallocTag);
+    }
+    OSFree(entry, sizeof(*entry), gOSMallocTag);
+}
+
+static void DecompCacheLRUAppendLocked(DecompCacheStripe *stripe, DecompCacheEntry *entry)
+    // Adds entry to the most recently used end of the stripe's LRU list.
+{
+    entry->fLRUNext = NULL;
+    entry->fLRUPrev = stripe->fLRUTail;
+    if (stripe->fLRUTail == NULL) {
+        stripe->fLRUHead = entry;
+    } else {
+        stripe->fLRUTail->fLRUNext = entry;
+    }
+    stripe->fLRUTail = entry;
+}
+
+static void DecompCacheLRURemoveLocked(DecompCacheStripe *stripe, DecompCacheEntry *entry)
+    // Removes entry from the stripe's LRU list.
+{
+    if (entry->fLRUPrev == NULL) {
+        stripe->fLRUHead = entry->fLRUNext;
+    } else {
+        entry->fLRUPrev->fLRUNext = entry->fLRUNext;
+    }
+    if (entry->fLRUNext == NULL) {
+        stripe->fLRUTail = entry->fLRUPrev;
+    } else {
+        entry->fLRUNext->fLRUPrev = entry->fLRUPrev;
+    }
+    entry->fLRUNext = NULL;
+    entry->fLRUPrev = NULL;
+}
+
+static void DecompCacheRemoveLocked(DecompCacheStripe *stripe, DecompCacheEntry *entry)
+    // Removes an unreferenced entry from the stripe altogether.  The caller 
+    // frees it, after dropping the lock.
+{
+    DecompCacheEntry ** link;
+
+    assert(entry->fRefCount == 0);
+
+    link = DecompCacheBucketForHash(stripe, entry->fHash);
+    while (*link != entry) {
+        assert(*link != NULL);
+        link = &(*link)->fHashNext;
+    }
+    *link = entry->fHashNext;
+    entry->fHashNext = NULL;
+    DecompCacheLRURemoveLocked(stripe, entry);
+    assert(stripe->fBytes >= entry->fLength);
+    stripe->fBytes -= entry->fLength;
+}
+
+static DecompCacheEntry * DecompCacheFindLocked(DecompCacheStripe *stripe, uint32_t hash, const EmptyFSMount *mtmp, uint64_t fileNum, uint64_t chunkIndex)
+    // Looks up a chunk in the stripe.  If it's there, takes a reference to 
+    // it, makes it the most recently used entry, and returns it.
+{
+    DecompCacheEntry *  entry;
+
+    for (entry = *DecompCacheBucketForHash(stripe, hash); entry != NULL; entry = entry->fHashNext) {
+        if ( (entry->fMount == mtmp) && (entry->fFileNum == fileNum) && (entry->fChunkIndex == chunkIndex) ) {
+            entry->fRefCount += 1;
+            DecompCacheLRURemoveLocked(stripe, entry);
+            DecompCacheLRUAppendLocked(stripe, entry);
+            break;
+        }
+    }
+    return entry;
+}
+
+static errno_t DecompCacheReadChunkChecksum(FSNode *node, uint64_t chunkIndex, uint32_t *checksumPtr)
+    // Gets the checksum of chunk chunkIndex of the compressed file node from 
+    // its checksum table, which it must have.  FSNodeLoad checked (with 
+    // EmptyFSFileRecordValidate) that the table is on the volume.
+{
+    errno_t         err;
+    EmptyFSMount *  mtmp;
+    uint64_t        tableOffset;
+    buf_t           bp;
+
+    assert(node->fChunkChecksumBlock != 0);
+    assert(checksumPtr != NULL);
+
+    mtmp = node->fMount;
+    tableOffset = chunkIndex * sizeof(uint32_t);
+
+    bp = NULL;
+    err = buf_meta_bread(
+        mtmp->fBlockDevVNode, 
+        (daddr64_t) ((node->fChunkChecksumBlock + (tableOffset / mtmp->fBlockSize)) * mtmp->fDevBlocksPerBlock), 
+        (int) mtmp->fBlockSize, 
+        NOCRED, 
+        &bp
+    );
+    if (err == 0) {
+        *checksumPtr = EmptyFSSwapLE32( * (const uint32_t *) (((const char *) buf_dataptr(bp)) + (tableOffset % mtmp->fBlockSize)) );
+    }
+    if (bp != NULL) {
+        buf_brelse(bp);
+    }
+    return err;
+}
+
+static errno_t DecompCacheReadChunk(FSNode *node, uint64_t chunkIndex, DecompCacheEntry **entryPtr)
+    // Reads and decompresses chunk chunkIndex of the compressed file node into 
+    // a new entry, which isn't yet in the cache, checking it against the 
+    // file's checksum table if it has one.  This can block, so the caller 
+    // mustn't hold any locks.
+{
+    errno_t                 err;
+    EmptyFSMount *          mtmp;
+    const EmptyFSExtent *   extent;
+    DecompCacheEntry *      entry;
+    uint64_t                chunkStart;
+    uint32_t                checksum;
+    buf_t                   bp;
+
+    assert(node->fCompressedChunkSize != 0);
+    assert(chunkIndex < node->fExtentCount);
+    assert(entryPtr != NULL);
+
+    mtmp   = node->fMount;
+    extent = &node->fExtents[chunkIndex];
+
+    err = 0;
+    entry = OSMalloc(sizeof(*entry), gOSMallocTag);
+    if (entry == NULL) {
+        err = ENOMEM;
+    } else {
+        memset(entry, 0, sizeof(*entry));
+
+        chunkStart = chunkIndex * node->fCompressedChunkSize;
+        assert(chunkStart < node->fSize);
+        if ( (node->fSize - chunkStart) < node->fCompressedChunkSize ) {
+            entry->fLength = (uint32_t) (node->fSize - chunkStart);
+        } else {
+            entry->fLength = node->fCompressedChunkSize;
+        }
+        entry->fData = OSMalloc(entry->fLength, gOSMallocTag);
+        if (entry->fData == NULL) {
+            err = ENOMEM;
+        }
+    }
+
+    // Get the chunk's checksum, if it has one, before we read the chunk, so 
+    // that we don't hold the chunk's buffer while we wait for the table.
+
+    checksum = 0;
+    if ( (err == 0) && (node->fChunkChecksumBlock != 0) ) {
+        err = DecompCacheReadChunkChecksum(node, chunkIndex, &checksum);
+    }
+
+    // Read the extent in one go.  FSNodeLoad checked (with 
+    // EmptyFSCompressedExtentsValidate) that it's on the volume and no 
+    // bigger than its chunk, so its size is bounded by 
+    // kEmptyFSMaxCompressedChunkSize.
+
+    if (err == 0) {
+        bp = NULL;
+        err = buf_meta_bread(
+            mtmp->fBlockDevVNode, 
+            (daddr64_t) (extent->fStartBlock * mtmp->fDevBlocksPerBlock), 
+            (int) (extent->fBlockCount * mtmp->fBlockSize), 
+            NOCRED, 
+            &bp
+        );
+        if ( (err == 0) && (node->fChunkChecksumBlock != 0) ) {
+            StatsCount(kEmptyFSCounterDataChecksumVerify, 1);
+            if ( EmptyFSChecksum(0, (const void *) buf_dataptr(bp), (size_t) (extent->fBlockCount * mtmp->fBlockSize)) != checksum ) {
+                StatsCount(kEmptyFSCounterDataChecksumError, 1);
+                printf("EmptyFS:DecompCacheReadChunk: chunk %llu of file %llu has a bad checksum\n", (unsigned long long) chunkIndex, (unsigned long long) node->fFileNum);
+                err = EIO;
+            }
+        }
+        if (err == 0) {
+            err = EmptyFSDecompress(
+                extent->fFlags & kEmptyFSCompressionMask, 
+                (const void *) buf_dataptr(bp), 
+                (size_t) (extent->fBlockCount * mtmp->fBlockSize), 
+                entry->fData, 
+                entry->fLength
+            );
+            if (err != 0) {
+                printf("EmptyFS:DecompCacheReadChunk: chunk %llu of file %llu is corrupt\n", (unsigned long long) chunkIndex, (unsigned long long) node->fFileNum);
+            }
+        }
+        if (bp != NULL) {
+            buf_markinvalid(bp);
+            buf_brelse(bp);
+        }
+    }
+    if ( (err == 0) && ((extent->fFlags & kEmptyFSCompressionMask) != kEmptyFSCompressionNone) ) {
+        StatsCount(kEmptyFSCounterDecompBytes, entry->fLength);
+    }
+
+    if (err == 0) {
+        entry->fMount      = mtmp;
+        entry->fFileNum    = node->fFileNum;
+        entry->fChunkIndex = chunkIndex;
+        entry->fHash       = DecompCacheHashValue(mtmp, node->fFileNum, chunkIndex);
+        entry->fRefCount   = 1;
+        *entryPtr = entry;
+    } else if (entry != NULL) {
+        DecompCacheFreeEntry(entry);
+    }
+    return err;
+}
+
+static errno_t DecompCacheGet(FSNode *node, uint64_t chunkIndex, DecompCacheEntry **entryPtr)
+    // Returns the decompressed data for chunk chunkIndex of the compressed 
+    // file node, reading it if it's not already cached.  On success, *entryPtr 
+    // is the entry, on which the caller holds a reference, which they must 
+    // release with DecompCacheRelease.
+{
+    errno_t             err;
+    uint32_t            hash;
+    DecompCacheStripe * stripe;
+    DecompCacheEntry ** bucket;
+    DecompCacheEntry *  entry;
+    DecompCacheEntry *  newEntry;
+    DecompCacheEntry *  victim;
+    DecompCacheEntry *  nextVictim;
+    DecompCacheEntry *  evicted;
+    uint32_t            evictCount;
+
+    assert(node != NULL);
+    assert(entryPtr != NULL);
+
+    hash   = DecompCacheHashValue(node->fMount, node->fFileNum, chunkIndex);
+    stripe = DecompCacheStripeForHash(hash);
+
+    lck_mtx_lock(stripe->fLock);
+    entry = DecompCacheFindLocked(stripe, hash, node->fMount, node->fFileNum, chunkIndex);
+    lck_mtx_unlock(stripe->fLock);
+
+    err = 0;
+    if (entry != NULL) {
+        StatsCount(kEmptyFSCounterDecompCacheHit, 1);
+    } else {
+        StatsCount(kEmptyFSCounterDecompCacheMiss, 1);
+
+        newEntry = NULL;
+        err = DecompCacheReadChunk(node, chunkIndex, &newEntry);
+        if (err == 0) {
+            evicted = NULL;
+            evictCount = 0;
+
+            lck_mtx_lock(stripe->fLock);
+
+            // Someone may have inserted the chunk while we were reading it. 
+            // If so, use theirs.  If not, insert ours and then, if the stripe 
+            // is over its budget, evict unreferenced entries, least recently 
+            // used first, onto a list that we free once we've dropped the lock.
+
+            entry = DecompCacheFindLocked(stripe, hash, node->fMount, node->fFileNum, chunkIndex);
+            if (entry == NULL) {
+                entry = newEntry;
+                newEntry = NULL;
+
+                bucket = DecompCacheBucketForHash(stripe, hash);
+                entry->fHashNext = *bucket;
+                *bucket = entry;
+                DecompCacheLRUAppendLocked(stripe, entry);
+                stripe->fBytes += entry->fLength;
+
+                victim = stripe->fLRUHead;
+                while ( (stripe->fBytes > (kDecompCacheMaxBytes / kDecompCacheStripeCount)) && (victim != NULL) ) {
+                    nextVictim = victim->fLRUNext;
+                    if (victim->fRefCount == 0) {
+                        DecompCacheRemoveLocked(stripe, victim);
+                        victim->fHashNext = evicted;
+                        evicted = victim;
+                        evictCount += 1;
+                    }
+                    victim = nextVictim;
+                }
+            }
+
+            lck_mtx_unlock(stripe->fLock);
+
+            if (newEntry != NULL) {
+                newEntry->fRefCount = 0;
+                DecompCacheFreeEntry(newEntry);
+            }
+            while (evicted != NULL) {
+                victim = evicted;
+                evicted = victim->fHashNext;
+                DecompCacheFreeEntry(victim);
+            }
+            if (evictCount != 0) {
+                StatsCount(kEmptyFSCounterDecompCacheEvict, evictCount);
+            }
+        }
+    }
+    if (err == 0) {
+        *entryPtr = entry;
+    }
+
+    assert( (err != 0) || ((*entryPtr)->fRefCount != 0) );
+
+    return err;
+}
+
+static void DecompCacheRelease(DecompCacheEntry *entry)
+    // Releases a reference taken by DecompCacheGet.  The entry stays in the 
+    // cache until it's evicted or purged.
+{
+    DecompCacheStripe * stripe;
+
+    stripe = DecompCacheStripeForHash(entry->fHash);
+
+    lck_mtx_lock(stripe->fLock);
+    assert(entry->fRefCount != 0);
+    entry->fRefCount -= 1;
+    lck_mtx_unlock(stripe->fLock);
+}
+
+static void DecompCachePurge(EmptyFSMount *mtmp)
+    // Removes all of the entries for the volume mtmp.  This is called by 
+    // VFSOPUnmount, once every vnode on the volume is gone, so none of them 
+    // can be in use.
+{
+    uint32_t            stripeIndex;
+    DecompCacheStripe * stripe;
+    DecompCacheEntry *  entry;
+    DecompCacheEntry *  nextEntry;
+    DecompCacheEntry *  purged;
+
+    for (stripeIndex = 0; stripeIndex < kDecompCacheStripeCount; stripeIndex++) {
+        stripe = &gDecompCacheStripes[stripeIndex];
+        purged = NULL;
+
+        lck_mtx_lock(stripe->fLock);
+        for (entry = stripe->fLRUHead; entry != NULL; entry = nextEntry) {
+            nextEntry = entry->fLRUNext;
+            if (entry->fMount == mtmp) {
+                DecompCacheRemoveLocked(stripe, entry);
+                entry->fHashNext = purged;
+                purged = entry;
+            }
+        }
+        lck_mtx_unlock(stripe->fLock);
+
+        while (purged != NULL) {
+            entry = purged;
+            purged = entry->fHashNext;
+            DecompCacheFreeEntry(entry);
+        }
+    }
+}
+
+static void DecompCacheTerm(void)
+    // Disposes of the decompression cache.  This is safe to call even if 
+    // DecompCacheInit failed part way through.  By the time this is called 
+    // all volumes have been unmounted, so the cache must be empty.
+{
+    uint32_t    stripeIndex;
+
+    for (stripeIndex = 0; stripeIndex < kDecompCacheStripeCount; stripeIndex++) {
+        assert(gDecompCacheStripes[stripeIndex].fLRUHead == NULL);
+        assert(gDecompCacheStripes[stripeIndex].fBytes == 0);
+        if (gDecompCacheStripes[stripeIndex].fLock != NULL) {
+            lck_mtx_free(gDecompCacheStripes[stripeIndex].fLock, gLockGroup);
+            gDecompCacheStripes[stripeIndex].fLock = NULL;
+        }
+    }
+}
+
+static errno_t DecompCacheInit(void)
+    // Creates the stripe locks.
+{
+    errno_t     err;
+    uint32_t    stripeIndex;
+
+    err = 0;
+    for (stripeIndex = 0; stripeIndex < kDecompCacheStripeCount; stripeIndex++) {
+        memset(&gDecompCacheStripes[stripeIndex], 0, sizeof(gDecompCacheStripes[stripeIndex]));
+        gDecompCacheStripes[stripeIndex].fLock = lck_mtx_alloc_init(gLockGroup, LCK_ATTR_NULL);
+        if (gDecompCacheStripes[stripeIndex].fLock == NULL) {
+            err = ENOMEM;
+            break;
+        }
+    }
+    if (err != 0) {
+        DecompCacheTerm();
+    }
+    return err;
+}
+
+static errno_t FSNodeCopyCompressed(FSNode *node, uint64_t offset, uint64_t length, uio_t uio, char *buffer)
+    // Copies length bytes of the compressed file node, starting at offset, to 
+    // uio or, if uio is NULL, to buffer.  The range must lie within the file. 
+    // We copy a chunk at a time, holding a reference to each chunk's cache 
+    // entry while we copy from it.
+{
+    errno_t             err;
+    DecompCacheEntry *  entry;
+    uint64_t            chunkIndex;
+    uint32_t            chunkOffset;
+    uint32_t            thisLength;
+
+    assert(node->fCompressedChunkSize != 0);
+    assert( (uio != NULL) != (buffer != NULL) );
+    assert(offset <= node->fSize);
+    assert(length <= (node->fSize - offset));
+
+    err = 0;
+    while ( (err == 0) && (length != 0) ) {
+        chunkIndex  = offset / node->fCompressedChunkSize;
+        chunkOffset = (uint32_t) (offset % node->fCompressedChunkSize);
+
+        err = DecompCacheGet(node, chunkIndex, &entry);
+        if (err == 0) {
+            assert(chunkOffset < entry->fLength);
+            thisLength = entry->fLength - chunkOffset;
+            if (thisLength > length) {
+                thisLength = (uint32_t) length;
+            }
+            if (uio != NULL) {
+                err = uiomove(entry->fData + chunkOffset, (int) thisLength, uio);
+            } else {
+                memcpy(buffer, entry->fData + chunkOffset, thisLength);
+                buffer += thisLength;
+            }
+            DecompCacheRelease(entry);
+
+            offset += thisLength;
+            length -= thisLength;
+        }
+    }
+    return err;
+}
+
+static errno_t FSNodePageinCompressed(FSNode *node, upl_t pl, vm_offset_t plOffset, off_t fOffset, size_t size, int flags)
+    // Implements VNOPPagein for a compressed file.  We map the UPL, fill its 
+    // pages from the decompression cache, zero fill anything beyond the end of 
+    // the file, unmap it, and then commit or abort the pages (unless 
+    // UPL_NOCOMMIT says that's the caller's job).
+{
+    errno_t         err;
+    kern_return_t   kernErr;
+    vm_offset_t     addr;
+    uint64_t        validSize;
+
+    assert(node->fCompressedChunkSize != 0);
+
+    err = 0;
+    if (fOffset < 0) {
+        err = EINVAL;
+    }
+    if (err == 0) {
+        kernErr = ubc_upl_map(pl, &addr);
+        err = ErrnoFromKernReturn(kernErr);
+    }
+    if (err == 0) {
+        validSize = 0;
+        if ( (uint64_t) fOffset < node->fSize ) {
+            validSize = node->fSize - (uint64_t) fOffset;
+            if (validSize > size) {
+                validSize = size;
+            }
+        }
+        err = FSNodeCopyCompressed(node, (uint64_t) fOffset, validSize, NULL, ((char *) addr) + plOffset);
+        if (err == 0) {
+            memset( ((char *) addr) + plOffset + validSize, 0, size - (size_t) validSize);
+        }
+        kernErr = ubc_upl_unmap(pl);
+        assert(kernErr == KERN_SUCCESS);
+    }
+    if ( ! (flags & UPL_NOCOMMIT) ) {
+        if (err == 0) {
+            (void) ubc_upl_commit_range(pl, plOffset, size, UPL_COMMIT_FREE_ON_EMPTY);
+        } else {
+            (void) ubc_upl_abort_range(pl, plOffset, size, UPL_ABORT_ERROR | UPL_ABORT_FREE_ON_EMPTY);
+        }
+    }
+    return err;
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** File Data
+
+// File data is read through the unified buffer cache (UBC).  VNOPRead calls 
+// cluster_read, which copies any data that's already cached and, for the rest, 
+// calls VNOPBlockmap to find out where the file lives on disk, then builds 
+// buffers that are as big as the file's layout allows (up to the cluster 
+// layer's limit) and passes them to VNOPStrategy.  Our on-disk format is 
+// extent based, so a file that was written in one go is usually a single 
+// extent, and a large read turns into a handful of large device I/Os.
+//
+// The cluster layer uses logical blocks of PAGE_SIZE when it talks to us 
+// (in VNOPBlktooff and VNOPOfftoblk), regardless of our block size.  
+// VNOPBlockmap returns device block numbers, in units of fDevBlockSize, 
+// because that's what buf_strategy passes to the device.
+//
+// Memory mapped files share the same cache.  When a mapping faults on a page 
+// that isn't in the UBC, VM builds a UPL (a list of busy pages) and calls 
+// VNOPPagein, which passes it to cluster_pagein.  That uses VNOPBlockmap and 
+// VNOPStrategy exactly like cluster_read, except that the device reads 
+// directly into the UPL's pages, which then become the mapped pages.  
+// There's no intermediate buffer and no copy, and a page that's been read 
+// with VNOPRead is already there for anyone who maps the file (and vice versa).
+//
+// Compressed files are the exception.  They don't go through the cluster 
+// layer at all; see "Decompression Cache".
+
+// Memory Mapping Notes
+// --------------------
+// VFS calls VNOPMmap each time the file is mapped, and VNOPMnomap once, when 
+// the last mapping goes away.  While the file is mapped, VM holds a use count 
+// on the vnode, so a normal unmount fails with EBUSY, just as it would if the 
+// file were open.  We record the mapped state in the FSNode (fMapped) and 
+// keep a count of mapped files in the mount (fMappedCount), which lets 
+// VFSOPUnmount check that the two stay in step.
+//
+// A forced unmount is different: VFS reclaims the vnode regardless of the use 
+// count, and the mapping is torn down later, if at all, against a dead vnode, 
+// so VNOPMnomap is never called.  Thus VNOPReclaim clears fMapped itself.  
+// Any later fault on the mapping fails (the process gets a SIGBUS), because 
+// the vnode no longer leads to us.
+
+// Read-Ahead Notes
+// ----------------
+// cluster_read has a read-ahead of its own, but it's tuned for the general 
+// case and its window is modest.  Our workload is dominated by large sequential 
+// reads of big files, so we run our own read-ahead and turn off the cluster 
+// layer's (by passing IO_RAOFF), so the two don't fight.
+//
+// The state is per FSNode.  Each read that starts exactly where the previous 
+// read finished is sequential, and doubles the read-ahead window, from 
+// kEmptyFSReadAheadMinWindow up to kEmptyFSReadAheadMaxWindow.  Any other read 
+// resets the window to zero, so random access doesn't waste bandwidth on data 
+// that no one will use.  While the window is open, we keep the UBC filled up 
+// to a window's worth beyond the current read, using advisory_read.  To 
+// keep the I/Os big, we don't top it up on every read, only once less than half 
+// a window remains.
+//
+// The state is protected by the FSNode's hash stripe lock, which we already 
+// have and is rarely contended.  We hold it just long enough to update the 
+// state; the I/O happens with no locks held.  Two threads reading the same 
+// file at once can confuse the stream detection, but the worst that can happen 
+// is that we read ahead too much or too little; read-ahead is just a hint.
+//
+// The kEmptyFSDebugNoFastPaths debug bit turns all of this off, leaving 
+// read-ahead to the cluster layer.
+
+enum {
+    kEmptyFSReadAheadMinWindow =  128 * 1024,
+    kEmptyFSReadAheadMaxWindow = 8192 * 1024
+};
+
+// Delayed Allocation Notes
+// ------------------------
+// On a writable volume, VNOPWrite doesn't allocate any blocks.  It reserves 
+// them, by taking them from the free block counter (so that the volume can't 
+// be overcommitted, and write returns ENOSPC when it should), and adds them 
+// to the file's fDelayedBlocks.  The data just sits in dirty pages in the UBC. 
+// The blocks are allocated when those pages are written back: the cluster 
+// layer calls VNOPBlockmap with VNODE_WRITE, and if the offset is beyond the 
+// blocks that the file has, FSNodeAllocateDelayed allocates all of its 
+// delayed blocks at once, right after its last extent if possible.  So a file 
+// that's written with lots of small appends is allocated in big runs, and 
+// files that are written at the same time don't interleave their blocks.
+//
+// For a regular file on a writable volume, this means that
+//
+//     fBlockCount + fDelayedBlocks >= ceil(fSize / fBlockSize)
+//
+// (it's only greater if the file has space preallocated by VNOPAllocate), 
+// and that fSize can be greater than fBlockCount * fBlockSize.  Reading the 
+// part of the file that has no blocks yet always finds the data in the UBC, 
+// because dirty pages are never evicted; VNOPBlockmap returns -1 for it, 
+// like a hole.  FSNodeWriteRecord never writes a size that's beyond the 
+// allocated blocks, so the record on disk is always consistent.
+//
+// The blocks that FSNodeAllocateDelayed allocates aren't marked in the 
+// bitmap straight away.  They're unmarked (see "Allocation Notes") until 
+// FSNodeWriteRecord writes the record that points to them, when 
+// FSNodeMarkBlocks marks them, in the same transaction as the record.  So, 
+// on a journalled volume, the bitmap never says that a block is in use 
+// unless some record on disk says who's using it, and a crash can't leak 
+// blocks.  fMarkedBlockCount is the number of the file's blocks, counting 
+// from the start, that are marked; the rest are unmarked.
+
+static errno_t FSNodeAppendExtent(FSNode *node, uint64_t startBlock, uint64_t blockCount)
+    // Adds blocks to the end of the file's extent list, merging them into 
+    // the last extent if they're contiguous with it.  The caller must hold 
+    // fLock exclusive.  This doesn't change fBlockCount.
+{
+    errno_t         err;
+    EmptyFSExtent * last;
+    EmptyFSExtent * newExtents;
+    uint32_t        newCapacity;
+
+    assert(node != NULL);
+    assert(blockCount != 0);
+    assert(blockCount <= UINT32_MAX);
+
+    err = 0;
+    last = (node->fExtentCount == 0) ? NULL : &node->fExtents[node->fExtentCount - 1];
+    if (    (last != NULL) 
+         && ( (last->fStartBlock + last->fBlockCount) == startBlock ) 
+         && ( ((uint64_t) last->fBlockCount + blockCount) <= UINT32_MAX ) ) {
+        last->fBlockCount += (uint32_t) blockCount;
+    } else {
+        if (node->fExtentCount == node->fExtentCapacity) {
+            newCapacity = node->fExtentCapacity * 2;
+            newExtents = OSMalloc(newCapacity * sizeof(EmptyFSExtent), gOSMallocTag);
+            if (newExtents == NULL) {
+                err = ENOMEM;
+            } else {
+                memcpy(newExtents, node->fExtents, node->fExtentCount * sizeof(EmptyFSExtent));
+                if (node->fExtents != node->fInlineExtents) {
+                    OSFree(node->fExtents, node->fExtentCapacity * sizeof(EmptyFSExtent), gOSMallocTag);
+                }
+                node->fExtents        = newExtents;
+                node->fExtentCapacity = newCapacity;
+            }
+        }
+        if (err == 0) {
+            node->fExtents[node->fExtentCount].fStartBlock = startBlock;
+            node->fExtents[node->fExtentCount].fBlockCount = (uint32_t) blockCount;
+            node->fExtents[node->fExtentCount].fFlags      = 0;
+            node->fExtentCount += 1;
+        }
+    }
+    return err;
+}
+
+static errno_t FSNodeAllocateDelayed(FSNode *node, boolean_t contiguous)
+    // Allocates all of the file's delayed blocks.  If contiguous is true, 
+    // the blocks must all be in one run, though not necessarily right after 
+    // the file's existing blocks; if they can't be, we return ENOSPC, having 
+    // allocated some of them.  The blocks aren't marked in the bitmap until 
+    // the file's record is written (see FSNodeMarkBlocks), so this doesn't 
+    // need a transaction handle.  The caller must hold fLock exclusive.  See 
+    // "Delayed Allocation Notes".
+{
+    errno_t         err;
+    EmptyFSMount *  mtmp;
+    uint64_t        hint;
+    boolean_t       first;
+    uint64_t        start;
+    uint64_t        count;
+
+    assert(node != NULL);
+
+    mtmp = node->fMount;
+
+    // Start looking right after the file's last block, so that, if no one 
+    // has allocated there in the meantime, the new blocks just extend the 
+    // last extent.
+    
+    // A contiguous run doesn't have to follow the file's blocks, so in that 
+    // case we don't want to start with a partial run right after them.  Any 
+    // later run must carry on where the last one ended.
+    
+    hint = 0;
+    if ( (node->fExtentCount != 0) && ! contiguous ) {
+        hint = node->fExtents[node->fExtentCount - 1].fStartBlock + node->fExtents[node->fExtentCount - 1].fBlockCount;
+    }
+
+    err = 0;
+    first = TRUE;
+    while ( (err == 0) && (node->fDelayedBlocks != 0) ) {
+        err = EmptyFSMountAllocBlocks(mtmp, hint, node->fDelayedBlocks, FALSE, &start, &count);
+        if ( (err == 0) && contiguous && ! first && (start != hint) ) {
+            (void) EmptyFSMountFreeBlocks(mtmp, start, count, kFreeBlocksUnmarked);    // still reserved, by fDelayedBlocks
+            err = ENOSPC;
+        }
+        first = FALSE;
+        if (err == 0) {
+            err = FSNodeAppendExtent(node, start, count);
+            if (err == 0) {
+                node->fBlockCount    += count;
+                node->fDelayedBlocks -= count;
+                node->fRecordDirty    = TRUE;
+                hint = start + count;
+            } else {
+                (void) EmptyFSMountFreeBlocks(mtmp, start, count, kFreeBlocksUnmarked);    // still reserved, by fDelayedBlocks
+            }
+        }
+    }
+    return err;
+}
+
+static errno_t FSNodeMarkBlocks(FSNode *node)
+    // Marks the file's unmarked blocks (those beyond fMarkedBlockCount) in 
+    // the bitmap.  The caller must hold fLock exclusive, and a transaction 
+    // handle.  See "Delayed Allocation Notes".
+{
+    errno_t         err;
+    EmptyFSMount *  mtmp;
+    uint64_t        logicalBlock;
+    uint64_t        physicalBlock;
+    uint64_t        contig;
+    uint64_t        marked;
+
+    assert(node != NULL);
+    assert(node->fMarkedBlockCount <= node->fBlockCount);
+
+    mtmp = node->fMount;
+
+    err = 0;
+    while ( (err == 0) && (node->fMarkedBlockCount < node->fBlockCount) ) {
+        logicalBlock = node->fMarkedBlockCount;
+        err = EmptyFSExtentMap(node->fExtents, node->fExtentCount, logicalBlock, &physicalBlock, &contig);
+        if (err == 0) {
+            if (contig > (node->fBlockCount - logicalBlock)) {
+                contig = node->fBlockCount - logicalBlock;
+            }
+            err = EmptyFSMountMarkAllocated(mtmp, physicalBlock, contig, &marked);
+            node->fMarkedBlockCount += marked;
+        }
+    }
+    return err;
+}
+
+static errno_t FSNodeTruncateBlocks(FSNode *node, uint64_t newSize)
+    // Gets rid of any blocks, allocated or delayed, that aren't needed to 
+    // hold newSize bytes, and returns them to the free block counter.  The 
+    // caller must hold fLock exclusive, and a transaction handle, and must 
+    // already have thrown away the pages beyond newSize (using ubc_setsize), 
+    // so that no one can be writing to the blocks.  This doesn't change 
+    // fSize.  The caller must write the file's record in the same 
+    // transaction, so that the record on disk never points to free blocks.
+{
+    errno_t         err;
+    errno_t         junk;
+    EmptyFSMount *  mtmp;
+    uint64_t        blocksNeeded;
+    uint64_t        excess;
+    uint64_t        freed;
+    uint64_t        start;
+    uint64_t        unmarked;
+    uint32_t        options;
+    EmptyFSExtent * last;
+
+    assert(node != NULL);
+
+    mtmp = node->fMount;
+    blocksNeeded = (newSize + mtmp->fBlockSize - 1) / mtmp->fBlockSize;
+    freed = 0;
+    err = 0;
+
+    // Delayed blocks are at the end, so they go first.  They're only a 
+    // reservation, so freeing them is just a matter of counting.
+    
+    if ( (node->fBlockCount + node->fDelayedBlocks) > blocksNeeded ) {
+        excess = node->fBlockCount + node->fDelayedBlocks - blocksNeeded;
+        if (excess > node->fDelayedBlocks) {
+            excess = node->fDelayedBlocks;
+        }
+        node->fDelayedBlocks -= excess;
+        freed += excess;
+    }
+
+    // Then free whole or partial extents from the end.  The end of a run 
+    // may be unmarked (see "Delayed Allocation Notes"), in which case it's 
+    // just given back.  If we can't update the bitmap, we leak the blocks 
+    // rather than risk having two files think that they own them. 
+    // EmptyFSMountFreeBlocks adds the blocks to the free block counter, 
+    // once it's safe to reuse them.
+    
+    options = kFreeBlocksRelease;
+    if (node->fType == VDIR) {
+        options |= kFreeBlocksMetadata;
+    }
+    while (node->fBlockCount > blocksNeeded) {
+        assert(node->fExtentCount != 0);
+        last = &node->fExtents[node->fExtentCount - 1];
+        excess = node->fBlockCount - blocksNeeded;
+        if (excess > last->fBlockCount) {
+            excess = last->fBlockCount;
+        }
+        start = last->fStartBlock + last->fBlockCount - excess;
+
+        unmarked = 0;
+        if (node->fMarkedBlockCount < node->fBlockCount) {
+            unmarked = node->fBlockCount - node->fMarkedBlockCount;
+            if (unmarked > excess) {
+                unmarked = excess;
+            }
+        }
+        if (unmarked != 0) {
+            junk = EmptyFSMountFreeBlocks(mtmp, start + excess - unmarked, unmarked, kFreeBlocksUnmarked | kFreeBlocksRelease);
+            assert(junk == 0);
+        }
+        if (excess > unmarked) {
+            junk = EmptyFSMountFreeBlocks(mtmp, start, excess - unmarked, options);
+            if ( (junk != 0) && (err == 0) ) {
+                err = junk;
+            }
+        }
+
+        if (excess == last->fBlockCount) {
+            node->fExtentCount -= 1;
+        } else {
+            last->fBlockCount -= (uint32_t) excess;
+        }
+        node->fBlockCount -= excess;
+        if (node->fMarkedBlockCount > node->fBlockCount) {
+            node->fMarkedBlockCount = node->fBlockCount;
+        }
+        node->fRecordDirty = TRUE;
+    }
+
+    EmptyFSMountCounterAdjust(mtmp, kVolumeCounterFreeBlocks, (int64_t) freed);
+
+    return err;
+}
+
+static errno_t FSNodeBlockMap(FSNode *node, off_t foffset, size_t size, int flags, daddr64_t *bpnPtr, size_t *runPtr)
+    // Maps the range of the file that starts at foffset and extends for 
+    // (at most) size bytes onto the device.  On success, *bpnPtr is the 
+    // device block (in units of fDevBlockSize) that holds foffset and *runPtr 
+    // is the number of bytes, starting at foffset and no more than size, that 
+    // are contiguous on the device.  If foffset is beyond the end of the file, 
+    // or in the part of it that has no blocks yet, *bpnPtr is -1, which tells 
+    // the cluster layer to zero fill.
+    //
+    // If flags contains VNODE_WRITE, the caller is about to write the range, 
+    // so we allocate any delayed blocks first.  Writing beyond the blocks 
+    // that the file has reserved is an error.
+{
+    errno_t         err;
+    EmptyFSMount *  mtmp;
+    uint64_t        allocatedBytes;
+    uint64_t        limit;
+    uint64_t        logicalBlock;
+    uint32_t        blockOffset;
+    uint64_t        physicalBlock;
+    uint64_t        contigBlocks;
+    uint64_t        contigBytes;
+
+    assert(node != NULL);
+    assert(bpnPtr != NULL);
+    assert(runPtr != NULL);
+
+    mtmp = node->fMount;
+
+    if (flags & VNODE_WRITE) {
+        FSNodeLockExclusive(node);
+    } else {
+        FSNodeLockShared(node);
+    }
+
+    err = 0;
+    if (foffset < 0) {
+        err = EINVAL;
+    } else {
+        allocatedBytes = node->fBlockCount * mtmp->fBlockSize;
+        if ( (flags & VNODE_WRITE) && ( (uint64_t) foffset >= allocatedBytes ) && (node->fDelayedBlocks != 0) ) {
+            err = FSNodeAllocateDelayed(node, FALSE);
+            allocatedBytes = node->fBlockCount * mtmp->fBlockSize;
+        }
+        if (flags & VNODE_WRITE) {
+            limit = allocatedBytes;
+            if ( (err == 0) && ( (uint64_t) foffset >= limit ) ) {
+                err = EIO;
+            }
+        } else {
+            limit = (node->fSize < allocatedBytes) ? node->fSize : allocatedBytes;
+        }
+    }
+    if (err != 0) {
+        // do nothing
+    } else if ( (uint64_t) foffset >= limit ) {
+        *bpnPtr = -1;
+        *runPtr = size;
+    } else {
+        logicalBlock = (uint64_t) foffset / mtmp->fBlockSize;
+        blockOffset  = (uint32_t) ((uint64_t) foffset % mtmp->fBlockSize);
+        
+        err = EmptyFSExtentMap(node->fExtents, node->fExtentCount, logicalBlock, &physicalBlock, &contigBlocks);
+        if (err == ERANGE) {
+            err = EIO;                      // FSNodeLoad checked that this can't happen
+        }
+        if (err == 0) {
+            contigBytes = (contigBlocks * mtmp->fBlockSize) - blockOffset;
+            
+            *bpnPtr = (daddr64_t) ( (physicalBlock * mtmp->fDevBlocksPerBlock) + (blockOffset / mtmp->fDevBlockSize) );
+            *runPtr = (contigBytes < size) ? (size_t) contigBytes : size;
+        }
+    }
+
+    if (flags & VNODE_WRITE) {
+        FSNodeUnlockExclusive(node);
+    } else {
+        FSNodeUnlockShared(node);
+    }
+
+    return err;
+}
+
+static boolean_t FSNodeReadAheadAdvise(FSNode *node, uint64_t fileSize, off_t offset, user_ssize_t resid, off_t *raOffsetPtr, int *raLengthPtr)
+    // Called by VNOPRead before each read of resid bytes at offset, in a 
+    // file that's fileSize bytes long.  Updates the FSNode's stream detection 
+    // state and returns true if the caller should read ahead, in which case 
+    // *raOffsetPtr and *raLengthPtr describe the range to read.  See the 
+    // "Read-Ahead Notes" for the details.
+{
+    boolean_t           result;
+    FSNodeHashStripe *  stripe;
+    off_t               raStart;
+    off_t               raEnd;
+
+    assert(node != NULL);
+    assert(offset >= 0);
+    assert(resid > 0);
+    assert(raOffsetPtr != NULL);
+    assert(raLengthPtr != NULL);
+
+    result = FALSE;
+
+    stripe = FSNodeHashStripeForHash(node->fHash);
+
+    lck_mtx_lock(stripe->fLock);
+
+    if (offset == node->fReadNextOffset) {
+        if (node->fReadAheadWindow == 0) {
+            node->fReadAheadWindow = kEmptyFSReadAheadMinWindow;
+        } else if (node->fReadAheadWindow < kEmptyFSReadAheadMaxWindow) {
+            node->fReadAheadWindow *= 2;
+        }
+    } else {
+        node->fReadAheadWindow = 0;
+        node->fReadAheadEnd    = 0;
+    }
+    node->fReadNextOffset = offset + resid;
+
+    if (node->fReadAheadWindow != 0) {
+        raStart = (node->fReadAheadEnd > node->fReadNextOffset) ? node->fReadAheadEnd : node->fReadNextOffset;
+        raEnd   = node->fReadNextOffset + node->fReadAheadWindow;
+        if ( raEnd > (off_t) fileSize ) {
+            raEnd = (off_t) fileSize;
+        }
+        if (    (raEnd > raStart) 
+             && ( (node->fReadAheadEnd - node->fReadNextOffset) < (off_t) (node->fReadAheadWindow / 2) ) ) {
+            node->fReadAheadEnd = raEnd;
+
+            *raOffsetPtr = raStart;
+            *raLengthPtr = (int) (raEnd - raStart);
+            result = TRUE;
+        }
+    }
+
+    lck_mtx_unlock(stripe->fLock);
+
+    return result;
+}
+
+static void FSNodeSetMapped(FSNode *node, boolean_t mapped)
+    // Records whether the file is memory mapped, keeping the mount's 
+    // count of mapped files in step.  See "Memory Mapping Notes".
+{
+    FSNodeHashStripe *  stripe;
+    boolean_t           changed;
+
+    assert(node != NULL);
+
+    stripe = FSNodeHashStripeForHash(node->fHash);
+
+    lck_mtx_lock(stripe->fLock);
+    changed = (node->fMapped != mapped);
+    node->fMapped = mapped;
+    lck_mtx_unlock(stripe->fLock);
+
+    if (changed) {
+        if (mapped) {
+            (void) OSIncrementAtomic(&node->fMount->fMappedCount);
+        } else {
+            (void) OSDecrementAtomic(&node->fMount->fMappedCount);
+        }
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** File Writing
+
+// Write Notes
+// -----------
+// A volume is writable if it's mounted read/write and it has no read-only 
+// compatible features that we don't understand (see VFSOPMount).  On a 
+// writable volume you can create, write, truncate and remove regular files, 
+// and change their attributes.  You can't create directories or symlinks, 
+// or rename anything; the format supports these, but the KEXT doesn't yet.
+//
+// File data is written through the UBC, and file system metadata (the 
+// bitmap, the file table, directory blocks, directory index nodes and 
+// overflow extent blocks) through the buffer cache, with delayed writes. 
+// Nothing is written synchronously unless the client asks for it (IO_SYNC 
+// or fsync), except the superblock. 
+// If the volume has a journal, every change to the metadata is part of a 
+// transaction, and goes through the journal; see "Journal Notes".
+//
+// The locks, in the order in which they're taken, are:
+//
+//   1. an FSNode's fWriteLock, which serialises writes and truncates of that 
+//      file, so that the file's size doesn't change under them 
+//   2. a transaction handle, on a journalled volume; this isn't a lock, but 
+//      a commit waits for every handle to end, so it behaves like one 
+//   3. the volume's fRecordLock, which serialises writing file records and 
+//      overflow extent chains 
+//   4. an FSNode's fLock, parent before child; see note [7] in "FSNode Notes"
+//   5. the volume's fAllocLock, then the lock of one allocation group 
+//      (never more than one); see "Allocation Notes"
+//   6. buffers in the buffer cache, and pages in the UBC
+//
+// The hash stripe locks and the volume's fDirtyLock are leaves: no other 
+// lock, or buffer, is taken while holding one.  Because the cluster layer 
+// calls VNOPBlockmap, which takes fLock, no one calls into the cluster layer 
+// (or ubc_setsize) while holding fLock.  And because FSNodeWriteRecord takes 
+// fRecordLock, no one calls it while holding fLock.
+
+static errno_t FSNodeWriteExtents(FSNode *node, EmptyFSFileRecord *rec, const EmptyFSExtent *extents, uint32_t extentCount)
+    // Sets up the extents in rec (in host byte order) from extents and 
+    // extentCount, writing any that don't fit in the record to the file's 
+    // chain of overflow extent blocks.  We reuse the blocks of the existing 
+    // chain where possible, allocating more (or freeing some) as needed. 
+    // The caller must hold the volume's fRecordLock, and a transaction 
+    // handle, and is responsible for writing rec, in the same transaction. 
+    // An extentCount of zero frees the whole chain.
+{
+    errno_t                 err;
+    EmptyFSMount *          mtmp;
+    uint32_t                perBlock;
+    uint32_t                blocksNeeded;
+    uint32_t                blocksHave;
+    uint32_t                chainSize;
+    uint64_t *              chain;
+    uint32_t                index;
+    uint32_t                done;
+    uint32_t                thisCount;
+    uint64_t                count;
+    buf_t                   bp;
+    EmptyFSOverflowHeader * header;
+
+    assert(node != NULL);
+    assert(rec != NULL);
+    assert( (extents != NULL) || (extentCount == 0) );
+
+    mtmp = node->fMount;
+    perBlock = EmptyFSOverflowExtentsPerBlock(&mtmp->fSuperblock);
+
+    blocksNeeded = 0;
+    if (extentCount > kEmptyFSInlineExtentCount) {
+        blocksNeeded = (extentCount - kEmptyFSInlineExtentCount + perBlock - 1) / perBlock;
+    }
+    blocksHave = 0;
+    if (node->fDiskExtentCount > kEmptyFSInlineExtentCount) {
+        blocksHave = (node->fDiskExtentCount - kEmptyFSInlineExtentCount + perBlock - 1) / perBlock;
+    }
+
+    // Gather the existing chain.  We know how long it is from the extent 
+    // count of the record on disk.  FSNodeReadOverflowExtents checked the 
+    // chain when the FSNode was loaded, and we've maintained it since.
+
+    err = 0;
+    chain = NULL;
+    chainSize = ((blocksHave > blocksNeeded) ? blocksHave : blocksNeeded) * sizeof(*chain);
+    if (chainSize != 0) {
+        chain = OSMalloc(chainSize, gOSMallocTag);
+        if (chain == NULL) {
+            err = ENOMEM;
+        }
+    }
+    if ( (err == 0) && (blocksHave != 0) ) {
+        uint64_t    block;
+
+        block = node->fOverflowBlock;
+        for (index = 0; (err == 0) && (index < blocksHave); index++) {
+            chain[index] = block;
+            err = EmptyFSMountReadMetaBlock(mtmp, block, &bp);
+            if (err == 0) {
+                header = (EmptyFSOverflowHeader *) buf_dataptr(bp);
+                block = EmptyFSSwapLE64(header->fNextBlock);
+                buf_brelse(bp);
+            }
+        }
+    }
+
+    // Allocate any extra blocks that we need, each one after the last.  If 
+    // that fails, give back the ones we got.
+
+    if ( (err == 0) && (blocksNeeded > blocksHave) ) {
+        err = EmptyFSMountCounterReserve(mtmp, kVolumeCounterFreeBlocks, blocksNeeded - blocksHave);
+        if (err == 0) {
+            for (index = blocksHave; (err == 0) && (index < blocksNeeded); index++) {
+                err = EmptyFSMountAllocBlocks(mtmp, (index == 0) ? 0 : chain[index - 1] + 1, 1, TRUE, &chain[index], &count);
+                assert( (err != 0) || (count == 1) );
+            }
+            if (err != 0) {
+                index -= 1;                 // the one that failed
+                while (index-- > blocksHave) {
+                    (void) EmptyFSMountFreeBlocks(mtmp, chain[index], 1, 0);
+                }
+                EmptyFSMountCounterAdd(mtmp, kVolumeCounterFreeBlocks, (SInt32) (blocksNeeded - blocksHave));
+            }
+        }
+    }
+
+    // Write the chain.
+
+    done = kEmptyFSInlineExtentCount;
+    for (index = 0; (err == 0) && (index < blocksNeeded); index++) {
+        thisCount = extentCount - done;
+        if (thisCount > perBlock) {
+            thisCount = perBlock;
+        }
+        bp = EmptyFSMountGetMetaBlock(mtmp, chain[index]);
+        err = EmptyFSMountModifyMetaBlockStart(mtmp, chain[index], &bp);
+        if (err == 0) {
+            memset( (void *) buf_dataptr(bp), 0, mtmp->fBlockSize);
+            header = (EmptyFSOverflowHeader *) buf_dataptr(bp);
+            header->fMagic       = kEmptyFSOverflowMagic;
+            header->fExtentCount = thisCount;
+            header->fNextBlock   = (index + 1 < blocksNeeded) ? chain[index + 1] : 0;
+            EmptyFSSwapOverflowHeader(header);
+            memcpy(header + 1, &extents[done], thisCount * sizeof(*extents));
+            EmptyFSSwapExtents( (EmptyFSExtent *) (header + 1), thisCount);
+            EmptyFSMountModifyMetaBlockEnd(mtmp, bp);
+            done += thisCount;
+        }
+    }
+
+    // Free any blocks that we no longer need.  We do this after writing 
+    // the new chain so that, on disk, the old chain stays intact until the 
+    // record that points to the new one is written.
+
+    if (err == 0) {
+        for (index = blocksNeeded; index < blocksHave; index++) {
+            (void) EmptyFSMountFreeBlocks(mtmp, chain[index], 1, kFreeBlocksRelease | kFreeBlocksMetadata);
+        }
+
+        memset(rec->fExtents, 0, sizeof(rec->fExtents));
+        if (extentCount != 0) {
+            memcpy(rec->fExtents, extents, ((extentCount < kEmptyFSInlineExtentCount) ? extentCount : kEmptyFSInlineExtentCount) * sizeof(*extents));
+        }
+        rec->fExtentCount   = extentCount;
+        rec->fOverflowBlock = (blocksNeeded != 0) ? chain[0] : 0;
+        
+        node->fOverflowBlock   = rec->fOverflowBlock;
+        node->fDiskExtentCount = extentCount;
+    }
+
+    if (chain != NULL) {
+        OSFree(chain, chainSize, gOSMallocTag);
+    }
+    return err;
+}
+
+static errno_t FSNodeWriteRecordLocked(FSNode *node)
+    // Writes the FSNode's file record (and overflow extent chain) if it's 
+    // dirty.  The record says that the file is no bigger than its allocated 
+    // blocks (see "Delayed Allocation Notes").  A file that's been removed 
+    // (its link count is zero) is still written, with its place on the 
+    // orphan list (see "Orphan Notes"), until FSNodeFreeUnlinked frees its 
+    // record and sets fMode to zero.  The caller must hold a transaction 
+    // handle and fRecordLock, and none of the volume's other locks.
+{
+    errno_t             err;
+    EmptyFSMount *      mtmp;
+    boolean_t           dirty;
+    EmptyFSFileRecord   rec;
+    EmptyFSExtent       inlineExtents[kEmptyFSInlineExtentCount];
+    EmptyFSExtent *     extents;
+    uint32_t            extentCount;
+    uint64_t            allocatedBytes;
+
+    assert(node != NULL);
+
+    mtmp = node->fMount;
+    assert(mtmp->fWritable);
+
+    err = 0;
+    extents = inlineExtents;
+    extentCount = 0;
+
+    // Take a snapshot of the record, and all of its extents, with fLock held. 
+    // Any blocks that the record points to, but that aren't yet marked in 
+    // the bitmap, get marked now, in the same transaction as the record.
+
+    FSNodeLockExclusive(node);
+    dirty = node->fRecordDirty && (node->fMode != 0);
+    if (dirty) {
+        err = FSNodeMarkBlocks(node);
+    }
+    if ( dirty && (err == 0) ) {
+        allocatedBytes = node->fBlockCount * mtmp->fBlockSize;
+
+        memset(&rec, 0, sizeof(rec));
+        rec.fMode          = node->fMode;
+        rec.fLinkCount     = node->fLinkCount;
+        rec.fFlags         = node->fFlags;
+        rec.fUID           = node->fUID;
+        rec.fGID           = node->fGID;
+        rec.fSize          = (node->fSize < allocatedBytes) ? node->fSize : allocatedBytes;
+        rec.fBlockCount    = node->fBlockCount;
+        rec.fCreateTime    = NanosecondsFromTimespec(&node->fCreateTime);
+        rec.fModifyTime    = NanosecondsFromTimespec(&node->fModifyTime);
+        rec.fChangeTime    = NanosecondsFromTimespec(&node->fChangeTime);
+        rec.fAccessTime    = NanosecondsFromTimespec(&node->fAccessTime);
+        rec.fParentFileNum = node->fParentFileNum;
+        rec.fGeneration    = node->fGeneration;
+        rec.fDirIndexBlock = node->fDirIndexBlock;
+        if (node->fLinkCount == 0) {
+            rec.fNextOrphan = EmptyFSMountOrphanNext(mtmp, (uint32_t) node->fFileNum);
+        }
+
+        extentCount = node->fExtentCount;
+        if (extentCount > kEmptyFSInlineExtentCount) {
+            extents = OSMalloc(extentCount * sizeof(EmptyFSExtent), gOSMallocTag);
+            if (extents == NULL) {
+                err = ENOMEM;
+            }
+        }
+        if (err == 0) {
+            memcpy(extents, node->fExtents, extentCount * sizeof(EmptyFSExtent));
+            node->fRecordDirty = FALSE;
+        }
+    }
+    FSNodeUnlockExclusive(node);
+
+    // Write it.  If that fails, the record is dirty again.
+
+    if ( dirty && (err == 0) ) {
+        err = FSNodeWriteExtents(node, &rec, extents, extentCount);
+        if (err == 0) {
+            err = EmptyFSMountWriteFileRecord(mtmp, node->fFileNum, &rec);
+        }
+        if (err != 0) {
+            FSNodeLockExclusive(node);
+            node->fRecordDirty = TRUE;
+            FSNodeUnlockExclusive(node);
+        }
+    }
+
+    if (extents != inlineExtents) {
+        OSFree(extents, extentCount * sizeof(EmptyFSExtent), gOSMallocTag);
+    }
+    return err;
+}
+
+static errno_t FSNodeWriteRecord(FSNode *node)
+    // As FSNodeWriteRecordLocked, but takes fRecordLock itself.  The caller 
+    // must hold a transaction handle, and none of the volume's locks.
+{
+    errno_t         err;
+    EmptyFSMount *  mtmp;
+
+    assert(node != NULL);
+
+    mtmp = node->fMount;
+
+    lck_mtx_lock(mtmp->fRecordLock);
+    err = FSNodeWriteRecordLocked(node);
+    lck_mtx_unlock(mtmp->fRecordLock);
+
+    return err;
+}
+
+static void FSNodeTouch(FSNode *node, boolean_t modify)
+    // Sets the file's change time, and its modification time if modify is 
+    // true, to now, and marks its record as dirty.  The caller must hold 
+    // fLock exclusive.
+{
+    struct timespec     now;
+
+    nanotime(&now);
+    node->fChangeTime = now;
+    if (modify) {
+        node->fModifyTime = now;
+    }
+    node->fRecordDirty = TRUE;
+}
+
+static errno_t FSNodeSetSize(vnode_t vp, uint64_t newSize)
+    // Changes the size of the regular file vp to newSize.  The caller must 
+    // hold the FSNode's fWriteLock, and no other locks.
+    //
+    // If the file grows, we reserve blocks for the new part (see "Delayed 
+    // Allocation Notes") and have the cluster layer zero it, from the old 
+    // end of file.  That leaves the zeroes in dirty pages, which get blocks 
+    // when they're pushed, like any other data.  We can't leave the new 
+    // part as a hole: once a later write triggers allocation, the new 
+    // blocks would hold whatever was on the disk.
+    //
+    // If it shrinks, we throw away the pages beyond the new end of file 
+    // before freeing the blocks under them, so that nothing can be writing 
+    // to the blocks as they're freed.  If it stays the same, we free any 
+    // blocks beyond the end of file that VNOPAllocate preallocated.
+{
+    errno_t         err;
+    errno_t         junk;
+    FSNode *        node;
+    EmptyFSMount *  mtmp;
+    uint64_t        oldSize;
+    uint64_t        curSize;
+    uint64_t        blocksNeeded;
+    uint64_t        blocksHave;
+
+    assert( ValidVNode(vp) );
+    assert( vnode_isreg(vp) );
+
+    node = FSNodeFromVNode(vp);
+    mtmp = node->fMount;
+
+    // If the volume looks full, there may be blocks waiting on the journal 
+    // to be freed; see EmptyFSMountJournalReclaim.
+
+    do {
+        err = 0;
+        FSNodeLockExclusive(node);
+        oldSize = node->fSize;
+        curSize = oldSize;
+        if (newSize > oldSize) {
+            blocksNeeded = (newSize + mtmp->fBlockSize - 1) / mtmp->fBlockSize;
+            blocksHave   = node->fBlockCount + node->fDelayedBlocks;
+            if (blocksNeeded > blocksHave) {
+                err = EmptyFSMountCounterReserve(mtmp, kVolumeCounterFreeBlocks, blocksNeeded - blocksHave);
+                if (err == 0) {
+                    node->fDelayedBlocks += blocksNeeded - blocksHave;
+                }
+            }
+            if (err == 0) {
+                node->fSize = newSize;
+                curSize = newSize;
+            }
+        }
+        FSNodeUnlockExclusive(node);
+    } while ( (err == ENOSPC) && EmptyFSMountJournalReclaim(mtmp) );
+    
+    if ( (err == 0) && (newSize > oldSize) ) {
+        (void) ubc_setsize(vp, (off_t) newSize);
+        err = cluster_write(vp, NULL, (off_t) oldSize, (off_t) newSize, (off_t) oldSize, 0, IO_HEADZEROFILL);
+        if (err != 0) {
+            newSize = oldSize;          // put it back, below
+        }
+    }
+    if ( (newSize < curSize) || ( (err == 0) && (newSize == oldSize) ) ) {
+        (void) ubc_setsize(vp, (off_t) newSize);
+
+        // Freeing blocks changes the bitmap, so the record has to be 
+        // written in the same transaction.
+
+        EmptyFSMountTransactionBegin(mtmp);
+        FSNodeLockExclusive(node);
+        if (err == 0) {
+            err = FSNodeTruncateBlocks(node, newSize);
+        } else {
+            (void) FSNodeTruncateBlocks(node, newSize);
+        }
+        node->fSize = newSize;
+        FSNodeUnlockExclusive(node);
+        if (mtmp->fJournal != NULL) {
+            junk = FSNodeWriteRecord(node);
+            if (err == 0) {
+                err = junk;
+            }
+        }
+        (void) EmptyFSMountTransactionEnd(mtmp);
+    }
+    return err;
+}
+
+// Flusher Notes
+// -------------
+// Delayed allocation only pays off if the data is written back in big 
+// chunks, and the shape of those chunks is up to us: the cluster layer 
+// leaves dirty pages alone until someone pushes them.  So each writable 
+// volume has a flusher thread, and a list of FSNodes (fDirtyHead) that 
+// have been written to since they were last flushed, oldest first, along 
+// with a count of the bytes written to them (fDirtyBytes).
+//
+// The flusher wakes up when fDirtyBytes reaches kEmptyFSFlushThreshold, or 
+// after kEmptyFSFlushInterval, whichever comes first, and flushes every 
+// FSNode on the list: it pushes the file's dirty pages with cluster_push 
+// (which allocates the file's delayed blocks, in one go, and coalesces the 
+// pages into I/Os as big as the cluster layer allows) and then writes its 
+// record.  Because it flushes whole files, a file that's being written in 
+// small appends reaches the disk in a few large writes, and because each 
+// file is allocated in one go, files that are being written at the same 
+// time don't fragment each other.
+//
+// On a journalled volume, the flusher is also what commits the journal's 
+// running transaction, once per wakeup, and checkpoints it in the 
+// background; see "Journal Notes".  So a change to the metadata becomes 
+// durable within about kEmptyFSFlushInterval seconds, unless someone asks 
+// for it sooner (with fsync, IO_SYNC or sync).
+//
+// Each time round, the flusher also loads one allocation group that hasn't 
+// been loaded yet, so that, shortly after mount, every group is ready 
+// without the mount having had to wait for them; see "Allocation Notes".
+//
+// The flusher also bounds the amount of dirty data.  If fDirtyBytes reaches 
+// kEmptyFSDirtyLimit, VNOPWrite waits for the flusher to catch up before 
+// dirtying any more pages.
+//
+// The flusher needs a vnode to call cluster_push, but the dirty list can't 
+// hold a reference to it (it would stop the vnode from ever going inactive). 
+// Instead, the flusher records the FSNode's vnode and vid while it holds 
+// fDirtyLock, and then uses vnode_getwithvid.  That's safe because an FSNode 
+// is only on the list while its vnode is attached: VNOPInactive takes it 
+// off the list after pushing its pages (so that an unlinked file is never 
+// flushed after it's freed), and VNOPReclaim does too, before detaching 
+// the vnode.  If vnode_getwithvid fails, the vnode is being reclaimed, and 
+// VNOPInactive has already written everything.
+
+enum {
+    kEmptyFSFlushThreshold = 16 * 1024 * 1024,  // wake the flusher once this much data is dirty
+    kEmptyFSDirtyLimit     = 64 * 1024 * 1024,  // writers wait while this much data is dirty
+    kEmptyFSFlushInterval  = 1                  // the flusher runs at least this often, in seconds
+};
+
+static void FSNodeDirtyAdd(FSNode *node, uint64_t bytes)
+    // Records that bytes bytes have been written to the file, adding it to 
+    // the dirty list if it's not already there, and wakes the flusher if 
+    // there's enough to do.
+{
+    EmptyFSMount *  mtmp;
+    boolean_t       wake;
+
+    assert(node != NULL);
+    assert(node->fVNode != NULL);
+
+    mtmp = node->fMount;
+
+    lck_mtx_lock(mtmp->fDirtyLock);
+    if ( ! node->fOnDirtyList ) {
+        node->fDirtyNext = NULL;
+        if (mtmp->fDirtyTail == NULL) {
+            mtmp->fDirtyHead = node;
+        } else {
+            mtmp->fDirtyTail->fDirtyNext = node;
+        }
+        mtmp->fDirtyTail = node;
+        node->fOnDirtyList = TRUE;
+    }
+    node->fDirtyBytes += bytes;
+    mtmp->fDirtyBytes += bytes;
+    wake = (mtmp->fDirtyBytes >= kEmptyFSFlushThreshold);
+    lck_mtx_unlock(mtmp->fDirtyLock);
+
+    if (wake) {
+        wakeup(&mtmp->fDirtyHead);
+    }
+}
+
+static void FSNodeDirtyRemove(FSNode *node)
+    // Takes the file off the dirty list, if it's on it.  The list is singly 
+    // linked, so this walks it, but that only happens when a vnode goes 
+    // inactive with data that the flusher hasn't got to yet.
+{
+    EmptyFSMount *  mtmp;
+    FSNode **       linkPtr;
+    FSNode *        prev;
+    boolean_t       removed;
+
+    assert(node != NULL);
+
+    mtmp = node->fMount;
+    removed = FALSE;
+
+    lck_mtx_lock(mtmp->fDirtyLock);
+    if (node->fOnDirtyList) {
+        prev = NULL;
+        linkPtr = &mtmp->fDirtyHead;
+        while (*linkPtr != node) {
+            assert(*linkPtr != NULL);
+            prev = *linkPtr;
+            linkPtr = &prev->fDirtyNext;
+        }
+        *linkPtr = node->fDirtyNext;
+        if (mtmp->fDirtyTail == node) {
+            mtmp->fDirtyTail = prev;
+        }
+        node->fDirtyNext = NULL;
+        node->fOnDirtyList = FALSE;
+
+        mtmp->fDirtyBytes -= node->fDirtyBytes;
+        node->fDirtyBytes = 0;
+        removed = TRUE;
+    }
+    lck_mtx_unlock(mtmp->fDirtyLock);
+
+    if (removed) {
+        wakeup(&mtmp->fDirtyBytes);
+    }
+}
+
+static void EmptyFSMountThrottleWriters(EmptyFSMount *mtmp)
+    // Called by VNOPWrite, with no locks held, before it dirties any pages. 
+    // Waits while there's more dirty data than kEmptyFSDirtyLimit.
+{
+    assert(mtmp != NULL);
+
+    lck_mtx_lock(mtmp->fDirtyLock);
+    while ( (mtmp->fDirtyBytes >= kEmptyFSDirtyLimit) && mtmp->fFlusherRunning ) {
+        wakeup(&mtmp->fDirtyHead);
+        (void) msleep(&mtmp->fDirtyBytes, mtmp->fDirtyLock, PINOD, "EmptyFS:throttle", NULL);
+    }
+    lck_mtx_unlock(mtmp->fDirtyLock);
+}
+
+static errno_t FSNodeFlush(vnode_t vp)
+    // Writes the file's dirty pages, and then its record.  On a journalled 
+    // volume, the record is only in the running transaction when this 
+    // returns; the caller commits it if it needs to.  The caller must hold 
+    // an I/O reference on vp, and no locks.
+{
+    errno_t     err;
+    errno_t     err2;
+
+    assert( ValidVNode(vp) );
+
+    err = 0;
+    if ( vnode_isreg(vp) ) {
+        err = cluster_push(vp, IO_SYNC);
+    }
+    EmptyFSMountTransactionBegin(FSNodeFromVNode(vp)->fMount);
+    err2 = FSNodeWriteRecord(FSNodeFromVNode(vp));
+    (void) EmptyFSMountTransactionEnd(FSNodeFromVNode(vp)->fMount);
+    if (err == 0) {
+        err = err2;
+    }
+    return err;
+}
+
+static errno_t FSNodeFreeUnlinked(vnode_t vp)
+    // Frees a file that's been removed (its link count is zero, and its 
+    // record hasn't been freed): throws away its pages, frees its blocks, 
+    // its overflow extent blocks and its file record, and takes it off the 
+    // orphan list (see "Orphan Notes").  Called by VNOPInactive once the 
+    // file is closed, and by EmptyFSMountOrphanReclaim for files that were 
+    // still open at the time of a crash.  Afterwards, fMode is zero, so 
+    // that no one frees it twice.  The caller must hold an I/O reference 
+    // on vp, and no locks.
+{
+    errno_t             err;
+    errno_t             junk;
+    EmptyFSMount *      mtmp;
+    FSNode *            node;
+    EmptyFSFileRecord   rec;
+    uint32_t            generation;
+
+    assert( ValidVNode(vp) );
+    assert( ! vnode_isdir(vp) );
+
+    node = FSNodeFromVNode(vp);
+    mtmp = node->fMount;
+    assert(mtmp->fWritable);
+
+    (void) ubc_setsize(vp, 0);
+    FSNodeDirtyRemove(node);
+
+    // Freeing the blocks, the overflow chain and the record, and taking 
+    // the file off the orphan list, is one transaction, so a crash can't 
+    // leave a free record that still has blocks, blocks that are free but 
+    // still in a record, or a free record on the orphan list.  If we can't 
+    // take the file off the list, we leave it alone, for the next mount.
+
+    EmptyFSMountTransactionBegin(mtmp);
+    lck_mtx_lock(mtmp->fRecordLock);
+
+    err = EmptyFSMountOrphanRemove(mtmp, (uint32_t) node->fFileNum);
+    if (err == 0) {
+        FSNodeLockExclusive(node);
+        assert( (node->fLinkCount == 0) && (node->fMode != 0) );
+
+        err = FSNodeTruncateBlocks(node, 0);
+        node->fSize = 0;
+        memset(&rec, 0, sizeof(rec));
+        junk = FSNodeWriteExtents(node, &rec, NULL, 0);
+        if (err == 0) {
+            err = junk;
+        }
+        generation = node->fGeneration;
+        node->fMode = 0;
+        node->fRecordDirty = FALSE;
+
+        FSNodeUnlockExclusive(node);
+
+        // If we couldn't free the blocks, we leak the record rather than 
+        // risk having a record on disk that's free but still has blocks.
+
+        if (err == 0) {
+            err = EmptyFSMountFreeFileRecord(mtmp, node->fFileNum, generation);
+        }
+    }
+
+    lck_mtx_unlock(mtmp->fRecordLock);
+    (void) EmptyFSMountTransactionEnd(mtmp);
+
+    if (err == 0) {
+        EmptyFSMountCounterAdd(mtmp, kVolumeCounterFreeFiles, 1);
+    }
+    return err;
+}
+
+static void EmptyFSMountOrphanReclaim(EmptyFSMount *mtmp)
+    // Frees every file on the orphan list: files that were removed while 
+    // they were open, and were still open when the system crashed.  See 
+    // "Orphan Notes".  VFSOPMount calls this once the volume is otherwise 
+    // ready, because freeing a file needs its vnode.  If we can't free a 
+    // file, we leave it, and the rest of the list, for the next mount.
+{
+    errno_t     err;
+    uint32_t    fileNum;
+    uint32_t    freed;
+    vnode_t     vn;
+    FSNode *    node;
+    boolean_t   unlinked;
+
+    assert(mtmp != NULL);
+    assert(mtmp->fWritable);
+
+    freed = 0;
+    do {
+        lck_mtx_lock(mtmp->fRecordLock);
+        fileNum = mtmp->fOrphanFileNum;
+        lck_mtx_unlock(mtmp->fRecordLock);
+
+        err = 0;
+        if (fileNum != 0) {
+            vn = NULL;
+            err = FSNodeGetVNodeCreatingIfNecessary(mtmp, fileNum, NULL, NULL, &vn);
+            if (err == 0) {
+                node = FSNodeFromVNode(vn);
+
+                // EmptyFSMountOrphanLoad checked that the record is an orphan, 
+                // but check again, because freeing anything else would be a 
+                // disaster.
+
+                FSNodeLockShared(node);
+                unlinked = (node->fLinkCount == 0) && (node->fMode != 0) && ! vnode_isdir(vn);
+                FSNodeUnlockShared(node);
+
+                if (unlinked) {
+                    err = FSNodeFreeUnlinked(vn);
+                } else {
+                    err = EIO;
+                }
+                (void) vnode_recycle(vn);
+                (void) vnode_put(vn);
+            }
+            if (err == 0) {
+                freed += 1;
+            } else {
+                printf("EmptyFS:EmptyFSMountOrphanReclaim: could not free file %u, error %d\n", (unsigned int) fileNum, err);
+            }
+        }
+    } while ( (err == 0) && (fileNum != 0) );
+
+    if (freed != 0) {
+        printf("EmptyFS:EmptyFSMountOrphanReclaim: freed %u orphaned files\n", (unsigned int) freed);
+    }
+}
+
+static uint32_t EmptyFSMountFlushDirty(EmptyFSMount *mtmp)
+    // Flushes every FSNode on the volume's dirty list, including any that 
+    // are added while we're working, returning the number that we flushed. 
+    // Called by the flusher thread and by VFSOPSync, with no locks held.
+{
+    uint32_t    result;
+    FSNode *    node;
+    vnode_t     vn;
+    uint32_t    vid;
+    uint64_t    bytes;
+
+    assert(mtmp != NULL);
+
+    result = 0;
+
+    lck_mtx_lock(mtmp->fDirtyLock);
+    while ( (node = mtmp->fDirtyHead) != NULL ) {
+
+        // Take the FSNode off the list, and grab what we need from it, 
+        // while we still know that it exists.  See "Flusher Notes".
+        
+        mtmp->fDirtyHead = node->fDirtyNext;
+        if (mtmp->fDirtyHead == NULL) {
+            mtmp->fDirtyTail = NULL;
+        }
+        node->fDirtyNext   = NULL;
+        node->fOnDirtyList = FALSE;
+        bytes = node->fDirtyBytes;
+        node->fDirtyBytes = 0;
+        vn  = node->fVNode;
+        vid = node->fVID;
+        assert(vn != NULL);
+        node = NULL;
+        lck_mtx_unlock(mtmp->fDirtyLock);
+
+        if ( vnode_getwithvid(vn, vid) == 0 ) {
+            (void) FSNodeFlush(vn);
+            (void) vnode_put(vn);
+            result += 1;
+        }
+
+        lck_mtx_lock(mtmp->fDirtyLock);
+        mtmp->fDirtyBytes -= bytes;
+        wakeup(&mtmp->fDirtyBytes);
+    }
+    lck_mtx_unlock(mtmp->fDirtyLock);
+
+    return result;
+}
+
+static void EmptyFSFlusher(void *parameter, wait_result_t wresult)
+    // The body of the volume's flusher thread.  See "Flusher Notes".
+{
+    EmptyFSMount *  mtmp;
+    struct timespec interval;
+
+    mtmp = (EmptyFSMount *) parameter;
+    assert(mtmp != NULL);
+    (void) wresult;
+
+    interval.tv_sec  = kEmptyFSFlushInterval;
+    interval.tv_nsec = 0;
+
+    lck_mtx_lock(mtmp->fDirtyLock);
+    while ( ! mtmp->fFlusherStop ) {
+        if (mtmp->fDirtyBytes < kEmptyFSFlushThreshold) {
+            (void) msleep(&mtmp->fDirtyHead, mtmp->fDirtyLock, PINOD, "EmptyFS:flusher", &interval);
+        }
+        if ( (mtmp->fDirtyHead != NULL) && ! mtmp->fFlusherStop ) {
+            lck_mtx_unlock(mtmp->fDirtyLock);
+            (void) EmptyFSMountFlushDirty(mtmp);
+            lck_mtx_lock(mtmp->fDirtyLock);
+        }
+
+        // Commit the records that we just wrote, along with anything else 
+        // that's gone into the running transaction since we last looked. 
+        // That's the group commit: one journal write, and one cache flush, 
+        // for every change in the interval.  Then checkpoint if the journal 
+        // is filling up, or the volume has gone quiet.
+
+        if ( (mtmp->fJournal != NULL) && ! mtmp->fFlusherStop ) {
+            lck_mtx_unlock(mtmp->fDirtyLock);
+            (void) EmptyFSMountJournalCommit(mtmp, 0);
+            if ( EmptyFSMountJournalWantsCheckpoint(mtmp) ) {
+                (void) EmptyFSMountJournalCheckpoint(mtmp);
+            }
+            lck_mtx_lock(mtmp->fDirtyLock);
+        }
+
+        // Load an allocation group that no one has needed yet, so that 
+        // the first allocation in it doesn't have to read the bitmap, and 
+        // initialise another chunk of a lazily initialised file table.  See 
+        // "Allocation Notes".
+
+        if ( ! mtmp->fFlusherStop ) {
+            lck_mtx_unlock(mtmp->fDirtyLock);
+            EmptyFSMountAllocPreload(mtmp, 1);
+            EmptyFSMountFileTableInitMore(mtmp);
+            lck_mtx_lock(mtmp->fDirtyLock);
+        }
+    }
+
+    // Tell EmptyFSMountFlusherStop that we're done.  We must not touch 
+    // mtmp after dropping the lock, because the unmount can then free it.
+    
+    mtmp->fFlusherRunning = FALSE;
+    wakeup(&mtmp->fFlusherRunning);
+    lck_mtx_unlock(mtmp->fDirtyLock);
+
+    (void) thread_terminate(current_thread());
+}
+
+static errno_t EmptyFSMountFlusherStart(EmptyFSMount *mtmp)
+    // Starts the volume's flusher thread.
+{
+    kern_return_t   kr;
+    thread_t        thread;
+
+    assert(mtmp != NULL);
+    assert( ! mtmp->fFlusherRunning );
+
+    mtmp->fFlusherStop    = FALSE;
+    mtmp->fFlusherRunning = TRUE;
+    kr = kernel_thread_start(EmptyFSFlusher, mtmp, &thread);
+    if (kr == KERN_SUCCESS) {
+        thread_deallocate(thread);
+    } else {
+        mtmp->fFlusherRunning = FALSE;
+    }
+    return ErrnoFromKernReturn(kr);
+}
+
+static void EmptyFSMountFlusherStop(EmptyFSMount *mtmp)
+    // Stops the volume's flusher thread, if it's running, and waits for it 
+    // to exit.  It doesn't flush anything on the way out; the caller does 
+    // that.
+{
+    assert(mtmp != NULL);
+
+    if (mtmp->fDirtyLock != NULL) {
+        lck_mtx_lock(mtmp->fDirtyLock);
+        mtmp->fFlusherStop = TRUE;
+        wakeup(&mtmp->fDirtyHead);
+        while (mtmp->fFlusherRunning) {
+            (void) msleep(&mtmp->fFlusherRunning, mtmp->fDirtyLock, PINOD, "EmptyFS:flusherstop", NULL);
+        }
+        lck_mtx_unlock(mtmp->fDirtyLock);
+
+        // Let anyone who was throttled carry on.
+        
+        wakeup(&mtmp->fDirtyBytes);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Tracing
+
+// If a volume is mounted with a non-zero debug level, we record each 
+// instrumented operation on that volume in the trace buffer described in 
+// "EmptyFSStats.h".  The goal is to capture a real workload without 
+// noticeably slowing it down, and without stopping the file system while 
+// the records are read.  So the trace buffer is a ring per CPU, and 
+// recording an operation doesn't take any locks.
+//
+// Recording works as follows:
+//
+// 1. The writer reserves a slot by atomically incrementing the fHead of the 
+//    current CPU's ring.  We can't disable preemption, so a second thread 
+//    may be using the same ring (if we were moved to another CPU); the 
+//    atomic increment makes sure that the two threads get different slots. 
+//    It's normally uncontended, and thus cheap.
+//
+// 2. The writer sets the slot's fSequence to 0, fills in the record, and 
+//    then sets fSequence to the reserved index plus one, with memory 
+//    barriers in between.  This is like a seqlock, except that each slot 
+//    is only ever written by one writer at a time.
+//
+// 3. The reader (TraceRead, called via VFSOPSysctl) takes gTraceLock, 
+//    which serialises readers but is never taken by writers.  For each 
+//    ring, it copies the records from fTail up to fHead.  A record is only 
+//    valid if fSequence is the expected value both before and after the 
+//    copy; otherwise the writer hasn't finished with it (so the reader 
+//    stops and tries again next time), or a faster writer has lapped the 
+//    reader and overwritten it (so it's counted as dropped).
+//
+// fHead is 32 bits, so it wraps every 4 billion records on a CPU.  The 
+// record whose fSequence wraps to 0 looks as though it's still being 
+// written, and is dropped once the writers get a full ring ahead of it. 
+// That's cheaper than using 64-bit atomic operations, which aren't 
+// available to KEXTs on all architectures.
+//
+// The rings use kStatsMaxCPUs and cpu_number exactly like the statistics. 
+// They're about 576 KB in total, so we don't allocate them until the first 
+// time someone mounts a volume with tracing enabled.  After that they stay 
+// around until the KEXT unloads; that way the writers never have to check 
+// whether they're going away.
+//
+// OpStart records the start time if either statistics or tracing need it. 
+// gTraceMountCount is the number of mounted volumes for which fTracing is 
+// set; it's only changed using atomic operations.
+
+enum {
+    kTraceRecordsPerCPU = 512           // must be a power of two
+};
+
+struct TraceSlot {
+    volatile uint32_t   fSequence;      // 0 while being written, otherwise index + 1
+    uint32_t            fReserved;
+    EmptyFSTraceRecord  fRecord;
+};
+typedef struct TraceSlot TraceSlot;
+
+struct TracePerCPU {
+    volatile SInt32     fHead;          // index of the next slot to write; atomic operations only
+    uint32_t            fTail;          // index of the next slot to read; protected by gTraceLock
+    TraceSlot           fSlots[kTraceRecordsPerCPU];
+};
+typedef struct TracePerCPU TracePerCPU;
+
+static lck_mtx_t *                  gTraceLock = NULL;
+static TracePerCPU *                gTraceRings = NULL;         // kStatsMaxCPUs entries, protected by gTraceLock
+static volatile SInt32              gTraceMountCount = 0;
+static uint64_t                     gTraceDropped = 0;          // protected by gTraceLock
+static uint32_t                     gTraceNextCPU = 0;          // protected by gTraceLock
+
+static void TraceTerm(void)
+    // Disposes of the trace rings and their lock.
+{
+    assert(gTraceMountCount == 0);
+    
+    if (gTraceRings != NULL) {
+        OSFree(gTraceRings, sizeof(*gTraceRings) * kStatsMaxCPUs, gOSMallocTag);
+        gTraceRings = NULL;
+    }
+    if (gTraceLock != NULL) {
+        lck_mtx_free(gTraceLock, gLockGroup);
+        gTraceLock = NULL;
+    }
+}
+
+static errno_t TraceInit(void)
+    // Allocates the lock that protects the trace rings.  The rings 
+    // themselves are allocated by TraceMountStart.
+{
+    errno_t     err;
+
+    err = 0;
+    gTraceLock = lck_mtx_alloc_init(gLockGroup, LCK_ATTR_NULL);
+    if (gTraceLock == NULL) {
+        err = ENOMEM;
+    }
+    return err;
+}
+
+static void TraceMountStart(EmptyFSMount *mtmp)
+    // Called by VFSOPMount, once it has set fDebugLevel, to enable tracing 
+    // for the volume if it's been asked for.  Tracing is just a debugging 
+    // aid, so if we can't allocate the rings we log that and mount anyway.
+{
+    TracePerCPU *   rings;
+
+    assert(mtmp != NULL);
+    assert( ! mtmp->fTracing );
+
+    if ( (mtmp->fDebugLevel & kEmptyFSDebugLevelMask) != 0 ) {
+        lck_mtx_lock(gTraceLock);
+        if (gTraceRings == NULL) {
+            rings = (TracePerCPU *) OSMalloc(sizeof(*rings) * kStatsMaxCPUs, gOSMallocTag);
+            if (rings == NULL) {
+                printf("EmptyFS:TraceMountStart: could not allocate trace buffer\n");
+            } else {
+                memset(rings, 0, sizeof(*rings) * kStatsMaxCPUs);
+                gTraceRings = rings;
+            }
+        }
+        if (gTraceRings != NULL) {
+            mtmp->fTracing = TRUE;
+            (void) OSIncrementAtomic(&gTraceMountCount);
+        }
+        lck_mtx_unlock(gTraceLock);
+    }
+}
+
+static void TraceMountStop(EmptyFSMount *mtmp)
+    // Called by VFSOPUnmount to undo the effects of TraceMountStart.
+{
+    assert(mtmp != NULL);
+
+    if (mtmp->fTracing) {
+        mtmp->fTracing = FALSE;
+        (void) OSDecrementAtomic(&gTraceMountCount);
+    }
+}
+
+static void TraceOp(
+    uint32_t            op, 
+    uint64_t            start, 
+    uint64_t            elapsed, 
+    errno_t             err, 
+    const EmptyFSMount *mtmp, 
+    uint64_t            fileNum, 
+    uint64_t            arg0, 
+    uint64_t            arg1, 
+    const char *        name, 
+    size_t              nameLen
+)
+    // Adds a record of an operation to the current CPU's trace ring.  start 
+    // is the mach_absolute_time at which the operation started, elapsed is 
+    // how long it took in ns; the other parameters go into the record as is. 
+    // See the comments at the start of this section for the protocol.
+{
+    uint32_t            cpu;
+    uint32_t            index;
+    TracePerCPU *       ring;
+    TraceSlot *         slot;
+    EmptyFSTraceRecord *record;
+
+    assert(op < kEmptyFSOpCount);
+    assert(mtmp != NULL);
+    assert(gTraceRings != NULL);
+    
+    cpu   = (uint32_t) cpu_number() & (kStatsMaxCPUs - 1);
+    ring  = &gTraceRings[cpu];
+    index = (uint32_t) OSIncrementAtomic(&ring->fHead);
+    slot  = &ring->fSlots[index & (kTraceRecordsPerCPU - 1)];
+
+    slot->fSequence = 0;
+    MemoryBarrier();
+
+    // Fill in every byte of the record, because VFSOPSysctl copies it out 
+    // to user space.
+    
+    record = &slot->fRecord;
+    record->fTime     = StatsNanosecondsFromAbsolute(start);
+    record->fFileNum  = fileNum;
+    record->fArg0     = arg0;
+    record->fArg1     = arg1;
+    record->fDuration = (elapsed > UINT32_MAX) ? UINT32_MAX : (uint32_t) elapsed;
+    record->fError    = err;
+    record->fDevice   = (uint32_t) mtmp->fBlockRDevNum;
+    record->fOp       = (uint16_t) op;
+    record->fCPU      = (uint16_t) cpu;
+    memset(record->fName, 0, sizeof(record->fName));
+    if (name != NULL) {
+        if (nameLen > (sizeof(record->fName) - 1)) {
+            nameLen = sizeof(record->fName) - 1;
+        }
+        memcpy(record->fName, name, nameLen);
+    }
+
+    MemoryBarrier();
+    slot->fSequence = index + 1;
+}
+
+static size_t TraceReadRing(TracePerCPU *ring, EmptyFSTraceRecord *records, size_t maxRecords)
+    // Copies up to maxRecords records from ring into records, removing them 
+    // from the ring, and returns the number copied.  Records that were 
+    // overwritten before we got to them are added to gTraceDropped.
+{
+    uint32_t    head;
+    uint32_t    tail;
+    uint32_t    sequence;
+    size_t      count;
+    TraceSlot * slot;
+
+    assert(ring != NULL);
+    assert(records != NULL);
+    lck_mtx_assert(gTraceLock, LCK_MTX_ASSERT_OWNED);
+
+    head = (uint32_t) ring->fHead;
+    tail = ring->fTail;
+    MemoryBarrier();
+
+    // If the writers have lapped us, skip the records that they've 
+    // definitely overwritten.
+    
+    if ( (head - tail) > kTraceRecordsPerCPU ) {
+        gTraceDropped += (head - tail) - kTraceRecordsPerCPU;
+        tail = head - kTraceRecordsPerCPU;
+    }
+
+    count = 0;
+    while ( (tail != head) && (count < maxRecords) ) {
+        slot = &ring->fSlots[tail & (kTraceRecordsPerCPU - 1)];
+
+        sequence = slot->fSequence;
+        MemoryBarrier();
+        if (sequence == (tail + 1)) {
+            records[count] = slot->fRecord;
+            MemoryBarrier();
+            if (slot->fSequence == sequence) {
+                count += 1;
+            } else {
+                gTraceDropped += 1;         // overwritten while we were copying it
+            }
+        } else if ( (sequence == 0) || ((int32_t) (sequence - (tail + 1)) < 0) ) {
+            break;                          // still being written; try again next time
+        } else {
+            gTraceDropped += 1;             // overwritten by a later record
+        }
+        tail += 1;
+    }
+    ring->fTail = tail;
+    
+    return count;
+}
+
+static errno_t TraceRead(user_addr_t oldp, size_t *oldlenp)
+    // Implements reading kEmptyFSSysctlTrace: removes as many records 
+    // from the trace rings as fit in the caller's buffer (up to 
+    // kEmptyFSTraceMaxRecords) and copies them out, preceded by an 
+    // EmptyFSTraceHeader.  If the copy out fails, the records are lost.
+{
+    errno_t                 err;
+    size_t                  maxRecords;
+    size_t                  bufferSize;
+    size_t                  resultSize;
+    EmptyFSTraceHeader *    header;
+    EmptyFSTraceRecord *    records;
+    size_t                  count;
+    uint32_t                cpuIndex;
+    uint32_t                cpu;
+
+    assert(oldp != USER_ADDR_NULL);
+    assert(oldlenp != NULL);
+
+    err = 0;
+    header = NULL;
+    if (*oldlenp < sizeof(*header)) {
+        err = ENOMEM;
+    }
+    if (err == 0) {
+        maxRecords = (*oldlenp - sizeof(*header)) / sizeof(*records);
+        if (maxRecords > kEmptyFSTraceMaxRecords) {
+            maxRecords = kEmptyFSTraceMaxRecords;
+        }
+        bufferSize = sizeof(*header) + (maxRecords * sizeof(*records));
+        header = (EmptyFSTraceHeader *) OSMalloc(bufferSize, gOSMallocTag);
+        if (header == NULL) {
+            err = ENOMEM;
+        }
+    }
+    if (err == 0) {
+        records = (EmptyFSTraceRecord *) (header + 1);
+
+        // Start with a different CPU each time so that, if the caller's 
+        // buffer is small, one busy CPU can't starve the others.
+        
+        count = 0;
+        lck_mtx_lock(gTraceLock);
+        if (gTraceRings != NULL) {
+            for (cpuIndex = 0; (cpuIndex < kStatsMaxCPUs) && (count < maxRecords); cpuIndex++) {
+                cpu = (gTraceNextCPU + cpuIndex) & (kStatsMaxCPUs - 1);
+                count += TraceReadRing(&gTraceRings[cpu], &records[count], maxRecords - count);
+            }
+            gTraceNextCPU = (gTraceNextCPU + 1) & (kStatsMaxCPUs - 1);
+        }
+        header->fVersion     = kEmptyFSTraceVersion;
+        header->fRecordSize  = sizeof(*records);
+        header->fRecordCount = (uint32_t) count;
+        header->fReserved    = 0;
+        header->fDropped     = gTraceDropped;
+        gTraceDropped = 0;
+        lck_mtx_unlock(gTraceLock);
+
+        resultSize = sizeof(*header) + (count * sizeof(*records));
+        err = copyout(header, oldp, resultSize);
+        if (err == 0) {
+            *oldlenp = resultSize;
+        }
+        
+        OSFree(header, bufferSize, gOSMallocTag);
+    }
+
+    return err;
+}
+
+static uint64_t OpStart(void)
+    // Returns the time at which an operation started, or 0 if neither 
+    // statistics nor tracing are enabled.  Pass the result to OpEnd.
+{
+    uint64_t    result;
+
+    result = 0;
+    if ( gStatsEnabled || (gTraceMountCount != 0) ) {
+        result = mach_absolute_time();
+    }
+    return result;
+}
+
+static void OpEndWithName(
+    uint32_t            op, 
+    uint64_t            start, 
+    errno_t             err, 
+    const EmptyFSMount *mtmp, 
+    uint64_t            fileNum, 
+    uint64_t            arg0, 
+    uint64_t            arg1, 
+    const char *        name, 
+    size_t              nameLen
+)
+    // Records the completion of operation op, which started at start (as 
+    // returned by OpStart) and returned err.  mtmp is the volume (or NULL, 
+    // if the operation failed before we knew it), and the remaining 
+    // parameters are used for the trace record (see "EmptyFSStats.h").
+{
+    uint64_t    elapsed;
+
+    if (start != 0) {
+        elapsed = StatsNanosecondsFromAbsolute(mach_absolute_time() - start);
+        if (gStatsEnabled) {
+            StatsOpEnd(op, elapsed, err);
+        }
+        if ( (mtmp != NULL) && mtmp->fTracing ) {
+            TraceOp(op, start, elapsed, err, mtmp, fileNum, arg0, arg1, name, nameLen);
+        }
+    }
+}
+
+static void OpEnd(
+    uint32_t            op, 
+    uint64_t            start, 
+    errno_t             err, 
+    const EmptyFSMount *mtmp, 
+    uint64_t            fileNum, 
+    uint64_t            arg0, 
+    uint64_t            arg1
+)
+    // OpEndWithName for operations that don't involve a name.
+{
+    OpEndWithName(op, start, err, mtmp, fileNum, arg0, arg1, NULL, 0);
+}
+
+static void OpEndVNode(uint32_t op, uint64_t start, errno_t err, vnode_t vp, uint64_t arg0, uint64_t arg1)
+    // OpEnd for vnode operations, which get the volume and file number from 
+    // vp.  We only look at vp if we need to, which keeps the disabled case 
+    // cheap.
+{
+    FSNode *    node;
+
+    if (start != 0) {
+        node = FSNodeFromVNode(vp);
+        OpEnd(op, start, err, node->fMount, node->fFileNum, arg0, arg1);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** VNode Operations
+
+static errno_t VNOPLookup(struct vnop_lookup_args *ap)
+    // This is called by VFS to do a directory lookup.
+    //
+    // dvp is the directory to search.
+    //
+    // cnp describes the name to search for.  This is kinda complicated, although 
+    // the comments in <sys/vnode.h> are pretty helpful.
+    //
+    // vpp is a pointer to a vnode where we return the found item.  The 
+    // returned vnode must have an I/O reference, and the caller is responsible 
+    // for releasing it.
+    //
+    // context identifies the calling process.
+    //
+    // VFS only calls us if the name isn't in its name cache.  When we're done, 
+    // we add our result to that cache (if the MAKEENTRY flag asks us to), so 
+    // that the next lookup of this name doesn't need to call us.  This includes 
+    // negative results: a name that doesn't exist is entered with a NULL vnode, 
+    // which stops VFS asking us about it again (this is a big win for things 
+    // like compilers searching include paths).  The one exception is when the 
+    // lookup is a prelude to creating the name (cn_nameiop is CREATE), where a 
+    // negative entry would just have to be removed again.
+    //
+    // If the last component of a CREATE lookup doesn't exist, and the volume 
+    // is writable, we return EJUSTRETURN rather than ENOENT, which tells VFS 
+    // to go ahead and call VNOPCreate.
+    //
+    // Any cache entry has to be removed (using cache_purge or 
+    // cache_purge_negatives) when the directory changes in a way that would 
+    // invalidate it.
+{
+    errno_t                 err;
+    vnode_t                 dvp;
+    vnode_t *               vpp;
+    struct componentname *  cnp;
+    vfs_context_t           context;
+    vnode_t                 vn;
+    uint64_t                fileNum;
+    uint64_t                opStart;
+    
+    opStart = OpStart();
+
+    // Unpack arguments
+    
+    dvp     = ap->a_dvp;
+    vpp     = ap->a_vpp;
+    cnp     = ap->a_cnp;
+    context = ap->a_context;
+    
+    // Pre-conditions
+    
+    assert(dvp != NULL);
+    assert(vnode_isdir(dvp));
+    assert( ValidVNode(dvp) );
+    assert(vpp != NULL);
+    assert(cnp != NULL);
+    assert(context != NULL);
+    
+    // Prepare for failure.
+    
+    vn = NULL;
+
+    // Trivial implementation
+    
+    if (cnp->cn_flags & ISDOTDOT) {
+        // Implement lookup for ".." (that is, the parent directory).  The parent of 
+        // the root is the root, so in that case we just get an I/O reference on dvp 
+        // and return that.  Otherwise the parent's file number is in the FSNode, 
+        // and we get its vnode like any other.  We don't know the parent's parent, 
+        // so we can't tell vnode_create about it.
+        
+        FSNode *    dirNode;
+
+        dirNode = FSNodeFromVNode(dvp);
+        if ( vnode_isvroot(dvp) ) {
+            err = vnode_get(dvp);
+            if (err == 0) {
+                vn = dvp;
+            }
+        } else {
+            err = FSNodeGetVNodeCreatingIfNecessary(
+                EmptyFSMountFromMount(vnode_mount(dvp)), 
+                dirNode->fParentFileNum, 
+                NULL, 
+                NULL, 
+                &vn
+            );
+        }
+    } else if ( (cnp->cn_namelen == 1) && (cnp->cn_nameptr[0] == '.') ) {
+        // Implement lookup for "." (that is, this directory).  Just get an I/O reference 
+        // to dvp and return that.
+        
+        err = vnode_get(dvp);
+        if (err == 0) {
+            vn = dvp;
+        }
+    } else {
+        // Look up the name in the directory and, if we find it, get the vnode 
+        // for the corresponding file system object.
+        
+        err = FSNodeLookupName(FSNodeFromVNode(dvp), cnp->cn_nameptr, (size_t) cnp->cn_namelen, &fileNum);
+        if (    (err == ENOENT) 
+             && (cnp->cn_nameiop == CREATE) 
+             && (cnp->cn_flags & ISLASTCN) 
+             && EmptyFSMountFromMount(vnode_mount(dvp))->fWritable ) {
+            err = EJUSTRETURN;
+        }
+        if (err == 0) {
+            err = FSNodeGetVNodeCreatingIfNecessary(
+                EmptyFSMountFromMount(vnode_mount(dvp)), 
+                fileNum, 
+                dvp, 
+                cnp, 
+                &vn
+            );
+        }
+        
+        // Feed the VFS name cache.
+        
+        if (cnp->cn_flags & MAKEENTRY) {
+            if (err == 0) {
+                cache_enter(dvp, vn, cnp);
+            } else if ( (err == ENOENT) && (cnp->cn_nameiop != CREATE) ) {
+                cache_enter(dvp, NULL, cnp);
+            }
+        }
+    }
+    
+    // Under all circumstances we set *vpp to vn.  That way, we satisfy the 
+    // post-condition, regardless of what VFS uses as the initial value for 
+    // *vpp.
+    
+    *vpp = vn;
+    
+    // Post-conditions
+    
+    assert( (err == 0) == (*vpp != NULL) );
+    
+    // Only dig out the trace information if someone wants it.
+    
+    if (opStart != 0) {
+        FSNode *    dirNode;
+        
+        dirNode = FSNodeFromVNode(dvp);
+        OpEndWithName(
+            kEmptyFSOpVNOPLookup, 
+            opStart, 
+            err, 
+            dirNode->fMount, 
+            dirNode->fFileNum, 
+            (err == 0) ? FSNodeFromVNode(vn)->fFileNum : 0, 
+            (uint64_t) cnp->cn_nameiop, 
+            cnp->cn_nameptr, 
+            (size_t) cnp->cn_namelen
+        );
+    }
+
+    return err;
+}
+
+static errno_t VNOPCreate(struct vnop_create_args *ap)
+    // Called by VFS to create a regular file.
+    //
+    // dvp is the directory in which to create it.
+    //
+    // vpp is a pointer to a vnode where we return the new file's vnode.  As 
+    // with VNOPLookup, it must have an I/O reference, and the caller is 
+    // responsible for releasing it.
+    //
+    // cnp is the name of the new file.
+    //
+    // vap describes the new file's attributes.  VFS has already checked that 
+    // the caller is allowed to create the file, and has filled in va_type and 
+    // va_mode.  If va_uid and va_gid are active, they're the new file's owner 
+    // and group; otherwise the file inherits them from the directory.  We 
+    // tell VFS which attributes we set by marking them as supported; it sets 
+    // any others (with VNOPSetattr) itself.
+    //
+    // context identifies the calling process.
+    //
+    // VFS calls us after VNOPLookup returned EJUSTRETURN, but it doesn't hold 
+    // any lock across the two calls, so someone may have created the name in 
+    // the meantime.  We search again, with the directory's fLock held 
+    // exclusive, and return EEXIST if they did.  We only create regular files 
+    // (see "Write Notes").
+{
+    errno_t                 err;
+    errno_t                 junk;
+    vnode_t                 dvp;
+    vnode_t *               vpp;
+    struct componentname *  cnp;
+    struct vnode_attr *     vap;
+    vfs_context_t           context;
+    EmptyFSMount *          mtmp;
+    FSNode *                dirNode;
+    EmptyFSFileRecord       rec;
+    struct timespec         now;
+    uint64_t                existingFileNum;
+    uint32_t                fileNum;
+    boolean_t               reserved;
+    boolean_t               handle;
+    boolean_t               grew;
+    uint64_t                oldBlockCount;
+    uint64_t                oldDirIndexBlock;
+    vnode_t                 vn;
+    uint64_t                opStart;
+
+    opStart = OpStart();
+
+    // Unpack arguments
+
+    dvp     = ap->a_dvp;
+    vpp     = ap->a_vpp;
+    cnp     = ap->a_cnp;
+    vap     = ap->a_vap;
+    context = ap->a_context;
+
+    // Pre-conditions
+
+    assert( ValidVNode(dvp) );
+    assert( vnode_isdir(dvp) );
+    assert(vpp != NULL);
+    assert(cnp != NULL);
+    assert(vap != NULL);
+    assert(context != NULL);
+
+    mtmp     = EmptyFSMountFromMount(vnode_mount(dvp));
+    dirNode  = FSNodeFromVNode(dvp);
+    fileNum  = 0;
+    reserved = FALSE;
+    vn       = NULL;
+
+    err = 0;
+    if ( ! mtmp->fWritable ) {
+        err = EROFS;
+    } else if ( ! VATTR_IS_ACTIVE(vap, va_type) || (vap->va_type != VREG) ) {
+        err = ENOTSUP;
+    } else if (cnp->cn_namelen > kEmptyFSMaxNameLength) {
+        err = ENAMETOOLONG;
+    }
+
+    // Reserve the file record first, so that we fail quickly if the volume 
+    // is full (see "Volume Counter Notes").
+    
+    if (err == 0) {
+        err = EmptyFSMountCounterReserve(mtmp, kVolumeCounterFreeFiles, 1);
+        reserved = (err == 0);
+    }
+
+    // With the directory locked, check that the name is still free, then 
+    // write the new file's record and add its directory entry.  If we can't 
+    // add the entry, free the record again.  Once the entry is in, update 
+    // the directory's lookup cache, so that it doesn't remember that the 
+    // name doesn't exist.  All of this is one transaction, so the record 
+    // and the entry reach the disk together.
+    
+    grew = FALSE;
+    handle = (err == 0);
+    if (handle) {
+        EmptyFSMountTransactionBegin(mtmp);
+    }
+    if (err == 0) {
+        FSNodeLockExclusive(dirNode);
+        oldBlockCount    = dirNode->fBlockCount;
+        oldDirIndexBlock = dirNode->fDirIndexBlock;
+
+        err = FSNodeSearchDirectory(dirNode, cnp->cn_nameptr, (size_t) cnp->cn_namelen, &existingFileNum, NULL);
+        if ( (err == 0) && (existingFileNum != 0) ) {
+            err = EEXIST;
+        }
+        if (err == 0) {
+            nanotime(&now);
+
+            memset(&rec, 0, sizeof(rec));
+            rec.fMode          = (uint16_t) (S_IFREG | (vap->va_mode & ~S_IFMT));
+            rec.fLinkCount     = 1;
+            rec.fUID           = VATTR_IS_ACTIVE(vap, va_uid) ? vap->va_uid : dirNode->fUID;
+            rec.fGID           = VATTR_IS_ACTIVE(vap, va_gid) ? vap->va_gid : dirNode->fGID;
+            rec.fCreateTime    = NanosecondsFromTimespec(&now);
+            rec.fModifyTime    = rec.fCreateTime;
+            rec.fChangeTime    = rec.fCreateTime;
+            rec.fAccessTime    = rec.fCreateTime;
+            rec.fParentFileNum = (uint32_t) dirNode->fFileNum;
+
+            err = EmptyFSMountAllocFileRecord(mtmp, &rec, &fileNum);
+        }
+        if (err == 0) {
+            err = FSNodeDirAddEntry(dirNode, cnp->cn_nameptr, (size_t) cnp->cn_namelen, fileNum, DT_REG);
+            if (err != 0) {
+                junk = EmptyFSMountFreeFileRecord(mtmp, fileNum, rec.fGeneration);
+                assert(junk == 0);
+                fileNum = 0;
+            }
+        }
+        if (err == 0) {
+            reserved = FALSE;           // it's been used
+            DirCacheEnter(dirNode->fDirCache, cnp->cn_nameptr, (size_t) cnp->cn_namelen, fileNum);
+            FSNodeTouch(dirNode, TRUE);
+        }
+        grew = (dirNode->fBlockCount != oldBlockCount) || (dirNode->fDirIndexBlock != oldDirIndexBlock);
+
+        FSNodeUnlockExclusive(dirNode);
+    }
+    if (reserved) {
+        EmptyFSMountCounterAdd(mtmp, kVolumeCounterFreeFiles, 1);
+    }
+
+    // If the directory grew, or its index has a new root, its record must 
+    // go in the same transaction as the new block; see "Delayed Allocation 
+    // Notes" and "Directory Index Notes".  That's so even if we then failed 
+    // to index the new entry, and took it out again.  Otherwise, queue the 
+    // record to be written (see "Flusher Notes").  Then get rid of any 
+    // negative VFS name cache entries for the directory, and get the new 
+    // file's vnode.
+    
+    if ( grew && (FSNodeWriteRecord(dirNode) != 0) ) {
+        grew = FALSE;                   // leave it to the flusher
+        if (err != 0) {
+            FSNodeDirtyAdd(dirNode, 0);
+        }
+    }
+    if (handle) {
+        (void) EmptyFSMountTransactionEnd(mtmp);
+    }
+    if (err == 0) {
+        if ( ! grew ) {
+            FSNodeDirtyAdd(dirNode, 0);
+        }
+        cache_purge_negatives(dvp);
+
+        VATTR_SET_SUPPORTED(vap, va_type);
+        VATTR_SET_SUPPORTED(vap, va_mode);
+        VATTR_SET_SUPPORTED(vap, va_uid);
+        VATTR_SET_SUPPORTED(vap, va_gid);
+
+        err = FSNodeGetVNodeCreatingIfNecessary(mtmp, fileNum, dvp, cnp, &vn);
+    }
+    *vpp = vn;
+
+    // Post-conditions
+
+    assert( (err == 0) == (*vpp != NULL) );
+
+    OpEndWithName(
+        kEmptyFSOpVNOPCreate, 
+        opStart, 
+        err, 
+        mtmp, 
+        dirNode->fFileNum, 
+        fileNum, 
+        0, 
+        cnp->cn_nameptr, 
+        (size_t) cnp->cn_namelen
+    );
+
+    return err;
+}
+
+static errno_t VNOPRemove(struct vnop_remove_args *ap)
+    // Called by VFS to remove a file.
+    //
+    // dvp is the directory that contains the file.
+    //
+    // vp is the file to remove.
+    //
+    // cnp is the name by which the caller found the file.
+    //
+    // flags is a set of VNODE_REMOVE_XXX flags, none of which we care about.
+    //
+    // context identifies the calling process.
+    //
+    // Removing a file just removes its directory entry and drops its link 
+    // count to zero.  If the file is open, it keeps working until it's 
+    // closed; we free its blocks and its record when its vnode goes inactive 
+    // (see VNOPInactive).  We ask VFS to recycle the vnode as soon as it can, 
+    // so that this happens promptly.  In the meantime, the file is on the 
+    // orphan list, so that if the system crashes before it's freed, the 
+    // next mount frees it; see "Orphan Notes".  Putting it there, and 
+    // writing its record, is part of the same transaction as removing the 
+    // entry.  We allocate the list entry before we start, so that nothing 
+    // can fail once the entry is gone.
+    //
+    // VFS doesn't hold any lock across the lookup and the remove, so we 
+    // check that the name still refers to vp, with the directory's fLock 
+    // held exclusive.
+{
+    errno_t                 err;
+    vnode_t                 dvp;
+    vnode_t                 vp;
+    struct componentname *  cnp;
+    int                     flags;
+    vfs_context_t           context;
+    EmptyFSMount *          mtmp;
+    FSNode *                dirNode;
+    FSNode *                node;
+    uint64_t                fileNum;
+    boolean_t               handle;
+    boolean_t               unlinked;
+    OrphanEntry *           orphan;
+    errno_t                 junk;
+    uint64_t                opStart;
+
+    opStart = OpStart();
+
+    // Unpack arguments
+
+    dvp     = ap->a_dvp;
+    vp      = ap->a_vp;
+    cnp     = ap->a_cnp;
+    flags   = ap->a_flags;
+    context = ap->a_context;
+
+    // Pre-conditions
+
+    assert( ValidVNode(dvp) );
+    assert( vnode_isdir(dvp) );
+    assert( ValidVNode(vp) );
+    assert(cnp != NULL);
+    assert(context != NULL);
+    (void) flags;
+
+    mtmp    = EmptyFSMountFromMount(vnode_mount(dvp));
+    dirNode = FSNodeFromVNode(dvp);
+    node    = FSNodeFromVNode(vp);
+
+    err = 0;
+    orphan = NULL;
+    unlinked = FALSE;
+    if ( ! mtmp->fWritable ) {
+        err = EROFS;
+    } else if ( vnode_isdir(vp) ) {
+        err = EPERM;                    // POSIX says unlink of a directory is EPERM
+    } else {
+        orphan = OSMalloc(sizeof(*orphan), gOSMallocTag);
+        if (orphan == NULL) {
+            err = ENOMEM;
+        }
+    }
+    handle = (err == 0);
+    if (handle) {
+        EmptyFSMountTransactionBegin(mtmp);
+    }
+    if (err == 0) {
+        FSNodeLockExclusive(dirNode);
+
+        err = FSNodeSearchDirectory(dirNode, cnp->cn_nameptr, (size_t) cnp->cn_namelen, &fileNum, NULL);
+        if ( (err == 0) && (fileNum != node->fFileNum) ) {
+            err = ENOENT;
+        }
+        if (err == 0) {
+            err = FSNodeDirRemoveEntry(dirNode, cnp->cn_nameptr, (size_t) cnp->cn_namelen, &fileNum);
+            assert( (err != 0) || (fileNum == node->fFileNum) );
+        }
+        if (err == 0) {
+            DirCacheEnter(dirNode->fDirCache, cnp->cn_nameptr, (size_t) cnp->cn_namelen, 0);
+            FSNodeTouch(dirNode, TRUE);
+
+            FSNodeLockExclusive(node);              // parent before child
+            assert(node->fLinkCount != 0);
+            node->fLinkCount -= 1;
+            FSNodeTouch(node, FALSE);
+            unlinked = (node->fLinkCount == 0);
+            FSNodeUnlockExclusive(node);
+        }
+
+        FSNodeUnlockExclusive(dirNode);
+    }
+
+    // If that was the last link, put the file on the orphan list and write 
+    // its record.  If the write fails, we take it off again (it's first, so 
+    // that only changes the head); the record stays dirty, and the file is 
+    // freed as usual when it's closed, but a crash before then would leak it.
+
+    if (unlinked) {
+        assert(err == 0);
+
+        lck_mtx_lock(mtmp->fRecordLock);
+        EmptyFSMountOrphanAdd(mtmp, orphan, (uint32_t) node->fFileNum);
+        orphan = NULL;
+        junk = FSNodeWriteRecordLocked(node);
+        if (junk != 0) {
+            printf("EmptyFS:VNOPRemove: could not write orphaned file %llu, error %d\n", (unsigned long long) node->fFileNum, junk);
+            junk = EmptyFSMountOrphanRemove(mtmp, (uint32_t) node->fFileNum);
+            assert(junk == 0);
+        }
+        lck_mtx_unlock(mtmp->fRecordLock);
+    }
+    if (handle) {
+        (void) EmptyFSMountTransactionEnd(mtmp);
+    }
+    if (orphan != NULL) {
+        OSFree(orphan, sizeof(*orphan), gOSMallocTag);
+    }
+    if (err == 0) {
+        FSNodeDirtyAdd(dirNode, 0);
+        cache_purge(vp);
+        (void) vnode_recycle(vp);
+    }
+
+    OpEndWithName(
+        kEmptyFSOpVNOPRemove, 
+        opStart, 
+        err, 
+        mtmp, 
+        dirNode->fFileNum, 
+        node->fFileNum, 
+        0, 
+        cnp->cn_nameptr, 
+        (size_t) cnp->cn_namelen
+    );
+
+    return err;
+}
+
+static errno_t VNOPOpen(struct vnop_open_args *ap)
+    // Called by VFS to open a vnode for access.
+    //
+    // vp is the vnode that's being opened. 
+    // 
+    // mode contains the flags passed to open (things like FREAD).
+    //
+    // context identifies the calling process.
+    //
+    // This entry is rarely useful because VFS can read a file vnode without ever 
+    // opening it, thus any work that you'd usually do here you have to do lazily in 
+    // your read/write entry points.
+    //
+    // Regardless, in our implementation we have nothing to do.
+{
+    vnode_t         vp;
+    int             mode;
+    vfs_context_t   context;
+    uint64_t        opStart;
+
+    opStart = OpStart();
+
+    // Unpack arguments
+    
+    vp      = ap->a_vp;
+    mode    = ap->a_mode;
+    context = ap->a_context;
+    
+    // Pre-conditions
+    
+    assert( ValidVNode(vp) );
+    AssertKnownFlags(mode, O_EVTONLY | O_NONBLOCK | FREAD | FWRITE);
+    assert(context != NULL);
+
+    // Empty implementation
+    
+    OpEndVNode(kEmptyFSOpVNOPOpen, opStart, 0, vp, (uint64_t) mode, 0);
+
+    return 0;
+}
+
+static errno_t VNOPClose(struct vnop_close_args *ap)
+    // Called by VFS to close a vnode for access.
+    //
+    // vp is the vnode that's being closed. 
+    //
+    // fflags contains the flags associated with the close (things like FREAD).
+    //
+    // context identifies the calling process.
+    //
+    // This entry is not as useful as you might think because a vnode can be accessed 
+    // after the last close (if, for example, if has been memory mapped).  In most cases 
+    // the work that you might think to do here, you end up doing in VNOPInactive.
+    //
+    // Regardless, in our implementation we have nothing to do.
+{
+    vnode_t         vp;
+    int             fflag;
+    vfs_context_t   context;
+    uint64_t        opStart;
+
+    opStart = OpStart();
+
+    // Unpack arguments
+
+    vp      = ap->a_vp;
+    fflag   = ap->a_fflag;
+    context = ap->a_context;
+
+    // Pre-conditions
+    
+    assert( ValidVNode(vp) );
+    AssertKnownFlags(fflag, O_EVTONLY | O_NONBLOCK | FREAD | FWRITE);
+    assert(context != NULL);
+
+    // Empty implementation
+    
+    OpEndVNode(kEmptyFSOpVNOPClose, opStart, 0, vp, (uint64_t) fflag, 0);
+
+    return 0;
+}
+
+static errno_t VNOPGetattr(struct vnop_getattr_args *ap)
+    // Called by VFS to get information about a vnode (this is called by the 
+    // VFS implementation of <x-man-page://2/stat> and <x-man-page://2/getattrlist>).
+    //
+    // vp is the vnode whose information is requested.
+    //
+    // vap describes the attributes requested and the place to store the results.
+    //
+    // context identifies the calling process.
+    //
+    // You have two options for doing this:
+    //
+    // o For attributes whose values you have readily available, use the VATTR_RETURN 
+    //   macro to unilaterally return the value.
+    //
+    // o For attributes whose values are hard to calculate, use VATTR_IS_ACTIVE to see 
+    //   if the caller requested the attribute and, if so, copy the value into the 
+    //   appropriate field.
+    //
+    // Our implementation is simple; all of the values come from the file record, 
+    // which FSNodeLoad copied into the FSNode when it was created.  On a 
+    // writable volume they can change, so we hold fLock while we copy them, 
+    // and the allocated size includes any blocks that are reserved for 
+    // delayed allocation (see "Delayed Allocation Notes"), which is the 
+    // space that the file is really using. 
+{
+    vnode_t             vp;
+    struct vnode_attr * vap;
+    vfs_context_t       context;
+    EmptyFSMount *      mtmp;
+    FSNode *            node;
+    uint64_t            opStart;
+
+    opStart = OpStart();
+
+    // Unpack arguments
+
+    vp      = ap->a_vp;
+    vap     = ap->a_vap;
+    context = ap->a_context;
+
+    // Pre-conditions
+    
+    assert( ValidVNode(vp) );
+    assert(vap != NULL);
+    assert(context != NULL);
+
+    // Simple implementation
+
+    mtmp = EmptyFSMountFromMount(vnode_mount(vp));
+    node = FSNodeFromVNode(vp);
+    
+    // The implementation of <x-man-page://2/stat> requires that we support va_rdev, 
+    // even on vnodes that aren't device vnodes (as is the case for all our vnodes).
+     
+    FSNodeLockShared(node);
+
+    VATTR_RETURN(vap, va_rdev,        0);
+    VATTR_RETURN(vap, va_nlink,       node->fLinkCount);
+    VATTR_RETURN(vap, va_total_size,  node->fSize);
+    VATTR_RETURN(vap, va_total_alloc, (node->fBlockCount + node->fDelayedBlocks) * mtmp->fBlockSize);
+    VATTR_RETURN(vap, va_data_size,   node->fSize);
+    VATTR_RETURN(vap, va_data_alloc,  (node->fBlockCount + node->fDelayedBlocks) * mtmp->fBlockSize);
+    VATTR_RETURN(vap, va_iosize,      mtmp->fAttr.f_iosize);
+
+    VATTR_RETURN(vap, va_uid,   node->fUID);
+    VATTR_RETURN(vap, va_gid,   node->fGID);
+    VATTR_RETURN(vap, va_mode,  node->fMode);
+    VATTR_RETURN(vap, va_flags, node->fFlags);
+//  VATTR_RETURN(vap, va_acl,   xxx);
+
+    VATTR_RETURN(vap, va_create_time, node->fCreateTime);
+    VATTR_RETURN(vap, va_access_time, node->fAccessTime);
+    VATTR_RETURN(vap, va_modify_time, node->fModifyTime);
+    VATTR_RETURN(vap, va_change_time, node->fChangeTime);
+//  VATTR_RETURN(vap, va_backup_time, xxx);
+
+    VATTR_RETURN(vap, va_fileid,   node->fFileNum);
+//  VATTR_RETURN(vap, va_linkid,   xxx);
+    VATTR_RETURN(vap, va_parentid, node->fParentFileNum);
+    VATTR_RETURN(vap, va_fsid,     mtmp->fBlockRDevNum);
+//  VATTR_RETURN(vap, va_filerev,  xxx);
+    VATTR_RETURN(vap, va_gen,      node->fGeneration);
+
+//  VATTR_RETURN(vap, va_encoding, xxx);
+
+//  VATTR_RETURN(vap, va_type,  xxx);                   // handled by VFS
+//  VATTR_RETURN(vap, va_name,  xxx);                   // let VFS get this from f_mntonname
+//  VATTR_RETURN(vap, va_uuuid, xxx);
+//  VATTR_RETURN(vap, va_guuid, xxx);
+
+//  VATTR_RETURN(vap, va_nchildren, xxx);
+
+    FSNodeUnlockShared(node);
+
+    OpEnd(kEmptyFSOpVNOPGetattr, opStart, 0, mtmp, node->fFileNum, vap->va_active, 0);
+
+    return 0;
+}
+
+static errno_t VNOPSetattr(struct vnop_setattr_args *ap)
+    // Called by VFS to change information about a vnode (this is called by 
+    // the VFS implementation of <x-man-page://2/truncate>, <x-man-page://2/chmod>, 
+    // <x-man-page://2/utimes>, and so on).
+    //
+    // vp is the vnode to change.
+    //
+    // vap describes the attributes to change.  VFS has already checked that 
+    // the caller is allowed to change them.
+    //
+    // context identifies the calling process.
+    //
+    // For each attribute in vap that we change, we use VATTR_SET_SUPPORTED to 
+    // tell VFS that we did.  We support the size (of a regular file), the 
+    // owner, the group, the mode, the BSD flags, and the access and 
+    // modification times, which are everything that the file record can 
+    // hold and that a client can set.  Changing the size takes fWriteLock, 
+    // to keep it in step with writes (see "Write Notes"); the rest only need 
+    // fLock.  The new values are written to disk by the flusher, like any 
+    // other change to the file record.
+{
+    errno_t             err;
+    vnode_t             vp;
+    struct vnode_attr * vap;
+    vfs_context_t       context;
+    EmptyFSMount *      mtmp;
+    FSNode *            node;
+    boolean_t           sizeChanged;
+    uint64_t            opStart;
+
+    opStart = OpStart();
+
+    // Unpack arguments
+
+    vp      = ap->a_vp;
+    vap     = ap->a_vap;
+    context = ap->a_context;
+
+    // Pre-conditions
+
+    assert( ValidVNode(vp) );
+    assert(vap != NULL);
+    assert(context != NULL);
+
+    mtmp = EmptyFSMountFromMount(vnode_mount(vp));
+    node = FSNodeFromVNode(vp);
+    sizeChanged = FALSE;
+
+    err = 0;
+    if ( ! mtmp->fWritable ) {
+        err = EROFS;
+    }
+
+    // Change the size first, because it's the only thing that can fail.
+    
+    if ( (err == 0) && VATTR_IS_ACTIVE(vap, va_data_size) ) {
+        if ( vnode_isdir(vp) ) {
+            err = EISDIR;
+        } else if ( ! vnode_isreg(vp) ) {
+            err = EPERM;
+        } else {
+            lck_mtx_lock(node->fWriteLock);
+            err = FSNodeSetSize(vp, vap->va_data_size);
+            lck_mtx_unlock(node->fWriteLock);
+        }
+        if (err == 0) {
+            VATTR_SET_SUPPORTED(vap, va_data_size);
+            sizeChanged = TRUE;
+        }
+    }
+
+    // Then the rest.  POSIX says that changing the size changes the 
+    // modification time, so we do that before applying any explicit 
+    // modification time.
+    
+    if (err == 0) {
+        FSNodeLockExclusive(node);
+        
+        FSNodeTouch(node, sizeChanged);
+        if ( VATTR_IS_ACTIVE(vap, va_uid) ) {
+            node->fUID = vap->va_uid;
+            VATTR_SET_SUPPORTED(vap, va_uid);
+        }
+        if ( VATTR_IS_ACTIVE(vap, va_gid) ) {
+            node->fGID = vap->va_gid;
+            VATTR_SET_SUPPORTED(vap, va_gid);
+        }
+        if ( VATTR_IS_ACTIVE(vap, va_mode) ) {
+            node->fMode = (uint16_t) ( (node->fMode & S_IFMT) | (vap->va_mode & ~S_IFMT) );
+            VATTR_SET_SUPPORTED(vap, va_mode);
+        }
+        if ( VATTR_IS_ACTIVE(vap, va_flags) ) {
+            node->fFlags = vap->va_flags;
+            VATTR_SET_SUPPORTED(vap, va_flags);
+        }
+        if ( VATTR_IS_ACTIVE(vap, va_access_time) ) {
+            node->fAccessTime = vap->va_access_time;
+            VATTR_SET_SUPPORTED(vap, va_access_time);
+        }
+        if ( VATTR_IS_ACTIVE(vap, va_modify_time) ) {
+            node->fModifyTime = vap->va_modify_time;
+            VATTR_SET_SUPPORTED(vap, va_modify_time);
+        }
+        
+        FSNodeUnlockExclusive(node);
+
+        FSNodeDirtyAdd(node, 0);
+    }
+
+    OpEndVNode(
+        kEmptyFSOpVNOPSetattr, 
+        opStart, 
+        err, 
+        vp, 
+        vap->va_active, 
+        VATTR_IS_ACTIVE(vap, va_data_size) ? vap->va_data_size : 0
+    );
+
+    return err;
+}
+
+// VNOPReadDir and VNOPReaddirattr don't copy out each entry as they go. 
+// Instead they pack entries into a kernel buffer, sized from uio_resid 
+// but no bigger than kDirChunkSize, and copy that out with one uiomove. 
+// Each uiomove has a fixed cost (in the kernel it's a copyout, which has 
+// to validate the user address range), so this is much cheaper than a 
+// uiomove per entry.
+
+enum {
+    kDirChunkSize = 64 * 1024
+};
+
+static errno_t DirChunkAlloc(uio_t uio, char **chunkPtr, size_t *chunkSizePtr)
+    // Allocates a buffer for packing directory entries that will be copied 
+    // out to uio.  On success, *chunkPtr is the buffer, or NULL if there's 
+    // no room in the user's buffer at all, and *chunkSizePtr is its size.  
+    // The caller must free it with OSFree.
+{
+    errno_t     err;
+    size_t      chunkSize;
+    char *      chunk;
+
+    err = 0;
+    chunk = NULL;
+    chunkSize = (uio_resid(uio) < kDirChunkSize) ? (size_t) uio_resid(uio) : kDirChunkSize;
+    if (chunkSize != 0) {
+        chunk = OSMalloc((uint32_t) chunkSize, gOSMallocTag);
+        if (chunk == NULL) {
+            err = ENOMEM;
+        }
+    }
+    if (err != 0) {
+        chunkSize = 0;
+    }
+    *chunkPtr     = chunk;
+    *chunkSizePtr = chunkSize;
+    return err;
+}
+
+static size_t ReadDirPackEntry(
+    char *          buf, 
+    size_t          bufSize, 
+    boolean_t       extended, 
+    uint64_t        fileNum, 
+    uint8_t         type, 
+    const char *    name, 
+    size_t          nameLen, 
+    off_t           seekOff
+)
+    // Packs a (struct dirent), or a (struct direntry) if extended is set, for 
+    // the given directory entry into buf.  The record is only as long as it 
+    // needs to be to hold the name and its null terminator, rounded up to a 
+    // multiple of four bytes for a dirent (see <x-man-page://5/dir>) and 
+    // eight bytes for a direntry (which contains 64-bit fields).  seekOff is 
+    // the cookie of the entry after this one; it's only used by direntry. 
+    // Returns the size of the record (its d_reclen), or 0 if it doesn't fit 
+    // in bufSize bytes.
+{
+    struct dirent *     thisItem;
+    struct direntry *   thisExtItem;
+    size_t              nameOffset;
+    size_t              reclen;
+
+    assert(nameLen <= 255);
+
+    if (extended) {
+        nameOffset = offsetof(struct direntry, d_name);
+        reclen = (nameOffset + nameLen + 1 + 7) & ~7;
+    } else {
+        nameOffset = offsetof(struct dirent, d_name);
+        reclen = (nameOffset + nameLen + 1 + 3) & ~3;
+    }
+    if (reclen > bufSize) {
+        reclen = 0;
+    } else if (extended) {
+        thisExtItem = (struct direntry *) buf;
+        thisExtItem->d_ino     = fileNum;
+        thisExtItem->d_seekoff = (uint64_t) seekOff;
+        thisExtItem->d_reclen  = (uint16_t) reclen;
+        thisExtItem->d_namlen  = (uint16_t) nameLen;
+        thisExtItem->d_type    = type;
+    } else {
+        thisItem = (struct dirent *) buf;
+        thisItem->d_fileno = (ino_t) fileNum;
+        thisItem->d_reclen = (uint16_t) reclen;
+        thisItem->d_type   = type;
+        thisItem->d_namlen = (uint8_t) nameLen;
+    }
+    if (reclen != 0) {
+        memcpy(buf + nameOffset, name, nameLen);
+        memset(buf + nameOffset + nameLen, 0, reclen - nameOffset - nameLen);
+    }
+    return reclen;
+}
+
+static errno_t VNOPReadDir(struct vnop_readdir_args *ap)
+    // Called by VFS to iterate the contents of a directory (most notably 
+    // by the implementation of <x-man-page://2/getdirentries>).
+    //
+    // vp is the directory we're iterating.  
+    //
+    // uio describes the buffer into which we copy the (struct dirent) values 
+    // that represent directory entries; it is discussed in detail below.
+    //
+    // flags contains two options bits, VNODE_READDIR_EXTENDED and 
+    // VNODE_READDIR_REQSEEKOFF, which are used by the NFS server.  The first 
+    // asks for (struct direntry) rather than (struct dirent); this has room 
+    // for 64-bit file numbers and, more importantly, d_seekoff, the cookie 
+    // to continue after that entry.  The second says that the caller needs 
+    // those cookies.  We only support it along with VNODE_READDIR_EXTENDED, 
+    // because a (struct dirent) has nowhere to put them.
+    //
+    // eofflagPtr, if not NULL, is a place to indicate that we've read the 
+    // last directory entry. 
+    //
+    // numdirententPtr, if not NULL, is a place to return a count of the 
+    // number of directory entries that we've returned.
+    //
+    // context identifies the calling process.
+    // 
+    // The hardest thing to understand about this entry point is the UIO 
+    // management.  There are two tricky aspects:
+    //
+    // o The UIO offset (accessed via uio_offset and uio_setoffset) 
+    //   determines the first directory item read.  This does not have 
+    //   to literally be an offset into the directory (such a usage makes 
+    //   sense on a UFS-style file system, but it makes no sense for a 
+    //   file system, like HFS Plus, which has no obvious directory offset). 
+    //   Rather, the semantics are as follows:
+    //
+    //   - A UIO offset of zero indicates that you should read from the 
+    //     start of the directory.
+    //
+    //   - You are responsible for setting the UIO offset to indicate how 
+    //     much you read.
+    //
+    //   - This offset value can then be passed back to you to continue 
+    //     reading at that offset.
+    //
+    //   So, if you have a file system where you can index directory items, 
+    //   it's perfectly reasonable for you to use an index as the UIO offset.
+    //   However, there are some gotchas:
+    //
+    //   - The UIO offset is an off_t, so you might think that you have 64 bits 
+    //     to play with.  However, this is truncated down to a long in the 
+    //     basep parameter of getdirentries, so you only have 32 bits (because 
+    //     a long is 32 bits for 32-bit client processes).
+    //
+    //   - Furthermore, you only /actually/ have 31 bits, because longs are 
+    //     signed, and if you return a negative offset then, if the client 
+    //     tries to lseek <x-man-page://2/lseek> to that offset (which is a 
+    //     legal usage pattern), lseek will fail (because it arbitrarily 
+    //     disallows negative offsets, even for directories).
+    //
+    //   - Remember that uiomove increments the UIO offset by the number of bytes 
+    //     that it copies.  Typically this is not useful behaviour for directories.  
+    //     In most cases you will want to explicitly set the UIO offset 
+    //     (using uio_setoffset) before you return.
+    //
+    //   - Because the offset can be set by untrusted programs (using lseek), 
+    //     you must be able to safely (that is, without kernel panicking!) 
+    //     reject illegal offsets.  If the client calls getdirentries after seeking 
+    //     to a bogus offset, you should return EINVAL.
+    //
+    //   - Depending on your volume format, it may be expensive to verify that 
+    //     the offset is valid.  In that case, you may want to cache the last 
+    //     offset that you returned in your FSNode.  There are two things to be careful
+    //     about here:
+    //
+    //     - Make sure you invalidate the cache if you do something that changes whether 
+    //       an offset is valid.
+    //
+    //     - Be aware that you may need more than one cache entry, because multiple 
+    //       client may be reading the directory simultaneously.  Remember, while 
+    //       each client gets their own file descriptor, there's only one FSNode 
+    //       for any given on-disk directory.
+    //
+    // o The UIO resid (residual ID, accessed by uio_resid and uio_setresid) 
+    //   indicates how much space is left in the user buffer described by the UIO.  
+    //   You must update this as you copy data out into that buffer (fortunately, 
+    //   the obvious copying routine, uiomove does this update for you).  The VFS 
+    //   layer uses this value to calculate the return value for the 
+    //   getdirentries system call.  That is, the return value of 
+    //   getdirentries is the original buffer size minus this UIO resid. 
+    //   So, if you completely fill the user's buffer (hence resid is 
+    //   0), getdirentries will return the original buffer size.  
+    //   On the other hand, if you return no data, resid will be equal 
+    //   to the buffer size, and getdirentries will return 0 (an indication 
+    //   that there are no more items in the directory).
+    //
+    //   It's also worth noting that there is no guarantee that the 
+    //   user's buffer size will be an even multiple of your dirent 
+    //   size (in fact, there's no requirement for you to have a 
+    //   fixed dirent size).  Thus, even after you've filled the user's 
+    //   buffer (you've copied out all of the entries that will fit), 
+    //   it's possible for resid to be positive.  Under no circumstances 
+    //   should you copy out a partial dirent.
+    //
+    // o uiomove does not error if it only copies out a part of the data 
+    //   that you requested.  You should call uio_resid to ensure that 
+    //   there's enough space for the entire dirent before calling uiomove.
+    //
+    // Make sure you read <x-man-page://5/dirent> for information about 
+    // (struct dirent).  Specifically, this page defines constraints on 
+    // (struct dirent) to which you must comply.
+    // 
+    // On success, *eofflagPtr is TRUE if we've returned the last 
+    // entry in this directory.  The NFS server uses this information 
+    // to tag the reply packet that contains this entry with an EOF 
+    // marker; this avoids the need for the client to make another 
+    // call to confirm that it has read the entire directory.
+    //
+    // On success, *numdirentPtr is the number of dirent structures 
+    // that we read.
+    //
+    // Our implementation returns "." and ".." (which aren't stored on disk) and 
+    // then walks the directory's blocks, returning each entry that's in use.  The 
+    // UIO offset is:
+    //
+    // o kDirCookieDot for ".", and kDirCookieDotDot for "..".
+    //
+    // o otherwise, a cookie that encodes the byte offset, within the directory's 
+    //   data, of the next entry to return (or of the start of a directory block). 
+    //   See "Directory Cookies" for the details.  Internally, we use the byte 
+    //   offset, with 0 and 1 standing for "." and "..".  Entries always follow 
+    //   a block header, so real offsets can't be confused with these.
+    //
+    // We validate an offset by walking its directory block from the start, which 
+    // is cheap because we have to read the block anyway, unless it's one that 
+    // we returned recently, in which case FSNodeDirBlockSeek knows it's good.
+    //
+    // Rather than copying out a full (struct dirent) for each entry, we pack 
+    // variable length dirents into a chunk from DirChunkAlloc and copy the 
+    // whole chunk out with a single uiomove.  The chunk is never bigger than 
+    // kDirChunkSize, so a call with a bigger buffer may return less than it 
+    // could; that's allowed (see the discussion of the UIO resid, above). 
+    // Because we only ever copy out whole dirents, there's no danger of 
+    // copying out part of one.
+{
+    errno_t         err;
+    vnode_t         vp;
+    struct uio *    uio;
+    int             flags;
+    int *           eofflagPtr;
+    int             eofflag;
+    int *           numdirentPtr;
+    int             numdirent;
+    vfs_context_t   context;
+    FSNode *        node;
+    uint32_t        blockSize;
+    off_t           dirEnd;
+    off_t           cookie;
+    off_t           offset;
+    off_t           startOffset;
+    boolean_t       extended;
+    char *          chunk;
+    size_t          chunkSize;
+    size_t          chunkUsed;
+    size_t          entrySize;
+    uint64_t        opStart;
+
+    opStart = OpStart();
+
+    // Unpack arguments
+
+    vp           = ap->a_vp;
+    uio          = ap->a_uio;
+    flags        = ap->a_flags;
+    eofflagPtr   = ap->a_eofflag;
+    numdirentPtr = ap->a_numdirent;
+    context      = ap->a_context;
+
+    // Pre-conditions
+    
+    assert( ValidVNode(vp) );
+    assert(uio != NULL);
+    AssertKnownFlags(flags, VNODE_READDIR_EXTENDED | VNODE_READDIR_REQSEEKOFF);
+    // assert(eofflag != NULL);     // it's fine for this to be NULL
+    // assert(numdirent == NULL);   // this is NULL in the typical case
+    assert(context != NULL);
+    
+    assert(vnode_isdir(vp));
+
+    node      = FSNodeFromVNode(vp);
+    blockSize = node->fMount->fBlockSize;
+
+    // On a writable volume, hold the directory's lock (shared) so that no 
+    // one adds a block, or changes an entry, while we're walking it.  Like 
+    // HFS, we hold it across the uiomove.
+    
+    FSNodeLockShared(node);
+    dirEnd    = (off_t) ((node->fSize / blockSize) * blockSize);
+
+    extended = ( (flags & VNODE_READDIR_EXTENDED) != 0 );
+    eofflag = FALSE;
+    numdirent = 0;
+    cookie = uio_offset(uio);
+    offset = 0;
+    chunk = NULL;
+    chunkSize = 0;
+    chunkUsed = 0;
+    
+    err = 0;
+    if ( (flags & VNODE_READDIR_REQSEEKOFF) && ! (flags & VNODE_READDIR_EXTENDED) ) {
+        err = EINVAL;
+    } else if ( (cookie < 0) || (cookie > kDirCookieMax) ) {
+        // The client has seeked to a bogus offset.  We check for subtler 
+        // problems as we go.
+        err = EINVAL;
+    } else {
+        if (cookie > kDirCookieDotDot) {
+            offset = DirOffsetFromCookie(cookie);
+        } else {
+            offset = cookie;
+        }
+        startOffset = offset;
+        
+        err = DirChunkAlloc(uio, &chunk, &chunkSize);
+        if ( (err == 0) && (chunk == NULL) ) {
+            err = ENOBUFS;
+        }
+        
+        // If we're being asked for the first directory entry...
+        
+        if ( (err == 0) && (offset == 0) ) {
+            entrySize = ReadDirPackEntry(chunk + chunkUsed, chunkSize - chunkUsed, extended, node->fFileNum, DT_DIR, ".", 1, kDirCookieDotDot);
+            if (entrySize == 0) {
+                err = ENOBUFS;
+            } else {
+                chunkUsed += entrySize;
+                numdirent += 1;
+                offset = 1;
+            }
+        }
+
+        // If we're being asked for the second directory entry...
+
+        if ( (err == 0) && (offset == 1) ) {
+            entrySize = ReadDirPackEntry(
+                chunk + chunkUsed, 
+                chunkSize - chunkUsed, 
+                extended, 
+                node->fParentFileNum, 
+                DT_DIR, 
+                "..", 
+                2, 
+                DirCookieFromOffset(sizeof(EmptyFSDirBlockHeader))
+            );
+            if (entrySize == 0) {
+                err = ENOBUFS;
+            } else {
+                chunkUsed += entrySize;
+                numdirent += 1;
+                offset = sizeof(EmptyFSDirBlockHeader);
+            }
+        }
+        
+        // Now the entries on disk, one block at a time.
+        
+        while ( (err == 0) && (offset < dirEnd) ) {
+            buf_t                   bp;
+            const void *            block;
+            const EmptyFSDirEntry * entry;
+            uint32_t                entryOffset;
+            off_t                   blockStart;
+            
+            blockStart = offset - (offset % blockSize);
+            
+            err = FSNodeReadDirBlock(node, (uint64_t) (offset / blockSize), &bp);
+            if (err == 0) {
+                block = (const void *) buf_dataptr(bp);
+                
+                // Skip to the entry at offset.  If there isn't one, the offset 
+                // is bogus.
+                
+                err = FSNodeDirBlockSeek(node, block, offset, &entry);
+                
+                // Return entries until we run out of entries or chunk space.
+                
+                while ( (err == 0) && (entry != NULL) ) {
+                    entryOffset = (uint32_t) ((const char *) entry - (const char *) block);
+                    if (entry->fFileNum != 0) {
+                        entrySize = ReadDirPackEntry(
+                            chunk + chunkUsed, 
+                            chunkSize - chunkUsed, 
+                            extended, 
+                            EmptyFSSwapLE32(entry->fFileNum), 
+                            entry->fType, 
+                            entry->fName, 
+                            entry->fNameLength, 
+                            DirCookieFromOffset(blockStart + entryOffset + EmptyFSSwapLE16(entry->fRecordLength))
+                        );
+                        if (entrySize == 0) {
+                            err = ENOBUFS;
+                        } else {
+                            chunkUsed += entrySize;
+                            numdirent += 1;
+                        }
+                    }
+                    if (err == 0) {
+                        offset = blockStart + entryOffset + EmptyFSSwapLE16(entry->fRecordLength);
+                        entry = EmptyFSDirBlockNextEntry(block, blockSize, entry);
+                    } else {
+                        offset = blockStart + entryOffset;
+                    }
+                }
+                
+                buf_brelse(bp);
+            }
+        }
+        
+        // If we failed because there wasn't enough space in the user's buffer, 
+        // just swallow the error.  This will result getdirentries returning 
+        // less than the buffer size (possibly even zero), and the caller is 
+        // expected to cope with that.
+        
+        if (err == ENOBUFS) {
+            err = 0;
+        }
+        
+        // Copy out everything we packed in one go.
+        
+        if ( (err == 0) && (chunkUsed != 0) ) {
+            err = uiomove(chunk, (int) chunkUsed, uio);
+        }
+        if (chunk != NULL) {
+            OSFree(chunk, (uint32_t) chunkSize, gOSMallocTag);
+        }
+        
+        // If we stopped part way through a block, remember where, so that we 
+        // don't have to check the offset when the client comes back for more.
+        
+        if ( (err == 0) && (offset > 1) && (offset < dirEnd) && ((offset % blockSize) != 0) ) {
+            DirCacheCursorUpdate(node->fDirCache, (startOffset > 1) ? startOffset : 0, offset);
+        }
+        
+        // Update uio_offset.  uiomove has advanced it by the number of bytes 
+        // it copied, which is meaningless to us, so we reset it to our cookie.
+        
+        if (offset > 1) {
+            cookie = DirCookieFromOffset(offset);
+        } else {
+            cookie = offset;
+        }
+        uio_setoffset(uio, cookie);
+        
+        // Determine if we're at the end of the directory.
+        
+        eofflag = (offset >= dirEnd) && (offset > 1);
+    }
     
-    lck_mtx_lock(mtmp->fRootMutex);
+    FSNodeUnlockShared(node);
+
+    // Copy out any information that's requested by the caller.
     
-    // We can ignore mtmp->fRootAttaching here because, if it's set, mtmp->fRootVNode 
-    // will be NULL.  And, if that's the case, we just do nothing and return.  That's 
-    // exactly the correct behaviour if the system tries to reclaim the vnode while 
-    // some other thread is in the process of attaching it.
-    //
-    // The following assert checks the assumption that makes this all work.
+    if (eofflagPtr != NULL) {
+        *eofflagPtr = eofflag;
+    }
+    if (numdirentPtr != NULL) {
+        *numdirentPtr = numdirent;
+    }
+
+    OpEnd(kEmptyFSOpVNOPReadDir, opStart, err, node->fMount, node->fFileNum, (uint64_t) cookie, (uint64_t) numdirent);
+
+    return err;
+}
+
+// VNOPReaddirattr returns the entries of a directory along with their 
+// attributes, in the format described by <x-man-page://2/getdirentriesattr>. 
+// Programs that enumerate a directory and then stat each entry (ls -l, the 
+// Finder, backup tools) can use this to replace 1 + N system calls, each of 
+// which has to look up a name and get a vnode, with a handful of calls that 
+// read the directory blocks and the file records directly.  VFS only calls 
+// us if we set VOL_CAP_INT_READDIRATTR.
+//
+// Each entry in the buffer is a uint32_t length (which includes itself), 
+// followed by the fixed size attributes in the order of their bits in the 
+// attribute list, followed by the variable length data (for us, that's 
+// just the name).  ATTR_CMN_NAME is an attrreference_t whose offset is 
+// relative to the attrreference_t itself.  Everything is aligned to four 
+// bytes.  Attributes that are in dirattr are only returned for directories, 
+// and attributes that are in fileattr are only returned for other objects. 
+// Unlike getattrlist, VFS doesn't fill in any attributes for us, so we 
+// reject requests for attributes we don't support rather than returning 
+// a buffer that the client can't parse.
+//
+// kReaddirattrMaxFixedSize is enough for every fixed size attribute that we 
+// support.  Like VNOPReadDir, we pack entries into a chunk from DirChunkAlloc, 
+// rather than doing a uiomove per entry or per attribute.
+
+enum {
+    kReaddirattrMaxFixedSize = 256
+};
+
+static errno_t ReaddirattrCheckList(const EmptyFSMount *mtmp, const struct attrlist *alist)
+    // Checks that alist is something that VNOPReaddirattr can return.
+{
+    const attribute_set_t * valid;
+    errno_t                 err;
+
+    valid = &mtmp->fAttr.f_attributes.validattr;
+
+    err = 0;
+    if (    (alist->bitmapcount != ATTR_BIT_MAP_COUNT)
+         || (alist->volattr  != 0)
+         || (alist->forkattr != 0)
+         || (alist->commonattr & ~valid->commonattr)
+         || (alist->dirattr    & ~valid->dirattr)
+         || (alist->fileattr   & ~valid->fileattr) ) {
+        err = EINVAL;
+    }
+    return err;
+}
+
+static void ReaddirattrPackBytes(char **cursorPtr, const void *value, size_t size)
+    // Copies size bytes from value to *cursorPtr, and advances *cursorPtr. 
+    // The attribute buffer has no alignment beyond four bytes, so we always 
+    // use memcpy.
+{
+    memcpy(*cursorPtr, value, size);
+    *cursorPtr += size;
+}
+
+static void ReaddirattrPackTime(char **cursorPtr, int64_t nanoseconds, boolean_t is64)
+    // Packs an on-disk time as a timespec of the size that the client process 
+    // expects.
+{
+    struct timespec ts;
+
+    TimespecFromNanoseconds(nanoseconds, &ts);
+    if (is64) {
+        int64_t     ts64[2];
+        
+        ts64[0] = (int64_t) ts.tv_sec;
+        ts64[1] = (int64_t) ts.tv_nsec;
+        ReaddirattrPackBytes(cursorPtr, ts64, sizeof(ts64));
+    } else {
+        int32_t     ts32[2];
+        
+        ts32[0] = (int32_t) ts.tv_sec;
+        ts32[1] = (int32_t) ts.tv_nsec;
+        ReaddirattrPackBytes(cursorPtr, ts32, sizeof(ts32));
+    }
+}
+
+static size_t ReaddirattrPackEntry(
+    const EmptyFSMount *        mtmp, 
+    const struct attrlist *     alist, 
+    boolean_t                   is64,
+    uint64_t                    fileNum, 
+    const EmptyFSFileRecord *   rec, 
+    const EmptyFSDirEntry *     entry, 
+    char *                      buf, 
+    size_t                      bufSize
+)
+    // Packs the attributes requested by alist for the object whose directory 
+    // entry is entry and whose file record is rec into buf.  Returns the size 
+    // of the packed entry, or 0 if it doesn't fit in bufSize bytes (in which 
+    // case the contents of buf are undefined).
+{
+    char            fixed[kReaddirattrMaxFixedSize];
+    char *          cursor;
+    size_t          fixedSize;
+    size_t          nameSize;
+    uint32_t        entrySize;
+    boolean_t       isDir;
+    attrreference_t nameRef;
+    fsobj_type_t    objType;
+    fsobj_id_t      objID;
+    uint32_t        u32;
+    off_t           size;
+
+    isDir = ((rec->fMode & S_IFMT) == S_IFDIR);
+
+    // Pack the fixed size attributes into fixed.  The first one, if requested, 
+    // is the reference to the name, which we patch once we know where the 
+    // variable length data starts.
     
-    assert( ! mtmp->fRootAttaching || (mtmp->fRootVNode == NULL) );
+    cursor = fixed;
+    if (alist->commonattr & ATTR_CMN_NAME) {
+        memset(&nameRef, 0, sizeof(nameRef));
+        ReaddirattrPackBytes(&cursor, &nameRef, sizeof(nameRef));
+    }
+    if (alist->commonattr & ATTR_CMN_DEVID) {
+        ReaddirattrPackBytes(&cursor, &mtmp->fBlockRDevNum, sizeof(dev_t));
+    }
+    if (alist->commonattr & ATTR_CMN_FSID) {
+        ReaddirattrPackBytes(&cursor, &mtmp->fAttr.f_fsid, sizeof(fsid_t));
+    }
+    if (alist->commonattr & ATTR_CMN_OBJTYPE) {
+        switch (rec->fMode & S_IFMT) {
+            case S_IFDIR:
+                objType = VDIR;
+                break;
+            case S_IFLNK:
+                objType = VLNK;
+                break;
+            default:
+                assert((rec->fMode & S_IFMT) == S_IFREG);     // EmptyFSFileRecordValidate checked this
+                objType = VREG;
+                break;
+        }
+        ReaddirattrPackBytes(&cursor, &objType, sizeof(objType));
+    }
+    if (alist->commonattr & ATTR_CMN_OBJID) {
+        objID.fid_objno      = (uint32_t) fileNum;
+        objID.fid_generation = rec->fGeneration;
+        ReaddirattrPackBytes(&cursor, &objID, sizeof(objID));
+    }
+    if (alist->commonattr & ATTR_CMN_PAROBJID) {
+        objID.fid_objno      = (uint32_t) rec->fParentFileNum;
+        objID.fid_generation = 0;
+        ReaddirattrPackBytes(&cursor, &objID, sizeof(objID));
+    }
+    if (alist->commonattr & ATTR_CMN_CRTIME) {
+        ReaddirattrPackTime(&cursor, rec->fCreateTime, is64);
+    }
+    if (alist->commonattr & ATTR_CMN_MODTIME) {
+        ReaddirattrPackTime(&cursor, rec->fModifyTime, is64);
+    }
+    if (alist->commonattr & ATTR_CMN_CHGTIME) {
+        ReaddirattrPackTime(&cursor, rec->fChangeTime, is64);
+    }
+    if (alist->commonattr & ATTR_CMN_ACCTIME) {
+        ReaddirattrPackTime(&cursor, rec->fAccessTime, is64);
+    }
+    if (alist->commonattr & ATTR_CMN_OWNERID) {
+        u32 = rec->fUID;
+        ReaddirattrPackBytes(&cursor, &u32, sizeof(u32));
+    }
+    if (alist->commonattr & ATTR_CMN_GRPID) {
+        u32 = rec->fGID;
+        ReaddirattrPackBytes(&cursor, &u32, sizeof(u32));
+    }
+    if (alist->commonattr & ATTR_CMN_ACCESSMASK) {
+        u32 = rec->fMode & ~S_IFMT;
+        ReaddirattrPackBytes(&cursor, &u32, sizeof(u32));
+    }
+    if (alist->commonattr & ATTR_CMN_FLAGS) {
+        u32 = rec->fFlags;
+        ReaddirattrPackBytes(&cursor, &u32, sizeof(u32));
+    }
+    if (isDir) {
+        if (alist->dirattr & ATTR_DIR_LINKCOUNT) {
+            u32 = rec->fLinkCount;
+            ReaddirattrPackBytes(&cursor, &u32, sizeof(u32));
+        }
+    } else {
+        if (alist->fileattr & ATTR_FILE_LINKCOUNT) {
+            u32 = rec->fLinkCount;
+            ReaddirattrPackBytes(&cursor, &u32, sizeof(u32));
+        }
+        if (alist->fileattr & ATTR_FILE_TOTALSIZE) {
+            size = (off_t) rec->fSize;
+            ReaddirattrPackBytes(&cursor, &size, sizeof(size));
+        }
+        if (alist->fileattr & ATTR_FILE_ALLOCSIZE) {
+            size = (off_t) (rec->fBlockCount * mtmp->fBlockSize);
+            ReaddirattrPackBytes(&cursor, &size, sizeof(size));
+        }
+        if (alist->fileattr & ATTR_FILE_IOBLOCKSIZE) {
+            u32 = mtmp->fAttr.f_iosize;
+            ReaddirattrPackBytes(&cursor, &u32, sizeof(u32));
+        }
+        if (alist->fileattr & ATTR_FILE_DATALENGTH) {
+            size = (off_t) rec->fSize;
+            ReaddirattrPackBytes(&cursor, &size, sizeof(size));
+        }
+        if (alist->fileattr & ATTR_FILE_DATAALLOCSIZE) {
+            size = (off_t) (rec->fBlockCount * mtmp->fBlockSize);
+            ReaddirattrPackBytes(&cursor, &size, sizeof(size));
+        }
+    }
+    fixedSize = (size_t) (cursor - fixed);
+    assert(fixedSize <= sizeof(fixed));
+
+    // Work out how big the entry is and, if it fits, copy it out.
     
-    if (mtmp->fRootVNode == NULL) {
-        // Do nothing; someone beat us to the reclaim; nothing to do.
+    nameSize = 0;
+    if (alist->commonattr & ATTR_CMN_NAME) {
+        nameSize = (entry->fNameLength + 1 + 3) & ~3;      // include the null terminator, and pad to 4 bytes
+    }
+    entrySize = (uint32_t) (sizeof(uint32_t) + fixedSize + nameSize);
+    if (entrySize > bufSize) {
+        entrySize = 0;
     } else {
-        // The vnode we're reclaiming should be the root vnode.  If it isn't, 
-        // I want to know about it.
+        cursor = buf;
+        ReaddirattrPackBytes(&cursor, &entrySize, sizeof(entrySize));
+        ReaddirattrPackBytes(&cursor, fixed, fixedSize);
+        if (alist->commonattr & ATTR_CMN_NAME) {
+        
+            // The name reference is the first thing after the length, so its 
+            // offset is simply the size of the fixed size attributes.
+            
+            nameRef.attr_dataoffset = (int32_t) fixedSize;
+            nameRef.attr_length     = entry->fNameLength + 1;
+            memcpy(buf + sizeof(uint32_t), &nameRef, sizeof(nameRef));
+
+            memset(cursor, 0, nameSize);
+            memcpy(cursor, entry->fName, entry->fNameLength);
+        }
+    }
+    return entrySize;
+}
+
+static void ReaddirattrSnoop(EmptyFSMount *mtmp, uint64_t fileNum, EmptyFSFileRecord *rec)
+    // If there's an FSNode for fileNum, overwrite the fields of rec that can 
+    // change with the FSNode's values, which may be newer than the volume's. 
+    //
+    // We're holding buffers (the directory block and the file table block), 
+    // so we can't take the FSNode's fLock (see "Write Notes").  Instead we 
+    // hold its hash stripe lock, which keeps the FSNode from being freed, 
+    // and copy the fields without fLock, as HFS does in hfs_chash_snoop. 
+    // The copy can be torn if the file is changing as we look at it, but 
+    // so can the answer from a getattrlist that races with a write.
+{
+    uint32_t            hash;
+    FSNodeHashStripe *  stripe;
+    FSNode *            node;
+
+    hash = FSNodeHashValue(mtmp->fBlockRDevNum, fileNum);
+    stripe = FSNodeHashStripeForHash(hash);
+
+    lck_mtx_lock(stripe->fLock);
+    node = FSNodeHashFindLocked(mtmp->fBlockRDevNum, fileNum, hash);
+    if ( (node != NULL) && ! node->fAttaching ) {
+        rec->fMode       = node->fMode;
+        rec->fLinkCount  = node->fLinkCount;
+        rec->fFlags      = node->fFlags;
+        rec->fUID        = node->fUID;
+        rec->fGID        = node->fGID;
+        rec->fSize       = node->fSize;
+        rec->fBlockCount = node->fBlockCount + node->fDelayedBlocks;
+        rec->fCreateTime = NanosecondsFromTimespec(&node->fCreateTime);
+        rec->fModifyTime = NanosecondsFromTimespec(&node->fModifyTime);
+        rec->fChangeTime = NanosecondsFromTimespec(&node->fChangeTime);
+        rec->fAccessTime = NanosecondsFromTimespec(&node->fAccessTime);
+    }
+    lck_mtx_unlock(stripe->fLock);
+}
+
+static errno_t VNOPReaddirattr(struct vnop_readdirattr_args *ap)
+    // Called by VFS to iterate the contents of a directory, returning the 
+    // attributes of each entry (this is called by the implementation of 
+    // <x-man-page://2/getdirentriesattr>).
+    //
+    // vp is the directory we're iterating.
+    //
+    // alist describes the attributes to return for each entry.
+    //
+    // uio describes the buffer into which we copy the entries.  The UIO offset 
+    // is a directory cookie, much like it is for VNOPReadDir (see the comments 
+    // there).
+    //
+    // maxcount is the maximum number of entries to return.
+    //
+    // options contains FSOPT_XXX flags.  We ignore FSOPT_NOFOLLOW (we never 
+    // follow symlinks here anyway).  FSOPT_NOINMEMUPDATE says that the client 
+    // wants what's on the volume, even if an FSNode has newer information; 
+    // see below.
+    //
+    // newstatePtr is a place to return a value that changes whenever the 
+    // directory's contents change, so that clients can tell whether they 
+    // have to start over.  We use the directory's modification time.
+    //
+    // eofflagPtr is a place to indicate that we've returned the last entry.
+    //
+    // actualcountPtr is a place to return the number of entries we returned.
+    //
+    // context identifies the calling process.
+    //
+    // Our cookies are the same as VNOPReadDir's, except that there are no 
+    // entries for "." and ".." (getdirentriesattr doesn't return them), so a 
+    // cookie of 0 means the first entry on disk, and a cookie of 1 is invalid.  For each entry 
+    // we read its file record directly, using a FileTableCursor, without 
+    // creating an FSNode or a vnode.  On a read-only volume the file record 
+    // always matches any FSNode that exists.  On a writable volume, an FSNode 
+    // can be newer than its record (a file that's being written has a bigger 
+    // size than the record on disk, for example), so ReaddirattrSnoop overlays 
+    // the record with the FSNode's fields, unless FSOPT_NOINMEMUPDATE is set.
+    //
+    // We hold the directory's lock (shared) throughout, as VNOPReadDir does. 
+    // That also means that no entry can be removed while we're looking at 
+    // it, so every entry's file record is in use.
+    //
+    // As with VNOPReadDir, if there isn't room for even one entry, we return 
+    // no entries and no error.
+{
+    errno_t             err;
+    vnode_t             vp;
+    struct attrlist *   alist;
+    struct uio *        uio;
+    u_long              maxcount;
+    u_long              options;
+    u_long *            newstatePtr;
+    int *               eofflagPtr;
+    u_long *            actualcountPtr;
+    vfs_context_t       context;
+    EmptyFSMount *      mtmp;
+    FSNode *            node;
+    uint32_t            blockSize;
+    off_t               dirEnd;
+    off_t               cookie;
+    off_t               offset;
+    off_t               startOffset;
+    boolean_t           is64;
+    boolean_t           snoop;
+    boolean_t           full;
+    u_long              actualcount;
+    FileTableCursor     cursor;
+    char *              chunk;
+    size_t              chunkSize;
+    size_t              chunkLimit;
+    size_t              chunkUsed;
+    uint64_t            opStart;
+
+    opStart = OpStart();
+
+    // Unpack arguments
+
+    vp             = ap->a_vp;
+    alist          = ap->a_alist;
+    uio            = ap->a_uio;
+    maxcount       = ap->a_maxcount;
+    options        = ap->a_options;
+    newstatePtr    = ap->a_newstate;
+    eofflagPtr     = ap->a_eofflag;
+    actualcountPtr = ap->a_actualcount;
+    context        = ap->a_context;
+
+    // Pre-conditions
+    
+    assert( ValidVNode(vp) );
+    assert(alist != NULL);
+    assert(uio != NULL);
+    AssertKnownFlags(options, FSOPT_NOFOLLOW | FSOPT_NOINMEMUPDATE);
+    assert(newstatePtr != NULL);
+    assert(eofflagPtr != NULL);
+    assert(actualcountPtr != NULL);
+    assert(context != NULL);
+
+    assert(vnode_isdir(vp));
+
+    mtmp      = EmptyFSMountFromMount(vnode_mount(vp));
+    node      = FSNodeFromVNode(vp);
+    blockSize = mtmp->fBlockSize;
+    is64      = (vfs_context_is64bit(context) != 0);
+    snoop     = mtmp->fWritable && ! (options & FSOPT_NOINMEMUPDATE);
+
+    FSNodeLockShared(node);
+    dirEnd    = (off_t) ((node->fSize / blockSize) * blockSize);
+
+    full        = FALSE;
+    actualcount = 0;
+    memset(&cursor, 0, sizeof(cursor));
+    chunk       = NULL;
+    chunkSize   = 0;
+    chunkUsed   = 0;
+    cookie      = uio_offset(uio);
+    offset      = 0;
+    startOffset = 0;
+    
+    err = ReaddirattrCheckList(mtmp, alist);
+    if (err == 0) {
+        if ( (cookie < 0) || (cookie == kDirCookieDotDot) || (cookie > kDirCookieMax) ) {
+            err = EINVAL;
+        } else if (cookie == 0) {
+            offset = sizeof(EmptyFSDirBlockHeader);
+        } else {
+            offset      = DirOffsetFromCookie(cookie);
+            startOffset = offset;
+        }
+    }
+    if (err == 0) {
+        err = DirChunkAlloc(uio, &chunk, &chunkSize);
+        if ( (err == 0) && (chunk == NULL) ) {
+            full = TRUE;
+        }
+    }
+    chunkLimit = chunkSize;
+    
+    // Walk the directory blocks, just like VNOPReadDir.
+    
+    while ( (err == 0) && ! full && (offset < dirEnd) ) {
+        buf_t                   bp;
+        const void *            block;
+        const EmptyFSDirEntry * entry;
+        uint32_t                entryOffset;
+        off_t                   blockStart;
+        EmptyFSFileRecord       rec;
+        uint64_t                fileNum;
+        size_t                  entrySize;
+
+        blockStart = offset - (offset % blockSize);
         
-        assert(mtmp->fRootVNode == vn);
+        err = FSNodeReadDirBlock(node, (uint64_t) (offset / blockSize), &bp);
+        if (err == 0) {
+            block = (const void *) buf_dataptr(bp);
+            
+            err = FSNodeDirBlockSeek(node, block, offset, &entry);
+            
+            while ( (err == 0) && (entry != NULL) ) {
+                entryOffset = (uint32_t) ((const char *) entry - (const char *) block);
+                if (entry->fFileNum != 0) {
+                    if (actualcount >= maxcount) {
+                        full = TRUE;
+                        break;
+                    }
+                    fileNum = EmptyFSSwapLE32(entry->fFileNum);
+                    err = EmptyFSMountReadFileRecord(mtmp, &cursor, fileNum, &rec);
+                    if (err == ENOENT) {
+                        err = EIO;          // directory entry points to a free record
+                    }
+                    if ( (err == 0) && snoop ) {
+                        ReaddirattrSnoop(mtmp, fileNum, &rec);
+                    }
+                    if (err == 0) {
+                        entrySize = ReaddirattrPackEntry(mtmp, alist, is64, fileNum, &rec, entry, chunk + chunkUsed, chunkLimit - chunkUsed);
+                        
+                        // If the entry doesn't fit in what's left of the chunk, copy 
+                        // out the chunk and try again.  If it doesn't fit in an empty 
+                        // chunk, the user's buffer is full.
+                        
+                        if ( (entrySize == 0) && (chunkUsed != 0) ) {
+                            err = uiomove(chunk, (int) chunkUsed, uio);
+                            chunkUsed = 0;
+                            chunkLimit = (uio_resid(uio) < (user_ssize_t) chunkSize) ? (size_t) uio_resid(uio) : chunkSize;
+                            if (err == 0) {
+                                entrySize = ReaddirattrPackEntry(mtmp, alist, is64, fileNum, &rec, entry, chunk, chunkLimit);
+                            }
+                        }
+                    }
+                    if (err == 0) {
+                        if (entrySize == 0) {
+                            full = TRUE;
+                            break;
+                        }
+                        chunkUsed   += entrySize;
+                        actualcount += 1;
+                    }
+                }
+                if (err == 0) {
+                    offset = blockStart + entryOffset + EmptyFSSwapLE16(entry->fRecordLength);
+                    entry = EmptyFSDirBlockNextEntry(block, blockSize, entry);
+                }
+            }
+            
+            buf_brelse(bp);
+        }
+    }
+    if ( (err == 0) && (chunkUsed != 0) ) {
+        err = uiomove(chunk, (int) chunkUsed, uio);
+    }
+    FileTableCursorDone(&cursor);
+    if (chunk != NULL) {
+        OSFree(chunk, (uint32_t) chunkSize, gOSMallocTag);
+    }
+    
+    // As in VNOPReadDir, remember where we stopped and reset the UIO offset 
+    // to our cookie.
+    
+    if (err == 0) {
+        if ( (offset < dirEnd) && ((offset % blockSize) != 0) ) {
+            DirCacheCursorUpdate(node->fDirCache, startOffset, offset);
+        }
+        uio_setoffset(uio, DirCookieFromOffset(offset));
+    }
+    
+    *newstatePtr    = (u_long) node->fModifyTime.tv_sec;
+    *eofflagPtr     = (err == 0) && (offset >= dirEnd);
+    *actualcountPtr = (err == 0) ? actualcount : 0;
+
+    FSNodeUnlockShared(node);
+    
+    OpEnd(kEmptyFSOpVNOPReaddirattr, opStart, err, mtmp, node->fFileNum, (uint64_t) cookie, (uint64_t) *actualcountPtr);
+
+    return err;
+}
+
+static errno_t VNOPRead(struct vnop_read_args *ap)
+    // Called by VFS to read data from a file.
+    //
+    // vp is the vnode to read from.
+    //
+    // uio describes the read: where in the file to start, how much to read, 
+    // and where to put the data.
+    //
+    // ioflag contains flags (IO_XXX from <sys/vnode.h>) that modify the read.  
+    // The interesting ones are IO_RAOFF, which means that the client has turned 
+    // off read-ahead (using the F_RDAHEAD fcntl), and IO_NOCACHE, which means 
+    // that they don't want the data cached (F_NOCACHE).
+    //
+    // context identifies the calling process.
+    //
+    // The cluster layer does the heavy lifting (see "File Data").  We add our 
+    // own read-ahead on top.  A compressed file is read from the decompression 
+    // cache instead, and gets no read-ahead.
+    //
+    // On a writable volume the file's size can change under us.  We take a 
+    // snapshot of it, with fLock held, and then drop the lock before calling 
+    // the cluster layer (see note [7] in "FSNode Notes").  A read that races 
+    // with a write or truncate sees the file either before or after the 
+    // change, or (if it's big) part way through, which is what POSIX allows 
+    // for a read that isn't serialised with the write. 
+{
+    errno_t         err;
+    vnode_t         vp;
+    uio_t           uio;
+    int             ioflag;
+    vfs_context_t   context;
+    EmptyFSMount *  mtmp;
+    FSNode *        node;
+    boolean_t       shouldReadAhead;
+    off_t           raOffset;
+    int             raLength;
+    off_t           startOffset;
+    user_ssize_t    startResid;
+    uint64_t        fileSize;
+    uint64_t        length;
+    uint64_t        opStart;
+
+    opStart = OpStart();
+
+    // Unpack arguments
+
+    vp      = ap->a_vp;
+    uio     = ap->a_uio;
+    ioflag  = ap->a_ioflag;
+    context = ap->a_context;
+
+    // Pre-conditions
+    
+    assert( ValidVNode(vp) );
+    assert(uio != NULL);
+    assert(uio_rw(uio) == UIO_READ);
+    assert(context != NULL);
+
+    mtmp = EmptyFSMountFromMount(vnode_mount(vp));
+    node = FSNodeFromVNode(vp);
+    startOffset = uio_offset(uio);      // for the trace
+    startResid  = uio_resid(uio);
+
+    FSNodeLockShared(node);
+    fileSize = node->fSize;
+    FSNodeUnlockShared(node);
+    
+    // Check the arguments.  Directories are read with VNOPReadDir, and 
+    // symlinks with VNOPReadlink.
+    
+    err = 0;
+    if ( vnode_isdir(vp) ) {
+        err = EISDIR;
+    } else if ( ! vnode_isreg(vp) ) {
+        err = EPERM;
+    } else if (uio_offset(uio) < 0) {
+        err = EINVAL;
+    }
+    
+    // Do the read.  Reading at or beyond the end of the file isn't an 
+    // error; it just reads nothing.
+    
+    if ( (err == 0) && (uio_resid(uio) > 0) && ( (uint64_t) uio_offset(uio) < fileSize ) && (node->fCompressedChunkSize != 0) ) {
+        length = fileSize - (uint64_t) uio_offset(uio);
+        if (length > (uint64_t) uio_resid(uio)) {
+            length = (uint64_t) uio_resid(uio);
+        }
+        err = FSNodeCopyCompressed(node, (uint64_t) uio_offset(uio), length, uio, NULL);
+    } else if ( (err == 0) && (uio_resid(uio) > 0) && ( (uint64_t) uio_offset(uio) < fileSize ) ) {
+        shouldReadAhead = FALSE;
+        if (    ! (mtmp->fDebugLevel & kEmptyFSDebugNoFastPaths) 
+             && ! (ioflag & (IO_RAOFF | IO_NOCACHE)) ) {
+            shouldReadAhead = FSNodeReadAheadAdvise(node, fileSize, uio_offset(uio), uio_resid(uio), &raOffset, &raLength);
+            ioflag |= IO_RAOFF;
+        }
         
-        // Tell VFS that we're removing our soft reference to the vnode.
+        err = cluster_read(vp, uio, (off_t) fileSize, ioflag);
         
-        junk = vnode_removefsref(mtmp->fRootVNode);
-        assert(junk == 0);
+        // Read-ahead is just a hint, so we ignore any errors.  If the data 
+        // really can't be read, the client will find out when they get there.
         
-        mtmp->fRootVNode = NULL;
+        if ( (err == 0) && shouldReadAhead ) {
+            (void) advisory_read(vp, (off_t) fileSize, raOffset, raLength);
+        }
     }
 
-    lck_mtx_unlock(mtmp->fRootMutex);
+    OpEnd(kEmptyFSOpVNOPRead, opStart, err, mtmp, node->fFileNum, (uint64_t) startOffset, (uint64_t) startResid);
+
+    return err;
 }
 
-#if MACH_ASSERT
+static errno_t VNOPWrite(struct vnop_write_args *ap)
+    // Called by VFS to write data to a file.
+    //
+    // vp is the vnode to write to.
+    //
+    // uio describes the write: where in the file to start, how much to write, 
+    // and where to get the data from.
+    //
+    // ioflag contains flags (IO_XXX from <sys/vnode.h>) that modify the write.  
+    // We pay attention to IO_APPEND (write at the end of the file, whatever 
+    // the uio says), IO_SYNC (don't return until the data is on the disk) 
+    // and IO_UNIT (if the write fails, undo all of it).
+    //
+    // context identifies the calling process.
+    //
+    // The write itself just copies the data into the UBC, leaving the pages 
+    // dirty.  Before doing that we reserve blocks for any part of the write 
+    // that extends the file, so that we can return ENOSPC now rather than 
+    // losing the data later, but we don't allocate them; that happens when 
+    // the pages are pushed (see "Delayed Allocation Notes" and "Flusher 
+    // Notes").  fWriteLock keeps the file's size stable for the duration, 
+    // and we drop fLock before calling the cluster layer (see "Write Notes").
+{
+    errno_t         err;
+    vnode_t         vp;
+    uio_t           uio;
+    int             ioflag;
+    vfs_context_t   context;
+    EmptyFSMount *  mtmp;
+    FSNode *        node;
+    off_t           startOffset;
+    user_ssize_t    startResid;
+    uint64_t        oldSize;
+    uint64_t        newSize;
+    uint64_t        blocksNeeded;
+    uint64_t        blocksHave;
+    uint64_t        written;
+    int             flags;
+    uint64_t        txn;
+    uint64_t        opStart;
 
-    static boolean_t ValidVNode(vnode_t vn)
-        // Returns true if the vnode is valid on our file system.  
-        // In this case, the only valid vnode is the root vnode, 
-        // so the implementation is trivial.
-    {
-        boolean_t       result;
-        EmptyFSMount *  mtmp;
+    opStart = OpStart();
+
+    // Unpack arguments
+
+    vp      = ap->a_vp;
+    uio     = ap->a_uio;
+    ioflag  = ap->a_ioflag;
+    context = ap->a_context;
+
+    // Pre-conditions
+    
+    assert( ValidVNode(vp) );
+    assert(uio != NULL);
+    assert(uio_rw(uio) == UIO_WRITE);
+    assert(context != NULL);
+
+    mtmp = EmptyFSMountFromMount(vnode_mount(vp));
+    node = FSNodeFromVNode(vp);
+    startOffset = uio_offset(uio);      // for the trace, and IO_UNIT
+    startResid  = uio_resid(uio);
+    written = 0;
+
+    // Check the arguments.
+    
+    err = 0;
+    if ( vnode_isdir(vp) ) {
+        err = EISDIR;
+    } else if ( ! vnode_isreg(vp) ) {
+        err = EPERM;
+    } else if ( ! mtmp->fWritable ) {
+        err = EROFS;
+    } else if (uio_offset(uio) < 0) {
+        err = EINVAL;
+    }
+    
+    if ( (err == 0) && (uio_resid(uio) > 0) ) {
+
+        // If there's too much dirty data, wait for the flusher to catch up.  
+        // We must do this before taking any locks.
         
-        assert(vn != NULL);
+        EmptyFSMountThrottleWriters(mtmp);
+
+        lck_mtx_lock(node->fWriteLock);
+
+        // Work out where the write goes, and reserve blocks for any part 
+        // of it that's beyond the blocks that the file already has, 
+        // allocated or reserved.  Then set the new size.  If the volume 
+        // looks full, there may be blocks waiting on the journal to be 
+        // freed; see EmptyFSMountJournalReclaim.
+        
+        do {
+            err = 0;
+            FSNodeLockExclusive(node);
+            
+            oldSize = node->fSize;
+            if (ioflag & IO_APPEND) {
+                uio_setoffset(uio, (off_t) oldSize);
+            }
+            startOffset = uio_offset(uio);
+            newSize = (uint64_t) startOffset + (uint64_t) startResid;
+            if (newSize < oldSize) {
+                newSize = oldSize;
+            }
+
+            blocksNeeded = (newSize + mtmp->fBlockSize - 1) / mtmp->fBlockSize;
+            blocksHave   = node->fBlockCount + node->fDelayedBlocks;
+            if (blocksNeeded > blocksHave) {
+                err = EmptyFSMountCounterReserve(mtmp, kVolumeCounterFreeBlocks, blocksNeeded - blocksHave);
+                if (err == 0) {
+                    node->fDelayedBlocks += blocksNeeded - blocksHave;
+                }
+            }
+            if (err == 0) {
+                node->fSize = newSize;
+            }
+            
+            FSNodeUnlockExclusive(node);
+        } while ( (err == ENOSPC) && EmptyFSMountJournalReclaim(mtmp) );
+
+        // Copy the data into the UBC.  If the write starts beyond the end of 
+        // the file, the cluster layer zero fills the gap (for the same 
+        // reason as in FSNodeSetSize). 
         
-        mtmp = EmptyFSMountFromMount( vnode_mount(vn) );
+        if (err == 0) {
+            if (newSize > oldSize) {
+                (void) ubc_setsize(vp, (off_t) newSize);
+            }
+            flags = ioflag & IO_SYNC;
+            if ( (uint64_t) startOffset > oldSize ) {
+                flags |= IO_HEADZEROFILL;
+            }
+            err = cluster_write(vp, uio, (off_t) oldSize, (off_t) newSize, (off_t) oldSize, 0, flags);
+
+            // If the write failed, put the size back to what it was, or, if 
+            // some of the data was written and the client is happy with a 
+            // partial write, to the end of that data.  Either way, this 
+            // gives back the reservation for the rest.
+            
+            if (err != 0) {
+                if (ioflag & IO_UNIT) {
+                    (void) FSNodeSetSize(vp, oldSize);
+                    uio_setoffset(uio, startOffset);
+                    uio_setresid(uio, startResid);
+                } else if ( (uint64_t) uio_offset(uio) < newSize ) {
+                    (void) FSNodeSetSize(vp, ((uint64_t) uio_offset(uio) > oldSize) ? (uint64_t) uio_offset(uio) : oldSize);
+                }
+            }
+            written = (uint64_t) (startResid - uio_resid(uio));
+        }
         
-        lck_mtx_lock(mtmp->fRootMutex);
+        if (written != 0) {
+            FSNodeLockExclusive(node);
+            FSNodeTouch(node, TRUE);
+            FSNodeUnlockExclusive(node);
+        }
 
-        result = (vn == mtmp->fRootVNode);
+        lck_mtx_unlock(node->fWriteLock);
 
-        lck_mtx_unlock(mtmp->fRootMutex);
+        // Queue the file for the flusher, or, for IO_SYNC, where the cluster 
+        // layer has already written the data, write the record now.  On a 
+        // journalled volume, committing the record's transaction makes it 
+        // durable, along with everything else in that transaction.
         
-        return result;
+        if (written != 0) {
+            FSNodeDirtyAdd(node, written);
+            if (ioflag & IO_SYNC) {
+                EmptyFSMountTransactionBegin(mtmp);
+                err = FSNodeWriteRecord(node);
+                txn = EmptyFSMountTransactionEnd(mtmp);
+                if ( (err == 0) && (mtmp->fJournal != NULL) ) {
+                    err = EmptyFSMountJournalCommit(mtmp, txn);
+                } else if (err == 0) {
+                    buf_flushdirtyblks(mtmp->fBlockDevVNode, TRUE, BUF_SKIP_LOCKED, "EmptyFS:write");
+                }
+            }
+        }
     }
 
-#endif
+    OpEnd(kEmptyFSOpVNOPWrite, opStart, err, mtmp, node->fFileNum, (uint64_t) startOffset, (uint64_t) startResid);
 
-/////////////////////////////////////////////////////////////////////
-#pragma mark ***** VNode Operations
+    return err;
+}
 
-static errno_t VNOPLookup(struct vnop_lookup_args *ap)
-    // This is called by VFS to do a directory lookup.
+static errno_t VNOPAllocate(struct vnop_allocate_args *ap)
+    // Called by VFS to preallocate space for a file (this is called by the 
+    // VFS implementation of the F_PREALLOCATE command of <x-man-page://2/fcntl>).
     //
-    // dvp is the directory to search.
+    // vp is the file.
     //
-    // cnp describes the name to search for.  This is kinda complicated, although 
-    // the comments in <sys/vnode.h> are pretty helpful.
+    // length is the number of bytes of space that the file should have, 
+    // counting from the start of the file or, if flags includes 
+    // ALLOCATEFROMPEOF, from the end of the space it already has.
     //
-    // vpp is a pointer to a vnode where we return the found item.  The 
-    // returned vnode must have an I/O reference, and the caller is responsible 
-    // for releasing it.
+    // flags is a combination of ALLOCATECONTIG (the new space must be 
+    // contiguous), ALLOCATEALL (allocate all of it, or nothing), and the 
+    // ALLOCATEFROMXxx flags.
+    //
+    // bytesallocated is where we return the number of bytes of space that 
+    // we added.
+    //
+    // offset is a block on the volume near which to allocate, if flags 
+    // includes ALLOCATEFROMVOL.  We ignore it; our own placement (right after 
+    // the file's last extent, or in the current CPU's allocation group) is 
+    // better than any hint that a client is likely to have.
     //
     // context identifies the calling process.
+    //
+    // We reserve the new blocks like a write does (see "Delayed Allocation 
+    // Notes") and then allocate them all straight away, which puts them in 
+    // as few extents as the free space allows.  The blocks belong to the 
+    // file until it's truncated or removed, even though they're beyond the 
+    // end of file.  If length is less than the space the file has, we give 
+    // back any space beyond the end of file, which is what HFS Plus does.
 {
-    errno_t                 err;
-    vnode_t                 dvp;
-    vnode_t *               vpp;
-    struct componentname *  cnp;
-    vfs_context_t           context;
-    vnode_t                 vn;
-    
+    errno_t         err;
+    vnode_t         vp;
+    off_t           length;
+    uint32_t        flags;
+    off_t *         bytesAllocated;
+    vfs_context_t   context;
+    EmptyFSMount *  mtmp;
+    FSNode *        node;
+    uint64_t        oldBlocks;
+    uint64_t        newBlocks;
+    uint64_t        extra;
+    uint64_t        unallocated;
+    uint64_t        counters[kVolumeCounterCount];
+    uint64_t        opStart;
+
+    opStart = OpStart();
+
     // Unpack arguments
-    
-    dvp     = ap->a_dvp;
-    vpp     = ap->a_vpp;
-    cnp     = ap->a_cnp;
-    context = ap->a_context;
-    
+
+    vp             = ap->a_vp;
+    length         = ap->a_length;
+    flags          = ap->a_flags;
+    bytesAllocated = ap->a_bytesallocated;
+    context        = ap->a_context;
+
     // Pre-conditions
-    
-    assert(dvp != NULL);
-    assert(vnode_isdir(dvp));
-    assert( ValidVNode(dvp) );
-    assert(vpp != NULL);
-    assert(cnp != NULL);
+
+    assert( ValidVNode(vp) );
+    assert(bytesAllocated != NULL);
     assert(context != NULL);
-    
-    // Prepare for failure.
-    
-    vn = NULL;
 
-    // Trivial implementation
-    
-    if (cnp->cn_flags & ISDOTDOT) {
-        // Implement lookup for ".." (that is, the parent directory).  As we currently 
-        // only support one directory (the root directory) and the parent of the root 
-        // is always the root, this is trivial (and, incidentally, exactly the same 
-        // as the code for ".", but that wouldn't be true in a more general VFS plug-in).
-        // We just get an I/O reference on dvp and return that.
+    mtmp = EmptyFSMountFromMount(vnode_mount(vp));
+    node = FSNodeFromVNode(vp);
+    *bytesAllocated = 0;
 
-        err = vnode_get(dvp);
-        if (err == 0) {
-            vn = dvp;
-        }
-    } else if ( (cnp->cn_namelen == 1) && (cnp->cn_nameptr[0] == '.') ) {
-        // Implement lookup for "." (that is, this directory).  Just get an I/O reference 
-        // to dvp and return that.
-        
-        err = vnode_get(dvp);
-        if (err == 0) {
-            vn = dvp;
-        }
-    } else {
-        err = ENOENT;
+    err = 0;
+    if ( vnode_isdir(vp) ) {
+        err = EISDIR;
+    } else if ( ! vnode_isreg(vp) ) {
+        err = EPERM;
+    } else if ( ! mtmp->fWritable ) {
+        err = EROFS;
+    } else if (length < 0) {
+        err = EINVAL;
     }
-    
-    // Under all circumstances we set *vpp to vn.  That way, we satisfy the 
-    // post-condition, regardless of what VFS uses as the initial value for 
-    // *vpp.
-    
-    *vpp = vn;
-    
-    // Post-conditions
-    
-    assert( (err == 0) == (*vpp != NULL) );
-    
+
+    if (err == 0) {
+        lck_mtx_lock(node->fWriteLock);
+
+        // Allocating blocks marks them in the bitmap, when we write the 
+        // record, so all of this is one transaction.  If the volume looks 
+        // full, there may be blocks waiting on the journal to be freed 
+        // (see EmptyFSMountJournalReclaim), but we can't wait for them 
+        // with a handle.  A failure with ENOSPC leaves the file as it was, 
+        // so we can just try again.
+
+        do {
+            EmptyFSMountTransactionBegin(mtmp);
+            FSNodeLockExclusive(node);
+
+            oldBlocks = node->fBlockCount + node->fDelayedBlocks;
+            newBlocks = ((uint64_t) length + mtmp->fBlockSize - 1) / mtmp->fBlockSize;
+            if (flags & ALLOCATEFROMPEOF) {
+                newBlocks += oldBlocks;
+            }
+
+            if (newBlocks > oldBlocks) {
+
+                // Reserve the new blocks.  If there aren't enough, and the 
+                // client will take what it can get, reserve what's left.
+            
+                extra = newBlocks - oldBlocks;
+                err = EmptyFSMountCounterReserve(mtmp, kVolumeCounterFreeBlocks, extra);
+                if ( (err == ENOSPC) && ! (flags & ALLOCATEALL) ) {
+                    EmptyFSMountGetCounters(mtmp, counters);
+                    if (counters[kVolumeCounterFreeBlocks] != 0) {
+                        extra = (counters[kVolumeCounterFreeBlocks] < extra) ? counters[kVolumeCounterFreeBlocks] : extra;
+                        err = EmptyFSMountCounterReserve(mtmp, kVolumeCounterFreeBlocks, extra);
+                    }
+                }
+
+                // Allocate them, along with any delayed blocks that the file 
+                // already had.  If that fails part way, give back the blocks 
+                // we didn't get or, if the client wanted all or nothing, all 
+                // of them.  FSNodeTruncateBlocks gives back delayed blocks 
+                // before allocated ones.
+            
+                if (err == 0) {
+                    node->fDelayedBlocks += extra;
+                    err = FSNodeAllocateDelayed(node, (flags & ALLOCATECONTIG) != 0);
+                    if (err != 0) {
+                        unallocated = (node->fDelayedBlocks < extra) ? node->fDelayedBlocks : extra;
+                        if ( (flags & ALLOCATEALL) || (unallocated == extra) ) {
+                            (void) FSNodeTruncateBlocks(node, oldBlocks * mtmp->fBlockSize);
+                        } else {
+                            (void) FSNodeTruncateBlocks(node, (oldBlocks + extra - unallocated) * mtmp->fBlockSize);
+                            extra -= unallocated;
+                            err = 0;
+                        }
+                    }
+                    if (err == 0) {
+                        *bytesAllocated = (off_t) (extra * mtmp->fBlockSize);
+                    }
+                }
+            } else if ( (newBlocks < oldBlocks) && ! (flags & ALLOCATEFROMPEOF) ) {
+
+                // Give back any space beyond both length and the end of file.
+            
+                err = FSNodeTruncateBlocks(node, ((uint64_t) length > node->fSize) ? (uint64_t) length : node->fSize);
+            }
+
+            FSNodeUnlockExclusive(node);
+            (void) FSNodeWriteRecord(node);     // if this fails, the flusher tries again
+            (void) EmptyFSMountTransactionEnd(mtmp);
+        } while ( (err == ENOSPC) && EmptyFSMountJournalReclaim(mtmp) );
+
+        lck_mtx_unlock(node->fWriteLock);
+
+        FSNodeDirtyAdd(node, 0);
+    }
+
+    OpEndVNode(kEmptyFSOpVNOPAllocate, opStart, err, vp, (uint64_t) length, (uint64_t) *bytesAllocated);
+
     return err;
 }
 
-static errno_t VNOPOpen(struct vnop_open_args *ap)
-    // Called by VFS to open a vnode for access.
+static errno_t VNOPFsync(struct vnop_fsync_args *ap)
+    // Called by VFS to write a file's data and metadata to disk.
     //
-    // vp is the vnode that's being opened. 
-    // 
-    // mode contains the flags passed to open (things like FREAD).
+    // vp is the vnode to write.
+    //
+    // waitfor is MNT_WAIT if we must not return until the writes are done, 
+    // or MNT_NOWAIT if we can just start them.
     //
     // context identifies the calling process.
     //
-    // This entry is rarely useful because VFS can read a file vnode without ever 
-    // opening it, thus any work that you'd usually do here you have to do lazily in 
-    // your read/write entry points.
+    // We push the file's dirty pages and write its record (using 
+    // FSNodeFlush), and then write all of the volume's dirty metadata 
+    // buffers.  That's more than we need to, but the buffer cache doesn't 
+    // let us pick out the buffers that belong to one file, and it's what 
+    // makes the file's record, and any blocks allocated for it, durable.
+    // The file stays on the dirty list; the flusher finds nothing to do.
     //
-    // Regardless, in our implementation we have nothing to do.
+    // On a journalled volume, we commit the running transaction instead, 
+    // which makes the record durable with one journal write, shared with 
+    // anyone else who's committing at the same time (see "Journal Notes"), 
+    // rather than writing every dirty metadata buffer home.
 {
+    errno_t         err;
     vnode_t         vp;
-    int             mode;
+    int             waitfor;
     vfs_context_t   context;
+    EmptyFSMount *  mtmp;
+    uint64_t        opStart;
+
+    opStart = OpStart();
 
     // Unpack arguments
-    
+
     vp      = ap->a_vp;
-    mode    = ap->a_mode;
+    waitfor = ap->a_waitfor;
     context = ap->a_context;
-    
+
     // Pre-conditions
-    
+
     assert( ValidVNode(vp) );
-    AssertKnownFlags(mode, O_EVTONLY | O_NONBLOCK | FREAD | FWRITE);
     assert(context != NULL);
 
-    // Empty implementation
-    
-    assert(vnode_isdir(vp));
+    mtmp = EmptyFSMountFromMount(vnode_mount(vp));
 
-    return 0;
+    err = 0;
+    if (mtmp->fWritable) {
+        err = FSNodeFlush(vp);
+        if ( (err == 0) && (mtmp->fJournal != NULL) ) {
+            err = EmptyFSMountJournalCommit(mtmp, 0);
+        } else if (err == 0) {
+            buf_flushdirtyblks(mtmp->fBlockDevVNode, (waitfor == MNT_WAIT), BUF_SKIP_LOCKED, "EmptyFS:fsync");
+        }
+    }
+
+    OpEndVNode(kEmptyFSOpVNOPFsync, opStart, err, vp, (uint64_t) waitfor, 0);
+
+    return err;
 }
 
-static errno_t VNOPClose(struct vnop_close_args *ap)
-    // Called by VFS to close a vnode for access.
+static errno_t VNOPBlockmap(struct vnop_blockmap_args *ap)
+    // Called by the cluster layer (and by buf_strategy) to find out where 
+    // part of a file lives on disk.
     //
-    // vp is the vnode that's being closed. 
+    // vp is the vnode of the file.
     //
-    // fflags contains the flags associated with the close (things like FREAD).
+    // foffset and size describe the range of the file.
     //
-    // context identifies the calling process.
+    // bpn is where to put the device block number (in units of the device's 
+    // block size) that holds foffset, or -1 if that part of the file has no 
+    // storage (in which case the cluster layer zero fills it).
     //
-    // This entry is not as useful as you might think because a vnode can be accessed 
-    // after the last close (if, for example, if has been memory mapped).  In most cases 
-    // the work that you might think to do here, you end up doing in VNOPInactive.
+    // run, if not NULL, is where to put the number of bytes, starting at foffset, 
+    // that are contiguous on disk.  This can be less than size, but must not be 
+    // more.
     //
-    // Regardless, in our implementation we have nothing to do.
+    // poff, if not NULL, is where to put the offset of foffset within the 
+    // block at bpn.  Our mapping is always block aligned, so this is zero.
+    //
+    // flags is VNODE_READ or VNODE_WRITE.
+    //
+    // context identifies the calling process.  It can be NULL.
 {
+    errno_t         err;
     vnode_t         vp;
-    int             fflag;
-    vfs_context_t   context;
+    off_t           foffset;
+    size_t          size;
+    daddr64_t *     bpnPtr;
+    size_t *        runPtr;
+    int *           poffPtr;
+    int             flags;
+    size_t          run;
+    uint64_t        opStart;
+
+    opStart = OpStart();
 
     // Unpack arguments
 
     vp      = ap->a_vp;
-    fflag   = ap->a_fflag;
-    context = ap->a_context;
+    foffset = ap->a_foffset;
+    size    = ap->a_size;
+    bpnPtr  = ap->a_bpn;
+    runPtr  = ap->a_run;
+    poffPtr = (int *) ap->a_poff;
+    flags   = ap->a_flags;
 
     // Pre-conditions
     
     assert( ValidVNode(vp) );
-    AssertKnownFlags(fflag, O_EVTONLY | O_NONBLOCK | FREAD | FWRITE);
-    assert(context != NULL);
-
-    // Empty implementation
+    assert(bpnPtr != NULL);
+    AssertKnownFlags(flags, VNODE_READ | VNODE_WRITE);
+
+    // On a read-only volume we have no business mapping anything for 
+    // writing.  On a writable one, mapping for writing is what triggers 
+    // delayed allocation; see "Delayed Allocation Notes".  A compressed file 
+    // has no block that holds any given byte, so it can't be mapped at all; 
+    // we never pass one to the cluster layer, so this shouldn't happen.
     
-    assert(vnode_isdir(vp));
+    err = 0;
+    if ( ! vnode_isreg(vp) ) {
+        err = ENOTSUP;
+    } else if (FSNodeFromVNode(vp)->fCompressedChunkSize != 0) {
+        err = ENOTSUP;
+    } else if ( (flags & VNODE_WRITE) && ! EmptyFSMountFromMount(vnode_mount(vp))->fWritable ) {
+        err = EROFS;
+    }
+    if (err == 0) {
+        err = FSNodeBlockMap(FSNodeFromVNode(vp), foffset, size, flags, bpnPtr, &run);
+    }
+    if (err == 0) {
+        if (runPtr != NULL) {
+            *runPtr = run;
+        }
+        if (poffPtr != NULL) {
+            *poffPtr = 0;
+        }
+    }
+
+    OpEndVNode(kEmptyFSOpVNOPBlockmap, opStart, err, vp, (uint64_t) foffset, (uint64_t) size);
+
+    return err;
+}
+
+static errno_t VNOPStrategy(struct vnop_strategy_args *ap)
+    // Called by the cluster layer to do the I/O described by a buffer.
+    //
+    // bp is the buffer.  buf_vnode(bp) is the vnode of the file, and 
+    // buf_blkno(bp) is the device block at which the I/O starts, as 
+    // returned by VNOPBlockmap.
+    //
+    // buf_strategy does the real work; if the buffer hasn't been mapped yet, 
+    // it calls VNOPBlockmap itself, then it passes the buffer to the device.  
+    // All we have to do is tell it what device we're on.  Regardless of 
+    // whether the I/O succeeds, the buffer must be completed (with 
+    // buf_biodone), which buf_strategy does for us.
+{
+    errno_t         err;
+    buf_t           bp;
+    vnode_t         vp;
+    EmptyFSMount *  mtmp;
+    daddr64_t       lblkno;
+    uint32_t        count;
+    uint64_t        opStart;
+
+    opStart = OpStart();
+
+    // Unpack arguments
+
+    bp = ap->a_bp;
+
+    // Pre-conditions
+
+    assert(bp != NULL);
+    vp = buf_vnode(bp);
+    assert( ValidVNode(vp) );
+
+    mtmp = EmptyFSMountFromMount(vnode_mount(vp));
+
+    // The buffer may be completed, and thus released, before buf_strategy 
+    // returns, so we grab the information for the trace now.
     
+    lblkno = buf_lblkno(bp);
+    count  = buf_count(bp);
+
+    if ( ! (buf_flags(bp) & B_READ) && ! mtmp->fWritable ) {
+        err = EROFS;
+        buf_seterror(bp, err);
+        buf_biodone(bp);
+    } else {
+        err = buf_strategy(mtmp->fBlockDevVNode, ap);
+    }
+
+    OpEndVNode(kEmptyFSOpVNOPStrategy, opStart, err, vp, (uint64_t) lblkno, (uint64_t) count);
+
+    return err;
+}
+
+static errno_t VNOPBlktooff(struct vnop_blktooff_args *ap)
+    // Called by buf_strategy (via ubc_blktooff) to convert a logical block 
+    // number to a file offset.
+    //
+    // vp is the vnode of the file.
+    //
+    // lblkno is the logical block number.
+    //
+    // offset is where to put the corresponding file offset.
+    //
+    // Our logical blocks are PAGE_SIZE; see "File Data".
+{
+    vnode_t     vp;
+
+    vp = ap->a_vp;
+
+    assert( ValidVNode(vp) );
+    assert(ap->a_offset != NULL);
+
+    *ap->a_offset = (off_t) ap->a_lblkno * PAGE_SIZE_64;
+
     return 0;
 }
 
-static errno_t VNOPGetattr(struct vnop_getattr_args *ap)
-    // Called by VFS to get information about a vnode (this is called by the 
-    // VFS implementation of <x-man-page://2/stat> and <x-man-page://2/getattrlist>).
+static errno_t VNOPOfftoblk(struct vnop_offtoblk_args *ap)
+    // Called by the cluster layer (via ubc_offtoblk) to convert a file 
+    // offset to a logical block number.  The inverse of VNOPBlktooff.
+{
+    vnode_t     vp;
+
+    vp = ap->a_vp;
+
+    assert( ValidVNode(vp) );
+    assert(ap->a_lblkno != NULL);
+
+    *ap->a_lblkno = (daddr64_t) (ap->a_offset / PAGE_SIZE_64);
+
+    return 0;
+}
+
+static errno_t VNOPMmap(struct vnop_mmap_args *ap)
+    // Called by VFS when a file is memory mapped.
     //
-    // vp is the vnode whose information is requested.
+    // vp is the vnode of the file.
     //
-    // vap describes the attributes requested and the place to store the results.
+    // fflags is the protection requested for the mapping (PROT_READ, 
+    // PROT_WRITE, and so on).  A private mapping is a copy-on-write copy 
+    // of the file, whose changes never reach us, so VFS doesn't include 
+    // PROT_WRITE for it.  Thus PROT_WRITE means a shared writable mapping.
     //
     // context identifies the calling process.
     //
-    // You have two options for doing this:
+    // VFS only pays attention to an EPERM error, which prevents the mapping.  
+    // On a read-only volume we can't actually write, but VFS won't allow a 
+    // shared writable mapping of a file that wasn't opened for writing, 
+    // which on a read-only volume it can't be.  So we allow anything on a 
+    // regular file.
     //
-    // o For attributes whose values you have readily available, use the VATTR_RETURN 
-    //   macro to unilaterally return the value.
+    // On a writable volume, a shared writable mapping would dirty pages 
+    // behind our back, and we don't implement VNOPPageout to write them, 
+    // so the changes would be lost.  We refuse PROT_WRITE on a writable 
+    // volume rather than pretend.  Private mappings, read-only or writable, 
+    // are fine.
+{
+    vnode_t         vp;
+    vfs_context_t   context;
+    errno_t         err;
+    uint64_t        opStart;
+
+    opStart = OpStart();
+
+    // Unpack arguments
+
+    vp      = ap->a_vp;
+    context = ap->a_context;
+
+    // Pre-conditions
+
+    assert( ValidVNode(vp) );
+    assert(context != NULL);
+
+    err = 0;
+    if ( ! vnode_isreg(vp) ) {
+        err = EPERM;
+    } else if ( (ap->a_fflags & PROT_WRITE) && EmptyFSMountFromMount(vnode_mount(vp))->fWritable ) {
+        err = EPERM;
+    } else {
+        FSNodeSetMapped(FSNodeFromVNode(vp), TRUE);
+    }
+
+    OpEndVNode(kEmptyFSOpVNOPMmap, opStart, err, vp, (uint64_t) ap->a_fflags, 0);
+
+    return err;
+}
+
+static errno_t VNOPMnomap(struct vnop_mnomap_args *ap)
+    // Called by VFS when the last mapping of a file goes away.
     //
-    // o For attributes whose values are hard to calculate, use VATTR_IS_ACTIVE to see 
-    //   if the caller requested the attribute and, if so, copy the value into the 
-    //   appropriate field.
+    // vp is the vnode of the file.
     //
-    // Our implementation is trivial; we just return statically configured values. 
+    // context identifies the calling process.
 {
-    vnode_t             vp;
-    struct vnode_attr * vap;
-    vfs_context_t       context;
-    EmptyFSMount *      mtmp;
-    static const struct timespec kYearZero = {0, 0};
+    vnode_t         vp;
+    vfs_context_t   context;
+    uint64_t        opStart;
+
+    opStart = OpStart();
 
     // Unpack arguments
 
     vp      = ap->a_vp;
-    vap     = ap->a_vap;
     context = ap->a_context;
 
     // Pre-conditions
-    
+
     assert( ValidVNode(vp) );
-    assert(vap != NULL);
     assert(context != NULL);
 
-    // Trivial implementation
-
-    assert(vnode_isdir(vp));
-
-    mtmp = EmptyFSMountFromMount(vnode_mount(vp));
-    
-    // The implementation of <x-man-page://2/stat> requires that we support va_rdev, 
-    // even on vnodes that aren't device vnodes (as is the case for all our vnodes).
-     
-    VATTR_RETURN(vap, va_rdev,        0);
-    VATTR_RETURN(vap, va_nlink,       2);           // traditional for directories
-//  VATTR_RETURN(vap, va_total_size,  xxx);
-//  VATTR_RETURN(vap, va_total_alloc, xxx);
-    VATTR_RETURN(vap, va_data_size,   2 * sizeof(struct dirent));
-//  VATTR_RETURN(vap, va_data_alloc,  xxx);
-//  VATTR_RETURN(vap, va_iosize,      xxx);
-
-//  VATTR_RETURN(vap, va_uid,   xxx);
-//  VATTR_RETURN(vap, va_gid,   xxx);
-    VATTR_RETURN(vap, va_mode,  S_IFDIR | S_IRUSR | S_IXUSR | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
-//  VATTR_RETURN(vap, va_flags, xxx);
-//  VATTR_RETURN(vap, va_acl,   xxx);
-
-    // The only date we really keep track of is the creation date.  However, 
-    // the implementation of <x-man-page://2/stat> requires that we support 
-    // the other dates (that is, it does a VATTR_WANTED on these dates and 
-    // doesn't check that we returned them, or initialise them to a default 
-    // value).  I didn't want to lie to the system and just return dummy values, 
-    // and I also didn't want to get random numbers back for these dates.  
-    // Thus, I initialise the fields to default values but don't mark them 
-    // as supported.
-    
-    VATTR_RETURN(vap, va_create_time, mtmp->fAttr.f_create_time);
-//  VATTR_RETURN(vap, va_access_time, xxx);
-    vap->va_access_time = kYearZero;
-//  VATTR_RETURN(vap, va_modify_time, xxx);
-    vap->va_modify_time = kYearZero;
-//  VATTR_RETURN(vap, va_change_time, xxx);
-    vap->va_change_time = kYearZero;
-//  VATTR_RETURN(vap, va_backup_time, xxx);
-
-    VATTR_RETURN(vap, va_fileid,   2);
-//  VATTR_RETURN(vap, va_linkid,   xxx);
-//  VATTR_RETURN(vap, va_parentid, xxx);
-    VATTR_RETURN(vap, va_fsid,     mtmp->fBlockRDevNum);
-//  VATTR_RETURN(vap, va_filerev,  xxx);
-//  VATTR_RETURN(vap, va_gen,      xxx);
-
-//  VATTR_RETURN(vap, va_encoding, xxx);
-
-//  VATTR_RETURN(vap, va_type,  xxx);                   // handled by VFS
-//  VATTR_RETURN(vap, va_name,  xxx);                   // let VFS get this from f_mntonname
-//  VATTR_RETURN(vap, va_uuuid, xxx);
-//  VATTR_RETURN(vap, va_guuid, xxx);
+    FSNodeSetMapped(FSNodeFromVNode(vp), FALSE);
 
-//  VATTR_RETURN(vap, va_nchildren, xxx);
+    OpEndVNode(kEmptyFSOpVNOPMnomap, opStart, 0, vp, 0, 0);
 
     return 0;
 }
 
-static errno_t uiomove_atomic(void *addr, size_t size, uio_t uio)
-{
-    errno_t     err;
-    
-    if (size > uio_resid(uio)) {
-        err = ENOBUFS;
-    } else {
-        err = uiomove(addr, size, uio);
-    }
-    return err;
-}
-
-static errno_t VNOPReadDir(struct vnop_readdir_args *ap)
-    // Called by VFS to iterate the contents of a directory (most notably 
-    // by the implementation of <x-man-page://2/getdirentries>).
-    //
-    // vp is the directory we're iterating.  
-    //
-    // uio describes the buffer into which we copy the (struct dirent) values 
-    // that represent directory entries; it is discussed in detail below.
-    //
-    // flags contains two options bits, VNODE_READDIR_EXTENDED and 
-    // VNODE_READDIR_REQSEEKOFF, neither of which we support (they're only 
-    // needed if the file system is to be NFS exported).
-    //
-    // eofflagPtr, if not NULL, is a place to indicate that we've read the 
-    // last directory entry. 
-    //
-    // numdirententPtr, if not NULL, is a place to return a count of the 
-    // number of directory entries that we've returned.
-    //
-    // context identifies the calling process.
-    // 
-    // The hardest thing to understand about this entry point is the UIO 
-    // management.  There are two tricky aspects:
-    //
-    // o The UIO offset (accessed via uio_offset and uio_setoffset) 
-    //   determines the first directory item read.  This does not have 
-    //   to literally be an offset into the directory (such a usage makes 
-    //   sense on a UFS-style file system, but it makes no sense for a 
-    //   file system, like HFS Plus, which has no obvious directory offset). 
-    //   Rather, the semantics are as follows:
-    //
-    //   - A UIO offset of zero indicates that you should read from the 
-    //     start of the directory.
-    //
-    //   - You are responsible for setting the UIO offset to indicate how 
-    //     much you read.
-    //
-    //   - This offset value can then be passed back to you to continue 
-    //     reading at that offset.
-    //
-    //   So, if you have a file system where you can index directory items, 
-    //   it's perfectly reasonable for you to use an index as the UIO offset.
-    //   However, there are some gotchas:
-    //
-    //   - The UIO offset is an off_t, so you might think that you have 64 bits 
-    //     to play with.  However, this is truncated down to a long in the 
-    //     basep parameter of getdirentries, so you only have 32 bits (because 
-    //     a long is 32 bits for 32-bit client processes).
-    //
-    //   - Furthermore, you only /actually/ have 31 bits, because longs are 
-    //     signed, and if you return a negative offset then, if the client 
-    //     tries to lseek <x-man-page://2/lseek> to that offset (which is a 
-    //     legal usage pattern), lseek will fail (because it arbitrarily 
-    //     disallows negative offsets, even for directories).
-    //
-    //   - Remember that uiomove increments the UIO offset by the number of bytes 
-    //     that it copies.  Typically this is not useful behaviour for directories.  
-    //     In most cases you will want to explicitly set the UIO offset 
-    //     (using uio_setoffset) before you return.
-    //
-    //   - Because the offset can be set by untrusted programs (using lseek), 
-    //     you must be able to safely (that is, without kernel panicking!) 
-    //     reject illegal offsets.  If the client calls getdirentries after seeking 
-    //     to a bogus offset, you should return EINVAL.
-    //
-    //   - Depending on your volume format, it may be expensive to verify that 
-    //     the offset is valid.  In that case, you may want to cache the last 
-    //     offset that you returned in your FSNode.  There are two things to be careful
-    //     about here:
+static errno_t VNOPPagein(struct vnop_pagein_args *ap)
+    // Called by VM to read pages of a memory mapped file.
     //
-    //     - Make sure you invalidate the cache if you do something that changes whether 
-    //       an offset is valid.
+    // vp is the vnode of the file.
     //
-    //     - Be aware that you may need more than one cache entry, because multiple 
-    //       client may be reading the directory simultaneously.  Remember, while 
-    //       each client gets their own file descriptor, there's only one FSNode 
-    //       for any given on-disk directory.
+    // pl is the UPL (universal page list) of the pages to fill in.
     //
-    // o The UIO resid (residual ID, accessed by uio_resid and uio_setresid) 
-    //   indicates how much space is left in the user buffer described by the UIO.  
-    //   You must update this as you copy data out into that buffer (fortunately, 
-    //   the obvious copying routine, uiomove does this update for you).  The VFS 
-    //   layer uses this value to calculate the return value for the 
-    //   getdirentries system call.  That is, the return value of 
-    //   getdirentries is the original buffer size minus this UIO resid. 
-    //   So, if you completely fill the user's buffer (hence resid is 
-    //   0), getdirentries will return the original buffer size.  
-    //   On the other hand, if you return no data, resid will be equal 
-    //   to the buffer size, and getdirentries will return 0 (an indication 
-    //   that there are no more items in the directory).
+    // pl_offset is the offset within the UPL of the first page to fill in.
     //
-    //   It's also worth noting that there is no guarantee that the 
-    //   user's buffer size will be an even multiple of your dirent 
-    //   size (in fact, there's no requirement for you to have a 
-    //   fixed dirent size).  Thus, even after you've filled the user's 
-    //   buffer (you've copied out all of the entries that will fit), 
-    //   it's possible for resid to be positive.  Under no circumstances 
-    //   should you copy out a partial dirent.
+    // f_offset is the corresponding offset within the file.
     //
-    // o uiomove does not error if it only copies out a part of the data 
-    //   that you requested.  You should call uio_resid to ensure that 
-    //   there's enough space for the entire dirent before calling uiomove.
+    // size is the number of bytes to read.
     //
-    // Make sure you read <x-man-page://5/dirent> for information about 
-    // (struct dirent).  Specifically, this page defines constraints on 
-    // (struct dirent) to which you must comply.
-    // 
-    // On success, *eofflagPtr is TRUE if we've returned the last 
-    // entry in this directory.  The NFS server uses this information 
-    // to tag the reply packet that contains this entry with an EOF 
-    // marker; this avoids the need for the client to make another 
-    // call to confirm that it has read the entire directory.
+    // flags contains UPL_XXX flags.  The interesting one is UPL_NOCOMMIT, 
+    // which says that the caller will commit or abort the pages; otherwise 
+    // that's our job, even if we fail.
     //
-    // On success, *numdirentPtr is the number of dirent structures 
-    // that we read.
+    // context identifies the calling process.
     //
-    // Our implementation is very easy, simply because we only have one directory 
-    // (the root) and it only has two entries ("." and "..").  Note that we /don't/ 
-    // check for available space in the user's buffer; we just cook up the next 
-    // directory entry and allow our uio_move abstraction to error if there's not 
-    // enough space.  This is convenient for our code and, because of the trivial cost 
-    // to set up thisItem, not a performance problem.  If setting up thisItem was 
-    // expensive, or there was a fixed cost for accessing a directory that we could 
-    // amortise over multiple entries, it would be sensible to look at uio_resid to 
-    // see how many entries to generate up front.
+    // cluster_pagein does all the work (see "File Data"), including committing 
+    // or aborting the UPL.  A compressed file is paged in from the 
+    // decompression cache by FSNodePageinCompressed, which does the same.
 {
     errno_t         err;
     vnode_t         vp;
-    struct uio *    uio;
+    upl_t           pl;
+    vm_offset_t     plOffset;
+    off_t           fOffset;
+    size_t          size;
     int             flags;
-    int *           eofflagPtr;
-    int             eofflag;
-    int *           numdirentPtr;
-    int             numdirent;
-    vfs_context_t   context;
+    FSNode *        node;
+    uint64_t        fileSize;
+    uint64_t        opStart;
+
+    opStart = OpStart();
 
     // Unpack arguments
 
-    vp           = ap->a_vp;
-    uio          = ap->a_uio;
-    flags        = ap->a_flags;
-    eofflagPtr   = ap->a_eofflag;
-    numdirentPtr = ap->a_numdirent;
-    context      = ap->a_context;
+    vp       = ap->a_vp;
+    pl       = ap->a_pl;
+    plOffset = ap->a_pl_offset;
+    fOffset  = ap->a_f_offset;
+    size     = ap->a_size;
+    flags    = ap->a_flags;
 
     // Pre-conditions
-    
+
     assert( ValidVNode(vp) );
-    assert(uio != NULL);
-    AssertKnownFlags(flags, VNODE_READDIR_EXTENDED | VNODE_READDIR_REQSEEKOFF);
-    // assert(eofflag != NULL);     // it's fine for this to be NULL
-    // assert(numdirent == NULL);   // this is NULL in the typical case
-    assert(context != NULL);
-    
-    // An easy, but non-trivial, implementation
-    
-    assert(vnode_isdir(vp));
+    assert(pl != NULL);
 
-    eofflag = FALSE;
-    numdirent = 0;
-    
-    if ( (flags & VNODE_READDIR_EXTENDED) || (flags & VNODE_READDIR_REQSEEKOFF) ) {
-        // We only need to support these flags if we want to support being exported 
-        // by NFS.
-        err = EINVAL;
+    // VM only pages in regular files, but if something else gets here, we 
+    // still have to abort the pages, otherwise they stay busy forever.
+
+    if ( ! vnode_isreg(vp) ) {
+        err = EPERM;
+        if ( ! (flags & UPL_NOCOMMIT) ) {
+            (void) ubc_upl_abort_range(pl, plOffset, size, UPL_ABORT_ERROR | UPL_ABORT_FREE_ON_EMPTY);
+        }
     } else {
-        struct dirent   thisItem;
-        off_t           index;
-        
-        err = 0;
-        
-        // Set up thisItem.
-        
-        thisItem.d_fileno = 2;
-        thisItem.d_reclen = sizeof(thisItem);
-        thisItem.d_type = DT_DIR;
-        strcpy(thisItem.d_name, ".");
-        thisItem.d_namlen = strlen(".");
-        
-        // We set uio_offset to the directory item index * 7 to:
-        //
-        // o Illustrate the points about uio_offset usage in the comment above.
-        //   
-        // o Allow us to check that we're getting valid input.
-        // 
-        // However, be aware of the comments above about not trusting uio_offset; 
-        // the client can set it to an arbitrary value using lseek.
-        
-        assert( (uio_offset(uio) % 7) == 0);
+        node = FSNodeFromVNode(vp);
 
-        index = uio_offset(uio) / 7;
+        FSNodeLockShared(node);
+        fileSize = node->fSize;
+        FSNodeUnlockShared(node);
 
-        // If we're being asked for the first directory entry...
-        
-        if (index == 0) {
-            err = uiomove_atomic(&thisItem, sizeof(thisItem), uio);
-            if (err == 0) {
-                numdirent += 1;
-                index += 1;
-            }
+        if (node->fCompressedChunkSize != 0) {
+            err = FSNodePageinCompressed(node, pl, plOffset, fOffset, size, flags);
+        } else {
+            err = cluster_pagein(vp, pl, plOffset, fOffset, (int) size, (off_t) fileSize, flags);
         }
+    }
 
-        // If we're being asked for the second directory entry...
+    OpEndVNode(kEmptyFSOpVNOPPagein, opStart, err, vp, (uint64_t) fOffset, (uint64_t) size);
 
-        if ( (err == 0) && (index == 1) ) {
-            strcpy(thisItem.d_name, "..");
-            thisItem.d_namlen = strlen("..");
-            err = uiomove_atomic(&thisItem, sizeof(thisItem), uio);
-            if (err == 0) {
-                numdirent += 1;
-                index += 1;
-            }
-        }
+    return err;
+}
+
+static errno_t VNOPInactive(struct vnop_inactive_args *ap)
+    // Called by VFS when the last use count and I/O reference on a vnode go 
+    // away.  
+    //
+    // vp is the vnode that's gone inactive.
+    //
+    // context identifies the calling process.
+    //
+    // On a read-only volume there's nothing to do.  On a writable one, this 
+    // is where a file that's been removed (its link count is zero) finally 
+    // goes away: FSNodeFreeUnlinked frees it, and we ask VFS to reclaim the 
+    // vnode.  
+    // For any other file, we write everything that's dirty, so that the 
+    // vnode can be reclaimed without doing any I/O.  Either way, the file 
+    // comes off the volume's dirty list (see "Flusher Notes").
+    //
+    // VFS ignores any error we return, so we don't bother.
+{
+    errno_t             err;
+    vnode_t             vp;
+    vfs_context_t       context;
+    EmptyFSMount *      mtmp;
+    FSNode *            node;
+    boolean_t           unlinked;
+    uint64_t            opStart;
+
+    opStart = OpStart();
+
+    // Unpack arguments
+
+    vp      = ap->a_vp;
+    context = ap->a_context;
+
+    // Pre-conditions
+
+    assert( ValidVNode(vp) );
+    assert(context != NULL);
+
+    node = FSNodeFromVNode(vp);
+    mtmp = node->fMount;
+
+    err = 0;
+    if (mtmp->fWritable) {
         
-        // If we failed because there wasn't enough space in the user's buffer, 
-        // just swallow the error.  This will result getdirentries returning 
-        // less than the buffer size (possibly even zero), and the caller is 
-        // expected to cope with that.
+        // A file whose record we've already freed has fMode set to zero, 
+        // so that we don't free it twice if the vnode goes inactive again 
+        // before it's reclaimed.
         
-        if (err == ENOBUFS) {
-            err = 0;
+        FSNodeLockShared(node);
+        unlinked = (node->fLinkCount == 0) && (node->fMode != 0);
+        FSNodeUnlockShared(node);
+
+        if ( ! unlinked ) {
+            err = FSNodeFlush(vp);
+            FSNodeDirtyRemove(node);
+        } else {
+            err = FSNodeFreeUnlinked(vp);
+            (void) vnode_recycle(vp);
         }
-        
-        // Update uio_offset.
-        
-        uio_setoffset(uio, index * 7);
-        
-        // Determine if we're at the end of the directory.
-        
-        eofflag = (index > 1);
     }
 
-    // Copy out any information that's requested by the caller.
-    
-    if (eofflagPtr != NULL) {
-        *eofflagPtr = eofflag;
-    }
-    if (numdirentPtr != NULL) {
-        *numdirentPtr = numdirent;
-    }
+    OpEndVNode(kEmptyFSOpVNOPInactive, opStart, err, vp, 0, 0);
 
-    return err;
+    return 0;
 }
 
 static errno_t VNOPReclaim(struct vnop_reclaim_args *ap)
@@ -1320,14 +13280,18 @@ static errno_t VNOPReclaim(struct vnop_reclaim_args *ap)
     // IMPORTANT:
     // If VNOPReclaim fails, the system panics.
     //
-    // In our implementation this is relatively easy because we only support one 
-    // vnode.  Still, there are some tricky race conditions to ponder.  In a proper 
-    // file system, this entry point would have to be coordinated with the FSNode 
-    // hash layer.
+    // In our implementation the real work is done by the FSNode hash layer, which 
+    // has to coordinate with threads that are concurrently looking up the same 
+    // object (see FSNodeDetachVNode).
 {
     vnode_t         vp;
     vfs_context_t   context;
+    FSNode *        node;
     EmptyFSMount *  mtmp;
+    uint64_t        fileNum;
+    uint64_t        opStart;
+
+    opStart = OpStart();
 
     // Unpack arguments
 
@@ -1340,11 +13304,32 @@ static errno_t VNOPReclaim(struct vnop_reclaim_args *ap)
     assert( ValidVNode(vp) );
     assert(context != NULL);
 
+    // Detaching the vnode can free the FSNode, so grab what we need for 
+    // the trace now.
+    
+    node    = FSNodeFromVNode(vp);
+    mtmp    = node->fMount;
+    fileNum = node->fFileNum;
+
+    // On a forced unmount, we can be reclaimed while still mapped, and 
+    // VNOPMnomap will never be called.  See "Memory Mapping Notes".
+
+    FSNodeSetMapped(node, FALSE);
+
+    // VNOPInactive normally takes the node off the dirty list, but a forced 
+    // unmount can reclaim a vnode without it having gone inactive cleanly.  
+    // Once the vnode is gone the flusher has no way to get at the node, so 
+    // the node must not stay on the list.
+
+    if (mtmp->fWritable) {
+        FSNodeDirtyRemove(node);
+    }
+
     // Do this at as 'FSNode hash' layer.
 
-    mtmp = EmptyFSMountFromMount(vnode_mount(vp));    
-    
-    EmptyFSMountDetachRootVNode(mtmp, vp);
+    FSNodeDetachVNode(node, vp);
+
+    OpEnd(kEmptyFSOpVNOPReclaim, opStart, 0, mtmp, fileNum, 0, 0);
 
     return 0;
 }
@@ -1397,6 +13382,8 @@ static errno_t VFSOPMount(mount_t mp, vnode_t devvp, user_addr_t data, vfs_conte
     int                 junk;
     EmptyFSMountArgs    args;
     EmptyFSMount *      mtmp;
+    boolean_t           force;
+    boolean_t           journalled;
     
     // Pre-conditions
 
@@ -1432,7 +13419,8 @@ static errno_t VFSOPMount(mount_t mp, vnode_t devvp, user_addr_t data, vfs_conte
             err = ENOMEM;
         } else {
             memset(mtmp, 0, sizeof(*mtmp));
-            mtmp->fMagic = kEmptyFSMountMagic;
+            mtmp->fMagic      = kEmptyFSMountMagic;
+            mtmp->fMountPoint = mp;             // so that VFSOPUnmount can clean up if we fail
             
             vfs_setfsprivate(mp, mtmp);
         }
@@ -1452,29 +13440,109 @@ static errno_t VFSOPMount(mount_t mp, vnode_t devvp, user_addr_t data, vfs_conte
             mtmp->fBlockDevVNode = devvp;
             mtmp->fBlockRDevNum  = vnode_specrdev(devvp);
         }
+        
+        // Read the superblock.  This fails if the volume isn't an EmptyFS volume.
+        
+        if (err == 0) {
+            err = EmptyFSMountReadSuperblock(mtmp, context);
+        }
 
+        // Decide whether the volume is writable.  It is if the mount is 
+        // read/write and the volume has no read-only compatible features 
+        // that we don't understand; otherwise we quietly mount it read-only, 
+        // as other file systems do.  We only write the free counts to the 
+        // superblock on unmount, so if the volume wasn't cleanly unmounted 
+        // they're wrong.  We refuse to mount it read/write unless the user 
+        // forces us to, in which case we recount them from the bitmap and 
+        // the file table.  A read-only mount doesn't care; statfs is just 
+        // a bit off.
+        //
+        // A volume with a journal doesn't need any of that.  Replaying the 
+        // journal (in EmptyFSMountJournalInit) brings the metadata, the 
+        // counts and the orphan list up to date, and it only has to read 
+        // the journal, so it takes time in proportion to the size of the 
+        // journal, not the size of the volume.  A read-only mount can't 
+        // replay the journal, so it sees the metadata as of the last 
+        // checkpoint, which is consistent, but may be out of date.
+        //
+        // We also mount a volume with compressed files read-only.  We can 
+        // read them (see "Decompression Cache"), but our write path allocates 
+        // blocks as pages are written back, one block per block of data, and 
+        // has no way to compress a chunk as it goes.  Such volumes are built 
+        // by mkimage_EmptyFS, and are meant to be read-only anyway.
+        
+        if (err == 0) {
+            force = (vfs_flags(mp) & MNT_FORCE) != 0;
+            journalled = (mtmp->fSuperblock.fROCompatFeatures & kEmptyFSROCompatJournal) != 0;
+            mtmp->fWritable = 
+                   ! vfs_isrdonly(mp) 
+                && ( (mtmp->fSuperblock.fROCompatFeatures & ~kEmptyFSROCompatFeaturesKnown) == 0 )
+                && ! (mtmp->fSuperblock.fIncompatFeatures & kEmptyFSIncompatCompression);
+            if ( mtmp->fWritable && journalled ) {
+                err = EmptyFSMountJournalInit(mtmp);
+            } else if ( journalled && ! (mtmp->fSuperblock.fState & kEmptyFSStateClean) ) {
+                printf("EmptyFS:VFSOPMount: volume not cleanly unmounted; mount read/write to replay its journal\n");
+            } else if ( mtmp->fWritable && ! (mtmp->fSuperblock.fState & kEmptyFSStateClean) ) {
+                if (force) {
+                    printf("EmptyFS:VFSOPMount: volume not cleanly unmounted, recounting\n");
+                    err = EmptyFSMountRecount(mtmp);
+                } else {
+                    printf("EmptyFS:VFSOPMount: volume not cleanly unmounted; use -f to mount read/write\n");
+                    err = EROFS;
+                }
+            }
+        }
         if (err == 0) {
-            mtmp->fRootMutex = lck_mtx_alloc_init(gLockGroup, NULL);
-            if (mtmp->fRootMutex == NULL) {
+            err = EmptyFSMountCountersInit(mtmp);
+        }
+        
+        // Set up the things that only a writable volume needs, and mark the 
+        // volume as in use, so that a crash leaves it marked as not cleanly 
+        // unmounted.  The flusher has to wait until the volume is ready.
+        
+        if ( (err == 0) && mtmp->fWritable ) {
+            mtmp->fFreeFileRecords = mtmp->fSuperblock.fFreeFileCount;
+            mtmp->fAllocLock  = lck_mtx_alloc_init(gLockGroup, LCK_ATTR_NULL);
+            mtmp->fRecordLock = lck_mtx_alloc_init(gLockGroup, LCK_ATTR_NULL);
+            mtmp->fDirtyLock  = lck_mtx_alloc_init(gLockGroup, LCK_ATTR_NULL);
+            if ( (mtmp->fAllocLock == NULL) || (mtmp->fRecordLock == NULL) || (mtmp->fDirtyLock == NULL) ) {
                 err = ENOMEM;
             }
         }
+        if ( (err == 0) && mtmp->fWritable ) {
+            err = EmptyFSMountOrphanLoad(mtmp);
+        }
+        if ( (err == 0) && mtmp->fWritable ) {
+            err = EmptyFSMountAllocInit(mtmp);
+        }
+        if ( (err == 0) && mtmp->fWritable ) {
+            err = EmptyFSMountWriteSuperblock(mtmp, FALSE);
+        }
+        if ( (err == 0) && mtmp->fWritable ) {
+            err = EmptyFSMountFlusherStart(mtmp);
+        }
 
         // Then do the stuff that can't fail.
         
         // IMPORTANT
-        // EmptyFSInitAttr reads mtmp->fBlockRDevNum, so you must initialise it before 
-        // calling EmptyFSInitAttr.
+        // EmptyFSInitAttr reads mtmp->fBlockRDevNum and the superblock, so you must 
+        // initialise them before calling EmptyFSInitAttr.
 
         if (err == 0) {
-            mtmp->fMountPoint = mp;
             mtmp->fDebugLevel = args.fDebugLevel;
-            strncpy(mtmp->fVolumeName, "EmptyFS", sizeof(mtmp->fVolumeName));
-            mtmp->fVolumeName[sizeof(mtmp->fVolumeName) - 1] = 0;
+            TraceMountStart(mtmp);
             EmptyFSInitAttr(mtmp);
-            assert( ! mtmp->fRootAttaching);
-            assert( ! mtmp->fRootWaiting);
-            assert(mtmp->fRootVNode == NULL);
+            assert(mtmp->fFSNodeCount == 0);
+            assert(mtmp->fRootVNodeHint == NULL);
+        }
+
+        // Finally, free any files that were removed while they were open, 
+        // and were still open when the system crashed.  This comes last 
+        // because it needs their vnodes.  If it fails, the files stay on 
+        // the orphan list, and the mount goes ahead.
+
+        if ( (err == 0) && mtmp->fWritable && (mtmp->fOrphanFileNum != 0) ) {
+            EmptyFSMountOrphanReclaim(mtmp);
         }
     }
     
@@ -1499,24 +13567,30 @@ static errno_t VFSOPMount(mount_t mp, vnode_t devvp, user_addr_t data, vfs_conte
     
     if (err == 0) {
         struct vfsstatfs *  sbp;
+        uint64_t            counters[kVolumeCounterCount];
         
         sbp = vfs_statfs(mp);
         assert(sbp != NULL);
         assert( strcmp(sbp->f_fstypename, "EmptyFS") == 0 );
         
+        EmptyFSMountGetCounters(mtmp, counters);
+
         sbp->f_bsize  = mtmp->fAttr.f_bsize;
         sbp->f_iosize = mtmp->fAttr.f_iosize;
         sbp->f_blocks = mtmp->fAttr.f_blocks;
-        sbp->f_bfree  = mtmp->fAttr.f_bfree;
-        sbp->f_bavail = mtmp->fAttr.f_bavail;
-        sbp->f_bused  = mtmp->fAttr.f_bused;
+        sbp->f_bfree  = counters[kVolumeCounterFreeBlocks];
+        sbp->f_bavail = counters[kVolumeCounterFreeBlocks];
+        sbp->f_bused  = mtmp->fAttr.f_blocks - counters[kVolumeCounterFreeBlocks];
         sbp->f_files  = mtmp->fAttr.f_files;
-        sbp->f_ffree  = mtmp->fAttr.f_ffree;
+        sbp->f_ffree  = counters[kVolumeCounterFreeFiles];
         sbp->f_fsid   = mtmp->fAttr.f_fsid;
     }
     
+    if ( (mtmp == NULL) || ! mtmp->fWritable ) {
+        vfs_setflags(mp, MNT_RDONLY);
+    }
     vfs_setflags(mp, 0
-        | MNT_RDONLY
+//      | MNT_RDONLY        // set above, unless the volume is writable
 //      | MNT_SYNCHRONOUS   
         | MNT_NOEXEC
         | MNT_NOSUID
@@ -1526,7 +13600,7 @@ static errno_t VFSOPMount(mount_t mp, vnode_t devvp, user_addr_t data, vfs_conte
 //      | MNT_DONTBROWSE    
         | MNT_IGNORE_OWNERSHIP
 //      | MNT_AUTOMOUNTED 
-//      | MNT_JOURNALED   
+//      | MNT_JOURNALED     // set below, if the volume has an active journal
 //      | MNT_NOUSERXATTR   
 //      | MNT_DEFWRITE  
 //      | MNT_EXPORTED  
@@ -1536,6 +13610,10 @@ static errno_t VFSOPMount(mount_t mp, vnode_t devvp, user_addr_t data, vfs_conte
 //      | MNT_DOVOLFS
     );
 
+    if ( (mtmp != NULL) && (mtmp->fJournal != NULL) ) {
+        vfs_setflags(mp, MNT_JOURNALED);
+    }
+
     // Don't think you need to call vnode_setmountedon because the system does it for you.
     
     if (err == 0) {
@@ -1603,9 +13681,11 @@ static errno_t VFSOPUnmount(mount_t mp, int mntflags, vfs_context_t context)
     // context identifies the calling process.
 {
     int             err;
+    int             junk;
     boolean_t       forcedUnmount;
     EmptyFSMount *  mtmp;
     int             flushFlags;
+    boolean_t       writable;
     
     // Pre-conditions
     
@@ -1622,6 +13702,22 @@ static errno_t VFSOPUnmount(mount_t mp, int mntflags, vfs_context_t context)
         flushFlags = 0;
     }
     
+    // On a writable volume, stop the flusher first, so that it's not holding 
+    // I/O references on our vnodes while vflush is trying to get rid of them. 
+    // Each vnode writes its own data and record as it goes inactive.  If the 
+    // unmount fails, we start the flusher again.  (If VFSOPMount is cleaning 
+    // up, the flusher may never have started, which is fine.)
+    
+    mtmp = NULL;
+    writable = FALSE;
+    if ( vfs_fsprivate(mp) != NULL ) {
+        mtmp = EmptyFSMountFromMount(mp);
+        writable = mtmp->fWritable;
+    }
+    if (writable) {
+        EmptyFSMountFlusherStop(mtmp);
+    }
+    
     // Prior to calling us, VFS has flushed all regular vnodes (that is, it called 
     // vflush with SKIPSWAP, SKIPSYSTEM, and SKIPROOT set).  Now we have to flush 
     // all vnodes, including the root.  If flushFlags is FORCECLOSE, this is a 
@@ -1630,6 +13726,10 @@ static errno_t VFSOPUnmount(mount_t mp, int mntflags, vfs_context_t context)
     // mount.
     
     err = vflush(mp, NULL, flushFlags);
+    if ( (err != 0) && writable && (mtmp->fDirtyLock != NULL) ) {
+        junk = EmptyFSMountFlusherStart(mtmp);
+        assert(junk == 0);
+    }
 
     // Clean up the file system specific data attached to the mount.
     
@@ -1639,8 +13739,46 @@ static errno_t VFSOPUnmount(mount_t mp, int mntflags, vfs_context_t context)
         // valid file system specific mount record.  We skip the clean up if 
         // that happens.
         
-        if ( vfs_fsprivate(mp) != NULL ) {
-            mtmp = EmptyFSMountFromMount(mp);
+        if (mtmp != NULL) {
+            
+            // Write back the metadata and then, if we got that far in 
+            // VFSOPMount, mark the volume as clean.  There's no way to fail 
+            // an unmount at this point, so if this goes wrong the volume is 
+            // just left marked as needing a check.  On a journalled volume, 
+            // commit and checkpoint first, which empties the journal.  If 
+            // that fails, we leave the volume marked as unclean, so that the 
+            // next mount replays the journal.
+            
+            if ( writable && (mtmp->fDirtyLock != NULL) ) {
+                assert(mtmp->fDirtyHead == NULL);
+                junk = EmptyFSMountJournalCommit(mtmp, 0);
+                if (junk == 0) {
+                    junk = EmptyFSMountJournalCheckpoint(mtmp);
+                }
+                buf_flushdirtyblks(mtmp->fBlockDevVNode, TRUE, BUF_SKIP_LOCKED, "EmptyFS:unmount");
+                if (junk == 0) {
+                    junk = EmptyFSMountWriteSuperblock(mtmp, TRUE);
+                }
+                if (junk != 0) {
+                    printf("EmptyFS:VFSOPUnmount: superblock write failed with error %d\n", junk);
+                }
+            }
+            EmptyFSMountJournalTerm(mtmp);
+            EmptyFSMountOrphanTerm(mtmp);
+            EmptyFSMountAllocTerm(mtmp);
+            DecompCachePurge(mtmp);
+            if (mtmp->fAllocLock != NULL) {
+                lck_mtx_free(mtmp->fAllocLock, gLockGroup);
+                mtmp->fAllocLock = NULL;
+            }
+            if (mtmp->fRecordLock != NULL) {
+                lck_mtx_free(mtmp->fRecordLock, gLockGroup);
+                mtmp->fRecordLock = NULL;
+            }
+            if (mtmp->fDirtyLock != NULL) {
+                lck_mtx_free(mtmp->fDirtyLock, gLockGroup);
+                mtmp->fDirtyLock = NULL;
+            }
             
             if (mtmp->fBlockDevVNode != NULL) {         // release our reference, if any
                 vnode_rele(mtmp->fBlockDevVNode);
@@ -1648,20 +13786,18 @@ static errno_t VFSOPUnmount(mount_t mp, int mntflags, vfs_context_t context)
                 mtmp->fBlockRDevNum = 0;
             }
             
-            // Prior to calling us, VFS ensures that no one is running within 
-            // our file system.  Thus, neither of these flags should be set.
-            
-            assert( ! mtmp->fRootAttaching);
-            assert( ! mtmp->fRootWaiting);
+            // The vflush, above, forces VFS to reclaim any vnodes on our volume, 
+            // and reclaiming a vnode frees its FSNode.  Also, prior to calling us, 
+            // VFS ensures that no one is running within our file system, so no one 
+            // can be in the middle of attaching a vnode.  Thus, there should be no 
+            // FSNodes left for this volume.
             
-            // The vflush, above, forces VFS to reclaim any vnodes on our volume. 
-            // Thus, fRootVNode should be NULL.
-            
-            assert(mtmp->fRootVNode == NULL);
-            
-            if (mtmp->fRootMutex != NULL) {
-                lck_mtx_free(mtmp->fRootMutex, gLockGroup);
-            }
+            assert(mtmp->fFSNodeCount == 0);
+            assert(mtmp->fMappedCount == 0);
+            assert(mtmp->fRootVNodeHint == NULL);
+
+            TraceMountStop(mtmp);
+            EmptyFSMountCountersTerm(mtmp);
 
             mtmp->fMagic = kEmptyFSMountBadMagic;
             
@@ -1684,24 +13820,32 @@ static errno_t VFSOPRoot(mount_t mp, struct vnode **vpp, vfs_context_t context)
     // 
     // context identifies the calling process.
     //
-    // Our implementation is fairly simple, 
+    // Our implementation tries the lock-free fast path first and, if that 
+    // doesn't work out, looks up the root in the FSNode hash like any other 
+    // object.
 {
     errno_t         err;
     vnode_t         vn;
     EmptyFSMount *  mtmp;
+    uint64_t        opStart;
     
+    opStart = OpStart();
+
     // Pre-conditions
 
     assert(mp != NULL);
     assert(vpp != NULL);
     assert(context != NULL);
 
-    // Trivial implementation
+    // Simple implementation
     
     mtmp = EmptyFSMountFromMount(mp);
 
     vn = NULL;
-    err = EmptyFSMountGetRootVNodeCreatingIfNecessary(mtmp, &vn);
+    err = EmptyFSMountGetRootVNodeFast(mtmp, &vn);
+    if (err == EAGAIN) {
+        err = FSNodeGetVNodeCreatingIfNecessary(mtmp, kEmptyFSRootFileNum, NULL, NULL, &vn);
+    }
 
     // Under all circumstances we set *vpp to vn.  That way, we satisfy the 
     // post-condition, regardless of what VFS uses as the initial value for 
@@ -1713,6 +13857,8 @@ static errno_t VFSOPRoot(mount_t mp, struct vnode **vpp, vfs_context_t context)
     
     assert( (err != 0) || (*vpp != NULL) );
 
+    OpEnd(kEmptyFSOpVFSOPRoot, opStart, err, mtmp, kEmptyFSRootFileNum, 0, 0);
+
     return err;
 }
 
@@ -1730,9 +13876,18 @@ static errno_t VFSOPGetattr(mount_t mp, struct vfs_attr *attr, vfs_context_t con
     // (VFSATTR_RETURN), and b) see if you need to return a value (VFSATTR_IS_ACTIVE).
     // 
     // Our implementation is trivial because we pre-calculated all of the file 
-    // system attributes in a convenient form.
+    // system attributes that don't change in a convenient form.  The ones 
+    // that do change come from the volume counters, which we can read without 
+    // taking any locks (see "Volume Counter Notes"), so this is always fast 
+    // (as promised by VOL_CAP_FMT_FAST_STATFS).  We only read the counters if 
+    // the caller wants one of the attributes that depend on them.
 {
     EmptyFSMount *  mtmp;
+    uint64_t        counters[kVolumeCounterCount];
+    uint64_t        objCount;
+    uint64_t        opStart;
+
+    opStart = OpStart();
 
     // Pre-conditions
     
@@ -1744,22 +13899,42 @@ static errno_t VFSOPGetattr(mount_t mp, struct vfs_attr *attr, vfs_context_t con
     
     mtmp = EmptyFSMountFromMount(mp);
     
-    VFSATTR_RETURN(attr, f_objcount,     mtmp->fAttr.f_objcount);
-    VFSATTR_RETURN(attr, f_filecount,    mtmp->fAttr.f_filecount);
-    VFSATTR_RETURN(attr, f_dircount,     mtmp->fAttr.f_dircount);
+    if (attr->f_active & kVolumeCounterAttributes) {
+        EmptyFSMountGetCounters(mtmp, counters);
+        
+        // If the counters are changing, we can see them in an inconsistent 
+        // state (for example, a directory that's been counted but whose file 
+        // record hasn't), so make sure that the results are at least 
+        // self-consistent.
+        
+        if (counters[kVolumeCounterFreeBlocks] > mtmp->fAttr.f_blocks) {
+            counters[kVolumeCounterFreeBlocks] = mtmp->fAttr.f_blocks;
+        }
+        if (counters[kVolumeCounterFreeFiles] > mtmp->fAttr.f_files) {
+            counters[kVolumeCounterFreeFiles] = mtmp->fAttr.f_files;
+        }
+        objCount = mtmp->fAttr.f_files - counters[kVolumeCounterFreeFiles];
+        if (objCount < counters[kVolumeCounterDirectories]) {
+            objCount = counters[kVolumeCounterDirectories];
+        }
+        VFSATTR_RETURN(attr, f_objcount,     objCount);
+        VFSATTR_RETURN(attr, f_filecount,    objCount - counters[kVolumeCounterDirectories]);
+        VFSATTR_RETURN(attr, f_dircount,     counters[kVolumeCounterDirectories]);
+        VFSATTR_RETURN(attr, f_bfree,        counters[kVolumeCounterFreeBlocks]);
+        VFSATTR_RETURN(attr, f_bavail,       counters[kVolumeCounterFreeBlocks]);
+        VFSATTR_RETURN(attr, f_bused,        mtmp->fAttr.f_blocks - counters[kVolumeCounterFreeBlocks]);
+        VFSATTR_RETURN(attr, f_ffree,        counters[kVolumeCounterFreeFiles]);
+    }
     VFSATTR_RETURN(attr, f_maxobjcount,  mtmp->fAttr.f_maxobjcount);
     VFSATTR_RETURN(attr, f_bsize,        mtmp->fAttr.f_bsize);
     VFSATTR_RETURN(attr, f_iosize,       mtmp->fAttr.f_iosize);
     VFSATTR_RETURN(attr, f_blocks,       mtmp->fAttr.f_blocks);
-    VFSATTR_RETURN(attr, f_bfree,        mtmp->fAttr.f_bfree);
-    VFSATTR_RETURN(attr, f_bavail,       mtmp->fAttr.f_bavail);
-    VFSATTR_RETURN(attr, f_bused,        mtmp->fAttr.f_bused);
     VFSATTR_RETURN(attr, f_files,        mtmp->fAttr.f_files);
-    VFSATTR_RETURN(attr, f_ffree,        mtmp->fAttr.f_ffree);
     VFSATTR_RETURN(attr, f_fsid,         mtmp->fAttr.f_fsid);
     VFSATTR_RETURN(attr, f_capabilities, mtmp->fAttr.f_capabilities);
     VFSATTR_RETURN(attr, f_attributes,   mtmp->fAttr.f_attributes);
     VFSATTR_RETURN(attr, f_create_time,  mtmp->fAttr.f_create_time);
+    VFSATTR_RETURN(attr, f_modify_time,  mtmp->fAttr.f_modify_time);
     VFSATTR_RETURN(attr, f_fssubtype,    mtmp->fAttr.f_fssubtype);
     
     if (VFSATTR_IS_ACTIVE(attr, f_vol_name) ) {
@@ -1768,9 +13943,395 @@ static errno_t VFSOPGetattr(mount_t mp, struct vfs_attr *attr, vfs_context_t con
         VFSATTR_SET_SUPPORTED(attr, f_vol_name);
     }
     
+    OpEnd(kEmptyFSOpVFSOPGetattr, opStart, 0, mtmp, 0, attr->f_active, 0);
+
     return 0;
 }
 
+static errno_t VFSOPSync(mount_t mp, int waitfor, vfs_context_t context)
+    // Called by VFS to write all of the volume's dirty data and metadata to 
+    // disk (this is called by <x-man-page://2/sync>, periodically by the 
+    // system, and before an unmount).
+    //
+    // mp is a reference to the kernel structure tracking this instance of the 
+    // file system.
+    //
+    // waitfor is MNT_WAIT if we must not return until the writes are done, 
+    // or MNT_NOWAIT if we can just start them.
+    //
+    // context identifies the calling process.
+    //
+    // We do what the flusher does, now, and then write the dirty metadata 
+    // buffers.  We don't update the superblock's free counts, which we only 
+    // write at unmount (see VFSOPMount).  On a read-only volume there's 
+    // nothing to do.
+    //
+    // On a journalled volume, committing the running transaction is what 
+    // makes the metadata durable; the buffers that it changed can't be 
+    // written until it's committed.  For MNT_WAIT, we also checkpoint, so 
+    // that the metadata is home, and a crash has nothing to replay.
+{
+    EmptyFSMount *  mtmp;
+    uint32_t        flushed;
+    uint64_t        opStart;
+
+    opStart = OpStart();
+
+    // Pre-conditions
+
+    assert(mp != NULL);
+    assert(context != NULL);
+
+    mtmp = EmptyFSMountFromMount(mp);
+
+    flushed = 0;
+    if (mtmp->fWritable) {
+        flushed = EmptyFSMountFlushDirty(mtmp);
+        (void) EmptyFSMountJournalCommit(mtmp, 0);
+        if (waitfor == MNT_WAIT) {
+            (void) EmptyFSMountJournalCheckpoint(mtmp);
+        }
+        buf_flushdirtyblks(mtmp->fBlockDevVNode, (waitfor == MNT_WAIT), BUF_SKIP_LOCKED, "EmptyFS:sync");
+    }
+
+    OpEnd(kEmptyFSOpVFSOPSync, opStart, 0, mtmp, 0, (uint64_t) waitfor, flushed);
+
+    return 0;
+}
+
+// EmptyFSFileHandle is the file handle we give to the NFS server.  It's 
+// opaque to everyone but us, so we keep it as compact as possible: the 
+// file number identifies the object and the generation number lets us 
+// detect that the file record has been reused since the handle was issued 
+// (in which case the handle is stale).  We store the fields little endian 
+// so that the handle means the same thing regardless of the byte order of 
+// the machine that exports the volume.
+
+struct EmptyFSFileHandle {
+    uint32_t    fFileNum;
+    uint32_t    fGeneration;
+};
+typedef struct EmptyFSFileHandle EmptyFSFileHandle;
+
+static errno_t EmptyFSMountGetVNodeByFileNum(EmptyFSMount *mtmp, uint64_t fileNum, vnode_t *vnPtr)
+    // Returns the vnode for the file system object whose file number is 
+    // fileNum, for VFSOPVget and VFSOPFhtovp.  fileNum comes from outside 
+    // the file system, so we check that it's in range.  Returns ENOENT if 
+    // there's no such object.
+{
+    errno_t     err;
+    vnode_t     vn;
+
+    assert(mtmp != NULL);
+    assert(vnPtr != NULL);
+
+    vn = NULL;
+    if (fileNum == kEmptyFSRootFileNum) {
+        err = EmptyFSMountGetRootVNodeFast(mtmp, &vn);
+    } else {
+        err = EAGAIN;
+    }
+    if (err == EAGAIN) {
+        if ( (fileNum < kEmptyFSFirstFileNum) || (fileNum > UINT32_MAX) ) {
+            err = ENOENT;
+        } else {
+            err = FSNodeGetVNodeCreatingIfNecessary(mtmp, fileNum, NULL, NULL, &vn);
+        }
+    }
+    *vnPtr = vn;
+
+    assert( (err != 0) || (*vnPtr != NULL) );
+
+    return err;
+}
+
+static errno_t VFSOPVget(mount_t mp, ino64_t ino, struct vnode **vpp, vfs_context_t context)
+    // Called by VFS to get the vnode for a file system object given its 
+    // file number.  The NFS server uses this to resolve the d_ino values 
+    // returned by an extended readdir (for READDIRPLUS) without a path walk.
+    //
+    // mp is a reference to the kernel structure tracking this instance of the 
+    // file system.
+    //
+    // ino is the file number of the object.
+    //
+    // vpp is a pointer to a vnode reference.  On success, we must set this to 
+    // the vnode.  We must have an I/O reference on that vnode, and it's the 
+    // caller's responsibility to release it.
+    // 
+    // context identifies the calling process.
+    //
+    // Our implementation goes straight to the FSNode hash, which either finds 
+    // the FSNode or loads it from the file table.  We can't pass a directory 
+    // and name along to vnode_create, so the vnode doesn't get a name cache 
+    // entry; that's fine because NFS works entirely in terms of handles.
+{
+    errno_t         err;
+    vnode_t         vn;
+    EmptyFSMount *  mtmp;
+    uint64_t        opStart;
+    
+    opStart = OpStart();
+
+    // Pre-conditions
+
+    assert(mp != NULL);
+    assert(vpp != NULL);
+    assert(context != NULL);
+
+    // Simple implementation
+    
+    mtmp = EmptyFSMountFromMount(mp);
+
+    err = EmptyFSMountGetVNodeByFileNum(mtmp, (uint64_t) ino, &vn);
+
+    // Under all circumstances we set *vpp to vn.  That way, we satisfy the 
+    // post-condition, regardless of what VFS uses as the initial value for 
+    // *vpp.
+
+    *vpp = vn;
+
+    // Post-conditions
+    
+    assert( (err != 0) || (*vpp != NULL) );
+
+    OpEnd(kEmptyFSOpVFSOPVget, opStart, err, mtmp, (uint64_t) ino, 0, 0);
+
+    return err;
+}
+
+static errno_t VFSOPFhtovp(mount_t mp, int fhlen, unsigned char *fhp, struct vnode **vpp, vfs_context_t context)
+    // Called by VFS (on behalf of the NFS server) to get the vnode for a 
+    // file handle that we previously returned from VFSOPVptofh.
+    //
+    // mp is a reference to the kernel structure tracking this instance of the 
+    // file system.
+    //
+    // fhlen and fhp describe the file handle.  It came over the wire, so we 
+    // can't trust any of it.
+    //
+    // vpp is a pointer to a vnode reference.  On success, we must set this to 
+    // the vnode.  We must have an I/O reference on that vnode, and it's the 
+    // caller's responsibility to release it.
+    // 
+    // context identifies the calling process.
+    //
+    // If the file no longer exists, or its file record has been reused for 
+    // some other file (which we detect by the generation number changing), we 
+    // return ESTALE, which the NFS server passes on to the client.
+{
+    errno_t             err;
+    vnode_t             vn;
+    EmptyFSFileHandle   handle;
+    uint64_t            opStart;
+    
+    opStart = OpStart();
+
+    // Pre-conditions
+
+    assert(mp != NULL);
+    assert(fhp != NULL);
+    assert(vpp != NULL);
+    assert(context != NULL);
+
+    vn = NULL;
+    memset(&handle, 0, sizeof(handle));
+    if (fhlen != sizeof(handle)) {
+        err = EINVAL;
+    } else {
+        memcpy(&handle, fhp, sizeof(handle));
+        handle.fFileNum    = EmptyFSSwapLE32(handle.fFileNum);
+        handle.fGeneration = EmptyFSSwapLE32(handle.fGeneration);
+
+        err = EmptyFSMountGetVNodeByFileNum(EmptyFSMountFromMount(mp), handle.fFileNum, &vn);
+        if (err == ENOENT) {
+            err = ESTALE;
+        }
+    }
+    if ( (err == 0) && (FSNodeFromVNode(vn)->fGeneration != handle.fGeneration) ) {
+        vnode_put(vn);
+        vn = NULL;
+        err = ESTALE;
+    }
+
+    *vpp = vn;
+
+    // Post-conditions
+    
+    assert( (err != 0) || (*vpp != NULL) );
+
+    OpEnd(kEmptyFSOpVFSOPFhtovp, opStart, err, EmptyFSMountFromMount(mp), handle.fFileNum, handle.fGeneration, 0);
+
+    return err;
+}
+
+static errno_t VFSOPVptofh(struct vnode *vp, int *fhlenp, unsigned char *fhp, vfs_context_t context)
+    // Called by VFS (on behalf of the NFS server) to get a file handle for 
+    // a vnode.
+    //
+    // vp is the vnode in question.
+    //
+    // fhlenp points to the size of the buffer pointed to by fhp.  On success, 
+    // we must set *fhlenp to the size of the handle that we put in that buffer.
+    // 
+    // context identifies the calling process.
+    //
+    // The handle is an EmptyFSFileHandle.  It doesn't identify the volume; VFS 
+    // takes care of that by wrapping it in an fhandle that includes the fsid.
+{
+    errno_t             err;
+    FSNode *            node;
+    EmptyFSFileHandle   handle;
+    uint64_t            opStart;
+    
+    opStart = OpStart();
+
+    // Pre-conditions
+
+    assert(vp != NULL);
+    assert(fhlenp != NULL);
+    assert(fhp != NULL);
+    assert(context != NULL);
+
+    // Simple implementation
+    
+    if (*fhlenp < (int) sizeof(handle)) {
+        err = EOVERFLOW;
+    } else {
+        node = FSNodeFromVNode(vp);
+        
+        handle.fFileNum    = EmptyFSSwapLE32( (uint32_t) node->fFileNum );
+        handle.fGeneration = EmptyFSSwapLE32(node->fGeneration);
+        memcpy(fhp, &handle, sizeof(handle));
+        *fhlenp = sizeof(handle);
+        err = 0;
+    }
+
+    OpEndVNode(kEmptyFSOpVFSOPVptofh, opStart, err, vp, 0, 0);
+
+    return err;
+}
+
+static errno_t SysctlReturn(const void *value, size_t size, user_addr_t oldp, size_t *oldlenp)
+    // Returns value (size bytes long) to the caller of sysctl, following the 
+    // usual conventions: if oldp is USER_ADDR_NULL the caller just wants to 
+    // know the size, and if the caller's buffer is too small we return ENOMEM.
+{
+    errno_t     err;
+
+    err = 0;
+    if (oldlenp != NULL) {
+        if (oldp != USER_ADDR_NULL) {
+            if (*oldlenp < size) {
+                err = ENOMEM;
+            } else {
+                err = copyout(value, oldp, size);
+            }
+        }
+        if (err == 0) {
+            *oldlenp = size;
+        }
+    }
+    return err;
+}
+
+static errno_t VFSOPSysctl(
+    int *           name, 
+    u_int           namelen, 
+    user_addr_t     oldp, 
+    size_t *        oldlenp, 
+    user_addr_t     newp, 
+    size_t          newlen, 
+    vfs_context_t   context
+)
+    // Called by VFS to handle sysctl requests for { CTL_VFS, <our type 
+    // number>, name... }.  Note that this isn't specific to a volume; 
+    // there's one sysctl namespace for the file system as a whole.
+    //
+    // name and namelen are the remainder of the sysctl name.
+    //
+    // oldp and oldlenp describe the buffer for the current value.  oldp 
+    // is a user address.
+    // 
+    // newp and newlen describe the new value, if any.  newp is a user 
+    // address.
+    //
+    // context identifies the calling process.
+    //
+    // VFS also calls this routine for some generic requests (for example, 
+    // VFS_CTL_QUERY), so it's important to return ENOTSUP for names that we 
+    // don't recognise.  The names that we support are described in 
+    // "EmptyFSStats.h".
+{
+    errno_t         err;
+    EmptyFSStats *  snapshot;
+    int             enabled;
+
+    // Pre-conditions
+
+    assert(name != NULL);
+    assert(context != NULL);
+
+    if (namelen != 1) {
+        err = ENOTSUP;
+    } else {
+        switch (name[0]) {
+            case kEmptyFSSysctlStats:
+                if (newp != USER_ADDR_NULL) {
+                    err = EPERM;
+                } else if (oldp == USER_ADDR_NULL) {
+                    err = SysctlReturn(NULL, sizeof(*snapshot), oldp, oldlenp);
+                } else {
+                    // EmptyFSStats is too big to put on the kernel stack.
+                    
+                    snapshot = (EmptyFSStats *) OSMalloc(sizeof(*snapshot), gOSMallocTag);
+                    if (snapshot == NULL) {
+                        err = ENOMEM;
+                    } else {
+                        StatsSnapshot(snapshot);
+                        err = SysctlReturn(snapshot, sizeof(*snapshot), oldp, oldlenp);
+                        OSFree(snapshot, sizeof(*snapshot), gOSMallocTag);
+                    }
+                }
+                break;
+            case kEmptyFSSysctlStatsEnable:
+                enabled = (gStatsEnabled != 0);
+                err = SysctlReturn(&enabled, sizeof(enabled), oldp, oldlenp);
+                if ( (err == 0) && (newp != USER_ADDR_NULL) ) {
+                    if (newlen != sizeof(enabled)) {
+                        err = EINVAL;
+                    } else if ( vfs_context_suser(context) != 0 ) {
+                        err = EPERM;
+                    } else {
+                        err = copyin(newp, &enabled, sizeof(enabled));
+                    }
+                    if (err == 0) {
+                        gStatsEnabled = (enabled != 0);
+                    }
+                }
+                break;
+            case kEmptyFSSysctlTrace:
+                if (newp != USER_ADDR_NULL) {
+                    err = EPERM;
+                } else if ( vfs_context_suser(context) != 0 ) {
+                    err = EPERM;
+                } else if (oldp == USER_ADDR_NULL) {
+                    err = SysctlReturn(NULL, kEmptyFSTraceMaxReadSize, oldp, oldlenp);
+                } else if (oldlenp == NULL) {
+                    err = EINVAL;
+                } else {
+                    err = TraceRead(oldp, oldlenp);
+                }
+                break;
+            default:
+                err = ENOTSUP;
+                break;
+        }
+    }
+
+    return err;
+}
+
 /////////////////////////////////////////////////////////////////////
 #pragma mark ***** Configuration Data
 
@@ -1787,52 +14348,52 @@ typedef errno_t (*VNodeOp)(void *);
 static struct vnodeopv_entry_desc gVNodeOperationEntries[] = {
 //  { &vnop_access_desc,        (VNodeOp) VNOPAccess      },
 //  { &vnop_advlock_desc,       (VNodeOp) VNOPAdvlock     },
-//  { &vnop_allocate_desc,      (VNodeOp) VNOPAllocate    },
-//  { &vnop_blktooff_desc,      (VNodeOp) VNOPBlktooff    },
-//  { &vnop_blockmap_desc,      (VNodeOp) VNOPBlockmap    },
+    { &vnop_allocate_desc,      (VNodeOp) VNOPAllocate    },
+    { &vnop_blktooff_desc,      (VNodeOp) VNOPBlktooff    },
+    { &vnop_blockmap_desc,      (VNodeOp) VNOPBlockmap    },
 //  { &vnop_bwrite_desc,        (VNodeOp) VNOPBwrite      },
     { &vnop_close_desc,         (VNodeOp) VNOPClose       },
 //  { &vnop_copyfile_desc,      (VNodeOp) VNOPCopyfile    },
-//  { &vnop_create_desc,        (VNodeOp) VNOPCreate      },
+    { &vnop_create_desc,        (VNodeOp) VNOPCreate      },
     { &vnop_default_desc,       (VNodeOp) vn_default_error},
 //  { &vnop_exchange_desc,      (VNodeOp) VNOPExchange    },
-//  { &vnop_fsync_desc,         (VNodeOp) VNOPFsync       },
+    { &vnop_fsync_desc,         (VNodeOp) VNOPFsync       },
     { &vnop_getattr_desc,       (VNodeOp) VNOPGetattr     },
 //  { &vnop_getattrlist_desc,   (VNodeOp) VNOPGetattrlist },            // not useful, implement getattr instead
 //  { &vnop_getxattr_desc,      (VNodeOp) VNOPGetxattr    },
-//  { &vnop_inactive_desc,      (VNodeOp) VNOPInactive    },
+    { &vnop_inactive_desc,      (VNodeOp) VNOPInactive    },
 //  { &vnop_ioctl_desc,         (VNodeOp) VNOPIoctl       },
 //  { &vnop_link_desc,          (VNodeOp) VNOPLink        },
 //  { &vnop_listxattr_desc,     (VNodeOp) VNOPListxattr   },
     { &vnop_lookup_desc,        (VNodeOp) VNOPLookup      },
 //  { &vnop_mkdir_desc,         (VNodeOp) VNOPMkdir       },
 //  { &vnop_mknod_desc,         (VNodeOp) VNOPMknod       },
-//  { &vnop_mmap_desc,          (VNodeOp) VNOPMmap        },
-//  { &vnop_mnomap_desc,        (VNodeOp) VNOPMnomap      },
-//  { &vnop_offtoblk_desc,      (VNodeOp) VNOPOfftoblk    },
+    { &vnop_mmap_desc,          (VNodeOp) VNOPMmap        },
+    { &vnop_mnomap_desc,        (VNodeOp) VNOPMnomap      },
+    { &vnop_offtoblk_desc,      (VNodeOp) VNOPOfftoblk    },
     { &vnop_open_desc,          (VNodeOp) VNOPOpen        },
-//  { &vnop_pagein_desc,        (VNodeOp) VNOPPagein      },
+    { &vnop_pagein_desc,        (VNodeOp) VNOPPagein      },
 //  { &vnop_pageout_desc,       (VNodeOp) VNOPPageout     },
 //  { &vnop_pathconf_desc,      (VNodeOp) VNOPPathconf    },
-//  { &vnop_read_desc,          (VNodeOp) VNOPRead        },
+    { &vnop_read_desc,          (VNodeOp) VNOPRead        },
     { &vnop_readdir_desc,       (VNodeOp) VNOPReadDir     },
-//  { &vnop_readdirattr_desc,   (VNodeOp) VNOPReaddirattr },
+    { &vnop_readdirattr_desc,   (VNodeOp) VNOPReaddirattr },
 //  { &vnop_readlink_desc,      (VNodeOp) VNOPReadlink    },
     { &vnop_reclaim_desc,       (VNodeOp) VNOPReclaim     },
-//  { &vnop_remove_desc,        (VNodeOp) VNOPRemove      },
+    { &vnop_remove_desc,        (VNodeOp) VNOPRemove      },
 //  { &vnop_removexattr_desc,   (VNodeOp) VNOPRemovexattr },
 //  { &vnop_rename_desc,        (VNodeOp) VNOPRename      },
 //  { &vnop_revoke_desc,        (VNodeOp) VNOPRevoke      },
 //  { &vnop_rmdir_desc,         (VNodeOp) VNOPRmdir       },
 //  { &vnop_searchfs_desc,      (VNodeOp) VNOPSearchfs    },
 //  { &vnop_select_desc,        (VNodeOp) VNOPSelect      },
-//  { &vnop_setattr_desc,       (VNodeOp) VNOPSetattr     },
+    { &vnop_setattr_desc,       (VNodeOp) VNOPSetattr     },
 //  { &vnop_setattrlist_desc,   (VNodeOp) VNOPSetattrlist },            // not useful, implement setattr instead
 //  { &vnop_setxattr_desc,      (VNodeOp) VNOPSetxattr    },
-//  { &vnop_strategy_desc,      (VNodeOp) VNOPStrategy    },
+    { &vnop_strategy_desc,      (VNodeOp) VNOPStrategy    },
 //  { &vnop_symlink_desc,       (VNodeOp) VNOPSymlink     },
 //  { &vnop_whiteout_desc,      (VNodeOp) VNOPWhiteout    },
-//  { &vnop_write_desc,         (VNodeOp) VNOPWrite       },
+    { &vnop_write_desc,         (VNodeOp) VNOPWrite       },
     { NULL, NULL }
 };
 
@@ -1868,12 +14429,12 @@ static struct vfsops gVFSOps = {
     VFSOPRoot,                                  // vfs_root
     NULL,                                       // vfs_quotactl
     VFSOPGetattr,                               // vfs_getattr
-    NULL,                                       // vfs_sync
-    NULL,                                       // vfs_vget
-    NULL,                                       // vfs_fhtovp
-    NULL,                                       // vfs_vptofh
+    VFSOPSync,                                  // vfs_sync
+    VFSOPVget,                                  // vfs_vget
+    VFSOPFhtovp,                                // vfs_fhtovp
+    VFSOPVptofh,                                // vfs_vptofh
     NULL,                                       // vfs_init
-    NULL,                                       // vfs_sysctl
+    VFSOPSysctl,                                // vfs_sysctl
     NULL,                                       // vfs_setattr
     {NULL, NULL, NULL, NULL, NULL, NULL, NULL}  // vfs_reserved
 };
@@ -1928,11 +14489,31 @@ extern kern_return_t MODULE_START(kmod_info_t * ki, void * d)
     kernErr = InitMemoryAndLocks();
     err = ErrnoFromKernReturn(kernErr);
 
+    if (err == 0) {
+        err = FSNodeHashInit();
+    }
+    if (err == 0) {
+        err = DirCacheInit();
+    }
+    if (err == 0) {
+        err = DecompCacheInit();
+    }
+    if (err == 0) {
+        err = StatsInit();
+    }
+    if (err == 0) {
+        err = TraceInit();
+    }
     if (err == 0) {
         err = vfs_fsadd(&gVFSEntry, &gVFSTableRef);
     }
     
     if (err != 0) {
+        TraceTerm();
+        StatsTerm();
+        DecompCacheTerm();
+        DirCacheTerm();
+        FSNodeHashTerm();
         TermMemoryAndLocks();
     }
 
@@ -1953,6 +14534,11 @@ extern kern_return_t MODULE_STOP(kmod_info_t * ki, void * d)
     if (err == 0) {
         gVFSTableRef = NULL;
         
+        TraceTerm();
+        StatsTerm();
+        DecompCacheTerm();
+        DirCacheTerm();
+        FSNodeHashTerm();
         TermMemoryAndLocks();
     }
 
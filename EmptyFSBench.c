@@ -0,0 +1,1812 @@
+/*
+    File:       EmptyFSBench.c
+
+    Contains:   User-space harness that benchmarks the EmptyFS vnode and VFS operations.
+
+    Written by: DTS
+
+    Copyright:  Copyright (c) 2006 by Apple Computer, Inc., All Rights Reserved.
+
+    Disclaimer: IMPORTANT:  This Apple software is supplied to you by Apple Computer, Inc.
+                ("Apple") in consideration of your agreement to the following terms, and your
+                use, installation, modification or redistribution of this Apple software
+                constitutes acceptance of these terms.  If you do not agree with these terms,
+                please do not use, install, modify or redistribute this Apple software.
+
+                In consideration of your agreement to abide by the following terms, and subject
+                to these terms, Apple grants you a personal, non-exclusive license, under Apple's
+                copyrights in this original Apple software (the "Apple Software"), to use,
+                reproduce, modify and redistribute the Apple Software, with or without
+                modifications, in source and/or binary forms; provided that if you redistribute
+                the Apple Software in its entirety and without modifications, you must retain
+                this notice and the following text and disclaimers in all such redistributions of
+                the Apple Software.  Neither the name, trademarks, service marks or logos of
+                Apple Computer, Inc. may be used to endorse or promote products derived from the
+                Apple Software without specific prior written permission from Apple.  Except as
+                expressly stated in this notice, no other rights or licenses, express or implied,
+                are granted by Apple herein, including but not limited to any patent rights that
+                may be infringed by your derivative works or by other works in which the Apple
+                Software may be incorporated.
+
+                The Apple Software is provided by Apple on an "AS IS" basis.  APPLE MAKES NO
+                WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                PURPOSE, REGARDING THE APPLE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                COMBINATION WITH YOUR PRODUCTS.
+
+                IN NO EVENT SHALL APPLE BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                OF THE APPLE SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF APPLE HAS BEEN
+                ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+    Change History (most recent first):
+
+$Log$
+
+*/
+
+/////////////////////////////////////////////////////////////////////
+
+// This tool links "EmptyFS.c" against the user-space KPI shim ("EmptyFSUserKPI.c")
+// and drives the plug-in the way VFS would: it calls MODULE_START to register the
+// file system, mounts a volume, and then calls through gVFSOps and the vnode
+// operations vector.  Each benchmark runs a single operation in a tight loop, on
+// one or more threads, and reports throughput and latency percentiles.
+//
+// The volume is an image file.  If you don't supply one (or the one you name
+// doesn't exist), the tool builds a sample volume using the image library
+// ("EmptyFSImage.c"): a root directory full of small files, a subdirectory, 
+// and a big file for the read benchmarks.  With -D, the subdirectory also 
+// has a directory of each of the given sizes, for the lookup-scale benchmarks.
+//
+// See "Read Me About EmptyFS.txt" for build instructions.
+
+#include "EmptyFSMountArgs.h"
+#include "EmptyFSUserKPI.h"
+#include "EmptyFSImage.h"
+#include "EmptyFSStats.h"
+
+#include <getopt.h>
+#include <unistd.h>
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Benchmark State
+
+extern kern_return_t MODULE_START(kmod_info_t * ki, void * d);
+extern kern_return_t MODULE_STOP (kmod_info_t * ki, void * d);
+
+// BenchHandle is a file handle, as the NFS server would hold it.  64 bytes 
+// is the NFS version 3 maximum (NFS3_FHSIZE).
+
+enum {
+    kBenchMaxHandleSize = 64
+};
+
+struct BenchHandle {
+    int             fLength;
+    unsigned char   fData[kBenchMaxHandleSize];
+};
+typedef struct BenchHandle BenchHandle;
+
+// BenchVolume describes the volume that all the benchmarks run against.
+
+struct BenchVolume {
+    mount_t             fMount;
+    vnode_t             fRootVNode;         // we hold an I/O reference on this while benchmarks run
+    vnode_t             fBigFileVNode;      // likewise; NULL if the volume has no big file
+    off_t               fBigFileSize;
+    volatile uint64_t   fReadCursor;        // next offset for the read benchmarks, modulo fBigFileSize
+    BenchHandle *       fHandles;           // handles for the root and everything in it; the root is first
+    size_t              fHandleCount;
+    volatile uint64_t   fHandleCursor;      // next handle for the NFS benchmarks, modulo fHandleCount
+    boolean_t           fReportOpStats;     // print the file system's own operation statistics (-S)
+    boolean_t           fDrainTrace;        // read the file system's trace while benchmarks run (-T)
+    vnode_t             fWriteDirVNode;     // directory for the write benchmarks; NULL unless mounted read/write (-w)
+    vnode_t             fAppendVNode;       // file for the write benchmarks, in fWriteDirVNode; likewise
+    volatile uint64_t   fWriteCursor;       // bytes appended so far, used to decide when to truncate
+    volatile uint64_t   fNameCursor;        // next unique name for the create benchmark
+    vnode_t             fScaleDirVNode;     // directory for the lookup-scale benchmarks, while they run
+    uint32_t            fScaleCount;        // number of entries in it
+    volatile uint64_t   fScaleCursor;       // next name for the lookup-scale benchmarks
+};
+typedef struct BenchVolume BenchVolume;
+
+typedef errno_t (*BenchOp)(BenchVolume *vol);
+
+struct BenchDesc {
+    const char *    fName;
+    BenchOp         fOp;
+    const char *    fDescription;
+    boolean_t       fReportDeviceIO;        // print a summary of the device I/O done by the benchmark
+    boolean_t       fNeedsWrite;            // only run if the volume is mounted read/write (-w)
+    boolean_t       fScaled;                // run once for each directory size (-D)
+};
+typedef struct BenchDesc BenchDesc;
+
+// BenchThread is the per-thread state for a benchmark run.
+
+struct BenchThread {
+    pthread_t               fThread;
+    pthread_barrier_t *     fBarrier;
+    BenchVolume *           fVolume;
+    const BenchDesc *       fBench;
+    size_t                  fOpCount;
+    uint32_t *              fSamples;       // latency of each op, in ns
+    uint64_t                fStart;         // when this thread started running ops
+    uint64_t                fEnd;           // when it finished
+    errno_t                 fErr;
+};
+typedef struct BenchThread BenchThread;
+
+static uint64_t NanoTime(void)
+{
+    struct timespec now;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t) now.tv_sec * 1000000000ULL) + (uint64_t) now.tv_nsec;
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Benchmarks
+
+static errno_t BenchRoot(BenchVolume *vol)
+    // VFS_ROOT, as done for every path resolution that crosses the mount point. 
+    // Run this with a range of thread counts (for example, "-t 1,2,4,8 root") 
+    // to see how VFSOPRoot scales under contention, and with "-s" to compare 
+    // against the locked path.
+{
+    errno_t     err;
+    vnode_t     vn;
+
+    vn = NULL;
+    err = VFS_ROOT(vol->fMount, &vn, vfs_context_current());
+    if (err == 0) {
+        (void) vnode_put(vn);
+    }
+    return err;
+}
+
+static errno_t LookupNameInDirectory(vnode_t dirVNode, const char *name, uint32_t flags, vnode_t *vnPtr)
+    // Looks up name in the directory dirVNode.  If flags contains MAKEENTRY, 
+    // the lookup goes through UserKPILookupComponent, and thus the name 
+    // cache, as it would for a real path lookup; otherwise it calls 
+    // VNOP_LOOKUP directly.  On success, *vnPtr has an I/O reference, which 
+    // the caller must release.
+{
+    errno_t                 err;
+    struct componentname    cn;
+    char                    nameBuf[MAXPATHLEN];
+
+    strncpy(nameBuf, name, sizeof(nameBuf) - 1);
+    nameBuf[sizeof(nameBuf) - 1] = 0;
+
+    memset(&cn, 0, sizeof(cn));
+    cn.cn_nameiop  = LOOKUP;
+    cn.cn_flags    = ISLASTCN | flags;
+    cn.cn_pnbuf    = nameBuf;
+    cn.cn_pnlen    = sizeof(nameBuf);
+    cn.cn_nameptr  = nameBuf;
+    cn.cn_namelen  = (int) strlen(nameBuf);
+
+    if (flags & MAKEENTRY) {
+        err = UserKPILookupComponent(dirVNode, vnPtr, &cn, vfs_context_current());
+    } else {
+        err = VNOP_LOOKUP(dirVNode, vnPtr, &cn, vfs_context_current());
+    }
+    return err;
+}
+
+static errno_t LookupNameVNode(BenchVolume *vol, const char *name, uint32_t flags, vnode_t *vnPtr)
+    // Like LookupNameInDirectory, for the root directory.
+{
+    return LookupNameInDirectory(vol->fRootVNode, name, flags, vnPtr);
+}
+
+static errno_t LookupName(BenchVolume *vol, const char *name, uint32_t flags)
+    // Like LookupNameVNode, but throws away the result.
+{
+    errno_t     err;
+    vnode_t     vn;
+
+    vn = NULL;
+    err = LookupNameVNode(vol, name, flags, &vn);
+    if (err == 0) {
+        (void) vnode_put(vn);
+    }
+    return err;
+}
+
+// The sample volume has kSampleFileCount files in the root directory, named 
+// using kSampleFileNameFormat, a subdirectory called kSampleDirName, and a 
+// file called kSampleBigFileName that's kSampleBigFileSize bytes long.  The 
+// lookup-hit benchmarks look up kSampleHitName, which is about half way through 
+// the root directory.
+
+enum {
+    kSampleVolumeSize   = 32 * 1024 * 1024,
+    kSampleFileCount    = 256,
+    kSampleSubFileCount = 16,
+    kSampleBigFileSize  = 8 * 1024 * 1024
+};
+
+static const char * kSampleFileNameFormat = "file-%04d";
+static const char * kSampleDirName        = "subdir";
+static const char * kSampleHitName        = "file-0128";
+static const char * kSampleBigFileName    = "bigfile";
+
+static errno_t BenchLookupHit(BenchVolume *vol)
+{
+    return LookupName(vol, kSampleHitName, 0);
+}
+
+static errno_t BenchNameiHit(BenchVolume *vol)
+{
+    return LookupName(vol, kSampleHitName, MAKEENTRY);
+}
+
+static errno_t BenchLookupDot(BenchVolume *vol)
+{
+    return LookupName(vol, ".", 0);
+}
+
+static errno_t BenchLookupDotDot(BenchVolume *vol)
+{
+    return LookupName(vol, "..", ISDOTDOT);
+}
+
+static errno_t LookupMissingName(BenchVolume *vol, uint32_t flags)
+{
+    errno_t     err;
+
+    err = LookupName(vol, "no-such-file", flags);
+    if (err == ENOENT) {
+        err = 0;
+    } else if (err == 0) {
+        err = EEXIST;
+    }
+    return err;
+}
+
+static errno_t BenchLookupMiss(BenchVolume *vol)
+{
+    return LookupMissingName(vol, 0);
+}
+
+static errno_t BenchNameiMiss(BenchVolume *vol)
+{
+    return LookupMissingName(vol, MAKEENTRY);
+}
+
+// With -D, kSampleDirName also has, for each size N in the list, a 
+// directory whose name is kScaleDirNameFormat of N, holding N empty files 
+// named using kScaleFileNameFormat.  They go in the subdirectory so as not 
+// to disturb the root directory benchmarks, which count its entries.  The lookup-scale benchmarks run once 
+// for each size, against that directory, so you can see how lookup latency 
+// grows with the size of the directory.  Each lookup takes the next name 
+// from a stride through the directory, so that successive lookups land on 
+// different directory blocks and miss the directory's lookup cache.  The 
+// misses look up names that aren't there, which is what every create does 
+// first.  Compare with -s, which makes lookups ignore the directory index.
+
+enum {
+    kMaxScaleCounts     = 8,
+    kScaleStride        = 7919,             // a prime, so the stride visits every name unless N is a multiple
+    kScaleBytesPerEntry = 512               // volume space for each entry: its file record, directory entry and index record
+};
+
+static const char * kScaleDirNameFormat  = "scale-%u";
+static const char * kScaleFileNameFormat = "entry-%u";
+static const char * kScaleMissNameFormat = "absent-%u";
+
+static errno_t LookupScaleName(BenchVolume *vol, const char *format)
+{
+    errno_t     err;
+    vnode_t     vn;
+    uint64_t    index;
+    char        name[32];
+
+    assert(vol->fScaleDirVNode != NULL);
+    assert(vol->fScaleCount != 0);
+
+    index = (__sync_fetch_and_add(&vol->fScaleCursor, 1) * kScaleStride) % vol->fScaleCount;
+    snprintf(name, sizeof(name), format, (unsigned int) index);
+
+    vn = NULL;
+    err = LookupNameInDirectory(vol->fScaleDirVNode, name, 0, &vn);
+    if (err == 0) {
+        (void) vnode_put(vn);
+    }
+    return err;
+}
+
+static errno_t BenchLookupScale(BenchVolume *vol)
+{
+    return LookupScaleName(vol, kScaleFileNameFormat);
+}
+
+static errno_t BenchLookupScaleMiss(BenchVolume *vol)
+{
+    errno_t     err;
+
+    err = LookupScaleName(vol, kScaleMissNameFormat);
+    if (err == ENOENT) {
+        err = 0;
+    } else if (err == 0) {
+        err = EEXIST;
+    }
+    return err;
+}
+
+static errno_t GetStatAttributes(vnode_t vn)
+    // Gets the attributes that stat asks for.
+{
+    struct vnode_attr   va;
+
+    VATTR_INIT(&va);
+    VATTR_WANTED(&va, va_rdev);
+    VATTR_WANTED(&va, va_nlink);
+    VATTR_WANTED(&va, va_data_size);
+    VATTR_WANTED(&va, va_mode);
+    VATTR_WANTED(&va, va_uid);
+    VATTR_WANTED(&va, va_gid);
+    VATTR_WANTED(&va, va_create_time);
+    VATTR_WANTED(&va, va_access_time);
+    VATTR_WANTED(&va, va_modify_time);
+    VATTR_WANTED(&va, va_change_time);
+    VATTR_WANTED(&va, va_fileid);
+    VATTR_WANTED(&va, va_fsid);
+    return VNOP_GETATTR(vn, &va, vfs_context_current());
+}
+
+static errno_t BenchGetattr(BenchVolume *vol)
+{
+    return GetStatAttributes(vol->fRootVNode);
+}
+
+static errno_t ReadRootDir(BenchVolume *vol, size_t bufSize)
+    // Reads the entire root directory, bufSize bytes at a time, like 
+    // getdirentries.
+{
+    errno_t     err;
+    uio_t       uio;
+    off_t       offset;
+    int         eofflag;
+    int         numdirent;
+    char        buf[4096];
+
+    assert(bufSize <= sizeof(buf));
+
+    err = 0;
+    offset = 0;
+    uio = uio_create(1, 0, UIO_SYSSPACE, UIO_READ);
+    if (uio == NULL) {
+        err = ENOMEM;
+    }
+    eofflag = FALSE;
+    while ( (err == 0) && ! eofflag ) {
+        uio_reset(uio, offset, UIO_SYSSPACE, UIO_READ);
+        (void) uio_addiov(uio, CAST_USER_ADDR_T(buf), bufSize);
+        err = VNOP_READDIR(vol->fRootVNode, uio, 0, &eofflag, &numdirent, vfs_context_current());
+        if ( (err == 0) && (uio_resid(uio) == (user_ssize_t) bufSize) ) {
+            eofflag = TRUE;
+        }
+        offset = uio_offset(uio);
+    }
+    if (uio != NULL) {
+        uio_free(uio);
+    }
+    return err;
+}
+
+static errno_t BenchReadDir(BenchVolume *vol)
+{
+    return ReadRootDir(vol, 4096);
+}
+
+static errno_t BenchReadDirPaged(BenchVolume *vol)
+    // A buffer this small holds about 10 entries, so most calls resume 
+    // part way through a directory block.  Compare with "-s" to see what 
+    // the directory cursor cache buys.
+{
+    return ReadRootDir(vol, 256);
+}
+
+// The readdir-stat and readdirattr benchmarks both get the names and 
+// attributes of everything in the root directory, which is what ls -l does. 
+// readdir-stat does it the traditional way, reading the directory and then 
+// looking up and getting the attributes of each entry.  readdirattr does 
+// it with VNOP_READDIRATTR, which is what getdirentriesattr calls.  Both 
+// use a 4 KB buffer, and both check that they saw every entry.
+
+enum {
+    kSampleRootEntryCount = kSampleFileCount + 2,   // plus kSampleDirName and kSampleBigFileName
+    kBenchDirBufferSize   = 4096
+};
+
+static errno_t BenchReadDirStat(BenchVolume *vol)
+{
+    errno_t             err;
+    uio_t               uio;
+    off_t               offset;
+    int                 eofflag;
+    int                 numdirent;
+    char                buf[kBenchDirBufferSize];
+    size_t              used;
+    size_t              entryOffset;
+    const struct dirent * thisItem;
+    vnode_t             vn;
+    int                 entryCount;
+
+    err = 0;
+    offset = 0;
+    entryCount = 0;
+    uio = uio_create(1, 0, UIO_SYSSPACE, UIO_READ);
+    if (uio == NULL) {
+        err = ENOMEM;
+    }
+    eofflag = FALSE;
+    while ( (err == 0) && ! eofflag ) {
+        uio_reset(uio, offset, UIO_SYSSPACE, UIO_READ);
+        (void) uio_addiov(uio, CAST_USER_ADDR_T(buf), sizeof(buf));
+        err = VNOP_READDIR(vol->fRootVNode, uio, 0, &eofflag, &numdirent, vfs_context_current());
+        if (err == 0) {
+            used = sizeof(buf) - (size_t) uio_resid(uio);
+            if (used == 0) {
+                eofflag = TRUE;
+            }
+            for (entryOffset = 0; (err == 0) && (entryOffset < used); entryOffset += thisItem->d_reclen) {
+                thisItem = (const struct dirent *) &buf[entryOffset];
+                if ( (strcmp(thisItem->d_name, ".") != 0) && (strcmp(thisItem->d_name, "..") != 0) ) {
+                    vn = NULL;
+                    err = LookupNameVNode(vol, thisItem->d_name, MAKEENTRY, &vn);
+                    if (err == 0) {
+                        err = GetStatAttributes(vn);
+                        (void) vnode_put(vn);
+                    }
+                    entryCount += 1;
+                }
+            }
+        }
+        offset = uio_offset(uio);
+    }
+    if ( (err == 0) && (entryCount != kSampleRootEntryCount) ) {
+        err = EIO;
+    }
+    if (uio != NULL) {
+        uio_free(uio);
+    }
+    return err;
+}
+
+static errno_t BenchReaddirattr(BenchVolume *vol)
+{
+    errno_t             err;
+    uio_t               uio;
+    off_t               offset;
+    struct attrlist     alist;
+    u_long              newstate;
+    int                 eofflag;
+    u_long              actualcount;
+    u_long              entryCount;
+    char                buf[kBenchDirBufferSize];
+
+    memset(&alist, 0, sizeof(alist));
+    alist.bitmapcount = ATTR_BIT_MAP_COUNT;
+    alist.commonattr  = ATTR_CMN_NAME | ATTR_CMN_OBJTYPE | ATTR_CMN_OBJID | ATTR_CMN_MODTIME 
+                      | ATTR_CMN_OWNERID | ATTR_CMN_GRPID | ATTR_CMN_ACCESSMASK | ATTR_CMN_FLAGS;
+    alist.dirattr     = ATTR_DIR_LINKCOUNT;
+    alist.fileattr    = ATTR_FILE_LINKCOUNT | ATTR_FILE_TOTALSIZE | ATTR_FILE_ALLOCSIZE;
+
+    err = 0;
+    offset = 0;
+    entryCount = 0;
+    uio = uio_create(1, 0, UIO_SYSSPACE, UIO_READ);
+    if (uio == NULL) {
+        err = ENOMEM;
+    }
+    eofflag = FALSE;
+    while ( (err == 0) && ! eofflag ) {
+        uio_reset(uio, offset, UIO_SYSSPACE, UIO_READ);
+        (void) uio_addiov(uio, CAST_USER_ADDR_T(buf), sizeof(buf));
+        err = VNOP_READDIRATTR(vol->fRootVNode, &alist, uio, kSampleRootEntryCount, 0, &newstate, &eofflag, &actualcount, vfs_context_current());
+        if ( (err == 0) && (actualcount == 0) ) {
+            eofflag = TRUE;
+        }
+        entryCount += actualcount;
+        offset = uio_offset(uio);
+    }
+    if ( (err == 0) && (entryCount != kSampleRootEntryCount) ) {
+        err = EIO;
+    }
+    if (uio != NULL) {
+        uio_free(uio);
+    }
+    return err;
+}
+
+// The NFS benchmarks replay the sort of handle-based access that the NFS 
+// server does on behalf of its clients.  Before running any benchmarks we 
+// get a handle for the root and for every item in it (CollectHandles). 
+// nfs-getattr then resolves those handles round robin, which is what the 
+// server does for every GETATTR (and, indeed, for every other request); 
+// its latency is the cost of turning a handle into a vnode.  Use "-v" to 
+// limit the number of vnodes so that most resolutions have to load the 
+// FSNode from disk.  nfs-readdirplus does what the server does for 
+// READDIRPLUS: an extended readdir of the root, resuming at each call from 
+// the d_seekoff of the last entry it got, and then a vget, getattr, and 
+// vptofh for each entry.
+
+static errno_t GetHandle(vnode_t vn, BenchHandle *handle)
+{
+    handle->fLength = sizeof(handle->fData);
+    return VFS_VPTOFH(vn, &handle->fLength, handle->fData, vfs_context_current());
+}
+
+static errno_t ReadRootDirExtended(
+    vnode_t     rootVN, 
+    off_t *     offsetPtr, 
+    char *      buf, 
+    size_t      bufSize, 
+    size_t *    usedPtr, 
+    int *       eofflagPtr
+)
+    // Reads the next chunk of the root directory as (struct direntry), 
+    // starting at *offsetPtr, and sets *offsetPtr to the d_seekoff of the 
+    // last entry returned.
+{
+    errno_t                     err;
+    uio_t                       uio;
+    int                         numdirent;
+    size_t                      entryOffset;
+    const struct direntry *     thisItem;
+
+    uio = uio_create(1, *offsetPtr, UIO_SYSSPACE, UIO_READ);
+    if (uio == NULL) {
+        err = ENOMEM;
+    } else {
+        (void) uio_addiov(uio, CAST_USER_ADDR_T(buf), bufSize);
+        err = VNOP_READDIR(
+            rootVN, 
+            uio, 
+            VNODE_READDIR_EXTENDED | VNODE_READDIR_REQSEEKOFF, 
+            eofflagPtr, 
+            &numdirent, 
+            vfs_context_current()
+        );
+        if (err == 0) {
+            *usedPtr = bufSize - (size_t) uio_resid(uio);
+            if (*usedPtr == 0) {
+                *eofflagPtr = TRUE;
+            }
+            for (entryOffset = 0; entryOffset < *usedPtr; entryOffset += thisItem->d_reclen) {
+                thisItem = (const struct direntry *) &buf[entryOffset];
+                *offsetPtr = (off_t) thisItem->d_seekoff;
+            }
+        }
+        uio_free(uio);
+    }
+    return err;
+}
+
+static errno_t CollectHandles(BenchVolume *vol)
+    // Fills in vol->fHandles with handles for the root directory and 
+    // everything in it.
+{
+    errno_t                     err;
+    off_t                       offset;
+    int                         eofflag;
+    char                        buf[kBenchDirBufferSize];
+    size_t                      used;
+    size_t                      entryOffset;
+    const struct direntry *     thisItem;
+    vnode_t                     vn;
+
+    vol->fHandleCount = 0;
+    vol->fHandles = calloc(kSampleRootEntryCount + 1, sizeof(*vol->fHandles));
+    if (vol->fHandles == NULL) {
+        err = ENOMEM;
+    } else {
+        err = GetHandle(vol->fRootVNode, &vol->fHandles[0]);
+    }
+    if (err == 0) {
+        vol->fHandleCount = 1;
+    }
+    offset = 0;
+    eofflag = FALSE;
+    while ( (err == 0) && ! eofflag ) {
+        err = ReadRootDirExtended(vol->fRootVNode, &offset, buf, sizeof(buf), &used, &eofflag);
+        for (entryOffset = 0; (err == 0) && (entryOffset < used); entryOffset += thisItem->d_reclen) {
+            thisItem = (const struct direntry *) &buf[entryOffset];
+            if ( (strcmp(thisItem->d_name, ".") != 0) && (strcmp(thisItem->d_name, "..") != 0) ) {
+                if (vol->fHandleCount == (kSampleRootEntryCount + 1)) {
+                    err = EIO;
+                } else {
+                    vn = NULL;
+                    err = LookupNameVNode(vol, thisItem->d_name, 0, &vn);
+                    if (err == 0) {
+                        err = GetHandle(vn, &vol->fHandles[vol->fHandleCount]);
+                        (void) vnode_put(vn);
+                    }
+                    if (err == 0) {
+                        vol->fHandleCount += 1;
+                    }
+                }
+            }
+        }
+    }
+    return err;
+}
+
+static errno_t BenchNFSGetattr(BenchVolume *vol)
+{
+    errno_t             err;
+    uint64_t            handleIndex;
+    BenchHandle *       handle;
+    vnode_t             vn;
+
+    handleIndex = __sync_fetch_and_add(&vol->fHandleCursor, 1) % vol->fHandleCount;
+    handle = &vol->fHandles[handleIndex];
+
+    vn = NULL;
+    err = VFS_FHTOVP(vol->fMount, handle->fLength, handle->fData, &vn, vfs_context_current());
+    if (err == 0) {
+        err = GetStatAttributes(vn);
+        (void) vnode_put(vn);
+    }
+    return err;
+}
+
+static errno_t BenchNFSReaddirplus(BenchVolume *vol)
+{
+    errno_t                     err;
+    vnode_t                     dirVN;
+    off_t                       offset;
+    int                         eofflag;
+    char                        buf[kBenchDirBufferSize];
+    size_t                      used;
+    size_t                      entryOffset;
+    const struct direntry *     thisItem;
+    vnode_t                     vn;
+    BenchHandle                 handle;
+    int                         entryCount;
+
+    dirVN = NULL;
+    err = VFS_FHTOVP(vol->fMount, vol->fHandles[0].fLength, vol->fHandles[0].fData, &dirVN, vfs_context_current());
+
+    offset = 0;
+    eofflag = FALSE;
+    entryCount = 0;
+    while ( (err == 0) && ! eofflag ) {
+        err = ReadRootDirExtended(dirVN, &offset, buf, sizeof(buf), &used, &eofflag);
+        for (entryOffset = 0; (err == 0) && (entryOffset < used); entryOffset += thisItem->d_reclen) {
+            thisItem = (const struct direntry *) &buf[entryOffset];
+            if ( (strcmp(thisItem->d_name, ".") != 0) && (strcmp(thisItem->d_name, "..") != 0) ) {
+                vn = NULL;
+                err = VFS_VGET(vol->fMount, (ino64_t) thisItem->d_ino, &vn, vfs_context_current());
+                if (err == 0) {
+                    err = GetStatAttributes(vn);
+                    if (err == 0) {
+                        err = GetHandle(vn, &handle);
+                    }
+                    (void) vnode_put(vn);
+                }
+                entryCount += 1;
+            }
+        }
+    }
+    if ( (err == 0) && (entryCount != kSampleRootEntryCount) ) {
+        err = EIO;
+    }
+    if (dirVN != NULL) {
+        (void) vnode_put(dirVN);
+    }
+    return err;
+}
+
+enum {
+    kBenchReadSize = 64 * 1024
+};
+
+static errno_t ReadBigFile(BenchVolume *vol, boolean_t cold)
+    // Reads the next kBenchReadSize bytes of the big file, wrapping around at 
+    // the end.  The threads running the benchmark share a cursor, so between 
+    // them they stream through the file.  If cold is set, the caches are purged 
+    // each time the cursor wraps, so that every pass reads from the device.
+{
+    errno_t     err;
+    uint64_t    cursor;
+    off_t       offset;
+    uio_t       uio;
+    char        buf[kBenchReadSize];
+
+    err = 0;
+    if (vol->fBigFileVNode == NULL) {
+        err = ENOENT;
+    }
+    if (err == 0) {
+        cursor = __sync_fetch_and_add(&vol->fReadCursor, kBenchReadSize);
+        offset = (off_t) (cursor % (uint64_t) vol->fBigFileSize);
+        if ( cold && (offset == 0) ) {
+            UserKPIPurgeCaches();
+        }
+        
+        uio = uio_create(1, offset, UIO_SYSSPACE, UIO_READ);
+        if (uio == NULL) {
+            err = ENOMEM;
+        } else {
+            (void) uio_addiov(uio, CAST_USER_ADDR_T(buf), sizeof(buf));
+            err = VNOP_READ(vol->fBigFileVNode, uio, 0, vfs_context_current());
+            uio_free(uio);
+        }
+    }
+    return err;
+}
+
+static errno_t BenchReadSeq(BenchVolume *vol)
+{
+    return ReadBigFile(vol, TRUE);
+}
+
+static errno_t BenchReadCached(BenchVolume *vol)
+{
+    return ReadBigFile(vol, FALSE);
+}
+
+static errno_t MapBigFile(BenchVolume *vol, boolean_t cold)
+    // The memory mapped equivalent of ReadBigFile: maps the big file, touches 
+    // each page of the next kBenchReadSize bytes, and unmaps it.  Touching a 
+    // page that's not in the UBC pages it in; touching one that is costs no 
+    // I/O and no copy.
+{
+    errno_t             err;
+    uint64_t            cursor;
+    off_t               offset;
+    off_t               pageOffset;
+    UserKPIMapping *    mapping;
+    const void *        addr;
+    uint32_t            sum;
+
+    mapping = NULL;
+
+    err = 0;
+    if (vol->fBigFileVNode == NULL) {
+        err = ENOENT;
+    }
+    if (err == 0) {
+        cursor = __sync_fetch_and_add(&vol->fReadCursor, kBenchReadSize);
+        offset = (off_t) (cursor % (uint64_t) vol->fBigFileSize);
+        if ( cold && (offset == 0) ) {
+            UserKPIPurgeCaches();
+        }
+
+        err = UserKPIMmap(vol->fBigFileVNode, PROT_READ, MAP_SHARED, &mapping);
+    }
+    if (err == 0) {
+        sum = 0;
+        for (pageOffset = 0; (err == 0) && (pageOffset < kBenchReadSize); pageOffset += PAGE_SIZE) {
+            err = UserKPIMapAccess(mapping, offset + pageOffset, &addr);
+            if (err == 0) {
+                sum += *(const volatile uint32_t *) addr;
+            }
+        }
+        (void) sum;
+    }
+    if (mapping != NULL) {
+        UserKPIMunmap(mapping);
+    }
+    return err;
+}
+
+static errno_t BenchMmapSeq(BenchVolume *vol)
+{
+    return MapBigFile(vol, TRUE);
+}
+
+static errno_t BenchMmapCached(BenchVolume *vol)
+{
+    return MapBigFile(vol, FALSE);
+}
+
+static errno_t BenchOpenClose(BenchVolume *vol)
+{
+    errno_t     err;
+
+    err = VNOP_OPEN(vol->fRootVNode, FREAD, vfs_context_current());
+    if (err == 0) {
+        err = VNOP_CLOSE(vol->fRootVNode, FREAD, vfs_context_current());
+    }
+    return err;
+}
+
+static errno_t BenchStatfs(BenchVolume *vol)
+{
+    struct vfs_attr     vfa;
+
+    VFSATTR_INIT(&vfa);
+    VFSATTR_WANTED(&vfa, f_bsize);
+    VFSATTR_WANTED(&vfa, f_iosize);
+    VFSATTR_WANTED(&vfa, f_blocks);
+    VFSATTR_WANTED(&vfa, f_bfree);
+    VFSATTR_WANTED(&vfa, f_bavail);
+    VFSATTR_WANTED(&vfa, f_files);
+    VFSATTR_WANTED(&vfa, f_ffree);
+    return VFS_GETATTR(vol->fMount, &vfa, vfs_context_current());
+}
+
+// EmptyFSUserKPICounterAdd (in "EmptyFS.c") changes one of the volume 
+// counters that VFSOPGetattr reports.  Counter 0 is the number of free 
+// blocks.
+
+extern void EmptyFSUserKPICounterAdd(mount_t mp, uint32_t counter, int32_t delta);
+
+static errno_t BenchStatfsChurn(BenchVolume *vol)
+    // Like BenchStatfs, except that we "allocate" a block before the statfs 
+    // and "free" it afterwards, so that statfs runs while other threads are 
+    // changing the free block count, as it would on a busy writable volume.
+{
+    errno_t     err;
+
+    EmptyFSUserKPICounterAdd(vol->fMount, 0, -1);
+    err = BenchStatfs(vol);
+    EmptyFSUserKPICounterAdd(vol->fMount, 0, 1);
+    return err;
+}
+
+// The checksum benchmarks time EmptyFSChecksum's two implementations (see 
+// "Metadata Checksums" in "EmptyFSFormat.h") over kBenchReadSize bytes, the 
+// same amount that each read benchmark op reads, so you can see what 
+// checksumming adds to a read.  They don't touch the volume.  crc32c-hw 
+// fails with ENOTSUP on a CPU without CRC-32C instructions.
+
+static uint8_t              gBenchChecksumBuffer[kBenchReadSize];
+static volatile uint32_t    gBenchChecksumResult;
+
+static errno_t BenchChecksumHardware(BenchVolume *vol)
+{
+    errno_t     err;
+
+    (void) vol;
+    err = 0;
+    if ( ! EmptyFSChecksumHardwareAvailable() ) {
+        err = ENOTSUP;
+    } else {
+        gBenchChecksumResult = EmptyFSChecksumHardware(0, gBenchChecksumBuffer, sizeof(gBenchChecksumBuffer));
+    }
+    return err;
+}
+
+static errno_t BenchChecksumSoftware(BenchVolume *vol)
+{
+    (void) vol;
+    gBenchChecksumResult = EmptyFSChecksumSoftware(0, gBenchChecksumBuffer, sizeof(gBenchChecksumBuffer));
+    return 0;
+}
+
+// The write benchmarks only work if the volume is mounted read/write (-w). 
+// They create their files in kSampleDirName, rather than the root directory, 
+// so that the root directory benchmarks, which count its entries, and the 
+// NFS benchmarks, which take a handle for each of them, see the same 
+// directory whether or not you pass -w. 
+// write-append appends to kBenchAppendName, truncating it back to zero each 
+// time it grows by kBenchAppendLimit, so that the benchmark can run for as 
+// long as you like on the small sample volume.  Because EmptyFS delays 
+// allocation, most appends never touch the device; the blocks are allocated, 
+// and the data written, when the flusher thread gets around to it.
+
+enum {
+    kBenchWriteSize   = 4 * 1024,
+    kBenchAppendLimit = 4 * 1024 * 1024
+};
+
+static const char * kBenchAppendName = "bench-append";
+
+static errno_t MakeComponentName(struct componentname *cn, uint32_t nameiop, char *nameBuf, size_t nameBufSize)
+    // Fills out cn for the last component of a path, named by nameBuf.
+{
+    memset(cn, 0, sizeof(*cn));
+    cn->cn_nameiop  = nameiop;
+    cn->cn_flags    = ISLASTCN;
+    cn->cn_pnbuf    = nameBuf;
+    cn->cn_pnlen    = (int) nameBufSize;
+    cn->cn_nameptr  = nameBuf;
+    cn->cn_namelen  = (int) strlen(nameBuf);
+    return 0;
+}
+
+static errno_t CreateNameVNode(BenchVolume *vol, const char *name, vnode_t *vnPtr)
+    // Creates a regular file called name in the write directory, as open(2) 
+    // with O_CREAT | O_EXCL would: a CREATE lookup, which returns EJUSTRETURN 
+    // if the name is free, followed by VNOP_CREATE.  On success, *vnPtr has 
+    // an I/O reference, which the caller must release.
+{
+    errno_t                 err;
+    struct componentname    cn;
+    struct vnode_attr       va;
+    char                    nameBuf[MAXPATHLEN];
+
+    strncpy(nameBuf, name, sizeof(nameBuf) - 1);
+    nameBuf[sizeof(nameBuf) - 1] = 0;
+
+    *vnPtr = NULL;
+    (void) MakeComponentName(&cn, CREATE, nameBuf, sizeof(nameBuf));
+    err = VNOP_LOOKUP(vol->fWriteDirVNode, vnPtr, &cn, vfs_context_current());
+    if (err == 0) {
+        (void) vnode_put(*vnPtr);
+        *vnPtr = NULL;
+        err = EEXIST;
+    } else if (err == EJUSTRETURN) {
+        VATTR_INIT(&va);
+        VATTR_SET(&va, va_type, VREG);
+        VATTR_SET(&va, va_mode, 0644);
+        err = VNOP_CREATE(vol->fWriteDirVNode, vnPtr, &cn, &va, vfs_context_current());
+    }
+    return err;
+}
+
+static errno_t RemoveName(BenchVolume *vol, const char *name)
+    // Removes the file called name from the write directory, as unlink(2) would.
+{
+    errno_t                 err;
+    struct componentname    cn;
+    vnode_t                 vn;
+    char                    nameBuf[MAXPATHLEN];
+
+    err = LookupNameInDirectory(vol->fWriteDirVNode, name, 0, &vn);
+    if (err == 0) {
+        strncpy(nameBuf, name, sizeof(nameBuf) - 1);
+        nameBuf[sizeof(nameBuf) - 1] = 0;
+
+        (void) MakeComponentName(&cn, DELETE, nameBuf, sizeof(nameBuf));
+        err = VNOP_REMOVE(vol->fWriteDirVNode, vn, &cn, 0, vfs_context_current());
+        (void) vnode_put(vn);
+    }
+    return err;
+}
+
+static errno_t BenchWriteAppend(BenchVolume *vol)
+    // Appends kBenchWriteSize bytes to the append file.  All threads share 
+    // the one file, so this measures how appenders contend for its write lock.
+{
+    errno_t             err;
+    uint64_t            cursor;
+    uio_t               uio;
+    struct vnode_attr   va;
+    char                buf[kBenchWriteSize];
+
+    err = 0;
+    if (vol->fAppendVNode == NULL) {
+        err = EROFS;
+    }
+    if (err == 0) {
+        cursor = __sync_fetch_and_add(&vol->fWriteCursor, kBenchWriteSize);
+        if ( (cursor != 0) && ((cursor % kBenchAppendLimit) == 0) ) {
+            VATTR_INIT(&va);
+            VATTR_SET(&va, va_data_size, 0);
+            err = VNOP_SETATTR(vol->fAppendVNode, &va, vfs_context_current());
+        }
+    }
+    if (err == 0) {
+        memset(buf, (int) (cursor / kBenchWriteSize), sizeof(buf));
+
+        uio = uio_create(1, 0, UIO_SYSSPACE, UIO_WRITE);
+        if (uio == NULL) {
+            err = ENOMEM;
+        } else {
+            (void) uio_addiov(uio, CAST_USER_ADDR_T(buf), sizeof(buf));
+            err = VNOP_WRITE(vol->fAppendVNode, uio, IO_APPEND, vfs_context_current());
+            if ( (err == 0) && (uio_resid(uio) != 0) ) {
+                err = EIO;
+            }
+            uio_free(uio);
+        }
+    }
+    return err;
+}
+
+static errno_t BenchCreateRemove(BenchVolume *vol)
+    // Creates an empty file with a unique name and then removes it.  This 
+    // exercises the directory update paths and the file record allocator.
+{
+    errno_t     err;
+    vnode_t     vn;
+    char        name[32];
+
+    err = 0;
+    if (vol->fAppendVNode == NULL) {
+        err = EROFS;
+    }
+    if (err == 0) {
+        snprintf(name, sizeof(name), "bench-%llu", (unsigned long long) __sync_fetch_and_add(&vol->fNameCursor, 1));
+        err = CreateNameVNode(vol, name, &vn);
+    }
+    if (err == 0) {
+        (void) vnode_put(vn);
+        err = RemoveName(vol, name);
+    }
+    return err;
+}
+
+static const BenchDesc kBenchmarks[] = {
+    { "root",           BenchRoot,          "VFSOPRoot",                                                FALSE, FALSE, FALSE },
+    { "lookup-hit",     BenchLookupHit,     "VNOPLookup of a name that exists",                         FALSE, FALSE, FALSE },
+    { "namei-hit",      BenchNameiHit,      "name cache then VNOPLookup of a name that exists",         FALSE, FALSE, FALSE },
+    { "lookup-dot",     BenchLookupDot,     "VNOPLookup of \".\"",                                      FALSE, FALSE, FALSE },
+    { "lookup-dotdot",  BenchLookupDotDot,  "VNOPLookup of \"..\"",                                     FALSE, FALSE, FALSE },
+    { "lookup-miss",    BenchLookupMiss,    "VNOPLookup of a name that doesn't exist",                  FALSE, FALSE, FALSE },
+    { "namei-miss",     BenchNameiMiss,     "name cache then VNOPLookup of a name that doesn't exist",  FALSE, FALSE, FALSE },
+    { "getattr",        BenchGetattr,       "VNOPGetattr of the stat attributes",                       FALSE, FALSE, FALSE },
+    { "readdir",        BenchReadDir,       "VNOPReadDir of the whole root directory",                  FALSE, FALSE, FALSE },
+    { "readdir-paged",  BenchReadDirPaged,  "VNOPReadDir of the whole root directory, 256 bytes a call",  FALSE, FALSE, FALSE },
+    { "readdir-stat",   BenchReadDirStat,   "VNOPReadDir of the root, then lookup and getattr of each", FALSE, FALSE, FALSE },
+    { "readdirattr",    BenchReaddirattr,   "VNOPReaddirattr of the whole root directory (ls -l)",      FALSE, FALSE, FALSE },
+    { "read-seq",       BenchReadSeq,       "64 KB sequential VNOPReads of the big file, from disk",    TRUE,  FALSE, FALSE },
+    { "read-cached",    BenchReadCached,    "64 KB sequential VNOPReads of the big file, from the UBC", TRUE,  FALSE, FALSE },
+    { "mmap-seq",       BenchMmapSeq,       "map the big file and touch the next 64 KB, from disk",     TRUE,  FALSE, FALSE },
+    { "mmap-cached",    BenchMmapCached,    "map the big file and touch the next 64 KB, from the UBC",  TRUE,  FALSE, FALSE },
+    { "nfs-getattr",    BenchNFSGetattr,    "VFSOPFhtovp of the next handle, then VNOPGetattr",         FALSE, FALSE, FALSE },
+    { "nfs-readdirplus",BenchNFSReaddirplus,"extended VNOPReadDir of the root, then vget/getattr/vptofh of each", FALSE, FALSE, FALSE },
+    { "open-close",     BenchOpenClose,     "VNOPOpen followed by VNOPClose",                           FALSE, FALSE, FALSE },
+    { "statfs",         BenchStatfs,        "VFSOPGetattr of the statfs attributes",                    FALSE, FALSE, FALSE },
+    { "statfs-churn",   BenchStatfsChurn,   "statfs while changing the free block count",               FALSE, FALSE, FALSE },
+    { "crc32c-hw",      BenchChecksumHardware, "CRC-32C of 64 KB with the CPU's instructions",          FALSE, FALSE, FALSE },
+    { "crc32c-sw",      BenchChecksumSoftware, "CRC-32C of 64 KB with the table-driven fallback",       FALSE, FALSE, FALSE },
+    { "write-append",   BenchWriteAppend,   "4 KB appending VNOPWrites to a shared file (needs -w)",    TRUE,  TRUE,  FALSE },
+    { "create-remove",  BenchCreateRemove,  "VNOPCreate of a new file, then VNOPRemove (needs -w)",     FALSE, TRUE,  FALSE },
+    { "lookup-scale",   BenchLookupScale,   "VNOPLookup of a name that exists, per directory size (needs -D)", TRUE, FALSE, TRUE },
+    { "lookup-scale-miss", BenchLookupScaleMiss, "VNOPLookup of a name that doesn't exist, per directory size (needs -D)", TRUE, FALSE, TRUE },
+    { NULL,             NULL,               NULL,                                                       FALSE, FALSE, FALSE }
+};
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Benchmark Engine
+
+static void * BenchThreadMain(void *arg)
+{
+    BenchThread *   thread;
+    size_t          opIndex;
+    uint64_t        start;
+    uint64_t        end;
+    uint64_t        delta;
+
+    thread = (BenchThread *) arg;
+
+    (void) pthread_barrier_wait(thread->fBarrier);
+
+    thread->fErr = 0;
+    thread->fStart = NanoTime();
+    for (opIndex = 0; opIndex < thread->fOpCount; opIndex++) {
+        start = NanoTime();
+        thread->fErr = thread->fBench->fOp(thread->fVolume);
+        end = NanoTime();
+        if (thread->fErr != 0) {
+            break;
+        }
+        delta = end - start;
+        thread->fSamples[opIndex] = (delta > UINT32_MAX) ? UINT32_MAX : (uint32_t) delta;
+    }
+    thread->fEnd = NanoTime();
+    return NULL;
+}
+
+static int CompareSamples(const void *lhs, const void *rhs)
+{
+    uint32_t    l;
+    uint32_t    r;
+
+    l = *(const uint32_t *) lhs;
+    r = *(const uint32_t *) rhs;
+    return (l < r) ? -1 : (l > r);
+}
+
+static uint32_t Percentile(const uint32_t *sorted, size_t count, double fraction)
+{
+    size_t  index;
+
+    index = (size_t) (fraction * (double) (count - 1) + 0.5);
+    return sorted[index];
+}
+
+#define EMPTYFS_STATS_OP_NAME(name) # name,
+
+static const char * kOpNames[kEmptyFSOpCount] = {
+    EMPTYFS_STATS_OP_LIST(EMPTYFS_STATS_OP_NAME)
+};
+
+#undef EMPTYFS_STATS_OP_NAME
+
+static errno_t OpStatsSysctl(int selector, void *oldp, size_t *oldlenp, void *newp, size_t newlen)
+    // Calls the file system's sysctl entry point, as "EmptyFSStat.c" does 
+    // via sysctl.
+{
+    int     name[1];
+
+    name[0] = selector;
+    return UserKPISysctl("EmptyFS", name, 1, oldp, oldlenp, newp, newlen);
+}
+
+static void PrintOpStats(const EmptyFSStats *before, const EmptyFSStats *after, size_t totalOps)
+    // Prints the number of calls to, and average time spent in, each of the 
+    // file system's operations between before and after, per benchmark op. 
+    // This shows where the time goes in benchmarks that call more than one 
+    // operation.
+{
+    uint32_t    op;
+    uint64_t    count;
+    uint64_t    errors;
+    uint64_t    totalTime;
+
+    for (op = 0; op < kEmptyFSOpCount; op++) {
+        count     = after->fOps[op].fCount     - before->fOps[op].fCount;
+        errors    = after->fOps[op].fErrors    - before->fOps[op].fErrors;
+        totalTime = after->fOps[op].fTotalTime - before->fOps[op].fTotalTime;
+        if (count != 0) {
+            printf("%-16s %7s %-16s %8.2f calls/op %9llu ns mean %10llu errors\n", 
+                "", 
+                "", 
+                kOpNames[op], 
+                (double) count / (double) totalOps, 
+                (unsigned long long) (totalTime / count), 
+                (unsigned long long) errors
+            );
+        }
+    }
+}
+
+// BenchTraceReader is the state for a thread that reads the file system's 
+// trace buffer while a benchmark runs, as "EmptyFSStat.c -t" would.  This 
+// shows what tracing costs when someone is actually collecting the trace, 
+// and whether the reader keeps up.
+
+struct BenchTraceReader {
+    pthread_t           fThread;
+    volatile boolean_t  fStop;
+    uint64_t            fRecords;       // records read
+    uint64_t            fDropped;       // records the file system dropped because we didn't keep up
+    errno_t             fErr;
+};
+typedef struct BenchTraceReader BenchTraceReader;
+
+static void * BenchTraceReaderMain(void *arg)
+    // Reads the trace until told to stop, and then until it's empty.  When 
+    // there's nothing to read, it sleeps for a millisecond, much like a real 
+    // reader would.
+{
+    BenchTraceReader *      reader;
+    EmptyFSTraceHeader *    header;
+    size_t                  len;
+    boolean_t               stopping;
+
+    reader = (BenchTraceReader *) arg;
+
+    header = (EmptyFSTraceHeader *) malloc(kEmptyFSTraceMaxReadSize);
+    if (header == NULL) {
+        reader->fErr = ENOMEM;
+    }
+    stopping = FALSE;
+    while (reader->fErr == 0) {
+        len = kEmptyFSTraceMaxReadSize;
+        reader->fErr = OpStatsSysctl(kEmptyFSSysctlTrace, header, &len, NULL, 0);
+        if ( (reader->fErr == 0) && (header->fRecordSize != sizeof(EmptyFSTraceRecord)) ) {
+            reader->fErr = EINVAL;
+        }
+        if (reader->fErr == 0) {
+            reader->fRecords += header->fRecordCount;
+            reader->fDropped += header->fDropped;
+            if (header->fRecordCount == 0) {
+                if (stopping) {
+                    break;
+                }
+                stopping = reader->fStop;
+                if ( ! stopping ) {
+                    (void) usleep(1000);
+                }
+            }
+        }
+    }
+    free(header);
+    return NULL;
+}
+
+static errno_t RunBenchmark(BenchVolume *vol, const BenchDesc *bench, int threadCount, size_t opsPerThread)
+    // Runs bench on threadCount threads, each doing opsPerThread operations,
+    // and prints a one line summary.
+{
+    errno_t             err;
+    int                 threadIndex;
+    BenchThread *       threads;
+    uint32_t *          samples;
+    pthread_barrier_t   barrier;
+    size_t              totalOps;
+    uint64_t            start;
+    uint64_t            end;
+    uint64_t            readCountBefore;
+    uint64_t            readBytesBefore;
+    uint64_t            readCount;
+    uint64_t            readBytes;
+    uint64_t            writeCountBefore;
+    uint64_t            writeBytesBefore;
+    uint64_t            writeCount;
+    uint64_t            writeBytes;
+    EmptyFSStats        opStatsBefore;
+    EmptyFSStats        opStatsAfter;
+    size_t              opStatsSize;
+    BenchTraceReader    traceReader;
+
+    totalOps = opsPerThread * (size_t) threadCount;
+
+    vol->fReadCursor = 0;
+    vol->fHandleCursor = 0;
+    UserKPIGetDeviceReadStats(&readCountBefore, &readBytesBefore);
+    UserKPIGetDeviceWriteStats(&writeCountBefore, &writeBytesBefore);
+
+    err = 0;
+    threads = calloc((size_t) threadCount, sizeof(*threads));
+    samples = calloc(totalOps, sizeof(*samples));
+    if ( (threads == NULL) || (samples == NULL) ) {
+        err = ENOMEM;
+    }
+    if ( (err == 0) && vol->fReportOpStats ) {
+        opStatsSize = sizeof(opStatsBefore);
+        err = OpStatsSysctl(kEmptyFSSysctlStats, &opStatsBefore, &opStatsSize, NULL, 0);
+    }
+    memset(&traceReader, 0, sizeof(traceReader));
+    if ( (err == 0) && vol->fDrainTrace ) {
+        err = pthread_create(&traceReader.fThread, NULL, BenchTraceReaderMain, &traceReader);
+    }
+
+    if (err == 0) {
+        (void) pthread_barrier_init(&barrier, NULL, (unsigned) threadCount + 1);
+        for (threadIndex = 0; threadIndex < threadCount; threadIndex++) {
+            threads[threadIndex].fBarrier  = &barrier;
+            threads[threadIndex].fVolume   = vol;
+            threads[threadIndex].fBench    = bench;
+            threads[threadIndex].fOpCount  = opsPerThread;
+            threads[threadIndex].fSamples  = samples + (opsPerThread * (size_t) threadIndex);
+            (void) pthread_create(&threads[threadIndex].fThread, NULL, BenchThreadMain, &threads[threadIndex]);
+        }
+        (void) pthread_barrier_wait(&barrier);
+
+        // Throughput is measured from the first thread starting to the last 
+        // thread finishing.
+
+        start = UINT64_MAX;
+        end   = 0;
+        for (threadIndex = 0; threadIndex < threadCount; threadIndex++) {
+            (void) pthread_join(threads[threadIndex].fThread, NULL);
+            if ( (err == 0) && (threads[threadIndex].fErr != 0) ) {
+                err = threads[threadIndex].fErr;
+            }
+            if (threads[threadIndex].fStart < start) {
+                start = threads[threadIndex].fStart;
+            }
+            if (threads[threadIndex].fEnd > end) {
+                end = threads[threadIndex].fEnd;
+            }
+        }
+        (void) pthread_barrier_destroy(&barrier);
+
+        if (vol->fDrainTrace) {
+            traceReader.fStop = TRUE;
+            (void) pthread_join(traceReader.fThread, NULL);
+            if (err == 0) {
+                err = traceReader.fErr;
+            }
+        }
+
+        if (err != 0) {
+            fprintf(stderr, "%s: failed with error %d\n", bench->fName, err);
+        } else {
+            qsort(samples, totalOps, sizeof(*samples), CompareSamples);
+            printf("%-16s %7d %10zu %12.0f %9u %9u %9u %9u %9u\n",
+                bench->fName,
+                threadCount,
+                totalOps,
+                (double) totalOps / ((double) (end - start) / 1.0e9),
+                Percentile(samples, totalOps, 0.50),
+                Percentile(samples, totalOps, 0.90),
+                Percentile(samples, totalOps, 0.99),
+                Percentile(samples, totalOps, 0.999),
+                samples[totalOps - 1]
+            );
+            if (bench->fReportDeviceIO) {
+                UserKPIGetDeviceReadStats(&readCount, &readBytes);
+                readCount -= readCountBefore;
+                readBytes -= readBytesBefore;
+                printf("%-16s %7s %10llu device reads, %llu KB average\n", 
+                    "", 
+                    "", 
+                    (unsigned long long) readCount, 
+                    (unsigned long long) ( (readCount == 0) ? 0 : (readBytes / readCount) / 1024 )
+                );
+                UserKPIGetDeviceWriteStats(&writeCount, &writeBytes);
+                writeCount -= writeCountBefore;
+                writeBytes -= writeBytesBefore;
+                if (writeCount != 0) {
+                    printf("%-16s %7s %10llu device writes, %llu KB average\n", 
+                        "", 
+                        "", 
+                        (unsigned long long) writeCount, 
+                        (unsigned long long) ( (writeBytes / writeCount) / 1024 )
+                    );
+                }
+            }
+            if (vol->fReportOpStats) {
+                opStatsSize = sizeof(opStatsAfter);
+                if ( OpStatsSysctl(kEmptyFSSysctlStats, &opStatsAfter, &opStatsSize, NULL, 0) == 0 ) {
+                    PrintOpStats(&opStatsBefore, &opStatsAfter, totalOps);
+                }
+            }
+            if (vol->fDrainTrace) {
+                printf("%-16s %7s %10llu trace records, %llu dropped\n", 
+                    "", 
+                    "", 
+                    (unsigned long long) traceReader.fRecords, 
+                    (unsigned long long) traceReader.fDropped
+                );
+            }
+            fflush(stdout);
+        }
+    }
+
+    free(samples);
+    free(threads);
+
+    return err;
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Main
+
+static void PrintUsage(const char *argv0)
+    // Print a helpful help message.
+{
+    const char *        progName;
+    const BenchDesc *   bench;
+
+    progName = strrchr(argv0, '/');
+    if (progName == NULL) {
+        progName = argv0;
+    } else {
+        progName += 1;
+    }
+    fprintf(stderr, "usage: %s [ -d ] [ -s ] [ -S ] [ -T ] [ -w ] [ -D entries[,entries...] ] [ -f image ] [ -n ops-per-thread ] [ -t threads[,threads...] ] [ -v vnodes ] [ benchmark... ]\n", progName);
+    fprintf(stderr, "benchmarks:\n");
+    for (bench = kBenchmarks; bench->fName != NULL; bench++) {
+        fprintf(stderr, "  %-16s %s\n", bench->fName, bench->fDescription);
+    }
+}
+
+static const BenchDesc * FindBenchmark(const char *name)
+{
+    const BenchDesc *   bench;
+
+    for (bench = kBenchmarks; bench->fName != NULL; bench++) {
+        if (strcmp(bench->fName, name) == 0) {
+            return bench;
+        }
+    }
+    return NULL;
+}
+
+static errno_t BuildSampleImage(const char *imagePath, const uint32_t scaleCounts[], int scaleCountCount)
+    // Creates the sample volume (described above) at imagePath, along with 
+    // a directory for each of the scaleCountCount sizes in scaleCounts.
+{
+    errno_t         err;
+    errno_t         junk;
+    EmptyFSImage *  image;
+    uint32_t        dirFileNum;
+    uint32_t        scaleDirFileNum;
+    int             fileIndex;
+    char            name[32];
+    char            contents[64];
+    uint32_t *      bigFileData;
+    size_t          wordIndex;
+    int             scaleIndex;
+    uint32_t        entryIndex;
+    uint64_t        scaleTotal;
+    uint64_t        volumeSize;
+    uint32_t        fileCount;
+
+    // The default file table is too small for the big directories, so if 
+    // there are any, we size it ourselves.
+
+    scaleTotal = 0;
+    for (scaleIndex = 0; scaleIndex < scaleCountCount; scaleIndex++) {
+        scaleTotal += scaleCounts[scaleIndex];
+    }
+    volumeSize = kSampleVolumeSize + scaleTotal * kScaleBytesPerEntry;
+    fileCount  = 0;
+    if (scaleTotal != 0) {
+        fileCount = (uint32_t) (volumeSize / kEmptyFSDefaultBlockSize / 4 + scaleTotal);
+    }
+
+    image = NULL;
+    err = EmptyFSImageCreate(imagePath, volumeSize, 0, fileCount, "EmptyFS", &image);
+    for (fileIndex = 0; (err == 0) && (fileIndex < kSampleFileCount); fileIndex++) {
+        snprintf(name, sizeof(name), kSampleFileNameFormat, fileIndex);
+        snprintf(contents, sizeof(contents), "This is %s.\n", name);
+        err = EmptyFSImageAddFile(image, kEmptyFSRootFileNum, name, 0644, contents, strlen(contents), NULL);
+    }
+    if (err == 0) {
+        err = EmptyFSImageAddDirectory(image, kEmptyFSRootFileNum, kSampleDirName, 0755, &dirFileNum);
+    }
+    for (fileIndex = 0; (err == 0) && (fileIndex < kSampleSubFileCount); fileIndex++) {
+        snprintf(name, sizeof(name), kSampleFileNameFormat, fileIndex);
+        snprintf(contents, sizeof(contents), "This is %s/%s.\n", kSampleDirName, name);
+        err = EmptyFSImageAddFile(image, dirFileNum, name, 0644, contents, strlen(contents), NULL);
+    }
+
+    // Each 32-bit word of the big file holds its own offset, which makes it 
+    // easy to check that reads return the right data.
+
+    if (err == 0) {
+        bigFileData = malloc(kSampleBigFileSize);
+        if (bigFileData == NULL) {
+            err = ENOMEM;
+        } else {
+            for (wordIndex = 0; wordIndex < (kSampleBigFileSize / sizeof(uint32_t)); wordIndex++) {
+                bigFileData[wordIndex] = (uint32_t) (wordIndex * sizeof(uint32_t));
+            }
+            err = EmptyFSImageAddFile(image, kEmptyFSRootFileNum, kSampleBigFileName, 0644, bigFileData, kSampleBigFileSize, NULL);
+            free(bigFileData);
+        }
+    }
+    for (scaleIndex = 0; (err == 0) && (scaleIndex < scaleCountCount); scaleIndex++) {
+        snprintf(name, sizeof(name), kScaleDirNameFormat, (unsigned int) scaleCounts[scaleIndex]);
+        err = EmptyFSImageAddDirectory(image, dirFileNum, name, 0755, &scaleDirFileNum);
+        for (entryIndex = 0; (err == 0) && (entryIndex < scaleCounts[scaleIndex]); entryIndex++) {
+            snprintf(name, sizeof(name), kScaleFileNameFormat, (unsigned int) entryIndex);
+            err = EmptyFSImageAddFile(image, scaleDirFileNum, name, 0644, NULL, 0, NULL);
+        }
+    }
+    if (image != NULL) {
+        junk = EmptyFSImageClose(image);
+        if (err == 0) {
+            err = junk;
+        }
+    }
+    return err;
+}
+
+static errno_t RunScaledBenchmark(BenchVolume *vol, const BenchDesc *bench, int threadCount, size_t opsPerThread, uint32_t scaleCount)
+    // Runs bench, one of the lookup-scale benchmarks, against the directory 
+    // with scaleCount entries.  The directory's size goes into the name of 
+    // the benchmark, so that each size gets its own line in the summary.
+{
+    errno_t     err;
+    vnode_t     subDirVNode;
+    BenchDesc   scaledBench;
+    char        name[32];
+
+    snprintf(name, sizeof(name), kScaleDirNameFormat, (unsigned int) scaleCount);
+    subDirVNode = NULL;
+    err = LookupNameVNode(vol, kSampleDirName, 0, &subDirVNode);
+    if (err == 0) {
+        err = LookupNameInDirectory(subDirVNode, name, 0, &vol->fScaleDirVNode);
+        (void) vnode_put(subDirVNode);
+    }
+    if (err != 0) {
+        fprintf(stderr, "could not find %s: error %d\n", name, err);
+    } else {
+        vol->fScaleCount  = scaleCount;
+        vol->fScaleCursor = 0;
+
+        snprintf(name, sizeof(name), "%s/%u", bench->fName, (unsigned int) scaleCount);
+        scaledBench = *bench;
+        scaledBench.fName = name;
+        err = RunBenchmark(vol, &scaledBench, threadCount, opsPerThread);
+
+        (void) vnode_put(vol->fScaleDirVNode);
+        vol->fScaleDirVNode = NULL;
+    }
+    return err;
+}
+
+enum {
+    kMaxThreadCounts = 16
+};
+
+extern int main(int argc, char **argv)
+{
+    int                 err;
+    int                 retVal;
+    int                 ch;
+    uint32_t            debugLevel;
+    boolean_t           reportOpStats;
+    boolean_t           drainTrace;
+    boolean_t           writable;
+    const char *        imagePath;
+    size_t              opsPerThread;
+    int                 threadCounts[kMaxThreadCounts];
+    int                 threadCountCount;
+    int                 threadCountIndex;
+    uint32_t            scaleCounts[kMaxScaleCounts];
+    int                 scaleCountCount;
+    int                 scaleIndex;
+    int                 argIndex;
+    const BenchDesc *   bench;
+    EmptyFSMountArgs    mountArgs;
+    BenchVolume         vol;
+    char *              cursor;
+    char                tempImagePath[64];
+
+    // Parse command line options.
+
+    debugLevel        = 0;
+    reportOpStats     = FALSE;
+    drainTrace        = FALSE;
+    writable          = FALSE;
+    imagePath         = NULL;
+    opsPerThread      = 100000;
+    threadCounts[0]   = 1;
+    threadCountCount  = 1;
+    scaleCountCount   = 0;
+
+    retVal = EXIT_SUCCESS;
+    do {
+        ch = getopt(argc, argv, "dD:f:n:sSt:Tv:w");
+        if (ch != -1) {
+            switch (ch) {
+                case 'd':
+                    debugLevel += 1;
+                    break;
+                case 'D':
+                    scaleCountCount = 0;
+                    cursor = optarg;
+                    while ( (*cursor != 0) && (scaleCountCount < kMaxScaleCounts) ) {
+                        scaleCounts[scaleCountCount] = (uint32_t) strtoul(cursor, &cursor, 0);
+                        if (scaleCounts[scaleCountCount] == 0) {
+                            break;
+                        }
+                        scaleCountCount += 1;
+                        if (*cursor == ',') {
+                            cursor += 1;
+                        }
+                    }
+                    if ( (scaleCountCount == 0) || (*cursor != 0) ) {
+                        PrintUsage(argv[0]);
+                        retVal = EXIT_FAILURE;
+                    }
+                    break;
+                case 'f':
+                    imagePath = optarg;
+                    break;
+                case 'n':
+                    opsPerThread = strtoul(optarg, NULL, 0);
+                    break;
+                case 's':
+                    debugLevel |= kEmptyFSDebugNoFastPaths;
+                    break;
+                case 'S':
+                    reportOpStats = TRUE;
+                    break;
+                case 'T':
+                    drainTrace = TRUE;
+                    break;
+                case 't':
+                    threadCountCount = 0;
+                    cursor = optarg;
+                    while ( (*cursor != 0) && (threadCountCount < kMaxThreadCounts) ) {
+                        threadCounts[threadCountCount] = (int) strtol(cursor, &cursor, 0);
+                        if (threadCounts[threadCountCount] <= 0) {
+                            break;
+                        }
+                        threadCountCount += 1;
+                        if (*cursor == ',') {
+                            cursor += 1;
+                        }
+                    }
+                    if ( (threadCountCount == 0) || (*cursor != 0) ) {
+                        PrintUsage(argv[0]);
+                        retVal = EXIT_FAILURE;
+                    }
+                    break;
+                case 'v':
+                    UserKPISetDesiredVNodes( (int) strtol(optarg, NULL, 0) );
+                    break;
+                case 'w':
+                    writable = TRUE;
+                    break;
+                case '?':
+                default:
+                    PrintUsage(argv[0]);
+                    retVal = EXIT_FAILURE;
+                    break;
+            }
+        }
+    } while ( (ch != -1) && (retVal == EXIT_SUCCESS) );
+
+    // Reading the trace implies tracing, which is enabled by a non-zero debug level.
+    
+    if ( drainTrace && ((debugLevel & kEmptyFSDebugLevelMask) == 0) ) {
+        debugLevel += 1;
+    }
+    if ( (retVal == EXIT_SUCCESS) && (opsPerThread == 0) ) {
+        PrintUsage(argv[0]);
+        retVal = EXIT_FAILURE;
+    }
+    for (argIndex = optind; (retVal == EXIT_SUCCESS) && (argIndex < argc); argIndex++) {
+        if (FindBenchmark(argv[argIndex]) == NULL) {
+            fprintf(stderr, "%s: unknown benchmark\n", argv[argIndex]);
+            PrintUsage(argv[0]);
+            retVal = EXIT_FAILURE;
+        }
+    }
+
+    // Build the sample volume, if necessary.  If the user didn't specify an 
+    // image, we put it in a temporary file, which we delete when we're done.
+
+    tempImagePath[0] = 0;
+    if ( (retVal == EXIT_SUCCESS) && ( (imagePath == NULL) || (access(imagePath, F_OK) != 0) ) ) {
+        int     fd;
+
+        err = 0;
+        if (imagePath == NULL) {
+            strncpy(tempImagePath, "/tmp/EmptyFSBench.XXXXXX", sizeof(tempImagePath));
+            fd = mkstemp(tempImagePath);
+            if (fd < 0) {
+                err = errno;
+                tempImagePath[0] = 0;
+            } else {
+                (void) close(fd);
+                imagePath = tempImagePath;
+            }
+        }
+        if (err == 0) {
+            err = BuildSampleImage(imagePath, scaleCounts, scaleCountCount);
+        }
+        if (err != 0) {
+            fprintf(stderr, "could not build sample volume: error %d\n", err);
+            retVal = EXIT_FAILURE;
+        }
+    }
+
+    // Load the "KEXT" and mount the volume.  Unless the user asks for the 
+    // write benchmarks (-w), we mount read-only, so that the read benchmarks 
+    // measure what they always have.
+
+    memset(&vol, 0, sizeof(vol));
+    if (retVal == EXIT_SUCCESS) {
+        err = MODULE_START(NULL, NULL);
+        if (err == KERN_SUCCESS) {
+            mountArgs.fMagic        = kEmptyFSMountArgsMagic;
+            mountArgs.fDebugLevel   = debugLevel;
+            mountArgs.fForceFailure = FALSE;
+            err = UserKPIMount("EmptyFS", imagePath, "/Volumes/EmptyFS", writable ? 0 : MNT_RDONLY, &mountArgs, &vol.fMount);
+        }
+        if (err == 0) {
+            err = VFS_ROOT(vol.fMount, &vol.fRootVNode, vfs_context_current());
+        }
+        if ( (err == 0) && reportOpStats ) {
+            int     enable;
+
+            enable = TRUE;
+            err = OpStatsSysctl(kEmptyFSSysctlStatsEnable, NULL, NULL, &enable, sizeof(enable));
+            vol.fReportOpStats = TRUE;
+        }
+        vol.fDrainTrace = drainTrace;
+        if (err != 0) {
+            fprintf(stderr, "mount failed with error %d\n", err);
+            retVal = EXIT_FAILURE;
+        }
+    }
+
+    // Find the big file.  If it's not there, the read benchmarks fail, but 
+    // the rest work just fine.
+
+    if (retVal == EXIT_SUCCESS) {
+        struct vnode_attr   va;
+
+        if ( LookupNameVNode(&vol, kSampleBigFileName, 0, &vol.fBigFileVNode) == 0 ) {
+            VATTR_INIT(&va);
+            VATTR_WANTED(&va, va_data_size);
+            if ( VNOP_GETATTR(vol.fBigFileVNode, &va, vfs_context_current()) == 0 ) {
+                vol.fBigFileSize = (off_t) va.va_data_size;
+            }
+            if (vol.fBigFileSize == 0) {
+                (void) vnode_put(vol.fBigFileVNode);
+                vol.fBigFileVNode = NULL;
+            }
+        }
+    }
+
+    // Get the handles for the NFS benchmarks.
+
+    if (retVal == EXIT_SUCCESS) {
+        err = CollectHandles(&vol);
+        if (err != 0) {
+            fprintf(stderr, "could not get file handles: error %d\n", err);
+            retVal = EXIT_FAILURE;
+        }
+    }
+
+    // Create the file for the write benchmarks, removing any left over from 
+    // a previous run.
+
+    if ( (retVal == EXIT_SUCCESS) && writable ) {
+        err = LookupNameVNode(&vol, kSampleDirName, 0, &vol.fWriteDirVNode);
+        if (err == 0) {
+            (void) RemoveName(&vol, kBenchAppendName);
+            err = CreateNameVNode(&vol, kBenchAppendName, &vol.fAppendVNode);
+        }
+        if (err != 0) {
+            fprintf(stderr, "could not create %s: error %d\n", kBenchAppendName, err);
+            retVal = EXIT_FAILURE;
+        }
+    }
+
+    // Run the benchmarks.
+
+    if (retVal == EXIT_SUCCESS) {
+        printf("%-16s %7s %10s %12s %9s %9s %9s %9s %9s\n",
+            "benchmark", "threads", "ops", "ops/sec", "p50 ns", "p90 ns", "p99 ns", "p99.9 ns", "max ns"
+        );
+        for (threadCountIndex = 0; threadCountIndex < threadCountCount; threadCountIndex++) {
+            if (optind == argc) {
+                for (bench = kBenchmarks; bench->fName != NULL; bench++) {
+                    if ( bench->fNeedsWrite && (vol.fAppendVNode == NULL) ) {
+                        continue;
+                    }
+                    if (bench->fScaled) {
+                        for (scaleIndex = 0; scaleIndex < scaleCountCount; scaleIndex++) {
+                            if ( RunScaledBenchmark(&vol, bench, threadCounts[threadCountIndex], opsPerThread, scaleCounts[scaleIndex]) != 0 ) {
+                                retVal = EXIT_FAILURE;
+                            }
+                        }
+                    } else if ( RunBenchmark(&vol, bench, threadCounts[threadCountIndex], opsPerThread) != 0 ) {
+                        retVal = EXIT_FAILURE;
+                    }
+                }
+            } else {
+                for (argIndex = optind; argIndex < argc; argIndex++) {
+                    bench = FindBenchmark(argv[argIndex]);
+                    if (bench->fScaled) {
+                        for (scaleIndex = 0; scaleIndex < scaleCountCount; scaleIndex++) {
+                            if ( RunScaledBenchmark(&vol, bench, threadCounts[threadCountIndex], opsPerThread, scaleCounts[scaleIndex]) != 0 ) {
+                                retVal = EXIT_FAILURE;
+                            }
+                        }
+                    } else if ( RunBenchmark(&vol, bench, threadCounts[threadCountIndex], opsPerThread) != 0 ) {
+                        retVal = EXIT_FAILURE;
+                    }
+                }
+            }
+        }
+    }
+
+    // Clean up.
+
+    free(vol.fHandles);
+    if (vol.fAppendVNode != NULL) {
+        (void) vnode_put(vol.fAppendVNode);
+        (void) RemoveName(&vol, kBenchAppendName);
+    }
+    if (vol.fWriteDirVNode != NULL) {
+        (void) vnode_put(vol.fWriteDirVNode);
+    }
+    if (vol.fBigFileVNode != NULL) {
+        (void) vnode_put(vol.fBigFileVNode);
+    }
+    if (vol.fRootVNode != NULL) {
+        (void) vnode_put(vol.fRootVNode);
+    }
+    if (vol.fMount != NULL) {
+        err = UserKPIUnmount(vol.fMount, 0);
+        if (err == 0) {
+            err = MODULE_STOP(NULL, NULL);
+        }
+        if (err != 0) {
+            fprintf(stderr, "unmount failed with error %d\n", err);
+            retVal = EXIT_FAILURE;
+        }
+    }
+    if (tempImagePath[0] != 0) {
+        (void) unlink(tempImagePath);
+    }
+
+    return retVal;
+}
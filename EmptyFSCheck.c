@@ -0,0 +1,1870 @@
+/*
+    File:       EmptyFSCheck.c
+
+    Contains:   User-space library for checking the consistency of an EmptyFS volume.
+
+    Written by: DTS
+
+    Copyright:  Copyright (c) 2006 by Apple Computer, Inc., All Rights Reserved.
+
+    Disclaimer: IMPORTANT:  This Apple software is supplied to you by Apple Computer, Inc.
+                ("Apple") in consideration of your agreement to the following terms, and your
+                use, installation, modification or redistribution of this Apple software
+                constitutes acceptance of these terms.  If you do not agree with these terms,
+                please do not use, install, modify or redistribute this Apple software.
+
+                In consideration of your agreement to abide by the following terms, and subject
+                to these terms, Apple grants you a personal, non-exclusive license, under Apple's
+                copyrights in this original Apple software (the "Apple Software"), to use,
+                reproduce, modify and redistribute the Apple Software, with or without
+                modifications, in source and/or binary forms; provided that if you redistribute
+                the Apple Software in its entirety and without modifications, you must retain
+                this notice and the following text and disclaimers in all such redistributions of
+                the Apple Software.  Neither the name, trademarks, service marks or logos of
+                Apple Computer, Inc. may be used to endorse or promote products derived from the
+                Apple Software without specific prior written permission from Apple.  Except as
+                expressly stated in this notice, no other rights or licenses, express or implied,
+                are granted by Apple herein, including but not limited to any patent rights that
+                may be infringed by your derivative works or by other works in which the Apple
+                Software may be incorporated.
+
+                The Apple Software is provided by Apple on an "AS IS" basis.  APPLE MAKES NO
+                WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                PURPOSE, REGARDING THE APPLE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                COMBINATION WITH YOUR PRODUCTS.
+
+                IN NO EVENT SHALL APPLE BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                OF THE APPLE SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF APPLE HAS BEEN
+                ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+    Change History (most recent first):
+
+$Log$
+
+*/
+
+/////////////////////////////////////////////////////////////////////
+
+// Checker Notes
+// -------------
+// A checker has to read every piece of metadata on the volume, so on a big
+// volume it's bound by how fast it can read, and by how fast it can cross
+// check what it has read.  This one is built to do both in parallel.
+//
+// o The work is split into phases, and each phase into work items: a
+//   chunk of the file table, a directory, or a chunk of the allocation
+//   bitmap.  A pool of threads (one per CPU, by default) takes items from a
+//   shared queue, in order, until there are none left, and the next phase
+//   starts once all of them are done.
+//
+// o The file table and the bitmap are read in kCheckIOSize pieces, and each
+//   directory is read an extent (or kCheckIOSize) at a time.  Because the
+//   queue hands out file table and bitmap chunks in order, the device sees
+//   a handful of big, nearly sequential reads, rather than a read per block
+//   or per record.
+//
+// o The cross references are compact bitmaps, shared by all the threads
+//   and updated with atomic operations: one bit per block (in use according
+//   to the metadata), two bits per file record (its type, or free), one bit
+//   per file record (has a directory entry) and one more (has no links).
+//   That's about the size of the volume's own bitmap plus four bits per
+//   file, so even a volume with
+//   hundreds of millions of files can be checked in a reasonable amount of
+//   memory.  Only the initialised part of a lazy file table (see "Lazy File
+//   Table" in "EmptyFSFormat.h") needs any.
+//
+// o Rather than remember each file's parent, which would cost 32 bits per
+//   file, each thread adds a hash of (file, parent) into one of
+//   kCheckParentBuckets buckets (chosen by the parent) for each file record,
+//   and subtracts a hash of (file, directory) from the directory's bucket for
+//   each directory entry.  If every file's parent is the directory that
+//   lists it, every bucket ends up zero.  If not, we go back and check the
+//   directories in the buckets that aren't, which is only a few of them.
+//
+// The phases are:
+//
+// 1. The file table.  Each in-use record is validated, its type is noted,
+//    and its extents (and overflow blocks) are marked in the block map.  A
+//    block that's already marked belongs to two things at once.  The
+//    directories are collected for phase 2, and files with no links are
+//    noted for phase 4.
+//
+// 2. The directories, biggest first, so that a huge directory doesn't
+//    leave one thread working on its own at the end.  Each directory block
+//    is validated, and each entry must name an in-use file, of the right
+//    type, that hasn't got an entry anywhere else.  Names must be unique
+//    within the directory, and the directory's link count must be two more
+//    than its number of subdirectories.  If the directory has an index, its
+//    nodes are validated, marked in the block map, and their records must
+//    match the directory entries one for one.
+//
+// 3. The allocation bitmap, which must match the block map exactly.
+//
+// 4. The rest, on one thread: every in-use file must have a directory
+//    entry (except the root and the orphans), the parent buckets must be
+//    zero, every directory must lead back to the root, and the superblock's
+//    counts must be right.  A file with no links is an orphan (see "Orphans"
+//    in "EmptyFSFormat.h"): a free that hasn't happened yet, not a problem,
+//    as long as it's on the orphan list, and only orphans may be.
+//
+// On a volume with metadata checksums (see "Metadata Checksums" in
+// "EmptyFSFormat.h"), each structure's checksum is checked when it's first
+// read.  A bad checksum is a problem in its own right, but we carry on
+// checking the structure, because its contents may well be fine.  A file
+// with a checksum table (see "Data Checksums") has its table blocks marked
+// in phase 1, and its data is read and checked against the table there too;
+// that's the only time the checker reads file data, so it's only as slow as
+// the volume is big.
+
+#include "EmptyFSCheck.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifndef DT_DIR
+    #define DT_DIR  4
+    #define DT_REG  8
+    #define DT_LNK  10
+#endif
+
+#ifndef TRUE
+    #define TRUE    1
+    #define FALSE   0
+#endif
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Checker State
+
+enum {
+    kCheckIOSize            = 1024 * 1024,      // size of the big reads; a multiple of any block size
+    kCheckMaxMessages       = 100,              // describe this many problems, then just count them
+    kCheckParentBuckets     = 65536
+};
+
+// File types, as recorded in the type map.
+
+enum {
+    kCheckTypeFree          = 0,
+    kCheckTypeReg           = 1,
+    kCheckTypeDir           = 2,
+    kCheckTypeLnk           = 3
+};
+
+// CheckDir describes a directory found by phase 1.
+
+struct CheckDir {
+    uint32_t            fFileNum;
+    int                 fBad;               // its record or extents are corrupt, so don't look inside it
+    EmptyFSFileRecord   fRecord;            // host byte order
+};
+typedef struct CheckDir CheckDir;
+
+// CheckKey is a directory entry, as phase 2 sees it.  The key is the one
+// that the directory's index should have for the entry.
+
+struct CheckKey {
+    uint64_t            fKey;               // EmptyFSDirIndexKey
+    uint32_t            fOffset;            // byte offset of the entry within its directory block
+    uint32_t            fReserved;
+};
+typedef struct CheckKey CheckKey;
+
+typedef struct Checker Checker;
+
+// CheckThread is the per-thread state.  Each thread accumulates its counts
+// here, and they're added to the Checker's at the end of each phase, so
+// that the threads don't fight over them.
+
+struct CheckThread {
+    pthread_t           fThread;
+    Checker *           fChecker;
+    uint8_t *           fIOBuf;             // kCheckIOSize bytes
+    uint8_t *           fBlockBuf;          // one block
+    uint8_t *           fNodeBuf;           // kEmptyFSDirIndexMaxDepth blocks, one index node per level
+    EmptyFSExtent *     fExtents;           // the current file's extents
+    uint32_t            fExtentCapacity;
+    CheckKey *          fKeys;              // the current directory's entries
+    size_t              fKeyCount;
+    size_t              fKeyCapacity;
+    uint64_t *          fIndexKeys;         // the current directory's index records
+    size_t              fIndexKeyCount;
+    size_t              fIndexKeyCapacity;
+    uint32_t            fFileCount;
+    uint32_t            fDirectoryCount;
+    uint32_t            fFreeFileCount;
+    uint64_t            fFreeBlockCount;
+    uint64_t            fUsedBlockCount;
+    uint64_t            fBytesRead;
+};
+typedef struct CheckThread CheckThread;
+
+typedef int (*CheckItemProc)(CheckThread *thread, uint64_t item);
+
+struct Checker {
+    int                 fFD;
+    EmptyFSSuperblock   fSB;                // host byte order
+    uint32_t            fInitCount;         // EmptyFSFileTableInitCount
+    uint32_t            fThreadCount;
+    FILE *              fMessages;
+
+    // The cross reference maps.  These are shared by every thread, and
+    // changed only with atomic operations.
+
+    uint32_t *          fBlockMap;          // one bit per block: in use according to the metadata
+    uint32_t *          fTypeMap;           // two bits per file record, kCheckTypeXxx
+    uint32_t *          fRefMap;            // one bit per file record: has a directory entry
+    uint32_t *          fUnlinkedMap;       // one bit per file record: has no links (an orphan)
+    uint64_t *          fParentSums;        // kCheckParentBuckets; see "Checker Notes", above
+
+    pthread_mutex_t     fLock;
+    CheckItemProc       fProc;              // the current phase
+    uint64_t            fItemCount;         // number of work items in the current phase
+    uint64_t            fNextItem;          // [fLock] next one to hand out
+    int                 fError;             // [fLock] first I/O (or memory) error, which stops the check
+    uint64_t            fProblemCount;      // [fLock]
+    CheckDir *          fDirs;              // [fLock] the directories
+    uint32_t            fDirCount;          // [fLock]
+    uint32_t            fDirCapacity;       // [fLock]
+
+    // Totals, added up from the threads at the end of each phase.
+
+    uint32_t            fFileCount;
+    uint32_t            fDirectoryCount;
+    uint32_t            fFreeFileCount;
+    uint64_t            fFreeBlockCount;    // according to the on-disk bitmap
+    uint64_t            fUsedBlockCount;    // according to the block map
+    uint64_t            fBytesRead;
+};
+
+static void Problem(Checker *checker, const char *format, ...)
+    // Records a problem with the volume and, if we haven't described too
+    // many already, describes it.
+{
+    va_list     args;
+
+    (void) pthread_mutex_lock(&checker->fLock);
+    checker->fProblemCount += 1;
+    if (checker->fMessages != NULL) {
+        if (checker->fProblemCount <= kCheckMaxMessages) {
+            va_start(args, format);
+            vfprintf(checker->fMessages, format, args);
+            va_end(args);
+            fputc('\n', checker->fMessages);
+        } else if (checker->fProblemCount == (kCheckMaxMessages + 1)) {
+            fprintf(checker->fMessages, "(further problems are counted but not described)\n");
+        }
+    }
+    (void) pthread_mutex_unlock(&checker->fLock);
+}
+
+static void Heading(Checker *checker, const char *heading)
+{
+    if (checker->fMessages != NULL) {
+        fprintf(checker->fMessages, "** %s\n", heading);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Cross Reference Maps
+
+// The GCC __sync builtins are full barriers; we only need atomicity, but
+// there's nothing cheaper that's as portable.
+
+static uint64_t MarkBlocks(Checker *checker, uint64_t start, uint64_t count)
+    // Marks the blocks [start, start + count) as in use in the block map,
+    // and returns the number of them that were already marked.  The caller
+    // must have checked that they're on the volume.
+{
+    uint64_t    alreadyMarked;
+    uint64_t    word;
+    uint32_t    firstBit;
+    uint32_t    bits;
+    uint32_t    mask;
+    uint32_t    old;
+
+    assert( (start <= checker->fSB.fBlockCount) && (count <= (checker->fSB.fBlockCount - start)) );
+
+    alreadyMarked = 0;
+    while (count != 0) {
+        word     = start / 32;
+        firstBit = (uint32_t) (start % 32);
+        bits     = 32 - firstBit;
+        if (bits > count) {
+            bits = (uint32_t) count;
+        }
+        mask = (bits == 32) ? 0xFFFFFFFF : (((1U << bits) - 1) << firstBit);
+
+        old = __sync_fetch_and_or(&checker->fBlockMap[word], mask);
+        alreadyMarked += (uint64_t) __builtin_popcount(old & mask);
+
+        start += bits;
+        count -= bits;
+    }
+    return alreadyMarked;
+}
+
+static void SetFileType(Checker *checker, uint32_t fileNum, uint32_t type)
+{
+    (void) __sync_fetch_and_or(&checker->fTypeMap[fileNum / 16], type << ((fileNum % 16) * 2));
+}
+
+static uint32_t GetFileType(const Checker *checker, uint32_t fileNum)
+    // Only called once phase 1 is done, so there's nothing to race with.
+{
+    return (checker->fTypeMap[fileNum / 16] >> ((fileNum % 16) * 2)) & 3;
+}
+
+static int TestAndSetReferenced(Checker *checker, uint32_t fileNum)
+    // Marks fileNum as having a directory entry, and returns true if it
+    // already had one.
+{
+    uint32_t    mask;
+
+    mask = 1U << (fileNum % 32);
+    return (__sync_fetch_and_or(&checker->fRefMap[fileNum / 32], mask) & mask) != 0;
+}
+
+static void SetUnlinked(Checker *checker, uint32_t fileNum)
+{
+    (void) __sync_fetch_and_or(&checker->fUnlinkedMap[fileNum / 32], 1U << (fileNum % 32));
+}
+
+static int TestAndClearUnlinked(Checker *checker, uint32_t fileNum)
+    // Only called in phase 4, which is single threaded.  Returns true if
+    // fileNum was marked as having no links.
+{
+    uint32_t    mask;
+    int         result;
+
+    mask = 1U << (fileNum % 32);
+    result = (checker->fUnlinkedMap[fileNum / 32] & mask) != 0;
+    checker->fUnlinkedMap[fileNum / 32] &= ~mask;
+    return result;
+}
+
+static uint64_t ParentHash(uint32_t fileNum, uint32_t parentFileNum)
+    // A well-mixed hash of the pair; this is the finaliser from MurmurHash3.
+    // Adding these up is only a good check if a wrong pair is very unlikely
+    // to produce the same sum as the right one, which is why we don't just
+    // add the numbers.
+{
+    uint64_t    x;
+
+    x = (((uint64_t) fileNum) << 32) | parentFileNum;
+    x ^= x >> 33;
+    x *= 0xFF51AFD7ED558CCDULL;
+    x ^= x >> 33;
+    x *= 0xC4CEB9FE1A85EC53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+static void AddParent(Checker *checker, uint32_t fileNum, uint32_t parentFileNum, int isEntry)
+    // Accounts for a file record that says its parent is parentFileNum or,
+    // if isEntry is true, for an entry for fileNum in directory parentFileNum.
+{
+    uint64_t    hash;
+
+    hash = ParentHash(fileNum, parentFileNum);
+    if (isEntry) {
+        hash = 0 - hash;
+    }
+    (void) __sync_fetch_and_add(&checker->fParentSums[parentFileNum % kCheckParentBuckets], hash);
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Work Queue
+
+static int ReadBlocks(CheckThread *thread, uint64_t block, uint64_t count, void *buf)
+    // Reads count blocks, starting at block, into buf.  The caller must have
+    // checked that they're on the volume.
+{
+    int         err;
+    Checker *   checker;
+    size_t      length;
+    off_t       offset;
+    ssize_t     bytesRead;
+
+    checker = thread->fChecker;
+    assert( (block <= checker->fSB.fBlockCount) && (count <= (checker->fSB.fBlockCount - block)) );
+
+    err = 0;
+    length = (size_t) (count * checker->fSB.fBlockSize);
+    offset = (off_t) (block * checker->fSB.fBlockSize);
+    while (length != 0) {
+        bytesRead = pread(checker->fFD, buf, length, offset);
+        if (bytesRead < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            err = errno;
+            break;
+        } else if (bytesRead == 0) {
+            err = EIO;                      // the device is shorter than the volume
+            break;
+        }
+        thread->fBytesRead += (uint64_t) bytesRead;
+        buf     = ((char *) buf) + bytesRead;
+        length -= (size_t) bytesRead;
+        offset += bytesRead;
+    }
+    return err;
+}
+
+static void * CheckThreadMain(void *parameter)
+    // The body of each checker thread: take the next item from the queue,
+    // process it, and repeat until there are none left or something has
+    // gone wrong.
+{
+    int             err;
+    CheckThread *   thread;
+    Checker *       checker;
+    uint64_t        item;
+    int             haveItem;
+
+    thread  = (CheckThread *) parameter;
+    checker = thread->fChecker;
+
+    err = 0;
+    do {
+        (void) pthread_mutex_lock(&checker->fLock);
+        if ( (err != 0) && (checker->fError == 0) ) {
+            checker->fError = err;
+        }
+        haveItem = (checker->fError == 0) && (checker->fNextItem < checker->fItemCount);
+        item = 0;
+        if (haveItem) {
+            item = checker->fNextItem;
+            checker->fNextItem += 1;
+        }
+        (void) pthread_mutex_unlock(&checker->fLock);
+
+        if (haveItem) {
+            err = checker->fProc(thread, item);
+        }
+    } while (haveItem);
+
+    return NULL;
+}
+
+static int RunPhase(Checker *checker, CheckThread *threads, CheckItemProc proc, uint64_t itemCount)
+    // Runs proc for each of itemCount work items, on all of the threads, and
+    // waits for them to finish.  Returns the first error that any of them
+    // hit.  If we can't start as many threads as we wanted, we make do with
+    // the ones we've got.
+{
+    uint32_t    started;
+    uint32_t    index;
+
+    checker->fProc      = proc;
+    checker->fItemCount = itemCount;
+    checker->fNextItem  = 0;
+
+    for (started = 0; started < checker->fThreadCount; started++) {
+        if ( pthread_create(&threads[started].fThread, NULL, CheckThreadMain, &threads[started]) != 0 ) {
+            break;
+        }
+    }
+    if (started == 0) {
+        (void) CheckThreadMain(&threads[0]);
+    }
+    for (index = 0; index < started; index++) {
+        (void) pthread_join(threads[index].fThread, NULL);
+    }
+    return checker->fError;
+}
+
+static int GrowArray(void **arrayPtr, size_t *capacityPtr, size_t needed, size_t elementSize)
+    // Makes sure that the malloc'd array at *arrayPtr has room for at least
+    // needed elements.
+{
+    int         err;
+    size_t      newCapacity;
+    void *      newArray;
+
+    err = 0;
+    if (needed > *capacityPtr) {
+        newCapacity = (*capacityPtr == 0) ? 64 : *capacityPtr;
+        while (newCapacity < needed) {
+            newCapacity *= 2;
+        }
+        newArray = realloc(*arrayPtr, newCapacity * elementSize);
+        if (newArray == NULL) {
+            err = ENOMEM;
+        } else {
+            *arrayPtr    = newArray;
+            *capacityPtr = newCapacity;
+        }
+    }
+    return err;
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Phase 1: File Table
+
+static int GetExtents(CheckThread *thread, uint32_t fileNum, const EmptyFSFileRecord *rec, int mark, int report, int *badPtr)
+    // Puts all of the extents of a file, including those in overflow blocks,
+    // into thread->fExtents, checking them as it goes.  If mark is true, it
+    // marks the extents and the overflow blocks in the block map.  If it
+    // finds a problem, it sets *badPtr and, if report is true, reports it.
+    // Returns an error only for I/O and memory errors.
+{
+    int                     err;
+    Checker *               checker;
+    const EmptyFSSuperblock * sb;
+    size_t                  capacity;
+    uint32_t                extentCount;
+    uint32_t                thisCount;
+    uint32_t                index;
+    uint32_t                perBlock;
+    uint64_t                overflowBlock;
+    uint64_t                blocks;
+    EmptyFSOverflowHeader   header;
+    EmptyFSExtent *         extent;
+
+    checker = thread->fChecker;
+    sb = &checker->fSB;
+
+    capacity = thread->fExtentCapacity;
+    err = GrowArray(
+        (void **) &thread->fExtents,
+        &capacity,
+        (rec->fExtentCount > kEmptyFSInlineExtentCount) ? rec->fExtentCount : kEmptyFSInlineExtentCount,
+        sizeof(EmptyFSExtent)
+    );
+    thread->fExtentCapacity = (uint32_t) capacity;
+
+    extentCount = 0;
+    if (err == 0) {
+        extentCount = (rec->fExtentCount < kEmptyFSInlineExtentCount) ? rec->fExtentCount : kEmptyFSInlineExtentCount;
+        memcpy(thread->fExtents, rec->fExtents, extentCount * sizeof(EmptyFSExtent));
+    }
+
+    // Walk the overflow chain.  Each block holds at least one extent, so the
+    // chain can't be longer than the number of extents, even if it loops.
+
+    perBlock = EmptyFSOverflowExtentsPerBlock(sb);
+    overflowBlock = rec->fOverflowBlock;
+    while ( (err == 0) && ! *badPtr && (extentCount < rec->fExtentCount) ) {
+        if ( (overflowBlock < sb->fDataStart) || (overflowBlock >= sb->fBlockCount) ) {
+            *badPtr = TRUE;
+            if (report) {
+                Problem(checker, "file %u: overflow block %llu is outside the data area", (unsigned int) fileNum, (unsigned long long) overflowBlock);
+            }
+            break;
+        }
+        if ( mark && (MarkBlocks(checker, overflowBlock, 1) != 0) ) {
+            Problem(checker, "file %u: overflow block %llu is also used by something else", (unsigned int) fileNum, (unsigned long long) overflowBlock);
+        }
+        err = ReadBlocks(thread, overflowBlock, 1, thread->fBlockBuf);
+        if ( (err == 0) && report && (EmptyFSMetaBlockVerify(sb, overflowBlock, thread->fBlockBuf) != 0) ) {
+            Problem(checker, "file %u: overflow block %llu has a bad checksum", (unsigned int) fileNum, (unsigned long long) overflowBlock);
+        }
+        if (err == 0) {
+            memcpy(&header, thread->fBlockBuf, sizeof(header));
+            EmptyFSSwapOverflowHeader(&header);
+            thisCount = header.fExtentCount;
+            if (    (header.fMagic != kEmptyFSOverflowMagic)
+                 || (thisCount == 0)
+                 || (thisCount > perBlock)
+                 || (thisCount > (rec->fExtentCount - extentCount)) ) {
+                *badPtr = TRUE;
+                if (report) {
+                    Problem(checker, "file %u: overflow block %llu is corrupt", (unsigned int) fileNum, (unsigned long long) overflowBlock);
+                }
+            } else {
+                memcpy(&thread->fExtents[extentCount], thread->fBlockBuf + sizeof(EmptyFSOverflowHeader), thisCount * sizeof(EmptyFSExtent));
+                EmptyFSSwapExtents(&thread->fExtents[extentCount], thisCount);
+                extentCount += thisCount;
+                overflowBlock = header.fNextBlock;
+            }
+        }
+    }
+    if ( (err == 0) && ! *badPtr && (extentCount == rec->fExtentCount) && (overflowBlock != 0) && (rec->fExtentCount > kEmptyFSInlineExtentCount) ) {
+        *badPtr = TRUE;
+        if (report) {
+            Problem(checker, "file %u: overflow chain is longer than its extents", (unsigned int) fileNum);
+        }
+    }
+
+    // Check the extents themselves.  Only the extents of a compressed file
+    // may have flags, and EmptyFSCompressedExtentsValidate checks those
+    // below.
+
+    blocks = 0;
+    for (index = 0; (err == 0) && ! *badPtr && (index < extentCount); index++) {
+        extent = &thread->fExtents[index];
+        if (    (extent->fBlockCount == 0)
+             || ( (extent->fFlags != 0) && (rec->fCompressedChunkSize == 0) )
+             || (extent->fStartBlock < sb->fDataStart)
+             || (extent->fStartBlock > sb->fBlockCount)
+             || (extent->fBlockCount > (sb->fBlockCount - extent->fStartBlock)) ) {
+            *badPtr = TRUE;
+            if (report) {
+                Problem(checker, "file %u: extent %u is invalid", (unsigned int) fileNum, (unsigned int) index);
+            }
+        } else {
+            blocks += extent->fBlockCount;
+        }
+    }
+    if ( (err == 0) && ! *badPtr && (rec->fCompressedChunkSize != 0) ) {
+        if (EmptyFSCompressedExtentsValidate(sb, rec, thread->fExtents, extentCount) != 0) {
+            *badPtr = TRUE;
+            if (report) {
+                Problem(checker, "file %u: compressed extents don't match its size and block count", (unsigned int) fileNum);
+            }
+        }
+    } else if ( (err == 0) && ! *badPtr && ( (blocks != rec->fBlockCount) || (rec->fSize > (blocks * sb->fBlockSize)) ) ) {
+        *badPtr = TRUE;
+        if (report) {
+            Problem(checker, "file %u: size and block count don't match its extents", (unsigned int) fileNum);
+        }
+    }
+    for (index = 0; (err == 0) && ! *badPtr && mark && (index < extentCount); index++) {
+        extent = &thread->fExtents[index];
+        if (MarkBlocks(checker, extent->fStartBlock, extent->fBlockCount) != 0) {
+            Problem(checker, "file %u: blocks %llu..%llu are also used by something else",
+                (unsigned int) fileNum,
+                (unsigned long long) extent->fStartBlock,
+                (unsigned long long) (extent->fStartBlock + extent->fBlockCount - 1)
+            );
+        }
+    }
+    return err;
+}
+
+static int CheckChunkChecksums(CheckThread *thread, uint32_t fileNum, const EmptyFSFileRecord *rec)
+    // Marks the checksum table of a compressed file in the block map, and
+    // checks each of its extents, which GetExtents has put in
+    // thread->fExtents, against the table.  We read each extent in
+    // kCheckIOSize pieces, continuing the checksum from one to the next.
+    // We can't use thread->fIOBuf, because our caller is still walking the
+    // file table records in it.
+{
+    int         err;
+    Checker *   checker;
+    uint32_t    blockSize;
+    uint64_t    tableBlocks;
+    uint32_t *  table;
+    uint8_t *   dataBuf;
+    uint32_t    index;
+    uint32_t    badCount;
+    uint64_t    done;
+    uint64_t    count;
+    uint32_t    crc;
+
+    checker = thread->fChecker;
+    blockSize = checker->fSB.fBlockSize;
+
+    // EmptyFSFileRecordValidate checked that the table is on the volume.
+
+    tableBlocks = EmptyFSChunkChecksumBlocks(&checker->fSB, rec);
+    if (MarkBlocks(checker, rec->fChunkChecksumBlock, tableBlocks) != 0) {
+        Problem(checker, "file %u: checksum table blocks %llu..%llu are also used by something else",
+            (unsigned int) fileNum,
+            (unsigned long long) rec->fChunkChecksumBlock,
+            (unsigned long long) (rec->fChunkChecksumBlock + tableBlocks - 1)
+        );
+    }
+
+    err = 0;
+    table   = malloc( (size_t) tableBlocks * blockSize );
+    dataBuf = malloc(kCheckIOSize);
+    if ( (table == NULL) || (dataBuf == NULL) ) {
+        err = ENOMEM;
+    } else {
+        err = ReadBlocks(thread, rec->fChunkChecksumBlock, tableBlocks, table);
+    }
+    badCount = 0;
+    for (index = 0; (err == 0) && (index < rec->fExtentCount); index++) {
+        crc = 0;
+        for (done = 0; (err == 0) && (done < thread->fExtents[index].fBlockCount); done += count) {
+            count = thread->fExtents[index].fBlockCount - done;
+            if (count > (kCheckIOSize / blockSize)) {
+                count = kCheckIOSize / blockSize;
+            }
+            err = ReadBlocks(thread, thread->fExtents[index].fStartBlock + done, count, dataBuf);
+            if (err == 0) {
+                crc = EmptyFSChecksum(crc, dataBuf, (size_t) (count * blockSize));
+            }
+        }
+        if ( (err == 0) && (crc != EmptyFSSwapLE32(table[index])) ) {
+            badCount += 1;
+        }
+    }
+    if (badCount != 0) {
+        Problem(checker, "file %u: %u of its %u chunks have bad checksums", (unsigned int) fileNum, (unsigned int) badCount, (unsigned int) rec->fExtentCount);
+    }
+    free(dataBuf);
+    free(table);
+    return err;
+}
+
+static int CheckFileRecord(CheckThread *thread, uint32_t fileNum, const EmptyFSFileRecord *diskRec)
+    // Checks one in-use file record, in disk byte order.
+{
+    int                 err;
+    Checker *           checker;
+    EmptyFSFileRecord   rec;
+    int                 bad;
+    uint32_t            type;
+    CheckDir *          dir;
+    size_t              capacity;
+
+    checker = thread->fChecker;
+    rec = *diskRec;
+    EmptyFSSwapFileRecord(&rec);
+
+    err = 0;
+    bad = FALSE;
+    if (fileNum < kEmptyFSFirstFileNum) {
+        bad = TRUE;
+        Problem(checker, "file %u: reserved file record is in use", (unsigned int) fileNum);
+    } else if ( EmptyFSFileRecordValidate(&checker->fSB, &rec) != 0 ) {
+        bad = TRUE;
+        Problem(checker, "file %u: record is corrupt", (unsigned int) fileNum);
+    }
+    if ( EmptyFSFileRecordVerify(&checker->fSB, diskRec, fileNum) != 0 ) {
+        Problem(checker, "file %u: record has a bad checksum", (unsigned int) fileNum);
+    }
+
+    // Note its type and parent even if it's corrupt, so that we don't also
+    // complain about its directory entry.
+
+    switch (rec.fMode & S_IFMT) {
+        case S_IFDIR:   type = kCheckTypeDir;   break;
+        case S_IFLNK:   type = kCheckTypeLnk;   break;
+        default:        type = kCheckTypeReg;   break;
+    }
+    if (fileNum >= kEmptyFSFirstFileNum) {
+        SetFileType(checker, fileNum, type);
+        thread->fFileCount += 1;
+        if (type == kCheckTypeDir) {
+            thread->fDirectoryCount += 1;
+        }
+    }
+
+    if ( (fileNum >= kEmptyFSFirstFileNum) && (fileNum != kEmptyFSRootFileNum) ) {
+        AddParent(checker, fileNum, rec.fParentFileNum, FALSE);
+    }
+    if ( ! bad ) {
+        if ( (fileNum == kEmptyFSRootFileNum) && ( (type != kCheckTypeDir) || (rec.fParentFileNum != kEmptyFSRootFileNum) ) ) {
+            Problem(checker, "root directory record is wrong");
+        }
+        if ( (type != kCheckTypeDir) && (rec.fLinkCount == 0) ) {
+            SetUnlinked(checker, fileNum);
+        } else if ( (type != kCheckTypeDir) && (rec.fLinkCount != 1) ) {
+            Problem(checker, "file %u: link count is %u, should be 1", (unsigned int) fileNum, (unsigned int) rec.fLinkCount);
+        }
+        err = GetExtents(thread, fileNum, &rec, TRUE, TRUE, &bad);
+    }
+    if ( (err == 0) && ! bad && (rec.fChunkChecksumBlock != 0) ) {
+        err = CheckChunkChecksums(thread, fileNum, &rec);
+    }
+
+    // Remember directories for phase 2.
+
+    if ( (err == 0) && (type == kCheckTypeDir) && (fileNum >= kEmptyFSFirstFileNum) ) {
+        (void) pthread_mutex_lock(&checker->fLock);
+        capacity = checker->fDirCapacity;
+        err = GrowArray((void **) &checker->fDirs, &capacity, checker->fDirCount + 1, sizeof(CheckDir));
+        checker->fDirCapacity = (uint32_t) capacity;
+        if (err == 0) {
+            dir = &checker->fDirs[checker->fDirCount];
+            dir->fFileNum = fileNum;
+            dir->fBad     = bad;
+            dir->fRecord  = rec;
+            checker->fDirCount += 1;
+        }
+        (void) pthread_mutex_unlock(&checker->fLock);
+    }
+    return err;
+}
+
+static int CheckFileTableChunk(CheckThread *thread, uint64_t item)
+    // Checks the item'th kCheckIOSize piece of the initialised part of the
+    // file table.
+{
+    int                         err;
+    Checker *                   checker;
+    uint32_t                    perBlock;
+    uint32_t                    perChunk;
+    uint32_t                    firstFileNum;
+    uint32_t                    fileCount;
+    uint32_t                    index;
+    uint64_t                    blockCount;
+    const EmptyFSFileRecord *   rec;
+
+    checker = thread->fChecker;
+    perBlock = EmptyFSFileRecordsPerBlock(&checker->fSB);
+    perChunk = (kCheckIOSize / checker->fSB.fBlockSize) * perBlock;
+
+    firstFileNum = (uint32_t) (item * perChunk);
+    fileCount = checker->fInitCount - firstFileNum;
+    if (fileCount > perChunk) {
+        fileCount = perChunk;
+    }
+    blockCount = (fileCount + perBlock - 1) / perBlock;
+
+    err = ReadBlocks(thread, checker->fSB.fFileTableStart + (firstFileNum / perBlock), blockCount, thread->fIOBuf);
+    for (index = 0; (err == 0) && (index < fileCount); index++) {
+        rec = (const EmptyFSFileRecord *) (thread->fIOBuf + ((size_t) index * kEmptyFSFileRecordSize));
+        if (rec->fMode != 0) {
+            err = CheckFileRecord(thread, firstFileNum + index, rec);
+        } else if ( (firstFileNum + index) >= kEmptyFSFirstFileNum ) {
+            thread->fFreeFileCount += 1;
+        }
+    }
+    return err;
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Phase 2: Directories
+
+static int CompareKeys(const void *lhs, const void *rhs)
+{
+    uint64_t    l;
+    uint64_t    r;
+
+    l = ((const CheckKey *) lhs)->fKey;
+    r = ((const CheckKey *) rhs)->fKey;
+    return (l < r) ? -1 : (l > r) ? 1 : 0;
+}
+
+static int CompareIndexKeys(const void *lhs, const void *rhs)
+{
+    uint64_t    l;
+    uint64_t    r;
+
+    l = *(const uint64_t *) lhs;
+    r = *(const uint64_t *) rhs;
+    return (l < r) ? -1 : (l > r) ? 1 : 0;
+}
+
+static int CheckDirEntry(CheckThread *thread, const CheckDir *dir, uint64_t logicalBlock, const uint8_t *block, const EmptyFSDirEntry *entry, uint32_t *subdirCountPtr)
+    // Checks one used directory entry, in directory block logicalBlock of
+    // dir, and adds it to thread->fKeys.
+{
+    int         err;
+    Checker *   checker;
+    uint32_t    fileNum;
+    uint32_t    nameLen;
+    uint32_t    type;
+    uint32_t    wantType;
+    size_t      capacity;
+    CheckKey *  key;
+
+    checker = thread->fChecker;
+    fileNum = EmptyFSSwapLE32(entry->fFileNum);
+    nameLen = entry->fNameLength;
+
+    if (    (memchr(entry->fName, '/', nameLen) != NULL)
+         || (memchr(entry->fName, 0,   nameLen) != NULL)
+         || ( (nameLen == 1) && (entry->fName[0] == '.') )
+         || ( (nameLen == 2) && (entry->fName[0] == '.') && (entry->fName[1] == '.') ) ) {
+        Problem(checker, "directory %u: entry for file %u has an invalid name", (unsigned int) dir->fFileNum, (unsigned int) fileNum);
+    }
+
+    if ( (fileNum < kEmptyFSFirstFileNum) || (fileNum == kEmptyFSRootFileNum) || (fileNum >= checker->fInitCount) ) {
+        Problem(checker, "directory %u: entry \"%.*s\" refers to invalid file %u", (unsigned int) dir->fFileNum, (int) nameLen, entry->fName, (unsigned int) fileNum);
+    } else {
+        type = GetFileType(checker, fileNum);
+        switch (entry->fType) {
+            case DT_DIR:    wantType = kCheckTypeDir;   break;
+            case DT_LNK:    wantType = kCheckTypeLnk;   break;
+            case DT_REG:    wantType = kCheckTypeReg;   break;
+            default:        wantType = kCheckTypeFree;  break;
+        }
+        if (type == kCheckTypeFree) {
+            Problem(checker, "directory %u: entry \"%.*s\" refers to free file %u", (unsigned int) dir->fFileNum, (int) nameLen, entry->fName, (unsigned int) fileNum);
+        } else {
+            if (type != wantType) {
+                Problem(checker, "directory %u: entry \"%.*s\" has the wrong type", (unsigned int) dir->fFileNum, (int) nameLen, entry->fName);
+            }
+            if ( TestAndSetReferenced(checker, fileNum) ) {
+                Problem(checker, "file %u has more than one directory entry", (unsigned int) fileNum);
+            }
+            if (type == kCheckTypeDir) {
+                *subdirCountPtr += 1;
+            }
+            AddParent(checker, fileNum, dir->fFileNum, TRUE);
+        }
+    }
+
+    // Remember the entry for the duplicate name and index checks.
+
+    capacity = thread->fKeyCapacity;
+    err = GrowArray((void **) &thread->fKeys, &capacity, thread->fKeyCount + 1, sizeof(CheckKey));
+    thread->fKeyCapacity = capacity;
+    if (err == 0) {
+        key = &thread->fKeys[thread->fKeyCount];
+        key->fKey      = EmptyFSDirIndexKey(EmptyFSDirNameHash(&checker->fSB, entry->fName, nameLen), logicalBlock);
+        key->fOffset   = (uint32_t) (((const uint8_t *) entry) - block);
+        key->fReserved = 0;
+        thread->fKeyCount += 1;
+    }
+    return err;
+}
+
+static int ReadDirEntry(CheckThread *thread, const CheckDir *dir, const CheckKey *key, uint8_t *block, const EmptyFSDirEntry **entryPtr)
+    // Reads the directory block that holds the entry described by key into
+    // block, and returns the entry.  thread->fExtents must hold the
+    // directory's extents.  The block was valid when we first read it, and
+    // nothing changes the volume while we check it.
+{
+    int         err;
+    uint64_t    physicalBlock;
+
+    err = EmptyFSExtentMap(thread->fExtents, dir->fRecord.fExtentCount, EmptyFSDirIndexKeyBlock(key->fKey), &physicalBlock, NULL);
+    if (err == 0) {
+        err = ReadBlocks(thread, physicalBlock, 1, block);
+    }
+    if (err == 0) {
+        *entryPtr = (const EmptyFSDirEntry *) (block + key->fOffset);
+    }
+    return err;
+}
+
+static int CheckDuplicateNames(CheckThread *thread, const CheckDir *dir)
+    // thread->fKeys holds the directory's entries, sorted by key.  Entries
+    // with the same name have the same hash, and so are next to each other
+    // (or nearly so), so we only compare names within runs of equal hashes,
+    // which are rare.
+{
+    int                     err;
+    Checker *               checker;
+    size_t                  runStart;
+    size_t                  index;
+    size_t                  other;
+    uint8_t *               otherBlock;
+    const EmptyFSDirEntry * entry;
+    const EmptyFSDirEntry * otherEntry;
+
+    checker = thread->fChecker;
+    otherBlock = thread->fNodeBuf;          // not in use during this check
+
+    err = 0;
+    runStart = 0;
+    for (index = 1; (err == 0) && (index <= thread->fKeyCount); index++) {
+        if ( (index < thread->fKeyCount) && (EmptyFSDirIndexKeyHash(thread->fKeys[index].fKey) == EmptyFSDirIndexKeyHash(thread->fKeys[runStart].fKey)) ) {
+            continue;
+        }
+        for ( ; (err == 0) && ((runStart + 1) < index); runStart++) {
+            err = ReadDirEntry(thread, dir, &thread->fKeys[runStart], thread->fBlockBuf, &entry);
+            for (other = runStart + 1; (err == 0) && (other < index); other++) {
+                err = ReadDirEntry(thread, dir, &thread->fKeys[other], otherBlock, &otherEntry);
+                if (    (err == 0)
+                     && (entry->fNameLength == otherEntry->fNameLength)
+                     && (memcmp(entry->fName, otherEntry->fName, entry->fNameLength) == 0) ) {
+                    Problem(checker, "directory %u: name \"%.*s\" appears more than once", (unsigned int) dir->fFileNum, (int) entry->fNameLength, entry->fName);
+                }
+            }
+        }
+        runStart = index;
+    }
+    return err;
+}
+
+static int CheckIndexNode(
+    CheckThread *       thread,
+    const CheckDir *    dir,
+    uint64_t            nodeBlock,
+    uint32_t            depth,
+    uint32_t            wantLevel,
+    uint64_t            lowKey,
+    uint64_t            highKey,
+    uint64_t            dirBlockCount,
+    int *               badPtr
+)
+    // Checks the directory index node at nodeBlock, which is depth levels
+    // below the root and, unless it's the root, should be at level wantLevel,
+    // and then its children.  Every key in it must lie within [lowKey,
+    // highKey].  The records of leaves are added to thread->fIndexKeys.  If
+    // the node is corrupt, we report it, set *badPtr, and don't look any
+    // further.  Levels strictly decrease on the way down, so this recursion
+    // is at most kEmptyFSDirIndexMaxDepth deep.
+{
+    int                             err;
+    Checker *                       checker;
+    uint8_t *                       node;
+    const EmptyFSDirIndexHeader *   header;
+    const EmptyFSDirIndexRecord *   records;
+    uint32_t                        level;
+    uint32_t                        count;
+    uint32_t                        index;
+    uint64_t                        key;
+    uint64_t                        childLow;
+    uint64_t                        childHigh;
+    size_t                          capacity;
+
+    checker = thread->fChecker;
+    assert(depth < kEmptyFSDirIndexMaxDepth);
+    node = thread->fNodeBuf + ((size_t) depth * checker->fSB.fBlockSize);
+
+    err = 0;
+    if ( (nodeBlock < checker->fSB.fDataStart) || (nodeBlock >= checker->fSB.fBlockCount) ) {
+        Problem(checker, "directory %u: index node %llu is outside the data area", (unsigned int) dir->fFileNum, (unsigned long long) nodeBlock);
+        *badPtr = TRUE;
+    } else {
+        if (MarkBlocks(checker, nodeBlock, 1) != 0) {
+            Problem(checker, "directory %u: index node %llu is also used by something else", (unsigned int) dir->fFileNum, (unsigned long long) nodeBlock);
+        }
+        err = ReadBlocks(thread, nodeBlock, 1, node);
+        if ( (err == 0) && (EmptyFSMetaBlockVerify(&checker->fSB, nodeBlock, node) != 0) ) {
+            Problem(checker, "directory %u: index node %llu has a bad checksum", (unsigned int) dir->fFileNum, (unsigned long long) nodeBlock);
+        }
+    }
+    if ( (err == 0) && ! *badPtr ) {
+        header  = (const EmptyFSDirIndexHeader *) node;
+        records = EmptyFSDirIndexRecords(node);
+        level = EmptyFSSwapLE16(header->fLevel);
+        count = EmptyFSSwapLE16(header->fCount);
+        if (    (EmptyFSDirIndexNodeValidate(&checker->fSB, node) != 0)
+             || ( (depth != 0) && (level != wantLevel) )
+             || ( (depth != 0) && (count == 0) )
+             || ( (depth + level) >= kEmptyFSDirIndexMaxDepth ) ) {
+            Problem(checker, "directory %u: index node %llu is corrupt", (unsigned int) dir->fFileNum, (unsigned long long) nodeBlock);
+            *badPtr = TRUE;
+        }
+
+        // A leaf's keys must lie within the bounds, and name a block of the
+        // directory.  An interior node's keys (except the first, which is
+        // ignored) must lie within the bounds, and set the bounds for their
+        // children.
+
+        for (index = 0; (err == 0) && ! *badPtr && (index < count); index++) {
+            key = EmptyFSSwapLE64(records[index].fKey);
+            if (    ( (level == 0) || (index != 0) )
+                 && ( (key < lowKey) || (key > highKey) || ( (level == 0) && (EmptyFSDirIndexKeyBlock(key) >= dirBlockCount) ) ) ) {
+                Problem(checker, "directory %u: index node %llu has a record out of order", (unsigned int) dir->fFileNum, (unsigned long long) nodeBlock);
+                *badPtr = TRUE;
+            } else if (level == 0) {
+                capacity = thread->fIndexKeyCapacity;
+                err = GrowArray((void **) &thread->fIndexKeys, &capacity, thread->fIndexKeyCount + 1, sizeof(uint64_t));
+                thread->fIndexKeyCapacity = capacity;
+                if (err == 0) {
+                    thread->fIndexKeys[thread->fIndexKeyCount] = key;
+                    thread->fIndexKeyCount += 1;
+                }
+            } else {
+                childLow  = (index == 0) ? lowKey : key;
+                childHigh = ((index + 1) < count) ? EmptyFSSwapLE64(records[index + 1].fKey) : highKey;
+                err = CheckIndexNode(thread, dir, EmptyFSSwapLE64(records[index].fChild), depth + 1, level - 1, childLow, childHigh, dirBlockCount, badPtr);
+
+                // Our node buffer is untouched by the recursion, which uses
+                // the next one down.
+            }
+        }
+    }
+    return err;
+}
+
+static int CheckIndex(CheckThread *thread, const CheckDir *dir, uint64_t dirBlockCount)
+    // Checks the directory's index, and then checks that its records match
+    // the directory's entries, which are in thread->fKeys, sorted.
+{
+    int         err;
+    Checker *   checker;
+    int         bad;
+    size_t      entryIndex;
+    size_t      indexIndex;
+    uint64_t    missing;
+    uint64_t    extra;
+
+    checker = thread->fChecker;
+    thread->fIndexKeyCount = 0;
+
+    bad = FALSE;
+    err = CheckIndexNode(thread, dir, dir->fRecord.fDirIndexBlock, 0, 0, 0, UINT64_MAX, dirBlockCount, &bad);
+    if ( (err == 0) && ! bad ) {
+
+        // The leaves should already be in order, but equal hashes can be
+        // in any block order, so sort them to be sure.
+
+        if (thread->fIndexKeyCount != 0) {
+            qsort(thread->fIndexKeys, thread->fIndexKeyCount, sizeof(uint64_t), CompareIndexKeys);
+        }
+
+        missing = 0;
+        extra   = 0;
+        entryIndex = 0;
+        indexIndex = 0;
+        while ( (entryIndex < thread->fKeyCount) || (indexIndex < thread->fIndexKeyCount) ) {
+            if ( (indexIndex == thread->fIndexKeyCount) || ( (entryIndex < thread->fKeyCount) && (thread->fKeys[entryIndex].fKey < thread->fIndexKeys[indexIndex]) ) ) {
+                missing += 1;
+                entryIndex += 1;
+            } else if ( (entryIndex == thread->fKeyCount) || (thread->fIndexKeys[indexIndex] < thread->fKeys[entryIndex].fKey) ) {
+                extra += 1;
+                indexIndex += 1;
+            } else {
+                entryIndex += 1;
+                indexIndex += 1;
+            }
+        }
+        if ( (missing != 0) || (extra != 0) ) {
+            Problem(checker, "directory %u: index doesn't match its entries (%llu missing, %llu extra)",
+                (unsigned int) dir->fFileNum,
+                (unsigned long long) missing,
+                (unsigned long long) extra
+            );
+        }
+    }
+    return err;
+}
+
+static int CheckDirectory(CheckThread *thread, uint64_t item)
+    // Checks the item'th directory.
+{
+    int                     err;
+    Checker *               checker;
+    const CheckDir *        dir;
+    uint32_t                blockSize;
+    uint64_t                dirBlockCount;
+    uint64_t                logicalBlock;
+    uint64_t                physicalBlock;
+    uint64_t                contig;
+    uint64_t                blockIndex;
+    uint32_t                subdirCount;
+    const uint8_t *         block;
+    const EmptyFSDirEntry * entry;
+    int                     bad;
+
+    checker = thread->fChecker;
+    dir = &checker->fDirs[item];
+    blockSize = checker->fSB.fBlockSize;
+    thread->fKeyCount = 0;
+
+    err = 0;
+    bad = dir->fBad;
+    dirBlockCount = dir->fRecord.fSize / blockSize;
+    if ( ! bad && ( ((dir->fRecord.fSize % blockSize) != 0) || (dirBlockCount > dir->fRecord.fBlockCount) ) ) {
+        Problem(checker, "directory %u: size is wrong", (unsigned int) dir->fFileNum);
+        bad = TRUE;
+    }
+    if ( ! bad ) {
+        err = GetExtents(thread, dir->fFileNum, &dir->fRecord, FALSE, FALSE, &bad);
+    }
+
+    // Read the directory a run of contiguous blocks at a time, and check
+    // each entry.
+
+    subdirCount = 0;
+    logicalBlock = 0;
+    while ( (err == 0) && ! bad && (logicalBlock < dirBlockCount) ) {
+        err = EmptyFSExtentMap(thread->fExtents, dir->fRecord.fExtentCount, logicalBlock, &physicalBlock, &contig);
+        assert(err == 0);                   // GetExtents checked that there are enough blocks
+        if (contig > (dirBlockCount - logicalBlock)) {
+            contig = dirBlockCount - logicalBlock;
+        }
+        if (contig > (kCheckIOSize / blockSize)) {
+            contig = kCheckIOSize / blockSize;
+        }
+        err = ReadBlocks(thread, physicalBlock, contig, thread->fIOBuf);
+        for (blockIndex = 0; (err == 0) && (blockIndex < contig); blockIndex++) {
+            block = thread->fIOBuf + (size_t) (blockIndex * blockSize);
+            if ( EmptyFSDirBlockValidate(block, blockSize) != 0 ) {
+                Problem(checker, "directory %u: block %llu is corrupt", (unsigned int) dir->fFileNum, (unsigned long long) (logicalBlock + blockIndex));
+                continue;
+            }
+            if ( EmptyFSMetaBlockVerify(&checker->fSB, physicalBlock + blockIndex, block) != 0 ) {
+                Problem(checker, "directory %u: block %llu has a bad checksum", (unsigned int) dir->fFileNum, (unsigned long long) (logicalBlock + blockIndex));
+            }
+            entry = NULL;
+            while ( (err == 0) && ((entry = EmptyFSDirBlockNextEntry(block, blockSize, entry)) != NULL) ) {
+                if (entry->fFileNum != 0) {
+                    err = CheckDirEntry(thread, dir, logicalBlock + blockIndex, block, entry, &subdirCount);
+                }
+            }
+        }
+        logicalBlock += contig;
+    }
+
+    if ( (err == 0) && ! bad ) {
+        if (dir->fRecord.fLinkCount != (2 + subdirCount)) {
+            Problem(checker, "directory %u: link count is %u, should be %u",
+                (unsigned int) dir->fFileNum,
+                (unsigned int) dir->fRecord.fLinkCount,
+                (unsigned int) (2 + subdirCount)
+            );
+        }
+        if (thread->fKeyCount != 0) {
+            qsort(thread->fKeys, thread->fKeyCount, sizeof(CheckKey), CompareKeys);
+        }
+        err = CheckDuplicateNames(thread, dir);
+    }
+    if ( (err == 0) && ! bad && (dir->fRecord.fDirIndexBlock != 0) ) {
+        err = CheckIndex(thread, dir, dirBlockCount);
+    }
+    return err;
+}
+
+static int CompareDirsBySize(const void *lhs, const void *rhs)
+    // Biggest first.
+{
+    uint64_t    l;
+    uint64_t    r;
+
+    l = ((const CheckDir *) lhs)->fRecord.fBlockCount;
+    r = ((const CheckDir *) rhs)->fRecord.fBlockCount;
+    return (l > r) ? -1 : (l < r) ? 1 : 0;
+}
+
+static int CompareDirsByFileNum(const void *lhs, const void *rhs)
+{
+    uint32_t    l;
+    uint32_t    r;
+
+    l = ((const CheckDir *) lhs)->fFileNum;
+    r = ((const CheckDir *) rhs)->fFileNum;
+    return (l < r) ? -1 : (l > r) ? 1 : 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Phase 3: Allocation Bitmap
+
+static void ReportBlockRun(Checker *checker, uint64_t start, uint64_t end, int inUse)
+{
+    if (inUse) {
+        Problem(checker, "blocks %llu..%llu are in use but marked free", (unsigned long long) start, (unsigned long long) (end - 1));
+    } else {
+        Problem(checker, "blocks %llu..%llu are marked in use but not used", (unsigned long long) start, (unsigned long long) (end - 1));
+    }
+}
+
+static int CheckBitmapChunk(CheckThread *thread, uint64_t item)
+    // Compares the item'th kCheckIOSize piece of the allocation bitmap with
+    // the block map.  Mismatched blocks are reported as runs, so a chunk's
+    // worth of bad bitmap is one problem rather than millions.
+{
+    int                 err;
+    Checker *           checker;
+    const EmptyFSSuperblock * sb;
+    uint64_t            blocksPerChunk;
+    uint64_t            firstBitmapBlock;
+    uint64_t            bitmapBlocks;
+    uint64_t            firstBlock;
+    uint64_t            endBlock;
+    uint64_t            wordCount;
+    uint64_t            wordIndex;
+    uint64_t            block;
+    uint32_t            disk;
+    uint32_t            map;
+    uint32_t            valid;
+    uint32_t            bit;
+    uint64_t            runStart;
+    int                 runInUse;
+    int                 inUse;
+
+    checker = thread->fChecker;
+    sb = &checker->fSB;
+    blocksPerChunk = kCheckIOSize / sb->fBlockSize;
+
+    firstBitmapBlock = item * blocksPerChunk;
+    bitmapBlocks = sb->fBitmapBlocks - firstBitmapBlock;
+    if (bitmapBlocks > blocksPerChunk) {
+        bitmapBlocks = blocksPerChunk;
+    }
+    err = ReadBlocks(thread, sb->fBitmapStart + firstBitmapBlock, bitmapBlocks, thread->fIOBuf);
+
+    if (err == 0) {
+        firstBlock = firstBitmapBlock * sb->fBlockSize * 8;
+        endBlock   = firstBlock + (bitmapBlocks * sb->fBlockSize * 8);
+        if (endBlock > sb->fBlockCount) {
+            endBlock = sb->fBlockCount;
+        }
+        wordCount = (endBlock > firstBlock) ? ((endBlock - firstBlock + 31) / 32) : 0;
+
+        runStart = 0;
+        runInUse = FALSE;
+        for (wordIndex = 0; wordIndex < wordCount; wordIndex++) {
+            block = firstBlock + (wordIndex * 32);
+
+            // The bitmap is little endian, least significant bit first, so
+            // each 32-bit little endian word covers the same blocks as a
+            // word of the block map.
+
+            disk = EmptyFSSwapLE32( ((const uint32_t *) thread->fIOBuf)[wordIndex] );
+            map  = checker->fBlockMap[block / 32];
+            valid = ((endBlock - block) >= 32) ? 0xFFFFFFFF : ((1U << (endBlock - block)) - 1);
+
+            // Count the free blocks as the KEXT does, from fDataStart on.
+
+            if ( (block + 32) <= sb->fDataStart ) {
+                // all metadata
+            } else if (block >= sb->fDataStart) {
+                thread->fFreeBlockCount += (uint64_t) __builtin_popcount(~disk & valid);
+            } else {
+                thread->fFreeBlockCount += (uint64_t) __builtin_popcount(~disk & valid & ~((1U << (sb->fDataStart - block)) - 1));
+            }
+            thread->fUsedBlockCount += (uint64_t) __builtin_popcount(map & valid);
+
+            if ( ((disk ^ map) & valid) == 0 ) {
+                if (runStart != 0) {
+                    ReportBlockRun(checker, runStart, block, runInUse);
+                    runStart = 0;
+                }
+                continue;
+            }
+            for (bit = 0; bit < 32; bit++) {
+                inUse = ((map >> bit) & 1) != 0;
+                if ( ! ((valid >> bit) & 1) || ( ((disk >> bit) & 1) == ((map >> bit) & 1) ) ) {
+                    if (runStart != 0) {
+                        ReportBlockRun(checker, runStart, block + bit, runInUse);
+                        runStart = 0;
+                    }
+                } else if ( (runStart == 0) || (runInUse != inUse) ) {
+                    if (runStart != 0) {
+                        ReportBlockRun(checker, runStart, block + bit, runInUse);
+                    }
+                    runStart = block + bit;     // block 0 is always metadata, so 0 means no run
+                    runInUse = inUse;
+                }
+            }
+        }
+        if (runStart != 0) {
+            ReportBlockRun(checker, runStart, endBlock, runInUse);
+        }
+    }
+    return err;
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Phase 4: Connectivity and Counts
+
+static const CheckDir * FindDir(const Checker *checker, uint32_t fileNum)
+    // Finds a directory in checker->fDirs, which must be sorted by file
+    // number.  Returns NULL if fileNum isn't a directory.
+{
+    uint32_t    low;
+    uint32_t    high;
+    uint32_t    mid;
+
+    low  = 0;
+    high = checker->fDirCount;
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        if (checker->fDirs[mid].fFileNum < fileNum) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return ( (low < checker->fDirCount) && (checker->fDirs[low].fFileNum == fileNum) ) ? &checker->fDirs[low] : NULL;
+}
+
+static int FindParentMismatches(CheckThread *thread)
+    // Some parent buckets aren't zero, so some file's parent isn't the
+    // directory that lists it.  Go back over the directories in those
+    // buckets (the directory that lists such a file always falls into one)
+    // and check each entry's file record directly.  This reads a file
+    // record per entry, but only for a few directories.
+{
+    int                     err;
+    Checker *               checker;
+    const CheckDir *        dir;
+    uint32_t                dirIndex;
+    int                     bad;
+    uint64_t                logicalBlock;
+    uint64_t                physicalBlock;
+    uint32_t                blockSize;
+    const EmptyFSDirEntry * entry;
+    uint32_t                fileNum;
+    uint64_t                recBlock;
+    uint32_t                recOffset;
+    EmptyFSFileRecord       rec;
+    uint64_t                found;
+
+    checker = thread->fChecker;
+    blockSize = checker->fSB.fBlockSize;
+
+    err = 0;
+    found = 0;
+    for (dirIndex = 0; (err == 0) && (dirIndex < checker->fDirCount); dirIndex++) {
+        dir = &checker->fDirs[dirIndex];
+        if ( dir->fBad || (checker->fParentSums[dir->fFileNum % kCheckParentBuckets] == 0) ) {
+            continue;
+        }
+        bad = FALSE;
+        err = GetExtents(thread, dir->fFileNum, &dir->fRecord, FALSE, FALSE, &bad);
+        for (logicalBlock = 0; (err == 0) && ! bad && (logicalBlock < (dir->fRecord.fSize / blockSize)); logicalBlock++) {
+            if ( EmptyFSExtentMap(thread->fExtents, dir->fRecord.fExtentCount, logicalBlock, &physicalBlock, NULL) != 0 ) {
+                break;
+            }
+            err = ReadBlocks(thread, physicalBlock, 1, thread->fIOBuf);
+            if ( (err != 0) || (EmptyFSDirBlockValidate(thread->fIOBuf, blockSize) != 0) ) {
+                continue;
+            }
+            entry = NULL;
+            while ( (err == 0) && ((entry = EmptyFSDirBlockNextEntry(thread->fIOBuf, blockSize, entry)) != NULL) ) {
+                fileNum = EmptyFSSwapLE32(entry->fFileNum);
+                if ( (fileNum < kEmptyFSFirstFileNum) || (fileNum >= checker->fInitCount) || (GetFileType(checker, fileNum) == kCheckTypeFree) ) {
+                    continue;
+                }
+                EmptyFSFileRecordLocation(&checker->fSB, fileNum, &recBlock, &recOffset);
+                err = ReadBlocks(thread, recBlock, 1, thread->fBlockBuf);
+                if (err == 0) {
+                    memcpy(&rec, thread->fBlockBuf + recOffset, sizeof(rec));
+                    EmptyFSSwapFileRecord(&rec);
+                    if (rec.fParentFileNum != dir->fFileNum) {
+                        found += 1;
+                        Problem(checker, "file %u: is in directory %u, but its parent is %u",
+                            (unsigned int) fileNum,
+                            (unsigned int) dir->fFileNum,
+                            (unsigned int) rec.fParentFileNum
+                        );
+                    }
+                }
+            }
+        }
+    }
+
+    // Every way for the sums not to balance should show up above, but if
+    // we somehow didn't find anything, say something anyway.
+
+    if ( (err == 0) && (found == 0) ) {
+        Problem(checker, "some files' parents don't match the directories that list them");
+    }
+    return err;
+}
+
+static void CheckConnectivity(Checker *checker)
+    // Every directory must lead back to the root by following its parents.
+    // checker->fDirs must be sorted by file number.  We follow each chain
+    // until we get to the root, or to a directory whose answer we already
+    // know, marking each directory on the way in state[] as kWalking, and
+    // then walk it again recording kReachable or kUnreachable.  A directory
+    // with a corrupt record has already been reported, so we count it as
+    // reachable rather than complain about everything below it too.
+{
+    enum {
+        kUnknown        = 0,
+        kWalking        = 1,
+        kReachable      = 2,
+        kUnreachable    = 3
+    };
+    uint32_t            dirIndex;
+    const CheckDir *    dir;
+    const CheckDir *    next;
+    uint8_t *           state;
+    uint8_t             answer;
+
+    state = calloc(checker->fDirCount, sizeof(uint8_t));
+    if (state == NULL) {
+        return;                             // not worth failing the check for
+    }
+
+    for (dirIndex = 0; dirIndex < checker->fDirCount; dirIndex++) {
+
+        // Walk up until we know the answer.
+
+        dir = &checker->fDirs[dirIndex];
+        answer = kUnknown;
+        while (answer == kUnknown) {
+            if (state[dir - checker->fDirs] >= kReachable) {
+                answer = state[dir - checker->fDirs];
+            } else if ( (dir->fFileNum == kEmptyFSRootFileNum) || dir->fBad ) {
+                answer = kReachable;
+            } else if (state[dir - checker->fDirs] == kWalking) {
+                answer = kUnreachable;      // a loop
+            } else {
+                state[dir - checker->fDirs] = kWalking;
+                next = FindDir(checker, dir->fRecord.fParentFileNum);
+                if (next == NULL) {
+                    answer = kUnreachable;
+                } else {
+                    dir = next;
+                }
+            }
+        }
+
+        // Walk up again, recording the answer.  We stop at the first
+        // directory that already has one, which, for a loop, is where we
+        // came in.
+
+        dir = &checker->fDirs[dirIndex];
+        while ( (dir != NULL) && (state[dir - checker->fDirs] < kReachable) ) {
+            state[dir - checker->fDirs] = answer;
+            if ( (dir->fFileNum == kEmptyFSRootFileNum) || dir->fBad ) {
+                break;
+            }
+            if (answer == kUnreachable) {
+                Problem(checker, "directory %u is not connected to the root", (unsigned int) dir->fFileNum);
+            }
+            dir = FindDir(checker, dir->fRecord.fParentFileNum);
+        }
+    }
+    free(state);
+}
+
+static int ReadFileRecord(CheckThread *thread, uint32_t fileNum, EmptyFSFileRecord *rec)
+    // Reads a file record, in host byte order, that phase 1 has already
+    // checked.
+{
+    int         err;
+    uint64_t    recBlock;
+    uint32_t    recOffset;
+
+    EmptyFSFileRecordLocation(&thread->fChecker->fSB, fileNum, &recBlock, &recOffset);
+    err = ReadBlocks(thread, recBlock, 1, thread->fBlockBuf);
+    if (err == 0) {
+        memcpy(rec, thread->fBlockBuf + recOffset, sizeof(*rec));
+        EmptyFSSwapFileRecord(rec);
+    }
+    return err;
+}
+
+static void AccountForOrphan(Checker *checker, uint32_t fileNum, const EmptyFSFileRecord *rec)
+    // An orphan has no directory entry, and that's fine, so we mark it as
+    // having one, and balance its parent's bucket as the entry would have.
+    // If it does have one, its link count is wrong.
+{
+    if ( TestAndSetReferenced(checker, fileNum) ) {
+        Problem(checker, "file %u: link count is 0, but it's in a directory", (unsigned int) fileNum);
+    } else {
+        AddParent(checker, fileNum, rec->fParentFileNum, TRUE);
+    }
+}
+
+static int CheckReferencesAndCounts(CheckThread *thread)
+    // The serial part of the check.
+{
+    int                 err;
+    Checker *           checker;
+    uint32_t            fileNum;
+    uint32_t            bucket;
+    int                 parentsMatch;
+    int                 clean;
+    uint32_t            freeFiles;
+    uint32_t            orphanCount;
+    EmptyFSFileRecord   rec;
+
+    checker = thread->fChecker;
+    clean = (checker->fSB.fState & kEmptyFSStateClean) != 0;
+
+    // Walk the orphan list, taking each file on it out of the unlinked map.
+    // Anything that's not in the map (a file with links, a free record, or
+    // one we've already seen, which would make the list a loop) means the
+    // list is damaged.  If the volume wasn't cleanly unmounted, the head of
+    // the list may only be in the journal, so we don't look at it, and take
+    // every file with no links as an orphan instead.
+
+    err = 0;
+    orphanCount = 0;
+    fileNum = clean ? checker->fSB.fOrphanFileNum : 0;
+    while ( (err == 0) && (fileNum != 0) ) {
+        if ( (fileNum >= checker->fInitCount) || ! TestAndClearUnlinked(checker, fileNum) ) {
+            Problem(checker, "orphan list is damaged at file %u", (unsigned int) fileNum);
+            break;
+        }
+        err = ReadFileRecord(thread, fileNum, &rec);
+        if (err == 0) {
+            AccountForOrphan(checker, fileNum, &rec);
+            orphanCount += 1;
+            fileNum = rec.fNextOrphan;
+        }
+    }
+
+    // Every in-use file but the root and the orphans must have a directory
+    // entry.  We can skip whole words of the type map that are all free.  A
+    // file without an entry leaves its parent's bucket unbalanced, so we
+    // read its record and balance it, rather than report the same problem
+    // twice.
+
+    for (fileNum = kEmptyFSFirstFileNum; (err == 0) && (fileNum < checker->fInitCount); fileNum++) {
+        if ( ((fileNum % 16) == 0) && (checker->fTypeMap[fileNum / 16] == 0) ) {
+            fileNum += 15;
+            continue;
+        }
+        if ( TestAndClearUnlinked(checker, fileNum) ) {
+            if (clean) {
+                Problem(checker, "file %u has no links, but isn't on the orphan list", (unsigned int) fileNum);
+            } else {
+                orphanCount += 1;
+            }
+            err = ReadFileRecord(thread, fileNum, &rec);
+            if (err == 0) {
+                AccountForOrphan(checker, fileNum, &rec);
+            }
+        } else if (    (GetFileType(checker, fileNum) != kCheckTypeFree)
+                    && (fileNum != kEmptyFSRootFileNum)
+                    && ! ((checker->fRefMap[fileNum / 32] >> (fileNum % 32)) & 1) ) {
+            Problem(checker, "file %u is not in any directory", (unsigned int) fileNum);
+
+            err = ReadFileRecord(thread, fileNum, &rec);
+            if (err == 0) {
+                AddParent(checker, fileNum, rec.fParentFileNum, TRUE);
+            }
+        }
+    }
+
+    parentsMatch = TRUE;
+    for (bucket = 0; bucket < kCheckParentBuckets; bucket++) {
+        if (checker->fParentSums[bucket] != 0) {
+            parentsMatch = FALSE;
+        }
+    }
+    if ( (err == 0) && ! parentsMatch ) {
+        err = FindParentMismatches(thread);
+    }
+
+    if (err == 0) {
+        CheckConnectivity(checker);
+
+        // The counts are only up to date in the superblock if the volume
+        // was cleanly unmounted.  Records beyond the initialised part of
+        // the file table are free.
+
+        freeFiles = checker->fFreeFileCount + (checker->fSB.fFileCount - checker->fInitCount);
+        if ( ! clean ) {
+            if (checker->fMessages != NULL) {
+                fprintf(checker->fMessages, "volume was not cleanly unmounted; not checking its counts\n");
+            }
+        } else {
+            if (checker->fFreeBlockCount != checker->fSB.fFreeBlockCount) {
+                Problem(checker, "free block count is %llu, should be %llu", (unsigned long long) checker->fSB.fFreeBlockCount, (unsigned long long) checker->fFreeBlockCount);
+            }
+            if (freeFiles != checker->fSB.fFreeFileCount) {
+                Problem(checker, "free file count is %u, should be %u", (unsigned int) checker->fSB.fFreeFileCount, (unsigned int) freeFiles);
+            }
+            if (checker->fDirectoryCount != checker->fSB.fDirectoryCount) {
+                Problem(checker, "directory count is %u, should be %u", (unsigned int) checker->fSB.fDirectoryCount, (unsigned int) checker->fDirectoryCount);
+            }
+        }
+
+        // The orphans still count as in use, which is what the superblock
+        // says too, until they're freed.
+
+        if ( (orphanCount != 0) && (checker->fMessages != NULL) ) {
+            fprintf(checker->fMessages, "%u orphaned files will be freed when the volume is next mounted\n", (unsigned int) orphanCount);
+        }
+    }
+    return err;
+}
+
+static int CheckJournalHeader(CheckThread *thread)
+{
+    int                     err;
+    Checker *               checker;
+    EmptyFSJournalHeader    header;
+
+    checker = thread->fChecker;
+    err = ReadBlocks(thread, checker->fSB.fJournalStart, 1, thread->fBlockBuf);
+    if (err == 0) {
+        memcpy(&header, thread->fBlockBuf, sizeof(header));
+        if ( EmptyFSJournalHeaderChecksum(&header) != EmptyFSSwapLE32(header.fChecksum) ) {
+            Problem(checker, "journal header checksum is wrong");
+        } else {
+            EmptyFSSwapJournalHeader(&header);
+            if ( EmptyFSJournalHeaderValidate(&checker->fSB, &header) != 0 ) {
+                Problem(checker, "journal header is corrupt");
+            }
+        }
+    }
+    return err;
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Checking a Volume
+
+static void MergeThreadCounts(Checker *checker, CheckThread *threads)
+    // Adds each thread's counts to the checker's totals, and zeroes them.
+{
+    uint32_t        index;
+    CheckThread *   thread;
+
+    for (index = 0; index < checker->fThreadCount; index++) {
+        thread = &threads[index];
+        checker->fFileCount         += thread->fFileCount;
+        checker->fDirectoryCount    += thread->fDirectoryCount;
+        checker->fFreeFileCount     += thread->fFreeFileCount;
+        checker->fFreeBlockCount    += thread->fFreeBlockCount;
+        checker->fUsedBlockCount    += thread->fUsedBlockCount;
+        checker->fBytesRead         += thread->fBytesRead;
+        thread->fFileCount          = 0;
+        thread->fDirectoryCount     = 0;
+        thread->fFreeFileCount      = 0;
+        thread->fFreeBlockCount     = 0;
+        thread->fUsedBlockCount     = 0;
+        thread->fBytesRead          = 0;
+    }
+}
+
+extern int EmptyFSCheckVolume(
+    int                     fd,
+    uint32_t                threadCount,
+    FILE *                  messages,
+    EmptyFSCheckResults *   results
+)
+    // See comment in header.
+{
+    int                 err;
+    Checker             checker;
+    CheckThread *       threads;
+    uint32_t            index;
+    uint64_t            itemCount;
+    size_t              blockMapBytes;
+    size_t              fileMapWords;
+    int                 sbChecksumBad;
+
+    assert(fd >= 0);
+    assert( (threadCount >= 1) && (threadCount <= kEmptyFSCheckMaxThreads) );
+    assert(results != NULL);
+
+    memset(&checker, 0, sizeof(checker));
+    checker.fFD          = fd;
+    checker.fThreadCount = threadCount;
+    checker.fMessages    = messages;
+    threads = NULL;
+    sbChecksumBad = FALSE;
+
+    err = pthread_mutex_init(&checker.fLock, NULL);
+    if (err == 0) {
+        threads = calloc(threadCount, sizeof(*threads));
+        if (threads == NULL) {
+            err = ENOMEM;
+        }
+    }
+
+    // Read the superblock.  We need it to set up the per-thread buffers, so
+    // we read it directly.
+
+    if (err == 0) {
+        if ( pread(fd, &checker.fSB, sizeof(checker.fSB), kEmptyFSSuperblockOffset) != (ssize_t) sizeof(checker.fSB) ) {
+            err = EIO;
+        }
+    }
+    if (err == 0) {
+        sbChecksumBad = (EmptyFSSuperblockVerify(&checker.fSB) != 0);
+        EmptyFSSwapSuperblock(&checker.fSB);
+        err = EmptyFSSuperblockValidate(&checker.fSB);
+    }
+    if (err == 0) {
+        checker.fInitCount = EmptyFSFileTableInitCount(&checker.fSB);
+        if (messages != NULL) {
+            fprintf(messages, "** Checking EmptyFS volume \"%s\"\n", checker.fSB.fVolumeName);
+        }
+        if (sbChecksumBad) {
+            Problem(&checker, "superblock has a bad checksum");
+        }
+    }
+
+    // Allocate the maps and the per-thread buffers.
+
+    if (err == 0) {
+        blockMapBytes = (size_t) ((checker.fSB.fBlockCount + 31) / 32) * sizeof(uint32_t);
+        fileMapWords  = ((size_t) checker.fInitCount + 31) / 32;
+        checker.fBlockMap    = calloc(1, blockMapBytes);
+        checker.fTypeMap     = calloc(fileMapWords * 2, sizeof(uint32_t));
+        checker.fRefMap      = calloc(fileMapWords, sizeof(uint32_t));
+        checker.fUnlinkedMap = calloc(fileMapWords, sizeof(uint32_t));
+        checker.fParentSums  = calloc(kCheckParentBuckets, sizeof(uint64_t));
+        if (    (checker.fBlockMap    == NULL) || (checker.fTypeMap     == NULL) || (checker.fRefMap      == NULL)
+             || (checker.fUnlinkedMap == NULL) || (checker.fParentSums  == NULL) ) {
+            err = ENOMEM;
+        }
+    }
+    for (index = 0; (err == 0) && (index < threadCount); index++) {
+        threads[index].fChecker  = &checker;
+        threads[index].fIOBuf    = malloc(kCheckIOSize);
+        threads[index].fBlockBuf = malloc(checker.fSB.fBlockSize);
+        threads[index].fNodeBuf  = malloc((size_t) kEmptyFSDirIndexMaxDepth * checker.fSB.fBlockSize);
+        if ( (threads[index].fIOBuf == NULL) || (threads[index].fBlockBuf == NULL) || (threads[index].fNodeBuf == NULL) ) {
+            err = ENOMEM;
+        }
+    }
+
+    // The superblock, bitmap, file table and journal are always in use.
+
+    if (err == 0) {
+        (void) MarkBlocks(&checker, 0, checker.fSB.fDataStart);
+        if (checker.fSB.fROCompatFeatures & kEmptyFSROCompatJournal) {
+            err = CheckJournalHeader(&threads[0]);
+        }
+    }
+
+    // Phase 1.
+
+    if (err == 0) {
+        Heading(&checker, "Checking the file table");
+        itemCount = ( (uint64_t) checker.fInitCount + ((kCheckIOSize / kEmptyFSFileRecordSize) - 1) ) / (kCheckIOSize / kEmptyFSFileRecordSize);
+        err = RunPhase(&checker, threads, CheckFileTableChunk, itemCount);
+        MergeThreadCounts(&checker, threads);
+    }
+    if ( (err == 0) && (GetFileType(&checker, kEmptyFSRootFileNum) != kCheckTypeDir) ) {
+        Problem(&checker, "root directory is missing");
+    }
+
+    // Phase 2.
+
+    if (err == 0) {
+        Heading(&checker, "Checking directories");
+        if (checker.fDirCount != 0) {
+            qsort(checker.fDirs, checker.fDirCount, sizeof(CheckDir), CompareDirsBySize);
+        }
+        err = RunPhase(&checker, threads, CheckDirectory, checker.fDirCount);
+        MergeThreadCounts(&checker, threads);
+    }
+
+    // Phase 3.
+
+    if (err == 0) {
+        Heading(&checker, "Checking the allocation bitmap");
+        itemCount = (checker.fSB.fBitmapBlocks + (kCheckIOSize / checker.fSB.fBlockSize) - 1) / (kCheckIOSize / checker.fSB.fBlockSize);
+        err = RunPhase(&checker, threads, CheckBitmapChunk, itemCount);
+        MergeThreadCounts(&checker, threads);
+    }
+
+    // Phase 4.
+
+    if (err == 0) {
+        Heading(&checker, "Checking connectivity and counts");
+        if (checker.fDirCount != 0) {
+            qsort(checker.fDirs, checker.fDirCount, sizeof(CheckDir), CompareDirsByFileNum);
+        }
+        err = CheckReferencesAndCounts(&threads[0]);
+        MergeThreadCounts(&checker, threads);
+    }
+
+    if (err == 0) {
+        results->fProblemCount   = checker.fProblemCount;
+        results->fFileCount      = checker.fFileCount;
+        results->fDirectoryCount = checker.fDirectoryCount;
+        results->fUsedBlockCount = checker.fUsedBlockCount;
+        results->fBytesRead      = checker.fBytesRead;
+    }
+
+    // Clean up.
+
+    if (threads != NULL) {
+        for (index = 0; index < threadCount; index++) {
+            free(threads[index].fIOBuf);
+            free(threads[index].fBlockBuf);
+            free(threads[index].fNodeBuf);
+            free(threads[index].fExtents);
+            free(threads[index].fKeys);
+            free(threads[index].fIndexKeys);
+        }
+        free(threads);
+    }
+    free(checker.fDirs);
+    free(checker.fBlockMap);
+    free(checker.fTypeMap);
+    free(checker.fRefMap);
+    free(checker.fUnlinkedMap);
+    free(checker.fParentSums);
+    (void) pthread_mutex_destroy(&checker.fLock);
+
+    return err;
+}
@@ -0,0 +1,102 @@
+/*
+    File:       EmptyFSCheck.h
+
+    Contains:   User-space library for checking the consistency of an EmptyFS volume.
+
+    Written by: DTS
+
+    Copyright:  Copyright (c) 2006 by Apple Computer, Inc., All Rights Reserved.
+
+    Disclaimer: IMPORTANT:  This Apple software is supplied to you by Apple Computer, Inc.
+                ("Apple") in consideration of your agreement to the following terms, and your
+                use, installation, modification or redistribution of this Apple software
+                constitutes acceptance of these terms.  If you do not agree with these terms,
+                please do not use, install, modify or redistribute this Apple software.
+
+                In consideration of your agreement to abide by the following terms, and subject
+                to these terms, Apple grants you a personal, non-exclusive license, under Apple's
+                copyrights in this original Apple software (the "Apple Software"), to use,
+                reproduce, modify and redistribute the Apple Software, with or without
+                modifications, in source and/or binary forms; provided that if you redistribute
+                the Apple Software in its entirety and without modifications, you must retain
+                this notice and the following text and disclaimers in all such redistributions of
+                the Apple Software.  Neither the name, trademarks, service marks or logos of
+                Apple Computer, Inc. may be used to endorse or promote products derived from the
+                Apple Software without specific prior written permission from Apple.  Except as
+                expressly stated in this notice, no other rights or licenses, express or implied,
+                are granted by Apple herein, including but not limited to any patent rights that
+                may be infringed by your derivative works or by other works in which the Apple
+                Software may be incorporated.
+
+                The Apple Software is provided by Apple on an "AS IS" basis.  APPLE MAKES NO
+                WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                PURPOSE, REGARDING THE APPLE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                COMBINATION WITH YOUR PRODUCTS.
+
+                IN NO EVENT SHALL APPLE BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                OF THE APPLE SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF APPLE HAS BEEN
+                ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+    Change History (most recent first):
+
+$Log$
+
+*/
+
+#ifndef _EMPTYFSCHECK_H_
+#define _EMPTYFSCHECK_H_
+
+// EmptyFSCheck is a user-space library that checks the consistency of an
+// EmptyFS volume.  It's the engine behind fsck_EmptyFS ("FsckEmptyFS.c"),
+// and "EmptyFSCheckBench.c" uses it to measure how long a check takes.
+//
+// The check only reads the volume.  It's split into phases (the file table,
+// then the directories, then the allocation bitmap), and each phase is split
+// into work items that a pool of threads takes from a shared queue, so a
+// check of a big volume keeps every CPU and the disk busy.  See the comments
+// at the top of "EmptyFSCheck.c" for the details.
+//
+// All routines return an errno-style error.
+
+#include "EmptyFSFormat.h"
+
+#include <stdio.h>
+
+struct EmptyFSCheckResults {
+    uint64_t    fProblemCount;          // number of inconsistencies found
+    uint32_t    fFileCount;             // in-use file records, including the root directory
+    uint32_t    fDirectoryCount;        // ditto, directories only
+    uint64_t    fUsedBlockCount;        // blocks used by metadata, files and directories
+    uint64_t    fBytesRead;             // from the device
+};
+typedef struct EmptyFSCheckResults EmptyFSCheckResults;
+
+enum {
+    kEmptyFSCheckMaxThreads = 64
+};
+
+extern int  EmptyFSCheckVolume(
+    int                     fd,
+    uint32_t                threadCount,
+    FILE *                  messages,
+    EmptyFSCheckResults *   results
+);
+    // Checks the volume on the device or image file open for reading on fd,
+    // using threadCount threads (1..kEmptyFSCheckMaxThreads).  If messages
+    // isn't NULL, this prints a heading for each phase, and a description of
+    // each problem it finds (up to a limit), to it.  It doesn't replay the
+    // journal; if the volume wasn't cleanly unmounted, replay it first (by
+    // opening it for writing with EmptyFSImageOpen), or expect the counts in
+    // the superblock not to be checked.
+    //
+    // Returns EINVAL if fd doesn't hold an EmptyFS volume, ENOTSUP if it's a
+    // version we don't understand, or an I/O error.  Otherwise it returns 0
+    // and fills out *results; a volume is consistent only if
+    // results->fProblemCount is zero.
+
+#endif
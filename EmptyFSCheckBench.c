@@ -0,0 +1,322 @@
+/*
+    File:       EmptyFSCheckBench.c
+
+    Contains:   Benchmark for the EmptyFS consistency checker.
+
+    Written by: DTS
+
+    Copyright:  Copyright (c) 2006 by Apple Computer, Inc., All Rights Reserved.
+
+    Disclaimer: IMPORTANT:  This Apple software is supplied to you by Apple Computer, Inc.
+                ("Apple") in consideration of your agreement to the following terms, and your
+                use, installation, modification or redistribution of this Apple software
+                constitutes acceptance of these terms.  If you do not agree with these terms,
+                please do not use, install, modify or redistribute this Apple software.
+
+                In consideration of your agreement to abide by the following terms, and subject
+                to these terms, Apple grants you a personal, non-exclusive license, under Apple's
+                copyrights in this original Apple software (the "Apple Software"), to use,
+                reproduce, modify and redistribute the Apple Software, with or without
+                modifications, in source and/or binary forms; provided that if you redistribute
+                the Apple Software in its entirety and without modifications, you must retain
+                this notice and the following text and disclaimers in all such redistributions of
+                the Apple Software.  Neither the name, trademarks, service marks or logos of
+                Apple Computer, Inc. may be used to endorse or promote products derived from the
+                Apple Software without specific prior written permission from Apple.  Except as
+                expressly stated in this notice, no other rights or licenses, express or implied,
+                are granted by Apple herein, including but not limited to any patent rights that
+                may be infringed by your derivative works or by other works in which the Apple
+                Software may be incorporated.
+
+                The Apple Software is provided by Apple on an "AS IS" basis.  APPLE MAKES NO
+                WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                PURPOSE, REGARDING THE APPLE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                COMBINATION WITH YOUR PRODUCTS.
+
+                IN NO EVENT SHALL APPLE BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                OF THE APPLE SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF APPLE HAS BEEN
+                ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+    Change History (most recent first):
+
+$Log$
+
+*/
+
+/////////////////////////////////////////////////////////////////////
+
+// This program measures how long the checker library ("EmptyFSCheck.c")
+// takes to check synthetic volumes of increasing size, with different
+// numbers of threads.  It uses the image library ("EmptyFSImage.c") to
+// build each volume: one small file for every kBytesPerFile bytes of volume,
+// in directories of kFilesPerDirectory files, which is big enough for them
+// to be indexed.  It then checks each volume with each thread count in turn,
+// and prints a table of the results.
+//
+// The images are plain files, so after the first check they're likely to be
+// in the host's page cache; the numbers measure the checker more than the
+// disk.  To measure a real device, format it with newfs_EmptyFS, fill it, and
+// time fsck_EmptyFS instead.
+
+// System interfaces
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <unistd.h>
+
+// The image and checker libraries
+
+#include "EmptyFSImage.h"
+#include "EmptyFSCheck.h"
+
+#ifndef TRUE
+    #define TRUE    1
+    #define FALSE   0
+#endif
+
+enum {
+    kBytesPerFile       = 64 * 1024,
+    kFilesPerDirectory  = 1024,
+    kMaxSizes           = 16,
+    kMaxThreadCounts    = 16
+};
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Building and Checking
+
+static int BuildImage(const char *path, uint64_t volumeSize, uint32_t *fileCountPtr, uint32_t *dirCountPtr)
+    // Creates a synthetic volume of volumeSize bytes at path.
+{
+    int             err;
+    EmptyFSImage *  image;
+    uint32_t        fileCount;
+    uint32_t        dirCount;
+    uint32_t        dirFileNum;
+    uint32_t        index;
+    char            name[32];
+
+    fileCount = (uint32_t) (volumeSize / kBytesPerFile);
+    dirCount  = 0;
+    dirFileNum = 0;
+
+    (void) unlink(path);
+    err = EmptyFSImageCreate(path, volumeSize, 0, 0, "Bench", &image);
+    if (err == 0) {
+        for (index = 0; (err == 0) && (index < fileCount); index++) {
+            if ( (index % kFilesPerDirectory) == 0 ) {
+                snprintf(name, sizeof(name), "dir-%u", (unsigned int) dirCount);
+                err = EmptyFSImageAddDirectory(image, kEmptyFSRootFileNum, name, 0755, &dirFileNum);
+                dirCount += 1;
+            }
+            if (err == 0) {
+                snprintf(name, sizeof(name), "file-%u", (unsigned int) index);
+                err = EmptyFSImageAddFile(image, dirFileNum, name, 0644, name, strlen(name), NULL);
+            }
+        }
+        if (err == 0) {
+            err = EmptyFSImageClose(image);
+        } else {
+            (void) EmptyFSImageClose(image);
+        }
+    }
+    if (err == 0) {
+        *fileCountPtr = fileCount;
+        *dirCountPtr  = dirCount;
+    }
+    return err;
+}
+
+static int TimeCheck(const char *path, uint32_t threadCount, double *secondsPtr, EmptyFSCheckResults *results)
+    // Checks the volume at path with threadCount threads, and returns how
+    // long it took.  It's an error for the volume to have any problems.
+{
+    int         err;
+    int         fd;
+    double      start;
+
+    start = EmptyFSImageNow();
+    err = 0;
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        err = errno;
+    }
+    if (err == 0) {
+        err = EmptyFSCheckVolume(fd, threadCount, NULL, results);
+        (void) close(fd);
+    }
+    if ( (err == 0) && (results->fProblemCount != 0) ) {
+        fprintf(stderr, "%s: %llu problems\n", path, (unsigned long long) results->fProblemCount);
+        err = EIO;
+    }
+    if (err == 0) {
+        *secondsPtr = EmptyFSImageNow() - start;
+    }
+    return err;
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Main
+
+static int ParseList(char *str, uint64_t *values, uint32_t maxCount, uint32_t *countPtr, int sizes)
+    // Parses a comma-separated list of sizes (if sizes is true) or numbers.
+{
+    int         err;
+    char *      item;
+    char *      end;
+    uint32_t    count;
+
+    err = 0;
+    count = 0;
+    while ( (err == 0) && ((item = strsep(&str, ",")) != NULL) ) {
+        if (count == maxCount) {
+            err = EINVAL;
+        } else if (sizes) {
+            err = EmptyFSImageParseSize(item, &values[count]);
+        } else {
+            values[count] = strtoull(item, &end, 0);
+            if ( (*end != 0) || (values[count] < 1) || (values[count] > kEmptyFSCheckMaxThreads) ) {
+                err = EINVAL;
+            }
+        }
+        count += 1;
+    }
+    *countPtr = count;
+    return err;
+}
+
+static void PrintUsage(const char *argv0)
+    // Print a helpful help message.
+{
+    const char *    progName;
+
+    progName = strrchr(argv0, '/');
+    if (progName == NULL) {
+        progName = argv0;
+    } else {
+        progName += 1;
+    }
+    fprintf(stderr, "usage: %s [ -s sizes ] [ -t thread-counts ] [ -d directory ] [ -k ]\n", progName);
+    fprintf(stderr, "  -s sizes          comma-separated volume sizes (k, m, g or t suffix); default 256m,1g,4g\n");
+    fprintf(stderr, "  -t thread-counts  comma-separated thread counts; default 1,2,4,8\n");
+    fprintf(stderr, "  -d directory      where to put the images; default /tmp\n");
+    fprintf(stderr, "  -k                keep the images\n");
+}
+
+extern int main(int argc, char **argv)
+{
+    int                     err;
+    int                     retVal;
+    int                     ch;
+    char                    defaultSizes[]   = "256m,1g,4g";
+    char                    defaultThreads[] = "1,2,4,8";
+    char *                  sizeList;
+    char *                  threadList;
+    const char *            directory;
+    int                     keep;
+    uint64_t                sizes[kMaxSizes];
+    uint32_t                sizeCount;
+    uint64_t                threadCounts[kMaxThreadCounts];
+    uint32_t                threadCountCount;
+    uint32_t                sizeIndex;
+    uint32_t                threadIndex;
+    char                    path[1024];
+    uint32_t                fileCount;
+    uint32_t                dirCount;
+    double                  start;
+    double                  buildSeconds;
+    double                  seconds;
+    EmptyFSCheckResults     results;
+
+    // Parse command line options.
+
+    sizeList   = defaultSizes;
+    threadList = defaultThreads;
+    directory  = "/tmp";
+    keep       = FALSE;
+
+    retVal = EXIT_SUCCESS;
+    do {
+        ch = getopt(argc, argv, "d:ks:t:");
+        if (ch != -1) {
+            switch (ch) {
+                case 'd':
+                    directory = optarg;
+                    break;
+                case 'k':
+                    keep = TRUE;
+                    break;
+                case 's':
+                    sizeList = optarg;
+                    break;
+                case 't':
+                    threadList = optarg;
+                    break;
+                case '?':
+                default:
+                    retVal = EXIT_FAILURE;
+                    break;
+            }
+        }
+    } while ( (ch != -1) && (retVal == EXIT_SUCCESS) );
+
+    if ( (retVal == EXIT_SUCCESS) && (argc != optind) ) {
+        retVal = EXIT_FAILURE;
+    }
+    if (retVal == EXIT_SUCCESS) {
+        if (    (ParseList(sizeList,   sizes,        kMaxSizes,        &sizeCount,        TRUE ) != 0)
+             || (ParseList(threadList, threadCounts, kMaxThreadCounts, &threadCountCount, FALSE) != 0) ) {
+            retVal = EXIT_FAILURE;
+        }
+    }
+    if (retVal != EXIT_SUCCESS) {
+        PrintUsage(argv[0]);
+    }
+
+    // Build each volume, and check it with each thread count.
+
+    if (retVal == EXIT_SUCCESS) {
+        printf("%10s %10s %8s %8s %10s %10s %10s\n", "size (MB)", "files", "dirs", "threads", "build (s)", "check (s)", "MB/s");
+        for (sizeIndex = 0; (retVal == EXIT_SUCCESS) && (sizeIndex < sizeCount); sizeIndex++) {
+            snprintf(path, sizeof(path), "%s/EmptyFSCheckBench-%llu.img", directory, (unsigned long long) sizes[sizeIndex]);
+
+            start = EmptyFSImageNow();
+            err = BuildImage(path, sizes[sizeIndex], &fileCount, &dirCount);
+            buildSeconds = EmptyFSImageNow() - start;
+
+            for (threadIndex = 0; (err == 0) && (threadIndex < threadCountCount); threadIndex++) {
+                err = TimeCheck(path, (uint32_t) threadCounts[threadIndex], &seconds, &results);
+                if (err == 0) {
+                    printf("%10llu %10u %8u %8u %10.3f %10.3f %10.1f\n",
+                        (unsigned long long) (sizes[sizeIndex] >> 20),
+                        (unsigned int) fileCount,
+                        (unsigned int) dirCount,
+                        (unsigned int) threadCounts[threadIndex],
+                        buildSeconds,
+                        seconds,
+                        ((double) results.fBytesRead / (1024.0 * 1024.0)) / seconds
+                    );
+                    fflush(stdout);
+                }
+            }
+            if ( ! keep ) {
+                (void) unlink(path);
+            }
+            if (err != 0) {
+                errno = err;
+                perror(path);
+                retVal = EXIT_FAILURE;
+            }
+        }
+    }
+
+    return retVal;
+}
@@ -0,0 +1,1711 @@
+/*
+    File:       EmptyFSFormat.c
+
+    Contains:   Byte swapping and validation of EmptyFS on-disk structures.
+
+    Written by: DTS
+
+    Copyright:  Copyright (c) 2006 by Apple Computer, Inc., All Rights Reserved.
+
+    Disclaimer: IMPORTANT:  This Apple software is supplied to you by Apple Computer, Inc.
+                ("Apple") in consideration of your agreement to the following terms, and your
+                use, installation, modification or redistribution of this Apple software
+                constitutes acceptance of these terms.  If you do not agree with these terms,
+                please do not use, install, modify or redistribute this Apple software.
+
+                In consideration of your agreement to abide by the following terms, and subject
+                to these terms, Apple grants you a personal, non-exclusive license, under Apple's
+                copyrights in this original Apple software (the "Apple Software"), to use,
+                reproduce, modify and redistribute the Apple Software, with or without
+                modifications, in source and/or binary forms; provided that if you redistribute
+                the Apple Software in its entirety and without modifications, you must retain
+                this notice and the following text and disclaimers in all such redistributions of
+                the Apple Software.  Neither the name, trademarks, service marks or logos of
+                Apple Computer, Inc. may be used to endorse or promote products derived from the
+                Apple Software without specific prior written permission from Apple.  Except as
+                expressly stated in this notice, no other rights or licenses, express or implied,
+                are granted by Apple herein, including but not limited to any patent rights that
+                may be infringed by your derivative works or by other works in which the Apple
+                Software may be incorporated.
+
+                The Apple Software is provided by Apple on an "AS IS" basis.  APPLE MAKES NO
+                WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                PURPOSE, REGARDING THE APPLE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                COMBINATION WITH YOUR PRODUCTS.
+
+                IN NO EVENT SHALL APPLE BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                OF THE APPLE SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF APPLE HAS BEEN
+                ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+    Change History (most recent first):
+
+$Log$
+
+*/
+
+/////////////////////////////////////////////////////////////////////
+
+// This file is compiled into both the KEXT and the user-space tools, so it
+// sticks to things that are available in both: no I/O, no memory allocation,
+// and no locks.
+
+#if KERNEL && ! EMPTYFS_USER_KPI
+    #include <sys/errno.h>
+    #include <sys/stat.h>
+    #include <libkern/libkern.h>
+#else
+    #include <errno.h>
+    #include <string.h>
+    #include <sys/stat.h>
+#endif
+
+#include "EmptyFSFormat.h"
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Compile-Time Checks
+
+// The on-disk structures must have exactly the sizes listed in "EmptyFSFormat.h",
+// regardless of the compiler's padding rules.  If one of these fails, you get
+// an error about an array with a negative size.
+
+#define EmptyFSCheckSize(type, size) \
+    typedef char type ## SizeCheck[ (sizeof(type) == (size)) ? 1 : -1 ]
+
+EmptyFSCheckSize(EmptyFSSuperblock,     kEmptyFSSuperblockSize);
+EmptyFSCheckSize(EmptyFSFileRecord,     kEmptyFSFileRecordSize);
+EmptyFSCheckSize(EmptyFSExtent,         16);
+EmptyFSCheckSize(EmptyFSOverflowHeader, 16);
+EmptyFSCheckSize(EmptyFSBlockTrailer,   8);
+EmptyFSCheckSize(EmptyFSDirBlockHeader, 8);
+EmptyFSCheckSize(EmptyFSDirEntry,       kEmptyFSDirEntryHeaderSize);
+EmptyFSCheckSize(EmptyFSDirIndexHeader, 16);
+EmptyFSCheckSize(EmptyFSDirIndexRecord, 16);
+EmptyFSCheckSize(EmptyFSJournalHeader,  64);
+EmptyFSCheckSize(EmptyFSJournalRecord,  kEmptyFSJournalRecordHeaderSize);
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Byte Swapping
+
+extern void EmptyFSSwapSuperblock(EmptyFSSuperblock *sb)
+    // See comment in header.
+{
+    sb->fMagic              = EmptyFSSwapLE32(sb->fMagic);
+    sb->fMajorVersion       = EmptyFSSwapLE16(sb->fMajorVersion);
+    sb->fMinorVersion       = EmptyFSSwapLE16(sb->fMinorVersion);
+    sb->fBlockSize          = EmptyFSSwapLE32(sb->fBlockSize);
+    sb->fFileRecordSize     = EmptyFSSwapLE32(sb->fFileRecordSize);
+    sb->fBlockCount         = EmptyFSSwapLE64(sb->fBlockCount);
+    sb->fFreeBlockCount     = EmptyFSSwapLE64(sb->fFreeBlockCount);
+    sb->fFileCount          = EmptyFSSwapLE32(sb->fFileCount);
+    sb->fFreeFileCount      = EmptyFSSwapLE32(sb->fFreeFileCount);
+    sb->fDirectoryCount     = EmptyFSSwapLE32(sb->fDirectoryCount);
+    sb->fRootFileNum        = EmptyFSSwapLE32(sb->fRootFileNum);
+    sb->fBitmapStart        = EmptyFSSwapLE64(sb->fBitmapStart);
+    sb->fBitmapBlocks       = EmptyFSSwapLE64(sb->fBitmapBlocks);
+    sb->fFileTableStart     = EmptyFSSwapLE64(sb->fFileTableStart);
+    sb->fFileTableBlocks    = EmptyFSSwapLE64(sb->fFileTableBlocks);
+    sb->fDataStart          = EmptyFSSwapLE64(sb->fDataStart);
+    sb->fCompatFeatures     = EmptyFSSwapLE32(sb->fCompatFeatures);
+    sb->fROCompatFeatures   = EmptyFSSwapLE32(sb->fROCompatFeatures);
+    sb->fIncompatFeatures   = EmptyFSSwapLE32(sb->fIncompatFeatures);
+    sb->fState              = EmptyFSSwapLE32(sb->fState);
+    sb->fCreateTime         = (int64_t) EmptyFSSwapLE64( (uint64_t) sb->fCreateTime );
+    sb->fModifyTime         = (int64_t) EmptyFSSwapLE64( (uint64_t) sb->fModifyTime );
+    // fUUID and fVolumeName are byte arrays
+    sb->fJournalStart       = EmptyFSSwapLE64(sb->fJournalStart);
+    sb->fJournalBlocks      = EmptyFSSwapLE64(sb->fJournalBlocks);
+    sb->fFileTableInitBlocks = EmptyFSSwapLE64(sb->fFileTableInitBlocks);
+    sb->fChecksum           = EmptyFSSwapLE32(sb->fChecksum);
+    sb->fOrphanFileNum      = EmptyFSSwapLE32(sb->fOrphanFileNum);
+}
+
+extern void EmptyFSSwapExtents(EmptyFSExtent *extents, size_t count)
+    // See comment in header.
+{
+    size_t  index;
+
+    for (index = 0; index < count; index++) {
+        extents[index].fStartBlock = EmptyFSSwapLE64(extents[index].fStartBlock);
+        extents[index].fBlockCount = EmptyFSSwapLE32(extents[index].fBlockCount);
+        extents[index].fFlags      = EmptyFSSwapLE32(extents[index].fFlags);
+    }
+}
+
+extern void EmptyFSSwapFileRecord(EmptyFSFileRecord *rec)
+    // See comment in header.
+{
+    rec->fMode          = EmptyFSSwapLE16(rec->fMode);
+    rec->fLinkCount     = EmptyFSSwapLE16(rec->fLinkCount);
+    rec->fFlags         = EmptyFSSwapLE32(rec->fFlags);
+    rec->fUID           = EmptyFSSwapLE32(rec->fUID);
+    rec->fGID           = EmptyFSSwapLE32(rec->fGID);
+    rec->fSize          = EmptyFSSwapLE64(rec->fSize);
+    rec->fBlockCount    = EmptyFSSwapLE64(rec->fBlockCount);
+    rec->fCreateTime    = (int64_t) EmptyFSSwapLE64( (uint64_t) rec->fCreateTime );
+    rec->fModifyTime    = (int64_t) EmptyFSSwapLE64( (uint64_t) rec->fModifyTime );
+    rec->fChangeTime    = (int64_t) EmptyFSSwapLE64( (uint64_t) rec->fChangeTime );
+    rec->fAccessTime    = (int64_t) EmptyFSSwapLE64( (uint64_t) rec->fAccessTime );
+    rec->fParentFileNum = EmptyFSSwapLE32(rec->fParentFileNum);
+    rec->fGeneration    = EmptyFSSwapLE32(rec->fGeneration);
+    rec->fExtentCount   = EmptyFSSwapLE32(rec->fExtentCount);
+    rec->fNextOrphan    = EmptyFSSwapLE32(rec->fNextOrphan);
+    rec->fOverflowBlock = EmptyFSSwapLE64(rec->fOverflowBlock);
+    EmptyFSSwapExtents(rec->fExtents, kEmptyFSInlineExtentCount);
+    rec->fDirIndexBlock = EmptyFSSwapLE64(rec->fDirIndexBlock);
+    rec->fCompressedChunkSize = EmptyFSSwapLE32(rec->fCompressedChunkSize);
+    rec->fChecksum      = EmptyFSSwapLE32(rec->fChecksum);
+    rec->fChunkChecksumBlock = EmptyFSSwapLE64(rec->fChunkChecksumBlock);
+}
+
+extern void EmptyFSSwapOverflowHeader(EmptyFSOverflowHeader *header)
+    // See comment in header.
+{
+    header->fMagic       = EmptyFSSwapLE32(header->fMagic);
+    header->fExtentCount = EmptyFSSwapLE32(header->fExtentCount);
+    header->fNextBlock   = EmptyFSSwapLE64(header->fNextBlock);
+}
+
+extern void EmptyFSSwapJournalHeader(EmptyFSJournalHeader *header)
+    // See comment in header.
+{
+    header->fMagic          = EmptyFSSwapLE32(header->fMagic);
+    header->fChecksum       = EmptyFSSwapLE32(header->fChecksum);
+    header->fStart          = EmptyFSSwapLE64(header->fStart);
+    header->fSequence       = EmptyFSSwapLE64(header->fSequence);
+    header->fFreeBlockCount = EmptyFSSwapLE64(header->fFreeBlockCount);
+    header->fFreeFileCount  = EmptyFSSwapLE32(header->fFreeFileCount);
+    header->fDirectoryCount = EmptyFSSwapLE32(header->fDirectoryCount);
+    header->fOrphanFileNum  = EmptyFSSwapLE32(header->fOrphanFileNum);
+}
+
+extern void EmptyFSSwapJournalRecord(EmptyFSJournalRecord *record)
+    // See comment in header.
+{
+    record->fMagic          = EmptyFSSwapLE32(record->fMagic);
+    record->fChecksum       = EmptyFSSwapLE32(record->fChecksum);
+    record->fSequence       = EmptyFSSwapLE64(record->fSequence);
+    record->fFlags          = EmptyFSSwapLE32(record->fFlags);
+    record->fBlockCount     = EmptyFSSwapLE32(record->fBlockCount);
+    record->fFreeBlockCount = EmptyFSSwapLE64(record->fFreeBlockCount);
+    record->fFreeFileCount  = EmptyFSSwapLE32(record->fFreeFileCount);
+    record->fDirectoryCount = EmptyFSSwapLE32(record->fDirectoryCount);
+    record->fOrphanFileNum  = EmptyFSSwapLE32(record->fOrphanFileNum);
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Superblock and File Records
+
+static int IsPowerOfTwo(uint64_t value)
+{
+    return (value != 0) && ((value & (value - 1)) == 0);
+}
+
+static int RangeIsWithin(uint64_t start, uint64_t count, uint64_t limit)
+    // Returns true if the block range [start, start + count) lies within
+    // [0, limit), being careful about overflow.
+{
+    return (start <= limit) && (count <= (limit - start));
+}
+
+static int OrphanIsPlausible(const EmptyFSSuperblock *sb, uint32_t fileNum)
+    // Returns true if fileNum could be on the orphan list (or is zero, which
+    // ends the list).  The root directory can never be an orphan.
+{
+    return (fileNum == 0) || ( (fileNum > kEmptyFSRootFileNum) && (fileNum < sb->fFileCount) );
+}
+
+extern int EmptyFSSuperblockValidate(const EmptyFSSuperblock *sb)
+    // See comment in header.
+{
+    int         err;
+    uint64_t    bitsPerBlock;
+
+    err = 0;
+    if (sb->fMagic != kEmptyFSSuperblockMagic) {
+        err = EINVAL;
+    } else if (sb->fMajorVersion != kEmptyFSMajorVersion) {
+        err = ENOTSUP;
+    } else if ( (sb->fIncompatFeatures & ~kEmptyFSIncompatFeaturesKnown) != 0 ) {
+        err = ENOTSUP;
+    }
+
+    // Check the geometry.  Each of the metadata areas must lie within the volume,
+    // in order, and must be big enough for what it holds.
+
+    if (err == 0) {
+        bitsPerBlock = (uint64_t) sb->fBlockSize * 8;
+        if (    ! IsPowerOfTwo(sb->fBlockSize)
+             || (sb->fBlockSize < kEmptyFSMinBlockSize)
+             || (sb->fBlockSize > kEmptyFSMaxBlockSize)
+             || (sb->fFileRecordSize != kEmptyFSFileRecordSize)
+             || (sb->fRootFileNum != kEmptyFSRootFileNum)
+             || (sb->fFileCount <= kEmptyFSRootFileNum)
+             || (sb->fFileCount > kEmptyFSMaxFileCount)
+             || (sb->fFreeFileCount > (sb->fFileCount - kEmptyFSFirstFileNum - 1))
+             || (sb->fDirectoryCount == 0)
+             || (sb->fDirectoryCount > (sb->fFileCount - kEmptyFSFirstFileNum - sb->fFreeFileCount))
+             || (sb->fFreeBlockCount > sb->fBlockCount)
+             || (sb->fBitmapStart == 0)
+             || ! RangeIsWithin(sb->fBitmapStart, sb->fBitmapBlocks, sb->fBlockCount)
+             || ( sb->fBitmapBlocks < ((sb->fBlockCount + bitsPerBlock - 1) / bitsPerBlock) )
+             || (sb->fFileTableStart < (sb->fBitmapStart + sb->fBitmapBlocks))
+             || ! RangeIsWithin(sb->fFileTableStart, sb->fFileTableBlocks, sb->fBlockCount)
+             || ( sb->fFileTableBlocks < ((sb->fFileCount + EmptyFSFileRecordsPerBlock(sb) - 1) / EmptyFSFileRecordsPerBlock(sb)) )
+             || (sb->fDataStart < (sb->fFileTableStart + sb->fFileTableBlocks))
+             || (sb->fDataStart > sb->fBlockCount)
+             || (sb->fVolumeName[kEmptyFSVolumeNameSize - 1] != 0)
+             || ! OrphanIsPlausible(sb, sb->fOrphanFileNum)
+           ) {
+            err = EINVAL;
+        }
+    }
+
+    // The journal, if any, sits between the file table and the data.
+
+    if (err == 0) {
+        if (sb->fROCompatFeatures & kEmptyFSROCompatJournal) {
+            if (    (sb->fJournalBlocks < kEmptyFSJournalMinBlocks)
+                 || (sb->fJournalStart < (sb->fFileTableStart + sb->fFileTableBlocks))
+                 || ! RangeIsWithin(sb->fJournalStart, sb->fJournalBlocks, sb->fBlockCount)
+                 || (sb->fDataStart < (sb->fJournalStart + sb->fJournalBlocks))
+               ) {
+                err = EINVAL;
+            }
+        } else if ( (sb->fJournalStart != 0) || (sb->fJournalBlocks != 0) ) {
+            err = EINVAL;
+        }
+    }
+
+    // A lazily initialised file table must have at least the root directory's
+    // record initialised.
+
+    if (err == 0) {
+        if (sb->fROCompatFeatures & kEmptyFSROCompatLazyFileTable) {
+            if (    (sb->fFileTableInitBlocks <= (kEmptyFSRootFileNum / EmptyFSFileRecordsPerBlock(sb)))
+                 || (sb->fFileTableInitBlocks > sb->fFileTableBlocks)
+               ) {
+                err = EINVAL;
+            }
+        } else if (sb->fFileTableInitBlocks != 0) {
+            err = EINVAL;
+        }
+    }
+    return err;
+}
+
+extern uint32_t EmptyFSFileRecordsPerBlock(const EmptyFSSuperblock *sb)
+    // See comment in header.
+{
+    return sb->fBlockSize / kEmptyFSFileRecordSize;
+}
+
+extern void EmptyFSFileRecordLocation(const EmptyFSSuperblock *sb, uint32_t fileNum, uint64_t *blockPtr, uint32_t *offsetPtr)
+    // See comment in header.
+{
+    uint32_t    perBlock;
+
+    perBlock = EmptyFSFileRecordsPerBlock(sb);
+    *blockPtr  = sb->fFileTableStart + (fileNum / perBlock);
+    *offsetPtr = (fileNum % perBlock) * kEmptyFSFileRecordSize;
+}
+
+extern uint32_t EmptyFSFileTableInitCount(const EmptyFSSuperblock *sb)
+    // See comment in header.
+{
+    uint64_t    result;
+
+    result = sb->fFileCount;
+    if (sb->fROCompatFeatures & kEmptyFSROCompatLazyFileTable) {
+        result = sb->fFileTableInitBlocks * EmptyFSFileRecordsPerBlock(sb);
+        if (result > sb->fFileCount) {
+            result = sb->fFileCount;
+        }
+    }
+    return (uint32_t) result;
+}
+
+extern uint32_t EmptyFSOverflowExtentsPerBlock(const EmptyFSSuperblock *sb)
+    // See comment in header.
+{
+    uint32_t    space;
+
+    space = (uint32_t) (sb->fBlockSize - sizeof(EmptyFSOverflowHeader));
+    if (sb->fROCompatFeatures & kEmptyFSROCompatMetadataChecksums) {
+        space -= (uint32_t) sizeof(EmptyFSBlockTrailer);
+    }
+    return (uint32_t) (space / sizeof(EmptyFSExtent));
+}
+
+extern uint64_t EmptyFSChunkChecksumBlocks(const EmptyFSSuperblock *sb, const EmptyFSFileRecord *rec)
+    // See comment in header.
+{
+    uint64_t    result;
+
+    result = 0;
+    if (rec->fChunkChecksumBlock != 0) {
+        result = ( ((uint64_t) rec->fExtentCount * sizeof(uint32_t)) + sb->fBlockSize - 1) / sb->fBlockSize;
+    }
+    return result;
+}
+
+extern int EmptyFSFileRecordValidate(const EmptyFSSuperblock *sb, const EmptyFSFileRecord *rec)
+    // See comment in header.  We check the things that the KEXT depends on
+    // for its own safety: that the object has a type we understand, that the
+    // parent is a plausible file number, that a directory isn't too big for 
+    // its cookies, that only an orphan (see "Orphans" in the header) has a
+    // next orphan, that a compressed file has a sensible chunk size and the
+    // right number of extents, that any checksum table is within the data
+    // area, and that each inline extent is too.  Overflow extents are
+    // checked as they're read.
+{
+    int         err;
+    uint32_t    index;
+    uint64_t    blocks;
+    uint32_t    chunkSize;
+    uint64_t    chunkCount;
+
+    err = 0;
+    switch (rec->fMode & S_IFMT) {
+        case S_IFDIR:
+        case S_IFREG:
+        case S_IFLNK:
+            break;
+        default:
+            err = EIO;
+            break;
+    }
+    if ( (err == 0) && ( (rec->fParentFileNum < kEmptyFSFirstFileNum) || (rec->fParentFileNum >= sb->fFileCount) ) ) {
+        err = EIO;
+    }
+    if ( (err == 0) && ((rec->fMode & S_IFMT) == S_IFDIR) && (rec->fSize > kEmptyFSMaxDirSize) ) {
+        err = EIO;
+    }
+    if ( (err == 0) && (rec->fExtentCount > kEmptyFSInlineExtentCount) && (rec->fOverflowBlock == 0) ) {
+        err = EIO;
+    }
+    if ( (err == 0) && (rec->fNextOrphan != 0) ) {
+        if (    ((rec->fMode & S_IFMT) == S_IFDIR)
+             || (rec->fLinkCount != 0)
+             || ! OrphanIsPlausible(sb, rec->fNextOrphan) ) {
+            err = EIO;
+        }
+    }
+    if ( (err == 0) && (rec->fDirIndexBlock != 0) ) {
+        if (    ! (sb->fROCompatFeatures & kEmptyFSROCompatDirIndex)
+             || ((rec->fMode & S_IFMT) != S_IFDIR)
+             || (rec->fDirIndexBlock < sb->fDataStart)
+             || (rec->fDirIndexBlock >= sb->fBlockCount) ) {
+            err = EIO;
+        }
+    }
+    chunkSize = rec->fCompressedChunkSize;
+    if ( (err == 0) && (chunkSize != 0) ) {
+        if (    ! (sb->fIncompatFeatures & kEmptyFSIncompatCompression)
+             || ((rec->fMode & S_IFMT) != S_IFREG)
+             || ! IsPowerOfTwo(chunkSize)
+             || (chunkSize < kEmptyFSMinCompressedChunkSize)
+             || (chunkSize > kEmptyFSMaxCompressedChunkSize)
+             || (chunkSize < sb->fBlockSize) ) {
+            err = EIO;
+        } else {
+            chunkCount = (rec->fSize / chunkSize) + ( (rec->fSize % chunkSize) != 0 );
+            if (chunkCount != rec->fExtentCount) {
+                err = EIO;
+            }
+        }
+    }
+    if ( (err == 0) && (rec->fChunkChecksumBlock != 0) ) {
+        if (    ! (sb->fROCompatFeatures & kEmptyFSROCompatDataChecksums)
+             || (chunkSize == 0)
+             || (rec->fChunkChecksumBlock < sb->fDataStart)
+             || ! RangeIsWithin(rec->fChunkChecksumBlock, EmptyFSChunkChecksumBlocks(sb, rec), sb->fBlockCount) ) {
+            err = EIO;
+        }
+    }
+    blocks = 0;
+    for (index = 0; (err == 0) && (index < rec->fExtentCount) && (index < kEmptyFSInlineExtentCount); index++) {
+        if (    (rec->fExtents[index].fBlockCount == 0)
+             || (rec->fExtents[index].fStartBlock < sb->fDataStart)
+             || ! RangeIsWithin(rec->fExtents[index].fStartBlock, rec->fExtents[index].fBlockCount, sb->fBlockCount) ) {
+            err = EIO;
+        }
+        blocks += rec->fExtents[index].fBlockCount;
+    }
+
+    // The file's size must fit within its blocks, unless it's compressed,
+    // in which case EmptyFSCompressedExtentsValidate does the equivalent
+    // check.  We can only check this here if all the extents are inline.
+
+    if ( (err == 0) && (rec->fExtentCount <= kEmptyFSInlineExtentCount) ) {
+        if ( (blocks != rec->fBlockCount) || ( (chunkSize == 0) && (rec->fSize > (blocks * sb->fBlockSize)) ) ) {
+            err = EIO;
+        }
+    }
+    return err;
+}
+
+extern int EmptyFSExtentMap(
+    const EmptyFSExtent *   extents,
+    size_t                  extentCount,
+    uint64_t                logicalBlock,
+    uint64_t *              physicalBlockPtr,
+    uint64_t *              contigBlocksPtr
+)
+    // See comment in header.
+{
+    int         err;
+    size_t      index;
+    uint64_t    extentBase;
+
+    err = ERANGE;
+    extentBase = 0;
+    for (index = 0; index < extentCount; index++) {
+        if (logicalBlock < (extentBase + extents[index].fBlockCount)) {
+            *physicalBlockPtr = extents[index].fStartBlock + (logicalBlock - extentBase);
+            if (contigBlocksPtr != NULL) {
+                *contigBlocksPtr = extents[index].fBlockCount - (logicalBlock - extentBase);
+            }
+            err = 0;
+            break;
+        }
+        extentBase += extents[index].fBlockCount;
+    }
+    return err;
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Compression
+
+extern int EmptyFSCompressedExtentsValidate(
+    const EmptyFSSuperblock *   sb,
+    const EmptyFSFileRecord *   rec,
+    const EmptyFSExtent *       extents,
+    size_t                      extentCount
+)
+    // See comment in header.
+{
+    int         err;
+    size_t      index;
+    uint64_t    chunkStart;
+    uint64_t    chunkLen;
+    uint64_t    maxBlocks;
+    uint64_t    blocks;
+
+    err = 0;
+    if ( (rec->fCompressedChunkSize == 0) || (extentCount != rec->fExtentCount) ) {
+        err = EIO;
+    }
+    blocks = 0;
+    chunkStart = 0;
+    for (index = 0; (err == 0) && (index < extentCount); index++) {
+        chunkLen = rec->fSize - chunkStart;
+        if (chunkLen > rec->fCompressedChunkSize) {
+            chunkLen = rec->fCompressedChunkSize;
+        }
+        maxBlocks = (chunkLen + sb->fBlockSize - 1) / sb->fBlockSize;
+
+        if (    (extents[index].fBlockCount == 0)
+             || (extents[index].fStartBlock < sb->fDataStart)
+             || ! RangeIsWithin(extents[index].fStartBlock, extents[index].fBlockCount, sb->fBlockCount) ) {
+            err = EIO;
+        } else {
+            switch (extents[index].fFlags) {
+                case kEmptyFSCompressionNone:
+                    if (extents[index].fBlockCount != maxBlocks) {
+                        err = EIO;
+                    }
+                    break;
+                case kEmptyFSCompressionLZ4:
+                    if (extents[index].fBlockCount > maxBlocks) {
+                        err = EIO;
+                    }
+                    break;
+                default:
+                    err = EIO;
+                    break;
+            }
+        }
+        blocks     += extents[index].fBlockCount;
+        chunkStart += rec->fCompressedChunkSize;
+    }
+    if ( (err == 0) && (blocks != rec->fBlockCount) ) {
+        err = EIO;
+    }
+    return err;
+}
+
+static int LZ4ReadLength(const uint8_t **srcPtr, const uint8_t *srcEnd, size_t *lenPtr)
+    // Reads the extra bytes of an LZ4 literal or match length, adding them to
+    // *lenPtr.  Each byte adds its value, and a byte of 255 means that
+    // another follows.
+{
+    int             err;
+    const uint8_t * src;
+    uint8_t         byte;
+
+    err = 0;
+    src = *srcPtr;
+    do {
+        if (src == srcEnd) {
+            err = EIO;
+            break;
+        }
+        byte = *src++;
+        *lenPtr += byte;
+    } while (byte == 255);
+    *srcPtr = src;
+    return err;
+}
+
+static int LZ4Decompress(const uint8_t *src, size_t srcLen, uint8_t *dst, size_t dstLen)
+    // Decodes an LZ4 block.  The block is a sequence of sequences, each of
+    // which is a token byte (literal length in the high nybble, match length
+    // less 4 in the low one, 15 meaning that more length bytes follow), the
+    // literals, and then a two byte little endian offset back into the output
+    // for the match.  The last sequence has only literals.  We stop as soon as
+    // the output is full, which is why the padding at the end of an extent
+    // doesn't matter.  Every length and offset is checked against the buffers,
+    // because the data comes straight off the disk.
+{
+    int             err;
+    const uint8_t * srcEnd;
+    size_t          dstOffset;
+    uint8_t         token;
+    size_t          len;
+    size_t          offset;
+    size_t          index;
+
+    err = 0;
+    srcEnd = src + srcLen;
+    dstOffset = 0;
+    while (dstOffset < dstLen) {
+        if (src == srcEnd) {
+            err = EIO;
+            break;
+        }
+        token = *src++;
+
+        // Literals.
+
+        len = token >> 4;
+        if (len == 15) {
+            err = LZ4ReadLength(&src, srcEnd, &len);
+            if (err != 0) {
+                break;
+            }
+        }
+        if ( (len > (size_t) (srcEnd - src)) || (len > (dstLen - dstOffset)) ) {
+            err = EIO;
+            break;
+        }
+        memcpy(dst + dstOffset, src, len);
+        src       += len;
+        dstOffset += len;
+        if (dstOffset == dstLen) {
+            break;
+        }
+
+        // Match.  The source and destination of a match can overlap (that's
+        // how LZ4 encodes runs), so we copy a byte at a time unless they
+        // don't.
+
+        if ((srcEnd - src) < 2) {
+            err = EIO;
+            break;
+        }
+        offset = (size_t) src[0] | ((size_t) src[1] << 8);
+        src += 2;
+        len = token & 15;
+        if (len == 15) {
+            err = LZ4ReadLength(&src, srcEnd, &len);
+            if (err != 0) {
+                break;
+            }
+        }
+        len += 4;
+        if ( (offset == 0) || (offset > dstOffset) || (len > (dstLen - dstOffset)) ) {
+            err = EIO;
+            break;
+        }
+        if (offset >= len) {
+            memcpy(dst + dstOffset, dst + dstOffset - offset, len);
+        } else {
+            for (index = 0; index < len; index++) {
+                dst[dstOffset + index] = dst[dstOffset + index - offset];
+            }
+        }
+        dstOffset += len;
+    }
+    return err;
+}
+
+extern int EmptyFSDecompress(
+    uint32_t                    compression,
+    const void *                src,
+    size_t                      srcLen,
+    void *                      dst,
+    size_t                      dstLen
+)
+    // See comment in header.
+{
+    int     err;
+
+    switch (compression) {
+        case kEmptyFSCompressionNone:
+            if (srcLen < dstLen) {
+                err = EIO;
+            } else {
+                memcpy(dst, src, dstLen);
+                err = 0;
+            }
+            break;
+        case kEmptyFSCompressionLZ4:
+            err = LZ4Decompress( (const uint8_t *) src, srcLen, (uint8_t *) dst, dstLen);
+            break;
+        default:
+            err = EIO;
+            break;
+    }
+    return err;
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Checksums
+
+// Checksum Notes
+// --------------
+// EmptyFSChecksum is on the path of every metadata block that's read from
+// the disk, and of every extent of a file with data checksums, so it has to
+// be fast.  There are two implementations.
+//
+// o EmptyFSChecksumSoftware is the portable one.  It uses "slicing by 8":
+//   gChecksumSlices[k][b] is the CRC of byte b followed by k zero bytes, so
+//   the CRC of the next eight bytes is the XOR of eight table lookups that
+//   don't depend on each other, rather than a chain of eight that do.
+//   gChecksumSlices[0] is gChecksumTable, the usual byte-at-a-time table.
+//
+// o EmptyFSChecksumHardware uses the CPU's CRC-32C instruction, eight bytes
+//   at a time.  The instruction takes three cycles, but the CPU can start a
+//   new one every cycle, so a single stream of data would leave it idle two
+//   thirds of the time.  Instead we checksum three adjacent pieces of the
+//   buffer at once, and then combine their CRCs.  Combining means shifting
+//   the CRC of one piece past the length of the next, as if by that many
+//   zero bytes, which is a linear function of the CRC; gChecksumShiftLong
+//   and gChecksumShiftShort tabulate it, a byte at a time, for our two piece
+//   sizes.  This is the method of Mark Adler's public domain "crc32c.c".
+//
+// We don't use the carry-less multiply instruction (PCLMULQDQ), the other
+// common way to compute a CRC quickly, because it works on the SSE
+// registers, which kernel code can't touch without saving the user's
+// state.  The CRC-32C instruction only uses general purpose registers, so
+// the same code works in the KEXT and in user space.  The instruction is
+// only used by 64-bit Intel code (it's part of SSE4.2, so we check CPUID
+// before using it) and by ARMv8 code compiled with the CRC extension.
+//
+// ChecksumInit builds the tables the first time anyone asks for a
+// checksum.  Two threads might both build them, which is harmless because
+// they build the same thing.  The barriers make sure that a thread that
+// sees gChecksumState set also sees the tables.
+
+enum {
+    kChecksumStateUnknown   = 0,
+    kChecksumStateSoftware  = 1,
+    kChecksumStateHardware  = 2,
+
+    kChecksumPolynomial     = 0x82F63B78,   // reflected
+    kChecksumLong           = 8192,         // piece sizes for EmptyFSChecksumHardware
+    kChecksumShort          = 256
+};
+
+#if defined(__x86_64__) && defined(__GNUC__)
+
+    #define EMPTYFS_CHECKSUM_HARDWARE 1
+
+    static uint64_t ChecksumInstruction64(uint64_t crc, uint64_t data)
+    {
+        __asm__ ("crc32q %1, %0" : "+r" (crc) : "rm" (data));
+        return crc;
+    }
+
+    static uint64_t ChecksumInstruction8(uint64_t crc, uint8_t data)
+    {
+        uint32_t    crc32;
+
+        crc32 = (uint32_t) crc;
+        __asm__ ("crc32b %1, %0" : "+r" (crc32) : "rm" (data));
+        return crc32;
+    }
+
+    static int ChecksumInstructionPresent(void)
+        // SSE4.2 is bit 20 of ECX for CPUID leaf 1.
+    {
+        uint32_t    eax;
+        uint32_t    ebx;
+        uint32_t    ecx;
+        uint32_t    edx;
+
+        __asm__ ("cpuid" : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx) : "a" (1), "c" (0));
+        return (ecx & (1U << 20)) != 0;
+    }
+
+    // x86 doesn't reorder loads with other loads, so the reader only needs
+    // to stop the compiler doing so.
+
+    #define ChecksumReadBarrier()   __asm__ __volatile__ ("" : : : "memory")
+
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32) && ! defined(__AARCH64EB__)
+
+    #include <arm_acle.h>
+
+    #define EMPTYFS_CHECKSUM_HARDWARE 1
+
+    static uint64_t ChecksumInstruction64(uint64_t crc, uint64_t data)
+    {
+        return __crc32cd( (uint32_t) crc, data);
+    }
+
+    static uint64_t ChecksumInstruction8(uint64_t crc, uint8_t data)
+    {
+        return __crc32cb( (uint32_t) crc, data);
+    }
+
+    static int ChecksumInstructionPresent(void)
+        // The compiler was told that the CPU has it.
+    {
+        return 1;
+    }
+
+    #define ChecksumReadBarrier()   __sync_synchronize()
+
+#else
+
+    #define EMPTYFS_CHECKSUM_HARDWARE 0
+
+    #define ChecksumReadBarrier()   __sync_synchronize()
+
+#endif
+
+// gChecksumTable is the usual byte-at-a-time table for the reflected CRC-32C
+// polynomial (0x82F63B78).  CRC-32C rather than the more familiar CRC-32
+// because it detects more errors in the block sizes we use, and because
+// many CPUs can compute it in hardware.
+
+static const uint32_t gChecksumTable[256] = {
+    0x00000000, 0xF26B8303, 0xE13B70F7, 0x1350F3F4,
+    0xC79A971F, 0x35F1141C, 0x26A1E7E8, 0xD4CA64EB,
+    0x8AD958CF, 0x78B2DBCC, 0x6BE22838, 0x9989AB3B,
+    0x4D43CFD0, 0xBF284CD3, 0xAC78BF27, 0x5E133C24,
+    0x105EC76F, 0xE235446C, 0xF165B798, 0x030E349B,
+    0xD7C45070, 0x25AFD373, 0x36FF2087, 0xC494A384,
+    0x9A879FA0, 0x68EC1CA3, 0x7BBCEF57, 0x89D76C54,
+    0x5D1D08BF, 0xAF768BBC, 0xBC267848, 0x4E4DFB4B,
+    0x20BD8EDE, 0xD2D60DDD, 0xC186FE29, 0x33ED7D2A,
+    0xE72719C1, 0x154C9AC2, 0x061C6936, 0xF477EA35,
+    0xAA64D611, 0x580F5512, 0x4B5FA6E6, 0xB93425E5,
+    0x6DFE410E, 0x9F95C20D, 0x8CC531F9, 0x7EAEB2FA,
+    0x30E349B1, 0xC288CAB2, 0xD1D83946, 0x23B3BA45,
+    0xF779DEAE, 0x05125DAD, 0x1642AE59, 0xE4292D5A,
+    0xBA3A117E, 0x4851927D, 0x5B016189, 0xA96AE28A,
+    0x7DA08661, 0x8FCB0562, 0x9C9BF696, 0x6EF07595,
+    0x417B1DBC, 0xB3109EBF, 0xA0406D4B, 0x522BEE48,
+    0x86E18AA3, 0x748A09A0, 0x67DAFA54, 0x95B17957,
+    0xCBA24573, 0x39C9C670, 0x2A993584, 0xD8F2B687,
+    0x0C38D26C, 0xFE53516F, 0xED03A29B, 0x1F682198,
+    0x5125DAD3, 0xA34E59D0, 0xB01EAA24, 0x42752927,
+    0x96BF4DCC, 0x64D4CECF, 0x77843D3B, 0x85EFBE38,
+    0xDBFC821C, 0x2997011F, 0x3AC7F2EB, 0xC8AC71E8,
+    0x1C661503, 0xEE0D9600, 0xFD5D65F4, 0x0F36E6F7,
+    0x61C69362, 0x93AD1061, 0x80FDE395, 0x72966096,
+    0xA65C047D, 0x5437877E, 0x4767748A, 0xB50CF789,
+    0xEB1FCBAD, 0x197448AE, 0x0A24BB5A, 0xF84F3859,
+    0x2C855CB2, 0xDEEEDFB1, 0xCDBE2C45, 0x3FD5AF46,
+    0x7198540D, 0x83F3D70E, 0x90A324FA, 0x62C8A7F9,
+    0xB602C312, 0x44694011, 0x5739B3E5, 0xA55230E6,
+    0xFB410CC2, 0x092A8FC1, 0x1A7A7C35, 0xE811FF36,
+    0x3CDB9BDD, 0xCEB018DE, 0xDDE0EB2A, 0x2F8B6829,
+    0x82F63B78, 0x709DB87B, 0x63CD4B8F, 0x91A6C88C,
+    0x456CAC67, 0xB7072F64, 0xA457DC90, 0x563C5F93,
+    0x082F63B7, 0xFA44E0B4, 0xE9141340, 0x1B7F9043,
+    0xCFB5F4A8, 0x3DDE77AB, 0x2E8E845F, 0xDCE5075C,
+    0x92A8FC17, 0x60C37F14, 0x73938CE0, 0x81F80FE3,
+    0x55326B08, 0xA759E80B, 0xB4091BFF, 0x466298FC,
+    0x1871A4D8, 0xEA1A27DB, 0xF94AD42F, 0x0B21572C,
+    0xDFEB33C7, 0x2D80B0C4, 0x3ED04330, 0xCCBBC033,
+    0xA24BB5A6, 0x502036A5, 0x4370C551, 0xB11B4652,
+    0x65D122B9, 0x97BAA1BA, 0x84EA524E, 0x7681D14D,
+    0x2892ED69, 0xDAF96E6A, 0xC9A99D9E, 0x3BC21E9D,
+    0xEF087A76, 0x1D63F975, 0x0E330A81, 0xFC588982,
+    0xB21572C9, 0x407EF1CA, 0x532E023E, 0xA145813D,
+    0x758FE5D6, 0x87E466D5, 0x94B49521, 0x66DF1622,
+    0x38CC2A06, 0xCAA7A905, 0xD9F75AF1, 0x2B9CD9F2,
+    0xFF56BD19, 0x0D3D3E1A, 0x1E6DCDEE, 0xEC064EED,
+    0xC38D26C4, 0x31E6A5C7, 0x22B65633, 0xD0DDD530,
+    0x0417B1DB, 0xF67C32D8, 0xE52CC12C, 0x1747422F,
+    0x49547E0B, 0xBB3FFD08, 0xA86F0EFC, 0x5A048DFF,
+    0x8ECEE914, 0x7CA56A17, 0x6FF599E3, 0x9D9E1AE0,
+    0xD3D3E1AB, 0x21B862A8, 0x32E8915C, 0xC083125F,
+    0x144976B4, 0xE622F5B7, 0xF5720643, 0x07198540,
+    0x590AB964, 0xAB613A67, 0xB831C993, 0x4A5A4A90,
+    0x9E902E7B, 0x6CFBAD78, 0x7FAB5E8C, 0x8DC0DD8F,
+    0xE330A81A, 0x115B2B19, 0x020BD8ED, 0xF0605BEE,
+    0x24AA3F05, 0xD6C1BC06, 0xC5914FF2, 0x37FACCF1,
+    0x69E9F0D5, 0x9B8273D6, 0x88D28022, 0x7AB90321,
+    0xAE7367CA, 0x5C18E4C9, 0x4F48173D, 0xBD23943E,
+    0xF36E6F75, 0x0105EC76, 0x12551F82, 0xE03E9C81,
+    0x34F4F86A, 0xC69F7B69, 0xD5CF889D, 0x27A40B9E,
+    0x79B737BA, 0x8BDCB4B9, 0x988C474D, 0x6AE7C44E,
+    0xBE2DA0A5, 0x4C4623A6, 0x5F16D052, 0xAD7D5351
+};
+
+static uint32_t gChecksumSlices[8][256];
+static uint32_t gChecksumShiftLong[4][256];
+static uint32_t gChecksumShiftShort[4][256];
+static volatile int gChecksumState = kChecksumStateUnknown;
+
+static uint32_t GF2MatrixTimes(const uint32_t *mat, uint32_t vec)
+    // Multiplies the 32 x 32 bit matrix mat by the vector vec, over GF(2).
+{
+    uint32_t    sum;
+
+    sum = 0;
+    while (vec != 0) {
+        if (vec & 1) {
+            sum ^= *mat;
+        }
+        vec >>= 1;
+        mat += 1;
+    }
+    return sum;
+}
+
+static void GF2MatrixSquare(uint32_t *square, const uint32_t *mat)
+{
+    int     n;
+
+    for (n = 0; n < 32; n++) {
+        square[n] = GF2MatrixTimes(mat, mat[n]);
+    }
+}
+
+static void ChecksumBuildShiftTable(uint32_t table[4][256], size_t len)
+    // Builds the table that shifts a CRC past len zero bytes, where len is
+    // a power of two.  We start with the operator for one zero bit, and
+    // square it until it covers len bytes.
+{
+    uint32_t    even[32];
+    uint32_t    odd[32];
+    uint32_t    row;
+    int         n;
+
+    odd[0] = kChecksumPolynomial;
+    row = 1;
+    for (n = 1; n < 32; n++) {
+        odd[n] = row;
+        row <<= 1;
+    }
+    GF2MatrixSquare(even, odd);             // two zero bits
+    GF2MatrixSquare(odd, even);             // four zero bits
+    do {
+        GF2MatrixSquare(even, odd);         // one zero byte on the first pass
+        len >>= 1;
+        if (len == 0) {
+            break;
+        }
+        GF2MatrixSquare(odd, even);
+        len >>= 1;
+        if (len == 0) {
+            memcpy(even, odd, sizeof(even));
+        }
+    } while (len != 0);
+
+    for (n = 0; n < 256; n++) {
+        table[0][n] = GF2MatrixTimes(even, (uint32_t) n);
+        table[1][n] = GF2MatrixTimes(even, (uint32_t) n << 8);
+        table[2][n] = GF2MatrixTimes(even, (uint32_t) n << 16);
+        table[3][n] = GF2MatrixTimes(even, (uint32_t) n << 24);
+    }
+}
+
+static int ChecksumInit(void)
+    // Builds the tables and decides which implementation EmptyFSChecksum
+    // uses.  Returns the new gChecksumState.
+{
+    int         state;
+    int         slice;
+    int         n;
+    uint32_t    crc;
+
+    for (n = 0; n < 256; n++) {
+        crc = gChecksumTable[n];
+        gChecksumSlices[0][n] = crc;
+        for (slice = 1; slice < 8; slice++) {
+            crc = gChecksumTable[crc & 0xFF] ^ (crc >> 8);
+            gChecksumSlices[slice][n] = crc;
+        }
+    }
+
+    state = kChecksumStateSoftware;
+    #if EMPTYFS_CHECKSUM_HARDWARE
+        if ( ChecksumInstructionPresent() ) {
+            ChecksumBuildShiftTable(gChecksumShiftLong,  kChecksumLong);
+            ChecksumBuildShiftTable(gChecksumShiftShort, kChecksumShort);
+            state = kChecksumStateHardware;
+        }
+    #endif
+
+    __sync_synchronize();
+    gChecksumState = state;
+    return state;
+}
+
+static int ChecksumState(void)
+    // Returns gChecksumState, initialising it if necessary.
+{
+    int     state;
+
+    state = gChecksumState;
+    if (state == kChecksumStateUnknown) {
+        state = ChecksumInit();
+    } else {
+        ChecksumReadBarrier();
+    }
+    return state;
+}
+
+extern uint32_t EmptyFSChecksumSoftware(uint32_t crc, const void *buf, size_t len)
+    // See comment in header.  We go a byte at a time until the cursor is
+    // aligned, and then eight bytes at a time.  The bytes are assembled by
+    // hand, rather than loaded as a word, so that this works regardless of
+    // the host's byte order.
+{
+    const uint8_t * cursor;
+
+    (void) ChecksumState();
+
+    cursor = (const uint8_t *) buf;
+    crc = ~crc;
+    while ( (len != 0) && ((((uintptr_t) cursor) & 7) != 0) ) {
+        crc = gChecksumTable[(crc ^ *cursor) & 0xFF] ^ (crc >> 8);
+        cursor += 1;
+        len -= 1;
+    }
+    while (len >= 8) {
+        crc ^=    (uint32_t) cursor[0]
+               | ((uint32_t) cursor[1] << 8)
+               | ((uint32_t) cursor[2] << 16)
+               | ((uint32_t) cursor[3] << 24);
+        crc =   gChecksumSlices[7][ crc        & 0xFF]
+              ^ gChecksumSlices[6][(crc >>  8) & 0xFF]
+              ^ gChecksumSlices[5][(crc >> 16) & 0xFF]
+              ^ gChecksumSlices[4][ crc >> 24        ]
+              ^ gChecksumSlices[3][cursor[4]]
+              ^ gChecksumSlices[2][cursor[5]]
+              ^ gChecksumSlices[1][cursor[6]]
+              ^ gChecksumSlices[0][cursor[7]];
+        cursor += 8;
+        len -= 8;
+    }
+    while (len != 0) {
+        crc = gChecksumTable[(crc ^ *cursor) & 0xFF] ^ (crc >> 8);
+        cursor += 1;
+        len -= 1;
+    }
+    return ~crc;
+}
+
+#if EMPTYFS_CHECKSUM_HARDWARE
+
+    static uint32_t ChecksumShift(uint32_t table[4][256], uint32_t crc)
+        // Shifts crc past the zero bytes that table was built for.
+    {
+        return    table[0][ crc        & 0xFF]
+                ^ table[1][(crc >>  8) & 0xFF]
+                ^ table[2][(crc >> 16) & 0xFF]
+                ^ table[3][ crc >> 24        ];
+    }
+
+    static uint64_t ChecksumLoad64(const uint8_t *cursor)
+        // The compiler turns this into a single load.
+    {
+        uint64_t    data;
+
+        memcpy(&data, cursor, sizeof(data));
+        return data;
+    }
+
+#endif
+
+extern uint32_t EmptyFSChecksumHardware(uint32_t crc, const void *buf, size_t len)
+    // See comment in header, and "Checksum Notes", above.
+{
+    uint32_t            result;
+    #if EMPTYFS_CHECKSUM_HARDWARE
+        const uint8_t * cursor;
+        const uint8_t * end;
+        uint64_t        crc0;
+        uint64_t        crc1;
+        uint64_t        crc2;
+        size_t          piece;
+    #endif
+
+    if ( ChecksumState() != kChecksumStateHardware ) {
+        result = EmptyFSChecksumSoftware(crc, buf, len);
+    } else {
+        #if EMPTYFS_CHECKSUM_HARDWARE
+            cursor = (const uint8_t *) buf;
+            crc0 = (uint32_t) ~crc;
+
+            while ( (len != 0) && ((((uintptr_t) cursor) & 7) != 0) ) {
+                crc0 = ChecksumInstruction8(crc0, *cursor);
+                cursor += 1;
+                len -= 1;
+            }
+
+            // Three pieces at a time, long ones and then short ones.
+
+            for (piece = kChecksumLong; piece >= kChecksumShort; piece = (piece == kChecksumLong) ? kChecksumShort : 0) {
+                while (len >= (piece * 3)) {
+                    crc1 = 0;
+                    crc2 = 0;
+                    end = cursor + piece;
+                    do {
+                        crc0 = ChecksumInstruction64(crc0, ChecksumLoad64(cursor));
+                        crc1 = ChecksumInstruction64(crc1, ChecksumLoad64(cursor + piece));
+                        crc2 = ChecksumInstruction64(crc2, ChecksumLoad64(cursor + (piece * 2)));
+                        cursor += 8;
+                    } while (cursor < end);
+                    if (piece == kChecksumLong) {
+                        crc0 = ChecksumShift(gChecksumShiftLong,  (uint32_t) crc0) ^ crc1;
+                        crc0 = ChecksumShift(gChecksumShiftLong,  (uint32_t) crc0) ^ crc2;
+                    } else {
+                        crc0 = ChecksumShift(gChecksumShiftShort, (uint32_t) crc0) ^ crc1;
+                        crc0 = ChecksumShift(gChecksumShiftShort, (uint32_t) crc0) ^ crc2;
+                    }
+                    cursor += piece * 2;
+                    len -= piece * 3;
+                }
+            }
+
+            // Whatever's left, eight bytes at a time and then one.
+
+            while (len >= 8) {
+                crc0 = ChecksumInstruction64(crc0, ChecksumLoad64(cursor));
+                cursor += 8;
+                len -= 8;
+            }
+            while (len != 0) {
+                crc0 = ChecksumInstruction8(crc0, *cursor);
+                cursor += 1;
+                len -= 1;
+            }
+            result = ~ (uint32_t) crc0;
+        #endif
+    }
+    return result;
+}
+
+extern int EmptyFSChecksumHardwareAvailable(void)
+    // See comment in header.
+{
+    return ChecksumState() == kChecksumStateHardware;
+}
+
+extern uint32_t EmptyFSChecksum(uint32_t crc, const void *buf, size_t len)
+    // See comment in header.
+{
+    uint32_t    result;
+
+    if ( ChecksumState() == kChecksumStateHardware ) {
+        result = EmptyFSChecksumHardware(crc, buf, len);
+    } else {
+        result = EmptyFSChecksumSoftware(crc, buf, len);
+    }
+    return result;
+}
+
+static uint32_t ChecksumSkippingField(uint32_t crc, const void *buf, size_t len, size_t fieldOffset)
+    // Returns the checksum of buf, continuing from crc, as if the 32-bit
+    // field at fieldOffset were zero.
+{
+    static const uint32_t   kZero = 0;
+
+    crc = EmptyFSChecksum(crc, buf, fieldOffset);
+    crc = EmptyFSChecksum(crc, &kZero, sizeof(kZero));
+    return EmptyFSChecksum(crc, ((const char *) buf) + fieldOffset + sizeof(kZero), len - fieldOffset - sizeof(kZero));
+}
+
+extern uint32_t EmptyFSSuperblockChecksum(const EmptyFSSuperblock *sb)
+    // See comment in header.
+{
+    return ChecksumSkippingField(0, sb, sizeof(*sb), offsetof(EmptyFSSuperblock, fChecksum));
+}
+
+extern uint32_t EmptyFSFileRecordChecksum(const EmptyFSFileRecord *rec, uint32_t fileNum)
+    // See comment in header.
+{
+    uint32_t    seed;
+
+    seed = EmptyFSSwapLE32(fileNum);
+    return ChecksumSkippingField(EmptyFSChecksum(0, &seed, sizeof(seed)), rec, sizeof(*rec), offsetof(EmptyFSFileRecord, fChecksum));
+}
+
+extern void EmptyFSSuperblockSeal(EmptyFSSuperblock *sb)
+    // See comment in header.
+{
+    if ( EmptyFSSwapLE32(sb->fROCompatFeatures) & kEmptyFSROCompatMetadataChecksums ) {
+        sb->fChecksum = EmptyFSSwapLE32( EmptyFSSuperblockChecksum(sb) );
+    }
+}
+
+extern int EmptyFSSuperblockVerify(const EmptyFSSuperblock *sb)
+    // See comment in header.  If the feature bit itself is damaged we can't
+    // tell, but EmptyFSSuperblockValidate catches most other damage.
+{
+    int     err;
+
+    err = 0;
+    if (    (EmptyFSSwapLE32(sb->fROCompatFeatures) & kEmptyFSROCompatMetadataChecksums)
+         && (EmptyFSSwapLE32(sb->fChecksum) != EmptyFSSuperblockChecksum(sb)) ) {
+        err = EIO;
+    }
+    return err;
+}
+
+extern void EmptyFSFileRecordSeal(const EmptyFSSuperblock *sb, EmptyFSFileRecord *rec, uint32_t fileNum)
+    // See comment in header.
+{
+    if ( (sb->fROCompatFeatures & kEmptyFSROCompatMetadataChecksums) && (rec->fMode != 0) ) {
+        rec->fChecksum = EmptyFSSwapLE32( EmptyFSFileRecordChecksum(rec, fileNum) );
+    }
+}
+
+extern int EmptyFSFileRecordVerify(const EmptyFSSuperblock *sb, const EmptyFSFileRecord *rec, uint32_t fileNum)
+    // See comment in header.
+{
+    int     err;
+
+    err = 0;
+    if (    (sb->fROCompatFeatures & kEmptyFSROCompatMetadataChecksums)
+         && (rec->fMode != 0)
+         && (EmptyFSSwapLE32(rec->fChecksum) != EmptyFSFileRecordChecksum(rec, fileNum)) ) {
+        err = EIO;
+    }
+    return err;
+}
+
+enum {
+    kMetaBlockUnsealed  = 0,            // no checksum
+    kMetaBlockFileTable = 1,            // one checksum per used record
+    kMetaBlockSealed    = 2             // one checksum, for the whole block
+};
+
+static int MetaBlockKind(const EmptyFSSuperblock *sb, uint64_t blockNum, const void *block, size_t *fieldOffsetPtr)
+    // Works out which kind of block, as far as checksums go, block is.  For
+    // kMetaBlockSealed, *fieldOffsetPtr is the offset of its checksum.  Note
+    // that the superblock has its own routine, and the journal and bitmap
+    // blocks lie between the superblock and the data area, so they're
+    // unsealed.
+{
+    int         kind;
+
+    kind = kMetaBlockUnsealed;
+    *fieldOffsetPtr = 0;
+    if ( ! (sb->fROCompatFeatures & kEmptyFSROCompatMetadataChecksums) ) {
+        // no checksums at all
+    } else if ( (blockNum >= sb->fFileTableStart) && ((blockNum - sb->fFileTableStart) < sb->fFileTableBlocks) ) {
+        kind = kMetaBlockFileTable;
+    } else if (blockNum >= sb->fDataStart) {
+        switch ( EmptyFSSwapLE32( * (const uint32_t *) block ) ) {
+            case kEmptyFSDirBlockMagic:
+                kind = kMetaBlockSealed;
+                *fieldOffsetPtr = offsetof(EmptyFSDirBlockHeader, fChecksum);
+                break;
+            case kEmptyFSDirIndexMagic:
+                kind = kMetaBlockSealed;
+                *fieldOffsetPtr = offsetof(EmptyFSDirIndexHeader, fChecksum);
+                break;
+            case kEmptyFSOverflowMagic:
+                kind = kMetaBlockSealed;
+                *fieldOffsetPtr = sb->fBlockSize - sizeof(EmptyFSBlockTrailer) + offsetof(EmptyFSBlockTrailer, fChecksum);
+                break;
+            default:
+                break;
+        }
+    }
+    return kind;
+}
+
+static uint32_t MetaBlockChecksum(const EmptyFSSuperblock *sb, uint64_t blockNum, const void *block, size_t fieldOffset)
+    // Returns the checksum of a kMetaBlockSealed block.
+{
+    uint64_t    seed;
+
+    seed = EmptyFSSwapLE64(blockNum);
+    return ChecksumSkippingField(EmptyFSChecksum(0, &seed, sizeof(seed)), block, sb->fBlockSize, fieldOffset);
+}
+
+static int MetaBlockFileTable(const EmptyFSSuperblock *sb, uint64_t blockNum, EmptyFSFileRecord *records, int seal)
+    // Seals, or verifies, every used record of a file table block.  Returns
+    // EIO if verification fails.
+{
+    int         err;
+    uint32_t    perBlock;
+    uint32_t    index;
+    uint64_t    fileNum;
+
+    err = 0;
+    perBlock = EmptyFSFileRecordsPerBlock(sb);
+    fileNum = (blockNum - sb->fFileTableStart) * perBlock;
+    for (index = 0; (err == 0) && (index < perBlock) && (fileNum < sb->fFileCount); index++, fileNum++) {
+        if (seal) {
+            EmptyFSFileRecordSeal(sb, &records[index], (uint32_t) fileNum);
+        } else {
+            err = EmptyFSFileRecordVerify(sb, &records[index], (uint32_t) fileNum);
+        }
+    }
+    return err;
+}
+
+extern void EmptyFSMetaBlockSeal(const EmptyFSSuperblock *sb, uint64_t blockNum, void *block)
+    // See comment in header.
+{
+    size_t      fieldOffset;
+    uint32_t *  field;
+
+    switch ( MetaBlockKind(sb, blockNum, block, &fieldOffset) ) {
+        case kMetaBlockFileTable:
+            (void) MetaBlockFileTable(sb, blockNum, (EmptyFSFileRecord *) block, 1);
+            break;
+        case kMetaBlockSealed:
+            field = (uint32_t *) (((char *) block) + fieldOffset);
+            *field = EmptyFSSwapLE32( MetaBlockChecksum(sb, blockNum, block, fieldOffset) );
+            break;
+        default:
+            break;
+    }
+}
+
+extern int EmptyFSMetaBlockVerify(const EmptyFSSuperblock *sb, uint64_t blockNum, const void *block)
+    // See comment in header.
+{
+    int                 err;
+    size_t              fieldOffset;
+    const uint32_t *    field;
+
+    err = 0;
+    switch ( MetaBlockKind(sb, blockNum, block, &fieldOffset) ) {
+        case kMetaBlockFileTable:
+            err = MetaBlockFileTable(sb, blockNum, (EmptyFSFileRecord *) (uintptr_t) block, 0);
+            break;
+        case kMetaBlockSealed:
+            field = (const uint32_t *) (((const char *) block) + fieldOffset);
+            if ( EmptyFSSwapLE32(*field) != MetaBlockChecksum(sb, blockNum, block, fieldOffset) ) {
+                err = EIO;
+            }
+            break;
+        default:
+            break;
+    }
+    return err;
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Journal
+
+extern uint32_t EmptyFSJournalHeaderChecksum(const EmptyFSJournalHeader *header)
+    // See comment in header.
+{
+    return ChecksumSkippingField(0, header, sizeof(*header), offsetof(EmptyFSJournalHeader, fChecksum));
+}
+
+extern uint32_t EmptyFSJournalRecordChecksum(const void *descriptor, uint32_t blockSize)
+    // See comment in header.
+{
+    return ChecksumSkippingField(0, descriptor, blockSize, offsetof(EmptyFSJournalRecord, fChecksum));
+}
+
+extern int EmptyFSJournalHeaderValidate(const EmptyFSSuperblock *sb, const EmptyFSJournalHeader *header)
+    // See comment in header.
+{
+    int     err;
+
+    err = 0;
+    if (    (header->fMagic != kEmptyFSJournalHeaderMagic)
+         || (header->fStart == 0)
+         || (header->fStart >= sb->fJournalBlocks)
+         || (header->fSequence == 0)
+         || (header->fFreeBlockCount > sb->fBlockCount)
+         || (header->fFreeFileCount > sb->fFileCount)
+         || (header->fDirectoryCount > sb->fFileCount)
+         || ! OrphanIsPlausible(sb, header->fOrphanFileNum)
+       ) {
+        err = EIO;
+    }
+    return err;
+}
+
+extern uint32_t EmptyFSJournalRecordCapacity(const EmptyFSSuperblock *sb)
+    // See comment in header.
+{
+    return (sb->fBlockSize - kEmptyFSJournalRecordHeaderSize) / sizeof(uint64_t);
+}
+
+extern int EmptyFSJournalRecordValidate(const EmptyFSSuperblock *sb, const EmptyFSJournalRecord *record, uint64_t sequence)
+    // See comment in header.  A record must leave room for the header block
+    // and at least one other block in the journal, otherwise the record
+    // would overwrite its own start.
+{
+    int     err;
+
+    err = 0;
+    if (    (record->fMagic != kEmptyFSJournalRecordMagic)
+         || (record->fSequence != sequence)
+         || ((record->fFlags & ~kEmptyFSJournalRecordContinued) != 0)
+         || (record->fBlockCount == 0)
+         || (record->fBlockCount > EmptyFSJournalRecordCapacity(sb))
+         || (((uint64_t) record->fBlockCount + 2) >= sb->fJournalBlocks)
+         || ! OrphanIsPlausible(sb, record->fOrphanFileNum)
+       ) {
+        err = ENOENT;
+    }
+    return err;
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Directory Blocks
+
+extern int EmptyFSDirBlockValidate(const void *block, uint32_t blockSize)
+    // See comment in header.
+{
+    int                             err;
+    const EmptyFSDirBlockHeader *   header;
+    const EmptyFSDirEntry *         entry;
+    uint32_t                        offset;
+    uint32_t                        recordLength;
+
+    header = (const EmptyFSDirBlockHeader *) block;
+
+    err = 0;
+    if ( EmptyFSSwapLE32(header->fMagic) != kEmptyFSDirBlockMagic ) {
+        err = EIO;
+    }
+    offset = sizeof(EmptyFSDirBlockHeader);
+    while ( (err == 0) && (offset < blockSize) ) {
+        if ( (blockSize - offset) < kEmptyFSDirEntryHeaderSize ) {
+            err = EIO;
+            break;
+        }
+        entry = (const EmptyFSDirEntry *) (((const char *) block) + offset);
+        recordLength = EmptyFSSwapLE16(entry->fRecordLength);
+        if (    (recordLength < kEmptyFSDirEntryHeaderSize)
+             || ((recordLength % kEmptyFSDirEntryAlign) != 0)
+             || (recordLength > (blockSize - offset)) ) {
+            err = EIO;
+        } else if ( (entry->fFileNum != 0) && ( (entry->fNameLength == 0) || ((uint32_t) EmptyFSDirEntrySize(entry->fNameLength) > recordLength) ) ) {
+            err = EIO;
+        } else {
+            offset += recordLength;
+        }
+    }
+    return err;
+}
+
+extern void EmptyFSDirBlockInit(void *block, uint32_t blockSize)
+    // See comment in header.
+{
+    EmptyFSDirBlockHeader * header;
+    EmptyFSDirEntry *       entry;
+
+    memset(block, 0, blockSize);
+    header = (EmptyFSDirBlockHeader *) block;
+    header->fMagic = EmptyFSSwapLE32(kEmptyFSDirBlockMagic);
+    entry = (EmptyFSDirEntry *) (header + 1);
+    entry->fRecordLength = EmptyFSSwapLE16( (uint16_t) (blockSize - sizeof(EmptyFSDirBlockHeader)) );
+}
+
+extern EmptyFSDirEntry * EmptyFSDirBlockNextEntry(const void *block, uint32_t blockSize, const EmptyFSDirEntry *entry)
+    // See comment in header.
+{
+    uint32_t    offset;
+
+    if (entry == NULL) {
+        offset = sizeof(EmptyFSDirBlockHeader);
+    } else {
+        offset = (uint32_t) (((const char *) entry) - ((const char *) block)) + EmptyFSSwapLE16(entry->fRecordLength);
+    }
+    if (offset >= blockSize) {
+        return NULL;
+    }
+    return (EmptyFSDirEntry *) (((const char *) block) + offset);
+}
+
+static EmptyFSDirEntry * DirBlockFindRoom(const void *block, uint32_t blockSize, size_t nameLen)
+    // Returns the first entry in a (valid) directory block that has room
+    // for a name of length nameLen, either because it's free or because
+    // it has enough slack at the end, or NULL if there isn't one.
+{
+    EmptyFSDirEntry *   entry;
+    uint32_t            recordLength;
+    uint32_t            usedLength;
+    uint32_t            neededLength;
+
+    neededLength = EmptyFSDirEntrySize(nameLen);
+
+    entry = NULL;
+    while ( (entry = EmptyFSDirBlockNextEntry(block, blockSize, entry)) != NULL ) {
+        recordLength = EmptyFSSwapLE16(entry->fRecordLength);
+        if (entry->fFileNum == 0) {
+            usedLength = 0;
+        } else {
+            usedLength = EmptyFSDirEntrySize(entry->fNameLength);
+        }
+        if ( (recordLength - usedLength) >= neededLength ) {
+            break;
+        }
+    }
+    return entry;
+}
+
+extern int EmptyFSDirBlockHasRoom(const void *block, uint32_t blockSize, size_t nameLen)
+    // See comment in header.
+{
+    return (nameLen != 0) && (nameLen <= kEmptyFSMaxNameLength) && (DirBlockFindRoom(block, blockSize, nameLen) != NULL);
+}
+
+extern int EmptyFSDirBlockInsertEntry(
+    void *          block,
+    uint32_t        blockSize,
+    const char *    name,
+    size_t          nameLen,
+    uint32_t        fileNum,
+    uint8_t         type
+)
+    // See comment in header.  We use the first entry with enough space, either
+    // a free entry or the slack at the end of a used one, splitting it if
+    // there's space left over.
+{
+    int                 err;
+    EmptyFSDirEntry *   entry;
+    EmptyFSDirEntry *   newEntry;
+    uint32_t            recordLength;
+    uint32_t            usedLength;
+
+    if ( (nameLen == 0) || (nameLen > kEmptyFSMaxNameLength) || (fileNum == 0) ) {
+        return EINVAL;
+    }
+
+    err = ENOSPC;
+    entry = DirBlockFindRoom(block, blockSize, nameLen);
+    if (entry != NULL) {
+        recordLength = EmptyFSSwapLE16(entry->fRecordLength);
+        if (entry->fFileNum == 0) {
+            usedLength = 0;
+        } else {
+            usedLength = EmptyFSDirEntrySize(entry->fNameLength);
+        }
+        if (usedLength == 0) {
+            newEntry = entry;
+        } else {
+            entry->fRecordLength = EmptyFSSwapLE16( (uint16_t) usedLength );
+            newEntry = (EmptyFSDirEntry *) (((char *) entry) + usedLength);
+            recordLength -= usedLength;
+        }
+        newEntry->fFileNum      = EmptyFSSwapLE32(fileNum);
+        newEntry->fRecordLength = EmptyFSSwapLE16( (uint16_t) recordLength );
+        newEntry->fNameLength   = (uint8_t) nameLen;
+        newEntry->fType         = type;
+        memcpy(newEntry->fName, name, nameLen);
+        err = 0;
+    }
+    return err;
+}
+
+extern uint32_t EmptyFSDirNameHash(const EmptyFSSuperblock *sb, const char *name, size_t nameLen)
+    // See comment in header.
+{
+    uint32_t    hash;
+    size_t      index;
+
+    hash = 2166136261U ^ (  ((uint32_t) sb->fUUID[0])
+                          | ((uint32_t) sb->fUUID[1] << 8)
+                          | ((uint32_t) sb->fUUID[2] << 16)
+                          | ((uint32_t) sb->fUUID[3] << 24) );
+    for (index = 0; index < nameLen; index++) {
+        hash = (hash ^ (uint8_t) name[index]) * 16777619U;
+    }
+    return hash;
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Directory Index
+
+extern uint32_t EmptyFSDirIndexCapacity(const EmptyFSSuperblock *sb)
+    // See comment in header.  fCount is 16 bits, but even a 64 KB node
+    // holds fewer records than that.
+{
+    return (uint32_t) ((sb->fBlockSize - sizeof(EmptyFSDirIndexHeader)) / sizeof(EmptyFSDirIndexRecord));
+}
+
+extern int EmptyFSDirIndexNodeValidate(const EmptyFSSuperblock *sb, const void *node)
+    // See comment in header.
+{
+    int                             err;
+    const EmptyFSDirIndexHeader *   header;
+    const EmptyFSDirIndexRecord *   records;
+    uint32_t                        level;
+    uint32_t                        count;
+    uint32_t                        index;
+    uint64_t                        child;
+
+    header  = (const EmptyFSDirIndexHeader *) node;
+    records = EmptyFSDirIndexRecords(node);
+    level   = EmptyFSSwapLE16(header->fLevel);
+    count   = EmptyFSSwapLE16(header->fCount);
+
+    err = 0;
+    if (    (EmptyFSSwapLE32(header->fMagic) != kEmptyFSDirIndexMagic)
+         || (level >= kEmptyFSDirIndexMaxDepth)
+         || (header->fReserved != 0)
+         || (count > EmptyFSDirIndexCapacity(sb))
+         || ( (level != 0) && (count == 0) ) ) {
+        err = EIO;
+    }
+    for (index = 0; (err == 0) && (index < count); index++) {
+        child = EmptyFSSwapLE64(records[index].fChild);
+        if (level == 0) {
+            if (child != 0) {
+                err = EIO;
+            }
+        } else if ( (child < sb->fDataStart) || (child >= sb->fBlockCount) ) {
+            err = EIO;
+        }
+
+        // Keys must not go down.  In an interior node, the first key doesn't
+        // count.
+
+        if (    (err == 0)
+             && (index > ((level == 0) ? 0U : 1U))
+             && (EmptyFSSwapLE64(records[index].fKey) < EmptyFSSwapLE64(records[index - 1].fKey)) ) {
+            err = EIO;
+        }
+    }
+    return err;
+}
+
+extern void EmptyFSDirIndexNodeInit(void *node, uint32_t blockSize, uint16_t level)
+    // See comment in header.
+{
+    EmptyFSDirIndexHeader * header;
+
+    memset(node, 0, blockSize);
+    header = (EmptyFSDirIndexHeader *) node;
+    header->fMagic = EmptyFSSwapLE32(kEmptyFSDirIndexMagic);
+    header->fLevel = EmptyFSSwapLE16(level);
+}
+
+extern uint32_t EmptyFSDirIndexNodeSearch(const void *node, uint64_t key, int after)
+    // See comment in header.  This is a binary search.  In an interior node
+    // the first key is ignored, which is the same as treating it as smaller
+    // than any key, so we never look at it.
+{
+    const EmptyFSDirIndexHeader *   header;
+    const EmptyFSDirIndexRecord *   records;
+    uint32_t                        low;
+    uint32_t                        high;
+    uint32_t                        mid;
+    uint64_t                        thisKey;
+
+    header  = (const EmptyFSDirIndexHeader *) node;
+    records = EmptyFSDirIndexRecords(node);
+
+    low  = (EmptyFSSwapLE16(header->fLevel) == 0) ? 0 : 1;
+    high = EmptyFSSwapLE16(header->fCount);
+    if (low > high) {
+        low = high;
+    }
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        thisKey = EmptyFSSwapLE64(records[mid].fKey);
+        if ( (thisKey < key) || ( after && (thisKey == key) ) ) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+extern int EmptyFSDirIndexNodeInsert(
+    const EmptyFSSuperblock *   sb,
+    void *                      node,
+    uint32_t                    index,
+    uint64_t                    key,
+    uint64_t                    child
+)
+    // See comment in header.
+{
+    int                     err;
+    EmptyFSDirIndexHeader * header;
+    EmptyFSDirIndexRecord * records;
+    uint32_t                count;
+
+    header  = (EmptyFSDirIndexHeader *) node;
+    records = EmptyFSDirIndexRecords(node);
+    count   = EmptyFSSwapLE16(header->fCount);
+
+    err = ENOSPC;
+    if ( (index <= count) && (count < EmptyFSDirIndexCapacity(sb)) ) {
+        memmove(&records[index + 1], &records[index], (count - index) * sizeof(*records));
+        records[index].fKey   = EmptyFSSwapLE64(key);
+        records[index].fChild = EmptyFSSwapLE64(child);
+        header->fCount = EmptyFSSwapLE16( (uint16_t) (count + 1) );
+        err = 0;
+    }
+    return err;
+}
+
+extern void EmptyFSDirIndexNodeRemove(void *node, uint32_t index)
+    // See comment in header.
+{
+    EmptyFSDirIndexHeader * header;
+    EmptyFSDirIndexRecord * records;
+    uint32_t                count;
+
+    header  = (EmptyFSDirIndexHeader *) node;
+    records = EmptyFSDirIndexRecords(node);
+    count   = EmptyFSSwapLE16(header->fCount);
+
+    if (index < count) {
+        memmove(&records[index], &records[index + 1], (count - index - 1) * sizeof(*records));
+        memset(&records[count - 1], 0, sizeof(*records));
+        header->fCount = EmptyFSSwapLE16( (uint16_t) (count - 1) );
+    }
+}
+
+extern uint64_t EmptyFSDirIndexNodeSplit(void *node, void *newNode, uint32_t blockSize)
+    // See comment in header.
+{
+    EmptyFSDirIndexHeader * header;
+    EmptyFSDirIndexRecord * records;
+    uint32_t                count;
+    uint32_t                keep;
+
+    header  = (EmptyFSDirIndexHeader *) node;
+    records = EmptyFSDirIndexRecords(node);
+    count   = EmptyFSSwapLE16(header->fCount);
+    keep    = count / 2;
+
+    EmptyFSDirIndexNodeInit(newNode, blockSize, EmptyFSSwapLE16(header->fLevel));
+    memcpy(EmptyFSDirIndexRecords(newNode), &records[keep], (count - keep) * sizeof(*records));
+    ((EmptyFSDirIndexHeader *) newNode)->fCount = EmptyFSSwapLE16( (uint16_t) (count - keep) );
+
+    memset(&records[keep], 0, (count - keep) * sizeof(*records));
+    header->fCount = EmptyFSSwapLE16( (uint16_t) keep );
+
+    return EmptyFSSwapLE64(EmptyFSDirIndexRecords(newNode)[0].fKey);
+}
@@ -0,0 +1,829 @@
+/*
+    File:       EmptyFSFormat.h
+
+    Contains:   On-disk format definitions for EmptyFS volumes.
+
+    Written by: DTS
+
+    Copyright:  Copyright (c) 2006 by Apple Computer, Inc., All Rights Reserved.
+
+    Disclaimer: IMPORTANT:  This Apple software is supplied to you by Apple Computer, Inc.
+                ("Apple") in consideration of your agreement to the following terms, and your
+                use, installation, modification or redistribution of this Apple software
+                constitutes acceptance of these terms.  If you do not agree with these terms,
+                please do not use, install, modify or redistribute this Apple software.
+
+                In consideration of your agreement to abide by the following terms, and subject
+                to these terms, Apple grants you a personal, non-exclusive license, under Apple's
+                copyrights in this original Apple software (the "Apple Software"), to use,
+                reproduce, modify and redistribute the Apple Software, with or without
+                modifications, in source and/or binary forms; provided that if you redistribute
+                the Apple Software in its entirety and without modifications, you must retain
+                this notice and the following text and disclaimers in all such redistributions of
+                the Apple Software.  Neither the name, trademarks, service marks or logos of
+                Apple Computer, Inc. may be used to endorse or promote products derived from the
+                Apple Software without specific prior written permission from Apple.  Except as
+                expressly stated in this notice, no other rights or licenses, express or implied,
+                are granted by Apple herein, including but not limited to any patent rights that
+                may be infringed by your derivative works or by other works in which the Apple
+                Software may be incorporated.
+
+                The Apple Software is provided by Apple on an "AS IS" basis.  APPLE MAKES NO
+                WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                PURPOSE, REGARDING THE APPLE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                COMBINATION WITH YOUR PRODUCTS.
+
+                IN NO EVENT SHALL APPLE BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                OF THE APPLE SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF APPLE HAS BEEN
+                ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+    Change History (most recent first):
+
+$Log$
+
+*/
+
+#ifndef _EMPTYFSFORMAT_H_
+#define _EMPTYFSFORMAT_H_
+
+// This header defines the on-disk format of an EmptyFS volume.  It's shared by
+// the KEXT ("EmptyFS.c") and by the user-space code that builds and reads volume
+// images ("EmptyFSImage.c"), so it must compile in both environments.  The
+// routines declared here (implemented in "EmptyFSFormat.c") are pure functions
+// of their arguments; they don't do any I/O, allocate memory or take locks.
+//
+// Volume Layout
+// -------------
+// A volume is an array of fixed-size blocks (fBlockSize bytes each, a power
+// of two between 512 bytes and 64 KB).  Block numbers are relative to the
+// start of the volume.  The layout is:
+//
+//   block 0                        superblock (in the first 512 bytes)
+//   fBitmapStart    (usually 1)    allocation bitmap, fBitmapBlocks long
+//   fFileTableStart                file table, fFileTableBlocks long
+//   fJournalStart   (optional)     metadata journal, fJournalBlocks long
+//   fDataStart                     file and directory data
+//
+// The allocation bitmap has one bit per block on the volume, least significant
+// bit first; a set bit means the block is in use.  The blocks that hold the
+// superblock, the bitmap, the file table and the journal are always marked as
+// in use.
+//
+// The file table is an array of fixed-size file records, indexed by file number.
+// File numbers 0 and 1 are never used (0 marks a free directory entry), and the
+// root directory is always file number 2 (kEmptyFSRootFileNum).  A file record
+// whose fMode is zero is free.
+//
+// The data of a file or directory is described by a list of extents, each a
+// run of contiguous blocks.  The first kEmptyFSInlineExtentCount extents live
+// in the file record itself; any more are stored in a chain of overflow extent
+// blocks, starting at fOverflowBlock.
+//
+// A directory's data is a sequence of directory blocks, each of which starts
+// with a small header and is then packed with variable-length directory entries.
+// Entries never span blocks, and the last entry in each block extends to the end
+// of the block.  A free entry (one whose fFileNum is zero) is just padding.
+// "." and ".." are not stored; the parent of a directory is recorded in its
+// file record (fParentFileNum).
+//
+// Directory Index
+// ---------------
+// On a volume with the kEmptyFSROCompatDirIndex feature, a directory may also
+// have an index, whose root block is given by fDirIndexBlock in its file
+// record.  The index is a B+tree with one record for each used entry in the
+// directory.  A record's key is EmptyFSDirIndexKey(hash, logicalBlock), where
+// hash is EmptyFSDirNameHash of the entry's name and logicalBlock is the block
+// of the directory that holds it.  Keys need not be unique: names whose hashes
+// collide just have records next to each other in key order, so a lookup
+// searches each of their blocks in turn.  The directory blocks are laid out
+// exactly as they are without an index, so a reader can ignore the index and
+// search them all.  It's a read-only compatible feature because a writer that
+// ignored the index would leave it out of date.
+//
+// Each node of the tree is a block that holds an EmptyFSDirIndexHeader followed
+// by fCount EmptyFSDirIndexRecords, sorted by key.  In a leaf (fLevel zero)
+// each record's fChild is zero.  In an interior node each record points to a
+// child node one level down; every key in the child's subtree is greater than
+// or equal to the record's key and less than or equal to the next record's
+// key.  The first record's key is ignored.  The tree is at most
+// kEmptyFSDirIndexMaxDepth levels deep, and only the root may be empty (an
+// empty root is a leaf).  Index blocks are not part of the directory's extents
+// and are not counted in its fBlockCount.
+//
+// To look up a name, start at the root and, at each interior node, follow the
+// last record whose key is less than EmptyFSDirIndexKey(hash, 0), or the first
+// record if there's no such record.  Then step through the records in key
+// order, starting at the first one whose key is at least that value, and search
+// the directory block that each one names, until you find the name or come to
+// a record with a different hash.
+//
+// Implementations give a directory an index when it grows to
+// kEmptyFSDirIndexMinBlocks blocks; smaller directories are quicker to search
+// linearly.
+//
+// Byte Order
+// ----------
+// Everything on disk is little endian.  The structures below are declared with
+// their on-disk layout; use the EmptyFSSwapXxx routines to convert between disk
+// and host byte order (the conversion is its own inverse, so the same routine
+// works in both directions).  Directory blocks are read in place (they may be
+// shared by many readers in the buffer cache), so directory entry fields must be
+// accessed via the EmptyFSSwapLE macros.
+//
+// Compatibility
+// -------------
+// The superblock has a major and minor version number, and three sets of feature
+// flags.  An implementation must refuse to mount a volume with a major version,
+// or an incompatible feature, that it doesn't understand.  Unknown read-only
+// compatible features mean that the volume may be read but not written, and
+// unknown compatible features can be ignored.
+//
+// Journal
+// -------
+// A volume with the kEmptyFSROCompatJournal feature has a metadata journal,
+// fJournalBlocks long, starting at fJournalStart.  The journal is a circular
+// log of the new contents of metadata blocks (bitmap, file table, overflow
+// extent and directory blocks); file data is never journalled.  Before a
+// metadata block is written to its home location, its new contents must
+// already be in the journal, so a crash at any point leaves the volume in
+// the state of some complete transaction once the journal is replayed.
+// It's a read-only compatible feature because an implementation that wrote
+// metadata without journalling it could have its changes undone by a later
+// replay.
+//
+// Block 0 of the journal holds an EmptyFSJournalHeader.  The rest of the
+// journal (journal-relative blocks 1 through fJournalBlocks - 1) holds
+// records, each of which is a descriptor block (an EmptyFSJournalRecord
+// followed by an array of little endian block numbers) and then fBlockCount
+// data blocks, the new contents of the listed blocks.  A record wraps from
+// the end of the journal back to block 1.  Records have consecutive sequence
+// numbers, and each has a checksum that covers its descriptor and data blocks.
+//
+// A transaction is one or more records; every record but the last has the
+// kEmptyFSJournalRecordContinued flag set, and the last one holds the
+// volume's free block, free file and directory counts, and the head of its
+// orphan list (see "Orphans", below), as of the end of the transaction.  To replay the journal, start at the header's fStart, whose
+// sequence number should be fSequence, and read records until you come to
+// one with a bad magic number, the wrong sequence number or a bad checksum.
+// Then write the data blocks of every complete transaction to their home
+// locations, in order, and discard any partial transaction at the end.
+// Finally, write a new header whose fStart is just past the last complete
+// transaction.  If the journal contains no complete transaction, the
+// header's counts are the volume's counts.
+//
+// The superblock counts (and fOrphanFileNum) of a journalled volume are only
+// brought up to date when it's unmounted; while it's mounted they live in
+// the journal.
+//
+// Lazy File Table
+// ---------------
+// Zeroing the file table of a big volume takes a long time (it's often the
+// biggest metadata area), so a volume with the kEmptyFSROCompatLazyFileTable
+// feature may leave all but the first fFileTableInitBlocks blocks of its file
+// table uninitialised.  Those blocks can hold anything, and their records
+// must be treated as free (all zeros) without reading them;
+// EmptyFSFileTableInitCount tells you where they start.  Before writing a
+// record beyond that point, an implementation must zero every block from
+// fFileTableInitBlocks up to and including the record's block, and write a
+// superblock with a bigger fFileTableInitBlocks, in that order.  Once the
+// whole table has been initialised, it may clear the feature (and
+// fFileTableInitBlocks).  The blocks up to and including the one that holds
+// the root directory's record are always initialised.  It's a read-only
+// compatible feature because a writer that didn't know about it would take
+// whatever the uninitialised blocks held for file records.
+//
+// Compression
+// -----------
+// A volume with the kEmptyFSIncompatCompression feature may have compressed
+// regular files.  A file is compressed if its fCompressedChunkSize is not
+// zero; it's then divided into chunks of that many bytes (a power of two
+// between kEmptyFSMinCompressedChunkSize and kEmptyFSMaxCompressedChunkSize,
+// and at least the block size), the last of which may be short, and each
+// chunk is stored in exactly one extent: extent i holds the bytes from
+// i * fCompressedChunkSize up to the next chunk or the end of the file.  So
+// the extent array is itself the index that lets you read any part of the
+// file without decompressing what comes before it.  The low byte of each
+// extent's fFlags says how its chunk is stored:
+//
+// o kEmptyFSCompressionNone -- The chunk is stored as is, in the smallest
+//   number of blocks that holds it.
+//
+// o kEmptyFSCompressionLZ4 -- The extent holds an LZ4 block (the raw format,
+//   without a frame header) that decompresses to the whole chunk, padded with
+//   zeros to the end of the extent.  The extent is never longer than the
+//   chunk would be uncompressed.
+//
+// A compressed file's fBlockCount is the number of blocks in its extents, and
+// its fSize can be much bigger than that.  It's an incompatible feature
+// because an implementation that didn't know about it would return the
+// compressed bytes as the file's data.
+//
+// Metadata Checksums
+// ------------------
+// On a volume with the kEmptyFSROCompatMetadataChecksums feature, every
+// metadata structure except the allocation bitmap carries a CRC-32C
+// (EmptyFSChecksum) of itself, computed as if its checksum field were zero:
+//
+// o The superblock's fChecksum covers the kEmptyFSSuperblockSize bytes of
+//   the superblock.
+//
+// o Each used file record's fChecksum covers the record, seeded with its
+//   file number (as a little endian 32-bit number).  Free records have no
+//   checksum, so a zeroed file table block is valid as it is.
+//
+// o The fChecksum in the header of each directory block and directory index
+//   node, and in the EmptyFSBlockTrailer at the end of each overflow extent
+//   block, covers the whole block, seeded with its block number (as a little
+//   endian 64-bit number), so a block that's written to the wrong place
+//   doesn't pass.  On such a volume an overflow block holds one extent fewer,
+//   to make room for the trailer.
+//
+// Seeding means continuing the checksum over the file or block number, so
+// the value in a block is EmptyFSChecksum(EmptyFSChecksum(0, &number,
+// sizeof(number)), block, size).  EmptyFSMetaBlockSeal and
+// EmptyFSMetaBlockVerify do all of this for a whole block.  The journal
+// already has its own checksums, and the bitmap has none: a bitmap block has
+// no spare bytes, and it's checked against the rest of the metadata by
+// fsck.  It's a read-only compatible feature because a writer that didn't
+// know about it would leave stale checksums behind.
+//
+// Data Checksums
+// --------------
+// A volume with the kEmptyFSROCompatDataChecksums feature may also have
+// checksums of file data.  A compressed file (see "Compression", above) with
+// a non-zero fChunkChecksumBlock has a checksum table: an array of
+// fExtentCount little endian 32-bit values, one for each extent, in as few
+// contiguous blocks as hold it, starting at that block.  Entry i is the
+// EmptyFSChecksum of all of extent i's blocks, as stored on disk (so, for a
+// compressed chunk, of the LZ4 data and its padding), with no seed.  Like
+// index blocks, the table's blocks are not part of the file's extents and
+// are not counted in its fBlockCount.  Only compressed files can have a
+// table, because they're only ever written in one go, when the volume is
+// built, so the table can't go out of date; an image builder that wants to
+// checksum a file that doesn't compress stores it as a compressed file whose
+// chunks are all kEmptyFSCompressionNone.
+//
+// Orphans
+// -------
+// A file that's removed while it's still open (a file, not a directory,
+// whose last link goes away while some process has it open) can't be freed
+// until it's closed, so its record stays in use, with an fLinkCount of zero, until
+// then.  Such a record is an orphan, and every orphan is on the orphan list:
+// the superblock's fOrphanFileNum is the file number of the first orphan,
+// each orphan's fNextOrphan is the file number of the next, and the last
+// orphan's fNextOrphan (like that of every record that isn't an orphan) is
+// zero.  An implementation adds a file to the list in the same transaction
+// that removes its last directory entry, and takes it off the list in the
+// same transaction that frees it, so if the system crashes before the file
+// is closed, the list still names it.  Whatever mounts the volume read/write
+// next must free every file on the list (its blocks, overflow extent blocks
+// and record) before it does anything else.  fsck treats the files on the
+// list as frees that haven't happened yet, not as lost files.  On a
+// journalled volume, the head of the list also lives in the journal, like
+// the volume counts.
+//
+// An older implementation that doesn't know about the list mounts the volume
+// (fOrphanFileNum and fNextOrphan were reserved, and zero, before), but
+// never frees the orphans, so their space is lost until fsck finds them.
+
+#if KERNEL && ! EMPTYFS_USER_KPI
+    #include <sys/types.h>
+    #include <libkern/OSByteOrder.h>
+#else
+    #include <stdint.h>
+    #include <stddef.h>
+    #include <sys/types.h>
+    #if defined(__APPLE__)
+        #include <libkern/OSByteOrder.h>
+    #else
+        #include <endian.h>
+    #endif
+#endif
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Byte Order
+
+#if defined(__APPLE__)
+    #define EmptyFSSwapLE16(x)  OSSwapLittleToHostInt16(x)
+    #define EmptyFSSwapLE32(x)  OSSwapLittleToHostInt32(x)
+    #define EmptyFSSwapLE64(x)  OSSwapLittleToHostInt64(x)
+#else
+    #define EmptyFSSwapLE16(x)  le16toh(x)
+    #define EmptyFSSwapLE32(x)  le32toh(x)
+    #define EmptyFSSwapLE64(x)  le64toh(x)
+#endif
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Constants
+
+enum {
+    kEmptyFSSuperblockMagic     = 'EmFS',
+    kEmptyFSMajorVersion        = 1,
+    kEmptyFSMinorVersion        = 1,
+
+    kEmptyFSSuperblockOffset    = 0,            // byte offset of the superblock on the volume
+    kEmptyFSSuperblockSize      = 512,
+
+    kEmptyFSMinBlockSize        = 512,
+    kEmptyFSMaxBlockSize        = 65536,
+    kEmptyFSDefaultBlockSize    = 4096,
+
+    kEmptyFSFileRecordSize      = 256,
+    kEmptyFSFirstFileNum        = 2,            // file numbers below this are reserved
+    kEmptyFSRootFileNum         = 2,
+    kEmptyFSMaxFileCount        = 0x7FFFFFFF,   // file numbers must fit in a (signed) 32-bit ino_t
+
+    kEmptyFSInlineExtentCount   = 8,
+
+    kEmptyFSVolumeNameSize      = 64            // including the terminating null
+};
+
+// Superblock fState values.
+
+enum {
+    kEmptyFSStateClean          = 0x00000001    // volume was cleanly unmounted (or never mounted)
+};
+
+// Feature flags.  The masks list the features that this version of the code
+// understands.
+
+enum {
+    kEmptyFSROCompatJournal         = 0x00000001,   // volume has a metadata journal; see "Journal", above
+    kEmptyFSROCompatDirIndex        = 0x00000002,   // directories may have an index; see "Directory Index", above
+    kEmptyFSROCompatLazyFileTable   = 0x00000004,   // file table may be partly uninitialised; see "Lazy File Table", above
+    kEmptyFSROCompatMetadataChecksums = 0x00000008, // metadata has checksums; see "Metadata Checksums", above
+    kEmptyFSROCompatDataChecksums   = 0x00000010    // compressed files may have checksums; see "Data Checksums", above
+};
+
+enum {
+    kEmptyFSIncompatCompression     = 0x00000001    // files may be compressed; see "Compression", above
+};
+
+enum {
+    kEmptyFSCompatFeaturesKnown     = 0,
+    kEmptyFSROCompatFeaturesKnown   = kEmptyFSROCompatJournal | kEmptyFSROCompatDirIndex | kEmptyFSROCompatLazyFileTable
+                                    | kEmptyFSROCompatMetadataChecksums | kEmptyFSROCompatDataChecksums,
+    kEmptyFSIncompatFeaturesKnown   = kEmptyFSIncompatCompression
+};
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Superblock
+
+struct EmptyFSSuperblock {
+    uint32_t    fMagic;                 // must be kEmptyFSSuperblockMagic
+    uint16_t    fMajorVersion;          // must be kEmptyFSMajorVersion
+    uint16_t    fMinorVersion;          // informational
+    uint32_t    fBlockSize;             // in bytes; power of two, kEmptyFSMinBlockSize..kEmptyFSMaxBlockSize
+    uint32_t    fFileRecordSize;        // must be kEmptyFSFileRecordSize
+    uint64_t    fBlockCount;            // total blocks on the volume
+    uint64_t    fFreeBlockCount;        // blocks not marked in the bitmap
+    uint32_t    fFileCount;             // number of file records in the file table, including the reserved ones
+    uint32_t    fFreeFileCount;         // number of free file records
+    uint32_t    fDirectoryCount;        // number of directories, including the root
+    uint32_t    fRootFileNum;           // must be kEmptyFSRootFileNum
+    uint64_t    fBitmapStart;           // first block of the allocation bitmap
+    uint64_t    fBitmapBlocks;
+    uint64_t    fFileTableStart;        // first block of the file table
+    uint64_t    fFileTableBlocks;
+    uint64_t    fDataStart;             // first block available for file data
+    uint32_t    fCompatFeatures;
+    uint32_t    fROCompatFeatures;
+    uint32_t    fIncompatFeatures;
+    uint32_t    fState;                 // kEmptyFSStateXxx
+    int64_t     fCreateTime;            // nanoseconds since 1 Jan 1970 UTC
+    int64_t     fModifyTime;            // ditto
+    uint8_t     fUUID[16];
+    char        fVolumeName[kEmptyFSVolumeNameSize];   // UTF-8, null terminated, null padded
+    uint64_t    fJournalStart;          // first block of the journal; zero if no kEmptyFSROCompatJournal
+    uint64_t    fJournalBlocks;         // ditto
+    uint64_t    fFileTableInitBlocks;   // initialised blocks at the start of the file table; zero if no kEmptyFSROCompatLazyFileTable
+    uint32_t    fChecksum;              // see "Metadata Checksums", above; zero if no kEmptyFSROCompatMetadataChecksums
+    uint32_t    fOrphanFileNum;         // first file on the orphan list, or zero; see "Orphans", above
+    uint8_t     fReserved[280];         // must be zero
+};
+typedef struct EmptyFSSuperblock EmptyFSSuperblock;
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** File Records and Extents
+
+struct EmptyFSExtent {
+    uint64_t    fStartBlock;            // first block of the extent
+    uint32_t    fBlockCount;            // number of blocks; zero only in unused slots
+    uint32_t    fFlags;                 // kEmptyFSCompressionXxx in the low byte if the file is compressed, otherwise zero
+};
+typedef struct EmptyFSExtent EmptyFSExtent;
+
+struct EmptyFSFileRecord {
+    uint16_t        fMode;              // POSIX mode (type and permissions); zero if the record is free
+    uint16_t        fLinkCount;
+    uint32_t        fFlags;             // BSD file flags (UF_xxx, SF_xxx)
+    uint32_t        fUID;
+    uint32_t        fGID;
+    uint64_t        fSize;              // logical size, in bytes
+    uint64_t        fBlockCount;        // number of blocks allocated to the data
+    int64_t         fCreateTime;        // nanoseconds since 1 Jan 1970 UTC
+    int64_t         fModifyTime;        // ditto
+    int64_t         fChangeTime;        // ditto
+    int64_t         fAccessTime;        // ditto
+    uint32_t        fParentFileNum;     // the directory containing this object; the root is its own parent
+    uint32_t        fGeneration;        // incremented each time the record is reused
+    uint32_t        fExtentCount;       // total number of extents, including those in overflow blocks
+    uint32_t        fNextOrphan;        // next file on the orphan list, or zero; see "Orphans", above
+    uint64_t        fOverflowBlock;     // first overflow extent block, or zero
+    EmptyFSExtent   fExtents[kEmptyFSInlineExtentCount];
+    uint64_t        fDirIndexBlock;     // directories only: root of the directory index, or zero
+    uint32_t        fCompressedChunkSize;   // regular files only: see "Compression", above; zero if not compressed
+    uint32_t        fChecksum;          // see "Metadata Checksums", above; zero if no kEmptyFSROCompatMetadataChecksums
+    uint64_t        fChunkChecksumBlock;    // compressed files only: see "Data Checksums", above; zero if none
+    uint8_t         fReserved2[16];     // must be zero
+};
+typedef struct EmptyFSFileRecord EmptyFSFileRecord;
+
+// How the chunk in an extent of a compressed file is stored, in the low byte
+// of the extent's fFlags.  The other bits must be zero.
+
+enum {
+    kEmptyFSCompressionMask         = 0x000000FF,
+    kEmptyFSCompressionNone         = 0,
+    kEmptyFSCompressionLZ4          = 1,
+
+    kEmptyFSMinCompressedChunkSize  = 4096,
+    kEmptyFSMaxCompressedChunkSize  = 1024 * 1024,
+    kEmptyFSDefaultCompressedChunkSize = 65536
+};
+
+// An overflow extent block holds the extents of a file beyond those that fit
+// in its file record.  The extents fill the rest of the block after the header
+// except, on a volume with metadata checksums, for the EmptyFSBlockTrailer in
+// the last 8 bytes; EmptyFSOverflowExtentsPerBlock says how many fit.
+
+enum {
+    kEmptyFSOverflowMagic   = 'EmEx'
+};
+
+struct EmptyFSOverflowHeader {
+    uint32_t    fMagic;                 // must be kEmptyFSOverflowMagic
+    uint32_t    fExtentCount;           // number of valid extents in this block
+    uint64_t    fNextBlock;             // next overflow block, or zero
+};
+typedef struct EmptyFSOverflowHeader EmptyFSOverflowHeader;
+
+struct EmptyFSBlockTrailer {
+    uint32_t    fReserved;              // must be zero
+    uint32_t    fChecksum;              // see "Metadata Checksums", above
+};
+typedef struct EmptyFSBlockTrailer EmptyFSBlockTrailer;
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Directory Blocks
+
+enum {
+    kEmptyFSDirBlockMagic   = 'EmDr',
+    kEmptyFSDirEntryAlign   = 8,
+    kEmptyFSMaxNameLength   = 255
+};
+
+struct EmptyFSDirBlockHeader {
+    uint32_t    fMagic;                 // must be kEmptyFSDirBlockMagic
+    uint32_t    fChecksum;              // see "Metadata Checksums", above; zero if no kEmptyFSROCompatMetadataChecksums
+};
+typedef struct EmptyFSDirBlockHeader EmptyFSDirBlockHeader;
+
+struct EmptyFSDirEntry {
+    uint32_t    fFileNum;               // zero if this entry is free
+    uint16_t    fRecordLength;          // total length of this entry, a multiple of kEmptyFSDirEntryAlign
+    uint8_t     fNameLength;            // not null terminated
+    uint8_t     fType;                  // DT_xxx value from <sys/dirent.h>
+    char        fName[];                // actually fNameLength bytes
+};
+typedef struct EmptyFSDirEntry EmptyFSDirEntry;
+
+enum {
+    kEmptyFSDirEntryHeaderSize = 8      // offsetof(EmptyFSDirEntry, fName)
+};
+
+// EmptyFSDirEntrySize returns the space needed by an entry with a name of
+// the given length.
+
+#define EmptyFSDirEntrySize(nameLen) \
+    ( (kEmptyFSDirEntryHeaderSize + (nameLen) + (kEmptyFSDirEntryAlign - 1)) & ~(kEmptyFSDirEntryAlign - 1) )
+
+// A directory's size can't exceed kEmptyFSMaxDirSize.  Every entry starts 
+// on a kEmptyFSDirEntryAlign boundary, so this lets the KEXT name any 
+// position in any directory with a directory cookie that fits in 31 bits.
+// It's a multiple of kEmptyFSMaxBlockSize.
+
+#define kEmptyFSMaxDirSize  ((uint64_t) 0x3FFFF0000ULL)        // 16 GB less 64 KB
+
+// Directory index nodes; see "Directory Index", above.
+
+enum {
+    kEmptyFSDirIndexMagic       = 'EmDx',
+    kEmptyFSDirIndexMinBlocks   = 4,
+    kEmptyFSDirIndexMaxDepth    = 8
+};
+
+struct EmptyFSDirIndexHeader {
+    uint32_t    fMagic;                 // must be kEmptyFSDirIndexMagic
+    uint16_t    fLevel;                 // zero for a leaf, otherwise one more than the level of the children
+    uint16_t    fCount;                 // number of records that follow
+    uint32_t    fChecksum;              // see "Metadata Checksums", above; zero if no kEmptyFSROCompatMetadataChecksums
+    uint32_t    fReserved;              // must be zero
+};
+typedef struct EmptyFSDirIndexHeader EmptyFSDirIndexHeader;
+
+struct EmptyFSDirIndexRecord {
+    uint64_t    fKey;                   // EmptyFSDirIndexKey
+    uint64_t    fChild;                 // interior nodes: the child node's block; leaves: zero
+};
+typedef struct EmptyFSDirIndexRecord EmptyFSDirIndexRecord;
+
+// A key combines a name hash with the logical block of the directory that
+// holds the name.  kEmptyFSMaxDirSize guarantees that the block fits in 32
+// bits.
+
+#define EmptyFSDirIndexKey(hash, logicalBlock)  ( (((uint64_t) (hash)) << 32) | (uint64_t) (uint32_t) (logicalBlock) )
+#define EmptyFSDirIndexKeyHash(key)             ( (uint32_t) ((key) >> 32) )
+#define EmptyFSDirIndexKeyBlock(key)            ( (uint32_t) (key) )
+
+// EmptyFSDirIndexRecords returns the records of an index node.  Like
+// directory entries, index nodes are read in place, so the records' fields
+// must be accessed via the EmptyFSSwapLE macros.
+
+#define EmptyFSDirIndexRecords(node)            ( (EmptyFSDirIndexRecord *) (((EmptyFSDirIndexHeader *) (node)) + 1) )
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Journal
+
+enum {
+    kEmptyFSJournalHeaderMagic      = 'EmJH',
+    kEmptyFSJournalRecordMagic      = 'EmJR',
+    kEmptyFSJournalMinBlocks        = 64,
+    kEmptyFSJournalRecordHeaderSize = 64        // sizeof(EmptyFSJournalRecord); the block numbers start here
+};
+
+// EmptyFSJournalRecord fFlags values.
+
+enum {
+    kEmptyFSJournalRecordContinued  = 0x00000001    // the transaction continues in the next record
+};
+
+struct EmptyFSJournalHeader {
+    uint32_t    fMagic;                 // must be kEmptyFSJournalHeaderMagic
+    uint32_t    fChecksum;              // EmptyFSJournalHeaderChecksum
+    uint64_t    fStart;                 // journal-relative block of the first record to replay
+    uint64_t    fSequence;              // sequence number of that record
+    uint64_t    fFreeBlockCount;        // volume counts as of the last transaction before fStart
+    uint32_t    fFreeFileCount;
+    uint32_t    fDirectoryCount;
+    uint32_t    fOrphanFileNum;         // head of the orphan list, ditto
+    uint8_t     fReserved[20];          // must be zero
+};
+typedef struct EmptyFSJournalHeader EmptyFSJournalHeader;
+
+struct EmptyFSJournalRecord {
+    uint32_t    fMagic;                 // must be kEmptyFSJournalRecordMagic
+    uint32_t    fChecksum;              // EmptyFSJournalRecordChecksum, continued over the data blocks
+    uint64_t    fSequence;              // one more than the previous record's
+    uint32_t    fFlags;                 // kEmptyFSJournalRecordXxx
+    uint32_t    fBlockCount;            // number of data blocks that follow the descriptor
+    uint64_t    fFreeBlockCount;        // volume counts at the end of the transaction;
+    uint32_t    fFreeFileCount;         // only meaningful if kEmptyFSJournalRecordContinued is clear
+    uint32_t    fDirectoryCount;
+    uint32_t    fOrphanFileNum;         // head of the orphan list, ditto
+    uint8_t     fReserved[20];          // must be zero
+    // followed by fBlockCount uint64_t home block numbers
+};
+typedef struct EmptyFSJournalRecord EmptyFSJournalRecord;
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Routines
+
+extern void     EmptyFSSwapSuperblock(EmptyFSSuperblock *sb);
+extern void     EmptyFSSwapFileRecord(EmptyFSFileRecord *rec);
+extern void     EmptyFSSwapExtents(EmptyFSExtent *extents, size_t count);
+extern void     EmptyFSSwapOverflowHeader(EmptyFSOverflowHeader *header);
+extern void     EmptyFSSwapJournalHeader(EmptyFSJournalHeader *header);
+extern void     EmptyFSSwapJournalRecord(EmptyFSJournalRecord *record);
+    // Convert the structure between disk and host byte order.
+    // EmptyFSSwapJournalRecord only swaps the fixed part of the descriptor,
+    // not the block numbers that follow it.
+
+extern uint32_t EmptyFSChecksum(uint32_t crc, const void *buf, size_t len);
+    // Returns the CRC-32C (Castagnoli) of buf, continuing from crc, which
+    // should be zero for the first buffer.  Checksumming a buffer in two
+    // pieces gives the same result as doing it in one.  This uses the CPU's
+    // CRC-32C instruction if it has one (SSE4.2 on Intel, the CRC extension
+    // on ARMv8), and EmptyFSChecksumSoftware if it doesn't.
+
+extern uint32_t EmptyFSChecksumSoftware(uint32_t crc, const void *buf, size_t len);
+extern uint32_t EmptyFSChecksumHardware(uint32_t crc, const void *buf, size_t len);
+extern int      EmptyFSChecksumHardwareAvailable(void);
+    // The two implementations behind EmptyFSChecksum, for benchmarks and
+    // tests: a portable table-driven one, and one that uses the CRC-32C
+    // instruction.  Only call EmptyFSChecksumHardware if
+    // EmptyFSChecksumHardwareAvailable returns true.
+
+extern uint32_t EmptyFSSuperblockChecksum(const EmptyFSSuperblock *sb);
+extern uint32_t EmptyFSFileRecordChecksum(const EmptyFSFileRecord *rec, uint32_t fileNum);
+    // Return the checksum of a superblock, or of the file record for fileNum,
+    // in disk byte order, computed as if its fChecksum field were zero.  The
+    // result is in host byte order.
+
+extern void     EmptyFSSuperblockSeal(EmptyFSSuperblock *sb);
+extern int      EmptyFSSuperblockVerify(const EmptyFSSuperblock *sb);
+extern void     EmptyFSFileRecordSeal(const EmptyFSSuperblock *sb, EmptyFSFileRecord *rec, uint32_t fileNum);
+extern int      EmptyFSFileRecordVerify(const EmptyFSSuperblock *sb, const EmptyFSFileRecord *rec, uint32_t fileNum);
+    // Fill in, or check, the fChecksum of a superblock or file record in disk
+    // byte order; sb, where given, is the volume's superblock in host byte
+    // order.  They do nothing, or return 0, unless the volume has the
+    // kEmptyFSROCompatMetadataChecksums feature, and free file records have
+    // no checksum.  The Verify routines return EIO if the checksum is wrong.
+
+extern void     EmptyFSMetaBlockSeal(const EmptyFSSuperblock *sb, uint64_t blockNum, void *block);
+    // Fills in the checksums of a metadata block, in disk byte order, that's
+    // about to be written to block blockNum: every used record of a file
+    // table block, or the checksum of a directory block, directory index node
+    // or overflow extent block, which it recognises by its magic number.  It
+    // leaves anything else, including bitmap blocks, alone, and does nothing
+    // unless the volume has the kEmptyFSROCompatMetadataChecksums feature.
+
+extern int      EmptyFSMetaBlockVerify(const EmptyFSSuperblock *sb, uint64_t blockNum, const void *block);
+    // The reverse of EmptyFSMetaBlockSeal: checks the checksums of a metadata
+    // block, in disk byte order, that was read from block blockNum.  Returns
+    // 0 if they're right, or if the block isn't one that EmptyFSMetaBlockSeal
+    // would seal (the caller still has to check its magic number), or EIO if
+    // they're wrong.
+
+extern uint32_t EmptyFSJournalHeaderChecksum(const EmptyFSJournalHeader *header);
+extern uint32_t EmptyFSJournalRecordChecksum(const void *descriptor, uint32_t blockSize);
+    // Return the checksum of a journal header, or a journal descriptor block,
+    // in disk byte order, computed as if its fChecksum field were zero.  For
+    // a record, continue the result over its data blocks, in order, using
+    // EmptyFSChecksum to get the value that belongs in fChecksum.
+
+extern int      EmptyFSJournalHeaderValidate(const EmptyFSSuperblock *sb, const EmptyFSJournalHeader *header);
+    // Checks a journal header (in host byte order, with its checksum already
+    // verified).  Returns 0 if it's OK, or EIO if it's corrupt.
+
+extern uint32_t EmptyFSJournalRecordCapacity(const EmptyFSSuperblock *sb);
+    // Returns the maximum number of data blocks in one journal record.
+
+extern int      EmptyFSJournalRecordValidate(const EmptyFSSuperblock *sb, const EmptyFSJournalRecord *record, uint64_t sequence);
+    // Checks the fixed part of a journal descriptor (in host byte order) that
+    // is expected to have the given sequence number.  Returns 0 if it's
+    // plausible, or ENOENT if it's not; ENOENT marks the end of the journal
+    // during replay, so it's not necessarily an error.  The caller must still
+    // verify the checksum.
+
+extern int      EmptyFSSuperblockValidate(const EmptyFSSuperblock *sb);
+    // Checks a superblock (in host byte order) for consistency.  Returns 0 if
+    // it's OK, ENOTSUP if it's a version, or uses an incompatible feature,
+    // that we don't understand, or EINVAL if it's not an EmptyFS superblock
+    // or is corrupt.
+
+extern int      EmptyFSFileRecordValidate(const EmptyFSSuperblock *sb, const EmptyFSFileRecord *rec);
+    // Checks an in-use file record (in host byte order) for consistency.
+    // Returns 0 if it's OK, or EIO if it's corrupt.
+
+extern uint32_t EmptyFSFileRecordsPerBlock(const EmptyFSSuperblock *sb);
+extern void     EmptyFSFileRecordLocation(const EmptyFSSuperblock *sb, uint32_t fileNum, uint64_t *blockPtr, uint32_t *offsetPtr);
+    // Returns the block that holds the file record for fileNum, and the byte
+    // offset of that record within the block.  fileNum must be less than
+    // sb->fFileCount.
+
+extern uint32_t EmptyFSFileTableInitCount(const EmptyFSSuperblock *sb);
+    // Returns the number of file records, counting from file number zero, in
+    // the initialised part of the file table.  Records with higher file
+    // numbers are free and must not be read; see "Lazy File Table", above.
+    // That's sb->fFileCount unless the volume has the
+    // kEmptyFSROCompatLazyFileTable feature.
+
+extern uint32_t EmptyFSOverflowExtentsPerBlock(const EmptyFSSuperblock *sb);
+    // Returns the number of extents that fit in an overflow extent block.
+
+extern uint64_t EmptyFSChunkChecksumBlocks(const EmptyFSSuperblock *sb, const EmptyFSFileRecord *rec);
+    // Returns the number of blocks in the checksum table of a compressed file
+    // (see "Data Checksums", above), or zero if it doesn't have one.
+
+extern int      EmptyFSCompressedExtentsValidate(
+    const EmptyFSSuperblock *   sb,
+    const EmptyFSFileRecord *   rec,
+    const EmptyFSExtent *       extents,
+    size_t                      extentCount
+);
+    // Checks the extents (in host byte order) of a compressed file, whose
+    // record has already passed EmptyFSFileRecordValidate, against the rules
+    // in "Compression", above.  extentCount must be rec->fExtentCount.
+    // Returns 0 if they're OK, or EIO if they're corrupt.
+
+extern int      EmptyFSDecompress(
+    uint32_t                    compression,
+    const void *                src,
+    size_t                      srcLen,
+    void *                      dst,
+    size_t                      dstLen
+);
+    // Decompresses the chunk in src, which is stored as compression (a
+    // kEmptyFSCompressionXxx value), into dst, which must be exactly as long
+    // as the chunk.  Returns 0 on success, or EIO if the data is corrupt,
+    // including if it would decompress to anything other than dstLen bytes.
+    // Trailing padding in src is ignored.
+
+extern int      EmptyFSExtentMap(
+    const EmptyFSExtent *   extents,
+    size_t                  extentCount,
+    uint64_t                logicalBlock,
+    uint64_t *              physicalBlockPtr,
+    uint64_t *              contigBlocksPtr
+);
+    // Maps logicalBlock of a file, whose extents (in host byte order) are
+    // given by extents and extentCount, to a block on the volume.  On success,
+    // *physicalBlockPtr is that block and, if contigBlocksPtr is not NULL,
+    // *contigBlocksPtr is the number of blocks (including the first) that are
+    // contiguous on disk from that point.  Returns ERANGE if logicalBlock is
+    // beyond the end of the extents.
+
+extern int      EmptyFSDirBlockValidate(const void *block, uint32_t blockSize);
+    // Checks a directory block for consistency: the header must be valid, every
+    // entry must lie within the block, and the entries must exactly fill the block.
+    // Returns 0 if it's OK, or EIO if it's corrupt.  Once a block has passed this
+    // check, EmptyFSDirBlockNextEntry can walk it without further checks.
+
+extern void     EmptyFSDirBlockInit(void *block, uint32_t blockSize);
+    // Initialises an empty directory block; it contains one free entry that
+    // spans the entire block.
+
+extern EmptyFSDirEntry * EmptyFSDirBlockNextEntry(const void *block, uint32_t blockSize, const EmptyFSDirEntry *entry);
+    // Returns the entry after entry, or the first entry in the block if entry
+    // is NULL, or NULL if there are no more entries.  This returns free entries
+    // as well as used ones.  The block must have passed EmptyFSDirBlockValidate.
+
+extern int      EmptyFSDirBlockHasRoom(const void *block, uint32_t blockSize, size_t nameLen);
+    // Returns true if EmptyFSDirBlockInsertEntry would be able to add an
+    // entry with a name of length nameLen to a (valid) directory block.
+    // This lets a journalled writer check a block before it commits to
+    // changing it.
+
+extern int      EmptyFSDirBlockInsertEntry(
+    void *          block,
+    uint32_t        blockSize,
+    const char *    name,
+    size_t          nameLen,
+    uint32_t        fileNum,
+    uint8_t         type
+);
+    // Adds an entry to a (valid) directory block.  Returns ENOSPC if there's
+    // not enough room, or EINVAL if the name is empty or too long.  This does
+    // not check for duplicate names.
+
+extern uint32_t EmptyFSDirNameHash(const EmptyFSSuperblock *sb, const char *name, size_t nameLen);
+    // Returns the hash of a name for the directory index: the 32-bit FNV-1a
+    // hash, with the offset basis XORed with the first four bytes of the
+    // volume's fUUID (as a little endian number), so that names that collide
+    // on one volume are unlikely to collide on another.
+
+extern uint32_t EmptyFSDirIndexCapacity(const EmptyFSSuperblock *sb);
+    // Returns the maximum number of records in a directory index node.
+
+extern int      EmptyFSDirIndexNodeValidate(const EmptyFSSuperblock *sb, const void *node);
+    // Checks a directory index node for consistency: the header must be valid,
+    // the records must be in key order, and each child must lie within the
+    // data area.  Returns 0 if it's OK, or EIO if it's corrupt.  The caller
+    // must check that the node is at the level it expects.
+
+extern void     EmptyFSDirIndexNodeInit(void *node, uint32_t blockSize, uint16_t level);
+    // Initialises an empty directory index node at the given level.
+
+extern uint32_t EmptyFSDirIndexNodeSearch(const void *node, uint64_t key, int after);
+    // Returns the index of the first record in a (valid) directory index node
+    // whose key is greater than or equal to key or, if after is true, greater
+    // than key.  Returns the node's fCount if there isn't one.  For an interior
+    // node, the child to follow is the one before that (or the first).
+
+extern int      EmptyFSDirIndexNodeInsert(
+    const EmptyFSSuperblock *   sb,
+    void *                      node,
+    uint32_t                    index,
+    uint64_t                    key,
+    uint64_t                    child
+);
+    // Inserts a record at position index (no greater than fCount) of a (valid)
+    // directory index node.  Returns ENOSPC if the node is full.  The caller
+    // is responsible for keeping the records in order.
+
+extern void     EmptyFSDirIndexNodeRemove(void *node, uint32_t index);
+    // Removes the record at position index of a (valid) directory index node.
+
+extern uint64_t EmptyFSDirIndexNodeSplit(void *node, void *newNode, uint32_t blockSize);
+    // Moves the upper half of the records of a (valid, full) directory index
+    // node into newNode, which this initialises at the same level, and returns
+    // the key of newNode's first record, which is the key to insert into the
+    // parent.
+
+#endif
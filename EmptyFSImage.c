@@ -0,0 +1,2755 @@
+/*
+    File:       EmptyFSImage.c
+
+    Contains:   User-space library for building and reading EmptyFS volume images.
+
+    Written by: DTS
+
+    Copyright:  Copyright (c) 2006 by Apple Computer, Inc., All Rights Reserved.
+
+    Disclaimer: IMPORTANT:  This Apple software is supplied to you by Apple Computer, Inc.
+                ("Apple") in consideration of your agreement to the following terms, and your
+                use, installation, modification or redistribution of this Apple software
+                constitutes acceptance of these terms.  If you do not agree with these terms,
+                please do not use, install, modify or redistribute this Apple software.
+
+                In consideration of your agreement to abide by the following terms, and subject
+                to these terms, Apple grants you a personal, non-exclusive license, under Apple's
+                copyrights in this original Apple software (the "Apple Software"), to use,
+                reproduce, modify and redistribute the Apple Software, with or without
+                modifications, in source and/or binary forms; provided that if you redistribute
+                the Apple Software in its entirety and without modifications, you must retain
+                this notice and the following text and disclaimers in all such redistributions of
+                the Apple Software.  Neither the name, trademarks, service marks or logos of
+                Apple Computer, Inc. may be used to endorse or promote products derived from the
+                Apple Software without specific prior written permission from Apple.  Except as
+                expressly stated in this notice, no other rights or licenses, express or implied,
+                are granted by Apple herein, including but not limited to any patent rights that
+                may be infringed by your derivative works or by other works in which the Apple
+                Software may be incorporated.
+
+                The Apple Software is provided by Apple on an "AS IS" basis.  APPLE MAKES NO
+                WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                PURPOSE, REGARDING THE APPLE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                COMBINATION WITH YOUR PRODUCTS.
+
+                IN NO EVENT SHALL APPLE BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                OF THE APPLE SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF APPLE HAS BEEN
+                ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+    Change History (most recent first):
+
+$Log$
+
+*/
+
+/////////////////////////////////////////////////////////////////////
+
+#include "EmptyFSImage.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#ifndef DT_DIR
+    #define DT_DIR  4
+    #define DT_REG  8
+#endif
+
+#ifndef TRUE
+    #define TRUE    1
+    #define FALSE   0
+#endif
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Image State
+
+struct EmptyFSImage {
+    int                 fFD;
+    int                 fWritable;
+    EmptyFSSuperblock   fSuperblock;        // host byte order
+    int                 fSuperblockDirty;
+    uint8_t *           fBitmap;            // writable images only; fBitmapBlocks * fBlockSize bytes
+    uint64_t            fBitmapDirtyStart;  // bitmap blocks [fBitmapDirtyStart, fBitmapDirtyEnd) have changed
+    uint64_t            fBitmapDirtyEnd;
+    uint64_t            fAllocHint;         // where to start looking for free blocks
+    uint32_t            fFileNumHint;       // where to start looking for free file records
+    uint8_t *           fBlockBuf;          // scratch buffer, one block long
+    uint8_t *           fIndexBuf;          // directory index nodes, kEmptyFSDirIndexMaxDepth + 1 blocks long
+};
+
+static int64_t NowNanoseconds(void)
+    // We use gettimeofday, rather than clock_gettime, because Mac OS X 10.4
+    // doesn't have the latter.
+{
+    struct timeval  now;
+
+    (void) gettimeofday(&now, NULL);
+    return ((int64_t) now.tv_sec * 1000000000LL) + ((int64_t) now.tv_usec * 1000);
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Low-Level Access
+
+static int CheckBlockRange(const EmptyFSImage *image, uint64_t block, uint64_t count)
+{
+    if ( (block > image->fSuperblock.fBlockCount) || (count > (image->fSuperblock.fBlockCount - block)) ) {
+        return EIO;
+    }
+    return 0;
+}
+
+extern int EmptyFSImageReadBlocks(EmptyFSImage *image, uint64_t block, uint64_t count, void *buf)
+{
+    int     err;
+
+    err = CheckBlockRange(image, block, count);
+    if (err == 0) {
+        err = EmptyFSImagePReadAll(image->fFD, buf, (size_t) (count * image->fSuperblock.fBlockSize), (off_t) (block * image->fSuperblock.fBlockSize));
+    }
+    return err;
+}
+
+extern int EmptyFSImageWriteBlocks(EmptyFSImage *image, uint64_t block, uint64_t count, const void *buf)
+{
+    int     err;
+
+    err = 0;
+    if ( ! image->fWritable ) {
+        err = EROFS;
+    }
+    if (err == 0) {
+        err = CheckBlockRange(image, block, count);
+    }
+    if (err == 0) {
+        err = EmptyFSImagePWriteAll(image->fFD, buf, (size_t) (count * image->fSuperblock.fBlockSize), (off_t) (block * image->fSuperblock.fBlockSize));
+    }
+    return err;
+}
+
+static int ImageReadMetaBlock(EmptyFSImage *image, uint64_t block, void *buf)
+    // Reads a single metadata block and checks its checksums (see "Metadata
+    // Checksums" in "EmptyFSFormat.h").  The caller must still check that it's
+    // the kind of block it expects.
+{
+    int     err;
+
+    err = EmptyFSImageReadBlocks(image, block, 1, buf);
+    if (err == 0) {
+        err = EmptyFSMetaBlockVerify(&image->fSuperblock, block, buf);
+    }
+    return err;
+}
+
+static int ImageWriteMetaBlock(EmptyFSImage *image, uint64_t block, void *buf)
+    // Fills in the checksums of a metadata block, in disk byte order, and
+    // writes it.
+{
+    EmptyFSMetaBlockSeal(&image->fSuperblock, block, buf);
+    return EmptyFSImageWriteBlocks(image, block, 1, buf);
+}
+
+extern int EmptyFSImageReadFileRecord(EmptyFSImage *image, uint32_t fileNum, EmptyFSFileRecord *rec)
+{
+    int         err;
+    uint64_t    block;
+    uint32_t    offset;
+
+    err = 0;
+    if ( (fileNum < kEmptyFSFirstFileNum) || (fileNum >= image->fSuperblock.fFileCount) ) {
+        err = ENOENT;
+    } else if ( fileNum >= EmptyFSFileTableInitCount(&image->fSuperblock) ) {
+        memset(rec, 0, sizeof(*rec));       // uninitialised, so free
+        err = ENOENT;
+    }
+    if (err == 0) {
+        EmptyFSFileRecordLocation(&image->fSuperblock, fileNum, &block, &offset);
+        err = EmptyFSImagePReadAll(image->fFD, rec, sizeof(*rec), (off_t) (block * image->fSuperblock.fBlockSize + offset));
+    }
+    if (err == 0) {
+        err = EmptyFSFileRecordVerify(&image->fSuperblock, rec, fileNum);
+    }
+    if (err == 0) {
+        EmptyFSSwapFileRecord(rec);
+        if (rec->fMode == 0) {
+            err = ENOENT;
+        } else {
+            err = EmptyFSFileRecordValidate(&image->fSuperblock, rec);
+        }
+    }
+    return err;
+}
+
+enum {
+    kFileTableInitChunk = 256               // file table blocks that we initialise at a time
+};
+
+static int FileTableInit(EmptyFSImage *image, uint32_t fileNum)
+    // Zeroes the uninitialised part of the file table up to and including the
+    // block that holds the record for fileNum, rounded up to a whole
+    // kFileTableInitChunk blocks, and updates the superblock to match (see
+    // "Lazy File Table" in "EmptyFSFormat.h").  Like the bitmap, the superblock
+    // isn't written until the next flush.
+{
+    int                 err;
+    EmptyFSSuperblock * sb;
+    uint32_t            perBlock;
+    uint64_t            block;
+    uint64_t            limit;
+    void *              zeros;
+
+    sb = &image->fSuperblock;
+    perBlock = EmptyFSFileRecordsPerBlock(sb);
+
+    err = 0;
+    zeros = calloc(1, sb->fBlockSize);
+    if (zeros == NULL) {
+        err = ENOMEM;
+    }
+    if (err == 0) {
+        limit = ((fileNum / perBlock) + kFileTableInitChunk) / kFileTableInitChunk * kFileTableInitChunk;
+        if (limit > sb->fFileTableBlocks) {
+            limit = sb->fFileTableBlocks;
+        }
+        for (block = sb->fFileTableInitBlocks; (err == 0) && (block < limit); block++) {
+            err = EmptyFSImageWriteBlocks(image, sb->fFileTableStart + block, 1, zeros);
+        }
+    }
+    if (err == 0) {
+        if ( (limit * perBlock) < sb->fFileCount ) {
+            sb->fFileTableInitBlocks = limit;
+        } else {
+            sb->fROCompatFeatures   &= ~kEmptyFSROCompatLazyFileTable;
+            sb->fFileTableInitBlocks = 0;
+        }
+        image->fSuperblockDirty = TRUE;
+    }
+    free(zeros);
+    return err;
+}
+
+extern int EmptyFSImageWriteFileRecord(EmptyFSImage *image, uint32_t fileNum, const EmptyFSFileRecord *rec)
+{
+    int                 err;
+    uint64_t            block;
+    uint32_t            offset;
+    EmptyFSFileRecord   diskRec;
+
+    err = 0;
+    if ( ! image->fWritable ) {
+        err = EROFS;
+    } else if ( (fileNum < kEmptyFSFirstFileNum) || (fileNum >= image->fSuperblock.fFileCount) ) {
+        err = EINVAL;
+    }
+    if ( (err == 0) && (fileNum >= EmptyFSFileTableInitCount(&image->fSuperblock)) ) {
+        err = FileTableInit(image, fileNum);
+    }
+    if (err == 0) {
+        diskRec = *rec;
+        EmptyFSSwapFileRecord(&diskRec);
+        EmptyFSFileRecordSeal(&image->fSuperblock, &diskRec, fileNum);
+        EmptyFSFileRecordLocation(&image->fSuperblock, fileNum, &block, &offset);
+        err = EmptyFSImagePWriteAll(image->fFD, &diskRec, sizeof(diskRec), (off_t) (block * image->fSuperblock.fBlockSize + offset));
+    }
+    return err;
+}
+
+extern int EmptyFSImageGetExtents(EmptyFSImage *image, const EmptyFSFileRecord *rec, EmptyFSExtent **extentsPtr)
+{
+    int                     err;
+    EmptyFSExtent *         extents;
+    uint32_t                extentCount;
+    uint32_t                perBlock;
+    uint64_t                overflowBlock;
+    EmptyFSOverflowHeader * header;
+
+    err = 0;
+    extents = NULL;
+    if (rec->fExtentCount != 0) {
+        extents = malloc(rec->fExtentCount * sizeof(*extents));
+        if (extents == NULL) {
+            err = ENOMEM;
+        }
+    }
+    if (err == 0) {
+        extentCount = (rec->fExtentCount < kEmptyFSInlineExtentCount) ? rec->fExtentCount : kEmptyFSInlineExtentCount;
+        memcpy(extents, rec->fExtents, extentCount * sizeof(*extents));
+
+        // Walk the overflow chain, if any.
+
+        perBlock = EmptyFSOverflowExtentsPerBlock(&image->fSuperblock);
+        overflowBlock = rec->fOverflowBlock;
+        while ( (err == 0) && (extentCount < rec->fExtentCount) ) {
+            if ( (overflowBlock < image->fSuperblock.fDataStart) || (overflowBlock >= image->fSuperblock.fBlockCount) ) {
+                err = EIO;
+                break;
+            }
+            err = ImageReadMetaBlock(image, overflowBlock, image->fBlockBuf);
+            if (err == 0) {
+                header = (EmptyFSOverflowHeader *) image->fBlockBuf;
+                EmptyFSSwapOverflowHeader(header);
+                if (    (header->fMagic != kEmptyFSOverflowMagic)
+                     || (header->fExtentCount == 0)
+                     || (header->fExtentCount > perBlock)
+                     || (header->fExtentCount > (rec->fExtentCount - extentCount)) ) {
+                    err = EIO;
+                } else {
+                    memcpy(&extents[extentCount], header + 1, header->fExtentCount * sizeof(*extents));
+                    EmptyFSSwapExtents(&extents[extentCount], header->fExtentCount);
+                    extentCount += header->fExtentCount;
+                    overflowBlock = header->fNextBlock;
+                }
+            }
+        }
+    }
+    if (err == 0) {
+        *extentsPtr = extents;
+    } else {
+        free(extents);
+    }
+    return err;
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Allocation
+
+static int BitmapTest(const EmptyFSImage *image, uint64_t block)
+{
+    return (image->fBitmap[block / 8] & (1 << (block % 8))) != 0;
+}
+
+static void BitmapSetRange(EmptyFSImage *image, uint64_t start, uint64_t count, int inUse)
+{
+    uint64_t    block;
+    uint64_t    bitsPerBlock;
+    uint64_t    dirtyStart;
+    uint64_t    dirtyEnd;
+
+    assert(count != 0);
+
+    for (block = start; block < (start + count); block++) {
+        assert( BitmapTest(image, block) == ! inUse );
+        if (inUse) {
+            image->fBitmap[block / 8] |=  (uint8_t)  (1 << (block % 8));
+        } else {
+            image->fBitmap[block / 8] &= (uint8_t) ~(1 << (block % 8));
+        }
+    }
+    if (inUse) {
+        image->fSuperblock.fFreeBlockCount -= count;
+    } else {
+        image->fSuperblock.fFreeBlockCount += count;
+    }
+
+    // Remember which bitmap blocks have changed, so that EmptyFSImageFlush
+    // writes just those.
+
+    bitsPerBlock = (uint64_t) image->fSuperblock.fBlockSize * 8;
+    dirtyStart = start / bitsPerBlock;
+    dirtyEnd   = ((start + count - 1) / bitsPerBlock) + 1;
+    if (image->fBitmapDirtyStart == image->fBitmapDirtyEnd) {
+        image->fBitmapDirtyStart = dirtyStart;
+        image->fBitmapDirtyEnd   = dirtyEnd;
+    } else {
+        if (dirtyStart < image->fBitmapDirtyStart) {
+            image->fBitmapDirtyStart = dirtyStart;
+        }
+        if (dirtyEnd > image->fBitmapDirtyEnd) {
+            image->fBitmapDirtyEnd = dirtyEnd;
+        }
+    }
+    image->fSuperblockDirty = TRUE;
+}
+
+static int AllocBlocks(EmptyFSImage *image, uint64_t wanted, uint64_t *startPtr, uint64_t *countPtr)
+    // Allocates a run of up to wanted blocks.  The run is the first one at or
+    // after the allocation hint (wrapping around if necessary), so a sequence of
+    // calls tends to lay data out contiguously.  The run may be shorter than
+    // wanted if the free space is fragmented.  Returns ENOSPC if the volume is full.
+{
+    uint64_t    blockCount;
+    uint64_t    dataStart;
+    uint64_t    start;
+    uint64_t    count;
+    uint64_t    scanned;
+    uint64_t    maxCount;
+
+    assert(wanted != 0);
+
+    blockCount = image->fSuperblock.fBlockCount;
+    dataStart  = image->fSuperblock.fDataStart;
+    if (image->fSuperblock.fFreeBlockCount == 0) {
+        return ENOSPC;
+    }
+
+    // Find the first free block.
+
+    start = image->fAllocHint;
+    if ( (start < dataStart) || (start >= blockCount) ) {
+        start = dataStart;
+    }
+    for (scanned = 0; scanned < (blockCount - dataStart); scanned++) {
+        if ( ! BitmapTest(image, start) ) {
+            break;
+        }
+        start += 1;
+        if (start == blockCount) {
+            start = dataStart;
+        }
+    }
+    if (scanned == (blockCount - dataStart)) {
+        return ENOSPC;
+    }
+
+    // Extend the run as far as we can.  An extent holds at most UINT32_MAX blocks.
+
+    maxCount = (wanted < UINT32_MAX) ? wanted : UINT32_MAX;
+    count = 1;
+    while ( (count < maxCount) && ((start + count) < blockCount) && ! BitmapTest(image, start + count) ) {
+        count += 1;
+    }
+
+    BitmapSetRange(image, start, count, TRUE);
+    image->fAllocHint = start + count;
+
+    *startPtr = start;
+    *countPtr = count;
+    return 0;
+}
+
+static void FreeBlocks(EmptyFSImage *image, uint64_t start, uint64_t count)
+{
+    BitmapSetRange(image, start, count, FALSE);
+}
+
+static int AllocFileNum(EmptyFSImage *image, uint32_t *fileNumPtr)
+    // Finds a free file record.  We don't keep a map of free records, so we
+    // search the file table starting at the hint, which is usually just past
+    // the last record that we allocated.
+{
+    int                 err;
+    uint32_t            fileNum;
+    uint32_t            scanned;
+    uint32_t            candidateCount;
+    EmptyFSFileRecord   rec;
+
+    if (image->fSuperblock.fFreeFileCount == 0) {
+        return ENOSPC;
+    }
+    candidateCount = image->fSuperblock.fFileCount - kEmptyFSFirstFileNum;
+    fileNum = image->fFileNumHint;
+    err = ENOSPC;
+    for (scanned = 0; scanned < candidateCount; scanned++) {
+        if ( (fileNum < kEmptyFSFirstFileNum) || (fileNum >= image->fSuperblock.fFileCount) ) {
+            fileNum = kEmptyFSFirstFileNum;
+        }
+        err = EmptyFSImageReadFileRecord(image, fileNum, &rec);
+        if (err == ENOENT) {
+            err = 0;
+            break;
+        } else if (err == 0) {
+            err = ENOSPC;
+        } else {
+            break;
+        }
+        fileNum += 1;
+    }
+    if (err == 0) {
+        image->fFileNumHint = fileNum + 1;
+        *fileNumPtr = fileNum;
+    }
+    return err;
+}
+
+static int SetFileExtents(EmptyFSImage *image, EmptyFSFileRecord *rec, const EmptyFSExtent *extents, uint32_t extentCount)
+    // Sets the extents of a file, writing any that don't fit in the file record
+    // to overflow blocks.  We reuse the file's existing overflow blocks where
+    // possible, allocating more (or freeing some) as needed.  The caller is
+    // responsible for writing rec.
+{
+    int                     err;
+    uint32_t                perBlock;
+    uint32_t                blocksNeeded;
+    uint32_t                blocksHave;
+    uint64_t *              chain;
+    uint32_t                index;
+    uint32_t                done;
+    uint32_t                thisCount;
+    uint64_t                count;
+    EmptyFSOverflowHeader * header;
+
+    perBlock = EmptyFSOverflowExtentsPerBlock(&image->fSuperblock);
+    blocksNeeded = 0;
+    if (extentCount > kEmptyFSInlineExtentCount) {
+        blocksNeeded = (extentCount - kEmptyFSInlineExtentCount + perBlock - 1) / perBlock;
+    }
+
+    // Gather the existing overflow chain.  We know how long it is from the
+    // old extent count.
+
+    blocksHave = 0;
+    if (rec->fExtentCount > kEmptyFSInlineExtentCount) {
+        blocksHave = (rec->fExtentCount - kEmptyFSInlineExtentCount + perBlock - 1) / perBlock;
+    }
+    chain = calloc( ((blocksHave > blocksNeeded) ? blocksHave : blocksNeeded) + 1, sizeof(*chain) );
+    err = (chain == NULL) ? ENOMEM : 0;
+    if ( (err == 0) && (blocksHave != 0) ) {
+        uint64_t    block;
+
+        block = rec->fOverflowBlock;
+        for (index = 0; (err == 0) && (index < blocksHave); index++) {
+            chain[index] = block;
+            err = ImageReadMetaBlock(image, block, image->fBlockBuf);
+            if (err == 0) {
+                header = (EmptyFSOverflowHeader *) image->fBlockBuf;
+                block = EmptyFSSwapLE64(header->fNextBlock);
+            }
+        }
+    }
+
+    // Allocate or free overflow blocks to get the chain to the right length.
+
+    for (index = blocksHave; (err == 0) && (index < blocksNeeded); index++) {
+        err = AllocBlocks(image, 1, &chain[index], &count);
+    }
+    for (index = blocksNeeded; (err == 0) && (index < blocksHave); index++) {
+        FreeBlocks(image, chain[index], 1);
+    }
+
+    // Write the overflow blocks, then fill in the record.
+
+    done = kEmptyFSInlineExtentCount;
+    for (index = 0; (err == 0) && (index < blocksNeeded); index++) {
+        thisCount = extentCount - done;
+        if (thisCount > perBlock) {
+            thisCount = perBlock;
+        }
+        memset(image->fBlockBuf, 0, image->fSuperblock.fBlockSize);
+        header = (EmptyFSOverflowHeader *) image->fBlockBuf;
+        header->fMagic       = kEmptyFSOverflowMagic;
+        header->fExtentCount = thisCount;
+        header->fNextBlock   = (index + 1 < blocksNeeded) ? chain[index + 1] : 0;
+        EmptyFSSwapOverflowHeader(header);
+        memcpy(header + 1, &extents[done], thisCount * sizeof(*extents));
+        EmptyFSSwapExtents( (EmptyFSExtent *) (header + 1), thisCount);
+        err = ImageWriteMetaBlock(image, chain[index], image->fBlockBuf);
+        done += thisCount;
+    }
+    if (err == 0) {
+        memset(rec->fExtents, 0, sizeof(rec->fExtents));
+        if (extentCount != 0) {
+            memcpy(rec->fExtents, extents, ((extentCount < kEmptyFSInlineExtentCount) ? extentCount : kEmptyFSInlineExtentCount) * sizeof(*extents));
+        }
+        rec->fExtentCount   = extentCount;
+        rec->fOverflowBlock = (blocksNeeded != 0) ? chain[0] : 0;
+    }
+
+    free(chain);
+    return err;
+}
+
+static int AllocFileData(EmptyFSImage *image, uint64_t blocksWanted, EmptyFSExtent **extentsPtr, uint32_t *extentCountPtr)
+    // Allocates blocksWanted blocks, in as few extents as possible, returning
+    // the extents in a malloc'd array.
+{
+    int             err;
+    EmptyFSExtent * extents;
+    EmptyFSExtent * newExtents;
+    uint32_t        extentCount;
+    uint32_t        extentCapacity;
+    uint64_t        start;
+    uint64_t        count;
+
+    err = 0;
+    extents = NULL;
+    extentCount = 0;
+    extentCapacity = 0;
+    if (blocksWanted > image->fSuperblock.fFreeBlockCount) {
+        err = ENOSPC;
+    }
+    while ( (err == 0) && (blocksWanted != 0) ) {
+        err = AllocBlocks(image, blocksWanted, &start, &count);
+        if ( (err == 0) && (extentCount == extentCapacity) ) {
+            extentCapacity = (extentCapacity == 0) ? kEmptyFSInlineExtentCount : (extentCapacity * 2);
+            newExtents = realloc(extents, extentCapacity * sizeof(*extents));
+            if (newExtents == NULL) {
+                FreeBlocks(image, start, count);
+                err = ENOMEM;
+            } else {
+                extents = newExtents;
+            }
+        }
+        if (err == 0) {
+            extents[extentCount].fStartBlock = start;
+            extents[extentCount].fBlockCount = (uint32_t) count;
+            extents[extentCount].fFlags      = 0;
+            extentCount += 1;
+            blocksWanted -= count;
+        }
+    }
+
+    if (err == 0) {
+        *extentsPtr = extents;
+        *extentCountPtr = extentCount;
+    } else {
+        while (extentCount != 0) {
+            extentCount -= 1;
+            FreeBlocks(image, extents[extentCount].fStartBlock, extents[extentCount].fBlockCount);
+        }
+        free(extents);
+    }
+    return err;
+}
+
+static int AllocContiguousBlocks(EmptyFSImage *image, uint64_t wanted, uint64_t *startPtr)
+    // Allocates a single run of exactly wanted blocks.  AllocBlocks gives us
+    // the first free run after the hint; if that's too short we give it
+    // back, move the hint past it, and try again, until we've been all the
+    // way round the volume.
+{
+    int         err;
+    uint64_t    start;
+    uint64_t    count;
+    uint64_t    firstStart;
+    int         wrapped;
+
+    assert(wanted != 0);
+
+    firstStart = 0;
+    wrapped = FALSE;
+    do {
+        err = AllocBlocks(image, wanted, &start, &count);
+        if ( (err == 0) && (count != wanted) ) {
+            FreeBlocks(image, start, count);
+            if (firstStart == 0) {
+                firstStart = start;
+            } else if (start <= firstStart) {
+                if (wrapped) {
+                    err = ENOSPC;
+                }
+                wrapped = TRUE;
+            }
+            image->fAllocHint = start + count;
+        }
+    } while ( (err == 0) && (count != wanted) );
+    if (err == 0) {
+        *startPtr = start;
+    }
+    return err;
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Journal
+
+// The library doesn't journal its own changes; it writes everything in place.
+// That's safe as long as the journal is empty when it starts, because then a
+// later replay has nothing to undo.  So EmptyFSImageCreate writes an empty
+// journal, and EmptyFSImageOpen replays the journal of a volume that wasn't
+// cleanly unmounted before it lets you change anything.  See the "Journal"
+// notes in "EmptyFSFormat.h".
+
+static uint64_t JournalAdvance(const EmptyFSImage *image, uint64_t pos, uint64_t count)
+    // Returns the journal position count blocks after pos, wrapping from the
+    // end of the journal back to block 1.
+{
+    uint64_t    blocks;
+
+    blocks = image->fSuperblock.fJournalBlocks;
+    return 1 + ((pos - 1 + count) % (blocks - 1));
+}
+
+static int JournalWriteHeader(EmptyFSImage *image, uint64_t start, uint64_t sequence)
+    // Writes a journal header that says the journal starts at start, with
+    // sequence number sequence, taking the counts (and the head of the orphan
+    // list) from the superblock.
+{
+    EmptyFSJournalHeader *  header;
+
+    memset(image->fBlockBuf, 0, image->fSuperblock.fBlockSize);
+    header = (EmptyFSJournalHeader *) image->fBlockBuf;
+    header->fMagic          = kEmptyFSJournalHeaderMagic;
+    header->fStart          = start;
+    header->fSequence       = sequence;
+    header->fFreeBlockCount = image->fSuperblock.fFreeBlockCount;
+    header->fFreeFileCount  = image->fSuperblock.fFreeFileCount;
+    header->fDirectoryCount = image->fSuperblock.fDirectoryCount;
+    header->fOrphanFileNum  = image->fSuperblock.fOrphanFileNum;
+    EmptyFSSwapJournalHeader(header);
+    header->fChecksum = EmptyFSSwapLE32( EmptyFSJournalHeaderChecksum(header) );
+    return EmptyFSImageWriteBlocks(image, image->fSuperblock.fJournalStart, 1, image->fBlockBuf);
+}
+
+static int JournalScan(
+    EmptyFSImage *          image,
+    uint64_t                start,
+    uint64_t                sequence,
+    uint64_t                stopSequence,
+    uint8_t *               desc,
+    uint8_t *               data,
+    uint64_t *              endPtr,
+    uint64_t *              endSequencePtr,
+    EmptyFSJournalRecord *  lastPtr
+)
+    // Reads the journal's records, starting at start with sequence number
+    // sequence, until it finds one that isn't valid or reaches stopSequence.
+    // Sets *endPtr and *endSequencePtr to just after the last complete
+    // transaction, and *lastPtr to that transaction's last record; if there's
+    // no complete transaction, they're left alone.  If stopSequence isn't
+    // UINT64_MAX, it also writes the data blocks home.  desc is a buffer of
+    // one block, and data one of EmptyFSJournalRecordCapacity blocks.
+{
+    int                     err;
+    const EmptyFSSuperblock * sb;
+    uint32_t                blockSize;
+    int                     apply;
+    int                     done;
+    EmptyFSJournalRecord    record;
+    const uint64_t *        blockNums;
+    uint64_t                home;
+    uint32_t                index;
+    uint32_t                crc;
+
+    sb = &image->fSuperblock;
+    blockSize = sb->fBlockSize;
+    apply = (stopSequence != UINT64_MAX);
+    blockNums = (const uint64_t *) (desc + kEmptyFSJournalRecordHeaderSize);
+
+    err = 0;
+    done = FALSE;
+    while ( (err == 0) && ! done && (sequence < stopSequence) ) {
+        err = EmptyFSImageReadBlocks(image, sb->fJournalStart + start, 1, desc);
+        if (err == 0) {
+            memcpy(&record, desc, sizeof(record));
+            EmptyFSSwapJournalRecord(&record);
+            done = (EmptyFSJournalRecordValidate(sb, &record, sequence) != 0);
+        }
+
+        // A record that writes outside the metadata is corrupt, which ends
+        // the journal like any other bad record.
+
+        for (index = 0; (err == 0) && ! done && (index < record.fBlockCount); index++) {
+            home = EmptyFSSwapLE64(blockNums[index]);
+            done =    (home < sb->fBitmapStart)
+                   || (home >= sb->fBlockCount)
+                   || ( (home >= sb->fJournalStart) && (home < (sb->fJournalStart + sb->fJournalBlocks)) );
+        }
+        if ( (err == 0) && ! done ) {
+            crc = EmptyFSJournalRecordChecksum(desc, blockSize);
+            for (index = 0; (err == 0) && (index < record.fBlockCount); index++) {
+                err = EmptyFSImageReadBlocks(image, sb->fJournalStart + JournalAdvance(image, start, 1 + index), 1, data + (size_t) index * blockSize);
+                if (err == 0) {
+                    crc = EmptyFSChecksum(crc, data + (size_t) index * blockSize, blockSize);
+                }
+            }
+            if ( (err == 0) && (crc != EmptyFSSwapLE32( ((const EmptyFSJournalRecord *) desc)->fChecksum )) ) {
+                done = TRUE;
+                if (apply) {
+                    err = EIO;              // it was fine when we scanned it
+                }
+            }
+        }
+        if ( (err == 0) && ! done && apply ) {
+            for (index = 0; (err == 0) && (index < record.fBlockCount); index++) {
+                err = EmptyFSImageWriteBlocks(image, EmptyFSSwapLE64(blockNums[index]), 1, data + (size_t) index * blockSize);
+            }
+        }
+        if ( (err == 0) && ! done ) {
+            start = JournalAdvance(image, start, 1 + record.fBlockCount);
+            sequence += 1;
+            if ( ! (record.fFlags & kEmptyFSJournalRecordContinued) ) {
+                *endPtr         = start;
+                *endSequencePtr = sequence;
+                *lastPtr        = record;
+            }
+        }
+    }
+    return err;
+}
+
+static int JournalReplay(EmptyFSImage *image)
+    // Replays the journal of a volume that wasn't cleanly unmounted, as the
+    // KEXT would when mounting it, then empties the journal and marks the
+    // volume clean.  Scanning first, and only then applying, means that a
+    // partial transaction at the end is never applied.
+{
+    int                     err;
+    EmptyFSSuperblock *     sb;
+    EmptyFSJournalHeader    header;
+    EmptyFSJournalRecord    last;
+    uint8_t *               desc;
+    uint8_t *               data;
+    uint64_t                end;
+    uint64_t                endSequence;
+    uint64_t                junk;
+
+    sb = &image->fSuperblock;
+
+    err = 0;
+    desc = malloc(sb->fBlockSize);
+    data = malloc( (size_t) EmptyFSJournalRecordCapacity(sb) * sb->fBlockSize );
+    if ( (desc == NULL) || (data == NULL) ) {
+        err = ENOMEM;
+    }
+    if (err == 0) {
+        err = EmptyFSImageReadBlocks(image, sb->fJournalStart, 1, image->fBlockBuf);
+    }
+    if (err == 0) {
+        memcpy(&header, image->fBlockBuf, sizeof(header));
+        if ( EmptyFSJournalHeaderChecksum(&header) != EmptyFSSwapLE32(header.fChecksum) ) {
+            err = EIO;
+        } else {
+            EmptyFSSwapJournalHeader(&header);
+            err = EmptyFSJournalHeaderValidate(sb, &header);
+        }
+    }
+    if (err == 0) {
+        end         = header.fStart;
+        endSequence = header.fSequence;
+        memset(&last, 0, sizeof(last));
+        last.fFreeBlockCount = header.fFreeBlockCount;
+        last.fFreeFileCount  = header.fFreeFileCount;
+        last.fDirectoryCount = header.fDirectoryCount;
+        last.fOrphanFileNum  = header.fOrphanFileNum;
+
+        err = JournalScan(image, header.fStart, header.fSequence, UINT64_MAX, desc, data, &end, &endSequence, &last);
+        if ( (err == 0) && (endSequence != header.fSequence) ) {
+            err = JournalScan(image, header.fStart, header.fSequence, endSequence, desc, data, &junk, &junk, &last);
+        }
+    }
+
+    // Everything is home, so the counts from the journal are the volume's
+    // counts.  Flush before writing the new header, so that the header
+    // never gets to the disk before the blocks that it says are home.  The
+    // sequence numbers skip ahead, as they do in the KEXT, so that stale
+    // records beyond the end can never be mistaken for new ones.
+
+    if (err == 0) {
+        sb->fFreeBlockCount = last.fFreeBlockCount;
+        sb->fFreeFileCount  = last.fFreeFileCount;
+        sb->fDirectoryCount = last.fDirectoryCount;
+        sb->fOrphanFileNum  = last.fOrphanFileNum;
+        if (fsync(image->fFD) < 0) {
+            err = errno;
+        }
+    }
+    if (err == 0) {
+        err = JournalWriteHeader(image, end, endSequence + sb->fJournalBlocks);
+    }
+    if (err == 0) {
+        sb->fState |= kEmptyFSStateClean;
+        image->fSuperblockDirty = TRUE;
+        err = EmptyFSImageFlush(image);
+    }
+
+    free(data);
+    free(desc);
+    return err;
+}
+
+static int FreeOrphans(EmptyFSImage *image)
+    // Frees the files on the orphan list (see "Orphans" in "EmptyFSFormat.h"),
+    // as the KEXT would when mounting the volume.  Each file comes off the
+    // list before its blocks go back to the bitmap.  If the list is damaged
+    // we stop there and empty it, leaving whatever's left for fsck_EmptyFS to
+    // find; leaking a few files is better than freeing something that's in
+    // use.
+{
+    int                 err;
+    EmptyFSSuperblock * sb;
+    EmptyFSFileRecord   rec;
+    EmptyFSExtent *     extents;
+    uint32_t            extentIndex;
+    uint32_t            fileNum;
+    uint32_t            freed;
+
+    sb = &image->fSuperblock;
+
+    err = 0;
+    freed = 0;
+    while ( (err == 0) && (sb->fOrphanFileNum != 0) ) {
+        fileNum = sb->fOrphanFileNum;
+
+        // The bound on freed catches a cycle, because each file we free is
+        // no longer an orphan when we come round to it again.
+
+        err = EmptyFSImageReadFileRecord(image, fileNum, &rec);
+        if ( (err == 0) && ( S_ISDIR(rec.fMode) || (rec.fLinkCount != 0) || (freed >= sb->fFileCount) ) ) {
+            err = EIO;
+        }
+        if (err != 0) {
+            sb->fOrphanFileNum = 0;
+            image->fSuperblockDirty = TRUE;
+            err = 0;
+            break;
+        }
+
+        extents = NULL;
+        sb->fOrphanFileNum = rec.fNextOrphan;
+        image->fSuperblockDirty = TRUE;
+        err = EmptyFSImageGetExtents(image, &rec, &extents);
+        if (err == 0) {
+            for (extentIndex = 0; extentIndex < rec.fExtentCount; extentIndex++) {
+                FreeBlocks(image, extents[extentIndex].fStartBlock, extents[extentIndex].fBlockCount);
+            }
+            if (rec.fChunkChecksumBlock != 0) {
+                FreeBlocks(image, rec.fChunkChecksumBlock, EmptyFSChunkChecksumBlocks(sb, &rec));
+            }
+
+            // Setting no extents frees the overflow blocks.
+
+            err = SetFileExtents(image, &rec, NULL, 0);
+        }
+        if (err == 0) {
+            uint32_t    generation;
+
+            generation = rec.fGeneration;
+            memset(&rec, 0, sizeof(rec));
+            rec.fGeneration = generation;
+            err = EmptyFSImageWriteFileRecord(image, fileNum, &rec);
+        }
+        if (err == 0) {
+            sb->fFreeFileCount += 1;
+            freed += 1;
+        }
+        free(extents);
+    }
+    if ( (err == 0) && (freed != 0) ) {
+        err = EmptyFSImageFlush(image);
+    }
+    return err;
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Opening and Closing
+
+static int ImageAllocBuffers(EmptyFSImage *image)
+{
+    size_t  bitmapSize;
+
+    image->fBlockBuf = malloc(image->fSuperblock.fBlockSize);
+    image->fIndexBuf = malloc( (size_t) (kEmptyFSDirIndexMaxDepth + 1) * image->fSuperblock.fBlockSize );
+    if ( (image->fBlockBuf == NULL) || (image->fIndexBuf == NULL) ) {
+        return ENOMEM;
+    }
+    if (image->fWritable) {
+        bitmapSize = (size_t) (image->fSuperblock.fBitmapBlocks * image->fSuperblock.fBlockSize);
+        image->fBitmap = calloc(1, bitmapSize);
+        if (image->fBitmap == NULL) {
+            return ENOMEM;
+        }
+    }
+    return 0;
+}
+
+static void ImageFree(EmptyFSImage *image)
+{
+    if (image->fFD >= 0) {
+        (void) close(image->fFD);
+    }
+    free(image->fBitmap);
+    free(image->fBlockBuf);
+    free(image->fIndexBuf);
+    free(image);
+}
+
+static void FillUUID(uint8_t *uuid)
+    // Makes a random (version 4) UUID.
+{
+    int     fd;
+    size_t  index;
+    int     ok;
+
+    ok = FALSE;
+    fd = open("/dev/urandom", O_RDONLY);
+    if (fd >= 0) {
+        ok = (read(fd, uuid, 16) == 16);
+        (void) close(fd);
+    }
+    if ( ! ok ) {
+        srandom( (unsigned) (NowNanoseconds() ^ getpid()) );
+        for (index = 0; index < 16; index++) {
+            uuid[index] = (uint8_t) random();
+        }
+    }
+    uuid[6] = (uint8_t) ((uuid[6] & 0x0F) | 0x40);
+    uuid[8] = (uint8_t) ((uuid[8] & 0x3F) | 0x80);
+}
+
+enum {
+    kMaxJournalBlocks = 8192                // big enough for group commit, small enough to replay quickly
+};
+
+extern int EmptyFSImageLayout(
+    uint64_t            volumeSize,
+    uint32_t            blockSize,
+    uint32_t            fileCount,
+    int                 lazyFileTable,
+    const char *        volumeName,
+    EmptyFSSuperblock * sb
+)
+{
+    int         err;
+    uint64_t    bitsPerBlock;
+    uint32_t    recordsPerBlock;
+    uint64_t    fileTableBlocks;
+    uint64_t    journalBlocks;
+    int64_t     now;
+
+    assert(sb != NULL);
+
+    if (blockSize == 0) {
+        blockSize = kEmptyFSDefaultBlockSize;
+    }
+    if (volumeName == NULL) {
+        volumeName = "EmptyFS";
+    }
+
+    err = 0;
+    if (    (blockSize < kEmptyFSMinBlockSize)
+         || (blockSize > kEmptyFSMaxBlockSize)
+         || ((blockSize & (blockSize - 1)) != 0) ) {
+        err = EINVAL;
+    }
+    if (err == 0) {
+        memset(sb, 0, sizeof(*sb));
+        sb->fMagic              = kEmptyFSSuperblockMagic;
+        sb->fMajorVersion       = kEmptyFSMajorVersion;
+        sb->fMinorVersion       = kEmptyFSMinorVersion;
+        sb->fBlockSize          = blockSize;
+        sb->fFileRecordSize     = kEmptyFSFileRecordSize;
+        sb->fBlockCount         = volumeSize / blockSize;
+        sb->fRootFileNum        = kEmptyFSRootFileNum;
+        sb->fState              = kEmptyFSStateClean;
+        now = NowNanoseconds();
+        sb->fCreateTime         = now;
+        sb->fModifyTime         = now;
+        FillUUID(sb->fUUID);
+        strncpy(sb->fVolumeName, volumeName, sizeof(sb->fVolumeName) - 1);
+
+        // By default, allow one file for every four blocks, which is plenty
+        // for the sort of volume that you build with this library.
+
+        if (fileCount == 0) {
+            fileCount = (sb->fBlockCount / 4 > kEmptyFSMaxFileCount) ? kEmptyFSMaxFileCount : (uint32_t) (sb->fBlockCount / 4);
+            if (fileCount < 64) {
+                fileCount = 64;
+            }
+        }
+        bitsPerBlock    = (uint64_t) blockSize * 8;
+        recordsPerBlock = blockSize / kEmptyFSFileRecordSize;
+        fileTableBlocks = ((uint64_t) fileCount + recordsPerBlock - 1) / recordsPerBlock;
+
+        // There's no point wasting the tail of the last file table block.
+
+        if ( (fileTableBlocks * recordsPerBlock) <= kEmptyFSMaxFileCount ) {
+            fileCount = (uint32_t) (fileTableBlocks * recordsPerBlock);
+        }
+
+        // Give the volume a journal of about 3% of its size, but no more
+        // than a replay can get through quickly.  A volume too small for a
+        // journal of kEmptyFSJournalMinBlocks doesn't get one.
+
+        journalBlocks = sb->fBlockCount / 32;
+        if (journalBlocks > kMaxJournalBlocks) {
+            journalBlocks = kMaxJournalBlocks;
+        }
+        if (journalBlocks < kEmptyFSJournalMinBlocks) {
+            journalBlocks = 0;
+        }
+
+        sb->fFileCount          = fileCount;
+        sb->fBitmapStart        = 1;
+        sb->fBitmapBlocks       = (sb->fBlockCount + bitsPerBlock - 1) / bitsPerBlock;
+        sb->fFileTableStart     = sb->fBitmapStart + sb->fBitmapBlocks;
+        sb->fFileTableBlocks    = fileTableBlocks;
+        if (journalBlocks != 0) {
+            sb->fROCompatFeatures |= kEmptyFSROCompatJournal;
+            sb->fJournalStart   = sb->fFileTableStart + sb->fFileTableBlocks;
+            sb->fJournalBlocks  = journalBlocks;
+        }
+        sb->fROCompatFeatures  |= kEmptyFSROCompatDirIndex | kEmptyFSROCompatMetadataChecksums;
+
+        // Only initialise the first chunk of a big file table; the rest is
+        // initialised as it's needed.
+
+        if ( lazyFileTable && (fileTableBlocks > kFileTableInitChunk) ) {
+            sb->fROCompatFeatures  |= kEmptyFSROCompatLazyFileTable;
+            sb->fFileTableInitBlocks = kFileTableInitChunk;
+        }
+        sb->fDataStart          = sb->fFileTableStart + sb->fFileTableBlocks + journalBlocks;
+        sb->fFreeBlockCount     = sb->fBlockCount;
+        sb->fFreeFileCount      = fileCount - kEmptyFSFirstFileNum;
+        sb->fDirectoryCount     = 0;
+
+        // We need at least one data block, for the root directory.
+
+        if ( (sb->fBlockCount == 0) || (sb->fDataStart >= sb->fBlockCount) ) {
+            err = EINVAL;
+        }
+    }
+    return err;
+}
+
+extern int EmptyFSImageCreateWithLayout(int fd, const EmptyFSSuperblock *sb, EmptyFSImage **imagePtr)
+{
+    int                 err;
+    EmptyFSImage *      image;
+    uint32_t            blockSize;
+    uint64_t            block;
+    uint64_t            count;
+    EmptyFSFileRecord   rootRec;
+
+    assert(fd >= 0);
+    assert(sb != NULL);
+    assert(imagePtr != NULL);
+
+    err = 0;
+    image = calloc(1, sizeof(*image));
+    if (image == NULL) {
+        (void) close(fd);
+        err = ENOMEM;
+    } else {
+        image->fFD = fd;
+        image->fWritable = TRUE;
+        image->fSuperblock = *sb;
+        blockSize = sb->fBlockSize;
+    }
+    if (err == 0) {
+        err = ImageAllocBuffers(image);
+    }
+
+    // Mark the metadata as in use and create the root directory.
+
+    if (err == 0) {
+        BitmapSetRange(image, 0, image->fSuperblock.fDataStart, TRUE);
+        image->fAllocHint   = image->fSuperblock.fDataStart;
+        image->fFileNumHint = kEmptyFSRootFileNum + 1;
+
+        err = AllocBlocks(image, 1, &block, &count);
+    }
+    if (err == 0) {
+        EmptyFSDirBlockInit(image->fBlockBuf, blockSize);
+        err = ImageWriteMetaBlock(image, block, image->fBlockBuf);
+    }
+    if (err == 0) {
+        memset(&rootRec, 0, sizeof(rootRec));
+        rootRec.fMode           = S_IFDIR | 0755;
+        rootRec.fLinkCount      = 2;
+        rootRec.fUID            = (uint32_t) getuid();
+        rootRec.fGID            = (uint32_t) getgid();
+        rootRec.fSize           = blockSize;
+        rootRec.fBlockCount     = 1;
+        rootRec.fCreateTime     = image->fSuperblock.fCreateTime;
+        rootRec.fModifyTime     = image->fSuperblock.fCreateTime;
+        rootRec.fChangeTime     = image->fSuperblock.fCreateTime;
+        rootRec.fAccessTime     = image->fSuperblock.fCreateTime;
+        rootRec.fParentFileNum  = kEmptyFSRootFileNum;
+        rootRec.fGeneration     = 1;
+        rootRec.fExtentCount    = 1;
+        rootRec.fExtents[0].fStartBlock = block;
+        rootRec.fExtents[0].fBlockCount = 1;
+
+        err = EmptyFSImageWriteFileRecord(image, kEmptyFSRootFileNum, &rootRec);
+    }
+    if (err == 0) {
+        image->fSuperblock.fFreeFileCount  -= 1;
+        image->fSuperblock.fDirectoryCount  = 1;
+        image->fSuperblockDirty = TRUE;
+
+        if (image->fSuperblock.fJournalBlocks != 0) {
+            err = JournalWriteHeader(image, 1, 1);
+        }
+    }
+    if (err == 0) {
+        err = EmptyFSImageFlush(image);
+    }
+
+    if (err == 0) {
+        *imagePtr = image;
+    } else if (image != NULL) {
+        ImageFree(image);
+    }
+    return err;
+}
+
+extern int EmptyFSImageCreate(
+    const char *        path,
+    uint64_t            volumeSize,
+    uint32_t            blockSize,
+    uint32_t            fileCount,
+    const char *        volumeName,
+    EmptyFSImage **     imagePtr
+)
+{
+    int                 err;
+    int                 fd;
+    EmptyFSSuperblock   sb;
+    struct stat         sbuf;
+    void *              zeros;
+    uint64_t            block;
+
+    assert(path != NULL);
+    assert(imagePtr != NULL);
+
+    fd = -1;
+    zeros = NULL;
+
+    err = EmptyFSImageLayout(volumeSize, blockSize, fileCount, TRUE, volumeName, &sb);
+
+    // Open the file and make sure that it's the right size and that the
+    // metadata areas are zero filled.  For a regular file we get this by
+    // truncating it.  For anything else we have to write the zeros, but
+    // only as far as the initialised part of the file table.
+
+    if (err == 0) {
+        fd = open(path, O_RDWR | O_CREAT, 0644);
+        if ( (fd < 0) || (fstat(fd, &sbuf) < 0) ) {
+            err = errno;
+        }
+    }
+    if (err == 0) {
+        if ( S_ISREG(sbuf.st_mode) ) {
+            if ( (ftruncate(fd, 0) < 0) || (ftruncate(fd, (off_t) (sb.fBlockCount * sb.fBlockSize)) < 0) ) {
+                err = errno;
+            }
+        } else {
+            zeros = calloc(1, sb.fBlockSize);
+            if (zeros == NULL) {
+                err = ENOMEM;
+            }
+            for (block = 0; (err == 0) && (block < sb.fDataStart); block++) {
+                if (    (sb.fROCompatFeatures & kEmptyFSROCompatLazyFileTable)
+                     && (block >= (sb.fFileTableStart + sb.fFileTableInitBlocks))
+                     && (block <  (sb.fFileTableStart + sb.fFileTableBlocks)) ) {
+                    continue;
+                }
+                err = EmptyFSImagePWriteAll(fd, zeros, sb.fBlockSize, (off_t) (block * sb.fBlockSize));
+            }
+        }
+    }
+    free(zeros);
+
+    if (err == 0) {
+        err = EmptyFSImageCreateWithLayout(fd, &sb, imagePtr);
+    } else if (fd >= 0) {
+        (void) close(fd);
+    }
+    return err;
+}
+
+extern int EmptyFSImageOpen(const char *path, int writable, EmptyFSImage **imagePtr)
+{
+    int             err;
+    EmptyFSImage *  image;
+
+    assert(path != NULL);
+    assert(imagePtr != NULL);
+
+    err = 0;
+    image = calloc(1, sizeof(*image));
+    if (image == NULL) {
+        err = ENOMEM;
+    } else {
+        image->fWritable = writable;
+        image->fFD = open(path, writable ? O_RDWR : O_RDONLY);
+        if (image->fFD < 0) {
+            err = errno;
+        }
+    }
+    if (err == 0) {
+        err = EmptyFSImagePReadAll(image->fFD, &image->fSuperblock, sizeof(image->fSuperblock), kEmptyFSSuperblockOffset);
+    }
+    if (err == 0) {
+        err = EmptyFSSuperblockVerify(&image->fSuperblock);
+    }
+    if (err == 0) {
+        EmptyFSSwapSuperblock(&image->fSuperblock);
+        err = EmptyFSSuperblockValidate(&image->fSuperblock);
+    }
+    if ( (err == 0) && writable && ((image->fSuperblock.fROCompatFeatures & ~kEmptyFSROCompatFeaturesKnown) != 0) ) {
+        err = EROFS;
+    }
+    if (err == 0) {
+        err = ImageAllocBuffers(image);
+    }
+    if (    (err == 0)
+         && writable
+         && (image->fSuperblock.fROCompatFeatures & kEmptyFSROCompatJournal)
+         && ! (image->fSuperblock.fState & kEmptyFSStateClean) ) {
+        err = JournalReplay(image);
+    }
+    if ( (err == 0) && writable ) {
+        err = EmptyFSImageReadBlocks(image, image->fSuperblock.fBitmapStart, image->fSuperblock.fBitmapBlocks, image->fBitmap);
+        image->fAllocHint   = image->fSuperblock.fDataStart;
+        image->fFileNumHint = kEmptyFSFirstFileNum;
+    }
+    if ( (err == 0) && writable && (image->fSuperblock.fOrphanFileNum != 0) ) {
+        err = FreeOrphans(image);
+    }
+
+    if (err == 0) {
+        *imagePtr = image;
+    } else if (image != NULL) {
+        ImageFree(image);
+    }
+    return err;
+}
+
+extern int EmptyFSImageFlush(EmptyFSImage *image)
+{
+    int                 err;
+    EmptyFSSuperblock   diskSB;
+
+    err = 0;
+    if ( image->fWritable && (image->fBitmapDirtyStart != image->fBitmapDirtyEnd) ) {
+        err = EmptyFSImageWriteBlocks(
+            image,
+            image->fSuperblock.fBitmapStart + image->fBitmapDirtyStart,
+            image->fBitmapDirtyEnd - image->fBitmapDirtyStart,
+            image->fBitmap + (image->fBitmapDirtyStart * image->fSuperblock.fBlockSize)
+        );
+        if (err == 0) {
+            image->fBitmapDirtyStart = 0;
+            image->fBitmapDirtyEnd   = 0;
+        }
+    }
+    if ( (err == 0) && image->fWritable && image->fSuperblockDirty ) {
+        diskSB = image->fSuperblock;
+        EmptyFSSwapSuperblock(&diskSB);
+        EmptyFSSuperblockSeal(&diskSB);
+        err = EmptyFSImagePWriteAll(image->fFD, &diskSB, sizeof(diskSB), kEmptyFSSuperblockOffset);
+        if (err == 0) {
+            image->fSuperblockDirty = FALSE;
+        }
+    }
+    if ( (err == 0) && image->fWritable ) {
+        if (fsync(image->fFD) < 0) {
+            err = errno;
+        }
+    }
+    return err;
+}
+
+extern int EmptyFSImageClose(EmptyFSImage *image)
+{
+    int     err;
+
+    err = 0;
+    if (image != NULL) {
+        err = EmptyFSImageFlush(image);
+        ImageFree(image);
+    }
+    return err;
+}
+
+extern const EmptyFSSuperblock * EmptyFSImageGetSuperblock(const EmptyFSImage *image)
+{
+    return &image->fSuperblock;
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Directory Index
+
+// The directory index is described in "EmptyFSFormat.h".  The library is
+// single threaded and writes straight to the image, so it can walk the
+// tree recursively, holding a node at each level in fIndexBuf, which has
+// room for one node per level plus the new node of a split.
+
+enum {
+    kDirIndexAnyLevel = 0xFFFFFFFF
+};
+
+static void * DirIndexBuffer(EmptyFSImage *image, uint32_t slot)
+    // Returns the part of fIndexBuf for the node at a given depth below the
+    // root, or the split buffer if slot is kEmptyFSDirIndexMaxDepth.
+{
+    assert(slot <= kEmptyFSDirIndexMaxDepth);
+    return image->fIndexBuf + ((size_t) slot * image->fSuperblock.fBlockSize);
+}
+
+static int ReadDirIndexNode(EmptyFSImage *image, uint64_t block, uint32_t level, void *node)
+    // Reads a directory index node, and checks that it's valid and at the
+    // given level (any level, if level is kDirIndexAnyLevel).
+{
+    int     err;
+
+    err = ImageReadMetaBlock(image, block, node);
+    if (err == 0) {
+        err = EmptyFSDirIndexNodeValidate(&image->fSuperblock, node);
+    }
+    if ( (err == 0) && (level != kDirIndexAnyLevel) && (EmptyFSSwapLE16( ((const EmptyFSDirIndexHeader *) node)->fLevel ) != level) ) {
+        err = EIO;
+    }
+    return err;
+}
+
+static int SearchDirBlock(
+    EmptyFSImage *          image,
+    const EmptyFSExtent *   extents,
+    uint32_t                extentCount,
+    uint64_t                logicalBlock,
+    const char *            name,
+    size_t                  nameLen,
+    uint32_t *              fileNumPtr
+)
+    // Searches one block of a directory for name, setting *fileNumPtr to its
+    // file number, or leaving it alone if it's not there.
+{
+    int                 err;
+    uint32_t            blockSize;
+    uint64_t            physicalBlock;
+    EmptyFSDirEntry *   entry;
+
+    blockSize = image->fSuperblock.fBlockSize;
+    err = EmptyFSExtentMap(extents, extentCount, logicalBlock, &physicalBlock, NULL);
+    if (err != 0) {
+        err = EIO;
+    }
+    if (err == 0) {
+        err = ImageReadMetaBlock(image, physicalBlock, image->fBlockBuf);
+    }
+    if (err == 0) {
+        err = EmptyFSDirBlockValidate(image->fBlockBuf, blockSize);
+    }
+    entry = NULL;
+    while ( (err == 0) && ((entry = EmptyFSDirBlockNextEntry(image->fBlockBuf, blockSize, entry)) != NULL) ) {
+        if ( (entry->fFileNum != 0) && (entry->fNameLength == nameLen) && (memcmp(entry->fName, name, nameLen) == 0) ) {
+            *fileNumPtr = EmptyFSSwapLE32(entry->fFileNum);
+            break;
+        }
+    }
+    return err;
+}
+
+struct DirIndexSearchState {
+    const EmptyFSExtent *   fExtents;
+    uint32_t                fExtentCount;
+    const char *            fName;
+    size_t                  fNameLen;
+    uint32_t                fHash;
+    uint64_t                fLastBlock;         // the last directory block searched
+    uint32_t                fFileNum;           // the answer, or zero
+    int                     fDone;              // found it, or passed the records with our hash
+};
+typedef struct DirIndexSearchState DirIndexSearchState;
+
+static int DirIndexSearchNode(EmptyFSImage *image, uint64_t block, uint32_t level, uint32_t depth, DirIndexSearchState *state)
+    // Searches the subtree rooted at block, which is depth levels below the
+    // root, for records with the hash in state, and searches the directory
+    // blocks that they name.  Records with one hash can span several leaves,
+    // so we go on into the next child until a leaf tells us that we've seen
+    // them all.
+{
+    int                     err;
+    void *                  node;
+    EmptyFSDirIndexRecord * records;
+    uint32_t                count;
+    uint32_t                index;
+    uint64_t                key;
+
+    node = DirIndexBuffer(image, depth);
+    err = ReadDirIndexNode(image, block, level, node);
+    if (err == 0) {
+        records = EmptyFSDirIndexRecords(node);
+        count   = EmptyFSSwapLE16( ((EmptyFSDirIndexHeader *) node)->fCount );
+        index   = EmptyFSDirIndexNodeSearch(node, EmptyFSDirIndexKey(state->fHash, 0), FALSE);
+        if (level == 0) {
+
+            // The directory block search uses fBlockBuf, not our node, so
+            // we can keep going through the leaf.
+
+            for ( ; (err == 0) && ! state->fDone && (index < count); index++) {
+                key = EmptyFSSwapLE64(records[index].fKey);
+                if (EmptyFSDirIndexKeyHash(key) != state->fHash) {
+                    state->fDone = TRUE;
+                } else if (EmptyFSDirIndexKeyBlock(key) != state->fLastBlock) {
+                    state->fLastBlock = EmptyFSDirIndexKeyBlock(key);
+                    err = SearchDirBlock(image, state->fExtents, state->fExtentCount, state->fLastBlock, state->fName, state->fNameLen, &state->fFileNum);
+                    state->fDone = (state->fFileNum != 0);
+                }
+            }
+        } else {
+            for (index -= 1; (err == 0) && ! state->fDone && (index < count); index++) {
+                err = DirIndexSearchNode(image, EmptyFSSwapLE64(records[index].fChild), level - 1, depth + 1, state);
+            }
+        }
+    }
+    return err;
+}
+
+static int DirIndexLookup(
+    EmptyFSImage *              image,
+    const EmptyFSFileRecord *   rec,
+    const EmptyFSExtent *       extents,
+    const char *                name,
+    size_t                      nameLen,
+    uint32_t *                  fileNumPtr
+)
+    // Looks up name in an indexed directory, setting *fileNumPtr to its file
+    // number, or 0 if it's not there.
+{
+    int                     err;
+    DirIndexSearchState     state;
+    EmptyFSDirIndexHeader   root;
+    uint32_t                level;
+
+    assert(rec->fDirIndexBlock != 0);
+
+    state.fExtents     = extents;
+    state.fExtentCount = rec->fExtentCount;
+    state.fName        = name;
+    state.fNameLen     = nameLen;
+    state.fHash        = EmptyFSDirNameHash(&image->fSuperblock, name, nameLen);
+    state.fLastBlock   = UINT64_MAX;
+    state.fFileNum     = 0;
+    state.fDone        = FALSE;
+
+    err = ReadDirIndexNode(image, rec->fDirIndexBlock, kDirIndexAnyLevel, DirIndexBuffer(image, 0));
+    if (err == 0) {
+        memcpy(&root, DirIndexBuffer(image, 0), sizeof(root));
+        level = EmptyFSSwapLE16(root.fLevel);
+        err = DirIndexSearchNode(image, rec->fDirIndexBlock, level, 0, &state);
+    }
+    if (err == 0) {
+        *fileNumPtr = state.fFileNum;
+    }
+    return err;
+}
+
+static int DirIndexInsertNode(
+    EmptyFSImage *  image,
+    uint64_t        block,
+    uint32_t        level,
+    uint32_t        depth,
+    uint64_t        key,
+    uint64_t *      splitKeyPtr,
+    uint64_t *      splitBlockPtr
+)
+    // Inserts a record with the given key into the subtree rooted at block,
+    // which is depth levels below the root.  If this node splits,
+    // *splitBlockPtr is the new node and *splitKeyPtr its first key, which
+    // our caller must insert into the parent; otherwise *splitBlockPtr is 0.
+{
+    int                     err;
+    void *                  node;
+    void *                  newNode;
+    uint32_t                index;
+    uint32_t                leftCount;
+    uint64_t                pendingKey;
+    uint64_t                pendingChild;
+    uint64_t                count;
+    int                     done;
+
+    *splitBlockPtr = 0;
+
+    // In an interior node, the record to add is the one for the new node
+    // of a split child, and it goes just after that child.
+
+    node = DirIndexBuffer(image, depth);
+    err = ReadDirIndexNode(image, block, level, node);
+    pendingKey   = key;
+    pendingChild = 0;
+    index = 0;
+    done  = FALSE;
+    if (err == 0) {
+        index = EmptyFSDirIndexNodeSearch(node, key, TRUE);
+        if (level != 0) {
+            err = DirIndexInsertNode(image, EmptyFSSwapLE64(EmptyFSDirIndexRecords(node)[index - 1].fChild), level - 1, depth + 1, key, &pendingKey, &pendingChild);
+            done = (pendingChild == 0);     // the child had room
+        }
+    }
+
+    // Add the record, splitting this node if it's full.  The new node goes
+    // in the split buffer, which our children are finished with.
+
+    if ( (err == 0) && ! done ) {
+        err = EmptyFSDirIndexNodeInsert(&image->fSuperblock, node, index, pendingKey, pendingChild);
+        if (err == ENOSPC) {
+            newNode = DirIndexBuffer(image, kEmptyFSDirIndexMaxDepth);
+            *splitKeyPtr = EmptyFSDirIndexNodeSplit(node, newNode, image->fSuperblock.fBlockSize);
+            leftCount = EmptyFSSwapLE16( ((EmptyFSDirIndexHeader *) node)->fCount );
+            if (index <= leftCount) {
+                err = EmptyFSDirIndexNodeInsert(&image->fSuperblock, node, index, pendingKey, pendingChild);
+            } else {
+                err = EmptyFSDirIndexNodeInsert(&image->fSuperblock, newNode, index - leftCount, pendingKey, pendingChild);
+            }
+            assert(err == 0);
+            if (err == 0) {
+                err = AllocBlocks(image, 1, splitBlockPtr, &count);
+            }
+            if (err == 0) {
+                err = ImageWriteMetaBlock(image, *splitBlockPtr, newNode);
+            }
+        }
+    }
+    if ( (err == 0) && ! done ) {
+        err = ImageWriteMetaBlock(image, block, node);
+    }
+    return err;
+}
+
+static int DirIndexInsert(EmptyFSImage *image, EmptyFSFileRecord *rec, uint64_t key)
+    // Adds a record with the given key to a directory's index.  If the root
+    // splits, this updates rec->fDirIndexBlock; the caller is responsible for
+    // writing rec.
+{
+    int                     err;
+    EmptyFSDirIndexHeader   header;
+    uint32_t                level;
+    uint64_t                splitKey;
+    uint64_t                splitBlock;
+    uint64_t                newRoot;
+    uint64_t                count;
+    void *                  node;
+
+    assert(rec->fDirIndexBlock != 0);
+
+    err = ReadDirIndexNode(image, rec->fDirIndexBlock, kDirIndexAnyLevel, DirIndexBuffer(image, 0));
+    level = 0;
+    if (err == 0) {
+        memcpy(&header, DirIndexBuffer(image, 0), sizeof(header));
+        level = EmptyFSSwapLE16(header.fLevel);
+        err = DirIndexInsertNode(image, rec->fDirIndexBlock, level, 0, key, &splitKey, &splitBlock);
+    }
+
+    // If the root split, put a new root above it.
+
+    if ( (err == 0) && (splitBlock != 0) ) {
+        if ( (level + 1) >= kEmptyFSDirIndexMaxDepth ) {
+            err = ENOSPC;
+        }
+        if (err == 0) {
+            err = AllocBlocks(image, 1, &newRoot, &count);
+        }
+        if (err == 0) {
+            node = DirIndexBuffer(image, 0);
+            EmptyFSDirIndexNodeInit(node, image->fSuperblock.fBlockSize, (uint16_t) (level + 1));
+            err = EmptyFSDirIndexNodeInsert(&image->fSuperblock, node, 0, 0, rec->fDirIndexBlock);
+            if (err == 0) {
+                err = EmptyFSDirIndexNodeInsert(&image->fSuperblock, node, 1, splitKey, splitBlock);
+            }
+            if (err == 0) {
+                err = ImageWriteMetaBlock(image, newRoot, node);
+            }
+            if (err == 0) {
+                rec->fDirIndexBlock = newRoot;
+            }
+        }
+    }
+    return err;
+}
+
+static int DirIndexBuild(EmptyFSImage *image, EmptyFSFileRecord *rec, const EmptyFSExtent *extents)
+    // Creates an index for a directory that doesn't have one, from its
+    // entries, and sets rec->fDirIndexBlock.  The caller is responsible for
+    // writing rec.
+{
+    int                 err;
+    uint32_t            blockSize;
+    uint64_t            blockCount;
+    uint64_t            logicalBlock;
+    uint64_t            physicalBlock;
+    uint64_t            root;
+    uint64_t            count;
+    EmptyFSDirEntry *   entry;
+    uint32_t *          hashes;
+    uint32_t            hashCount;
+    uint32_t            index;
+
+    assert(rec->fDirIndexBlock == 0);
+
+    blockSize  = image->fSuperblock.fBlockSize;
+    blockCount = rec->fSize / blockSize;
+
+    // A block can't hold more entries than this.  We hash a block's names
+    // before indexing them, because inserting uses fBlockBuf.
+
+    err = 0;
+    hashes = malloc( (blockSize / kEmptyFSDirEntryAlign) * sizeof(*hashes) );
+    if (hashes == NULL) {
+        err = ENOMEM;
+    }
+    if (err == 0) {
+        err = AllocBlocks(image, 1, &root, &count);
+    }
+    if (err == 0) {
+        EmptyFSDirIndexNodeInit(image->fBlockBuf, blockSize, 0);
+        err = ImageWriteMetaBlock(image, root, image->fBlockBuf);
+    }
+    if (err == 0) {
+        rec->fDirIndexBlock = root;
+    }
+    for (logicalBlock = 0; (err == 0) && (logicalBlock < blockCount); logicalBlock++) {
+        hashCount = 0;
+        err = EmptyFSExtentMap(extents, rec->fExtentCount, logicalBlock, &physicalBlock, NULL);
+        if (err != 0) {
+            err = EIO;
+        }
+        if (err == 0) {
+            err = ImageReadMetaBlock(image, physicalBlock, image->fBlockBuf);
+        }
+        if (err == 0) {
+            err = EmptyFSDirBlockValidate(image->fBlockBuf, blockSize);
+        }
+        entry = NULL;
+        while ( (err == 0) && ((entry = EmptyFSDirBlockNextEntry(image->fBlockBuf, blockSize, entry)) != NULL) ) {
+            if (entry->fFileNum != 0) {
+                hashes[hashCount] = EmptyFSDirNameHash(&image->fSuperblock, entry->fName, entry->fNameLength);
+                hashCount += 1;
+            }
+        }
+        for (index = 0; (err == 0) && (index < hashCount); index++) {
+            err = DirIndexInsert(image, rec, EmptyFSDirIndexKey(hashes[index], logicalBlock));
+        }
+    }
+
+    // We don't free a partially built index; it's just leaked blocks.
+
+    if (err != 0) {
+        rec->fDirIndexBlock = 0;
+    }
+    free(hashes);
+    return err;
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Reading
+
+static int ReadDirectoryRecord(EmptyFSImage *image, uint32_t dirFileNum, EmptyFSFileRecord *rec, EmptyFSExtent **extentsPtr)
+    // Reads the file record and extents of a directory.
+{
+    int     err;
+
+    err = EmptyFSImageReadFileRecord(image, dirFileNum, rec);
+    if ( (err == 0) && ! S_ISDIR(rec->fMode) ) {
+        err = ENOTDIR;
+    }
+    if (err == 0) {
+        err = EmptyFSImageGetExtents(image, rec, extentsPtr);
+    }
+    return err;
+}
+
+extern int EmptyFSImageIterateDirectory(
+    EmptyFSImage *                  image,
+    uint32_t                        dirFileNum,
+    EmptyFSImageDirectoryCallback   callback,
+    void *                          refCon
+)
+{
+    int                 err;
+    EmptyFSFileRecord   rec;
+    EmptyFSExtent *     extents;
+    uint64_t            blockCount;
+    uint64_t            logicalBlock;
+    uint64_t            physicalBlock;
+    EmptyFSDirEntry *   entry;
+    uint32_t            blockSize;
+
+    blockSize = image->fSuperblock.fBlockSize;
+    extents = NULL;
+    blockCount = 0;
+    err = ReadDirectoryRecord(image, dirFileNum, &rec, &extents);
+    if (err == 0) {
+        blockCount = rec.fSize / blockSize;
+    }
+    for (logicalBlock = 0; (err == 0) && (logicalBlock < blockCount); logicalBlock++) {
+        err = EmptyFSExtentMap(extents, rec.fExtentCount, logicalBlock, &physicalBlock, NULL);
+        if (err != 0) {
+            err = EIO;
+        }
+        if (err == 0) {
+            err = ImageReadMetaBlock(image, physicalBlock, image->fBlockBuf);
+        }
+        if (err == 0) {
+            err = EmptyFSDirBlockValidate(image->fBlockBuf, blockSize);
+        }
+        entry = NULL;
+        while ( (err == 0) && ((entry = EmptyFSDirBlockNextEntry(image->fBlockBuf, blockSize, entry)) != NULL) ) {
+            if (entry->fFileNum != 0) {
+                err = callback(refCon, entry->fName, entry->fNameLength, EmptyFSSwapLE32(entry->fFileNum), entry->fType);
+            }
+        }
+    }
+    free(extents);
+    return err;
+}
+
+struct LookupState {
+    const char *    fName;
+    size_t          fNameLen;
+    uint32_t        fFileNum;
+};
+typedef struct LookupState LookupState;
+
+enum {
+    kLookupFound = -1                       // not a valid errno, so it can't be confused with one
+};
+
+static int LookupCallback(void *refCon, const char *name, size_t nameLen, uint32_t fileNum, uint8_t type)
+{
+    LookupState *   state;
+
+    (void) type;
+    state = (LookupState *) refCon;
+    if ( (nameLen == state->fNameLen) && (memcmp(name, state->fName, nameLen) == 0) ) {
+        state->fFileNum = fileNum;
+        return kLookupFound;
+    }
+    return 0;
+}
+
+extern int EmptyFSImageLookup(EmptyFSImage *image, uint32_t dirFileNum, const char *name, uint32_t *fileNumPtr)
+    // If the directory has an index, we use it.  Otherwise we search every
+    // entry.
+{
+    int                 err;
+    EmptyFSFileRecord   rec;
+    EmptyFSExtent *     extents;
+    LookupState         state;
+
+    state.fName    = name;
+    state.fNameLen = strlen(name);
+    state.fFileNum = 0;
+    extents = NULL;
+    err = ReadDirectoryRecord(image, dirFileNum, &rec, &extents);
+    if ( (err == 0) && (rec.fDirIndexBlock != 0) ) {
+        err = DirIndexLookup(image, &rec, extents, state.fName, state.fNameLen, &state.fFileNum);
+        if ( (err == 0) && (state.fFileNum != 0) ) {
+            err = kLookupFound;
+        }
+    } else if (err == 0) {
+        err = EmptyFSImageIterateDirectory(image, dirFileNum, LookupCallback, &state);
+    }
+    if (err == kLookupFound) {
+        *fileNumPtr = state.fFileNum;
+        err = 0;
+    } else if (err == 0) {
+        err = ENOENT;
+    }
+    free(extents);
+    return err;
+}
+
+static int ReadCompressedFile(
+    EmptyFSImage *              image,
+    const EmptyFSFileRecord *   rec,
+    const EmptyFSExtent *       extents,
+    uint64_t                    offset,
+    void *                      buf,
+    size_t                      length
+)
+    // Reads length bytes (all of which are within the file) from offset in
+    // a compressed file.  Each chunk that the range touches is read and
+    // decompressed in full, and the part that we want is copied out.  If the
+    // file has a checksum table, each chunk is checked against it before
+    // it's decompressed.
+{
+    int         err;
+    uint32_t    blockSize;
+    uint32_t    chunkSize;
+    uint64_t    tableBlocks;
+    uint32_t *  table;
+    uint8_t *   extentBuf;
+    uint8_t *   chunkBuf;
+    uint64_t    chunkIndex;
+    uint64_t    chunkStart;
+    size_t      chunkLen;
+    size_t      offsetInChunk;
+    size_t      done;
+    size_t      thisLength;
+
+    blockSize = image->fSuperblock.fBlockSize;
+    chunkSize = rec->fCompressedChunkSize;
+
+    err = EmptyFSCompressedExtentsValidate(&image->fSuperblock, rec, extents, rec->fExtentCount);
+    table = NULL;
+    tableBlocks = EmptyFSChunkChecksumBlocks(&image->fSuperblock, rec);
+    extentBuf = malloc(chunkSize);
+    chunkBuf  = malloc(chunkSize);
+    if ( (err == 0) && ( (extentBuf == NULL) || (chunkBuf == NULL) ) ) {
+        err = ENOMEM;
+    }
+    if ( (err == 0) && (tableBlocks != 0) ) {
+        table = malloc( (size_t) tableBlocks * blockSize );
+        if (table == NULL) {
+            err = ENOMEM;
+        } else {
+            err = EmptyFSImageReadBlocks(image, rec->fChunkChecksumBlock, tableBlocks, table);
+        }
+    }
+    done = 0;
+    while ( (err == 0) && (done < length) ) {
+        chunkIndex    = (offset + done) / chunkSize;
+        chunkStart    = chunkIndex * chunkSize;
+        offsetInChunk = (size_t) ((offset + done) - chunkStart);
+        chunkLen      = chunkSize;
+        if (chunkLen > (rec->fSize - chunkStart)) {
+            chunkLen = (size_t) (rec->fSize - chunkStart);
+        }
+
+        err = EmptyFSImageReadBlocks(image, extents[chunkIndex].fStartBlock, extents[chunkIndex].fBlockCount, extentBuf);
+        if (    (err == 0)
+             && (table != NULL)
+             && (EmptyFSChecksum(0, extentBuf, (size_t) extents[chunkIndex].fBlockCount * blockSize) != EmptyFSSwapLE32(table[chunkIndex])) ) {
+            err = EIO;
+        }
+        if (err == 0) {
+            err = EmptyFSDecompress(
+                extents[chunkIndex].fFlags,
+                extentBuf,
+                (size_t) extents[chunkIndex].fBlockCount * blockSize,
+                chunkBuf,
+                chunkLen
+            );
+        }
+        if (err == 0) {
+            thisLength = chunkLen - offsetInChunk;
+            if (thisLength > (length - done)) {
+                thisLength = length - done;
+            }
+            memcpy( ((char *) buf) + done, chunkBuf + offsetInChunk, thisLength);
+            done += thisLength;
+        }
+    }
+    free(table);
+    free(extentBuf);
+    free(chunkBuf);
+    return err;
+}
+
+extern int EmptyFSImageReadFile(
+    EmptyFSImage *  image,
+    uint32_t        fileNum,
+    uint64_t        offset,
+    void *          buf,
+    size_t          length,
+    size_t *        actualPtr
+)
+{
+    int                 err;
+    EmptyFSFileRecord   rec;
+    EmptyFSExtent *     extents;
+    uint32_t            blockSize;
+    uint64_t            logicalBlock;
+    uint64_t            physicalBlock;
+    uint64_t            contig;
+    uint32_t            offsetInBlock;
+    size_t              done;
+    size_t              thisLength;
+
+    blockSize = image->fSuperblock.fBlockSize;
+    extents = NULL;
+    done = 0;
+    err = EmptyFSImageReadFileRecord(image, fileNum, &rec);
+    if (err == 0) {
+        err = EmptyFSImageGetExtents(image, &rec, &extents);
+    }
+    if ( (err == 0) && (offset < rec.fSize) ) {
+        if (length > (rec.fSize - offset)) {
+            length = (size_t) (rec.fSize - offset);
+        }
+    }
+    if ( (err == 0) && (offset < rec.fSize) && (rec.fCompressedChunkSize != 0) ) {
+        err = ReadCompressedFile(image, &rec, extents, offset, buf, length);
+        if (err == 0) {
+            done = length;
+        }
+    } else if ( (err == 0) && (offset < rec.fSize) ) {
+
+        // Read a contiguous run at a time, going through the scratch buffer
+        // only for partial blocks.
+
+        while ( (err == 0) && (done < length) ) {
+            logicalBlock  = (offset + done) / blockSize;
+            offsetInBlock = (uint32_t) ((offset + done) % blockSize);
+            err = EmptyFSExtentMap(extents, rec.fExtentCount, logicalBlock, &physicalBlock, &contig);
+            if (err != 0) {
+                err = EIO;
+            } else if ( (offsetInBlock != 0) || ((length - done) < blockSize) ) {
+                err = EmptyFSImageReadBlocks(image, physicalBlock, 1, image->fBlockBuf);
+                if (err == 0) {
+                    thisLength = blockSize - offsetInBlock;
+                    if (thisLength > (length - done)) {
+                        thisLength = length - done;
+                    }
+                    memcpy( ((char *) buf) + done, image->fBlockBuf + offsetInBlock, thisLength);
+                    done += thisLength;
+                }
+            } else {
+                if (contig > ((length - done) / blockSize)) {
+                    contig = (length - done) / blockSize;
+                }
+                err = EmptyFSImageReadBlocks(image, physicalBlock, contig, ((char *) buf) + done);
+                if (err == 0) {
+                    done += (size_t) (contig * blockSize);
+                }
+            }
+        }
+    }
+    if (err == 0) {
+        *actualPtr = done;
+    }
+    free(extents);
+    return err;
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Writing
+
+static int AddEntryToDirectory(EmptyFSImage *image, uint32_t dirFileNum, const char *name, uint32_t fileNum, uint8_t type, int isDir)
+    // Adds an entry to a directory, growing the directory by one block if
+    // there's no room in the existing blocks, and adds it to the directory's
+    // index, creating the index if the directory has become big enough to
+    // need one.  If isDir is true, the entry is a subdirectory, so the
+    // directory's link count goes up by one.
+{
+    int                 err;
+    EmptyFSFileRecord   rec;
+    EmptyFSExtent *     extents;
+    EmptyFSExtent *     newExtents;
+    uint32_t            blockSize;
+    uint64_t            blockCount;
+    uint64_t            logicalBlock;
+    uint64_t            physicalBlock;
+    uint64_t            count;
+    size_t              nameLen;
+
+    blockSize = image->fSuperblock.fBlockSize;
+    nameLen = strlen(name);
+    extents = NULL;
+    blockCount = 0;
+    err = ReadDirectoryRecord(image, dirFileNum, &rec, &extents);
+
+    // Try each existing block in turn.  An indexed directory can be huge, and
+    // we only ever add to it, so we just try its last block.
+
+    if (err == 0) {
+        blockCount = rec.fSize / blockSize;
+    }
+    physicalBlock = 0;
+    logicalBlock = 0;
+    if ( (rec.fDirIndexBlock != 0) && (blockCount != 0) ) {
+        logicalBlock = blockCount - 1;
+    }
+    for ( ; (err == 0) && (logicalBlock < blockCount); logicalBlock++) {
+        err = EmptyFSExtentMap(extents, rec.fExtentCount, logicalBlock, &physicalBlock, NULL);
+        if (err != 0) {
+            err = EIO;
+        }
+        if (err == 0) {
+            err = ImageReadMetaBlock(image, physicalBlock, image->fBlockBuf);
+        }
+        if (err == 0) {
+            err = EmptyFSDirBlockValidate(image->fBlockBuf, blockSize);
+        }
+        if (err == 0) {
+            err = EmptyFSDirBlockInsertEntry(image->fBlockBuf, blockSize, name, nameLen, fileNum, type);
+            if (err == 0) {
+                err = ImageWriteMetaBlock(image, physicalBlock, image->fBlockBuf);
+                break;
+            } else if (err == ENOSPC) {
+                err = 0;
+            }
+        }
+    }
+
+    // If none had room, add a block.  We try to put it right after the
+    // directory's last block, so that we can just extend the last extent.
+    // The block must be written before calling SetFileExtents, which uses
+    // the scratch buffer.
+
+    if ( (err == 0) && (logicalBlock == blockCount) ) {
+        if (rec.fExtentCount != 0) {
+            image->fAllocHint = extents[rec.fExtentCount - 1].fStartBlock + extents[rec.fExtentCount - 1].fBlockCount;
+        }
+        err = AllocBlocks(image, 1, &physicalBlock, &count);
+        if (err == 0) {
+            EmptyFSDirBlockInit(image->fBlockBuf, blockSize);
+            err = EmptyFSDirBlockInsertEntry(image->fBlockBuf, blockSize, name, nameLen, fileNum, type);
+        }
+        if (err == 0) {
+            err = ImageWriteMetaBlock(image, physicalBlock, image->fBlockBuf);
+        }
+        if (err == 0) {
+            if (    (rec.fExtentCount != 0)
+                 && (physicalBlock == (extents[rec.fExtentCount - 1].fStartBlock + extents[rec.fExtentCount - 1].fBlockCount))
+                 && (extents[rec.fExtentCount - 1].fBlockCount < UINT32_MAX) ) {
+                extents[rec.fExtentCount - 1].fBlockCount += 1;
+                err = SetFileExtents(image, &rec, extents, rec.fExtentCount);
+            } else {
+                newExtents = realloc(extents, (rec.fExtentCount + 1) * sizeof(*extents));
+                if (newExtents == NULL) {
+                    err = ENOMEM;
+                } else {
+                    extents = newExtents;
+                    extents[rec.fExtentCount].fStartBlock = physicalBlock;
+                    extents[rec.fExtentCount].fBlockCount = 1;
+                    extents[rec.fExtentCount].fFlags      = 0;
+                    err = SetFileExtents(image, &rec, extents, rec.fExtentCount + 1);
+                }
+            }
+        }
+        if (err == 0) {
+            rec.fSize       += blockSize;
+            rec.fBlockCount += 1;
+        }
+    }
+
+    // Index the new entry, which is in block logicalBlock, or index the
+    // directory if it's now big enough.
+
+    if ( (err == 0) && (rec.fDirIndexBlock != 0) ) {
+        err = DirIndexInsert(image, &rec, EmptyFSDirIndexKey(EmptyFSDirNameHash(&image->fSuperblock, name, nameLen), logicalBlock));
+    } else if (    (err == 0)
+                && (image->fSuperblock.fROCompatFeatures & kEmptyFSROCompatDirIndex)
+                && ((rec.fSize / blockSize) >= kEmptyFSDirIndexMinBlocks) ) {
+        err = DirIndexBuild(image, &rec, extents);
+    }
+
+    // Update the directory's record.
+
+    if (err == 0) {
+        if (isDir) {
+            rec.fLinkCount += 1;
+        }
+        rec.fModifyTime = NowNanoseconds();
+        rec.fChangeTime = rec.fModifyTime;
+        err = EmptyFSImageWriteFileRecord(image, dirFileNum, &rec);
+    }
+    free(extents);
+    return err;
+}
+
+static int AddObject(
+    EmptyFSImage *  image,
+    uint32_t        parentFileNum,
+    const char *    name,
+    uint16_t        mode,
+    const void *    data,
+    uint64_t        size,
+    uint32_t *      fileNumPtr
+)
+    // The common code behind EmptyFSImageAddDirectory and EmptyFSImageAddFile.
+    // For a directory, data is NULL and size is one block (its first, empty,
+    // directory block).
+{
+    int                 err;
+    uint32_t            fileNum;
+    uint32_t            existingFileNum;
+    uint32_t            blockSize;
+    uint64_t            blocksWanted;
+    EmptyFSFileRecord   rec;
+    EmptyFSExtent *     extents;
+    uint32_t            extentCount;
+    uint32_t            extentIndex;
+    uint64_t            done;
+    uint64_t            thisLength;
+    int64_t             now;
+    int                 isDir;
+
+    blockSize = image->fSuperblock.fBlockSize;
+    isDir     = S_ISDIR(mode);
+    now = 0;
+    extents = NULL;
+    extentCount = 0;
+
+    err = 0;
+    if ( ! image->fWritable ) {
+        err = EROFS;
+    } else if ( (name[0] == 0) || (strlen(name) > kEmptyFSMaxNameLength) || (strchr(name, '/') != NULL)
+             || (strcmp(name, ".") == 0) || (strcmp(name, "..") == 0) ) {
+        err = EINVAL;
+    }
+    if (err == 0) {
+        err = EmptyFSImageLookup(image, parentFileNum, name, &existingFileNum);
+        if (err == 0) {
+            err = EEXIST;
+        } else if (err == ENOENT) {
+            err = 0;
+        }
+    }
+    if (err == 0) {
+        err = AllocFileNum(image, &fileNum);
+    }
+
+    // Allocate and write the data.
+
+    if (err == 0) {
+        blocksWanted = (size + blockSize - 1) / blockSize;
+        if (blocksWanted != 0) {
+            err = AllocFileData(image, blocksWanted, &extents, &extentCount);
+        }
+    }
+    done = 0;
+    for (extentIndex = 0; (err == 0) && (extentIndex < extentCount); extentIndex++) {
+        if (isDir) {
+            EmptyFSDirBlockInit(image->fBlockBuf, blockSize);
+            err = ImageWriteMetaBlock(image, extents[extentIndex].fStartBlock, image->fBlockBuf);
+        } else {
+            thisLength = (uint64_t) extents[extentIndex].fBlockCount * blockSize;
+            if (thisLength > (size - done)) {
+                // The last block is partial.  Write the full blocks directly,
+                // and the tail via the (zero padded) scratch buffer.
+
+                uint64_t    fullBlocks;
+
+                fullBlocks = (size - done) / blockSize;
+                if (fullBlocks != 0) {
+                    err = EmptyFSImageWriteBlocks(image, extents[extentIndex].fStartBlock, fullBlocks, ((const char *) data) + done);
+                    done += fullBlocks * blockSize;
+                }
+                if (err == 0) {
+                    memset(image->fBlockBuf, 0, blockSize);
+                    memcpy(image->fBlockBuf, ((const char *) data) + done, (size_t) (size - done));
+                    err = EmptyFSImageWriteBlocks(image, extents[extentIndex].fStartBlock + fullBlocks, 1, image->fBlockBuf);
+                    done = size;
+                }
+            } else {
+                err = EmptyFSImageWriteBlocks(image, extents[extentIndex].fStartBlock, extents[extentIndex].fBlockCount, ((const char *) data) + done);
+                done += thisLength;
+            }
+        }
+    }
+
+    // Write the file record.
+
+    if (err == 0) {
+        now = NowNanoseconds();
+        memset(&rec, 0, sizeof(rec));
+        rec.fMode           = mode;
+        rec.fLinkCount      = isDir ? 2 : 1;
+        rec.fUID            = (uint32_t) getuid();
+        rec.fGID            = (uint32_t) getgid();
+        rec.fSize           = isDir ? blockSize : size;
+        rec.fBlockCount     = (size + blockSize - 1) / blockSize;
+        rec.fCreateTime     = now;
+        rec.fModifyTime     = now;
+        rec.fChangeTime     = now;
+        rec.fAccessTime     = now;
+        rec.fParentFileNum  = parentFileNum;
+        rec.fGeneration     = 1;
+        err = SetFileExtents(image, &rec, extents, extentCount);
+    }
+    if (err == 0) {
+        err = EmptyFSImageWriteFileRecord(image, fileNum, &rec);
+    }
+    if (err == 0) {
+        err = AddEntryToDirectory(image, parentFileNum, name, fileNum, isDir ? DT_DIR : DT_REG, isDir);
+    }
+    if (err == 0) {
+        image->fSuperblock.fFreeFileCount -= 1;
+        if (isDir) {
+            image->fSuperblock.fDirectoryCount += 1;
+        }
+        image->fSuperblock.fModifyTime = now;
+        image->fSuperblockDirty = TRUE;
+        if (fileNumPtr != NULL) {
+            *fileNumPtr = fileNum;
+        }
+    }
+
+    // We don't attempt to roll back a partially completed add; the blocks
+    // stay allocated, but the volume remains consistent enough to mount.
+
+    free(extents);
+    return err;
+}
+
+extern int EmptyFSImageAddDirectory(
+    EmptyFSImage *  image,
+    uint32_t        parentFileNum,
+    const char *    name,
+    uint16_t        mode,
+    uint32_t *      fileNumPtr
+)
+{
+    return AddObject(image, parentFileNum, name, (uint16_t) (S_IFDIR | (mode & ~S_IFMT)), NULL, image->fSuperblock.fBlockSize, fileNumPtr);
+}
+
+extern int EmptyFSImageAddFile(
+    EmptyFSImage *  image,
+    uint32_t        parentFileNum,
+    const char *    name,
+    uint16_t        mode,
+    const void *    data,
+    uint64_t        size,
+    uint32_t *      fileNumPtr
+)
+{
+    return AddObject(image, parentFileNum, name, (uint16_t) (S_IFREG | (mode & ~S_IFMT)), data, size, fileNumPtr);
+}
+
+extern int EmptyFSImageAllocFileData(
+    EmptyFSImage *      image,
+    uint32_t            fileNum,
+    uint64_t            size,
+    EmptyFSExtent **    extentsPtr,
+    uint32_t *          extentCountPtr
+)
+    // See comment in header.
+{
+    int                 err;
+    uint32_t            blockSize;
+    uint64_t            blocksWanted;
+    EmptyFSFileRecord   rec;
+    EmptyFSExtent *     extents;
+    uint32_t            extentCount;
+
+    assert(extentsPtr != NULL);
+    assert(extentCountPtr != NULL);
+
+    blockSize = image->fSuperblock.fBlockSize;
+    extents = NULL;
+    extentCount = 0;
+
+    err = 0;
+    if ( ! image->fWritable ) {
+        err = EROFS;
+    }
+    if (err == 0) {
+        err = EmptyFSImageReadFileRecord(image, fileNum, &rec);
+    }
+    if ( (err == 0) && ( ! S_ISREG(rec.fMode) || (rec.fBlockCount != 0) || (rec.fExtentCount != 0) ) ) {
+        err = EINVAL;
+    }
+    if (err == 0) {
+        blocksWanted = (size + blockSize - 1) / blockSize;
+        if (blocksWanted != 0) {
+            err = AllocFileData(image, blocksWanted, &extents, &extentCount);
+        }
+    }
+    if (err == 0) {
+        rec.fSize       = size;
+        rec.fBlockCount = (size + blockSize - 1) / blockSize;
+        err = SetFileExtents(image, &rec, extents, extentCount);
+    }
+    if (err == 0) {
+        err = EmptyFSImageWriteFileRecord(image, fileNum, &rec);
+    }
+    if (err == 0) {
+        *extentsPtr     = extents;
+        *extentCountPtr = extentCount;
+    } else {
+        free(extents);
+    }
+    return err;
+}
+
+extern int EmptyFSImageAllocCompressedFileData(
+    EmptyFSImage *      image,
+    uint32_t            fileNum,
+    uint64_t            size,
+    uint32_t            chunkSize,
+    EmptyFSExtent *     extents,
+    uint32_t            extentCount
+)
+    // See comment in header.
+{
+    int                 err;
+    EmptyFSFileRecord   rec;
+    uint64_t            blocksWanted;
+    uint32_t            index;
+    uint32_t            allocated;
+
+    err = 0;
+    allocated = 0;
+    if ( ! image->fWritable ) {
+        err = EROFS;
+    }
+    if (err == 0) {
+        err = EmptyFSImageReadFileRecord(image, fileNum, &rec);
+    }
+    if ( (err == 0) && ( ! S_ISREG(rec.fMode) || (rec.fBlockCount != 0) || (rec.fExtentCount != 0) ) ) {
+        err = EINVAL;
+    }
+
+    // Check the chunk size and the extents against the format's rules before
+    // we allocate anything.  The extents don't have start blocks yet, so we
+    // give them all a plausible one.
+
+    blocksWanted = 0;
+    if (err == 0) {
+        for (index = 0; index < extentCount; index++) {
+            extents[index].fStartBlock = image->fSuperblock.fDataStart;
+            blocksWanted += extents[index].fBlockCount;
+        }
+        rec.fSize                = size;
+        rec.fBlockCount          = blocksWanted;
+        rec.fExtentCount         = extentCount;
+        rec.fCompressedChunkSize = chunkSize;
+        if (    (chunkSize < kEmptyFSMinCompressedChunkSize)
+             || (chunkSize > kEmptyFSMaxCompressedChunkSize)
+             || ((chunkSize & (chunkSize - 1)) != 0)
+             || (chunkSize < image->fSuperblock.fBlockSize)
+             || (extentCount != ((size + chunkSize - 1) / chunkSize))
+             || (EmptyFSCompressedExtentsValidate(&image->fSuperblock, &rec, extents, extentCount) != 0) ) {
+            err = EINVAL;
+        } else if (blocksWanted > image->fSuperblock.fFreeBlockCount) {
+            err = ENOSPC;
+        }
+        rec.fExtentCount = 0;
+    }
+
+    for (index = 0; (err == 0) && (index < extentCount); index++) {
+        err = AllocContiguousBlocks(image, extents[index].fBlockCount, &extents[index].fStartBlock);
+        if (err == 0) {
+            allocated += 1;
+        }
+    }
+    if (err == 0) {
+        err = SetFileExtents(image, &rec, extents, extentCount);
+    }
+    if (err == 0) {
+        err = EmptyFSImageWriteFileRecord(image, fileNum, &rec);
+    }
+    if ( (err == 0) && ! (image->fSuperblock.fIncompatFeatures & kEmptyFSIncompatCompression) ) {
+        image->fSuperblock.fIncompatFeatures |= kEmptyFSIncompatCompression;
+        image->fSuperblockDirty = TRUE;
+    }
+    if (err != 0) {
+        while (allocated != 0) {
+            allocated -= 1;
+            FreeBlocks(image, extents[allocated].fStartBlock, extents[allocated].fBlockCount);
+        }
+    }
+    return err;
+}
+
+extern int EmptyFSImageAllocChunkChecksums(EmptyFSImage *image, uint32_t fileNum)
+    // See comment in header.
+{
+    int                 err;
+    EmptyFSFileRecord   rec;
+    uint64_t            tableBlocks;
+    uint64_t            tableBlock;
+
+    err = 0;
+    if ( ! image->fWritable ) {
+        err = EROFS;
+    }
+    if (err == 0) {
+        err = EmptyFSImageReadFileRecord(image, fileNum, &rec);
+    }
+    if ( (err == 0) && ( (rec.fCompressedChunkSize == 0) || (rec.fExtentCount == 0) || (rec.fChunkChecksumBlock != 0) ) ) {
+        err = EINVAL;
+    }
+
+    // The feature has to be set before we write the record, because
+    // EmptyFSFileRecordValidate rejects a table on a volume without it.
+
+    if ( (err == 0) && ! (image->fSuperblock.fROCompatFeatures & kEmptyFSROCompatDataChecksums) ) {
+        image->fSuperblock.fROCompatFeatures |= kEmptyFSROCompatDataChecksums;
+        image->fSuperblockDirty = TRUE;
+    }
+    if (err == 0) {
+        tableBlocks = ( ((uint64_t) rec.fExtentCount * sizeof(uint32_t)) + image->fSuperblock.fBlockSize - 1) / image->fSuperblock.fBlockSize;
+        err = AllocContiguousBlocks(image, tableBlocks, &tableBlock);
+    }
+    if (err == 0) {
+        rec.fChunkChecksumBlock = tableBlock;
+        err = EmptyFSImageWriteFileRecord(image, fileNum, &rec);
+        if (err != 0) {
+            FreeBlocks(image, tableBlock, tableBlocks);
+        }
+    }
+    return err;
+}
+
+extern int EmptyFSImageWriteChunkChecksums(EmptyFSImage *image, uint32_t fileNum, const uint32_t *checksums)
+    // See comment in header.
+{
+    int                 err;
+    EmptyFSFileRecord   rec;
+    uint64_t            tableBlocks;
+    uint32_t *          table;
+    uint32_t            index;
+
+    table = NULL;
+    err = EmptyFSImageReadFileRecord(image, fileNum, &rec);
+    if ( (err == 0) && (rec.fChunkChecksumBlock == 0) ) {
+        err = EINVAL;
+    }
+    if (err == 0) {
+        tableBlocks = EmptyFSChunkChecksumBlocks(&image->fSuperblock, &rec);
+        table = calloc( (size_t) tableBlocks, image->fSuperblock.fBlockSize);
+        if (table == NULL) {
+            err = ENOMEM;
+        }
+    }
+    if (err == 0) {
+        for (index = 0; index < rec.fExtentCount; index++) {
+            table[index] = EmptyFSSwapLE32(checksums[index]);
+        }
+        err = EmptyFSImageWriteBlocks(image, rec.fChunkChecksumBlock, tableBlocks, table);
+    }
+    free(table);
+    return err;
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Compression
+
+// The compressor produces standard LZ4 blocks, which EmptyFSDecompress (in
+// "EmptyFSFormat.c") decodes.  It's the simple greedy one: hash the next
+// four bytes, look in a table for the last place we saw the same hash, and
+// if the bytes there match, extend the match as far as it goes and emit it.
+// That gives most of the compression of the fancier LZ4 compressors at a
+// fraction of the cost.  Like LZ4 itself, we skip ahead faster the longer we
+// go without finding a match, so incompressible data goes by quickly, and we
+// leave the last few bytes of the input as literals, as the format requires.
+
+enum {
+    kLZ4HashBits        = 12,
+    kLZ4MinMatch        = 4,
+    kLZ4MaxOffset       = 65535,
+    kLZ4LastLiterals    = 5,            // the last 5 bytes are always literals
+    kLZ4MatchLimit      = 12,           // and no match starts in the last 12
+    kLZ4SkipShift       = 6
+};
+
+static uint32_t LZ4Read32(const uint8_t *p)
+{
+    uint32_t    value;
+
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint8_t * LZ4WriteLength(uint8_t *dst, size_t len)
+    // Writes the extra bytes of a literal or match length of at least 15.
+{
+    len -= 15;
+    while (len >= 255) {
+        *dst++ = 255;
+        len -= 255;
+    }
+    *dst++ = (uint8_t) len;
+    return dst;
+}
+
+static size_t LZ4WriteSequence(
+    uint8_t *       dst,
+    size_t          dstCapacity,
+    const uint8_t * literals,
+    size_t          literalLen,
+    size_t          offset,
+    size_t          matchLen
+)
+    // Appends a sequence to the compressed output: literalLen literals and
+    // then, unless matchLen is zero, a match.  Returns the number of bytes
+    // written, or zero if they wouldn't fit in dstCapacity.
+{
+    uint8_t *   cursor;
+    size_t      needed;
+
+    needed = 1 + (literalLen / 255) + 1 + literalLen + 2 + (matchLen / 255) + 1;
+    if (needed > dstCapacity) {
+        return 0;
+    }
+
+    cursor = dst;
+    *cursor++ = (uint8_t) ( (((literalLen < 15) ? literalLen : 15) << 4) | ( (matchLen == 0) ? 0 : (((matchLen - kLZ4MinMatch) < 15) ? (matchLen - kLZ4MinMatch) : 15) ) );
+    if (literalLen >= 15) {
+        cursor = LZ4WriteLength(cursor, literalLen);
+    }
+    memcpy(cursor, literals, literalLen);
+    cursor += literalLen;
+    if (matchLen != 0) {
+        *cursor++ = (uint8_t) (offset & 0xFF);
+        *cursor++ = (uint8_t) (offset >> 8);
+        if ( (matchLen - kLZ4MinMatch) >= 15 ) {
+            cursor = LZ4WriteLength(cursor, matchLen - kLZ4MinMatch);
+        }
+    }
+    return (size_t) (cursor - dst);
+}
+
+static size_t LZ4Compress(const uint8_t *src, size_t srcLen, uint8_t *dst, size_t dstCapacity)
+    // Compresses src into dst, returning the compressed length, or zero if it
+    // doesn't fit in dstCapacity.
+{
+    uint32_t    table[1 << kLZ4HashBits];
+    size_t      out;
+    size_t      written;
+    size_t      anchor;
+    size_t      pos;
+    size_t      candidate;
+    size_t      matchLen;
+    size_t      misses;
+    uint32_t    sequence;
+    uint32_t    hash;
+
+    memset(table, 0, sizeof(table));
+    out = 0;
+    anchor = 0;
+    if (srcLen > kLZ4MatchLimit) {
+        pos = 0;
+        misses = 0;
+        while (pos < (srcLen - kLZ4MatchLimit)) {
+            sequence  = LZ4Read32(src + pos);
+            hash      = (sequence * 2654435761U) >> (32 - kLZ4HashBits);
+            candidate = table[hash];
+            table[hash] = (uint32_t) pos;
+
+            if ( (candidate < pos) && ((pos - candidate) <= kLZ4MaxOffset) && (LZ4Read32(src + candidate) == sequence) ) {
+                matchLen = kLZ4MinMatch;
+                while ( ((pos + matchLen) < (srcLen - kLZ4LastLiterals)) && (src[candidate + matchLen] == src[pos + matchLen]) ) {
+                    matchLen += 1;
+                }
+                written = LZ4WriteSequence(dst + out, dstCapacity - out, src + anchor, pos - anchor, pos - candidate, matchLen);
+                if (written == 0) {
+                    return 0;
+                }
+                out   += written;
+                pos   += matchLen;
+                anchor = pos;
+                misses = 0;
+            } else {
+                pos    += 1 + (misses >> kLZ4SkipShift);
+                misses += 1;
+            }
+        }
+    }
+    written = LZ4WriteSequence(dst + out, dstCapacity - out, src + anchor, srcLen - anchor, 0, 0);
+    if (written == 0) {
+        return 0;
+    }
+    return out + written;
+}
+
+extern void EmptyFSImageCompressChunk(
+    uint32_t            blockSize,
+    const void *        src,
+    size_t              srcLen,
+    void *              dst,
+    uint32_t *          compressionPtr,
+    uint32_t *          blockCountPtr
+)
+    // See comment in header.
+{
+    size_t      rawBlocks;
+    size_t      compressedLen;
+    size_t      blocks;
+
+    assert(srcLen != 0);
+
+    // It's only worth storing the chunk compressed if that saves a block, so
+    // that's all the room we give the compressor.
+
+    rawBlocks = (srcLen + blockSize - 1) / blockSize;
+    compressedLen = 0;
+    if (rawBlocks > 1) {
+        compressedLen = LZ4Compress( (const uint8_t *) src, srcLen, (uint8_t *) dst, (rawBlocks - 1) * blockSize);
+    }
+    if (compressedLen != 0) {
+        blocks = (compressedLen + blockSize - 1) / blockSize;
+        memset( ((uint8_t *) dst) + compressedLen, 0, (blocks * blockSize) - compressedLen);
+        *compressionPtr = kEmptyFSCompressionLZ4;
+    } else {
+        blocks = rawBlocks;
+        memcpy(dst, src, srcLen);
+        memset( ((uint8_t *) dst) + srcLen, 0, (blocks * blockSize) - srcLen);
+        *compressionPtr = kEmptyFSCompressionNone;
+    }
+    *blockCountPtr = (uint32_t) blocks;
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Tool Utilities
+
+extern int EmptyFSImageParseSize(const char *str, uint64_t *sizePtr)
+    // See comment in header.
+{
+    int                 err;
+    char *              end;
+    unsigned long long  value;
+    int                 shift;
+
+    err = 0;
+    errno = 0;
+    value = strtoull(str, &end, 0);
+    if ( (errno != 0) || (end == str) ) {
+        err = EINVAL;
+    }
+    if (err == 0) {
+        shift = 0;
+        switch (*end) {
+            case 't': case 'T': shift = 40; end += 1; break;
+            case 'g': case 'G': shift = 30; end += 1; break;
+            case 'm': case 'M': shift = 20; end += 1; break;
+            case 'k': case 'K': shift = 10; end += 1; break;
+            default:                                  break;
+        }
+        if ( (*end != 0) || (value > (UINT64_MAX >> shift)) ) {
+            err = EINVAL;
+        } else {
+            *sizePtr = (uint64_t) value << shift;
+        }
+    }
+    return err;
+}
+
+extern double EmptyFSImageNow(void)
+    // See comment in header.
+{
+    struct timeval  now;
+
+    (void) gettimeofday(&now, NULL);
+    return (double) now.tv_sec + ((double) now.tv_usec / 1000000.0);
+}
+
+extern int EmptyFSImagePReadAll(int fd, void *buf, size_t length, off_t offset)
+    // See comment in header.
+{
+    ssize_t bytesRead;
+
+    while (length != 0) {
+        bytesRead = pread(fd, buf, length, offset);
+        if (bytesRead < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        } else if (bytesRead == 0) {
+            return EIO;                     // read past the end of the file
+        }
+        buf     = ((char *) buf) + bytesRead;
+        length -= (size_t) bytesRead;
+        offset += bytesRead;
+    }
+    return 0;
+}
+
+extern int EmptyFSImagePWriteAll(int fd, const void *buf, size_t length, off_t offset)
+    // See comment in header.
+{
+    ssize_t bytesWritten;
+
+    while (length != 0) {
+        bytesWritten = pwrite(fd, buf, length, offset);
+        if (bytesWritten < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+        buf     = ((const char *) buf) + bytesWritten;
+        length -= (size_t) bytesWritten;
+        offset += bytesWritten;
+    }
+    return 0;
+}
@@ -0,0 +1,310 @@
+/*
+    File:       EmptyFSImage.h
+
+    Contains:   User-space library for building and reading EmptyFS volume images.
+
+    Written by: DTS
+
+    Copyright:  Copyright (c) 2006 by Apple Computer, Inc., All Rights Reserved.
+
+    Disclaimer: IMPORTANT:  This Apple software is supplied to you by Apple Computer, Inc.
+                ("Apple") in consideration of your agreement to the following terms, and your
+                use, installation, modification or redistribution of this Apple software
+                constitutes acceptance of these terms.  If you do not agree with these terms,
+                please do not use, install, modify or redistribute this Apple software.
+
+                In consideration of your agreement to abide by the following terms, and subject
+                to these terms, Apple grants you a personal, non-exclusive license, under Apple's
+                copyrights in this original Apple software (the "Apple Software"), to use,
+                reproduce, modify and redistribute the Apple Software, with or without
+                modifications, in source and/or binary forms; provided that if you redistribute
+                the Apple Software in its entirety and without modifications, you must retain
+                this notice and the following text and disclaimers in all such redistributions of
+                the Apple Software.  Neither the name, trademarks, service marks or logos of
+                Apple Computer, Inc. may be used to endorse or promote products derived from the
+                Apple Software without specific prior written permission from Apple.  Except as
+                expressly stated in this notice, no other rights or licenses, express or implied,
+                are granted by Apple herein, including but not limited to any patent rights that
+                may be infringed by your derivative works or by other works in which the Apple
+                Software may be incorporated.
+
+                The Apple Software is provided by Apple on an "AS IS" basis.  APPLE MAKES NO
+                WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                PURPOSE, REGARDING THE APPLE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                COMBINATION WITH YOUR PRODUCTS.
+
+                IN NO EVENT SHALL APPLE BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                OF THE APPLE SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF APPLE HAS BEEN
+                ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+    Change History (most recent first):
+
+$Log$
+
+*/
+
+#ifndef _EMPTYFSIMAGE_H_
+#define _EMPTYFSIMAGE_H_
+
+// EmptyFSImage is a user-space library for building and reading EmptyFS volumes.
+// It works on anything that supports pread and pwrite: a plain image file (on
+// Mac OS X or Linux) or a raw disk device.  It uses the format definitions and
+// routines from "EmptyFSFormat.h", the same ones that the KEXT uses, so it's a
+// handy way to test the on-disk format without loading the KEXT.
+//
+// The library is deliberately simple.  It's single threaded (an EmptyFSImage
+// must not be used by more than one thread at a time), it allocates space
+// first-fit, and it assumes that nothing else is modifying the volume while
+// it's open.  Changes to file records and data are written immediately; the
+// allocation bitmap and superblock are written by EmptyFSImageFlush (or
+// EmptyFSImageClose).
+//
+// All routines return an errno-style error.  All structures are in host byte
+// order.
+
+#include "EmptyFSFormat.h"
+
+typedef struct EmptyFSImage EmptyFSImage;
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Opening and Closing
+
+extern int  EmptyFSImageCreate(
+    const char *        path,
+    uint64_t            volumeSize,
+    uint32_t            blockSize,
+    uint32_t            fileCount,
+    const char *        volumeName,
+    EmptyFSImage **     imagePtr
+);
+    // Formats a new volume at path, which is created if it doesn't exist.
+    // If path is a regular file, it's truncated to volumeSize bytes; otherwise
+    // volumeSize must not be bigger than the device.  blockSize may be 0,
+    // in which case kEmptyFSDefaultBlockSize is used.  fileCount is the number
+    // of file records in the file table; pass 0 to get a sensible default
+    // based on the size of the volume.  The new volume contains just an empty
+    // root directory and, unless it's tiny, an empty metadata journal.  Only
+    // the first few hundred blocks of a big file table are initialised; see
+    // "Lazy File Table" in "EmptyFSFormat.h".  On success, *imagePtr is an
+    // image open for writing.
+
+extern int  EmptyFSImageLayout(
+    uint64_t            volumeSize,
+    uint32_t            blockSize,
+    uint32_t            fileCount,
+    int                 lazyFileTable,
+    const char *        volumeName,
+    EmptyFSSuperblock * sb
+);
+    // Works out the layout of a new volume, as EmptyFSImageCreate would, and
+    // returns it in *sb (in host byte order) without writing anything.  If
+    // lazyFileTable is false, the whole file table is to be initialised.  The
+    // counts in *sb describe a volume without even a root directory;
+    // EmptyFSImageCreateWithLayout adds that.
+
+extern int  EmptyFSImageCreateWithLayout(int fd, const EmptyFSSuperblock *sb, EmptyFSImage **imagePtr);
+    // Formats a new volume, laid out as *sb says (get it from
+    // EmptyFSImageLayout), on the file or device open for reading and writing
+    // on fd.  The caller must already have made it big enough, and zeroed the
+    // superblock, the bitmap, the initialised part of the file table and the
+    // journal; this lets a tool like newfs_EmptyFS do that in parallel.  This
+    // writes only the handful of blocks that aren't zero.  fd belongs to the
+    // image from then on, and is closed if this fails.  On success, *imagePtr
+    // is an image open for writing.
+
+extern int  EmptyFSImageOpen(const char *path, int writable, EmptyFSImage **imagePtr);
+    // Opens an existing volume.  Fails with EINVAL if the volume isn't an
+    // EmptyFS volume, and ENOTSUP if it's a version we don't understand.
+    // If writable is true and the volume has a journal but wasn't cleanly
+    // unmounted, this replays the journal, just as mounting it would.  And,
+    // again like mounting, opening a volume for writing frees any files on
+    // its orphan list.
+
+extern int  EmptyFSImageFlush(EmptyFSImage *image);
+    // Writes the allocation bitmap and superblock, if they've changed.
+
+extern int  EmptyFSImageClose(EmptyFSImage *image);
+    // Flushes the image (if it's writable) and closes it.  The image is freed
+    // even if the flush fails.
+
+extern const EmptyFSSuperblock * EmptyFSImageGetSuperblock(const EmptyFSImage *image);
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Low-Level Access
+
+extern int  EmptyFSImageReadBlocks (EmptyFSImage *image, uint64_t block, uint64_t count, void *buf);
+extern int  EmptyFSImageWriteBlocks(EmptyFSImage *image, uint64_t block, uint64_t count, const void *buf);
+
+extern int  EmptyFSImageReadFileRecord(EmptyFSImage *image, uint32_t fileNum, EmptyFSFileRecord *rec);
+    // Reads and validates the file record for fileNum.  Returns ENOENT if
+    // the record is free, or EIO if it's corrupt.
+
+extern int  EmptyFSImageWriteFileRecord(EmptyFSImage *image, uint32_t fileNum, const EmptyFSFileRecord *rec);
+
+extern int  EmptyFSImageGetExtents(EmptyFSImage *image, const EmptyFSFileRecord *rec, EmptyFSExtent **extentsPtr);
+    // Returns all of the extents of a file, including those in overflow blocks,
+    // in a malloc'd array of rec->fExtentCount elements.  The caller must free
+    // it.  If the file has no extents, *extentsPtr is set to NULL.
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Reading
+
+typedef int (*EmptyFSImageDirectoryCallback)(
+    void *          refCon,
+    const char *    name,
+    size_t          nameLen,
+    uint32_t        fileNum,
+    uint8_t         type
+);
+    // Called once for each entry in a directory.  name is not null terminated.
+    // Return 0 to continue iterating, or an error to stop (the error is
+    // returned by EmptyFSImageIterateDirectory).
+
+extern int  EmptyFSImageIterateDirectory(
+    EmptyFSImage *                  image,
+    uint32_t                        dirFileNum,
+    EmptyFSImageDirectoryCallback   callback,
+    void *                          refCon
+);
+    // Calls callback for each entry in the directory, in on-disk order.
+
+extern int  EmptyFSImageLookup(EmptyFSImage *image, uint32_t dirFileNum, const char *name, uint32_t *fileNumPtr);
+    // Looks up name in the directory.  Returns ENOENT if it's not there.
+
+extern int  EmptyFSImageReadFile(
+    EmptyFSImage *  image,
+    uint32_t        fileNum,
+    uint64_t        offset,
+    void *          buf,
+    size_t          length,
+    size_t *        actualPtr
+);
+    // Reads up to length bytes from the file, starting at offset.  *actualPtr
+    // is the number of bytes read, which is less than length only if the read
+    // hit the end of the file.  Compressed files are decompressed.
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Writing
+
+extern int  EmptyFSImageAddDirectory(
+    EmptyFSImage *  image,
+    uint32_t        parentFileNum,
+    const char *    name,
+    uint16_t        mode,
+    uint32_t *      fileNumPtr
+);
+    // Creates an empty directory called name in the directory parentFileNum.
+    // mode supplies the permissions (the file type bits are ignored).  Returns
+    // EEXIST if the name is already in use.  fileNumPtr may be NULL.
+
+extern int  EmptyFSImageAddFile(
+    EmptyFSImage *  image,
+    uint32_t        parentFileNum,
+    const char *    name,
+    uint16_t        mode,
+    const void *    data,
+    uint64_t        size,
+    uint32_t *      fileNumPtr
+);
+    // Creates a regular file called name in the directory parentFileNum,
+    // containing size bytes from data.  The file's data is allocated as
+    // contiguously as the free space allows.  Otherwise like
+    // EmptyFSImageAddDirectory.
+
+extern int  EmptyFSImageAllocFileData(
+    EmptyFSImage *      image,
+    uint32_t            fileNum,
+    uint64_t            size,
+    EmptyFSExtent **    extentsPtr,
+    uint32_t *          extentCountPtr
+);
+    // Makes the empty regular file fileNum size bytes long, allocating its
+    // blocks as contiguously as the free space allows, just after the last
+    // blocks that the image allocated, but doesn't write them.  On success,
+    // *extentsPtr is a malloc'd array (which the caller must free) of the
+    // file's *extentCountPtr extents; it's NULL if size is zero.  The caller
+    // must write the data, zero padding the last block, before closing the
+    // image.  This lets a tool like mkimage_EmptyFS lay out many files first
+    // and then write their data with its own threads.
+
+extern int  EmptyFSImageAllocCompressedFileData(
+    EmptyFSImage *      image,
+    uint32_t            fileNum,
+    uint64_t            size,
+    uint32_t            chunkSize,
+    EmptyFSExtent *     extents,
+    uint32_t            extentCount
+);
+    // Like EmptyFSImageAllocFileData, but makes the file a compressed one
+    // (see "Compression" in "EmptyFSFormat.h"), setting the volume's
+    // kEmptyFSIncompatCompression feature if it's not already set.  On
+    // entry, extents has one element per chunk, whose fBlockCount and fFlags
+    // say how the chunk is stored, typically as returned by
+    // EmptyFSImageCompressChunk; extentCount must be the number of chunks.
+    // The routine allocates each extent as a single run of blocks, setting
+    // its fStartBlock.  Returns EINVAL if the extents don't describe a
+    // compressed file of that size.
+
+extern int  EmptyFSImageAllocChunkChecksums(EmptyFSImage *image, uint32_t fileNum);
+    // Gives the compressed file fileNum, whose data is already allocated, a
+    // checksum table (see "Data Checksums" in "EmptyFSFormat.h"), setting the
+    // volume's kEmptyFSROCompatDataChecksums feature if it's not already set.
+    // The table's blocks are allocated just after the file's data, but
+    // they're not written; the caller must do that, with
+    // EmptyFSImageWriteChunkChecksums, before closing the image.
+
+extern int  EmptyFSImageWriteChunkChecksums(EmptyFSImage *image, uint32_t fileNum, const uint32_t *checksums);
+    // Writes the checksum table of fileNum, which must have one from
+    // EmptyFSImageAllocChunkChecksums.  checksums has one element, in host
+    // byte order, per extent: EmptyFSChecksum(0, ...) of the extent's blocks,
+    // exactly as they were written.
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Compression
+
+extern void EmptyFSImageCompressChunk(
+    uint32_t            blockSize,
+    const void *        src,
+    size_t              srcLen,
+    void *              dst,
+    uint32_t *          compressionPtr,
+    uint32_t *          blockCountPtr
+);
+    // Compresses one chunk (srcLen bytes, not zero) of a compressed file with
+    // LZ4, for a volume with the given block size.  If that doesn't save at
+    // least one block, the chunk is stored as is.  On return, dst holds the
+    // *blockCountPtr blocks that belong in the chunk's extent (zero padded),
+    // and *compressionPtr is the kEmptyFSCompressionXxx value for its fFlags.
+    // dst must have room for srcLen rounded up to a whole number of blocks.
+    // Unlike the rest of the library, this routine doesn't use an image, so
+    // any number of threads can call it at once.
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Tool Utilities
+
+// These don't use an image either.  They're here so that the tools that are
+// built on the library don't each need their own copy.
+
+extern int  EmptyFSImageParseSize(const char *str, uint64_t *sizePtr);
+    // Parses a size in bytes, as the tools take it on the command line, with
+    // an optional k, m, g or t suffix (powers of 1024).  Returns EINVAL if
+    // str isn't a size, or if the size doesn't fit in 64 bits.
+
+extern double EmptyFSImageNow(void);
+    // Returns the current time, in seconds, for timing things.
+
+extern int  EmptyFSImagePReadAll(int fd, void *buf, size_t length, off_t offset);
+    // Reads length bytes from fd at offset, as pread does, except that it
+    // keeps going after a short read or EINTR.  Returns EIO if it hits the
+    // end of the file first.
+
+extern int  EmptyFSImagePWriteAll(int fd, const void *buf, size_t length, off_t offset);
+    // Writes length bytes to fd at offset, as pwrite does, except that it
+    // keeps going after a short write or EINTR.
+
+#endif
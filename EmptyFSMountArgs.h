@@ -82,4 +82,14 @@ struct EmptyFSMountArgs {
 };
 typedef struct EmptyFSMountArgs EmptyFSMountArgs;
 
+// Most of fDebugLevel is just a level, but the bits above kEmptyFSDebugLevelMask 
+// change the behaviour of the VFS plug-in.  They exist so that you can compare 
+// the optimised and unoptimised code paths using the same KEXT (or the same 
+// benchmark harness).
+
+enum {
+    kEmptyFSDebugLevelMask      = 0x0000FFFF,
+    kEmptyFSDebugNoFastPaths    = 0x00010000    // always take the locked slow paths
+};
+
 #endif
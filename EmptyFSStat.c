@@ -0,0 +1,591 @@
+/*
+    File:       EmptyFSStat.c
+
+    Contains:   Tool to display EmptyFS operation statistics and traces.
+
+    Written by: DTS
+
+    Copyright:  Copyright (c) 2006 by Apple Computer, Inc., All Rights Reserved.
+
+    Disclaimer: IMPORTANT:  This Apple software is supplied to you by Apple Computer, Inc.
+                ("Apple") in consideration of your agreement to the following terms, and your
+                use, installation, modification or redistribution of this Apple software
+                constitutes acceptance of these terms.  If you do not agree with these terms,
+                please do not use, install, modify or redistribute this Apple software.
+
+                In consideration of your agreement to abide by the following terms, and subject
+                to these terms, Apple grants you a personal, non-exclusive license, under Apple's
+                copyrights in this original Apple software (the "Apple Software"), to use,
+                reproduce, modify and redistribute the Apple Software, with or without
+                modifications, in source and/or binary forms; provided that if you redistribute
+                the Apple Software in its entirety and without modifications, you must retain
+                this notice and the following text and disclaimers in all such redistributions of
+                the Apple Software.  Neither the name, trademarks, service marks or logos of
+                Apple Computer, Inc. may be used to endorse or promote products derived from the
+                Apple Software without specific prior written permission from Apple.  Except as
+                expressly stated in this notice, no other rights or licenses, express or implied,
+                are granted by Apple herein, including but not limited to any patent rights that
+                may be infringed by your derivative works or by other works in which the Apple
+                Software may be incorporated.
+
+                The Apple Software is provided by Apple on an "AS IS" basis.  APPLE MAKES NO
+                WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                PURPOSE, REGARDING THE APPLE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                COMBINATION WITH YOUR PRODUCTS.
+
+                IN NO EVENT SHALL APPLE BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                OF THE APPLE SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF APPLE HAS BEEN
+                ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+    Change History (most recent first):
+
+$Log$
+
+*/
+
+/////////////////////////////////////////////////////////////////////
+
+// This tool displays the per-operation statistics that EmptyFS collects (see 
+// "EmptyFSStats.h").  By default it prints the totals since the KEXT was 
+// loaded.  Other options let you print the statistics for an interval:
+//
+// o -i seconds prints the statistics for each interval of that many seconds 
+//   (like <x-man-page://1/vm_stat>), -c limiting the number of intervals.
+//
+// o -w file saves the current statistics to a file, and -b file prints the 
+//   difference between the current statistics and those saved in the file. 
+//   So you can run "EmptyFSStat -w before", run your test, and then run 
+//   "EmptyFSStat -b before".
+//
+// Collection is disabled when the KEXT loads; use -e to enable it and -x to 
+// disable it (both require super user privileges).
+//
+// -t reads the trace of the operations on volumes that were mounted with a 
+// non-zero debug level (see "Tracing" in "EmptyFSStats.h") and prints a line 
+// for each operation, until you interrupt it with ^C.  With -o file it writes 
+// the raw EmptyFSTraceRecord structures to the file instead, for later replay. 
+// This requires super user privileges.
+
+// System interfaces
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
+#include <mach/mach.h>
+#include <sys/param.h>
+#include <sys/mount.h>
+#include <sys/sysctl.h>
+
+// Statistics definitions shared with kernel
+
+#include "EmptyFSStats.h"
+
+/////////////////////////////////////////////////////////////////////
+
+#define EMPTYFS_STATS_OP_NAME(name) # name,
+
+static const char * kOpNames[kEmptyFSOpCount] = {
+    EMPTYFS_STATS_OP_LIST(EMPTYFS_STATS_OP_NAME)
+};
+
+static const char * kCounterNames[kEmptyFSCounterCount] = {
+    EMPTYFS_STATS_COUNTER_LIST(EMPTYFS_STATS_OP_NAME)
+};
+
+#undef EMPTYFS_STATS_OP_NAME
+
+static int Sysctl(int selector, void *oldp, size_t *oldlenp, void *newp, size_t newlen)
+    // Calls sysctl for { CTL_VFS, <EmptyFS type number>, selector }.
+{
+    int             err;
+    struct vfsconf  vfc;
+    int             mib[3];
+
+    err = 0;
+    if ( getvfsbyname("EmptyFS", &vfc) < 0 ) {
+        err = errno;
+        if (err == ENOENT) {
+            fprintf(stderr, "EmptyFS is not loaded\n");
+        }
+    }
+    if (err == 0) {
+        mib[0] = CTL_VFS;
+        mib[1] = vfc.vfc_typenum;
+        mib[2] = selector;
+        if ( sysctl(mib, 3, oldp, oldlenp, newp, newlen) < 0 ) {
+            err = errno;
+        }
+    }
+    return err;
+}
+
+static int GetStats(EmptyFSStats *stats)
+    // Gets the current statistics from the kernel, checking that they're 
+    // the version that we understand.
+{
+    int     err;
+    size_t  len;
+
+    len = sizeof(*stats);
+    err = Sysctl(kEmptyFSSysctlStats, stats, &len, NULL, 0);
+    if ( (err == 0) && (     (len != sizeof(*stats)) 
+                          || (stats->fVersion != kEmptyFSStatsVersion) 
+                          || (stats->fOpCount != kEmptyFSOpCount) 
+                          || (stats->fBucketCount != kEmptyFSStatsBucketCount) 
+                          || (stats->fCounterCount != kEmptyFSCounterCount) ) ) {
+        fprintf(stderr, "the loaded EmptyFS doesn't match this tool\n");
+        err = EINVAL;
+    }
+    return err;
+}
+
+static int SetEnabled(int enabled)
+{
+    return Sysctl(kEmptyFSSysctlStatsEnable, NULL, NULL, &enabled, sizeof(enabled));
+}
+
+static int ReadStatsFile(const char *path, EmptyFSStats *stats)
+    // Reads statistics saved by WriteStatsFile.
+{
+    int     err;
+    FILE *  f;
+
+    err = 0;
+    f = fopen(path, "r");
+    if (f == NULL) {
+        err = errno;
+    } else {
+        if ( fread(stats, sizeof(*stats), 1, f) != 1 ) {
+            err = EINVAL;
+        } else if (    (stats->fVersion != kEmptyFSStatsVersion) 
+                    || (stats->fOpCount != kEmptyFSOpCount) 
+                    || (stats->fBucketCount != kEmptyFSStatsBucketCount) 
+                    || (stats->fCounterCount != kEmptyFSCounterCount) ) {
+            err = EINVAL;
+        }
+        (void) fclose(f);
+    }
+    return err;
+}
+
+static int WriteStatsFile(const char *path, const EmptyFSStats *stats)
+    // Saves stats to a file, for a later invocation of the tool to 
+    // subtract (the -b option).  The file is only meaningful on the 
+    // machine that wrote it.
+{
+    int     err;
+    FILE *  f;
+
+    err = 0;
+    f = fopen(path, "w");
+    if (f == NULL) {
+        err = errno;
+    } else {
+        if ( fwrite(stats, sizeof(*stats), 1, f) != 1 ) {
+            err = errno;
+        }
+        if ( fclose(f) != 0 ) {
+            if (err == 0) {
+                err = errno;
+            }
+        }
+    }
+    return err;
+}
+
+static void SubtractStats(EmptyFSStats *result, const EmptyFSStats *now, const EmptyFSStats *then)
+    // Sets result to the statistics for the interval between then and now.
+{
+    uint32_t    op;
+    uint32_t    bucket;
+    uint32_t    counter;
+
+    *result = *now;
+    for (op = 0; op < kEmptyFSOpCount; op++) {
+        result->fOps[op].fCount     -= then->fOps[op].fCount;
+        result->fOps[op].fErrors    -= then->fOps[op].fErrors;
+        result->fOps[op].fTotalTime -= then->fOps[op].fTotalTime;
+        for (bucket = 0; bucket < kEmptyFSStatsBucketCount; bucket++) {
+            result->fOps[op].fHistogram[bucket] -= then->fOps[op].fHistogram[bucket];
+        }
+    }
+    for (counter = 0; counter < kEmptyFSCounterCount; counter++) {
+        result->fCounters[counter] -= then->fCounters[counter];
+    }
+}
+
+static uint64_t Percentile(const EmptyFSOpStats *opStats, uint64_t permille)
+    // Returns an upper bound, in ns, on the permille'th permille of the 
+    // calls described by opStats.  We only know which histogram bucket 
+    // each call fell into, so this is the upper bound of that bucket.
+{
+    uint64_t    target;
+    uint64_t    seen;
+    uint32_t    bucket;
+
+    target = ((opStats->fCount * permille) + 999) / 1000;
+    seen = 0;
+    for (bucket = 0; bucket < (kEmptyFSStatsBucketCount - 1); bucket++) {
+        seen += opStats->fHistogram[bucket];
+        if (seen >= target) {
+            break;
+        }
+    }
+    return ((uint64_t) 1) << (bucket + 1);
+}
+
+static void PrintStats(const EmptyFSStats *stats, int printHistograms)
+    // Prints a line for each operation that was called at least once, and 
+    // optionally its histogram, and then a line for each non-zero counter.
+{
+    uint32_t                op;
+    uint32_t                bucket;
+    uint32_t                counter;
+    int                     printedHeader;
+    const EmptyFSOpStats *  opStats;
+
+    printf("%-16s %12s %10s %10s %10s %10s %10s\n", 
+        "operation", "calls", "errors", "mean ns", "p50 ns <=", "p90 ns <=", "p99 ns <="
+    );
+    for (op = 0; op < kEmptyFSOpCount; op++) {
+        opStats = &stats->fOps[op];
+        if (opStats->fCount != 0) {
+            printf("%-16s %12llu %10llu %10llu %10llu %10llu %10llu\n", 
+                kOpNames[op], 
+                (unsigned long long) opStats->fCount, 
+                (unsigned long long) opStats->fErrors, 
+                (unsigned long long) (opStats->fTotalTime / opStats->fCount), 
+                (unsigned long long) Percentile(opStats, 500), 
+                (unsigned long long) Percentile(opStats, 900), 
+                (unsigned long long) Percentile(opStats, 990)
+            );
+            if (printHistograms) {
+                for (bucket = 0; bucket < kEmptyFSStatsBucketCount; bucket++) {
+                    if (opStats->fHistogram[bucket] != 0) {
+                        printf("    %12llu ns <= t < %12llu ns: %12llu\n", 
+                            (unsigned long long) ((bucket == 0) ? 0 : (((uint64_t) 1) << bucket)), 
+                            (unsigned long long) (((uint64_t) 1) << (bucket + 1)), 
+                            (unsigned long long) opStats->fHistogram[bucket]
+                        );
+                    }
+                }
+            }
+        }
+    }
+    printedHeader = FALSE;
+    for (counter = 0; counter < kEmptyFSCounterCount; counter++) {
+        if (stats->fCounters[counter] != 0) {
+            if ( ! printedHeader ) {
+                printf("\n%-20s %12s\n", "counter", "count");
+                printedHeader = TRUE;
+            }
+            printf("%-20s %12llu\n", kCounterNames[counter], (unsigned long long) stats->fCounters[counter]);
+        }
+    }
+    if ( ! stats->fEnabled ) {
+        printf("(collection is disabled; use -e to enable it)\n");
+    }
+}
+
+static volatile sig_atomic_t gTraceStop = FALSE;
+
+static void TraceSignalHandler(int signum)
+    // Tells ReadTrace to finish up.
+{
+    #pragma unused(signum)
+    gTraceStop = TRUE;
+}
+
+static int CompareTraceRecords(const void *left, const void *right)
+    // qsort callback to sort trace records by start time.
+{
+    const EmptyFSTraceRecord *  l;
+    const EmptyFSTraceRecord *  r;
+
+    l = (const EmptyFSTraceRecord *) left;
+    r = (const EmptyFSTraceRecord *) right;
+    if (l->fTime < r->fTime) {
+        return -1;
+    } else if (l->fTime > r->fTime) {
+        return 1;
+    }
+    return 0;
+}
+
+static void PrintTraceRecord(const EmptyFSTraceRecord *record)
+    // Prints a line describing record.  See "EmptyFSStats.h" for the 
+    // meaning of fArg0 and fArg1.
+{
+    printf("%20llu %3u %-16s %08x %10llu %18llx %12llu %10u %4d %s\n", 
+        (unsigned long long) record->fTime, 
+        (unsigned int) record->fCPU, 
+        (record->fOp < kEmptyFSOpCount) ? kOpNames[record->fOp] : "?", 
+        (unsigned int) record->fDevice, 
+        (unsigned long long) record->fFileNum, 
+        (unsigned long long) record->fArg0, 
+        (unsigned long long) record->fArg1, 
+        (unsigned int) record->fDuration, 
+        (int) record->fError, 
+        record->fName
+    );
+}
+
+static int ReadTrace(const char *outputPath)
+    // Reads the trace until interrupted, printing each record or, if 
+    // outputPath isn't NULL, writing it to that file.  Each read returns 
+    // the records that have accumulated in the kernel since the last one; 
+    // when there aren't any, we wait a little before trying again.
+{
+    int                     err;
+    FILE *                  f;
+    EmptyFSTraceHeader *    header;
+    EmptyFSTraceRecord *    records;
+    size_t                  len;
+    boolean_t               stopping;
+    unsigned long long      totalRecords;
+    unsigned long long      totalDropped;
+
+    err = 0;
+    f = NULL;
+    totalRecords = 0;
+    totalDropped = 0;
+    
+    header = (EmptyFSTraceHeader *) malloc(kEmptyFSTraceMaxReadSize);
+    if (header == NULL) {
+        err = ENOMEM;
+    }
+    if ( (err == 0) && (outputPath != NULL) ) {
+        f = fopen(outputPath, "w");
+        if (f == NULL) {
+            err = errno;
+        }
+    }
+    if (err == 0) {
+        (void) signal(SIGINT, TraceSignalHandler);
+        if (f == NULL) {
+            printf("%20s %3s %-16s %8s %10s %18s %12s %10s %4s %s\n", 
+                "time ns", "cpu", "operation", "device", "file", "arg0", "arg1", "ns", "err", "name"
+            );
+        }
+    }
+
+    // Once we've been interrupted, keep reading until the trace is empty.
+    
+    stopping = FALSE;
+    records = (EmptyFSTraceRecord *) (header + 1);
+    while (err == 0) {
+        len = kEmptyFSTraceMaxReadSize;
+        err = Sysctl(kEmptyFSSysctlTrace, header, &len, NULL, 0);
+        if ( (err == 0) && ( (header->fVersion != kEmptyFSTraceVersion) || (header->fRecordSize != sizeof(EmptyFSTraceRecord)) ) ) {
+            fprintf(stderr, "the loaded EmptyFS doesn't match this tool\n");
+            err = EINVAL;
+        }
+        if (err == 0) {
+            totalRecords += header->fRecordCount;
+            totalDropped += header->fDropped;
+            if (header->fDropped != 0) {
+                fprintf(stderr, "%llu records dropped\n", (unsigned long long) header->fDropped);
+            }
+            
+            if (f != NULL) {
+                if ( fwrite(records, sizeof(*records), header->fRecordCount, f) != header->fRecordCount ) {
+                    err = errno;
+                }
+            } else {
+                uint32_t    recordIndex;
+                
+                // The records from different CPUs are interleaved.
+                
+                qsort(records, header->fRecordCount, sizeof(*records), CompareTraceRecords);
+                for (recordIndex = 0; recordIndex < header->fRecordCount; recordIndex++) {
+                    PrintTraceRecord(&records[recordIndex]);
+                }
+                (void) fflush(stdout);
+            }
+        }
+        if ( (err == 0) && (header->fRecordCount == 0) ) {
+            if (stopping) {
+                break;
+            }
+            stopping = gTraceStop;
+            if ( ! stopping ) {
+                (void) usleep(10000);
+            }
+        }
+    }
+    if (f != NULL) {
+        if ( (fclose(f) != 0) && (err == 0) ) {
+            err = errno;
+        }
+    }
+    if (err == 0) {
+        fprintf(stderr, "%llu records, %llu dropped\n", totalRecords, totalDropped);
+    }
+    free(header);
+    
+    return err;
+}
+
+static void PrintUsage(const char *argv0)
+    // Print a helpful help message.
+{
+    const char *    progName;
+    
+    progName = strrchr(argv0, '/');
+    if (progName == NULL) {
+        progName = argv0;
+    } else {
+        progName += 1;
+    }
+    fprintf(stderr, "usage: %s [ -e | -x ] [ -H ] [ -w file ] [ -b file | -i seconds [ -c count ] ]\n", progName);
+    fprintf(stderr, "       %s -t [ -o file ]\n", progName);
+}
+
+extern int main(int argc, char **argv)
+{
+    int             err;
+    int             retVal;
+    int             ch;
+    int             enable;
+    int             printHistograms;
+    const char *    baselinePath;
+    const char *    savePath;
+    int             trace;
+    const char *    tracePath;
+    long            interval;
+    long            count;
+    long            iteration;
+    EmptyFSStats    then;
+    EmptyFSStats    now;
+    EmptyFSStats    delta;
+
+    // Parse command line options.
+
+    enable          = -1;
+    printHistograms = FALSE;
+    baselinePath    = NULL;
+    savePath        = NULL;
+    trace           = FALSE;
+    tracePath       = NULL;
+    interval        = 0;
+    count           = 0;
+
+    retVal = EXIT_SUCCESS;
+    do {
+        ch = getopt(argc, argv, "b:c:eHi:o:tw:x");
+        if (ch != -1) {
+            switch (ch) {
+                case 'b':
+                    baselinePath = optarg;
+                    break;
+                case 'c':
+                    count = strtol(optarg, NULL, 0);
+                    break;
+                case 'e':
+                    enable = TRUE;
+                    break;
+                case 'H':
+                    printHistograms = TRUE;
+                    break;
+                case 'i':
+                    interval = strtol(optarg, NULL, 0);
+                    break;
+                case 'o':
+                    tracePath = optarg;
+                    break;
+                case 't':
+                    trace = TRUE;
+                    break;
+                case 'w':
+                    savePath = optarg;
+                    break;
+                case 'x':
+                    enable = FALSE;
+                    break;
+                case '?':
+                default:
+                    PrintUsage(argv[0]);
+                    retVal = EXIT_FAILURE;
+                    break;
+            }
+        }
+    } while ( (ch != -1) && (retVal == EXIT_SUCCESS) );
+
+    if (    (retVal == EXIT_SUCCESS) 
+         && (    (optind != argc) 
+              || (interval < 0) 
+              || (count < 0) 
+              || ( (count != 0) && (interval == 0) ) 
+              || ( (baselinePath != NULL) && (interval != 0) ) 
+              || ( (tracePath != NULL) && ! trace ) 
+              || ( trace && ( (enable != -1) || printHistograms || (baselinePath != NULL) || (savePath != NULL) || (interval != 0) ) ) ) ) {
+        PrintUsage(argv[0]);
+        retVal = EXIT_FAILURE;
+    }
+
+    // Enable or disable collection, if requested.
+    
+    err = 0;
+    if ( (retVal == EXIT_SUCCESS) && (enable != -1) ) {
+        err = SetEnabled(enable);
+    }
+
+    // In trace mode, that's all we do.
+    
+    if ( (retVal == EXIT_SUCCESS) && (err == 0) && trace ) {
+        err = ReadTrace(tracePath);
+    }
+
+    // Get the current statistics and print them, either as is or relative 
+    // to the baseline.
+
+    if ( (retVal == EXIT_SUCCESS) && (err == 0) && ! trace ) {
+        err = GetStats(&now);
+    }
+    if ( (retVal == EXIT_SUCCESS) && (err == 0) && (baselinePath != NULL) ) {
+        err = ReadStatsFile(baselinePath, &then);
+        if (err == 0) {
+            SubtractStats(&delta, &now, &then);
+            PrintStats(&delta, printHistograms);
+        }
+    } else if ( (retVal == EXIT_SUCCESS) && (err == 0) && ! trace && (savePath == NULL) && (interval == 0) ) {
+        PrintStats(&now, printHistograms);
+    }
+    if ( (retVal == EXIT_SUCCESS) && (err == 0) && (savePath != NULL) ) {
+        err = WriteStatsFile(savePath, &now);
+    }
+
+    // If requested, print the statistics for each interval.
+    
+    for (iteration = 0; (retVal == EXIT_SUCCESS) && (err == 0) && (interval != 0) && ( (count == 0) || (iteration < count) ); iteration++) {
+        then = now;
+        (void) sleep( (unsigned int) interval );
+        err = GetStats(&now);
+        if (err == 0) {
+            SubtractStats(&delta, &now, &then);
+            if (iteration != 0) {
+                printf("\n");
+            }
+            PrintStats(&delta, printHistograms);
+            (void) fflush(stdout);
+        }
+    }
+    
+    if ( (retVal == EXIT_SUCCESS) && (err != 0) ) {
+        errno = err;
+        perror(NULL);
+        retVal = EXIT_FAILURE;
+    }
+    
+    return retVal;
+}
@@ -0,0 +1,287 @@
+/*
+    File:       EmptyFSStats.h
+
+    Contains:   Operation statistics and tracing shared between EmptyFS and its tools.
+
+    Written by: DTS
+
+    Copyright:  Copyright (c) 2006 by Apple Computer, Inc., All Rights Reserved.
+
+    Disclaimer: IMPORTANT:  This Apple software is supplied to you by Apple Computer, Inc.
+                ("Apple") in consideration of your agreement to the following terms, and your
+                use, installation, modification or redistribution of this Apple software
+                constitutes acceptance of these terms.  If you do not agree with these terms,
+                please do not use, install, modify or redistribute this Apple software.
+
+                In consideration of your agreement to abide by the following terms, and subject
+                to these terms, Apple grants you a personal, non-exclusive license, under Apple's
+                copyrights in this original Apple software (the "Apple Software"), to use,
+                reproduce, modify and redistribute the Apple Software, with or without
+                modifications, in source and/or binary forms; provided that if you redistribute
+                the Apple Software in its entirety and without modifications, you must retain
+                this notice and the following text and disclaimers in all such redistributions of
+                the Apple Software.  Neither the name, trademarks, service marks or logos of
+                Apple Computer, Inc. may be used to endorse or promote products derived from the
+                Apple Software without specific prior written permission from Apple.  Except as
+                expressly stated in this notice, no other rights or licenses, express or implied,
+                are granted by Apple herein, including but not limited to any patent rights that
+                may be infringed by your derivative works or by other works in which the Apple
+                Software may be incorporated.
+
+                The Apple Software is provided by Apple on an "AS IS" basis.  APPLE MAKES NO
+                WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                PURPOSE, REGARDING THE APPLE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                COMBINATION WITH YOUR PRODUCTS.
+
+                IN NO EVENT SHALL APPLE BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                OF THE APPLE SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF APPLE HAS BEEN
+                ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+    Change History (most recent first):
+
+$Log$
+
+*/
+
+#ifndef _EMPTYFSSTATS_H_
+#define _EMPTYFSSTATS_H_
+
+#include <stdint.h>
+
+// EmptyFS counts the calls to each of its vnode and VFS operations, and keeps 
+// a histogram of how long they took.  The statistics are global to the KEXT 
+// (they're not per volume), and are collected per CPU so that collecting them 
+// doesn't cause cache line contention.  They're only collected while enabled; 
+// when disabled, the cost is one load and branch per operation.
+//
+// You get at the statistics using <x-man-page://3/sysctl> with the name 
+// { CTL_VFS, <type number>, <selector> }, where <type number> is the 
+// vfc_typenum returned by <x-man-page://3/getvfsbyname> for "EmptyFS" and 
+// <selector> is one of the following:
+//
+// o kEmptyFSSysctlStats -- Read only.  Returns an EmptyFSStats structure, 
+//   which is the sum of the statistics across all CPUs.
+//
+// o kEmptyFSSysctlStatsEnable -- Read/write.  An int that's non-zero if 
+//   statistics collection is enabled.  Setting it requires super user 
+//   privileges.  Collection is disabled when the KEXT is loaded.
+//
+// o kEmptyFSSysctlTrace -- Read only, super user only.  Removes records from 
+//   the trace buffer; see "Tracing", below.
+//
+// The counters are never reset; tools that want per-interval numbers take 
+// two snapshots and subtract (see "EmptyFSStat.c").
+//
+// IMPORTANT:
+// These structures are passed between the kernel and user space, so they 
+// must have the same layout for 32- and 64-bit clients.  That's why they're 
+// made entirely of fixed-size types.
+
+enum {
+    kEmptyFSSysctlStats         = 1,
+    kEmptyFSSysctlStatsEnable   = 2,
+    kEmptyFSSysctlTrace         = 3
+};
+
+// EMPTYFS_STATS_OP_LIST lists the operations that we collect statistics 
+// for, in the order that they appear in EmptyFSStats.fOps.  Each entry is 
+// the name of the routine in "EmptyFS.c" that implements the operation.
+
+#define EMPTYFS_STATS_OP_LIST(X) \
+    X(VFSOPRoot)        \
+    X(VFSOPGetattr)     \
+    X(VFSOPVget)        \
+    X(VFSOPFhtovp)      \
+    X(VFSOPVptofh)      \
+    X(VNOPLookup)       \
+    X(VNOPOpen)         \
+    X(VNOPClose)        \
+    X(VNOPGetattr)      \
+    X(VNOPRead)         \
+    X(VNOPReadDir)      \
+    X(VNOPReaddirattr)  \
+    X(VNOPBlockmap)     \
+    X(VNOPStrategy)     \
+    X(VNOPPagein)       \
+    X(VNOPMmap)         \
+    X(VNOPMnomap)       \
+    X(VNOPReclaim)      \
+    X(VNOPWrite)        \
+    X(VNOPCreate)       \
+    X(VNOPRemove)       \
+    X(VNOPSetattr)      \
+    X(VNOPFsync)        \
+    X(VNOPInactive)     \
+    X(VFSOPSync)        \
+    X(VNOPAllocate)
+
+#define EMPTYFS_STATS_OP_ENUM(name) kEmptyFSOp ## name,
+
+enum {
+    EMPTYFS_STATS_OP_LIST(EMPTYFS_STATS_OP_ENUM)
+    kEmptyFSOpCount
+};
+
+#undef EMPTYFS_STATS_OP_ENUM
+
+// EMPTYFS_STATS_COUNTER_LIST lists the event counters, in the order that 
+// they appear in EmptyFSStats.fCounters.  Unlike the operations, these 
+// count things that happen inside operations, and have no timing.
+//
+// o DecompCacheHit -- A read or page-in of a compressed file found the 
+//   chunk it needed already decompressed (see "Decompression Cache" in 
+//   "EmptyFS.c").
+//
+// o DecompCacheMiss -- It didn't, so the chunk was read and decompressed.
+//
+// o DecompCacheEvict -- A decompressed chunk was thrown out of the cache to 
+//   make room for another.
+//
+// o DecompBytes -- The number of bytes that were decompressed.
+//
+// o MetaChecksumVerify -- A metadata block was read from the disk, rather 
+//   than found in the buffer cache, and its checksums were checked (see 
+//   "Metadata Checksums" in "EmptyFSFormat.h").
+//
+// o MetaChecksumError -- The check failed, so the read failed with EIO.
+//
+// o DataChecksumVerify -- A chunk of a compressed file was checked against 
+//   the file's checksum table before being decompressed (see "Data 
+//   Checksums" in "EmptyFSFormat.h").
+//
+// o DataChecksumError -- The check failed, so the read failed with EIO.
+
+#define EMPTYFS_STATS_COUNTER_LIST(X) \
+    X(DecompCacheHit)     \
+    X(DecompCacheMiss)    \
+    X(DecompCacheEvict)   \
+    X(DecompBytes)        \
+    X(MetaChecksumVerify) \
+    X(MetaChecksumError)  \
+    X(DataChecksumVerify) \
+    X(DataChecksumError)
+
+#define EMPTYFS_STATS_COUNTER_ENUM(name) kEmptyFSCounter ## name,
+
+enum {
+    EMPTYFS_STATS_COUNTER_LIST(EMPTYFS_STATS_COUNTER_ENUM)
+    kEmptyFSCounterCount
+};
+
+#undef EMPTYFS_STATS_COUNTER_ENUM
+
+// Histogram bucket N counts the calls that took at least 2^N ns, and less 
+// than 2^(N+1) ns.  Bucket 0 also counts calls that took no time at all, and 
+// the last bucket also counts everything that took longer than it covers 
+// (2^31 ns is about 2 seconds).
+
+enum {
+    kEmptyFSStatsBucketCount    = 32,
+    kEmptyFSStatsVersion        = 5
+};
+
+struct EmptyFSOpStats {
+    uint64_t    fCount;                 // number of calls
+    uint64_t    fErrors;                // number of calls that returned a non-zero error
+    uint64_t    fTotalTime;             // total time spent in those calls, in ns
+    uint64_t    fHistogram[kEmptyFSStatsBucketCount];
+};
+typedef struct EmptyFSOpStats EmptyFSOpStats;
+
+struct EmptyFSStats {
+    uint32_t        fVersion;           // kEmptyFSStatsVersion
+    uint32_t        fOpCount;           // kEmptyFSOpCount
+    uint32_t        fBucketCount;       // kEmptyFSStatsBucketCount
+    uint32_t        fEnabled;           // non-zero if collection is currently enabled
+    uint32_t        fCounterCount;      // kEmptyFSCounterCount
+    uint32_t        fReserved;          // zero
+    EmptyFSOpStats  fOps[kEmptyFSOpCount];
+    uint64_t        fCounters[kEmptyFSCounterCount];
+};
+typedef struct EmptyFSStats EmptyFSStats;
+
+// Tracing
+// -------
+// If a volume is mounted with a non-zero debug level (the mount tool's -d 
+// option; see kEmptyFSDebugLevelMask in "EmptyFSMountArgs.h"), EmptyFS also 
+// records each of the above operations on that volume in a trace buffer. 
+// This lets you capture the access pattern of a real workload, for example 
+// to replay it later.  The buffer is a ring per CPU, and recording an 
+// operation doesn't take any locks, so tracing is cheap enough to leave on 
+// for a while.  However, if no one reads the records, they're overwritten.
+//
+// Reading kEmptyFSSysctlTrace returns an EmptyFSTraceHeader followed by 
+// fRecordCount EmptyFSTraceRecord structures, and removes those records 
+// from the buffer.  A single read returns at most kEmptyFSTraceMaxRecords 
+// records, so readers should use a buffer of kEmptyFSTraceMaxReadSize bytes 
+// and read repeatedly (see the -t option of "EmptyFSStat.c").  The records 
+// from different CPUs are interleaved, so sort them by fTime if the order 
+// matters.  Reading requires super user privileges because the records 
+// include file names.
+//
+// The meaning of fArg0 and fArg1 depends on the operation:
+//
+//  operation           fArg0                   fArg1
+//  ---------           -----                   -----
+//  VFSOPGetattr        f_active                -
+//  VFSOPFhtovp         handle generation       -
+//  VNOPLookup          file number found       cn_nameiop
+//  VNOPOpen            a_mode                  -
+//  VNOPClose           a_fflag                 -
+//  VNOPGetattr         va_active               -
+//  VNOPRead            offset                  bytes requested
+//  VNOPReadDir         cookie                  entries returned
+//  VNOPReaddirattr     cookie                  entries returned
+//  VNOPBlockmap        offset                  bytes requested
+//  VNOPStrategy        logical block number    bytes requested
+//  VNOPPagein          offset                  bytes requested
+//  VNOPMmap            a_fflags                -
+//  VNOPWrite           offset                  bytes requested
+//  VNOPCreate          file number created     -
+//  VNOPRemove          file number removed     -
+//  VNOPSetattr         va_active               new size, if va_data_size is active
+//  VNOPFsync           a_waitfor               -
+//  VFSOPSync           waitfor                 files flushed
+//  VNOPAllocate        a_length                bytes allocated
+//
+// Fields marked "-", and both fields of any operation not listed, are zero.
+
+enum {
+    kEmptyFSTraceVersion        = 1,
+    kEmptyFSTraceNameSize       = 16,
+    kEmptyFSTraceMaxRecords     = 1024
+};
+
+struct EmptyFSTraceRecord {
+    uint64_t    fTime;                  // when the operation started, in ns (mach_absolute_time, converted)
+    uint64_t    fFileNum;               // file number of the vnode (the directory, for lookups, creates and removes), or 0
+    uint64_t    fArg0;                  // see above
+    uint64_t    fArg1;                  // see above
+    uint32_t    fDuration;              // how long the operation took, in ns; saturates at 0xFFFFFFFF
+    int32_t     fError;                 // errno returned by the operation
+    uint32_t    fDevice;                // dev_t of the volume
+    uint16_t    fOp;                    // kEmptyFSOpXxx
+    uint16_t    fCPU;                   // CPU that recorded the operation
+    char        fName[kEmptyFSTraceNameSize];   // lookups, creates and removes: the name, truncated and null terminated
+};
+typedef struct EmptyFSTraceRecord EmptyFSTraceRecord;
+
+struct EmptyFSTraceHeader {
+    uint32_t    fVersion;               // kEmptyFSTraceVersion
+    uint32_t    fRecordSize;            // sizeof(EmptyFSTraceRecord)
+    uint32_t    fRecordCount;           // number of records that follow the header
+    uint32_t    fReserved;              // zero
+    uint64_t    fDropped;               // records overwritten before anyone read them, since the last read
+};
+typedef struct EmptyFSTraceHeader EmptyFSTraceHeader;
+
+enum {
+    kEmptyFSTraceMaxReadSize = sizeof(EmptyFSTraceHeader) + (kEmptyFSTraceMaxRecords * sizeof(EmptyFSTraceRecord))
+};
+
+#endif
@@ -0,0 +1,4023 @@
+/*
+    File:       EmptyFSUserKPI.c
+
+    Contains:   User-space stand-ins for the kernel KPIs used by EmptyFS.
+
+    Written by: DTS
+
+    Copyright:  Copyright (c) 2006 by Apple Computer, Inc., All Rights Reserved.
+
+    Disclaimer: IMPORTANT:  This Apple software is supplied to you by Apple Computer, Inc.
+                ("Apple") in consideration of your agreement to the following terms, and your
+                use, installation, modification or redistribution of this Apple software
+                constitutes acceptance of these terms.  If you do not agree with these terms,
+                please do not use, install, modify or redistribute this Apple software.
+
+                In consideration of your agreement to abide by the following terms, and subject
+                to these terms, Apple grants you a personal, non-exclusive license, under Apple's
+                copyrights in this original Apple software (the "Apple Software"), to use,
+                reproduce, modify and redistribute the Apple Software, with or without
+                modifications, in source and/or binary forms; provided that if you redistribute
+                the Apple Software in its entirety and without modifications, you must retain
+                this notice and the following text and disclaimers in all such redistributions of
+                the Apple Software.  Neither the name, trademarks, service marks or logos of
+                Apple Computer, Inc. may be used to endorse or promote products derived from the
+                Apple Software without specific prior written permission from Apple.  Except as
+                expressly stated in this notice, no other rights or licenses, express or implied,
+                are granted by Apple herein, including but not limited to any patent rights that
+                may be infringed by your derivative works or by other works in which the Apple
+                Software may be incorporated.
+
+                The Apple Software is provided by Apple on an "AS IS" basis.  APPLE MAKES NO
+                WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                PURPOSE, REGARDING THE APPLE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                COMBINATION WITH YOUR PRODUCTS.
+
+                IN NO EVENT SHALL APPLE BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                OF THE APPLE SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF APPLE HAS BEEN
+                ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+    Change History (most recent first):
+
+$Log$
+
+*/
+
+/////////////////////////////////////////////////////////////////////
+
+// glibc only declares sched_getcpu (used by cpu_number) if _GNU_SOURCE is set.
+
+#if defined(__linux__) && ! defined(_GNU_SOURCE)
+    #define _GNU_SOURCE 1
+#endif
+
+#include "EmptyFSUserKPI.h"
+
+#include <sched.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Shim Notes
+
+/*
+    This file implements, in user space, the subset of the KPI that EmptyFS
+    uses.  The goal is fidelity where it affects the behaviour of the VFS
+    plug-in, and simplicity everywhere else.  Specifically:
+
+      o Vnodes have an I/O count, a use count, a vnode ID (vid) and an
+        FS reference, with the same semantics as the kernel.  Unused vnodes
+        are kept on an LRU list and recycled (VNOPReclaim is called, and the
+        vid incremented) once there are more than gDesiredVNodes of them.
+        Vnode memory is never freed, so it's safe to call vnode_getwithvid
+        on a stale vnode, just like it is in the kernel.
+
+      o Locks are pthread mutexes and read/write locks.  msleep/wakeup are 
+        implemented with a single condition variable; wakeup wakes everyone, 
+        which is legal (msleep callers must always recheck their condition). 
+        Kernel threads are detached pthreads.
+
+      o All addresses are in the same address space, so copyin and copyout
+        are just memcpy, and user_addr_t is just a pointer.
+
+      o Device vnodes are backed by a file descriptor.  The buffer cache
+        reads from it with pread and caches whole buffers.  Delayed writes 
+        (buf_bdwrite) are written when the buffer is evicted or flushed.
+
+      o File data is cached in the UBC, a hash of pages keyed by vnode and
+        page index.  cluster_read fills missing pages by building a UPL of 
+        busy pages, asking the file system to map the file (VNOPBlockmap), 
+        and then passing one buffer per contiguous run to its VNOPStrategy; 
+        the device reads straight into the pages.  There's no read-ahead; 
+        that's the file system's problem.  cluster_write dirties pages, and 
+        cluster_push writes them in the same way, from the pages to the 
+        device.  There's no pageout daemon, so dirty pages stay in memory 
+        until the file system pushes them.  A vnode's pages are thrown away 
+        when it's reclaimed.
+
+      o Memory mapping is simulated.  A mapping is just a table of pointers 
+        to (pinned) UBC pages, so mapped access shares the cache with read 
+        and never copies.  A fault on a page that isn't in the cache builds 
+        a UPL and calls VNOPPagein, just like the kernel's vnode pager.
+*/
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Asserts
+
+extern void UserKPIAssertFailed(const char *file, int line, const char *expr)
+{
+    fprintf(stderr, "%s:%d: failed assertion `%s'\n", file, line, expr);
+    abort();
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Memory
+
+struct UserKPIMallocTag {
+    char    fName[64];
+};
+
+extern OSMallocTag OSMalloc_Tagalloc(const char *name, uint32_t flags)
+{
+    OSMallocTag tag;
+
+    (void) flags;
+    tag = calloc(1, sizeof(*tag));
+    if (tag != NULL) {
+        strncpy(tag->fName, name, sizeof(tag->fName) - 1);
+    }
+    return tag;
+}
+
+extern void OSMalloc_Tagfree(OSMallocTag tag)
+{
+    free(tag);
+}
+
+extern void * OSMalloc(uint32_t size, OSMallocTag tag)
+{
+    assert(tag != NULL);
+    return malloc(size);
+}
+
+extern void * OSMalloc_noblock(uint32_t size, OSMallocTag tag)
+{
+    return OSMalloc(size, tag);
+}
+
+extern void OSFree(void *addr, uint32_t size, OSMallocTag tag)
+{
+    (void) size;
+    assert(tag != NULL);
+    free(addr);
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Locks
+
+struct UserKPILockGroup {
+    char                fName[64];
+};
+
+struct UserKPIMutex {
+    pthread_mutex_t     fMutex;
+    pthread_t           fOwner;
+    boolean_t           fOwned;
+};
+
+struct UserKPIRWLock {
+    pthread_rwlock_t    fLock;
+};
+
+extern lck_grp_t * lck_grp_alloc_init(const char *name, lck_grp_attr_t *attr)
+{
+    lck_grp_t * grp;
+
+    (void) attr;
+    grp = calloc(1, sizeof(*grp));
+    if (grp != NULL) {
+        strncpy(grp->fName, name, sizeof(grp->fName) - 1);
+    }
+    return grp;
+}
+
+extern void lck_grp_free(lck_grp_t *grp)
+{
+    free(grp);
+}
+
+extern lck_mtx_t * lck_mtx_alloc_init(lck_grp_t *grp, lck_attr_t *attr)
+{
+    lck_mtx_t * mtx;
+
+    (void) attr;
+    assert(grp != NULL);
+    mtx = calloc(1, sizeof(*mtx));
+    if (mtx != NULL) {
+        (void) pthread_mutex_init(&mtx->fMutex, NULL);
+    }
+    return mtx;
+}
+
+extern void lck_mtx_free(lck_mtx_t *mtx, lck_grp_t *grp)
+{
+    assert(grp != NULL);
+    assert( ! mtx->fOwned );
+    (void) pthread_mutex_destroy(&mtx->fMutex);
+    free(mtx);
+}
+
+extern void lck_mtx_lock(lck_mtx_t *mtx)
+{
+    (void) pthread_mutex_lock(&mtx->fMutex);
+    mtx->fOwner = pthread_self();
+    mtx->fOwned = TRUE;
+}
+
+extern void lck_mtx_unlock(lck_mtx_t *mtx)
+{
+    assert(mtx->fOwned && pthread_equal(mtx->fOwner, pthread_self()));
+    mtx->fOwned = FALSE;
+    (void) pthread_mutex_unlock(&mtx->fMutex);
+}
+
+extern void lck_mtx_assert(lck_mtx_t *mtx, unsigned int type)
+{
+    boolean_t   owned;
+
+    owned = mtx->fOwned && pthread_equal(mtx->fOwner, pthread_self());
+    if (type == LCK_MTX_ASSERT_OWNED) {
+        assert(owned);
+    } else {
+        assert( ! owned );
+    }
+    (void) owned;
+}
+
+extern lck_rw_t * lck_rw_alloc_init(lck_grp_t *grp, lck_attr_t *attr)
+{
+    lck_rw_t *  lck;
+
+    (void) attr;
+    assert(grp != NULL);
+    lck = calloc(1, sizeof(*lck));
+    if (lck != NULL) {
+        (void) pthread_rwlock_init(&lck->fLock, NULL);
+    }
+    return lck;
+}
+
+extern void lck_rw_free(lck_rw_t *lck, lck_grp_t *grp)
+{
+    assert(grp != NULL);
+    (void) pthread_rwlock_destroy(&lck->fLock);
+    free(lck);
+}
+
+extern void lck_rw_lock_shared(lck_rw_t *lck)
+{
+    (void) pthread_rwlock_rdlock(&lck->fLock);
+}
+
+extern void lck_rw_unlock_shared(lck_rw_t *lck)
+{
+    (void) pthread_rwlock_unlock(&lck->fLock);
+}
+
+extern void lck_rw_lock_exclusive(lck_rw_t *lck)
+{
+    (void) pthread_rwlock_wrlock(&lck->fLock);
+}
+
+extern void lck_rw_unlock_exclusive(lck_rw_t *lck)
+{
+    (void) pthread_rwlock_unlock(&lck->fLock);
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Sleep and Wakeup
+
+// gSleepGeneration is bumped by every wakeup.  A sleeper records the generation
+// while holding gSleepLock, and only then drops the caller's mutex, so a wakeup
+// can never slip in between the two.
+
+static pthread_mutex_t  gSleepLock       = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   gSleepCond       = PTHREAD_COND_INITIALIZER;
+static uint64_t         gSleepGeneration = 0;
+
+extern int msleep(void *chan, lck_mtx_t *mtx, int pri, const char *wmesg, struct timespec *ts)
+{
+    int         err;
+    uint64_t    generation;
+    struct timespec deadline;
+
+    (void) chan;
+    (void) wmesg;
+
+    err = 0;
+    if (ts != NULL) {
+        (void) clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec  += ts->tv_sec;
+        deadline.tv_nsec += ts->tv_nsec;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec  += 1;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+
+    (void) pthread_mutex_lock(&gSleepLock);
+    generation = gSleepGeneration;
+    if (mtx != NULL) {
+        lck_mtx_unlock(mtx);
+    }
+    while ( (err == 0) && (generation == gSleepGeneration) ) {
+        if (ts == NULL) {
+            (void) pthread_cond_wait(&gSleepCond, &gSleepLock);
+        } else if (pthread_cond_timedwait(&gSleepCond, &gSleepLock, &deadline) == ETIMEDOUT) {
+            err = EWOULDBLOCK;
+        }
+    }
+    (void) pthread_mutex_unlock(&gSleepLock);
+
+    if ( (mtx != NULL) && ! (pri & PDROP) ) {
+        lck_mtx_lock(mtx);
+    }
+    return err;
+}
+
+extern void wakeup(void *chan)
+{
+    (void) chan;
+    (void) pthread_mutex_lock(&gSleepLock);
+    gSleepGeneration += 1;
+    (void) pthread_cond_broadcast(&gSleepCond);
+    (void) pthread_mutex_unlock(&gSleepLock);
+}
+
+extern void nanotime(struct timespec *ts)
+{
+    (void) clock_gettime(CLOCK_REALTIME, ts);
+}
+
+// On Intel, absolute time is the time stamp counter, as it is in the kernel. 
+// Reading it is much cheaper than clock_gettime, which matters for code (like 
+// EmptyFS's statistics) that reads it on every operation.  Like on a PowerPC 
+// Mac, the time base isn't nanoseconds, so we calibrate it against the 
+// monotonic clock the first time someone asks for it.  Elsewhere, absolute 
+// time is just the monotonic clock, in nanoseconds.
+
+static uint64_t MonotonicNanoseconds(void)
+{
+    struct timespec now;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t) now.tv_sec * 1000000000ULL) + (uint64_t) now.tv_nsec;
+}
+
+static pthread_once_t               gTimebaseOnce = PTHREAD_ONCE_INIT;
+static mach_timebase_info_data_t    gTimebase;
+
+static void InitTimebase(void)
+{
+    #if defined(__i386__) || defined(__x86_64__)
+        uint64_t            startNanos;
+        uint64_t            startTicks;
+        uint64_t            nanos;
+        uint64_t            ticks;
+        struct timespec     delay;
+
+        startNanos = MonotonicNanoseconds();
+        startTicks = mach_absolute_time();
+        delay.tv_sec  = 0;
+        delay.tv_nsec = 20 * 1000 * 1000;
+        (void) nanosleep(&delay, NULL);
+        nanos = MonotonicNanoseconds() - startNanos;
+        ticks = mach_absolute_time() - startTicks;
+        while ( (nanos > UINT32_MAX) || (ticks > UINT32_MAX) ) {
+            nanos /= 2;
+            ticks /= 2;
+        }
+        if ( (nanos == 0) || (ticks == 0) ) {
+            nanos = 1;
+            ticks = 1;
+        }
+        gTimebase.numer = (uint32_t) nanos;
+        gTimebase.denom = (uint32_t) ticks;
+    #else
+        gTimebase.numer = 1;
+        gTimebase.denom = 1;
+    #endif
+}
+
+extern uint64_t mach_absolute_time(void)
+{
+    #if defined(__i386__) || defined(__x86_64__)
+        return __builtin_ia32_rdtsc();
+    #else
+        return MonotonicNanoseconds();
+    #endif
+}
+
+extern void clock_timebase_info(mach_timebase_info_t info)
+{
+    (void) pthread_once(&gTimebaseOnce, InitTimebase);
+    *info = gTimebase;
+}
+
+extern void absolutetime_to_nanoseconds(uint64_t abstime, uint64_t *result)
+{
+    (void) pthread_once(&gTimebaseOnce, InitTimebase);
+
+    // Split the multiplication so that it can't overflow (numer and denom 
+    // both fit in 32 bits).
+
+    *result = ( (abstime / gTimebase.denom) * gTimebase.numer ) 
+            + ( ( (abstime % gTimebase.denom) * gTimebase.numer ) / gTimebase.denom );
+}
+
+extern int cpu_number(void)
+{
+    int     cpu;
+
+    #if defined(__linux__)
+        cpu = sched_getcpu();
+        if (cpu < 0) {
+            cpu = 0;
+        }
+    #else
+        cpu = 0;
+    #endif
+    return cpu;
+}
+
+extern unsigned int ml_get_max_cpus(void)
+{
+    long    cpus;
+
+    cpus = sysconf(_SC_NPROCESSORS_CONF);
+    if (cpus < 1) {
+        cpus = 1;
+    }
+    return (unsigned int) cpus;
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Kernel Threads
+
+// A kernel thread is a detached pthread.  The UserKPIThread is reference 
+// counted: one reference belongs to the thread itself, and is dropped when 
+// it terminates, and the other is returned to the caller of kernel_thread_start.
+
+struct UserKPIThread {
+    pthread_t           fThread;
+    thread_continue_t   fContinuation;
+    void *              fParameter;
+    volatile int32_t    fRefCount;
+};
+
+static __thread thread_t gCurrentThread = NULL;
+
+static void * KernelThreadEntry(void *param)
+{
+    thread_t    thread;
+
+    thread = (thread_t) param;
+    gCurrentThread = thread;
+    thread->fContinuation(thread->fParameter, THREAD_AWAKENED);
+
+    // A continuation that returns terminates its thread, as in the kernel.
+
+    (void) thread_terminate(thread);
+    return NULL;
+}
+
+extern kern_return_t kernel_thread_start(thread_continue_t continuation, void *parameter, thread_t *new_thread)
+{
+    kern_return_t   kr;
+    thread_t        thread;
+    pthread_attr_t  attr;
+
+    assert(continuation != NULL);
+    assert(new_thread != NULL);
+
+    kr = KERN_FAILURE;
+    thread = calloc(1, sizeof(*thread));
+    if (thread != NULL) {
+        thread->fContinuation = continuation;
+        thread->fParameter    = parameter;
+        thread->fRefCount     = 2;
+
+        (void) pthread_attr_init(&attr);
+        (void) pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if ( pthread_create(&thread->fThread, &attr, KernelThreadEntry, thread) == 0 ) {
+            kr = KERN_SUCCESS;
+        }
+        (void) pthread_attr_destroy(&attr);
+    }
+    if (kr == KERN_SUCCESS) {
+        *new_thread = thread;
+    } else {
+        free(thread);
+    }
+    return kr;
+}
+
+extern thread_t current_thread(void)
+    // Returns NULL for threads that weren't started by kernel_thread_start 
+    // (that is, the harness's threads).
+{
+    return gCurrentThread;
+}
+
+extern void thread_deallocate(thread_t thread)
+{
+    if ( __sync_sub_and_fetch(&thread->fRefCount, 1) == 0 ) {
+        free(thread);
+    }
+}
+
+extern kern_return_t thread_terminate(thread_t thread)
+    // Only supports a thread terminating itself.
+{
+    assert( (thread != NULL) && (thread == gCurrentThread) );
+    gCurrentThread = NULL;
+    thread_deallocate(thread);
+    pthread_exit(NULL);
+    return KERN_SUCCESS;
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Atomic Operations
+
+// The GCC __sync builtins are full barriers, which matches the kernel's 
+// OSAtomic routines on the hardware that Mac OS X 10.4 supports.
+
+extern SInt32 OSAddAtomic(SInt32 amount, volatile SInt32 *address)
+{
+    return __sync_fetch_and_add(address, amount);
+}
+
+extern SInt32 OSIncrementAtomic(volatile SInt32 *address)
+{
+    return __sync_fetch_and_add(address, 1);
+}
+
+extern SInt32 OSDecrementAtomic(volatile SInt32 *address)
+{
+    return __sync_fetch_and_sub(address, 1);
+}
+
+extern boolean_t OSCompareAndSwap(UInt32 oldValue, UInt32 newValue, volatile UInt32 *address)
+{
+    return __sync_bool_compare_and_swap(address, oldValue, newValue);
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Core Structures
+
+struct vfs_context {
+    int             fUnused;
+};
+
+struct vfstable {
+    struct vfs_fsentry  fEntry;
+    int                 fTypeNum;
+};
+
+struct mount {
+    struct vfstable *   mnt_vtable;
+    void *              mnt_data;
+    uint64_t            mnt_flag;
+    struct vfsstatfs    mnt_vfsstat;
+    vnode_t             mnt_devvp;
+    vnode_t             mnt_vnodelist;      // protected by gVNodeListLock
+};
+
+enum {
+    // v_lflag values
+    VL_TERMINATE    = 0x0001,               // VNOPReclaim in progress
+    VL_DEAD         = 0x0002,               // reclaimed, on the free list
+    VL_ONLRU        = 0x0004,               // unused, on the LRU list
+    VL_MARKRECYCLE  = 0x0008                // reclaim as soon as unused
+};
+
+enum {
+    // v_flag values
+    VROOT           = 0x0001,
+    VSYSTEM         = 0x0002,
+    VNOCACHE_NAME   = 0x0004
+};
+
+struct vnode {
+    pthread_mutex_t     v_lock;             // protects v_iocount, v_usecount, v_lflag
+    uint32_t            v_id;
+    int32_t             v_iocount;
+    int32_t             v_usecount;
+    uint32_t            v_lflag;
+    uint32_t            v_flag;
+    boolean_t           v_fsref;
+    enum vtype          v_type;
+    mount_t             v_mount;
+    void *              v_data;
+    int                 (**v_op)(void *);
+    dev_t               v_rdev;
+    off_t               v_filesize;         // as set by ubc_setsize; protected by gUBCLock
+    int                 v_devfd;            // device vnodes only
+    int32_t             v_ubcpages;         // number of pages in the UBC; protected by gUBCLock
+    int32_t             v_ubcdirty;         // number of those that are dirty; protected by gUBCLock
+    uint64_t            v_dirtylow;         // lowest and highest index of a page that's been dirty 
+    uint64_t            v_dirtyhigh;        // since v_ubcdirty was last zero; protected by gUBCLock
+    int32_t             v_mapcount;         // number of UserKPIMappings of this vnode; protected by v_lock
+
+    vnode_t             v_lrunext;          // protected by gVNodeListLock
+    vnode_t             v_lruprev;
+    vnode_t             v_mntnext;
+    vnode_t             v_mntprev;
+};
+
+static struct vfs_context gKernelContext;
+
+extern vfs_context_t vfs_context_current(void)
+{
+    return &gKernelContext;
+}
+
+extern int vfs_context_is64bit(vfs_context_t context)
+    // The "process" is the harness, which shares our address space.
+{
+    assert(context != NULL);
+    (void) context;
+    return (sizeof(void *) == 8);
+}
+
+extern int vfs_context_suser(vfs_context_t context)
+    // The harness is all-powerful.
+{
+    assert(context != NULL);
+    (void) context;
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Vnode Operation Descriptors
+
+enum {
+    #define USERKPI_VNOP_OFFSET(name) kVNOPOffset_ ## name,
+    USERKPI_VNOP_LIST(USERKPI_VNOP_OFFSET)
+    #undef USERKPI_VNOP_OFFSET
+    kVNOPCount
+};
+
+#define USERKPI_DEFINE_VNOP_DESC(name) struct vnodeop_desc vnop_ ## name ## _desc = { kVNOPOffset_ ## name, "vnop_" # name };
+USERKPI_VNOP_LIST(USERKPI_DEFINE_VNOP_DESC)
+#undef USERKPI_DEFINE_VNOP_DESC
+
+extern int vn_default_error(void)
+{
+    return ENOTSUP;
+}
+
+typedef int (*UserKPIVNodeOp)(void *);
+
+static int CallVNOP(vnode_t vp, struct vnodeop_desc *desc, void *ap)
+    // Dispatches a vnode operation through the vnode's operations vector,
+    // exactly like the VNOP_XXX routines in the kernel.
+{
+    assert(vp != NULL);
+    assert(vp->v_op != NULL);
+    *(struct vnodeop_desc **) ap = desc;
+    return vp->v_op[desc->vdesc_offset](ap);
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** VFS Registration
+
+enum {
+    kMaxVFSTables    = 8,
+    kFirstDynamicTypeNum = 100
+};
+
+static pthread_mutex_t      gVFSTableLock = PTHREAD_MUTEX_INITIALIZER;
+static struct vfstable *    gVFSTables[kMaxVFSTables];
+
+extern int vfs_fsadd(struct vfs_fsentry *vfe, vfstable_t *handle)
+{
+    int                 err;
+    int                 tableIndex;
+    int                 descIndex;
+    struct vfstable *   table;
+
+    assert(vfe != NULL);
+    assert(handle != NULL);
+
+    err = 0;
+    table = calloc(1, sizeof(*table));
+    if (table == NULL) {
+        err = ENOMEM;
+    }
+
+    // Build each vnode operations vector.  Every slot starts out as the
+    // vnop_default_desc implementation, then gets overridden by the entries
+    // that the file system supplied.
+
+    for (descIndex = 0; (err == 0) && (descIndex < vfe->vfe_vopcnt); descIndex++) {
+        struct vnodeopv_desc *          opv;
+        struct vnodeopv_entry_desc *    entry;
+        UserKPIVNodeOp *                vector;
+        UserKPIVNodeOp                  defaultOp;
+        int                             op;
+
+        opv = vfe->vfe_opvdescs[descIndex];
+        vector = calloc(kVNOPCount, sizeof(*vector));
+        if (vector == NULL) {
+            err = ENOMEM;
+            break;
+        }
+        defaultOp = (UserKPIVNodeOp) vn_default_error;
+        for (entry = opv->opv_desc_ops; entry->opve_op != NULL; entry++) {
+            if (entry->opve_op == &vnop_default_desc) {
+                defaultOp = entry->opve_impl;
+            }
+        }
+        for (op = 0; op < kVNOPCount; op++) {
+            vector[op] = defaultOp;
+        }
+        for (entry = opv->opv_desc_ops; entry->opve_op != NULL; entry++) {
+            vector[entry->opve_op->vdesc_offset] = entry->opve_impl;
+        }
+        *opv->opv_desc_vector_p = vector;
+    }
+
+    if (err == 0) {
+        table->fEntry = *vfe;
+        (void) pthread_mutex_lock(&gVFSTableLock);
+        err = ENOSPC;
+        for (tableIndex = 0; tableIndex < kMaxVFSTables; tableIndex++) {
+            if (gVFSTables[tableIndex] == NULL) {
+                if (vfe->vfe_flags & VFS_TBLNOTYPENUM) {
+                    table->fTypeNum = kFirstDynamicTypeNum + tableIndex;
+                } else {
+                    table->fTypeNum = vfe->vfe_fstypenum;
+                }
+                gVFSTables[tableIndex] = table;
+                err = 0;
+                break;
+            }
+        }
+        (void) pthread_mutex_unlock(&gVFSTableLock);
+    }
+    if (err == 0) {
+        *handle = table;
+    } else {
+        free(table);
+    }
+    return err;
+}
+
+extern int vfs_fsremove(vfstable_t handle)
+{
+    int     tableIndex;
+
+    (void) pthread_mutex_lock(&gVFSTableLock);
+    for (tableIndex = 0; tableIndex < kMaxVFSTables; tableIndex++) {
+        if (gVFSTables[tableIndex] == handle) {
+            gVFSTables[tableIndex] = NULL;
+        }
+    }
+    (void) pthread_mutex_unlock(&gVFSTableLock);
+    free(handle);
+    return 0;
+}
+
+static struct vfstable * FindVFSTable(const char *fsName)
+{
+    int                 tableIndex;
+    struct vfstable *   result;
+
+    result = NULL;
+    (void) pthread_mutex_lock(&gVFSTableLock);
+    for (tableIndex = 0; tableIndex < kMaxVFSTables; tableIndex++) {
+        if ( (gVFSTables[tableIndex] != NULL) && (strcmp(gVFSTables[tableIndex]->fEntry.vfe_fsname, fsName) == 0) ) {
+            result = gVFSTables[tableIndex];
+            break;
+        }
+    }
+    (void) pthread_mutex_unlock(&gVFSTableLock);
+    return result;
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Mount KPI
+
+extern void * vfs_fsprivate(mount_t mp)
+{
+    return mp->mnt_data;
+}
+
+extern void vfs_setfsprivate(mount_t mp, void *mntdata)
+{
+    mp->mnt_data = mntdata;
+}
+
+extern struct vfsstatfs * vfs_statfs(mount_t mp)
+{
+    return &mp->mnt_vfsstat;
+}
+
+extern int vfs_typenum(mount_t mp)
+{
+    return mp->mnt_vtable->fTypeNum;
+}
+
+extern int vfs_isupdate(mount_t mp)
+{
+    return (mp->mnt_flag & MNT_UPDATE) != 0;
+}
+
+extern int vfs_isrdonly(mount_t mp)
+{
+    return (mp->mnt_flag & MNT_RDONLY) != 0;
+}
+
+extern uint64_t vfs_flags(mount_t mp)
+{
+    return mp->mnt_flag;
+}
+
+extern void vfs_setflags(mount_t mp, uint64_t flags)
+{
+    mp->mnt_flag |= flags;
+}
+
+extern void vfs_clearflags(mount_t mp, uint64_t flags)
+{
+    mp->mnt_flag &= ~flags;
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Vnode Lists
+
+// gVNodeListLock protects the LRU list, the free list, and the per-mount vnode
+// lists.  The lock order is vnode lock, then gVNodeListLock.
+
+static pthread_mutex_t  gVNodeListLock  = PTHREAD_MUTEX_INITIALIZER;
+static vnode_t          gLRUHead        = NULL;
+static vnode_t          gLRUTail        = NULL;
+static int              gLRUCount       = 0;
+static vnode_t          gFreeList       = NULL;
+static int              gDesiredVNodes  = 1024;
+
+extern void UserKPISetDesiredVNodes(int count)
+{
+    gDesiredVNodes = count;
+}
+
+static void LRURemoveLocked(vnode_t vp)
+{
+    if (vp->v_lruprev != NULL) {
+        vp->v_lruprev->v_lrunext = vp->v_lrunext;
+    } else {
+        gLRUHead = vp->v_lrunext;
+    }
+    if (vp->v_lrunext != NULL) {
+        vp->v_lrunext->v_lruprev = vp->v_lruprev;
+    } else {
+        gLRUTail = vp->v_lruprev;
+    }
+    vp->v_lrunext = NULL;
+    vp->v_lruprev = NULL;
+    gLRUCount -= 1;
+}
+
+static void LRUAppendLocked(vnode_t vp)
+{
+    vp->v_lrunext = NULL;
+    vp->v_lruprev = gLRUTail;
+    if (gLRUTail != NULL) {
+        gLRUTail->v_lrunext = vp;
+    } else {
+        gLRUHead = vp;
+    }
+    gLRUTail = vp;
+    gLRUCount += 1;
+}
+
+static void MountListAddLocked(mount_t mp, vnode_t vp)
+{
+    vp->v_mntprev = NULL;
+    vp->v_mntnext = mp->mnt_vnodelist;
+    if (mp->mnt_vnodelist != NULL) {
+        mp->mnt_vnodelist->v_mntprev = vp;
+    }
+    mp->mnt_vnodelist = vp;
+}
+
+static void MountListRemoveLocked(mount_t mp, vnode_t vp)
+{
+    if (vp->v_mntprev != NULL) {
+        vp->v_mntprev->v_mntnext = vp->v_mntnext;
+    } else {
+        mp->mnt_vnodelist = vp->v_mntnext;
+    }
+    if (vp->v_mntnext != NULL) {
+        vp->v_mntnext->v_mntprev = vp->v_mntprev;
+    }
+    vp->v_mntnext = NULL;
+    vp->v_mntprev = NULL;
+}
+
+static void UBCInvalidateVNode(vnode_t vp);
+    // forward declaration
+
+static void ReclaimVNode(vnode_t vp)
+    // Disassociates vp from its FSNode.  The caller must have set VL_TERMINATE
+    // (and removed the vnode from the LRU), which guarantees that no one
+    // else can get a new reference.
+{
+    int                         err;
+    struct vnop_inactive_args   inactiveArgs;
+    struct vnop_reclaim_args    reclaimArgs;
+    mount_t                     mp;
+
+    assert(vp->v_lflag & VL_TERMINATE);
+
+    inactiveArgs.a_vp      = vp;
+    inactiveArgs.a_context = vfs_context_current();
+    (void) CallVNOP(vp, &vnop_inactive_desc, &inactiveArgs);
+
+    reclaimArgs.a_vp      = vp;
+    reclaimArgs.a_context = vfs_context_current();
+    err = CallVNOP(vp, &vnop_reclaim_desc, &reclaimArgs);
+    if (err != 0) {
+        fprintf(stderr, "UserKPI: VNOPReclaim failed with error %d; in the kernel this would panic\n", err);
+        abort();
+    }
+
+    // The vnode's pages are keyed by its address, which is about to be reused.
+
+    UBCInvalidateVNode(vp);
+
+    // The kernel panics if the file system forgets to remove its FS reference.
+
+    assert( ! vp->v_fsref );
+
+    mp = vp->v_mount;
+
+    // If the vnode is still mapped (which only happens on a forced unmount), 
+    // the mappings live on, but they notice that the vid has changed and 
+    // don't call the file system again.
+
+    (void) pthread_mutex_lock(&vp->v_lock);
+    vp->v_id   += 1;
+    vp->v_lflag = VL_DEAD;
+    vp->v_mapcount = 0;
+    vp->v_data  = NULL;
+    vp->v_op    = NULL;
+    vp->v_mount = NULL;
+    (void) pthread_mutex_unlock(&vp->v_lock);
+
+    (void) pthread_mutex_lock(&gVNodeListLock);
+    MountListRemoveLocked(mp, vp);
+    vp->v_lrunext = gFreeList;
+    gFreeList = vp;
+    (void) pthread_mutex_unlock(&gVNodeListLock);
+}
+
+static boolean_t TryBeginTerminate(vnode_t vp, boolean_t force)
+    // Marks vp as being reclaimed if it's unused (or force is set).  Returns
+    // true if the caller is now responsible for calling ReclaimVNode.
+{
+    boolean_t   result;
+
+    result = FALSE;
+    (void) pthread_mutex_lock(&vp->v_lock);
+    if ( ! (vp->v_lflag & (VL_TERMINATE | VL_DEAD)) ) {
+        if ( force || ((vp->v_iocount == 0) && (vp->v_usecount == 0)) ) {
+            vp->v_lflag |= VL_TERMINATE;
+            result = TRUE;
+        }
+    }
+    if (result) {
+        (void) pthread_mutex_lock(&gVNodeListLock);
+        if (vp->v_lflag & VL_ONLRU) {
+            LRURemoveLocked(vp);
+            vp->v_lflag &= ~VL_ONLRU;
+        }
+        (void) pthread_mutex_unlock(&gVNodeListLock);
+    }
+    (void) pthread_mutex_unlock(&vp->v_lock);
+    return result;
+}
+
+static void DrainIOCounts(vnode_t vp)
+    // Waits for the I/O references on vp to go away.  The caller must have 
+    // set VL_TERMINATE, so no new ones can be taken.  This is the equivalent 
+    // of the kernel's vnode_drain.
+{
+    (void) pthread_mutex_lock(&vp->v_lock);
+    assert(vp->v_lflag & VL_TERMINATE);
+    while (vp->v_iocount != 0) {
+        (void) pthread_mutex_unlock(&vp->v_lock);
+        (void) sched_yield();
+        (void) pthread_mutex_lock(&vp->v_lock);
+    }
+    (void) pthread_mutex_unlock(&vp->v_lock);
+}
+
+static void TrimLRU(void)
+    // Recycles unused vnodes until the LRU is no longer over its limit.
+{
+    vnode_t     vp;
+
+    do {
+        vp = NULL;
+        (void) pthread_mutex_lock(&gVNodeListLock);
+        if (gLRUCount > gDesiredVNodes) {
+            vp = gLRUHead;
+        }
+        (void) pthread_mutex_unlock(&gVNodeListLock);
+
+        // There's a window here where vp can be revived (or recycled by
+        // someone else) before we get its lock; TryBeginTerminate copes with
+        // that by re-checking everything with the lock held.
+
+        if (vp != NULL) {
+            if ( TryBeginTerminate(vp, FALSE) ) {
+                ReclaimVNode(vp);
+            } else {
+                // Someone else got there first; to guarantee progress, just stop.
+                vp = NULL;
+            }
+        }
+    } while (vp != NULL);
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Vnode KPI
+
+extern errno_t vnode_create(int flavor, size_t size, void *data, vnode_t *vpp)
+{
+    struct vnode_fsparam *  params;
+    vnode_t                 vp;
+
+    assert(flavor == VNCREATE_FLAVOR);
+    assert(size == sizeof(struct vnode_fsparam));
+    assert(data != NULL);
+    assert(vpp != NULL);
+
+    params = (struct vnode_fsparam *) data;
+    assert(params->vnfs_mp != NULL);
+    assert(params->vnfs_vops != NULL);
+
+    (void) pthread_mutex_lock(&gVNodeListLock);
+    vp = gFreeList;
+    if (vp != NULL) {
+        gFreeList = vp->v_lrunext;
+        vp->v_lrunext = NULL;
+    }
+    (void) pthread_mutex_unlock(&gVNodeListLock);
+
+    if (vp == NULL) {
+        vp = calloc(1, sizeof(*vp));
+        if (vp == NULL) {
+            return ENOMEM;
+        }
+        (void) pthread_mutex_init(&vp->v_lock, NULL);
+        vp->v_id = 1;
+    }
+
+    // No one can find vp yet, so there's no need to lock it.
+
+    vp->v_iocount   = 1;
+    vp->v_usecount  = 0;
+    vp->v_lflag     = 0;
+    vp->v_flag      = 0;
+    vp->v_fsref     = (params->vnfs_flags & VNFS_ADDFSREF) != 0;
+    vp->v_type      = params->vnfs_vtype;
+    vp->v_mount     = params->vnfs_mp;
+    vp->v_data      = params->vnfs_fsnode;
+    vp->v_op        = params->vnfs_vops;
+    vp->v_rdev      = params->vnfs_rdev;
+    vp->v_filesize  = params->vnfs_filesize;
+    vp->v_devfd     = -1;
+    vp->v_ubcdirty  = 0;
+    vp->v_mapcount  = 0;
+    if (params->vnfs_markroot) {
+        vp->v_flag |= VROOT;
+    }
+    if (params->vnfs_marksystem) {
+        vp->v_flag |= VSYSTEM;
+    }
+    if (params->vnfs_flags & VNFS_CANTCACHE) {
+        vp->v_flag |= VNOCACHE_NAME;
+    }
+
+    (void) pthread_mutex_lock(&gVNodeListLock);
+    MountListAddLocked(vp->v_mount, vp);
+    (void) pthread_mutex_unlock(&gVNodeListLock);
+
+    // As in the kernel, unless the file system says otherwise, a vnode created 
+    // as the result of a lookup goes straight into the name cache.
+
+    if ( ! (params->vnfs_flags & VNFS_NOCACHE) && (params->vnfs_cnp != NULL) && (params->vnfs_cnp->cn_flags & MAKEENTRY) ) {
+        assert(params->vnfs_dvp != NULL);
+        cache_enter(params->vnfs_dvp, vp, params->vnfs_cnp);
+    }
+
+    *vpp = vp;
+
+    TrimLRU();
+
+    return 0;
+}
+
+extern uint32_t vnode_vid(vnode_t vp)
+{
+    return vp->v_id;
+}
+
+static int GetIOCountLocked(vnode_t vp)
+{
+    int     err;
+
+    if (vp->v_lflag & (VL_TERMINATE | VL_DEAD)) {
+        err = ENOENT;
+    } else {
+        if (vp->v_lflag & VL_ONLRU) {
+            (void) pthread_mutex_lock(&gVNodeListLock);
+            LRURemoveLocked(vp);
+            (void) pthread_mutex_unlock(&gVNodeListLock);
+            vp->v_lflag &= ~VL_ONLRU;
+        }
+        vp->v_iocount += 1;
+        err = 0;
+    }
+    return err;
+}
+
+extern int vnode_get(vnode_t vp)
+{
+    int     err;
+
+    (void) pthread_mutex_lock(&vp->v_lock);
+    err = GetIOCountLocked(vp);
+    (void) pthread_mutex_unlock(&vp->v_lock);
+    return err;
+}
+
+extern int vnode_getwithvid(vnode_t vp, uint32_t vid)
+{
+    int     err;
+
+    // Like the kernel, if the vnode is in the middle of being reclaimed we 
+    // wait for that to finish (at which point the vid no longer matches) 
+    // rather than failing straight away.  Callers that loop on failure rely 
+    // on this to avoid spinning against a reclaim in progress.
+
+    (void) pthread_mutex_lock(&vp->v_lock);
+    while ( (vp->v_id == vid) && (vp->v_lflag & VL_TERMINATE) ) {
+        (void) pthread_mutex_unlock(&vp->v_lock);
+        (void) sched_yield();
+        (void) pthread_mutex_lock(&vp->v_lock);
+    }
+    if (vp->v_id != vid) {
+        err = ENOENT;
+    } else {
+        err = GetIOCountLocked(vp);
+    }
+    (void) pthread_mutex_unlock(&vp->v_lock);
+    return err;
+}
+
+static void ReleaseLocked(vnode_t vp, boolean_t *reclaimPtr)
+    // Called when one of vp's counts drops.  If the vnode is now unused,
+    // it either goes on the LRU or, if it's been marked for recycling,
+    // gets reclaimed immediately.
+{
+    *reclaimPtr = FALSE;
+    if ( (vp->v_iocount == 0) && (vp->v_usecount == 0) && ! (vp->v_lflag & (VL_TERMINATE | VL_DEAD)) ) {
+        if (vp->v_lflag & VL_MARKRECYCLE) {
+            vp->v_lflag |= VL_TERMINATE;
+            *reclaimPtr = TRUE;
+        } else {
+            (void) pthread_mutex_lock(&gVNodeListLock);
+            LRUAppendLocked(vp);
+            (void) pthread_mutex_unlock(&gVNodeListLock);
+            vp->v_lflag |= VL_ONLRU;
+        }
+    }
+}
+
+extern int vnode_put(vnode_t vp)
+{
+    boolean_t   reclaim;
+
+    (void) pthread_mutex_lock(&vp->v_lock);
+    assert(vp->v_iocount > 0);
+    vp->v_iocount -= 1;
+    ReleaseLocked(vp, &reclaim);
+    (void) pthread_mutex_unlock(&vp->v_lock);
+
+    if (reclaim) {
+        ReclaimVNode(vp);
+    } else {
+        TrimLRU();
+    }
+    return 0;
+}
+
+extern int vnode_ref(vnode_t vp)
+{
+    (void) pthread_mutex_lock(&vp->v_lock);
+    assert(vp->v_iocount > 0);
+    vp->v_usecount += 1;
+    (void) pthread_mutex_unlock(&vp->v_lock);
+    return 0;
+}
+
+extern void vnode_rele(vnode_t vp)
+{
+    boolean_t   reclaim;
+
+    (void) pthread_mutex_lock(&vp->v_lock);
+    assert(vp->v_usecount > 0);
+    vp->v_usecount -= 1;
+    if (vp->v_mount != NULL) {
+        ReleaseLocked(vp, &reclaim);
+    } else {
+        reclaim = FALSE;                    // device vnodes aren't managed by us
+    }
+    (void) pthread_mutex_unlock(&vp->v_lock);
+
+    if (reclaim) {
+        ReclaimVNode(vp);
+    }
+}
+
+extern int vnode_recycle(vnode_t vp)
+{
+    int         result;
+
+    (void) pthread_mutex_lock(&vp->v_lock);
+    vp->v_lflag |= VL_MARKRECYCLE;
+    (void) pthread_mutex_unlock(&vp->v_lock);
+
+    result = TryBeginTerminate(vp, FALSE);
+    if (result) {
+        ReclaimVNode(vp);
+    }
+    return result;
+}
+
+extern int vnode_addfsref(vnode_t vp)
+{
+    vp->v_fsref = TRUE;
+    return 0;
+}
+
+extern int vnode_removefsref(vnode_t vp)
+{
+    vp->v_fsref = FALSE;
+    return 0;
+}
+
+extern mount_t vnode_mount(vnode_t vp)
+{
+    return vp->v_mount;
+}
+
+extern enum vtype vnode_vtype(vnode_t vp)
+{
+    return vp->v_type;
+}
+
+extern int vnode_isdir(vnode_t vp)
+{
+    return (vp->v_type == VDIR);
+}
+
+extern int vnode_isreg(vnode_t vp)
+{
+    return (vp->v_type == VREG);
+}
+
+extern int vnode_isvroot(vnode_t vp)
+{
+    return (vp->v_flag & VROOT) != 0;
+}
+
+extern void * vnode_fsnode(vnode_t vp)
+{
+    return vp->v_data;
+}
+
+extern void vnode_clearfsnode(vnode_t vp)
+{
+    vp->v_data = NULL;
+}
+
+extern dev_t vnode_specrdev(vnode_t vp)
+{
+    return vp->v_rdev;
+}
+
+extern int vflush(mount_t mp, vnode_t skipvp, int flags)
+{
+    int         busy;
+    vnode_t     vp;
+    vnode_t     next;
+
+    busy = 0;
+    do {
+        // Find a candidate.  We can't call ReclaimVNode with gVNodeListLock
+        // held, so we find one vnode, reclaim it, and start again.
+
+        vp = NULL;
+        (void) pthread_mutex_lock(&gVNodeListLock);
+        for (next = mp->mnt_vnodelist; next != NULL; next = next->v_mntnext) {
+            if (next == skipvp) {
+                continue;
+            }
+            if ( (flags & SKIPROOT) && (next->v_flag & VROOT) ) {
+                continue;
+            }
+            if ( (flags & SKIPSYSTEM) && (next->v_flag & VSYSTEM) ) {
+                continue;
+            }
+            if (next->v_lflag & (VL_TERMINATE | VL_DEAD)) {
+                continue;
+            }
+            if ( ! (flags & FORCECLOSE) && (next->v_usecount != 0) ) {
+                continue;
+            }
+            vp = next;
+            break;
+        }
+        (void) pthread_mutex_unlock(&gVNodeListLock);
+
+        // Like the kernel's vflush, a vnode that's only busy because someone 
+        // has an I/O reference on it (for example, a file system's own 
+        // flusher thread) isn't a reason to fail; we wait for the reference 
+        // to go away.  A vnode with a use count (an open file) is.
+
+        if (vp != NULL) {
+            if ( TryBeginTerminate(vp, TRUE) ) {
+                if ( ! (flags & FORCECLOSE) ) {
+                    DrainIOCounts(vp);
+                }
+                ReclaimVNode(vp);
+            }
+        }
+    } while (vp != NULL);
+
+    // Anything left that we were meant to flush is busy.
+
+    (void) pthread_mutex_lock(&gVNodeListLock);
+    for (vp = mp->mnt_vnodelist; vp != NULL; vp = vp->v_mntnext) {
+        if ( (vp != skipvp) && ! ((flags & SKIPROOT) && (vp->v_flag & VROOT)) && ! ((flags & SKIPSYSTEM) && (vp->v_flag & VSYSTEM)) ) {
+            busy += 1;
+        }
+    }
+    (void) pthread_mutex_unlock(&gVNodeListLock);
+
+    return (busy == 0) ? 0 : EBUSY;
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Name Cache
+
+// The name cache is a fixed-size, direct-mapped table keyed by directory vnode 
+// and name.  A new entry simply replaces whatever was in its slot, which is a 
+// crude stand-in for the kernel's LRU but has the same property that matters: 
+// entries can disappear at any time, so the file system can't rely on them. 
+// Each entry records the vids of its vnodes, so entries for reclaimed vnodes 
+// are never returned.  That's why, unlike the kernel's vclean, ReclaimVNode 
+// doesn't bother calling cache_purge (which is a full table scan here).
+
+enum {
+    kNameCacheSize      = 4096,             // must be a power of two
+    kNameCacheMaxName   = 31                // NCHNAMLEN
+};
+
+struct NameCacheEntry {
+    vnode_t     fDVP;                       // NULL if the slot is empty
+    uint32_t    fDVID;
+    vnode_t     fVP;                        // NULL for a negative entry
+    uint32_t    fVID;
+    uint32_t    fNameLen;
+    char        fName[kNameCacheMaxName];
+};
+typedef struct NameCacheEntry NameCacheEntry;
+
+static pthread_mutex_t  gNameCacheLock = PTHREAD_MUTEX_INITIALIZER;
+static NameCacheEntry   gNameCache[kNameCacheSize];
+
+static NameCacheEntry * NameCacheSlot(vnode_t dvp, const char *name, int nameLen)
+{
+    uint32_t    hash;
+    int         i;
+
+    hash = 2166136261U ^ (uint32_t) (uintptr_t) dvp;
+    for (i = 0; i < nameLen; i++) {
+        hash = (hash ^ (uint8_t) name[i]) * 16777619U;
+    }
+    return &gNameCache[hash & (kNameCacheSize - 1)];
+}
+
+static boolean_t NameCacheMatchLocked(const NameCacheEntry *entry, vnode_t dvp, struct componentname *cnp)
+{
+    return (entry->fDVP == dvp)
+        && (entry->fDVID == dvp->v_id)
+        && (entry->fNameLen == (uint32_t) cnp->cn_namelen)
+        && (memcmp(entry->fName, cnp->cn_nameptr, entry->fNameLen) == 0);
+}
+
+extern int cache_lookup(vnode_t dvp, vnode_t *vpp, struct componentname *cnp)
+{
+    int                 result;
+    NameCacheEntry *    entry;
+    vnode_t             vp;
+    uint32_t            vid;
+
+    result = 0;
+    vp  = NULL;
+    vid = 0;
+    if (cnp->cn_namelen <= kNameCacheMaxName) {
+        entry = NameCacheSlot(dvp, cnp->cn_nameptr, cnp->cn_namelen);
+
+        (void) pthread_mutex_lock(&gNameCacheLock);
+        if ( NameCacheMatchLocked(entry, dvp, cnp) ) {
+            if ( ! (cnp->cn_flags & MAKEENTRY) ) {
+                // The caller doesn't want this cached (it's probably about to 
+                // change it), so get rid of it.
+                entry->fDVP = NULL;
+            } else if (entry->fVP == NULL) {
+                result = ENOENT;
+            } else {
+                vp  = entry->fVP;
+                vid = entry->fVID;
+                result = -1;
+            }
+        }
+        (void) pthread_mutex_unlock(&gNameCacheLock);
+    }
+
+    // Take the I/O reference outside of the cache lock; if the vnode was 
+    // recycled in the meantime, treat it as a miss.
+
+    if (result == -1) {
+        if ( vnode_getwithvid(vp, vid) == 0 ) {
+            *vpp = vp;
+        } else {
+            result = 0;
+        }
+    }
+    return result;
+}
+
+extern void cache_enter(vnode_t dvp, vnode_t vp, struct componentname *cnp)
+{
+    NameCacheEntry *    entry;
+
+    if ( (cnp->cn_namelen <= kNameCacheMaxName) && ! (dvp->v_flag & VNOCACHE_NAME) && ( (vp == NULL) || ! (vp->v_flag & VNOCACHE_NAME) ) ) {
+        entry = NameCacheSlot(dvp, cnp->cn_nameptr, cnp->cn_namelen);
+
+        (void) pthread_mutex_lock(&gNameCacheLock);
+        entry->fDVP     = dvp;
+        entry->fDVID    = dvp->v_id;
+        entry->fVP      = vp;
+        entry->fVID     = (vp == NULL) ? 0 : vp->v_id;
+        entry->fNameLen = (uint32_t) cnp->cn_namelen;
+        memcpy(entry->fName, cnp->cn_nameptr, (size_t) cnp->cn_namelen);
+        (void) pthread_mutex_unlock(&gNameCacheLock);
+    }
+}
+
+static void NameCachePurge(vnode_t vp, boolean_t negativesOnly)
+{
+    size_t  i;
+
+    (void) pthread_mutex_lock(&gNameCacheLock);
+    for (i = 0; i < kNameCacheSize; i++) {
+        if (negativesOnly) {
+            if ( (gNameCache[i].fDVP == vp) && (gNameCache[i].fVP == NULL) ) {
+                gNameCache[i].fDVP = NULL;
+            }
+        } else {
+            if ( (gNameCache[i].fDVP == vp) || ( (gNameCache[i].fDVP != NULL) && (gNameCache[i].fVP == vp) ) ) {
+                gNameCache[i].fDVP = NULL;
+            }
+        }
+    }
+    (void) pthread_mutex_unlock(&gNameCacheLock);
+}
+
+extern void cache_purge(vnode_t vp)
+{
+    NameCachePurge(vp, FALSE);
+}
+
+extern void cache_purge_negatives(vnode_t vp)
+{
+    NameCachePurge(vp, TRUE);
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** UIO and Copying
+
+enum {
+    kUIOMaxIOVecs = 16
+};
+
+struct uio {
+    off_t           uio_offset;
+    user_ssize_t    uio_resid;
+    int             uio_segflg;
+    int             uio_rw;
+    int             uio_iovmax;
+    int             uio_iovcnt;
+    int             uio_iovcur;
+    struct {
+        user_addr_t     base;
+        user_ssize_t    len;
+    }               uio_iovs[kUIOMaxIOVecs];
+};
+
+extern uio_t uio_create(int iovcount, off_t offset, int spacetype, int iodirection)
+{
+    uio_t   uio;
+
+    assert( (iovcount > 0) && (iovcount <= kUIOMaxIOVecs) );
+    uio = calloc(1, sizeof(*uio));
+    if (uio != NULL) {
+        uio->uio_iovmax = iovcount;
+        uio_reset(uio, offset, spacetype, iodirection);
+    }
+    return uio;
+}
+
+extern void uio_free(uio_t uio)
+{
+    free(uio);
+}
+
+extern void uio_reset(uio_t uio, off_t offset, int spacetype, int iodirection)
+{
+    uio->uio_offset = offset;
+    uio->uio_resid  = 0;
+    uio->uio_segflg = spacetype;
+    uio->uio_rw     = iodirection;
+    uio->uio_iovcnt = 0;
+    uio->uio_iovcur = 0;
+}
+
+extern int uio_addiov(uio_t uio, user_addr_t baseaddr, user_addr_t length)
+{
+    int     err;
+
+    err = 0;
+    if (uio->uio_iovcnt == uio->uio_iovmax) {
+        err = -1;
+    } else {
+        uio->uio_iovs[uio->uio_iovcnt].base = baseaddr;
+        uio->uio_iovs[uio->uio_iovcnt].len  = (user_ssize_t) length;
+        uio->uio_iovcnt += 1;
+        uio->uio_resid  += (user_ssize_t) length;
+    }
+    return err;
+}
+
+extern user_ssize_t uio_resid(uio_t uio)
+{
+    return uio->uio_resid;
+}
+
+extern void uio_setresid(uio_t uio, user_ssize_t value)
+{
+    uio->uio_resid = value;
+}
+
+extern off_t uio_offset(uio_t uio)
+{
+    return uio->uio_offset;
+}
+
+extern void uio_setoffset(uio_t uio, off_t offset)
+{
+    uio->uio_offset = offset;
+}
+
+extern int uio_rw(uio_t uio)
+{
+    return uio->uio_rw;
+}
+
+extern int uiomove(const char *cp, int n, struct uio *uio)
+    // Like the kernel's uiomove, this copies as much as will fit and
+    // does /not/ return an error for a short copy.
+{
+    while ( (n > 0) && (uio->uio_resid > 0) && (uio->uio_iovcur < uio->uio_iovcnt) ) {
+        user_ssize_t    chunk;
+        char *          userBuf;
+
+        chunk = uio->uio_iovs[uio->uio_iovcur].len;
+        if (chunk == 0) {
+            uio->uio_iovcur += 1;
+            continue;
+        }
+        if (chunk > n) {
+            chunk = n;
+        }
+        userBuf = (char *) (uintptr_t) uio->uio_iovs[uio->uio_iovcur].base;
+        if (uio->uio_rw == UIO_READ) {
+            memcpy(userBuf, cp, (size_t) chunk);
+        } else {
+            memcpy((char *) cp, userBuf, (size_t) chunk);
+        }
+        uio->uio_iovs[uio->uio_iovcur].base += (user_addr_t) chunk;
+        uio->uio_iovs[uio->uio_iovcur].len  -= chunk;
+        uio->uio_resid  -= chunk;
+        uio->uio_offset += chunk;
+        cp += chunk;
+        n  -= (int) chunk;
+    }
+    return 0;
+}
+
+extern int copyin(const user_addr_t uaddr, void *kaddr, size_t len)
+{
+    memcpy(kaddr, (const void *) (uintptr_t) uaddr, len);
+    return 0;
+}
+
+extern int copyout(const void *kaddr, user_addr_t udaddr, size_t len)
+{
+    memcpy((void *) (uintptr_t) udaddr, kaddr, len);
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Buffer Cache
+
+// The buffer cache is a hash table of buffers, keyed by (vnode, block number),
+// protected by a single lock.  A buffer is either busy (owned by whoever got
+// it from buf_bread or buf_getblk, until they release it) or on the LRU list.  
+// When there are more than kBufCacheMaxBuffers buffers, the least recently 
+// used one is freed.  A buffer released with buf_bdwrite is marked B_DELWRI, 
+// and BufFreeLocked writes it before freeing it.  That write is done with 
+// gBufLock held, which stalls everyone else who uses the buffer cache, but 
+// it keeps things simple and it's rare: file systems that care call 
+// buf_flushdirtyblks long before their dirty buffers reach the head of the LRU.
+//
+// A B_LOCKED buffer isn't put on the LRU list when it's released, so it's 
+// neither evicted nor flushed; if every buffer is locked, the cache grows 
+// beyond kBufCacheMaxBuffers.
+//
+// All device I/O is done with pread and pwrite on the device vnode's v_devfd, 
+// in units of kDeviceBlockSize.
+
+enum {
+    kDeviceBlockSize        = 512,
+    kBufHashSize            = 1024,         // must be a power of two
+    kBufCacheMaxBuffers     = 2048,
+    kClusterMaxIOSize       = 1024 * 1024   // largest cluster I/O buffer; see "Unified Buffer Cache"
+};
+
+enum {
+    // b_flags values
+    B_BUSY      = 0x0001,
+    B_INVAL     = 0x0002,
+    B_DONE      = 0x0004,
+    B_DELWRI    = 0x0008,
+    // B_LOCKED (0x0010) is public; see "EmptyFSUserKPI.h"
+    B_CACHE     = 0x0020                    // the last BufGet found the buffer in the cache
+};
+
+struct buf {
+    vnode_t             b_vp;
+    daddr64_t           b_blkno;
+    daddr64_t           b_lblkno;           // cluster I/O buffers only
+    uint32_t            b_size;
+    uint32_t            b_flags;            // protected by gBufLock
+    int32_t             b_ioflags;          // B_READ or B_WRITE
+    errno_t             b_error;
+    char *              b_data;             // NULL if the buffer describes part of a UPL
+    upl_t               b_upl;              // cluster I/O buffers only
+    vm_offset_t         b_uploffset;        // offset of the I/O within b_upl
+
+    struct buf *        b_hashnext;         // protected by gBufLock
+    struct buf *        b_lrunext;
+    struct buf *        b_lruprev;
+};
+
+static pthread_mutex_t  gBufLock        = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   gBufCond        = PTHREAD_COND_INITIALIZER;
+static buf_t            gBufHash[kBufHashSize];
+static buf_t            gBufLRUHead     = NULL;
+static buf_t            gBufLRUTail     = NULL;
+static int              gBufCount       = 0;
+
+// gDeviceReadCount and gDeviceReadBytes count every read from a device vnode, 
+// whether it's for the buffer cache or the cluster layer, and gDeviceWriteCount 
+// and gDeviceWriteBytes do the same for writes.  They're only accessed atomically.
+
+static volatile uint64_t    gDeviceReadCount  = 0;
+static volatile uint64_t    gDeviceReadBytes  = 0;
+static volatile uint64_t    gDeviceWriteCount = 0;
+static volatile uint64_t    gDeviceWriteBytes = 0;
+
+static errno_t DeviceReadV(vnode_t devvp, const struct iovec *iov, int iovCount, size_t size, daddr64_t blkno)
+    // Reads size bytes from devvp, starting at device block blkno, scattering 
+    // them into the iovCount buffers described by iov (which must add up to 
+    // size).  This is our equivalent of a DMA into a scatter/gather list.
+{
+    errno_t     err;
+    ssize_t     bytesRead;
+
+    assert(devvp->v_type == VBLK);
+    assert(devvp->v_devfd >= 0);
+
+    (void) __sync_fetch_and_add(&gDeviceReadCount, 1);
+    (void) __sync_fetch_and_add(&gDeviceReadBytes, (uint64_t) size);
+
+    err = 0;
+    bytesRead = preadv(devvp->v_devfd, iov, iovCount, (off_t) blkno * kDeviceBlockSize);
+    if (bytesRead < 0) {
+        err = errno;
+    } else if ( (size_t) bytesRead != size ) {
+        err = EIO;
+    }
+    return err;
+}
+
+static errno_t DeviceRead(vnode_t devvp, void *data, size_t size, daddr64_t blkno)
+    // Reads size bytes from devvp, starting at device block blkno.
+{
+    struct iovec    iov;
+
+    iov.iov_base = data;
+    iov.iov_len  = size;
+    return DeviceReadV(devvp, &iov, 1, size, blkno);
+}
+
+static errno_t DeviceWriteV(vnode_t devvp, const struct iovec *iov, int iovCount, size_t size, daddr64_t blkno)
+    // Writes size bytes to devvp, starting at device block blkno, gathering 
+    // them from the iovCount buffers described by iov (which must add up to 
+    // size).
+{
+    errno_t     err;
+    ssize_t     bytesWritten;
+
+    assert(devvp->v_type == VBLK);
+    assert(devvp->v_devfd >= 0);
+
+    (void) __sync_fetch_and_add(&gDeviceWriteCount, 1);
+    (void) __sync_fetch_and_add(&gDeviceWriteBytes, (uint64_t) size);
+
+    err = 0;
+    bytesWritten = pwritev(devvp->v_devfd, iov, iovCount, (off_t) blkno * kDeviceBlockSize);
+    if (bytesWritten < 0) {
+        err = errno;
+    } else if ( (size_t) bytesWritten != size ) {
+        err = EIO;
+    }
+    return err;
+}
+
+static errno_t DeviceWrite(vnode_t devvp, const void *data, size_t size, daddr64_t blkno)
+    // Writes size bytes to devvp, starting at device block blkno.
+{
+    struct iovec    iov;
+
+    iov.iov_base = (void *) data;
+    iov.iov_len  = size;
+    return DeviceWriteV(devvp, &iov, 1, size, blkno);
+}
+
+extern void UserKPIGetDeviceReadStats(uint64_t *readCountPtr, uint64_t *byteCountPtr)
+{
+    if (readCountPtr != NULL) {
+        *readCountPtr = __sync_fetch_and_add(&gDeviceReadCount, 0);
+    }
+    if (byteCountPtr != NULL) {
+        *byteCountPtr = __sync_fetch_and_add(&gDeviceReadBytes, 0);
+    }
+}
+
+extern void UserKPIGetDeviceWriteStats(uint64_t *writeCountPtr, uint64_t *byteCountPtr)
+{
+    if (writeCountPtr != NULL) {
+        *writeCountPtr = __sync_fetch_and_add(&gDeviceWriteCount, 0);
+    }
+    if (byteCountPtr != NULL) {
+        *byteCountPtr = __sync_fetch_and_add(&gDeviceWriteBytes, 0);
+    }
+}
+
+static buf_t * BufHashBucket(vnode_t vp, daddr64_t blkno)
+{
+    uintptr_t   hash;
+
+    hash = ((uintptr_t) vp >> 4) ^ (uintptr_t) blkno ^ ((uintptr_t) blkno >> 10);
+    return &gBufHash[hash & (kBufHashSize - 1)];
+}
+
+static void BufLRURemoveLocked(buf_t bp)
+    // Removes bp from the LRU list.  Busy buffers aren't on the list, so 
+    // this does nothing if bp isn't.
+{
+    if ( (bp->b_lruprev == NULL) && (gBufLRUHead != bp) ) {
+        return;
+    }
+    if (bp->b_lruprev == NULL) {
+        gBufLRUHead = bp->b_lrunext;
+    } else {
+        bp->b_lruprev->b_lrunext = bp->b_lrunext;
+    }
+    if (bp->b_lrunext == NULL) {
+        gBufLRUTail = bp->b_lruprev;
+    } else {
+        bp->b_lrunext->b_lruprev = bp->b_lruprev;
+    }
+    bp->b_lrunext = NULL;
+    bp->b_lruprev = NULL;
+}
+
+static void BufLRUAppendLocked(buf_t bp)
+{
+    bp->b_lrunext = NULL;
+    bp->b_lruprev = gBufLRUTail;
+    if (gBufLRUTail == NULL) {
+        gBufLRUHead = bp;
+    } else {
+        gBufLRUTail->b_lrunext = bp;
+    }
+    gBufLRUTail = bp;
+}
+
+static void BufFreeLocked(buf_t bp)
+    // Removes an idle buffer from the cache and frees it, writing it first 
+    // if it's dirty.  There's no one to report a write error to; the kernel 
+    // would log it and carry on, and so do we.
+{
+    buf_t * linkPtr;
+
+    assert( ! (bp->b_flags & B_BUSY) );
+    if (bp->b_flags & B_DELWRI) {
+        if ( DeviceWrite(bp->b_vp, bp->b_data, bp->b_size, bp->b_blkno) != 0 ) {
+            fprintf(stderr, "UserKPI: delayed write of block %lld failed\n", (long long) bp->b_blkno);
+        }
+    }
+    linkPtr = BufHashBucket(bp->b_vp, bp->b_blkno);
+    while (*linkPtr != bp) {
+        linkPtr = &(*linkPtr)->b_hashnext;
+    }
+    *linkPtr = bp->b_hashnext;
+    BufLRURemoveLocked(bp);
+    gBufCount -= 1;
+
+    free(bp->b_data);
+    free(bp);
+}
+
+static errno_t BufGet(vnode_t vp, daddr64_t blkno, int size, boolean_t doRead, buf_t *bpp)
+    // The common code for buf_bread and buf_getblk.  If doRead is false, a 
+    // buffer that's not in the cache is zero filled rather than read.
+{
+    buf_t       bp;
+    buf_t *     bucket;
+
+    assert(vp != NULL);
+    assert(vp->v_devfd >= 0);
+    assert(size > 0);
+    assert(bpp != NULL);
+
+    (void) pthread_mutex_lock(&gBufLock);
+
+    // Look for the buffer in the cache, waiting for it if it's busy.  A
+    // buffer of the wrong size is thrown away; the file system only does
+    // this if it's changed its mind about the block size, which happens at
+    // mount time.
+
+    bucket = BufHashBucket(vp, blkno);
+    do {
+        for (bp = *bucket; bp != NULL; bp = bp->b_hashnext) {
+            if ( (bp->b_vp == vp) && (bp->b_blkno == blkno) ) {
+                break;
+            }
+        }
+        if ( (bp != NULL) && (bp->b_flags & B_BUSY) ) {
+            (void) pthread_cond_wait(&gBufCond, &gBufLock);
+            continue;
+        }
+        if ( (bp != NULL) && (bp->b_size != (uint32_t) size) ) {
+            BufFreeLocked(bp);
+            bp = NULL;
+        }
+        break;
+    } while (TRUE);
+
+    if (bp != NULL) {
+        BufLRURemoveLocked(bp);
+        bp->b_flags |= B_BUSY | B_CACHE;
+        (void) pthread_mutex_unlock(&gBufLock);
+    } else {
+
+        // Not in the cache.  Make room if necessary, then insert a new busy
+        // buffer and read it with the lock dropped.
+
+        while ( (gBufCount >= kBufCacheMaxBuffers) && (gBufLRUHead != NULL) ) {
+            BufFreeLocked(gBufLRUHead);
+        }
+        bp = calloc(1, sizeof(*bp));
+        if (bp != NULL) {
+            bp->b_data = calloc(1, (size_t) size);
+        }
+        if ( (bp == NULL) || (bp->b_data == NULL) ) {
+            abort();                        // like the kernel, we don't expect this to fail
+        }
+        bp->b_vp       = vp;
+        bp->b_blkno    = blkno;
+        bp->b_lblkno   = blkno;
+        bp->b_size     = (uint32_t) size;
+        bp->b_flags    = B_BUSY;
+        bp->b_ioflags  = B_READ;
+        bp->b_hashnext = *bucket;
+        *bucket = bp;
+        gBufCount += 1;
+        (void) pthread_mutex_unlock(&gBufLock);
+
+        if (doRead) {
+            bp->b_error = DeviceRead(vp, bp->b_data, (size_t) size, blkno);
+        }
+    }
+
+    *bpp = bp;
+    return bp->b_error;
+}
+
+extern errno_t buf_bread(vnode_t vp, daddr64_t blkno, int size, kauth_cred_t cred, buf_t *bpp)
+{
+    (void) cred;
+    return BufGet(vp, blkno, size, TRUE, bpp);
+}
+
+extern errno_t buf_meta_bread(vnode_t vp, daddr64_t blkno, int size, kauth_cred_t cred, buf_t *bpp)
+{
+    (void) cred;
+    return BufGet(vp, blkno, size, TRUE, bpp);
+}
+
+extern buf_t buf_getblk(vnode_t vp, daddr64_t blkno, int size, int slpflag, int slptimeo, int operation)
+    // Returns the buffer for blkno, busy, without reading it.  If it wasn't 
+    // already in the cache, it's zero filled.
+{
+    buf_t   bp;
+
+    (void) slpflag;
+    (void) slptimeo;
+    (void) operation;
+    (void) BufGet(vp, blkno, size, FALSE, &bp);
+    return bp;
+}
+
+extern uintptr_t buf_dataptr(buf_t bp)
+{
+    return (uintptr_t) bp->b_data;
+}
+
+extern uint32_t buf_count(buf_t bp)
+{
+    return bp->b_size;
+}
+
+extern daddr64_t buf_blkno(buf_t bp)
+{
+    return bp->b_blkno;
+}
+
+extern errno_t buf_error(buf_t bp)
+{
+    return bp->b_error;
+}
+
+extern int buf_fromcache(buf_t bp)
+{
+    assert(bp->b_flags & B_BUSY);
+    return (bp->b_flags & B_CACHE) != 0;
+}
+
+extern void buf_markinvalid(buf_t bp)
+{
+    assert(bp->b_flags & B_BUSY);
+    bp->b_flags |= B_INVAL;
+}
+
+extern void buf_clear(buf_t bp)
+{
+    assert(bp->b_flags & B_BUSY);
+    memset(bp->b_data, 0, bp->b_size);
+}
+
+extern void buf_brelse(buf_t bp)
+    // As in the kernel, releasing an invalid buffer throws it away, even if 
+    // it's dirty.
+{
+    (void) pthread_mutex_lock(&gBufLock);
+    assert(bp->b_flags & B_BUSY);
+    bp->b_flags &= ~B_BUSY;
+    if ( (bp->b_flags & B_INVAL) || (bp->b_error != 0) ) {
+        bp->b_flags &= ~(B_DELWRI | B_LOCKED);
+        BufFreeLocked(bp);
+    } else if ( ! (bp->b_flags & B_LOCKED) ) {
+        BufLRUAppendLocked(bp);
+    }
+    (void) pthread_cond_broadcast(&gBufCond);
+    (void) pthread_mutex_unlock(&gBufLock);
+}
+
+extern errno_t buf_bwrite(buf_t bp)
+    // Writes the buffer synchronously and then releases it.
+{
+    errno_t     err;
+
+    assert(bp->b_flags & B_BUSY);
+    assert(bp->b_upl == NULL);
+
+    err = DeviceWrite(bp->b_vp, bp->b_data, bp->b_size, bp->b_blkno);
+
+    (void) pthread_mutex_lock(&gBufLock);
+    bp->b_flags &= ~B_DELWRI;
+    (void) pthread_mutex_unlock(&gBufLock);
+    bp->b_error = err;
+    buf_brelse(bp);
+
+    return err;
+}
+
+extern void buf_bdwrite(buf_t bp)
+    // Marks the buffer dirty and releases it.
+{
+    assert(bp->b_flags & B_BUSY);
+    assert(bp->b_upl == NULL);
+
+    (void) pthread_mutex_lock(&gBufLock);
+    bp->b_flags |= B_DELWRI;
+    (void) pthread_mutex_unlock(&gBufLock);
+    bp->b_error = 0;
+    buf_brelse(bp);
+}
+
+extern void buf_flushdirtyblks(vnode_t vp, int wait, int flags, const char *msg)
+    // Writes all of vp's idle dirty buffers.  Busy buffers are skipped: their 
+    // owners are responsible for writing them when they're done.  All our 
+    // writes are synchronous, so wait is irrelevant.
+{
+    buf_t   bp;
+
+    (void) wait;
+    (void) flags;
+    (void) msg;
+
+    (void) pthread_mutex_lock(&gBufLock);
+    for (bp = gBufLRUHead; bp != NULL; bp = bp->b_lrunext) {
+        if ( (bp->b_vp == vp) && (bp->b_flags & B_DELWRI) ) {
+            if ( DeviceWrite(vp, bp->b_data, bp->b_size, bp->b_blkno) == 0 ) {
+                bp->b_flags &= ~B_DELWRI;
+            }
+        }
+    }
+    (void) pthread_mutex_unlock(&gBufLock);
+}
+
+extern vnode_t buf_vnode(buf_t bp)
+{
+    return bp->b_vp;
+}
+
+extern int32_t buf_flags(buf_t bp)
+{
+    return bp->b_ioflags | (int32_t) (bp->b_flags & B_LOCKED);
+}
+
+extern void buf_setflags(buf_t bp, int32_t flags)
+    // Only B_LOCKED can be set, and only on a busy buffer.
+{
+    (void) pthread_mutex_lock(&gBufLock);
+    assert(bp->b_flags & B_BUSY);
+    bp->b_flags |= (uint32_t) (flags & B_LOCKED);
+    (void) pthread_mutex_unlock(&gBufLock);
+}
+
+extern void buf_clearflags(buf_t bp, int32_t flags)
+    // Only B_LOCKED can be cleared, and only on a busy buffer.  The buffer 
+    // goes on the LRU list when it's released.
+{
+    (void) pthread_mutex_lock(&gBufLock);
+    assert(bp->b_flags & B_BUSY);
+    bp->b_flags &= ~ (uint32_t) (flags & B_LOCKED);
+    (void) pthread_mutex_unlock(&gBufLock);
+}
+
+extern daddr64_t buf_lblkno(buf_t bp)
+{
+    return bp->b_lblkno;
+}
+
+extern void buf_setblkno(buf_t bp, daddr64_t blkno)
+{
+    bp->b_blkno = blkno;
+}
+
+extern void buf_seterror(buf_t bp, errno_t error)
+{
+    bp->b_error = error;
+}
+
+extern void buf_biodone(buf_t bp)
+    // Cluster I/O is synchronous, so there's no one to wake up.
+{
+    assert( ! (bp->b_flags & B_DONE) );
+    bp->b_flags |= B_DONE;
+}
+
+static int  UPLBuildIOVec(upl_t upl, vm_offset_t offset, size_t size, struct iovec *iov);
+static void UPLZero(upl_t upl, vm_offset_t offset, size_t size);
+    // forward declarations
+
+extern errno_t buf_strategy(vnode_t devvp, void *ap)
+    // Called by a file system's VNOPStrategy to do the I/O described by 
+    // ap->a_bp on its device.  As in the kernel, if the buffer's physical 
+    // block number hasn't been set (it's still equal to the logical block 
+    // number), we ask the file system to map it.  Unlike the kernel, we can't 
+    // split an I/O that the file system reports as discontiguous; the cluster 
+    // layer never issues one.  If the buffer describes part of a UPL, the 
+    // data goes directly into (or comes directly from) the UPL's pages.  
+    // Reading a hole (a physical block number of -1) zero fills; writing 
+    // one is an error.
+{
+    errno_t         err;
+    buf_t           bp;
+    boolean_t       isRead;
+    off_t           foffset;
+    size_t          contigBytes;
+    struct iovec    iov[ (kClusterMaxIOSize / PAGE_SIZE) + 1 ];
+    int             iovCount;
+
+    bp = ((struct vnop_strategy_args *) ap)->a_bp;
+    assert(bp != NULL);
+    assert(devvp != NULL);
+
+    isRead = ( (bp->b_ioflags & B_READ) != 0 );
+
+    err = 0;
+    if (bp->b_blkno == bp->b_lblkno) {
+        err = VNOP_BLKTOOFF(bp->b_vp, bp->b_lblkno, &foffset);
+        if (err == 0) {
+            err = VNOP_BLOCKMAP(bp->b_vp, foffset, bp->b_size, &bp->b_blkno, &contigBytes, NULL, isRead ? VNODE_READ : VNODE_WRITE, NULL);
+        }
+        if ( (err == 0) && (bp->b_blkno != -1) && (contigBytes < bp->b_size) ) {
+            err = EIO;
+        }
+    }
+    if ( (err == 0) && ! isRead && (bp->b_blkno == -1) ) {
+        err = EIO;
+    }
+    if (err == 0) {
+        if (bp->b_upl != NULL) {
+            assert(bp->b_size <= kClusterMaxIOSize);
+            if (bp->b_blkno == -1) {
+                UPLZero(bp->b_upl, bp->b_uploffset, bp->b_size);
+            } else {
+                iovCount = UPLBuildIOVec(bp->b_upl, bp->b_uploffset, bp->b_size, iov);
+                if (isRead) {
+                    err = DeviceReadV(devvp, iov, iovCount, bp->b_size, bp->b_blkno);
+                } else {
+                    err = DeviceWriteV(devvp, iov, iovCount, bp->b_size, bp->b_blkno);
+                }
+            }
+        } else if (bp->b_blkno == -1) {
+            memset(bp->b_data, 0, bp->b_size);
+        } else if (isRead) {
+            err = DeviceRead(devvp, bp->b_data, bp->b_size, bp->b_blkno);
+        } else {
+            err = DeviceWrite(devvp, bp->b_data, bp->b_size, bp->b_blkno);
+        }
+    }
+    bp->b_error = err;
+    buf_biodone(bp);
+
+    return err;
+}
+
+static void BufInvalidateVNode(vnode_t vp)
+    // Frees all of the buffers belonging to vp, writing any that are dirty.  
+    // None may be busy.
+{
+    buf_t   bp;
+    buf_t   next;
+
+    (void) pthread_mutex_lock(&gBufLock);
+    for (bp = gBufLRUHead; bp != NULL; bp = next) {
+        next = bp->b_lrunext;
+        if (bp->b_vp == vp) {
+            BufFreeLocked(bp);
+        }
+    }
+    (void) pthread_mutex_unlock(&gBufLock);
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Unified Buffer Cache
+
+// The UBC is a hash table of pages, keyed by (vnode, page index), protected 
+// by a single lock.  A page is busy while it's being read in; once it's 
+// valid, it goes on the LRU list.  While someone is copying out of a page, 
+// or has it mapped, they pin it, which stops it from being evicted.  When 
+// there are more than kUBCMaxPages pages, the least recently used unpinned 
+// clean pages are freed.  Dirty pages are never evicted: there's no pageout 
+// daemon, so they stay put until the file system calls cluster_push.  If a 
+// file system never does, the cache grows without bound.
+//
+// Pages are read in through a UPL, which is a run of busy pages that have 
+// been claimed by UBCClaimRun.  The device reads directly into the UPL's 
+// pages (see buf_strategy), and then the UPL is committed, which makes the 
+// pages valid, or aborted, which throws them away.  The cluster layer 
+// (ClusterFill) builds UPLs of up to kClusterMaxIOSize bytes, which is what 
+// the kernel's cluster layer allows for a single I/O, and splits each I/O 
+// wherever VNOPBlockmap says that the file isn't contiguous on disk.  A page 
+// fault (MapFault) builds a UPL of up to kPageinMaxIOSize bytes and hands it 
+// to the file system's VNOPPagein, which typically passes it on to 
+// cluster_pagein.
+//
+// Writes go the other way.  cluster_write copies into pages (claiming and, 
+// if necessary, reading in any that are missing) and marks them dirty.  
+// cluster_push claims runs of dirty pages, which makes them busy and clean, 
+// and writes each run through the file system's VNOPStrategy; if the write 
+// fails, the pages are made dirty again.  A page that's written to while 
+// it's being pushed is dirty again when the push completes, so the new data 
+// is written by the next push.
+//
+// If a vnode is reclaimed while some of its pages are pinned (which can only 
+// happen if it's still mapped when it's forcibly unmounted), those pages are 
+// orphaned: removed from the cache but not freed until the last pin is dropped.
+
+enum {
+    kUBCHashSize        = 4096,             // must be a power of two
+    kUBCMaxPages        = 16384,            // 64 MB
+    kPageinMaxIOSize    = 256 * 1024
+};
+
+enum {
+    // p_flags values
+    P_BUSY      = 0x0001,
+    P_DIRTY     = 0x0002
+};
+
+typedef struct UBCPage UBCPage;
+
+struct UBCPage {
+    vnode_t             p_vp;               // NULL if orphaned
+    uint64_t            p_index;            // offset in the file / PAGE_SIZE
+    uint32_t            p_flags;
+    int32_t             p_pincount;
+    char *              p_data;
+
+    UBCPage *           p_hashnext;
+    UBCPage *           p_lrunext;
+    UBCPage *           p_lruprev;
+};
+
+struct upl {
+    vnode_t             upl_vp;
+    uint64_t            upl_index;          // page index of the first page
+    uint32_t            upl_pagecount;
+    UBCPage *           upl_pages[kClusterMaxIOSize / PAGE_SIZE];   // set to NULL as each page is committed or aborted
+    char *              upl_mapped;         // bounce buffer between ubc_upl_map and ubc_upl_unmap, otherwise NULL
+};
+
+// All of the following, and every field of every UBCPage, are protected 
+// by gUBCLock.
+
+static pthread_mutex_t  gUBCLock        = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   gUBCCond        = PTHREAD_COND_INITIALIZER;
+static UBCPage *        gUBCHash[kUBCHashSize];
+static UBCPage *        gUBCLRUHead     = NULL;
+static UBCPage *        gUBCLRUTail     = NULL;
+static int              gUBCPageCount   = 0;
+
+static UBCPage ** UBCHashBucket(vnode_t vp, uint64_t index)
+{
+    uintptr_t   hash;
+
+    hash = ((uintptr_t) vp >> 4) ^ (uintptr_t) index ^ ((uintptr_t) index >> 12);
+    return &gUBCHash[hash & (kUBCHashSize - 1)];
+}
+
+static UBCPage * UBCFindLocked(vnode_t vp, uint64_t index)
+{
+    UBCPage *   page;
+
+    for (page = *UBCHashBucket(vp, index); page != NULL; page = page->p_hashnext) {
+        if ( (page->p_vp == vp) && (page->p_index == index) ) {
+            break;
+        }
+    }
+    return page;
+}
+
+static void UBCLRURemoveLocked(UBCPage *page)
+{
+    if (page->p_lruprev == NULL) {
+        gUBCLRUHead = page->p_lrunext;
+    } else {
+        page->p_lruprev->p_lrunext = page->p_lrunext;
+    }
+    if (page->p_lrunext == NULL) {
+        gUBCLRUTail = page->p_lruprev;
+    } else {
+        page->p_lrunext->p_lruprev = page->p_lruprev;
+    }
+    page->p_lrunext = NULL;
+    page->p_lruprev = NULL;
+}
+
+static void UBCLRUAppendLocked(UBCPage *page)
+{
+    page->p_lrunext = NULL;
+    page->p_lruprev = gUBCLRUTail;
+    if (gUBCLRUTail == NULL) {
+        gUBCLRUHead = page;
+    } else {
+        gUBCLRUTail->p_lrunext = page;
+    }
+    gUBCLRUTail = page;
+}
+
+static void UBCSetDirtyLocked(UBCPage *page)
+{
+    vnode_t     vp;
+
+    vp = page->p_vp;
+    assert(vp != NULL);
+    if ( ! (page->p_flags & P_DIRTY) ) {
+        page->p_flags |= P_DIRTY;
+        if (vp->v_ubcdirty == 0) {
+            vp->v_dirtylow  = page->p_index;
+            vp->v_dirtyhigh = page->p_index;
+        } else if (page->p_index < vp->v_dirtylow) {
+            vp->v_dirtylow  = page->p_index;
+        } else if (page->p_index > vp->v_dirtyhigh) {
+            vp->v_dirtyhigh = page->p_index;
+        }
+        vp->v_ubcdirty += 1;
+    }
+}
+
+static void UBCClearDirtyLocked(UBCPage *page)
+{
+    if (page->p_flags & P_DIRTY) {
+        page->p_flags &= ~P_DIRTY;
+        assert(page->p_vp->v_ubcdirty > 0);
+        page->p_vp->v_ubcdirty -= 1;
+    }
+}
+
+static void UBCRemoveLocked(UBCPage *page)
+    // Removes a page from the cache, leaving it orphaned.  If it's not 
+    // busy, it must be on the LRU list.  If it's dirty, its data is lost.
+{
+    UBCPage **  linkPtr;
+
+    assert(page->p_vp != NULL);
+    UBCClearDirtyLocked(page);
+    linkPtr = UBCHashBucket(page->p_vp, page->p_index);
+    while (*linkPtr != page) {
+        linkPtr = &(*linkPtr)->p_hashnext;
+    }
+    *linkPtr = page->p_hashnext;
+    if ( ! (page->p_flags & P_BUSY) ) {
+        UBCLRURemoveLocked(page);
+    }
+    page->p_vp->v_ubcpages -= 1;
+    gUBCPageCount -= 1;
+    page->p_vp = NULL;
+}
+
+static void UBCFreeLocked(UBCPage *page)
+    // Removes a page from the cache and frees it.  The page must not be 
+    // pinned.
+{
+    assert(page->p_pincount == 0);
+    UBCRemoveLocked(page);
+
+    free(page->p_data);
+    free(page);
+}
+
+static void UBCPinLocked(UBCPage *page)
+    // Pins a valid page, and marks it as recently used.
+{
+    assert( ! (page->p_flags & P_BUSY) );
+    page->p_pincount += 1;
+    UBCLRURemoveLocked(page);
+    UBCLRUAppendLocked(page);
+}
+
+static void UBCUnpinLocked(UBCPage *page)
+    // Drops a pin taken by UBCPinLocked.  If the page was orphaned while 
+    // it was pinned, and this was the last pin, the page is freed.
+{
+    assert(page->p_pincount > 0);
+    page->p_pincount -= 1;
+    if ( (page->p_pincount == 0) && (page->p_vp == NULL) ) {
+        free(page->p_data);
+        free(page);
+    }
+}
+
+static void UBCTrimLocked(int pagesNeeded)
+    // Frees unpinned clean pages, least recently used first, until there's 
+    // room for pagesNeeded more pages.  If everything is pinned or dirty, the 
+    // cache is allowed to grow beyond kUBCMaxPages.
+{
+    UBCPage *   page;
+    UBCPage *   next;
+
+    for (page = gUBCLRUHead; (page != NULL) && ((gUBCPageCount + pagesNeeded) > kUBCMaxPages); page = next) {
+        next = page->p_lrunext;
+        if ( (page->p_pincount == 0) && ! (page->p_flags & P_DIRTY) ) {
+            UBCFreeLocked(page);
+        }
+    }
+}
+
+static void UBCInvalidateVNode(vnode_t vp)
+    // Frees all of the pages belonging to vp.  VFS won't reclaim a vnode 
+    // while it has an I/O reference, so none of them can be busy.  Pages 
+    // that are pinned by a mapping are orphaned.  Dirty pages are thrown 
+    // away; a file system that writes must push them in its VNOPInactive 
+    // (which is where the kernel would push them, via VNOPPageout).
+{
+    UBCPage *   page;
+    UBCPage *   next;
+
+    (void) pthread_mutex_lock(&gUBCLock);
+    for (page = gUBCLRUHead; (page != NULL) && (vp->v_ubcpages != 0); page = next) {
+        next = page->p_lrunext;
+        if (page->p_vp == vp) {
+            if (page->p_pincount == 0) {
+                UBCFreeLocked(page);
+            } else {
+                UBCRemoveLocked(page);
+            }
+        }
+    }
+    assert(vp->v_ubcpages == 0);
+    (void) pthread_mutex_unlock(&gUBCLock);
+}
+
+extern void UserKPIPurgeCaches(void)
+{
+    UBCPage *   page;
+    UBCPage *   next;
+
+    (void) pthread_mutex_lock(&gUBCLock);
+    for (page = gUBCLRUHead; page != NULL; page = next) {
+        next = page->p_lrunext;
+        if ( (page->p_pincount == 0) && ! (page->p_flags & P_DIRTY) ) {
+            UBCFreeLocked(page);
+        }
+    }
+    (void) pthread_mutex_unlock(&gUBCLock);
+}
+
+static void UBCClaimRun(vnode_t vp, uint64_t firstIndex, uint64_t pageLimit, upl_t upl)
+    // Fills in upl with the run of missing pages of vp that starts at page 
+    // firstIndex, stopping at the first page that's present or after 
+    // pageLimit pages, whichever comes first.  Each page is inserted into 
+    // the cache as a busy placeholder, so anyone else who wants it waits 
+    // until the UPL is committed or aborted.  upl->upl_pagecount can be zero 
+    // if someone else got to the first page before us.
+{
+    uint64_t    pageCount;
+    uint64_t    pageIndex;
+    UBCPage *   page;
+    UBCPage **  bucket;
+
+    assert(pageLimit > 0);
+    assert(pageLimit <= (kClusterMaxIOSize / PAGE_SIZE));
+
+    (void) pthread_mutex_lock(&gUBCLock);
+    for (pageCount = 0; pageCount < pageLimit; pageCount++) {
+        if ( UBCFindLocked(vp, firstIndex + pageCount) != NULL ) {
+            break;
+        }
+    }
+    if (pageCount != 0) {
+        UBCTrimLocked( (int) pageCount );
+    }
+    for (pageIndex = 0; pageIndex < pageCount; pageIndex++) {
+        page = calloc(1, sizeof(UBCPage));
+        if (page != NULL) {
+            page->p_data = malloc(PAGE_SIZE);
+        }
+        if ( (page == NULL) || (page->p_data == NULL) ) {
+            abort();                        // like the kernel, we don't expect this to fail
+        }
+        page->p_vp    = vp;
+        page->p_index = firstIndex + pageIndex;
+        page->p_flags = P_BUSY;
+        bucket = UBCHashBucket(vp, firstIndex + pageIndex);
+        page->p_hashnext = *bucket;
+        *bucket = page;
+        vp->v_ubcpages += 1;
+        gUBCPageCount  += 1;
+
+        upl->upl_pages[pageIndex] = page;
+    }
+    (void) pthread_mutex_unlock(&gUBCLock);
+
+    upl->upl_vp        = vp;
+    upl->upl_index     = firstIndex;
+    upl->upl_pagecount = (uint32_t) pageCount;
+    upl->upl_mapped    = NULL;
+}
+
+static void UPLCheckRange(upl_t upl, vm_offset_t offset, vm_size_t size)
+{
+    assert(upl != NULL);
+    assert( (offset % PAGE_SIZE) == 0 );
+    assert( (offset + size) <= ((vm_size_t) upl->upl_pagecount * PAGE_SIZE) );
+    (void) upl;
+    (void) offset;
+    (void) size;
+}
+
+static char * UPLPageData(upl_t upl, vm_offset_t offset)
+    // Returns the address of the byte at offset within the UPL.  The page 
+    // that holds it must not have been committed or aborted yet.
+{
+    UBCPage *   page;
+
+    page = upl->upl_pages[offset / PAGE_SIZE];
+    assert(page != NULL);
+    return page->p_data + (offset % PAGE_SIZE);
+}
+
+static int UPLBuildIOVec(upl_t upl, vm_offset_t offset, size_t size, struct iovec *iov)
+    // Builds the scatter/gather list for size bytes starting at offset within 
+    // the UPL, returning the number of entries.  iov must have room for 
+    // (kClusterMaxIOSize / PAGE_SIZE) + 1 entries.
+{
+    int         iovCount;
+    size_t      chunk;
+
+    iovCount = 0;
+    while (size != 0) {
+        chunk = PAGE_SIZE - (offset % PAGE_SIZE);
+        if (chunk > size) {
+            chunk = size;
+        }
+        iov[iovCount].iov_base = UPLPageData(upl, offset);
+        iov[iovCount].iov_len  = chunk;
+        iovCount += 1;
+        offset += chunk;
+        size   -= chunk;
+    }
+    return iovCount;
+}
+
+static void UPLZero(upl_t upl, vm_offset_t offset, size_t size)
+    // Zero fills size bytes starting at offset within the UPL.
+{
+    size_t      chunk;
+
+    while (size != 0) {
+        chunk = PAGE_SIZE - (offset % PAGE_SIZE);
+        if (chunk > size) {
+            chunk = size;
+        }
+        memset(UPLPageData(upl, offset), 0, chunk);
+        offset += chunk;
+        size   -= chunk;
+    }
+}
+
+static void UPLCommit(upl_t upl, vm_offset_t offset, vm_size_t size, boolean_t dirty)
+    // Makes the pages in the range valid and, if dirty is set, dirty.  Pages 
+    // that have already been committed or aborted are skipped.
+{
+    uint32_t    pageIndex;
+    UBCPage *   page;
+
+    UPLCheckRange(upl, offset, size);
+
+    (void) pthread_mutex_lock(&gUBCLock);
+    for (pageIndex = (uint32_t) (offset / PAGE_SIZE); pageIndex < (uint32_t) ((offset + size + PAGE_SIZE - 1) / PAGE_SIZE); pageIndex++) {
+        page = upl->upl_pages[pageIndex];
+        if (page != NULL) {
+            page->p_flags &= ~P_BUSY;
+            if (dirty) {
+                UBCSetDirtyLocked(page);
+            }
+            UBCLRUAppendLocked(page);
+            upl->upl_pages[pageIndex] = NULL;
+        }
+    }
+    (void) pthread_cond_broadcast(&gUBCCond);
+    (void) pthread_mutex_unlock(&gUBCLock);
+}
+
+extern kern_return_t ubc_upl_commit_range(upl_t upl, vm_offset_t offset, vm_size_t size, int flags)
+    // We free the UPL structure ourselves, so UPL_COMMIT_FREE_ON_EMPTY is 
+    // irrelevant.
+{
+    (void) flags;
+    UPLCommit(upl, offset, size, FALSE);
+    return KERN_SUCCESS;
+}
+
+extern kern_return_t ubc_upl_abort_range(upl_t upl, vm_offset_t offset, vm_size_t size, int abort_flags)
+    // Throws away the pages in the range, so that the next person who wants 
+    // them will read them again.  Pages that have already been committed or 
+    // aborted are skipped.
+{
+    uint32_t    pageIndex;
+    UBCPage *   page;
+
+    (void) abort_flags;
+    UPLCheckRange(upl, offset, size);
+
+    (void) pthread_mutex_lock(&gUBCLock);
+    for (pageIndex = (uint32_t) (offset / PAGE_SIZE); pageIndex < (uint32_t) ((offset + size + PAGE_SIZE - 1) / PAGE_SIZE); pageIndex++) {
+        page = upl->upl_pages[pageIndex];
+        if (page != NULL) {
+            UBCFreeLocked(page);
+            upl->upl_pages[pageIndex] = NULL;
+        }
+    }
+    (void) pthread_cond_broadcast(&gUBCCond);
+    (void) pthread_mutex_unlock(&gUBCLock);
+
+    return KERN_SUCCESS;
+}
+
+extern kern_return_t ubc_upl_map(upl_t upl, vm_offset_t *dst_addr)
+    // The UPL's pages aren't contiguous in our address space, so we map them 
+    // by copying them into a bounce buffer, which ubc_upl_unmap copies back.  
+    // Like the kernel, we only allow one mapping at a time.
+{
+    kern_return_t   kernErr;
+    uint32_t        pageIndex;
+
+    assert(upl->upl_mapped == NULL);
+
+    kernErr = KERN_SUCCESS;
+    upl->upl_mapped = malloc( (size_t) upl->upl_pagecount * PAGE_SIZE );
+    if (upl->upl_mapped == NULL) {
+        kernErr = KERN_FAILURE;
+    } else {
+        for (pageIndex = 0; pageIndex < upl->upl_pagecount; pageIndex++) {
+            memcpy(upl->upl_mapped + ((size_t) pageIndex * PAGE_SIZE), UPLPageData(upl, (vm_offset_t) pageIndex * PAGE_SIZE), PAGE_SIZE);
+        }
+        *dst_addr = (vm_offset_t) upl->upl_mapped;
+    }
+    return kernErr;
+}
+
+extern kern_return_t ubc_upl_unmap(upl_t upl)
+    // Copies the bounce buffer back into the pages, which must not have been 
+    // committed or aborted while the UPL was mapped.
+{
+    uint32_t        pageIndex;
+
+    assert(upl->upl_mapped != NULL);
+
+    for (pageIndex = 0; pageIndex < upl->upl_pagecount; pageIndex++) {
+        memcpy(UPLPageData(upl, (vm_offset_t) pageIndex * PAGE_SIZE), upl->upl_mapped + ((size_t) pageIndex * PAGE_SIZE), PAGE_SIZE);
+    }
+    free(upl->upl_mapped);
+    upl->upl_mapped = NULL;
+    return KERN_SUCCESS;
+}
+
+static errno_t ClusterReadRun(vnode_t vp, upl_t upl, vm_offset_t uplOffset, off_t foffset, size_t length, off_t filesize)
+    // Reads length bytes of vp, starting at foffset, into the UPL, starting 
+    // at uplOffset.  foffset and length are page aligned.  Anything beyond 
+    // filesize is zero filled.
+{
+    errno_t     err;
+    size_t      done;
+    size_t      run;
+    daddr64_t   bpn;
+    struct buf  bp;
+
+    err = 0;
+    done = 0;
+    while ( (err == 0) && (done < length) ) {
+        if ( (foffset + (off_t) done) >= filesize ) {
+            UPLZero(upl, uplOffset + done, length - done);
+            break;
+        }
+        err = VNOP_BLOCKMAP(vp, foffset + (off_t) done, length - done, &bpn, &run, NULL, VNODE_READ, vfs_context_current());
+        if ( (err == 0) && (run == 0) ) {
+            err = EIO;
+        }
+        if (err == 0) {
+            if (run > (length - done)) {
+                run = length - done;
+            }
+            if (bpn == -1) {
+                UPLZero(upl, uplOffset + done, run);        // a hole
+            } else {
+                memset(&bp, 0, sizeof(bp));
+                bp.b_vp         = vp;
+                bp.b_lblkno     = (foffset + (off_t) done) / PAGE_SIZE_64;
+                bp.b_blkno      = bpn;
+                bp.b_size       = (uint32_t) run;
+                bp.b_ioflags    = B_READ;
+                bp.b_upl        = upl;
+                bp.b_uploffset  = uplOffset + done;
+
+                err = VNOP_STRATEGY(&bp);
+                assert(bp.b_flags & B_DONE);
+                if (err == 0) {
+                    err = bp.b_error;
+                }
+            }
+            done += run;
+        }
+    }
+
+    // Zero the part of the last page that's beyond the end of the file.
+
+    if ( (err == 0) && ((foffset + (off_t) length) > filesize) && (filesize > foffset) ) {
+        UPLZero(upl, uplOffset + (vm_offset_t) (filesize - foffset), (size_t) ((foffset + (off_t) length) - filesize));
+    }
+    return err;
+}
+
+static errno_t ClusterFill(vnode_t vp, uint64_t firstIndex, uint64_t pageLimit, off_t filesize, uint64_t *pageCountPtr)
+    // Reads the run of missing pages of vp that starts at page firstIndex, 
+    // stopping at the first page that's present, after pageLimit pages, or 
+    // at kClusterMaxIOSize, whichever comes first.  *pageCountPtr is the 
+    // number of pages read; this can be zero if someone else got there first.
+{
+    errno_t     err;
+    struct upl  upl;
+    size_t      length;
+
+    if (pageLimit > (kClusterMaxIOSize / PAGE_SIZE)) {
+        pageLimit = kClusterMaxIOSize / PAGE_SIZE;
+    }
+
+    UBCClaimRun(vp, firstIndex, pageLimit, &upl);
+
+    err = 0;
+    if (upl.upl_pagecount != 0) {
+        length = (size_t) upl.upl_pagecount * PAGE_SIZE;
+        err = ClusterReadRun(vp, &upl, 0, (off_t) firstIndex * PAGE_SIZE_64, length, filesize);
+        if (err == 0) {
+            (void) ubc_upl_commit_range(&upl, 0, length, UPL_COMMIT_FREE_ON_EMPTY);
+        } else {
+            (void) ubc_upl_abort_range(&upl, 0, length, UPL_ABORT_ERROR | UPL_ABORT_FREE_ON_EMPTY);
+        }
+    }
+
+    *pageCountPtr = upl.upl_pagecount;
+    return err;
+}
+
+extern int cluster_read(vnode_t vp, struct uio *uio, off_t filesize, int flags)
+{
+    errno_t     err;
+    off_t       offset;
+    off_t       end;
+    uint64_t    index;
+    uint64_t    endIndex;
+    uint64_t    pageCount;
+    UBCPage *   page;
+    size_t      pageOffset;
+    size_t      chunk;
+
+    (void) flags;                           // we never do read-ahead, so IO_RAOFF is irrelevant
+
+    assert(vp != NULL);
+    assert(uio != NULL);
+    assert(uio_rw(uio) == UIO_READ);
+
+    err = 0;
+    while ( (err == 0) && (uio_resid(uio) > 0) && (uio_offset(uio) < filesize) ) {
+        offset = uio_offset(uio);
+        index  = (uint64_t) (offset / PAGE_SIZE_64);
+
+        (void) pthread_mutex_lock(&gUBCLock);
+        page = UBCFindLocked(vp, index);
+        if (page == NULL) {
+            (void) pthread_mutex_unlock(&gUBCLock);
+
+            // Read the missing pages, all the way to the end of the request 
+            // if possible, then go around again to copy them out.
+
+            end = offset + uio_resid(uio);
+            if (end > filesize) {
+                end = filesize;
+            }
+            endIndex = (uint64_t) ( (end + PAGE_SIZE_64 - 1) / PAGE_SIZE_64 );
+            err = ClusterFill(vp, index, endIndex - index, filesize, &pageCount);
+        } else if (page->p_flags & P_BUSY) {
+            (void) pthread_cond_wait(&gUBCCond, &gUBCLock);
+            (void) pthread_mutex_unlock(&gUBCLock);
+        } else {
+            UBCPinLocked(page);
+            (void) pthread_mutex_unlock(&gUBCLock);
+
+            pageOffset = (size_t) (offset % PAGE_SIZE_64);
+            chunk = PAGE_SIZE - pageOffset;
+            if ( (off_t) chunk > (filesize - offset) ) {
+                chunk = (size_t) (filesize - offset);
+            }
+            if ( (user_ssize_t) chunk > uio_resid(uio) ) {
+                chunk = (size_t) uio_resid(uio);
+            }
+            err = uiomove(page->p_data + pageOffset, (int) chunk, uio);
+
+            (void) pthread_mutex_lock(&gUBCLock);
+            UBCUnpinLocked(page);
+            (void) pthread_mutex_unlock(&gUBCLock);
+        }
+    }
+    return err;
+}
+
+extern int advisory_read(vnode_t vp, off_t filesize, off_t f_offset, int resid)
+{
+    errno_t     err;
+    uint64_t    index;
+    uint64_t    endIndex;
+    uint64_t    pageCount;
+    boolean_t   present;
+
+    assert(vp != NULL);
+
+    err = 0;
+    if ( (f_offset < 0) || (resid < 0) ) {
+        err = EINVAL;
+    } else if (f_offset < filesize) {
+        if ( (f_offset + resid) > filesize ) {
+            resid = (int) (filesize - f_offset);
+        }
+        index    = (uint64_t) (f_offset / PAGE_SIZE_64);
+        endIndex = (uint64_t) ( (f_offset + resid + PAGE_SIZE_64 - 1) / PAGE_SIZE_64 );
+        while ( (err == 0) && (index < endIndex) ) {
+            (void) pthread_mutex_lock(&gUBCLock);
+            present = (UBCFindLocked(vp, index) != NULL);
+            (void) pthread_mutex_unlock(&gUBCLock);
+
+            if (present) {
+                index += 1;
+            } else {
+                err = ClusterFill(vp, index, endIndex - index, filesize, &pageCount);
+                index += (pageCount == 0) ? 1 : pageCount;
+            }
+        }
+    }
+    return err;
+}
+
+extern int cluster_pagein(vnode_t vp, upl_t upl, vm_offset_t upl_offset, off_t f_offset, int size, off_t filesize, int flags)
+    // As in the kernel, pages that are entirely beyond the end of the file 
+    // are aborted rather than committed, so a fault on them fails.
+{
+    errno_t     err;
+    size_t      ioSize;
+    size_t      validSize;
+
+    assert(vp != NULL);
+    assert(upl != NULL);
+    assert(upl->upl_vp == vp);
+
+    err = 0;
+    if (    (size <= 0) 
+         || (f_offset < 0) 
+         || ((f_offset % PAGE_SIZE_64) != 0) 
+         || ((upl_offset % PAGE_SIZE) != 0) 
+         || ((upl_offset + (vm_offset_t) size) > ((vm_offset_t) upl->upl_pagecount * PAGE_SIZE)) ) {
+        err = EINVAL;
+    } else if (f_offset >= filesize) {
+        err = EFAULT;
+    }
+
+    validSize = 0;
+    if (err == 0) {
+        ioSize = (size_t) size;
+        if ( (f_offset + (off_t) ioSize) > filesize ) {
+            ioSize = (size_t) (filesize - f_offset);
+        }
+        validSize = (ioSize + PAGE_SIZE - 1) & ~((size_t) PAGE_SIZE - 1);
+
+        err = ClusterReadRun(vp, upl, upl_offset, f_offset, validSize, filesize);
+    }
+
+    if ( ! (flags & UPL_NOCOMMIT) && (size > 0) ) {
+        if (err != 0) {
+            (void) ubc_upl_abort_range(upl, upl_offset, (vm_size_t) size, UPL_ABORT_ERROR | UPL_ABORT_FREE_ON_EMPTY);
+        } else {
+            (void) ubc_upl_commit_range(upl, upl_offset, validSize, UPL_COMMIT_FREE_ON_EMPTY);
+            if (validSize < (size_t) size) {
+                (void) ubc_upl_abort_range(upl, upl_offset + validSize, (size_t) size - validSize, UPL_ABORT_FREE_ON_EMPTY);
+            }
+        }
+    }
+    return err;
+}
+
+static errno_t ClusterWritePage(vnode_t vp, off_t offset, size_t length, struct uio *uio, off_t oldEOF)
+    // Copies length bytes from uio (or, if uio is NULL, zeros) into the cache 
+    // at offset, and marks the page dirty.  The range must lie within a single 
+    // page.  If the page isn't in the cache, we claim it and, unless we're 
+    // about to overwrite all of it or it's entirely beyond oldEOF, read it in 
+    // first.
+{
+    errno_t     err;
+    uint64_t    index;
+    size_t      pageOffset;
+    UBCPage *   page;
+    struct upl  upl;
+    boolean_t   done;
+
+    index      = (uint64_t) (offset / PAGE_SIZE_64);
+    pageOffset = (size_t) (offset % PAGE_SIZE_64);
+    assert( (pageOffset + length) <= PAGE_SIZE );
+
+    err = 0;
+    done = FALSE;
+    do {
+        (void) pthread_mutex_lock(&gUBCLock);
+        page = UBCFindLocked(vp, index);
+        if (page == NULL) {
+            (void) pthread_mutex_unlock(&gUBCLock);
+
+            UBCClaimRun(vp, index, 1, &upl);
+            if (upl.upl_pagecount != 0) {
+                if ( ((pageOffset != 0) || (length != PAGE_SIZE)) && ((off_t) index * PAGE_SIZE_64 < oldEOF) ) {
+                    err = ClusterReadRun(vp, &upl, 0, (off_t) index * PAGE_SIZE_64, PAGE_SIZE, oldEOF);
+                } else {
+                    UPLZero(&upl, 0, PAGE_SIZE);
+                }
+                if (err == 0) {
+                    if (uio != NULL) {
+                        err = uiomove(UPLPageData(&upl, pageOffset), (int) length, uio);
+                    } else {
+                        memset(UPLPageData(&upl, pageOffset), 0, length);
+                    }
+                }
+                if (err == 0) {
+                    UPLCommit(&upl, 0, PAGE_SIZE, TRUE);
+                } else {
+                    (void) ubc_upl_abort_range(&upl, 0, PAGE_SIZE, UPL_ABORT_ERROR | UPL_ABORT_FREE_ON_EMPTY);
+                }
+                done = TRUE;
+            }
+        } else if ( (page->p_flags & P_BUSY) && (page->p_pincount == 0) ) {
+
+            // It's being read in, or it's being pushed and we haven't got it 
+            // pinned; wait for that to finish.  (A page that's being pushed 
+            // can be pinned by a writer who got in first; it's fine for us 
+            // to copy into it, because the writer marks it dirty again.)
+            
+            (void) pthread_cond_wait(&gUBCCond, &gUBCLock);
+            (void) pthread_mutex_unlock(&gUBCLock);
+        } else {
+            if (page->p_flags & P_BUSY) {
+                page->p_pincount += 1;
+            } else {
+                UBCPinLocked(page);
+            }
+            (void) pthread_mutex_unlock(&gUBCLock);
+
+            if (uio != NULL) {
+                err = uiomove(page->p_data + pageOffset, (int) length, uio);
+            } else {
+                memset(page->p_data + pageOffset, 0, length);
+            }
+
+            (void) pthread_mutex_lock(&gUBCLock);
+            if ( (err == 0) && (page->p_vp != NULL) ) {
+                UBCSetDirtyLocked(page);
+            }
+            UBCUnpinLocked(page);
+            (void) pthread_mutex_unlock(&gUBCLock);
+            done = TRUE;
+        }
+    } while ( ! done );
+
+    return err;
+}
+
+static errno_t ClusterWriteRange(vnode_t vp, struct uio *uio, off_t offset, off_t length, off_t oldEOF)
+    // Copies length bytes from uio (or zeros) into the cache at offset, one 
+    // page at a time.
+{
+    errno_t     err;
+    size_t      chunk;
+
+    err = 0;
+    while ( (err == 0) && (length > 0) ) {
+        chunk = PAGE_SIZE - (size_t) (offset % PAGE_SIZE_64);
+        if ( (off_t) chunk > length ) {
+            chunk = (size_t) length;
+        }
+        err = ClusterWritePage(vp, offset, chunk, uio, oldEOF);
+        offset += (off_t) chunk;
+        length -= (off_t) chunk;
+    }
+    return err;
+}
+
+static errno_t ClusterWriteRun(vnode_t vp, upl_t upl, off_t foffset, size_t length)
+    // Writes length bytes of the UPL to vp at foffset, splitting the write 
+    // wherever VNOPBlockmap says the file isn't contiguous on disk.  Asking 
+    // for a VNODE_WRITE mapping is what prompts a file system that does 
+    // delayed allocation to allocate.
+{
+    errno_t     err;
+    size_t      done;
+    size_t      run;
+    daddr64_t   bpn;
+    struct buf  bp;
+
+    err = 0;
+    done = 0;
+    while ( (err == 0) && (done < length) ) {
+        err = VNOP_BLOCKMAP(vp, foffset + (off_t) done, length - done, &bpn, &run, NULL, VNODE_WRITE, vfs_context_current());
+        if ( (err == 0) && ((run == 0) || (bpn == -1)) ) {
+            err = EIO;
+        }
+        if (err == 0) {
+            if (run > (length - done)) {
+                run = length - done;
+            }
+            memset(&bp, 0, sizeof(bp));
+            bp.b_vp         = vp;
+            bp.b_lblkno     = (foffset + (off_t) done) / PAGE_SIZE_64;
+            bp.b_blkno      = bpn;
+            bp.b_size       = (uint32_t) run;
+            bp.b_ioflags    = B_WRITE;
+            bp.b_upl        = upl;
+            bp.b_uploffset  = done;
+
+            err = VNOP_STRATEGY(&bp);
+            assert(bp.b_flags & B_DONE);
+            if (err == 0) {
+                err = bp.b_error;
+            }
+            done += run;
+        }
+    }
+    return err;
+}
+
+static errno_t ClusterPushRange(vnode_t vp, uint64_t index, uint64_t endIndex)
+    // Writes the dirty pages of vp whose indexes are in [index, endIndex), 
+    // in runs of up to kClusterMaxIOSize.  If a page is busy, we wait for it, 
+    // so that when we return, everything that was dirty when we were called 
+    // has been written (or has failed to write).  We never write beyond 
+    // the end of the file rounded up to the device block size; the file 
+    // system may not own the rest of the last page.
+{
+    errno_t     err;
+    errno_t     junk;
+    UBCPage *   page;
+    struct upl  upl;
+    uint64_t    pageLimit;
+    off_t       foffset;
+    off_t       filesize;
+    size_t      length;
+
+    err = 0;
+    while (index < endIndex) {
+        (void) pthread_mutex_lock(&gUBCLock);
+        page = UBCFindLocked(vp, index);
+        if ( (page != NULL) && (page->p_flags & P_BUSY) ) {
+            (void) pthread_cond_wait(&gUBCCond, &gUBCLock);
+            (void) pthread_mutex_unlock(&gUBCLock);
+        } else if ( (page == NULL) || ! (page->p_flags & P_DIRTY) ) {
+            (void) pthread_mutex_unlock(&gUBCLock);
+            index += 1;
+        } else {
+
+            // Claim the run of idle dirty pages that starts here.
+
+            pageLimit = endIndex - index;
+            if (pageLimit > (kClusterMaxIOSize / PAGE_SIZE)) {
+                pageLimit = kClusterMaxIOSize / PAGE_SIZE;
+            }
+            upl.upl_vp        = vp;
+            upl.upl_index     = index;
+            upl.upl_pagecount = 0;
+            upl.upl_mapped    = NULL;
+            while ( (page != NULL) && (page->p_flags & P_DIRTY) && ! (page->p_flags & P_BUSY) ) {
+                UBCLRURemoveLocked(page);
+                UBCClearDirtyLocked(page);
+                page->p_flags |= P_BUSY;
+                upl.upl_pages[upl.upl_pagecount] = page;
+                upl.upl_pagecount += 1;
+                if (upl.upl_pagecount == pageLimit) {
+                    break;
+                }
+                page = UBCFindLocked(vp, index + upl.upl_pagecount);
+            }
+            filesize = vp->v_filesize;
+            (void) pthread_mutex_unlock(&gUBCLock);
+
+            foffset = (off_t) index * PAGE_SIZE_64;
+            length  = (size_t) upl.upl_pagecount * PAGE_SIZE;
+            if ( (foffset + (off_t) length) > filesize ) {
+                length = (filesize <= foffset) ? 0 : (size_t) (filesize - foffset);
+                length = (length + kDeviceBlockSize - 1) & ~((size_t) kDeviceBlockSize - 1);
+            }
+
+            junk = 0;
+            if (length != 0) {
+                junk = ClusterWriteRun(vp, &upl, foffset, length);
+            }
+            UPLCommit(&upl, 0, (vm_size_t) upl.upl_pagecount * PAGE_SIZE, (junk != 0));
+            if ( (junk != 0) && (err == 0) ) {
+                err = junk;
+            }
+
+            index += upl.upl_pagecount;
+        }
+    }
+    return err;
+}
+
+extern int cluster_write(vnode_t vp, struct uio *uio, off_t oldEOF, off_t newEOF, off_t headOff, off_t tailOff, int flags)
+{
+    errno_t     err;
+    off_t       start;
+    off_t       end;
+
+    assert(vp != NULL);
+    assert( (uio == NULL) || (uio_rw(uio) == UIO_WRITE) );
+
+    if (uio != NULL) {
+        start = uio_offset(uio);
+        end   = start + uio_resid(uio);
+    } else {
+        start = newEOF;
+        end   = newEOF;
+    }
+    assert(end <= newEOF);
+
+    err = 0;
+    if ( (flags & IO_HEADZEROFILL) && (headOff < start) ) {
+        err = ClusterWriteRange(vp, NULL, headOff, start - headOff, oldEOF);
+        start = headOff;
+    }
+    if ( (err == 0) && (uio != NULL) ) {
+        err = ClusterWriteRange(vp, uio, uio_offset(uio), uio_resid(uio), oldEOF);
+    }
+    if ( (err == 0) && (flags & IO_TAILZEROFILL) && (tailOff > end) ) {
+        err = ClusterWriteRange(vp, NULL, end, tailOff - end, oldEOF);
+        end = tailOff;
+    }
+    if ( (err == 0) && (flags & IO_SYNC) ) {
+        err = ClusterPushRange(vp, (uint64_t) (start / PAGE_SIZE_64), (uint64_t) ((end + PAGE_SIZE_64 - 1) / PAGE_SIZE_64));
+    }
+    return err;
+}
+
+extern int cluster_push(vnode_t vp, int flags)
+    // Pushes every page that's been dirtied since the vnode last had no 
+    // dirty pages.  All our I/O is synchronous, so IO_SYNC is irrelevant.
+{
+    errno_t     err;
+    uint64_t    index;
+    uint64_t    endIndex;
+
+    (void) flags;
+    assert(vp != NULL);
+
+    index    = 0;
+    endIndex = 0;
+    (void) pthread_mutex_lock(&gUBCLock);
+    if (vp->v_ubcdirty != 0) {
+        index    = vp->v_dirtylow;
+        endIndex = vp->v_dirtyhigh + 1;
+    }
+    (void) pthread_mutex_unlock(&gUBCLock);
+
+    err = 0;
+    if (endIndex != 0) {
+        err = ClusterPushRange(vp, index, endIndex);
+    }
+    return err;
+}
+
+extern int ubc_setsize(vnode_t vp, off_t size)
+    // Returns 1 on success, like the kernel.
+{
+    off_t       oldSize;
+    uint64_t    index;
+    uint64_t    endIndex;
+    UBCPage *   page;
+
+    assert(vp != NULL);
+    assert(size >= 0);
+
+    (void) pthread_mutex_lock(&gUBCLock);
+    oldSize = vp->v_filesize;
+    vp->v_filesize = size;
+    if (size < oldSize) {
+
+        // Throw away every page that's now entirely beyond the end of the 
+        // file (waiting for any that are busy), and zero the rest of the 
+        // page that contains the new end of file.
+
+        index    = (uint64_t) (size / PAGE_SIZE_64);
+        endIndex = (uint64_t) ( (oldSize + PAGE_SIZE_64 - 1) / PAGE_SIZE_64 );
+        while (index < endIndex) {
+            page = UBCFindLocked(vp, index);
+            if ( (page != NULL) && (page->p_flags & P_BUSY) ) {
+                (void) pthread_cond_wait(&gUBCCond, &gUBCLock);
+            } else {
+                if (page != NULL) {
+                    if ( (off_t) index * PAGE_SIZE_64 < size ) {
+                        memset(page->p_data + (size % PAGE_SIZE_64), 0, PAGE_SIZE - (size_t) (size % PAGE_SIZE_64));
+                    } else if (page->p_pincount == 0) {
+                        UBCFreeLocked(page);
+                    } else {
+                        UBCRemoveLocked(page);
+                    }
+                }
+                index += 1;
+            }
+        }
+    }
+    (void) pthread_mutex_unlock(&gUBCLock);
+
+    return 1;
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Memory Mapping
+
+// A UserKPIMapping stands in for a VM map entry backed by the vnode pager.  
+// It holds a use count on the vnode (as the kernel's ubc_map does) and a 
+// table of the pages that it has faulted in, each of which is pinned in the 
+// UBC until the mapping goes away.  The vnode's v_mapcount tells us when 
+// to call VNOPMmap's counterpart, VNOPMnomap.
+//
+// A mapping must only be used by one thread at a time.
+
+struct UserKPIMapping {
+    vnode_t             fVNode;
+    uint32_t            fVID;               // vnode_vid of fVNode when it was mapped
+    off_t               fSize;              // file size when it was mapped
+    uint64_t            fPageCount;
+    UBCPage **          fPages;             // fPageCount entries; NULL if not faulted in
+};
+
+extern errno_t UserKPIMmap(vnode_t vp, int prot, int flags, UserKPIMapping **mappingPtr)
+{
+    errno_t             err;
+    UserKPIMapping *    mapping;
+    int                 fflags;
+
+    assert(vp != NULL);
+    assert(mappingPtr != NULL);
+
+    mapping = NULL;
+
+    err = 0;
+    if ( ! vnode_isreg(vp) ) {
+        err = ENODEV;
+    }
+
+    // As in the kernel (see ubc_map), only EPERM from VNOPMmap prevents 
+    // the mapping.  And, as in the kernel (see vm_map_enter_mem_object), 
+    // a private mapping is a copy of the file, so the pager never sees 
+    // PROT_WRITE for it.
+
+    if (err == 0) {
+        fflags = prot;
+        if ( ! (flags & MAP_SHARED) ) {
+            fflags &= ~PROT_WRITE;
+        }
+        err = VNOP_MMAP(vp, fflags, vfs_context_current());
+        if (err != EPERM) {
+            err = 0;
+        }
+    }
+    if (err == 0) {
+        mapping = calloc(1, sizeof(*mapping));
+        if (mapping == NULL) {
+            err = ENOMEM;
+        }
+    }
+    if (err == 0) {
+        mapping->fVNode     = vp;
+        mapping->fVID       = vnode_vid(vp);
+        mapping->fSize      = vp->v_filesize;
+        mapping->fPageCount = (uint64_t) ( (mapping->fSize + PAGE_SIZE_64 - 1) / PAGE_SIZE_64 );
+        mapping->fPages     = calloc( (mapping->fPageCount == 0) ? 1 : (size_t) mapping->fPageCount, sizeof(UBCPage *) );
+        if (mapping->fPages == NULL) {
+            err = ENOMEM;
+        }
+    }
+    if (err == 0) {
+        (void) vnode_ref(vp);
+        (void) pthread_mutex_lock(&vp->v_lock);
+        vp->v_mapcount += 1;
+        (void) pthread_mutex_unlock(&vp->v_lock);
+
+        *mappingPtr = mapping;
+    } else {
+        if (mapping != NULL) {
+            free(mapping->fPages);
+            free(mapping);
+        }
+    }
+    return err;
+}
+
+static errno_t MapPagein(vnode_t vp, uint64_t index, off_t filesize)
+    // Does what the vnode pager does when a fault finds that page index of vp 
+    // isn't in the UBC: claims a run of missing pages (up to kPageinMaxIOSize, 
+    // and not beyond the end of the file) and passes them to VNOPPagein.
+{
+    errno_t     err;
+    struct upl  upl;
+    uint64_t    pageLimit;
+    uint32_t    pageIndex;
+
+    pageLimit = (uint64_t) ( (filesize + PAGE_SIZE_64 - 1) / PAGE_SIZE_64 ) - index;
+    if (pageLimit > (kPageinMaxIOSize / PAGE_SIZE)) {
+        pageLimit = kPageinMaxIOSize / PAGE_SIZE;
+    }
+
+    UBCClaimRun(vp, index, pageLimit, &upl);
+
+    err = 0;
+    if (upl.upl_pagecount != 0) {
+        err = VNOP_PAGEIN(
+            vp, 
+            &upl, 
+            0, 
+            (off_t) index * PAGE_SIZE_64, 
+            (size_t) upl.upl_pagecount * PAGE_SIZE, 
+            0, 
+            vfs_context_current()
+        );
+
+        // Whether or not it succeeds, the file system must commit or abort 
+        // every page.  If it doesn't, the pages would stay busy forever.
+
+        for (pageIndex = 0; pageIndex < upl.upl_pagecount; pageIndex++) {
+            if (upl.upl_pages[pageIndex] != NULL) {
+                fprintf(stderr, "UserKPI: VNOPPagein left page %u of its UPL busy; in the kernel this would hang\n", (unsigned) pageIndex);
+                abort();
+            }
+        }
+    }
+    return err;
+}
+
+static errno_t MapFault(UserKPIMapping *mapping, uint64_t index)
+    // Resolves a fault on page index of the mapping, which isn't mapped yet.  
+    // If the page is in the UBC, we just pin it; otherwise we page it in.
+{
+    errno_t     err;
+    vnode_t     vp;
+    boolean_t   haveIOCount;
+    UBCPage *   page;
+
+    vp = mapping->fVNode;
+
+    // If the vnode has been reclaimed (a forced unmount), the pages are gone 
+    // for good.
+
+    err = vnode_getwithvid(vp, mapping->fVID);
+    haveIOCount = (err == 0);
+    if (err != 0) {
+        err = EFAULT;
+    }
+
+    while ( (err == 0) && (mapping->fPages[index] == NULL) ) {
+        (void) pthread_mutex_lock(&gUBCLock);
+        page = UBCFindLocked(vp, index);
+        if (page == NULL) {
+            (void) pthread_mutex_unlock(&gUBCLock);
+
+            // Page it in and go around again to pin it.  If the page was 
+            // evicted in the meantime, we page it in again, just like VM 
+            // would.  If the pagein fails, so does the fault.
+
+            err = MapPagein(vp, index, mapping->fSize);
+            if (err != 0) {
+                err = EFAULT;
+            }
+        } else if (page->p_flags & P_BUSY) {
+            (void) pthread_cond_wait(&gUBCCond, &gUBCLock);
+            (void) pthread_mutex_unlock(&gUBCLock);
+        } else {
+            UBCPinLocked(page);
+            mapping->fPages[index] = page;
+            (void) pthread_mutex_unlock(&gUBCLock);
+        }
+    }
+
+    if (haveIOCount) {
+        (void) vnode_put(vp);
+    }
+    return err;
+}
+
+extern errno_t UserKPIMapAccess(UserKPIMapping *mapping, off_t offset, const void **addrPtr)
+{
+    errno_t     err;
+    uint64_t    index;
+
+    assert(mapping != NULL);
+    assert(addrPtr != NULL);
+
+    err = 0;
+    if ( (offset < 0) || (offset >= mapping->fSize) ) {
+        err = EFAULT;
+    }
+    if (err == 0) {
+        index = (uint64_t) (offset / PAGE_SIZE_64);
+        if (mapping->fPages[index] == NULL) {
+            err = MapFault(mapping, index);
+        }
+        if (err == 0) {
+            *addrPtr = mapping->fPages[index]->p_data + (offset % PAGE_SIZE_64);
+        }
+    }
+    return err;
+}
+
+extern void UserKPIMunmap(UserKPIMapping *mapping)
+{
+    vnode_t     vp;
+    uint64_t    index;
+    int32_t     mapCount;
+
+    assert(mapping != NULL);
+
+    vp = mapping->fVNode;
+
+    (void) pthread_mutex_lock(&gUBCLock);
+    for (index = 0; index < mapping->fPageCount; index++) {
+        if (mapping->fPages[index] != NULL) {
+            UBCUnpinLocked(mapping->fPages[index]);
+        }
+    }
+    (void) pthread_mutex_unlock(&gUBCLock);
+
+    // If the vnode was reclaimed while it was mapped, its use count went 
+    // with it; otherwise, the last mapping to go calls VNOPMnomap and drops 
+    // the use count.
+
+    if ( vnode_getwithvid(vp, mapping->fVID) == 0 ) {
+        (void) pthread_mutex_lock(&vp->v_lock);
+        assert(vp->v_mapcount > 0);
+        vp->v_mapcount -= 1;
+        mapCount = vp->v_mapcount;
+        (void) pthread_mutex_unlock(&vp->v_lock);
+
+        if (mapCount == 0) {
+            (void) VNOP_MNOMAP(vp, vfs_context_current());
+        }
+        vnode_rele(vp);
+        (void) vnode_put(vp);
+    }
+
+    free(mapping->fPages);
+    free(mapping);
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Device VNodes
+
+enum {
+    kAnonymousDeviceSize = 1024 * 1024
+};
+
+static int32_t gNextDevNum = 0x0E000000;
+
+static errno_t CreateDeviceVNode(const char *devPath, boolean_t readOnly, vnode_t *devvpPtr)
+    // Creates a VBLK vnode that's backed by the file at devPath or, if
+    // devPath is NULL, an anonymous zero-filled file.  Device vnodes don't
+    // belong to any mount, and are never recycled.
+{
+    errno_t     err;
+    int         fd;
+    vnode_t     vp;
+
+    err = 0;
+    if (devPath != NULL) {
+        fd = open(devPath, readOnly ? O_RDONLY : O_RDWR);
+    } else {
+        FILE *  anon;
+
+        fd = -1;
+        anon = tmpfile();
+        if (anon != NULL) {
+            fd = dup(fileno(anon));
+            (void) fclose(anon);
+            if ( (fd >= 0) && (ftruncate(fd, kAnonymousDeviceSize) < 0) ) {
+                (void) close(fd);
+                fd = -1;
+            }
+        }
+    }
+    if (fd < 0) {
+        err = errno;
+    }
+
+    vp = NULL;
+    if (err == 0) {
+        vp = calloc(1, sizeof(*vp));
+        if (vp == NULL) {
+            (void) close(fd);
+            err = ENOMEM;
+        }
+    }
+    if (err == 0) {
+        (void) pthread_mutex_init(&vp->v_lock, NULL);
+        vp->v_id       = 1;
+        vp->v_iocount  = 1;
+        vp->v_type     = VBLK;
+        vp->v_rdev     = (dev_t) __sync_fetch_and_add(&gNextDevNum, 1);
+        vp->v_devfd    = fd;
+        *devvpPtr = vp;
+    }
+    return err;
+}
+
+static void DisposeDeviceVNode(vnode_t vp)
+{
+    assert(vp->v_usecount == 0);
+    BufInvalidateVNode(vp);
+    (void) close(vp->v_devfd);
+    (void) pthread_mutex_destroy(&vp->v_lock);
+    free(vp);
+}
+
+extern errno_t VNOP_IOCTL(vnode_t vp, unsigned long command, caddr_t data, int fflag, vfs_context_t context)
+    // Only device vnodes support ioctls, and only the ones that a file 
+    // system uses to size up its device and flush its cache.
+{
+    errno_t     err;
+    off_t       deviceSize;
+
+    (void) fflag;
+    (void) context;
+
+    err = 0;
+    if (vp->v_type != VBLK) {
+        err = ENOTTY;
+    } else if (command == DKIOCSYNCHRONIZECACHE) {
+        if ( fsync(vp->v_devfd) < 0 ) {
+            err = errno;
+        }
+    } else if (command == DKIOCGETBLOCKSIZE) {
+        *(uint32_t *) data = kDeviceBlockSize;
+    } else if (command == DKIOCGETBLOCKCOUNT) {
+        deviceSize = lseek(vp->v_devfd, 0, SEEK_END);
+        if (deviceSize < 0) {
+            err = errno;
+        } else {
+            *(uint64_t *) data = (uint64_t) deviceSize / kDeviceBlockSize;
+        }
+    } else {
+        err = ENOTTY;
+    }
+    return err;
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Harness Entry Points
+
+extern errno_t UserKPIMount(
+    const char *    fsName,
+    const char *    devPath,
+    const char *    mountOnName,
+    int             mntflags,
+    const void *    data,
+    mount_t *       mpPtr
+)
+{
+    errno_t             err;
+    struct vfstable *   table;
+    mount_t             mp;
+    vnode_t             devvp;
+
+    assert(fsName != NULL);
+    assert(mpPtr != NULL);
+
+    mp    = NULL;
+    devvp = NULL;
+
+    err = 0;
+    table = FindVFSTable(fsName);
+    if (table == NULL) {
+        err = ENODEV;
+    }
+    if (err == 0) {
+        mp = calloc(1, sizeof(*mp));
+        if (mp == NULL) {
+            err = ENOMEM;
+        }
+    }
+    if ( (err == 0) && (table->fEntry.vfe_flags & VFS_TBLLOCALVOL) ) {
+        err = CreateDeviceVNode(devPath, (mntflags & MNT_RDONLY) != 0, &devvp);
+    }
+
+    // Set up the mount the way VFS does before calling the file system's
+    // mount entry point.
+
+    if (err == 0) {
+        mp->mnt_vtable = table;
+        mp->mnt_devvp  = devvp;
+        mp->mnt_flag   = (uint64_t) mntflags;
+        if (table->fEntry.vfe_flags & VFS_TBLLOCALVOL) {
+            mp->mnt_flag |= MNT_LOCAL;
+        }
+        strncpy(mp->mnt_vfsstat.f_fstypename, table->fEntry.vfe_fsname, MFSTYPENAMELEN - 1);
+        strncpy(mp->mnt_vfsstat.f_mntonname, (mountOnName != NULL) ? mountOnName : "/", MAXPATHLEN - 1);
+        strncpy(mp->mnt_vfsstat.f_mntfromname, (devPath != NULL) ? devPath : "anonymous", MAXPATHLEN - 1);
+        mp->mnt_vfsstat.f_owner = getuid();
+
+        err = table->fEntry.vfe_vfsops->vfs_mount(mp, devvp, CAST_USER_ADDR_T(data), vfs_context_current());
+
+        // As in the kernel, MNT_FORCE is only visible to the file system's 
+        // mount entry point.
+
+        mp->mnt_flag &= ~((uint64_t) MNT_FORCE);
+    }
+    if ( (err == 0) && (table->fEntry.vfe_vfsops->vfs_start != NULL) ) {
+        (void) table->fEntry.vfe_vfsops->vfs_start(mp, 0, vfs_context_current());
+    }
+
+    // The device vnode's I/O reference belongs to the open that VFS did
+    // on our behalf; the file system takes its own use count if it wants it.
+
+    if (devvp != NULL) {
+        (void) pthread_mutex_lock(&devvp->v_lock);
+        devvp->v_iocount -= 1;
+        (void) pthread_mutex_unlock(&devvp->v_lock);
+    }
+
+    if (err == 0) {
+        *mpPtr = mp;
+    } else {
+        if (devvp != NULL) {
+            DisposeDeviceVNode(devvp);
+        }
+        free(mp);
+    }
+    return err;
+}
+
+extern errno_t UserKPIUnmount(mount_t mp, int mntflags)
+{
+    errno_t     err;
+    vnode_t     devvp;
+
+    // VFS flushes everything but the root and system vnodes before calling
+    // the file system; the file system's unmount flushes the rest.
+
+    err = vflush(mp, NULL, SKIPSWAP | SKIPSYSTEM | SKIPROOT | ((mntflags & MNT_FORCE) ? FORCECLOSE : 0));
+    if (err == 0) {
+        err = mp->mnt_vtable->fEntry.vfe_vfsops->vfs_unmount(mp, mntflags, vfs_context_current());
+    }
+    if (err == 0) {
+        devvp = mp->mnt_devvp;
+        if (devvp != NULL) {
+            DisposeDeviceVNode(devvp);
+        }
+        free(mp);
+    }
+    return err;
+}
+
+extern errno_t UserKPISysctl(
+    const char *    fsName,
+    int *           name,
+    u_int           namelen,
+    void *          oldp,
+    size_t *        oldlenp,
+    void *          newp,
+    size_t          newlen
+)
+{
+    errno_t             err;
+    struct vfstable *   table;
+
+    table = FindVFSTable(fsName);
+    if (table == NULL) {
+        err = ENOTSUP;
+    } else if (table->fEntry.vfe_vfsops->vfs_sysctl == NULL) {
+        err = ENOTSUP;
+    } else {
+        err = table->fEntry.vfe_vfsops->vfs_sysctl(
+            name, 
+            namelen, 
+            CAST_USER_ADDR_T(oldp), 
+            oldlenp, 
+            CAST_USER_ADDR_T(newp), 
+            newlen, 
+            vfs_context_current()
+        );
+    }
+    return err;
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** VFS and VNode Operation Wrappers
+
+extern errno_t UserKPILookupComponent(vnode_t dvp, vnode_t *vpp, struct componentname *cnp, vfs_context_t context)
+{
+    errno_t     err;
+    int         cacheResult;
+
+    if ( (cnp->cn_namelen == 1) && (cnp->cn_nameptr[0] == '.') ) {
+        err = vnode_get(dvp);
+        if (err == 0) {
+            *vpp = dvp;
+        }
+    } else {
+        cacheResult = cache_lookup(dvp, vpp, cnp);
+        if (cacheResult == -1) {
+            err = 0;
+        } else if (cacheResult == ENOENT) {
+            err = ENOENT;
+        } else {
+            err = VNOP_LOOKUP(dvp, vpp, cnp, context);
+        }
+    }
+    return err;
+}
+
+extern errno_t VFS_ROOT(mount_t mp, vnode_t *vpp, vfs_context_t context)
+{
+    return mp->mnt_vtable->fEntry.vfe_vfsops->vfs_root(mp, vpp, context);
+}
+
+extern errno_t VFS_GETATTR(mount_t mp, struct vfs_attr *vfa, vfs_context_t context)
+{
+    return mp->mnt_vtable->fEntry.vfe_vfsops->vfs_getattr(mp, vfa, context);
+}
+
+// Like the kernel, we return ENOTSUP for the optional VFS operations if the 
+// file system doesn't implement them.
+
+extern errno_t VFS_VGET(mount_t mp, ino64_t ino, vnode_t *vpp, vfs_context_t context)
+{
+    if (mp->mnt_vtable->fEntry.vfe_vfsops->vfs_vget == NULL) {
+        return ENOTSUP;
+    }
+    return mp->mnt_vtable->fEntry.vfe_vfsops->vfs_vget(mp, ino, vpp, context);
+}
+
+extern errno_t VFS_FHTOVP(mount_t mp, int fhlen, unsigned char *fhp, vnode_t *vpp, vfs_context_t context)
+{
+    if (mp->mnt_vtable->fEntry.vfe_vfsops->vfs_fhtovp == NULL) {
+        return ENOTSUP;
+    }
+    return mp->mnt_vtable->fEntry.vfe_vfsops->vfs_fhtovp(mp, fhlen, fhp, vpp, context);
+}
+
+extern errno_t VFS_VPTOFH(vnode_t vp, int *fhlen, unsigned char *fhp, vfs_context_t context)
+{
+    mount_t     mp;
+
+    mp = vnode_mount(vp);
+    if (mp->mnt_vtable->fEntry.vfe_vfsops->vfs_vptofh == NULL) {
+        return ENOTSUP;
+    }
+    return mp->mnt_vtable->fEntry.vfe_vfsops->vfs_vptofh(vp, fhlen, fhp, context);
+}
+
+extern errno_t VFS_SYNC(mount_t mp, int waitfor, vfs_context_t context)
+{
+    if (mp->mnt_vtable->fEntry.vfe_vfsops->vfs_sync == NULL) {
+        return ENOTSUP;
+    }
+    return mp->mnt_vtable->fEntry.vfe_vfsops->vfs_sync(mp, waitfor, context);
+}
+
+extern errno_t VNOP_LOOKUP(vnode_t dvp, vnode_t *vpp, struct componentname *cnp, vfs_context_t context)
+{
+    struct vnop_lookup_args args;
+
+    args.a_dvp     = dvp;
+    args.a_vpp     = vpp;
+    args.a_cnp     = cnp;
+    args.a_context = context;
+    return CallVNOP(dvp, &vnop_lookup_desc, &args);
+}
+
+extern errno_t VNOP_OPEN(vnode_t vp, int mode, vfs_context_t context)
+{
+    struct vnop_open_args   args;
+
+    args.a_vp      = vp;
+    args.a_mode    = mode;
+    args.a_context = context;
+    return CallVNOP(vp, &vnop_open_desc, &args);
+}
+
+extern errno_t VNOP_CLOSE(vnode_t vp, int fflag, vfs_context_t context)
+{
+    struct vnop_close_args  args;
+
+    args.a_vp      = vp;
+    args.a_fflag   = fflag;
+    args.a_context = context;
+    return CallVNOP(vp, &vnop_close_desc, &args);
+}
+
+extern errno_t VNOP_GETATTR(vnode_t vp, struct vnode_attr *vap, vfs_context_t context)
+{
+    struct vnop_getattr_args    args;
+
+    args.a_vp      = vp;
+    args.a_vap     = vap;
+    args.a_context = context;
+    return CallVNOP(vp, &vnop_getattr_desc, &args);
+}
+
+extern errno_t VNOP_READDIR(vnode_t vp, struct uio *uio, int flags, int *eofflag, int *numdirent, vfs_context_t context)
+{
+    struct vnop_readdir_args    args;
+
+    args.a_vp        = vp;
+    args.a_uio       = uio;
+    args.a_flags     = flags;
+    args.a_eofflag   = eofflag;
+    args.a_numdirent = numdirent;
+    args.a_context   = context;
+    return CallVNOP(vp, &vnop_readdir_desc, &args);
+}
+
+extern errno_t VNOP_READ(vnode_t vp, struct uio *uio, int ioflag, vfs_context_t context)
+{
+    struct vnop_read_args   args;
+
+    args.a_vp      = vp;
+    args.a_uio     = uio;
+    args.a_ioflag  = ioflag;
+    args.a_context = context;
+    return CallVNOP(vp, &vnop_read_desc, &args);
+}
+
+extern errno_t VNOP_WRITE(vnode_t vp, struct uio *uio, int ioflag, vfs_context_t context)
+{
+    struct vnop_write_args  args;
+
+    args.a_vp      = vp;
+    args.a_uio     = uio;
+    args.a_ioflag  = ioflag;
+    args.a_context = context;
+    return CallVNOP(vp, &vnop_write_desc, &args);
+}
+
+extern errno_t VNOP_CREATE(vnode_t dvp, vnode_t *vpp, struct componentname *cnp, struct vnode_attr *vap, vfs_context_t context)
+{
+    struct vnop_create_args args;
+
+    args.a_dvp     = dvp;
+    args.a_vpp     = vpp;
+    args.a_cnp     = cnp;
+    args.a_vap     = vap;
+    args.a_context = context;
+    return CallVNOP(dvp, &vnop_create_desc, &args);
+}
+
+extern errno_t VNOP_REMOVE(vnode_t dvp, vnode_t vp, struct componentname *cnp, int flags, vfs_context_t context)
+{
+    struct vnop_remove_args args;
+
+    args.a_dvp     = dvp;
+    args.a_vp      = vp;
+    args.a_cnp     = cnp;
+    args.a_flags   = flags;
+    args.a_context = context;
+    return CallVNOP(dvp, &vnop_remove_desc, &args);
+}
+
+extern errno_t VNOP_FSYNC(vnode_t vp, int waitfor, vfs_context_t context)
+{
+    struct vnop_fsync_args  args;
+
+    args.a_vp      = vp;
+    args.a_waitfor = waitfor;
+    args.a_context = context;
+    return CallVNOP(vp, &vnop_fsync_desc, &args);
+}
+
+extern errno_t VNOP_SETATTR(vnode_t vp, struct vnode_attr *vap, vfs_context_t context)
+{
+    struct vnop_setattr_args    args;
+
+    args.a_vp      = vp;
+    args.a_vap     = vap;
+    args.a_context = context;
+    return CallVNOP(vp, &vnop_setattr_desc, &args);
+}
+
+extern errno_t VNOP_ALLOCATE(vnode_t vp, off_t length, u_int32_t flags, off_t *bytesallocated, off_t offset, vfs_context_t context)
+{
+    struct vnop_allocate_args   args;
+
+    args.a_vp             = vp;
+    args.a_length         = length;
+    args.a_flags          = flags;
+    args.a_bytesallocated = bytesallocated;
+    args.a_offset         = offset;
+    args.a_context        = context;
+    return CallVNOP(vp, &vnop_allocate_desc, &args);
+}
+
+extern errno_t VNOP_BLOCKMAP(vnode_t vp, off_t foffset, size_t size, daddr64_t *bpn, size_t *run, void *poff, int flags, vfs_context_t context)
+{
+    struct vnop_blockmap_args   args;
+
+    args.a_vp      = vp;
+    args.a_foffset = foffset;
+    args.a_size    = size;
+    args.a_bpn     = bpn;
+    args.a_run     = run;
+    args.a_poff    = poff;
+    args.a_flags   = flags;
+    args.a_context = context;
+    return CallVNOP(vp, &vnop_blockmap_desc, &args);
+}
+
+extern errno_t VNOP_STRATEGY(struct buf *bp)
+{
+    struct vnop_strategy_args   args;
+
+    args.a_bp = bp;
+    return CallVNOP(bp->b_vp, &vnop_strategy_desc, &args);
+}
+
+extern errno_t VNOP_BLKTOOFF(vnode_t vp, daddr64_t lblkno, off_t *offset)
+{
+    struct vnop_blktooff_args   args;
+
+    args.a_vp     = vp;
+    args.a_lblkno = lblkno;
+    args.a_offset = offset;
+    return CallVNOP(vp, &vnop_blktooff_desc, &args);
+}
+
+extern errno_t VNOP_OFFTOBLK(vnode_t vp, off_t offset, daddr64_t *lblkno)
+{
+    struct vnop_offtoblk_args   args;
+
+    args.a_vp     = vp;
+    args.a_offset = offset;
+    args.a_lblkno = lblkno;
+    return CallVNOP(vp, &vnop_offtoblk_desc, &args);
+}
+
+extern errno_t VNOP_MMAP(vnode_t vp, int fflags, vfs_context_t context)
+{
+    struct vnop_mmap_args   args;
+
+    args.a_vp      = vp;
+    args.a_fflags  = fflags;
+    args.a_context = context;
+    return CallVNOP(vp, &vnop_mmap_desc, &args);
+}
+
+extern errno_t VNOP_MNOMAP(vnode_t vp, vfs_context_t context)
+{
+    struct vnop_mnomap_args args;
+
+    args.a_vp      = vp;
+    args.a_context = context;
+    return CallVNOP(vp, &vnop_mnomap_desc, &args);
+}
+
+extern errno_t VNOP_PAGEIN(vnode_t vp, upl_t pl, vm_offset_t pl_offset, off_t f_offset, size_t size, int flags, vfs_context_t context)
+{
+    struct vnop_pagein_args args;
+
+    args.a_vp        = vp;
+    args.a_pl        = pl;
+    args.a_pl_offset = pl_offset;
+    args.a_f_offset  = f_offset;
+    args.a_size      = size;
+    args.a_flags     = flags;
+    args.a_context   = context;
+    return CallVNOP(vp, &vnop_pagein_desc, &args);
+}
+
+extern errno_t VNOP_READDIRATTR(vnode_t vp, struct attrlist *alist, struct uio *uio, u_long maxcount, u_long options, u_long *newstate, int *eofflag, u_long *actualcount, vfs_context_t context)
+{
+    struct vnop_readdirattr_args    args;
+
+    args.a_vp          = vp;
+    args.a_alist       = alist;
+    args.a_uio         = uio;
+    args.a_maxcount    = maxcount;
+    args.a_options     = options;
+    args.a_newstate    = newstate;
+    args.a_eofflag     = eofflag;
+    args.a_actualcount = actualcount;
+    args.a_context     = context;
+    return CallVNOP(vp, &vnop_readdirattr_desc, &args);
+}
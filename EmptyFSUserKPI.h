@@ -0,0 +1,1361 @@
+/*
+    File:       EmptyFSUserKPI.h
+
+    Contains:   User-space stand-ins for the kernel KPIs used by EmptyFS.
+
+    Written by: DTS
+
+    Copyright:  Copyright (c) 2006 by Apple Computer, Inc., All Rights Reserved.
+
+    Disclaimer: IMPORTANT:  This Apple software is supplied to you by Apple Computer, Inc.
+                ("Apple") in consideration of your agreement to the following terms, and your
+                use, installation, modification or redistribution of this Apple software
+                constitutes acceptance of these terms.  If you do not agree with these terms,
+                please do not use, install, modify or redistribute this Apple software.
+
+                In consideration of your agreement to abide by the following terms, and subject
+                to these terms, Apple grants you a personal, non-exclusive license, under Apple's
+                copyrights in this original Apple software (the "Apple Software"), to use,
+                reproduce, modify and redistribute the Apple Software, with or without
+                modifications, in source and/or binary forms; provided that if you redistribute
+                the Apple Software in its entirety and without modifications, you must retain
+                this notice and the following text and disclaimers in all such redistributions of
+                the Apple Software.  Neither the name, trademarks, service marks or logos of
+                Apple Computer, Inc. may be used to endorse or promote products derived from the
+                Apple Software without specific prior written permission from Apple.  Except as
+                expressly stated in this notice, no other rights or licenses, express or implied,
+                are granted by Apple herein, including but not limited to any patent rights that
+                may be infringed by your derivative works or by other works in which the Apple
+                Software may be incorporated.
+
+                The Apple Software is provided by Apple on an "AS IS" basis.  APPLE MAKES NO
+                WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                PURPOSE, REGARDING THE APPLE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                COMBINATION WITH YOUR PRODUCTS.
+
+                IN NO EVENT SHALL APPLE BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                OF THE APPLE SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF APPLE HAS BEEN
+                ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+    Change History (most recent first):
+
+$Log$
+
+*/
+
+#ifndef _EMPTYFSUSERKPI_H_
+#define _EMPTYFSUSERKPI_H_
+
+// This header lets "EmptyFS.c" compile as an ordinary user-space program,
+// so that its vnode and VFS operations can be exercised (and timed) without
+// loading a KEXT.  It declares just enough of the Mac OS X 10.4 KPI to satisfy
+// EmptyFS; the implementations live in "EmptyFSUserKPI.c".
+//
+// The rules of the game are:
+//
+// o "EmptyFS.c" is compiled with KERNEL=1 and EMPTYFS_USER_KPI=1.  It includes
+//   this header instead of the kernel headers, and is otherwise unchanged.
+//
+// o Types, constants and functions that exist in the kernel KPI use their
+//   kernel names and (where it matters) their kernel values.
+//
+// o Entry points that have no kernel equivalent, and that exist only so that
+//   a harness can play the role of VFS, are prefixed with "UserKPI".
+//
+// None of this is compiled into the KEXT.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Basic Types
+
+typedef int             errno_t;
+typedef int             kern_return_t;
+typedef int             boolean_t;
+typedef uint64_t        user_addr_t;
+typedef int64_t         user_ssize_t;
+typedef uint32_t        attrgroup_t;
+typedef uintptr_t       vm_offset_t;
+typedef uintptr_t       vm_size_t;
+
+#ifndef __USE_LARGEFILE64
+    typedef uint64_t    ino64_t;
+#endif
+
+// glibc has its own fsid_t (with a differently named field), so we rename ours.
+
+#define fsid_t UserKPI_fsid_t
+typedef struct { int32_t val[2]; } fsid_t;
+
+#ifndef TRUE
+    #define TRUE    1
+#endif
+#ifndef FALSE
+    #define FALSE   0
+#endif
+
+enum {
+    KERN_SUCCESS = 0,
+    KERN_FAILURE = 5
+};
+
+#ifndef ENOTSUP
+    #define ENOTSUP EOPNOTSUPP
+#endif
+
+// EJUSTRETURN is kernel-only; VNOPLookup returns it to say that a name 
+// doesn't exist but can be created.
+
+#define EJUSTRETURN     (-2)
+
+#define MFSNAMELEN      15
+#define MFSTYPENAMELEN  16
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Asserts
+
+// <kern/assert.h> only evaluates the expression if MACH_ASSERT is set.
+// EmptyFS relies on this (for example, ValidVNode only exists in debug builds).
+
+extern void UserKPIAssertFailed(const char *file, int line, const char *expr);
+
+#if MACH_ASSERT
+    #define assert(ex) ((ex) ? (void) 0 : UserKPIAssertFailed(__FILE__, __LINE__, # ex))
+#else
+    #define assert(ex) ((void) 0)
+#endif
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Memory, Locks and Sleeping
+
+typedef struct UserKPIMallocTag *   OSMallocTag;
+
+enum {
+    OSMT_DEFAULT = 0,
+    OSMT_PAGEABLE = 1
+};
+
+extern OSMallocTag  OSMalloc_Tagalloc(const char *name, uint32_t flags);
+extern void         OSMalloc_Tagfree(OSMallocTag tag);
+extern void *       OSMalloc(uint32_t size, OSMallocTag tag);
+extern void *       OSMalloc_noblock(uint32_t size, OSMallocTag tag);
+extern void         OSFree(void *addr, uint32_t size, OSMallocTag tag);
+
+typedef struct UserKPILockGroup     lck_grp_t;
+typedef struct UserKPILockGroupAttr lck_grp_attr_t;
+typedef struct UserKPILockAttr      lck_attr_t;
+typedef struct UserKPIMutex         lck_mtx_t;
+typedef struct UserKPIRWLock        lck_rw_t;
+
+#define LCK_GRP_ATTR_NULL   ((lck_grp_attr_t *) NULL)
+#define LCK_ATTR_NULL       ((lck_attr_t *) NULL)
+
+enum {
+    LCK_MTX_ASSERT_OWNED    = 1,
+    LCK_MTX_ASSERT_NOTOWNED = 2
+};
+
+extern lck_grp_t *  lck_grp_alloc_init(const char *name, lck_grp_attr_t *attr);
+extern void         lck_grp_free(lck_grp_t *grp);
+extern lck_mtx_t *  lck_mtx_alloc_init(lck_grp_t *grp, lck_attr_t *attr);
+extern void         lck_mtx_free(lck_mtx_t *mtx, lck_grp_t *grp);
+extern void         lck_mtx_lock(lck_mtx_t *mtx);
+extern void         lck_mtx_unlock(lck_mtx_t *mtx);
+extern void         lck_mtx_assert(lck_mtx_t *mtx, unsigned int type);
+
+// Reader/writer locks.  As in the kernel, they can't be taken recursively, 
+// even for reading, and there's no way to assert ownership.
+
+extern lck_rw_t *   lck_rw_alloc_init(lck_grp_t *grp, lck_attr_t *attr);
+extern void         lck_rw_free(lck_rw_t *lck, lck_grp_t *grp);
+extern void         lck_rw_lock_shared(lck_rw_t *lck);
+extern void         lck_rw_unlock_shared(lck_rw_t *lck);
+extern void         lck_rw_lock_exclusive(lck_rw_t *lck);
+extern void         lck_rw_unlock_exclusive(lck_rw_t *lck);
+
+// msleep/wakeup.  Priorities are ignored, but PDROP is honoured.
+
+#define PINOD   8
+#define PCATCH  0x100
+#define PDROP   0x200
+
+extern int          msleep(void *chan, lck_mtx_t *mtx, int pri, const char *wmesg, struct timespec *ts);
+extern void         wakeup(void *chan);
+
+extern void         nanotime(struct timespec *ts);
+
+// In the shim, absolute time is the time stamp counter on Intel (and 
+// nanoseconds elsewhere), cpu_number is the CPU that the calling thread 
+// happens to be running on, and ml_get_max_cpus is the number of CPUs that 
+// the system is configured with.
+
+struct mach_timebase_info {
+    uint32_t    numer;
+    uint32_t    denom;
+};
+typedef struct mach_timebase_info   mach_timebase_info_data_t;
+typedef struct mach_timebase_info * mach_timebase_info_t;
+
+extern uint64_t     mach_absolute_time(void);
+extern void         clock_timebase_info(mach_timebase_info_t info);
+extern void         absolutetime_to_nanoseconds(uint64_t abstime, uint64_t *result);
+extern int          cpu_number(void);
+extern unsigned int ml_get_max_cpus(void);
+
+// Kernel threads.  kernel_thread_start returns a reference to the new thread, 
+// which the caller must drop with thread_deallocate.  A thread exits by calling 
+// thread_terminate on itself, which doesn't return.
+
+typedef struct UserKPIThread *      thread_t;
+typedef int                         wait_result_t;
+typedef void                        (*thread_continue_t)(void *parameter, wait_result_t wresult);
+
+#define THREAD_AWAKENED     0
+
+extern kern_return_t    kernel_thread_start(thread_continue_t continuation, void *parameter, thread_t *new_thread);
+extern thread_t         current_thread(void);
+extern void             thread_deallocate(thread_t thread);
+extern kern_return_t    thread_terminate(thread_t thread);
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** <libkern/OSAtomic.h>
+
+typedef int32_t         SInt32;
+typedef uint32_t        UInt32;
+typedef int64_t         SInt64;
+typedef uint64_t        UInt64;
+
+// Like their kernel counterparts, these return the value /before/ the operation 
+// and act as full memory barriers.
+
+extern SInt32       OSAddAtomic(SInt32 amount, volatile SInt32 *address);
+extern SInt32       OSIncrementAtomic(volatile SInt32 *address);
+extern SInt32       OSDecrementAtomic(volatile SInt32 *address);
+extern boolean_t    OSCompareAndSwap(UInt32 oldValue, UInt32 newValue, volatile UInt32 *address);
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Kernel Module
+
+typedef struct kmod_info {
+    int     id;
+    char    name[64];
+    char    version[64];
+} kmod_info_t;
+
+#ifndef MODULE_START
+    #define MODULE_START    com_apple_dts_kext_EmptyFS_start
+#endif
+#ifndef MODULE_STOP
+    #define MODULE_STOP     com_apple_dts_kext_EmptyFS_stop
+#endif
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Opaque VFS Types
+
+typedef struct mount *          mount_t;
+typedef struct vnode *          vnode_t;
+typedef struct vfs_context *    vfs_context_t;
+typedef struct uio *            uio_t;
+typedef struct vfstable *       vfstable_t;
+typedef struct buf *            buf_t;
+typedef struct upl *            upl_t;
+typedef int64_t                 daddr64_t;
+
+enum vtype { VNON, VREG, VDIR, VBLK, VCHR, VLNK, VSOCK, VFIFO, VBAD, VSTR, VCPLX };
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** <sys/fcntl.h>, <sys/dirent.h>
+
+#ifndef FREAD
+    #define FREAD       0x0001
+#endif
+#ifndef FWRITE
+    #define FWRITE      0x0002
+#endif
+#ifndef O_EVTONLY
+    #define O_EVTONLY   0x8000
+#endif
+
+// We can't include <dirent.h> (glibc's struct dirent has a different layout),
+// so this is the Mac OS X 10.4 definition.
+
+struct dirent {
+    uint32_t    d_fileno;
+    uint16_t    d_reclen;
+    uint8_t     d_type;
+    uint8_t     d_namlen;
+    char        d_name[255 + 1];
+};
+
+// struct direntry is what VNOPReadDir returns if it's passed 
+// VNODE_READDIR_EXTENDED (which only the NFS server does).  d_seekoff is 
+// the cookie to pass back to continue after this entry.
+
+struct direntry {
+    uint64_t    d_ino;
+    uint64_t    d_seekoff;
+    uint16_t    d_reclen;
+    uint16_t    d_namlen;
+    uint8_t     d_type;
+    char        d_name[1024];
+};
+
+#define DT_UNKNOWN   0
+#define DT_FIFO      1
+#define DT_CHR       2
+#define DT_DIR       4
+#define DT_BLK       6
+#define DT_REG       8
+#define DT_LNK      10
+#define DT_SOCK     12
+#define DT_WHT      14
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** <sys/mount.h>
+
+#define MNT_RDONLY              0x00000001
+#define MNT_SYNCHRONOUS         0x00000002
+#define MNT_NOEXEC              0x00000004
+#define MNT_NOSUID              0x00000008
+#define MNT_NODEV               0x00000010
+#define MNT_UNION               0x00000020
+#define MNT_ASYNC               0x00000040
+#define MNT_EXPORTED            0x00000100
+#define MNT_LOCAL               0x00001000
+#define MNT_QUOTA               0x00002000
+#define MNT_ROOTFS              0x00004000
+#define MNT_DOVOLFS             0x00008000
+#define MNT_UPDATE              0x00010000
+#define MNT_RELOAD              0x00040000
+#define MNT_FORCE               0x00080000
+#define MNT_DONTBROWSE          0x00100000
+#define MNT_IGNORE_OWNERSHIP    0x00200000
+#define MNT_AUTOMOUNTED         0x00400000
+#define MNT_JOURNALED           0x00800000
+#define MNT_NOUSERXATTR         0x01000000
+#define MNT_DEFWRITE            0x02000000
+
+// vflush flags
+
+#define SKIPSYSTEM      0x0001
+#define FORCECLOSE      0x0002
+#define WRITECLOSE      0x0004
+#define SKIPSWAP        0x0008
+#define SKIPROOT        0x0010
+
+// vfs_sync and VNOPFsync waitfor values
+
+#define MNT_WAIT        1
+#define MNT_NOWAIT      2
+
+struct vfsstatfs {
+    uint32_t    f_bsize;
+    size_t      f_iosize;
+    uint64_t    f_blocks;
+    uint64_t    f_bfree;
+    uint64_t    f_bavail;
+    uint64_t    f_bused;
+    uint64_t    f_files;
+    uint64_t    f_ffree;
+    fsid_t      f_fsid;
+    uid_t       f_owner;
+    uint64_t    f_flags;
+    char        f_fstypename[MFSTYPENAMELEN];
+    char        f_mntonname[MAXPATHLEN];
+    char        f_mntfromname[MAXPATHLEN];
+    uint32_t    f_fssubtype;
+    void *      f_reserved[2];
+};
+
+// Volume capabilities (see <sys/attr.h>).
+
+typedef uint32_t vol_capabilities_set_t[4];
+
+#define VOL_CAPABILITIES_FORMAT         0
+#define VOL_CAPABILITIES_INTERFACES     1
+#define VOL_CAPABILITIES_RESERVED1      2
+#define VOL_CAPABILITIES_RESERVED2      3
+
+typedef struct vol_capabilities_attr {
+    vol_capabilities_set_t  capabilities;
+    vol_capabilities_set_t  valid;
+} vol_capabilities_attr_t;
+
+#define VOL_CAP_FMT_PERSISTENTOBJECTIDS     0x00000001
+#define VOL_CAP_FMT_SYMBOLICLINKS           0x00000002
+#define VOL_CAP_FMT_HARDLINKS               0x00000004
+#define VOL_CAP_FMT_JOURNAL                 0x00000008
+#define VOL_CAP_FMT_JOURNAL_ACTIVE          0x00000010
+#define VOL_CAP_FMT_NO_ROOT_TIMES           0x00000020
+#define VOL_CAP_FMT_SPARSE_FILES            0x00000040
+#define VOL_CAP_FMT_ZERO_RUNS               0x00000080
+#define VOL_CAP_FMT_CASE_SENSITIVE          0x00000100
+#define VOL_CAP_FMT_CASE_PRESERVING         0x00000200
+#define VOL_CAP_FMT_FAST_STATFS             0x00000400
+#define VOL_CAP_FMT_2TB_FILESIZE            0x00000800
+
+#define VOL_CAP_INT_SEARCHFS                0x00000001
+#define VOL_CAP_INT_ATTRLIST                0x00000002
+#define VOL_CAP_INT_NFSEXPORT               0x00000004
+#define VOL_CAP_INT_READDIRATTR             0x00000008
+#define VOL_CAP_INT_EXCHANGEDATA            0x00000010
+#define VOL_CAP_INT_COPYFILE                0x00000020
+#define VOL_CAP_INT_ALLOCATE                0x00000040
+#define VOL_CAP_INT_VOL_RENAME              0x00000080
+#define VOL_CAP_INT_ADVLOCK                 0x00000100
+#define VOL_CAP_INT_FLOCK                   0x00000200
+#define VOL_CAP_INT_EXTENDED_SECURITY       0x00000400
+#define VOL_CAP_INT_USERACCESS              0x00000800
+
+typedef struct attribute_set {
+    attrgroup_t commonattr;
+    attrgroup_t volattr;
+    attrgroup_t dirattr;
+    attrgroup_t fileattr;
+    attrgroup_t forkattr;
+} attribute_set_t;
+
+typedef struct vol_attributes_attr {
+    attribute_set_t validattr;
+    attribute_set_t nativeattr;
+} vol_attributes_attr_t;
+
+#define ATTR_CMN_NAME                       0x00000001
+#define ATTR_CMN_DEVID                      0x00000002
+#define ATTR_CMN_FSID                       0x00000004
+#define ATTR_CMN_OBJTYPE                    0x00000008
+#define ATTR_CMN_OBJTAG                     0x00000010
+#define ATTR_CMN_OBJID                      0x00000020
+#define ATTR_CMN_OBJPERMANENTID             0x00000040
+#define ATTR_CMN_PAROBJID                   0x00000080
+#define ATTR_CMN_SCRIPT                     0x00000100
+#define ATTR_CMN_CRTIME                     0x00000200
+#define ATTR_CMN_MODTIME                    0x00000400
+#define ATTR_CMN_CHGTIME                    0x00000800
+#define ATTR_CMN_ACCTIME                    0x00001000
+#define ATTR_CMN_BKUPTIME                   0x00002000
+#define ATTR_CMN_FNDRINFO                   0x00004000
+#define ATTR_CMN_OWNERID                    0x00008000
+#define ATTR_CMN_GRPID                      0x00010000
+#define ATTR_CMN_ACCESSMASK                 0x00020000
+#define ATTR_CMN_FLAGS                      0x00040000
+#define ATTR_CMN_USERACCESS                 0x00200000
+#define ATTR_CMN_EXTENDED_SECURITY          0x00400000
+#define ATTR_CMN_UUID                       0x00800000
+#define ATTR_CMN_GRPUUID                    0x01000000
+
+#define ATTR_VOL_FSTYPE                     0x00000001
+#define ATTR_VOL_SIGNATURE                  0x00000002
+#define ATTR_VOL_SIZE                       0x00000004
+#define ATTR_VOL_SPACEFREE                  0x00000008
+#define ATTR_VOL_SPACEAVAIL                 0x00000010
+#define ATTR_VOL_MINALLOCATION              0x00000020
+#define ATTR_VOL_ALLOCATIONCLUMP            0x00000040
+#define ATTR_VOL_IOBLOCKSIZE                0x00000080
+#define ATTR_VOL_OBJCOUNT                   0x00000100
+#define ATTR_VOL_FILECOUNT                  0x00000200
+#define ATTR_VOL_DIRCOUNT                   0x00000400
+#define ATTR_VOL_MAXOBJCOUNT                0x00000800
+#define ATTR_VOL_MOUNTPOINT                 0x00001000
+#define ATTR_VOL_NAME                       0x00002000
+#define ATTR_VOL_MOUNTFLAGS                 0x00004000
+#define ATTR_VOL_MOUNTEDDEVICE              0x00008000
+#define ATTR_VOL_ENCODINGSUSED              0x00010000
+#define ATTR_VOL_CAPABILITIES               0x00020000
+#define ATTR_VOL_ATTRIBUTES                 0x40000000
+#define ATTR_VOL_INFO                       0x80000000
+
+#define ATTR_DIR_LINKCOUNT                  0x00000001
+#define ATTR_DIR_ENTRYCOUNT                 0x00000002
+#define ATTR_DIR_MOUNTSTATUS                0x00000004
+
+#define ATTR_FILE_LINKCOUNT                 0x00000001
+#define ATTR_FILE_TOTALSIZE                 0x00000002
+#define ATTR_FILE_ALLOCSIZE                 0x00000004
+#define ATTR_FILE_IOBLOCKSIZE               0x00000008
+#define ATTR_FILE_DEVTYPE                   0x00000020
+#define ATTR_FILE_FORKCOUNT                 0x00000080
+#define ATTR_FILE_FORKLIST                  0x00000100
+#define ATTR_FILE_DATALENGTH                0x00000200
+#define ATTR_FILE_DATAALLOCSIZE             0x00000400
+#define ATTR_FILE_RSRCLENGTH                0x00001000
+#define ATTR_FILE_RSRCALLOCSIZE             0x00002000
+
+// struct attrlist, and the types used in an attribute buffer.  These are 
+// what a file system's VNOPReaddirattr needs to pack entries in the 
+// format of <x-man-page://2/getattrlist>.
+
+#define ATTR_BIT_MAP_COUNT                  5
+
+struct attrlist {
+    u_short     bitmapcount;                // must be ATTR_BIT_MAP_COUNT
+    uint16_t    reserved;
+    attrgroup_t commonattr;
+    attrgroup_t volattr;
+    attrgroup_t dirattr;
+    attrgroup_t fileattr;
+    attrgroup_t forkattr;
+};
+
+typedef struct attrreference {
+    int32_t     attr_dataoffset;            // relative to the attrreference itself
+    uint32_t    attr_length;
+} attrreference_t;
+
+typedef uint32_t fsobj_type_t;
+
+typedef struct fsobj_id {
+    uint32_t    fid_objno;
+    uint32_t    fid_generation;
+} fsobj_id_t;
+
+#define FSOPT_NOFOLLOW                      0x00000001
+#define FSOPT_NOINMEMUPDATE                 0x00000002
+
+// struct vfs_attr, and the VFSATTR_XXX macros that go with it.
+
+struct vfs_attr {
+    uint64_t                f_supported;
+    uint64_t                f_active;
+
+    uint64_t                f_objcount;
+    uint64_t                f_filecount;
+    uint64_t                f_dircount;
+    uint64_t                f_maxobjcount;
+
+    uint32_t                f_bsize;
+    size_t                  f_iosize;
+    uint64_t                f_blocks;
+    uint64_t                f_bfree;
+    uint64_t                f_bavail;
+    uint64_t                f_bused;
+    uint64_t                f_files;
+    uint64_t                f_ffree;
+    fsid_t                  f_fsid;
+    uid_t                   f_owner;
+
+    vol_capabilities_attr_t f_capabilities;
+    vol_attributes_attr_t   f_attributes;
+
+    struct timespec         f_create_time;
+    struct timespec         f_modify_time;
+    struct timespec         f_access_time;
+    struct timespec         f_backup_time;
+
+    uint32_t                f_fssubtype;
+    char *                  f_vol_name;
+    uint16_t                f_signature;
+    uint16_t                f_carbon_fsid;
+};
+
+#define VFSATTR_f_objcount          (1LL <<  0)
+#define VFSATTR_f_filecount         (1LL <<  1)
+#define VFSATTR_f_dircount          (1LL <<  2)
+#define VFSATTR_f_maxobjcount       (1LL <<  3)
+#define VFSATTR_f_bsize             (1LL <<  4)
+#define VFSATTR_f_iosize            (1LL <<  5)
+#define VFSATTR_f_blocks            (1LL <<  6)
+#define VFSATTR_f_bfree             (1LL <<  7)
+#define VFSATTR_f_bavail            (1LL <<  8)
+#define VFSATTR_f_bused             (1LL <<  9)
+#define VFSATTR_f_files             (1LL << 10)
+#define VFSATTR_f_ffree             (1LL << 11)
+#define VFSATTR_f_fsid              (1LL << 12)
+#define VFSATTR_f_owner             (1LL << 13)
+#define VFSATTR_f_capabilities      (1LL << 14)
+#define VFSATTR_f_attributes        (1LL << 15)
+#define VFSATTR_f_create_time       (1LL << 16)
+#define VFSATTR_f_modify_time       (1LL << 17)
+#define VFSATTR_f_access_time       (1LL << 18)
+#define VFSATTR_f_backup_time       (1LL << 19)
+#define VFSATTR_f_fssubtype         (1LL << 20)
+#define VFSATTR_f_vol_name          (1LL << 21)
+#define VFSATTR_f_signature         (1LL << 22)
+#define VFSATTR_f_carbon_fsid       (1LL << 23)
+
+#define VFSATTR_INIT(s)             ((s)->f_supported = (s)->f_active = 0LL)
+#define VFSATTR_SET_SUPPORTED(s, a) ((s)->f_supported |= VFSATTR_ ## a)
+#define VFSATTR_IS_SUPPORTED(s, a)  ((s)->f_supported & VFSATTR_ ## a)
+#define VFSATTR_CLEAR_ACTIVE(s, a)  ((s)->f_active &= ~VFSATTR_ ## a)
+#define VFSATTR_IS_ACTIVE(s, a)     ((s)->f_active & VFSATTR_ ## a)
+#define VFSATTR_ALL_SUPPORTED(s)    (((s)->f_active & (s)->f_supported) == (s)->f_active)
+#define VFSATTR_WANTED(s, a)        ((s)->f_active |= VFSATTR_ ## a)
+#define VFSATTR_RETURN(s, a, x)     do { (s)->a = (x); VFSATTR_SET_SUPPORTED(s, a);} while(0)
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** <sys/vnode.h>
+
+// struct vnode_attr, and the VATTR_XXX macros that go with it.
+
+struct vnode_attr {
+    uint64_t        va_supported;
+    uint64_t        va_active;
+    int             va_vaflags;
+
+    dev_t           va_rdev;
+    uint64_t        va_nlink;
+    uint64_t        va_total_size;
+    uint64_t        va_total_alloc;
+    uint64_t        va_data_size;
+    uint64_t        va_data_alloc;
+    uint32_t        va_iosize;
+
+    uid_t           va_uid;
+    gid_t           va_gid;
+    mode_t          va_mode;
+    uint32_t        va_flags;
+    void *          va_acl;
+
+    struct timespec va_create_time;
+    struct timespec va_access_time;
+    struct timespec va_modify_time;
+    struct timespec va_change_time;
+    struct timespec va_backup_time;
+
+    uint64_t        va_fileid;
+    uint64_t        va_linkid;
+    uint64_t        va_parentid;
+    uint32_t        va_fsid;
+    uint64_t        va_filerev;
+    uint32_t        va_gen;
+    uint32_t        va_encoding;
+
+    enum vtype      va_type;
+    char *          va_name;
+    unsigned char   va_uuuid[16];
+    unsigned char   va_guuid[16];
+
+    uint64_t        va_nchildren;
+};
+
+#define VNODE_ATTR_va_rdev          (1LL <<  0)
+#define VNODE_ATTR_va_nlink         (1LL <<  1)
+#define VNODE_ATTR_va_total_size    (1LL <<  2)
+#define VNODE_ATTR_va_total_alloc   (1LL <<  3)
+#define VNODE_ATTR_va_data_size     (1LL <<  4)
+#define VNODE_ATTR_va_data_alloc    (1LL <<  5)
+#define VNODE_ATTR_va_iosize        (1LL <<  6)
+#define VNODE_ATTR_va_uid           (1LL <<  7)
+#define VNODE_ATTR_va_gid           (1LL <<  8)
+#define VNODE_ATTR_va_mode          (1LL <<  9)
+#define VNODE_ATTR_va_flags         (1LL << 10)
+#define VNODE_ATTR_va_acl           (1LL << 11)
+#define VNODE_ATTR_va_create_time   (1LL << 12)
+#define VNODE_ATTR_va_access_time   (1LL << 13)
+#define VNODE_ATTR_va_modify_time   (1LL << 14)
+#define VNODE_ATTR_va_change_time   (1LL << 15)
+#define VNODE_ATTR_va_backup_time   (1LL << 16)
+#define VNODE_ATTR_va_fileid        (1LL << 17)
+#define VNODE_ATTR_va_linkid        (1LL << 18)
+#define VNODE_ATTR_va_parentid      (1LL << 19)
+#define VNODE_ATTR_va_fsid          (1LL << 20)
+#define VNODE_ATTR_va_filerev       (1LL << 21)
+#define VNODE_ATTR_va_gen           (1LL << 22)
+#define VNODE_ATTR_va_encoding      (1LL << 23)
+#define VNODE_ATTR_va_type          (1LL << 24)
+#define VNODE_ATTR_va_name          (1LL << 25)
+#define VNODE_ATTR_va_uuuid         (1LL << 26)
+#define VNODE_ATTR_va_guuid         (1LL << 27)
+#define VNODE_ATTR_va_nchildren     (1LL << 28)
+
+#define VATTR_INIT(v)               do {(v)->va_supported = (v)->va_active = 0ll; (v)->va_vaflags = 0;} while(0)
+#define VATTR_SET_ACTIVE(v, a)      ((v)->va_active |= VNODE_ATTR_ ## a)
+#define VATTR_SET_SUPPORTED(v, a)   ((v)->va_supported |= VNODE_ATTR_ ## a)
+#define VATTR_IS_SUPPORTED(v, a)    ((v)->va_supported & VNODE_ATTR_ ## a)
+#define VATTR_CLEAR_ACTIVE(v, a)    ((v)->va_active &= ~VNODE_ATTR_ ## a)
+#define VATTR_IS_ACTIVE(v, a)       ((v)->va_active & VNODE_ATTR_ ## a)
+#define VATTR_ALL_SUPPORTED(v)      (((v)->va_active & (v)->va_supported) == (v)->va_active)
+#define VATTR_WANTED(v, a)          VATTR_SET_ACTIVE(v, a)
+#define VATTR_RETURN(v, a, x)       do { (v)->a = (x); VATTR_SET_SUPPORTED(v, a);} while(0)
+#define VATTR_SET(v, a, x)          do { (v)->a = (x); VATTR_SET_ACTIVE(v, a);} while(0)
+
+// struct componentname, as passed to VNOPLookup.
+
+struct componentname {
+    uint32_t    cn_nameiop;
+    uint32_t    cn_flags;
+    void *      cn_context;
+    char *      cn_pnbuf;
+    int         cn_pnlen;
+    char *      cn_nameptr;
+    int         cn_namelen;
+    uint32_t    cn_hash;
+    int         cn_consume;
+};
+
+#define LOOKUP      0
+#define CREATE      1
+#define DELETE      2
+#define RENAME      3
+
+#define FOLLOW      0x00000040
+#define ISDOTDOT    0x00002000
+#define MAKEENTRY   0x00004000
+#define ISLASTCN    0x00008000
+
+// vnode_create parameters.
+
+#define VNCREATE_FLAVOR 0
+
+#define VNFS_NOCACHE    0x01
+#define VNFS_CANTCACHE  0x02
+#define VNFS_ADDFSREF   0x04
+
+struct vnode_fsparam {
+    mount_t                 vnfs_mp;
+    enum vtype              vnfs_vtype;
+    const char *            vnfs_str;
+    vnode_t                 vnfs_dvp;
+    void *                  vnfs_fsnode;
+    int                     (**vnfs_vops)(void *);
+    int                     vnfs_markroot;
+    int                     vnfs_marksystem;
+    dev_t                   vnfs_rdev;
+    off_t                   vnfs_filesize;
+    struct componentname *  vnfs_cnp;
+    uint32_t                vnfs_flags;
+};
+
+#define VNODE_READDIR_EXTENDED      0x0001
+#define VNODE_READDIR_REQSEEKOFF    0x0002
+
+// ioflag values for VNOPRead and friends.
+
+#define IO_UNIT         0x0001
+#define IO_APPEND       0x0002
+#define IO_SYNC         0x0004
+#define IO_NODELOCKED   0x0008
+#define IO_NDELAY       0x0010
+#define IO_NOZEROFILL   0x0020
+#define IO_TAILZEROFILL 0x0040
+#define IO_HEADZEROFILL 0x0080
+#define IO_CLOSE        0x0400
+#define IO_NOCACHE      0x0800
+#define IO_RAOFF        0x1000
+
+// VNOPBlockmap flags.
+
+#define VNODE_READ      0x01
+#define VNODE_WRITE     0x02
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** <sys/vnode_if.h>
+
+// Each vnode operation has a descriptor.  vfs_fsadd uses vdesc_offset to place
+// the file system's implementation in the vnode operations vector.
+
+struct vnodeop_desc {
+    int             vdesc_offset;
+    const char *    vdesc_name;
+};
+
+struct vnodeopv_entry_desc {
+    struct vnodeop_desc *   opve_op;
+    int                     (*opve_impl)(void *);
+};
+
+struct vnodeopv_desc {
+    int                             (***opv_desc_vector_p)(void *);
+    struct vnodeopv_entry_desc *    opv_desc_ops;
+};
+
+#define USERKPI_VNOP_LIST(X) \
+    X(default)      X(access)       X(advlock)      X(allocate)     X(blktooff)     \
+    X(blockmap)     X(bwrite)       X(close)        X(copyfile)     X(create)       \
+    X(exchange)     X(fsync)        X(getattr)      X(getattrlist)  X(getxattr)     \
+    X(inactive)     X(ioctl)        X(link)         X(listxattr)    X(lookup)       \
+    X(mkdir)        X(mknod)        X(mmap)         X(mnomap)       X(offtoblk)     \
+    X(open)         X(pagein)       X(pageout)      X(pathconf)     X(read)         \
+    X(readdir)      X(readdirattr)  X(readlink)     X(reclaim)      X(remove)       \
+    X(removexattr)  X(rename)       X(revoke)       X(rmdir)        X(searchfs)     \
+    X(select)       X(setattr)      X(setattrlist)  X(setxattr)     X(strategy)     \
+    X(symlink)      X(whiteout)     X(write)
+
+#define USERKPI_DECLARE_VNOP_DESC(name) extern struct vnodeop_desc vnop_ ## name ## _desc;
+USERKPI_VNOP_LIST(USERKPI_DECLARE_VNOP_DESC)
+#undef USERKPI_DECLARE_VNOP_DESC
+
+extern int vn_default_error(void);
+
+struct vnop_lookup_args {
+    struct vnodeop_desc *   a_desc;
+    vnode_t                 a_dvp;
+    vnode_t *               a_vpp;
+    struct componentname *  a_cnp;
+    vfs_context_t           a_context;
+};
+
+struct vnop_open_args {
+    struct vnodeop_desc *   a_desc;
+    vnode_t                 a_vp;
+    int                     a_mode;
+    vfs_context_t           a_context;
+};
+
+struct vnop_close_args {
+    struct vnodeop_desc *   a_desc;
+    vnode_t                 a_vp;
+    int                     a_fflag;
+    vfs_context_t           a_context;
+};
+
+struct vnop_getattr_args {
+    struct vnodeop_desc *   a_desc;
+    vnode_t                 a_vp;
+    struct vnode_attr *     a_vap;
+    vfs_context_t           a_context;
+};
+
+struct vnop_readdir_args {
+    struct vnodeop_desc *   a_desc;
+    vnode_t                 a_vp;
+    struct uio *            a_uio;
+    int                     a_flags;
+    int *                   a_eofflag;
+    int *                   a_numdirent;
+    vfs_context_t           a_context;
+};
+
+struct vnop_readdirattr_args {
+    struct vnodeop_desc *   a_desc;
+    vnode_t                 a_vp;
+    struct attrlist *       a_alist;
+    struct uio *            a_uio;
+    u_long                  a_maxcount;
+    u_long                  a_options;
+    u_long *                a_newstate;
+    int *                   a_eofflag;
+    u_long *                a_actualcount;
+    vfs_context_t           a_context;
+};
+
+struct vnop_read_args {
+    struct vnodeop_desc *   a_desc;
+    vnode_t                 a_vp;
+    struct uio *            a_uio;
+    int                     a_ioflag;
+    vfs_context_t           a_context;
+};
+
+struct vnop_write_args {
+    struct vnodeop_desc *   a_desc;
+    vnode_t                 a_vp;
+    struct uio *            a_uio;
+    int                     a_ioflag;
+    vfs_context_t           a_context;
+};
+
+struct vnop_create_args {
+    struct vnodeop_desc *   a_desc;
+    vnode_t                 a_dvp;
+    vnode_t *               a_vpp;
+    struct componentname *  a_cnp;
+    struct vnode_attr *     a_vap;
+    vfs_context_t           a_context;
+};
+
+struct vnop_remove_args {
+    struct vnodeop_desc *   a_desc;
+    vnode_t                 a_dvp;
+    vnode_t                 a_vp;
+    struct componentname *  a_cnp;
+    int                     a_flags;
+    vfs_context_t           a_context;
+};
+
+struct vnop_fsync_args {
+    struct vnodeop_desc *   a_desc;
+    vnode_t                 a_vp;
+    int                     a_waitfor;
+    vfs_context_t           a_context;
+};
+
+struct vnop_setattr_args {
+    struct vnodeop_desc *   a_desc;
+    vnode_t                 a_vp;
+    struct vnode_attr *     a_vap;
+    vfs_context_t           a_context;
+};
+
+// a_flags values for VNOPAllocate (the same as the fst_flags of F_PREALLOCATE).
+
+#define PREALLOCATE         0x00000001
+#define ALLOCATECONTIG      0x00000002
+#define ALLOCATEALL         0x00000004
+#define ALLOCATEFROMPEOF    0x00000010
+#define ALLOCATEFROMVOL     0x00000020
+
+struct vnop_allocate_args {
+    struct vnodeop_desc *   a_desc;
+    vnode_t                 a_vp;
+    off_t                   a_length;
+    u_int32_t               a_flags;
+    off_t *                 a_bytesallocated;
+    off_t                   a_offset;
+    vfs_context_t           a_context;
+};
+
+struct vnop_blockmap_args {
+    struct vnodeop_desc *   a_desc;
+    vnode_t                 a_vp;
+    off_t                   a_foffset;
+    size_t                  a_size;
+    daddr64_t *             a_bpn;
+    size_t *                a_run;
+    void *                  a_poff;
+    int                     a_flags;
+    vfs_context_t           a_context;
+};
+
+struct vnop_strategy_args {
+    struct vnodeop_desc *   a_desc;
+    struct buf *            a_bp;
+};
+
+struct vnop_blktooff_args {
+    struct vnodeop_desc *   a_desc;
+    vnode_t                 a_vp;
+    daddr64_t               a_lblkno;
+    off_t *                 a_offset;
+};
+
+struct vnop_offtoblk_args {
+    struct vnodeop_desc *   a_desc;
+    vnode_t                 a_vp;
+    off_t                   a_offset;
+    daddr64_t *             a_lblkno;
+};
+
+struct vnop_mmap_args {
+    struct vnodeop_desc *   a_desc;
+    vnode_t                 a_vp;
+    int                     a_fflags;
+    vfs_context_t           a_context;
+};
+
+struct vnop_mnomap_args {
+    struct vnodeop_desc *   a_desc;
+    vnode_t                 a_vp;
+    vfs_context_t           a_context;
+};
+
+struct vnop_pagein_args {
+    struct vnodeop_desc *   a_desc;
+    vnode_t                 a_vp;
+    upl_t                   a_pl;
+    vm_offset_t             a_pl_offset;
+    off_t                   a_f_offset;
+    size_t                  a_size;
+    int                     a_flags;
+    vfs_context_t           a_context;
+};
+
+struct vnop_inactive_args {
+    struct vnodeop_desc *   a_desc;
+    vnode_t                 a_vp;
+    vfs_context_t           a_context;
+};
+
+struct vnop_reclaim_args {
+    struct vnodeop_desc *   a_desc;
+    vnode_t                 a_vp;
+    vfs_context_t           a_context;
+};
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** VFS Registration
+
+struct vfsconf;
+
+struct vfsops {
+    int     (*vfs_mount)(struct mount *mp, vnode_t devvp, user_addr_t data, vfs_context_t context);
+    int     (*vfs_start)(struct mount *mp, int flags, vfs_context_t context);
+    int     (*vfs_unmount)(struct mount *mp, int mntflags, vfs_context_t context);
+    int     (*vfs_root)(struct mount *mp, struct vnode **vpp, vfs_context_t context);
+    int     (*vfs_quotactl)(struct mount *mp, int cmds, uid_t uid, caddr_t arg, vfs_context_t context);
+    int     (*vfs_getattr)(struct mount *mp, struct vfs_attr *, vfs_context_t context);
+    int     (*vfs_sync)(struct mount *mp, int waitfor, vfs_context_t context);
+    int     (*vfs_vget)(struct mount *mp, ino64_t ino, struct vnode **vpp, vfs_context_t context);
+    int     (*vfs_fhtovp)(struct mount *mp, int fhlen, unsigned char *fhp, struct vnode **vpp, vfs_context_t context);
+    int     (*vfs_vptofh)(struct vnode *vp, int *fhlen, unsigned char *fhp, vfs_context_t context);
+    int     (*vfs_init)(struct vfsconf *);
+    int     (*vfs_sysctl)(int *, u_int, user_addr_t, size_t *, user_addr_t, size_t, vfs_context_t context);
+    int     (*vfs_setattr)(struct mount *mp, struct vfs_attr *, vfs_context_t context);
+    void *  vfs_reserved[7];
+};
+
+#define VFS_TBLTHREADSAFE       0x0001
+#define VFS_TBLFSNODELOCK       0x0002
+#define VFS_TBLNOTYPENUM        0x0008
+#define VFS_TBLLOCALVOL         0x0010
+#define VFS_TBL64BITREADY       0x0020
+
+struct vfs_fsentry {
+    struct vfsops *             vfe_vfsops;
+    int                         vfe_vopcnt;
+    struct vnodeopv_desc **     vfe_opvdescs;
+    int                         vfe_fstypenum;
+    char                        vfe_fsname[MFSNAMELEN];
+    uint32_t                    vfe_flags;
+    void *                      vfe_reserv[2];
+};
+
+extern int      vfs_fsadd(struct vfs_fsentry *vfe, vfstable_t *handle);
+extern int      vfs_fsremove(vfstable_t handle);
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Mount KPI
+
+extern void *               vfs_fsprivate(mount_t mp);
+extern void                 vfs_setfsprivate(mount_t mp, void *mntdata);
+extern struct vfsstatfs *   vfs_statfs(mount_t mp);
+extern int                  vfs_typenum(mount_t mp);
+extern int                  vfs_isupdate(mount_t mp);
+extern int                  vfs_isrdonly(mount_t mp);
+extern uint64_t             vfs_flags(mount_t mp);
+extern void                 vfs_setflags(mount_t mp, uint64_t flags);
+extern void                 vfs_clearflags(mount_t mp, uint64_t flags);
+extern int                  vflush(mount_t mp, vnode_t skipvp, int flags);
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** VNode KPI
+
+extern errno_t      vnode_create(int flavor, size_t size, void *data, vnode_t *vpp);
+extern uint32_t     vnode_vid(vnode_t vp);
+extern int          vnode_get(vnode_t vp);
+extern int          vnode_getwithvid(vnode_t vp, uint32_t vid);
+extern int          vnode_put(vnode_t vp);
+extern int          vnode_ref(vnode_t vp);
+extern void         vnode_rele(vnode_t vp);
+extern int          vnode_recycle(vnode_t vp);
+extern int          vnode_addfsref(vnode_t vp);
+extern int          vnode_removefsref(vnode_t vp);
+extern mount_t      vnode_mount(vnode_t vp);
+extern enum vtype   vnode_vtype(vnode_t vp);
+extern int          vnode_isdir(vnode_t vp);
+extern int          vnode_isreg(vnode_t vp);
+extern int          vnode_isvroot(vnode_t vp);
+extern void *       vnode_fsnode(vnode_t vp);
+extern void         vnode_clearfsnode(vnode_t vp);
+extern dev_t        vnode_specrdev(vnode_t vp);
+
+// The name cache.  cache_lookup returns -1 for a positive hit (with an I/O 
+// reference on *vpp), ENOENT for a negative hit, and 0 for a miss.
+
+extern int          cache_lookup(vnode_t dvp, vnode_t *vpp, struct componentname *cnp);
+extern void         cache_enter(vnode_t dvp, vnode_t vp, struct componentname *cnp);
+extern void         cache_purge(vnode_t vp);
+extern void         cache_purge_negatives(vnode_t vp);
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** <sys/buf.h>, <sys/disk.h>
+
+// The buffer cache.  It's only used for metadata, and only on device vnodes. 
+// As in the kernel, blkno is in units of the device's block size
+// (DKIOCGETBLOCKSIZE), and buf_bread/buf_meta_bread return a buffer in *bpp 
+// even if they fail, which the caller must release with buf_brelse.
+//
+// A buffer that you've read (or got with buf_getblk, which doesn't read) 
+// can be written with buf_bwrite, which writes it immediately, or buf_bdwrite, 
+// which marks it dirty and releases it; the buffer cache writes it later, 
+// when it's evicted or when someone calls buf_flushdirtyblks.  Either way, 
+// the buffer is released.
+//
+// A buffer with B_LOCKED set (see buf_setflags) is never evicted, or written 
+// by buf_flushdirtyblks, even if it's dirty, until the flag is cleared.  A 
+// journalling file system uses this to keep a metadata block from going to 
+// disk before its journal transaction does.  The kernel's 
+// buf_flushdirtyblks only skips such buffers if you pass BUF_SKIP_LOCKED, 
+// so pass that; we always skip them.  Unlike the kernel, we only let you 
+// change B_LOCKED while the buffer is busy.
+//
+// buf_fromcache tells you whether the buffer that you just got was already 
+// in the cache, rather than read from the disk, so that a file system that 
+// checks what it reads (say, a checksum) need only do so once per read from 
+// the disk.
+//
+// File data doesn't go through the buffer cache; the cluster layer (see 
+// <sys/ubc.h>, below) builds a buffer for each I/O and passes it to the 
+// file system's VNOPStrategy, which passes it on to buf_strategy.
+
+typedef struct ucred *          kauth_cred_t;
+
+#define NOCRED ((kauth_cred_t) -1)
+
+extern errno_t      buf_bread(vnode_t vp, daddr64_t blkno, int size, kauth_cred_t cred, buf_t *bpp);
+extern errno_t      buf_meta_bread(vnode_t vp, daddr64_t blkno, int size, kauth_cred_t cred, buf_t *bpp);
+extern uintptr_t    buf_dataptr(buf_t bp);
+extern uint32_t     buf_count(buf_t bp);
+extern daddr64_t    buf_blkno(buf_t bp);
+extern errno_t      buf_error(buf_t bp);
+extern void         buf_markinvalid(buf_t bp);
+extern int          buf_fromcache(buf_t bp);
+extern void         buf_brelse(buf_t bp);
+extern void         buf_clear(buf_t bp);
+
+#define BLK_READ        0x01
+#define BLK_WRITE       0x02
+#define BLK_META        0x10
+
+extern buf_t        buf_getblk(vnode_t vp, daddr64_t blkno, int size, int slpflag, int slptimeo, int operation);
+extern errno_t      buf_bwrite(buf_t bp);
+extern void         buf_bdwrite(buf_t bp);
+extern void         buf_flushdirtyblks(vnode_t vp, int wait, int flags, const char *msg);
+
+#define BUF_SKIP_LOCKED 0x02
+
+#define B_WRITE         0x00000000
+#define B_READ          0x00000001
+#define B_LOCKED        0x00000010
+
+extern vnode_t      buf_vnode(buf_t bp);
+extern int32_t      buf_flags(buf_t bp);
+extern void         buf_setflags(buf_t bp, int32_t flags);
+extern void         buf_clearflags(buf_t bp, int32_t flags);
+extern daddr64_t    buf_lblkno(buf_t bp);
+extern void         buf_setblkno(buf_t bp, daddr64_t blkno);
+extern void         buf_seterror(buf_t bp, errno_t error);
+extern void         buf_biodone(buf_t bp);
+extern errno_t      buf_strategy(vnode_t devvp, void *ap);
+
+// Device ioctls.  The values are those of the Mac OS X _IO and _IOR macros, 
+// so that they don't collide with any Linux ioctl.  Device vnodes always 
+// report a 512 byte block size.  DKIOCSYNCHRONIZECACHE (flush the drive's 
+// write cache) is an fsync of the device file.
+
+#define DKIOCSYNCHRONIZECACHE   0x20006416      // _IO('d', 22)
+#define DKIOCGETBLOCKSIZE       0x40046418      // _IOR('d', 24, uint32_t)
+#define DKIOCGETBLOCKCOUNT      0x40086419      // _IOR('d', 25, uint64_t)
+
+extern errno_t      VNOP_IOCTL(vnode_t vp, unsigned long command, caddr_t data, int fflag, vfs_context_t context);
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** <sys/ubc.h>
+
+// The unified buffer cache (UBC) caches file data in pages.  cluster_read 
+// copies from the cache to the UIO, reading any missing pages from the 
+// device first, in I/Os that are as large as the file's layout (as reported 
+// by VNOPBlockmap) allows.  advisory_read brings pages into the cache without 
+// copying them anywhere.  Unlike the kernel, the shim does no read-ahead of 
+// its own, and advisory_read is synchronous.
+//
+// cluster_write copies from the UIO into the cache, reading in any partially 
+// overwritten page that lies within oldEOF, and zero filling from headOff to 
+// the start of the write if IO_HEADZEROFILL is set.  The pages are left dirty. 
+// As in the kernel, the UIO can be NULL, in which case the only thing written 
+// is the zero fill, from headOff to newEOF. 
+// cluster_push writes a vnode's dirty pages, coalescing adjacent pages into 
+// I/Os of up to 1 MB, and calling VNOPBlockmap (with VNODE_WRITE) and then 
+// VNOPStrategy for each I/O.  Unlike the kernel, cluster_write never starts 
+// any I/O itself unless IO_SYNC is set; pushing dirty pages is entirely up 
+// to the file system.  ubc_setsize tells the UBC the file's size; if the file 
+// shrinks, pages beyond the new end of file are thrown away, dirty or not, 
+// and the tail of the last page is zeroed.
+
+#ifndef PAGE_SIZE
+    #define PAGE_SIZE       4096
+#endif
+#define PAGE_SIZE_64        ((off_t) PAGE_SIZE)
+
+extern int          cluster_read(vnode_t vp, struct uio *uio, off_t filesize, int flags);
+extern int          advisory_read(vnode_t vp, off_t filesize, off_t f_offset, int resid);
+extern int          cluster_write(vnode_t vp, struct uio *uio, off_t oldEOF, off_t newEOF, off_t headOff, off_t tailOff, int flags);
+extern int          cluster_push(vnode_t vp, int flags);
+extern int          ubc_setsize(vnode_t vp, off_t size);
+
+// Paging.  When a mapped file takes a page fault, VM builds a UPL (a universal 
+// page list) of busy pages in the UBC and passes it to the file system's 
+// VNOPPagein, which normally passes it straight on to cluster_pagein.  
+// cluster_pagein reads the data directly into the UPL's pages and then, 
+// unless UPL_NOCOMMIT is set, commits them (making them valid) or, if the 
+// I/O fails, aborts them.  A file system that fails a pagein without 
+// calling cluster_pagein must abort the range itself.  A file system that 
+// fills the pages itself maps the UPL into the kernel's address space with 
+// ubc_upl_map, and unmaps it with ubc_upl_unmap before committing it.
+
+#define UPL_IOSYNC                  0x01
+#define UPL_NOCOMMIT                0x02
+#define UPL_NORDAHEAD               0x04
+
+#define UPL_COMMIT_FREE_ON_EMPTY    0x01
+#define UPL_ABORT_ERROR             0x04
+#define UPL_ABORT_FREE_ON_EMPTY     0x08
+
+#ifndef PROT_READ
+    #define PROT_READ               0x01
+    #define PROT_WRITE              0x02
+    #define PROT_EXEC               0x04
+#endif
+
+#ifndef MAP_SHARED
+    #define MAP_SHARED              0x0001
+    #define MAP_PRIVATE             0x0002
+#endif
+
+extern int              cluster_pagein(vnode_t vp, upl_t upl, vm_offset_t upl_offset, off_t f_offset, int size, off_t filesize, int flags);
+extern kern_return_t    ubc_upl_commit_range(upl_t upl, vm_offset_t offset, vm_size_t size, int flags);
+extern kern_return_t    ubc_upl_abort_range(upl_t upl, vm_offset_t offset, vm_size_t size, int abort_flags);
+extern kern_return_t    ubc_upl_map(upl_t upl, vm_offset_t *dst_addr);
+extern kern_return_t    ubc_upl_unmap(upl_t upl);
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** UIO and Copying
+
+enum uio_seg {
+    UIO_USERSPACE   = 0,
+    UIO_SYSSPACE    = 2,
+    UIO_USERSPACE32 = 5,
+    UIO_USERSPACE64 = 8,
+    UIO_SYSSPACE32  = 11
+};
+
+enum uio_rw { UIO_READ = 0, UIO_WRITE = 1 };
+
+extern uio_t        uio_create(int iovcount, off_t offset, int spacetype, int iodirection);
+extern void         uio_free(uio_t uio);
+extern int          uio_addiov(uio_t uio, user_addr_t baseaddr, user_addr_t length);
+extern void         uio_reset(uio_t uio, off_t offset, int spacetype, int iodirection);
+extern user_ssize_t uio_resid(uio_t uio);
+extern void         uio_setresid(uio_t uio, user_ssize_t value);
+extern off_t        uio_offset(uio_t uio);
+extern void         uio_setoffset(uio_t uio, off_t offset);
+extern int          uio_rw(uio_t uio);
+extern int          uiomove(const char *cp, int n, struct uio *uio);
+
+extern int          copyin(const user_addr_t uaddr, void *kaddr, size_t len);
+extern int          copyout(const void *kaddr, user_addr_t udaddr, size_t len);
+
+#define CAST_USER_ADDR_T(a) ((user_addr_t) (uintptr_t) (a))
+#define USER_ADDR_NULL      ((user_addr_t) 0)
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Harness Entry Points
+
+// The following have no kernel equivalent.  They let a harness do the things
+// that VFS does on behalf of a process: mount and unmount a volume, and call
+// through the vnode and VFS operation vectors.
+
+extern vfs_context_t    vfs_context_current(void);
+extern int              vfs_context_is64bit(vfs_context_t context);
+extern int              vfs_context_suser(vfs_context_t context);
+
+extern errno_t  UserKPIMount(
+    const char *    fsName,
+    const char *    devPath,
+    const char *    mountOnName,
+    int             mntflags,
+    const void *    data,
+    mount_t *       mpPtr
+);
+    // Mounts the file system registered as fsName.  devPath is a regular file
+    // (or a block device) that acts as the volume's block device; if it's NULL,
+    // an anonymous 1 MB device is used.  mntflags are the flags passed to 
+    // mount (for example, MNT_RDONLY, in which case the device is opened 
+    // read-only).  data points to the file system specific mount arguments, 
+    // in their kernel layout (that is, after VFS has consumed the device path).
+
+extern errno_t  UserKPIUnmount(mount_t mp, int mntflags);
+    // Unmounts a volume mounted by UserKPIMount.
+
+extern void     UserKPIPurgeCaches(void);
+    // Throws away everything in the UBC that's not in use, so that the next 
+    // read of a file comes from the device (the equivalent of purge).
+
+extern void     UserKPIGetDeviceReadStats(uint64_t *readCountPtr, uint64_t *byteCountPtr);
+    // Returns the total number of reads that have been issued to device 
+    // vnodes, and the total number of bytes read.  Either pointer may be 
+    // NULL.
+
+extern void     UserKPIGetDeviceWriteStats(uint64_t *writeCountPtr, uint64_t *byteCountPtr);
+    // The equivalent of UserKPIGetDeviceReadStats for writes.
+
+typedef struct UserKPIMapping UserKPIMapping;
+
+extern errno_t  UserKPIMmap(vnode_t vp, int prot, int flags, UserKPIMapping **mappingPtr);
+    // Maps the file vp (on which the caller holds an I/O reference) the way 
+    // that mmap does: VNOPMmap is called and the mapping takes a use count 
+    // on the vnode.  The mapping covers the file's size at the time of the call.  
+    // flags is MAP_SHARED or MAP_PRIVATE.  As in the kernel, VNOPMmap only 
+    // sees PROT_WRITE for a shared mapping; a private mapping's changes go 
+    // to copy-on-write pages and never reach the file.
+
+extern errno_t  UserKPIMapAccess(UserKPIMapping *mapping, off_t offset, const void **addrPtr);
+    // Touches the byte at offset in the mapping, taking a page fault if its 
+    // page isn't mapped yet.  A fault on a page that's not in the UBC calls 
+    // VNOPPagein.  On success, *addrPtr points at the byte, within the UBC 
+    // page itself; it remains valid until the mapping is unmapped.  Faulting 
+    // beyond the end of the mapping, or on a forcibly unmounted file, returns 
+    // EFAULT (the equivalent of SIGBUS).
+
+extern void     UserKPIMunmap(UserKPIMapping *mapping);
+    // Unmaps a mapping created by UserKPIMmap.  When the last mapping of a 
+    // vnode goes away, VNOPMnomap is called and the use count is released.
+
+extern errno_t  UserKPISysctl(
+    const char *    fsName,
+    int *           name,
+    u_int           namelen,
+    void *          oldp,
+    size_t *        oldlenp,
+    void *          newp,
+    size_t          newlen
+);
+    // Calls the vfs_sysctl entry point of the file system registered as 
+    // fsName, the way that sysctl does for { CTL_VFS, <type number>, name... }. 
+    // oldp and newp are passed through as user addresses.
+
+extern void     UserKPISetDesiredVNodes(int count);
+    // Sets the number of unused vnodes that are cached before the shim starts
+    // recycling them (the equivalent of the kern.maxvnodes sysctl).
+
+extern errno_t  UserKPILookupComponent(vnode_t dvp, vnode_t *vpp, struct componentname *cnp, vfs_context_t context);
+    // Looks up one path component the way that namei does: "." is handled 
+    // directly, then the name cache is consulted, and only on a miss is 
+    // VNOP_LOOKUP called.  As with VNOP_LOOKUP, *vpp has an I/O reference 
+    // on success.
+
+extern errno_t  VFS_ROOT(mount_t mp, vnode_t *vpp, vfs_context_t context);
+extern errno_t  VFS_GETATTR(mount_t mp, struct vfs_attr *vfa, vfs_context_t context);
+extern errno_t  VFS_VGET(mount_t mp, ino64_t ino, vnode_t *vpp, vfs_context_t context);
+extern errno_t  VFS_FHTOVP(mount_t mp, int fhlen, unsigned char *fhp, vnode_t *vpp, vfs_context_t context);
+extern errno_t  VFS_VPTOFH(vnode_t vp, int *fhlen, unsigned char *fhp, vfs_context_t context);
+extern errno_t  VFS_SYNC(mount_t mp, int waitfor, vfs_context_t context);
+
+extern errno_t  VNOP_LOOKUP(vnode_t dvp, vnode_t *vpp, struct componentname *cnp, vfs_context_t context);
+extern errno_t  VNOP_OPEN(vnode_t vp, int mode, vfs_context_t context);
+extern errno_t  VNOP_CLOSE(vnode_t vp, int fflag, vfs_context_t context);
+extern errno_t  VNOP_GETATTR(vnode_t vp, struct vnode_attr *vap, vfs_context_t context);
+extern errno_t  VNOP_READ(vnode_t vp, struct uio *uio, int ioflag, vfs_context_t context);
+extern errno_t  VNOP_WRITE(vnode_t vp, struct uio *uio, int ioflag, vfs_context_t context);
+extern errno_t  VNOP_CREATE(vnode_t dvp, vnode_t *vpp, struct componentname *cnp, struct vnode_attr *vap, vfs_context_t context);
+extern errno_t  VNOP_REMOVE(vnode_t dvp, vnode_t vp, struct componentname *cnp, int flags, vfs_context_t context);
+extern errno_t  VNOP_FSYNC(vnode_t vp, int waitfor, vfs_context_t context);
+extern errno_t  VNOP_SETATTR(vnode_t vp, struct vnode_attr *vap, vfs_context_t context);
+extern errno_t  VNOP_ALLOCATE(vnode_t vp, off_t length, u_int32_t flags, off_t *bytesallocated, off_t offset, vfs_context_t context);
+extern errno_t  VNOP_BLOCKMAP(vnode_t vp, off_t foffset, size_t size, daddr64_t *bpn, size_t *run, void *poff, int flags, vfs_context_t context);
+extern errno_t  VNOP_STRATEGY(struct buf *bp);
+extern errno_t  VNOP_BLKTOOFF(vnode_t vp, daddr64_t lblkno, off_t *offset);
+extern errno_t  VNOP_OFFTOBLK(vnode_t vp, off_t offset, daddr64_t *lblkno);
+extern errno_t  VNOP_MMAP(vnode_t vp, int fflags, vfs_context_t context);
+extern errno_t  VNOP_MNOMAP(vnode_t vp, vfs_context_t context);
+extern errno_t  VNOP_PAGEIN(vnode_t vp, upl_t pl, vm_offset_t pl_offset, off_t f_offset, size_t size, int flags, vfs_context_t context);
+extern errno_t  VNOP_READDIR(vnode_t vp, struct uio *uio, int flags, int *eofflag, int *numdirent, vfs_context_t context);
+extern errno_t  VNOP_READDIRATTR(vnode_t vp, struct attrlist *alist, struct uio *uio, u_long maxcount, u_long options, u_long *newstate, int *eofflag, u_long *actualcount, vfs_context_t context);
+
+#endif
@@ -0,0 +1,260 @@
+/*
+    File:       FsckEmptyFS.c
+
+    Contains:   Tool to check the consistency of an EmptyFS volume.
+
+    Written by: DTS
+
+    Copyright:  Copyright (c) 2006 by Apple Computer, Inc., All Rights Reserved.
+
+    Disclaimer: IMPORTANT:  This Apple software is supplied to you by Apple Computer, Inc.
+                ("Apple") in consideration of your agreement to the following terms, and your
+                use, installation, modification or redistribution of this Apple software
+                constitutes acceptance of these terms.  If you do not agree with these terms,
+                please do not use, install, modify or redistribute this Apple software.
+
+                In consideration of your agreement to abide by the following terms, and subject
+                to these terms, Apple grants you a personal, non-exclusive license, under Apple's
+                copyrights in this original Apple software (the "Apple Software"), to use,
+                reproduce, modify and redistribute the Apple Software, with or without
+                modifications, in source and/or binary forms; provided that if you redistribute
+                the Apple Software in its entirety and without modifications, you must retain
+                this notice and the following text and disclaimers in all such redistributions of
+                the Apple Software.  Neither the name, trademarks, service marks or logos of
+                Apple Computer, Inc. may be used to endorse or promote products derived from the
+                Apple Software without specific prior written permission from Apple.  Except as
+                expressly stated in this notice, no other rights or licenses, express or implied,
+                are granted by Apple herein, including but not limited to any patent rights that
+                may be infringed by your derivative works or by other works in which the Apple
+                Software may be incorporated.
+
+                The Apple Software is provided by Apple on an "AS IS" basis.  APPLE MAKES NO
+                WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                PURPOSE, REGARDING THE APPLE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                COMBINATION WITH YOUR PRODUCTS.
+
+                IN NO EVENT SHALL APPLE BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                OF THE APPLE SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF APPLE HAS BEEN
+                ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+    Change History (most recent first):
+
+$Log$
+
+*/
+
+/////////////////////////////////////////////////////////////////////
+
+// This tool checks the consistency of an EmptyFS volume, on a disk device or
+// in a plain image file.  It's built as "fsck_EmptyFS", the name that the
+// system's tools expect.  The check itself is done by the checker library
+// ("EmptyFSCheck.c"), which reads the volume with a pool of threads (-t, by
+// default one per CPU); see the comments there for how it works.
+//
+// The tool never repairs anything.  If the volume has a journal and wasn't
+// cleanly unmounted, the tool replays the journal first (which also frees
+// any orphaned files), just as mounting the volume would, unless -n says not
+// to write to the volume at all.
+//
+// It exits with 0 if the volume is consistent, 8 (the traditional fsck
+// status) if it isn't, and 1 if it couldn't check it.
+
+// System interfaces
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <unistd.h>
+
+// The image and checker libraries
+
+#include "EmptyFSImage.h"
+#include "EmptyFSCheck.h"
+
+#ifndef TRUE
+    #define TRUE    1
+    #define FALSE   0
+#endif
+
+enum {
+    kExitInconsistent   = 8
+};
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Checking
+
+static int ReplayJournalIfNeeded(const char *path, int readOnly)
+    // If the volume at path has a journal and wasn't cleanly unmounted,
+    // replays the journal, unless readOnly is true, in which case it just
+    // warns that the counts won't be checked.
+{
+    int                         err;
+    EmptyFSImage *              image;
+    const EmptyFSSuperblock *   sb;
+    int                         replay;
+
+    replay = FALSE;
+    err = EmptyFSImageOpen(path, FALSE, &image);
+    if (err == 0) {
+        sb = EmptyFSImageGetSuperblock(image);
+        replay = ( (sb->fROCompatFeatures & kEmptyFSROCompatJournal) && ! (sb->fState & kEmptyFSStateClean) );
+        err = EmptyFSImageClose(image);
+    }
+    if ( (err == 0) && replay ) {
+        if (readOnly) {
+            fprintf(stderr, "%s: journal not replayed (-n)\n", path);
+        } else {
+            printf("** Replaying the journal\n");
+            err = EmptyFSImageOpen(path, TRUE, &image);
+            if (err == 0) {
+                err = EmptyFSImageClose(image);
+            }
+        }
+    }
+    return err;
+}
+
+static int Check(const char *path, int readOnly, uint32_t threadCount, int *consistentPtr)
+    // Checks the volume at path, printing what it finds to stdout.  Sets
+    // *consistentPtr to whether it's consistent.
+{
+    int                     err;
+    int                     fd;
+    EmptyFSCheckResults     results;
+    double                  startTime;
+    double                  seconds;
+
+    fd = -1;
+    err = ReplayJournalIfNeeded(path, readOnly);
+    if (err == 0) {
+        startTime = EmptyFSImageNow();
+        fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            err = errno;
+        }
+    }
+    if (err == 0) {
+        err = EmptyFSCheckVolume(fd, threadCount, stdout, &results);
+    }
+    if (err == 0) {
+        seconds = EmptyFSImageNow() - startTime;
+
+        printf("files: %u, directories: %u, blocks used: %llu\n",
+            (unsigned int) results.fFileCount,
+            (unsigned int) results.fDirectoryCount,
+            (unsigned long long) results.fUsedBlockCount
+        );
+        printf("checked in %.3f seconds using %u thread%s (%.1f MB read)\n",
+            seconds,
+            (unsigned int) threadCount,
+            (threadCount == 1) ? "" : "s",
+            (double) results.fBytesRead / (1024.0 * 1024.0)
+        );
+        if (results.fProblemCount == 0) {
+            printf("** The volume %s appears to be OK\n", path);
+        } else {
+            printf("** The volume %s has %llu problem%s\n", path, (unsigned long long) results.fProblemCount, (results.fProblemCount == 1) ? "" : "s");
+        }
+        *consistentPtr = (results.fProblemCount == 0);
+    }
+    if (fd >= 0) {
+        (void) close(fd);
+    }
+    return err;
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Main
+
+static void PrintUsage(const char *argv0)
+    // Print a helpful help message.
+{
+    const char *    progName;
+
+    progName = strrchr(argv0, '/');
+    if (progName == NULL) {
+        progName = argv0;
+    } else {
+        progName += 1;
+    }
+    fprintf(stderr, "usage: %s [ -n ] [ -t threads ] special-device-or-image\n", progName);
+    fprintf(stderr, "  -n             don't write to the volume, even to replay its journal\n");
+    fprintf(stderr, "  -t threads     threads to check with; default one per CPU, at most %u\n", (unsigned int) kEmptyFSCheckMaxThreads);
+}
+
+extern int main(int argc, char **argv)
+{
+    int             err;
+    int             retVal;
+    int             ch;
+    int             readOnly;
+    long            threadCount;
+    char *          end;
+    int             consistent;
+
+    // Parse command line options.
+
+    readOnly    = FALSE;
+    threadCount = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threadCount < 1) {
+        threadCount = 1;
+    } else if (threadCount > kEmptyFSCheckMaxThreads) {
+        threadCount = kEmptyFSCheckMaxThreads;
+    }
+
+    retVal = EXIT_SUCCESS;
+    do {
+        ch = getopt(argc, argv, "nt:");
+        if (ch != -1) {
+            switch (ch) {
+                case 'n':
+                    readOnly = TRUE;
+                    break;
+                case 't':
+                    threadCount = strtol(optarg, &end, 0);
+                    if ( (*end != 0) || (threadCount < 1) || (threadCount > kEmptyFSCheckMaxThreads) ) {
+                        retVal = EXIT_FAILURE;
+                    }
+                    break;
+                case '?':
+                default:
+                    retVal = EXIT_FAILURE;
+                    break;
+            }
+        }
+    } while ( (ch != -1) && (retVal == EXIT_SUCCESS) );
+
+    // Fail if we don't have exactly one remaining argument.
+
+    if ( (retVal == EXIT_SUCCESS) && ((argc - optind) != 1) ) {
+        retVal = EXIT_FAILURE;
+    }
+    if (retVal != EXIT_SUCCESS) {
+        PrintUsage(argv[0]);
+    }
+
+    // If all is well, do the check.
+
+    if (retVal == EXIT_SUCCESS) {
+        consistent = FALSE;
+        err = Check(argv[optind], readOnly, (uint32_t) threadCount, &consistent);
+
+        if (err != 0) {
+            errno = err;
+            perror(argv[optind]);
+            retVal = EXIT_FAILURE;
+        } else if ( ! consistent ) {
+            retVal = kExitInconsistent;
+        }
+    }
+
+    return retVal;
+}
@@ -0,0 +1,1498 @@
+/*
+    File:       MkimageEmptyFS.c
+
+    Contains:   Tool to build an EmptyFS image from a directory tree.
+
+    Written by: DTS
+
+    Copyright:  Copyright (c) 2006 by Apple Computer, Inc., All Rights Reserved.
+
+    Disclaimer: IMPORTANT:  This Apple software is supplied to you by Apple Computer, Inc.
+                ("Apple") in consideration of your agreement to the following terms, and your
+                use, installation, modification or redistribution of this Apple software
+                constitutes acceptance of these terms.  If you do not agree with these terms,
+                please do not use, install, modify or redistribute this Apple software.
+
+                In consideration of your agreement to abide by the following terms, and subject
+                to these terms, Apple grants you a personal, non-exclusive license, under Apple's
+                copyrights in this original Apple software (the "Apple Software"), to use,
+                reproduce, modify and redistribute the Apple Software, with or without
+                modifications, in source and/or binary forms; provided that if you redistribute
+                the Apple Software in its entirety and without modifications, you must retain
+                this notice and the following text and disclaimers in all such redistributions of
+                the Apple Software.  Neither the name, trademarks, service marks or logos of
+                Apple Computer, Inc. may be used to endorse or promote products derived from the
+                Apple Software without specific prior written permission from Apple.  Except as
+                expressly stated in this notice, no other rights or licenses, express or implied,
+                are granted by Apple herein, including but not limited to any patent rights that
+                may be infringed by your derivative works or by other works in which the Apple
+                Software may be incorporated.
+
+                The Apple Software is provided by Apple on an "AS IS" basis.  APPLE MAKES NO
+                WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                PURPOSE, REGARDING THE APPLE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                COMBINATION WITH YOUR PRODUCTS.
+
+                IN NO EVENT SHALL APPLE BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                OF THE APPLE SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF APPLE HAS BEEN
+                ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+    Change History (most recent first):
+
+$Log$
+
+*/
+
+/////////////////////////////////////////////////////////////////////
+
+// This tool builds an EmptyFS image, or fills a device, from a directory
+// tree, so that a read-only data set can be published as a volume rather
+// than as a copy of the tree.  It's built as "mkimage_EmptyFS".
+//
+// It works in three passes, or four if it's compressing (-c) or
+// checksumming (-k):
+//
+// 1. Scan.  Walk the source tree, recording each directory and regular file
+//    (EmptyFS has no hard links, and mount_EmptyFS can't read symlinks, so
+//    hard links are copied and everything else is skipped with a warning).
+//    Each directory's entries are sorted: its files, by name, and then its
+//    subdirectories, by name.  That's the order in which they're added, and
+//    so the order in which VNOPReadDir returns them.
+//
+// 2. Measure (-c only).  Compress each file that's more than a block long,
+//    one compression chunk (-C) at a time, with a pool of threads, to find
+//    out how many blocks each chunk takes when stored (see "Compression" in
+//    "EmptyFSFormat.h").  We throw the compressed data away; all we keep is
+//    the block counts.  That costs a second read and compression of each
+//    file in pass 4, but it means that the volume can be sized exactly, and
+//    the data laid out as tightly, as for an uncompressed tree, without
+//    holding the compressed tree in memory.  A file that has no chunk that
+//    compresses by at least a block is stored uncompressed.
+//
+//    With -k, every non-empty file is stored in chunks, whether or not it
+//    compresses, because only a file that's stored in chunks can have a
+//    checksum table (see "Data Checksums" in "EmptyFSFormat.h").  Without
+//    -c, each chunk is stored as is, and this pass doesn't need to read
+//    anything.
+//
+// 3. Lay out.  Using the image library ("EmptyFSImage.c"), create each
+//    directory and file, and allocate each file's blocks, without writing
+//    any data.  Directories are visited depth first, and within each one we
+//    add all of its files (so that its directory blocks are contiguous), then
+//    allocate their data, in entry order, and then move on to each
+//    subdirectory in turn.  The image library allocates each run of blocks
+//    just after the last, so the device ends up holding each directory's
+//    blocks followed by its files' data, in the order that a depth-first
+//    scan (find, tar, rsync, or VNOPReadDir followed by VNOPRead of each
+//    entry) reads them.  Small files are packed together, a block apart at
+//    most.  A compressed file's chunks are allocated the same way, each as a
+//    single extent, followed by the file's checksum table, if it has one.
+//
+// 4. Copy.  The data to write is now a list of runs of contiguous blocks,
+//    which we cut into kChunkSize chunks; a chunk may hold the tail of one
+//    file and dozens of small files.  A pipeline copies the chunks: a pool
+//    of reader threads (-t, by default one per CPU) fills chunk buffers from
+//    the source files, in parallel, and a writer writes the filled chunks to
+//    the image in order, one big sequential write each.  There are only a
+//    few buffers per reader, so a slow device holds up the readers, and a
+//    slow source holds up the writer, without either using much memory.
+//    The readers compress the data too, so compression scales with the
+//    number of threads.  A compressed chunk that doesn't come out the size
+//    that it did in pass 2 means that someone changed the file under us,
+//    which is an error.  With -k, the readers also checksum each chunk as it
+//    will be stored, and once everything's copied we write each file's
+//    checksum table.
+
+// System interfaces
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+// The image library, and the format definitions that it shares with the kernel
+
+#include "EmptyFSImage.h"
+
+#ifndef TRUE
+    #define TRUE    1
+    #define FALSE   0
+#endif
+
+enum {
+    kMaxThreads         = 64,
+    kChunkSize          = 1024 * 1024,      // the writer writes this much at a time, at most
+    kBuffersPerThread   = 2
+};
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Scanning the Source
+
+// A Node is a directory or regular file in the source tree.
+
+typedef struct Node Node;
+
+struct Node {
+    char *              fName;
+    char *              fPath;              // path of the source object
+    struct stat         fStat;
+    Node **             fChildren;          // directories only; files (sorted by name), then subdirectories (ditto)
+    uint32_t            fChildCount;
+    uint32_t            fChildCapacity;
+    uint32_t            fFileNum;           // once it's been added to the image
+    EmptyFSExtent *     fStoredExtents;     // files that we're storing in chunks only: how each chunk is stored, from pass 2
+    uint32_t            fStoredExtentCount;
+    uint32_t *          fChecksums;         // files that we're checksumming only: each chunk's checksum, from pass 4
+};
+
+// ScanTotals accumulates what we need to know to size the volume.
+
+struct ScanTotals {
+    uint32_t            fFileCount;         // regular files
+    uint32_t            fDirectoryCount;    // including the root
+    uint64_t            fDataBytes;
+    uint64_t            fDataBlocks;        // at the block size being used, after compression
+    uint64_t            fEntryBytes;        // space taken by directory entries
+    uint32_t            fSkipped;           // objects that we couldn't copy
+    uint32_t            fCompressedFileCount;
+    uint32_t            fChecksummedFileCount;
+};
+typedef struct ScanTotals ScanTotals;
+
+static int CompareNodes(const void *lhs, const void *rhs)
+    // Files before directories, and then by name.
+{
+    const Node *    l;
+    const Node *    r;
+    int             lIsDir;
+    int             rIsDir;
+
+    l = *(const Node * const *) lhs;
+    r = *(const Node * const *) rhs;
+    lIsDir = S_ISDIR(l->fStat.st_mode);
+    rIsDir = S_ISDIR(r->fStat.st_mode);
+    if (lIsDir != rIsDir) {
+        return lIsDir - rIsDir;
+    }
+    return strcmp(l->fName, r->fName);
+}
+
+static void FreeNode(Node *node)
+{
+    uint32_t    index;
+
+    if (node != NULL) {
+        for (index = 0; index < node->fChildCount; index++) {
+            FreeNode(node->fChildren[index]);
+        }
+        free(node->fChildren);
+        free(node->fStoredExtents);
+        free(node->fChecksums);
+        free(node->fName);
+        free(node->fPath);
+        free(node);
+    }
+}
+
+static int NewNode(const char *name, const char *path, const struct stat *sb, Node **nodePtr)
+{
+    int     err;
+    Node *  node;
+
+    err = 0;
+    node = calloc(1, sizeof(*node));
+    if (node != NULL) {
+        node->fName = strdup(name);
+        node->fPath = strdup(path);
+        node->fStat = *sb;
+    }
+    if ( (node == NULL) || (node->fName == NULL) || (node->fPath == NULL) ) {
+        FreeNode(node);
+        node = NULL;
+        err = ENOMEM;
+    }
+    *nodePtr = node;
+    return err;
+}
+
+static int AddChild(Node *parent, Node *child)
+{
+    int         err;
+    Node **     newChildren;
+    uint32_t    newCapacity;
+
+    err = 0;
+    if (parent->fChildCount == parent->fChildCapacity) {
+        newCapacity = (parent->fChildCapacity == 0) ? 16 : (parent->fChildCapacity * 2);
+        newChildren = realloc(parent->fChildren, newCapacity * sizeof(*newChildren));
+        if (newChildren == NULL) {
+            err = ENOMEM;
+        } else {
+            parent->fChildren      = newChildren;
+            parent->fChildCapacity = newCapacity;
+        }
+    }
+    if (err == 0) {
+        parent->fChildren[parent->fChildCount] = child;
+        parent->fChildCount += 1;
+    }
+    return err;
+}
+
+static int ScanDirectory(Node *dirNode, uint32_t blockSize, ScanTotals *totals)
+    // Adds the contents of the source directory dirNode to it, recursively.
+    // Errors reading the source are fatal, because a partial copy of a data
+    // set is worse than none; objects that we can't represent are skipped.
+{
+    int                 err;
+    DIR *               dir;
+    struct dirent *     entry;
+    char *              path;
+    size_t              pathLen;
+    size_t              nameLen;
+    struct stat         sb;
+    Node *              child;
+    uint32_t            index;
+
+    err = 0;
+    dir = opendir(dirNode->fPath);
+    if (dir == NULL) {
+        err = errno;
+        fprintf(stderr, "%s: ", dirNode->fPath);
+    }
+    while (err == 0) {
+        errno = 0;
+        entry = readdir(dir);
+        if (entry == NULL) {
+            err = errno;
+            if (err != 0) {
+                fprintf(stderr, "%s: ", dirNode->fPath);
+            }
+            break;
+        }
+        if ( (strcmp(entry->d_name, ".") == 0) || (strcmp(entry->d_name, "..") == 0) ) {
+            continue;
+        }
+
+        nameLen = strlen(entry->d_name);
+        pathLen = strlen(dirNode->fPath) + 1 + nameLen + 1;
+        path = malloc(pathLen);
+        if (path == NULL) {
+            err = ENOMEM;
+            break;
+        }
+        snprintf(path, pathLen, "%s/%s", dirNode->fPath, entry->d_name);
+
+        child = NULL;
+        if ( lstat(path, &sb) < 0 ) {
+            err = errno;
+            fprintf(stderr, "%s: ", path);
+        } else if (nameLen > kEmptyFSMaxNameLength) {
+            fprintf(stderr, "%s: name too long; skipped\n", path);
+            totals->fSkipped += 1;
+        } else if ( ! S_ISDIR(sb.st_mode) && ! S_ISREG(sb.st_mode) ) {
+            fprintf(stderr, "%s: not a file or directory; skipped\n", path);
+            totals->fSkipped += 1;
+        } else {
+            err = NewNode(entry->d_name, path, &sb, &child);
+            if (err == 0) {
+                err = AddChild(dirNode, child);
+                if (err != 0) {
+                    FreeNode(child);
+                }
+            }
+            if (err == 0) {
+                totals->fEntryBytes += EmptyFSDirEntrySize(nameLen);
+                if ( S_ISDIR(sb.st_mode) ) {
+                    totals->fDirectoryCount += 1;
+                } else {
+                    totals->fFileCount  += 1;
+                    totals->fDataBytes  += (uint64_t) sb.st_size;
+                    totals->fDataBlocks += ((uint64_t) sb.st_size + blockSize - 1) / blockSize;
+                }
+            }
+        }
+        free(path);
+    }
+    if (dir != NULL) {
+        (void) closedir(dir);
+    }
+
+    // Sort the entries, and then scan the subdirectories.  They come last, so
+    // we can stop at the first non-directory from the end.
+
+    if ( (err == 0) && (dirNode->fChildCount != 0) ) {
+        qsort(dirNode->fChildren, dirNode->fChildCount, sizeof(Node *), CompareNodes);
+    }
+    for (index = 0; (err == 0) && (index < dirNode->fChildCount); index++) {
+        if ( S_ISDIR(dirNode->fChildren[index]->fStat.st_mode) ) {
+            err = ScanDirectory(dirNode->fChildren[index], blockSize, totals);
+        }
+    }
+    return err;
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Measuring Compression
+
+// A Measurer hands out the files to measure, one at a time, to a pool of
+// threads.  Each file is measured by one thread, so there's no contention
+// except for the index of the next file.
+
+struct Measurer {
+    Node **             fFiles;
+    size_t              fFileCount;
+    uint32_t            fBlockSize;
+    uint32_t            fChunkSize;
+    int                 fCompress;
+    int                 fChecksum;
+    pthread_mutex_t     fLock;
+    size_t              fNextFile;          // [fLock]
+    int                 fError;             // [fLock] the first error, if any, which stops everything
+};
+typedef struct Measurer Measurer;
+
+static int CollectFiles(Node *dirNode, off_t minSize, Node ***filesPtr, size_t *countPtr, size_t *capacityPtr)
+    // Appends the files below dirNode that are longer than minSize to
+    // *filesPtr.
+{
+    int         err;
+    uint32_t    index;
+    Node *      child;
+    Node **     newFiles;
+
+    err = 0;
+    for (index = 0; (err == 0) && (index < dirNode->fChildCount); index++) {
+        child = dirNode->fChildren[index];
+        if ( S_ISDIR(child->fStat.st_mode) ) {
+            err = CollectFiles(child, minSize, filesPtr, countPtr, capacityPtr);
+        } else if ( child->fStat.st_size > minSize ) {
+            if (*countPtr == *capacityPtr) {
+                *capacityPtr = (*capacityPtr == 0) ? 1024 : (*capacityPtr * 2);
+                newFiles = realloc(*filesPtr, *capacityPtr * sizeof(Node *));
+                if (newFiles == NULL) {
+                    err = ENOMEM;
+                    break;
+                }
+                *filesPtr = newFiles;
+            }
+            (*filesPtr)[*countPtr] = child;
+            *countPtr += 1;
+        }
+    }
+    return err;
+}
+
+static int MeasureFile(const Measurer *measurer, Node *file, uint8_t *source, uint8_t *stored)
+    // Compresses file a chunk at a time, using source and stored (each
+    // chunkSize bytes) as scratch buffers, and, if that saves any space or
+    // we're checksumming, sets up file->fStoredExtents to say how each chunk
+    // is stored.  If we're not compressing, each chunk is stored as is, and
+    // there's nothing to read.
+{
+    int             err;
+    int             fd;
+    uint64_t        size;
+    uint64_t        offset;
+    uint32_t        chunkLen;
+    uint32_t        extentCount;
+    uint32_t        index;
+    EmptyFSExtent * extents;
+    int             saved;
+    uint32_t        blockSize;
+    uint32_t        chunkSize;
+
+    blockSize = measurer->fBlockSize;
+    chunkSize = measurer->fChunkSize;
+    size = (uint64_t) file->fStat.st_size;
+    extentCount = (uint32_t) ((size + chunkSize - 1) / chunkSize);
+    saved = FALSE;
+
+    err = 0;
+    extents = calloc(extentCount, sizeof(EmptyFSExtent));
+    if (extents == NULL) {
+        err = ENOMEM;
+    }
+    fd = -1;
+    if ( (err == 0) && measurer->fCompress ) {
+        fd = open(file->fPath, O_RDONLY);
+        if (fd < 0) {
+            err = errno;
+        }
+    }
+    offset = 0;
+    for (index = 0; (err == 0) && (index < extentCount); index++) {
+        chunkLen = (uint32_t) ( ((size - offset) < chunkSize) ? (size - offset) : chunkSize );
+        if ( ! measurer->fCompress ) {
+            extents[index].fFlags      = kEmptyFSCompressionNone;
+            extents[index].fBlockCount = (chunkLen + blockSize - 1) / blockSize;
+        } else {
+            err = EmptyFSImagePReadAll(fd, source, chunkLen, (off_t) offset);
+        }
+        if ( (err == 0) && measurer->fCompress ) {
+            EmptyFSImageCompressChunk(blockSize, source, chunkLen, stored, &extents[index].fFlags, &extents[index].fBlockCount);
+            if (extents[index].fFlags != kEmptyFSCompressionNone) {
+                saved = TRUE;
+            }
+        }
+        offset += chunkLen;
+    }
+    if (fd >= 0) {
+        (void) close(fd);
+    }
+    if ( (err == 0) && (saved || measurer->fChecksum) ) {
+        file->fStoredExtents     = extents;
+        file->fStoredExtentCount = extentCount;
+    } else {
+        free(extents);
+    }
+    return err;
+}
+
+static void * MeasureThread(void *parameter)
+    // The body of each measuring thread: take the next file and measure it,
+    // until there are none left.
+{
+    int         err;
+    Measurer *  measurer;
+    uint8_t *   source;
+    uint8_t *   stored;
+    Node *      file;
+
+    measurer = (Measurer *) parameter;
+
+    err = 0;
+    source = malloc(measurer->fChunkSize);
+    stored = malloc(measurer->fChunkSize);
+    if ( (source == NULL) || (stored == NULL) ) {
+        err = ENOMEM;
+    }
+    (void) pthread_mutex_lock(&measurer->fLock);
+    if (err != 0) {
+        measurer->fError = err;
+    }
+    while ( (measurer->fError == 0) && (measurer->fNextFile < measurer->fFileCount) ) {
+        file = measurer->fFiles[measurer->fNextFile];
+        measurer->fNextFile += 1;
+        (void) pthread_mutex_unlock(&measurer->fLock);
+
+        err = MeasureFile(measurer, file, source, stored);
+
+        (void) pthread_mutex_lock(&measurer->fLock);
+        if ( (err != 0) && (measurer->fError == 0) ) {
+            measurer->fError = err;
+            fprintf(stderr, "%s: ", file->fPath);
+        }
+    }
+    (void) pthread_mutex_unlock(&measurer->fLock);
+
+    free(source);
+    free(stored);
+    return NULL;
+}
+
+static int MeasureCompression(
+    Node *          root,
+    uint32_t        blockSize,
+    uint32_t        chunkSize,
+    int             compress,
+    int             checksum,
+    uint32_t        threadCount,
+    ScanTotals *    totals
+)
+    // Pass 2: measures every file that might be worth compressing, or every
+    // non-empty file if we're checksumming, with threadCount threads, and
+    // updates totals to account for the blocks that compression saves and
+    // that the checksum tables take.
+{
+    int         err;
+    Measurer    measurer;
+    size_t      capacity;
+    pthread_t   threads[kMaxThreads];
+    uint32_t    started;
+    uint32_t    index;
+    size_t      fileIndex;
+    Node *      file;
+    uint64_t    storedBlocks;
+    int         compressed;
+
+    assert( (threadCount >= 1) && (threadCount <= kMaxThreads) );
+
+    memset(&measurer, 0, sizeof(measurer));
+    measurer.fBlockSize = blockSize;
+    measurer.fChunkSize = chunkSize;
+    measurer.fCompress  = compress;
+    measurer.fChecksum  = checksum;
+    capacity = 0;
+    started = 0;
+
+    err = CollectFiles(root, checksum ? 0 : (off_t) blockSize, &measurer.fFiles, &measurer.fFileCount, &capacity);
+    if ( (err == 0) && (measurer.fFileCount != 0) ) {
+        err = pthread_mutex_init(&measurer.fLock, NULL);
+        if (err == 0) {
+            for (started = 0; started < threadCount; started++) {
+                if ( pthread_create(&threads[started], NULL, MeasureThread, &measurer) != 0 ) {
+                    break;
+                }
+            }
+            if (started == 0) {
+                err = EAGAIN;
+            }
+            for (index = 0; index < started; index++) {
+                (void) pthread_join(threads[index], NULL);
+            }
+            if (err == 0) {
+                err = measurer.fError;
+            }
+            (void) pthread_mutex_destroy(&measurer.fLock);
+        }
+    }
+
+    for (fileIndex = 0; (err == 0) && (fileIndex < measurer.fFileCount); fileIndex++) {
+        file = measurer.fFiles[fileIndex];
+        if (file->fStoredExtents != NULL) {
+            storedBlocks = 0;
+            compressed = FALSE;
+            for (index = 0; index < file->fStoredExtentCount; index++) {
+                storedBlocks += file->fStoredExtents[index].fBlockCount;
+                if (file->fStoredExtents[index].fFlags != kEmptyFSCompressionNone) {
+                    compressed = TRUE;
+                }
+            }
+            totals->fDataBlocks -= (((uint64_t) file->fStat.st_size + blockSize - 1) / blockSize) - storedBlocks;
+            if (compressed) {
+                totals->fCompressedFileCount += 1;
+            }
+            if (checksum) {
+                totals->fDataBlocks += (((uint64_t) file->fStoredExtentCount * sizeof(uint32_t)) + blockSize - 1) / blockSize;
+                totals->fChecksummedFileCount += 1;
+            }
+        }
+    }
+
+    free(measurer.fFiles);
+    return err;
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Laying Out the Image
+
+// A Segment is a piece of a source file that's copied to a contiguous run of
+// blocks within a chunk.  A Chunk is a run of contiguous blocks on the image,
+// no bigger than kChunkSize, and the segments that fill it.  For a file
+// that's stored in chunks, each segment is one of the file's compression
+// chunks (so an extent), which is compressed (and checksummed) as it's
+// copied.
+
+struct Segment {
+    const Node *        fFile;
+    uint64_t            fFileOffset;        // in bytes
+    uint32_t            fChunkOffset;       // in bytes
+    uint32_t            fLength;            // in bytes, of the source; the rest of the last block is zero
+    uint32_t            fStoredBlocks;      // blocks that the compressed chunk takes, or zero if the file isn't stored in chunks
+    uint32_t            fExtentIndex;       // ditto, the chunk's index in the file
+};
+typedef struct Segment Segment;
+
+struct Chunk {
+    uint64_t            fStartBlock;
+    uint32_t            fBlockCount;
+    size_t              fFirstSegment;
+    size_t              fSegmentCount;
+};
+typedef struct Chunk Chunk;
+
+struct Plan {
+    uint32_t            fBlockSize;
+    uint32_t            fCompressedChunkSize;   // zero if we're neither compressing nor checksumming
+    int                 fCompress;              // FALSE if chunks are stored as is (-k without -c)
+    int                 fChecksum;
+    Segment *           fSegments;
+    size_t              fSegmentCount;
+    size_t              fSegmentCapacity;
+    Chunk *             fChunks;
+    size_t              fChunkCount;
+    size_t              fChunkCapacity;
+};
+typedef struct Plan Plan;
+
+static int PlanAddExtent(Plan *plan, const Node *file, uint64_t fileOffset, const EmptyFSExtent *extent, uint32_t extentIndex)
+    // Adds the part of file that lives in extent, starting at fileOffset, to
+    // the plan, extending the last chunk if the extent follows on from it.
+    // If file is stored in chunks, the extent (which is extentIndex in the
+    // file) holds one compression chunk, which must be compressed and
+    // checksummed as a whole, so it goes in a single segment, and it starts
+    // a new chunk if it doesn't fit in the last one.
+{
+    int         err;
+    uint64_t    block;
+    uint64_t    blocksLeft;
+    uint64_t    bytesLeft;
+    uint32_t    blocksPerChunk;
+    uint32_t    blocks;
+    Chunk *     chunk;
+    Segment *   segment;
+    void *      newArray;
+
+    blocksPerChunk = kChunkSize / plan->fBlockSize;
+    block      = extent->fStartBlock;
+    blocksLeft = extent->fBlockCount;
+    bytesLeft  = (uint64_t) file->fStat.st_size - fileOffset;
+    if ( (file->fStoredExtents != NULL) && (bytesLeft > plan->fCompressedChunkSize) ) {
+        bytesLeft = plan->fCompressedChunkSize;
+    }
+
+    err = 0;
+    while ( (err == 0) && (blocksLeft != 0) ) {
+
+        // Start a new chunk if this one's full, or the extent doesn't follow
+        // on from it.
+
+        chunk = (plan->fChunkCount == 0) ? NULL : &plan->fChunks[plan->fChunkCount - 1];
+        if (    (chunk == NULL)
+             || (chunk->fBlockCount == blocksPerChunk)
+             || ((chunk->fStartBlock + chunk->fBlockCount) != block)
+             || ( (file->fStoredExtents != NULL) && ((chunk->fBlockCount + blocksLeft) > blocksPerChunk) ) ) {
+            if (plan->fChunkCount == plan->fChunkCapacity) {
+                plan->fChunkCapacity = (plan->fChunkCapacity == 0) ? 1024 : (plan->fChunkCapacity * 2);
+                newArray = realloc(plan->fChunks, plan->fChunkCapacity * sizeof(Chunk));
+                if (newArray == NULL) {
+                    err = ENOMEM;
+                    break;
+                }
+                plan->fChunks = newArray;
+            }
+            chunk = &plan->fChunks[plan->fChunkCount];
+            chunk->fStartBlock    = block;
+            chunk->fBlockCount    = 0;
+            chunk->fFirstSegment  = plan->fSegmentCount;
+            chunk->fSegmentCount  = 0;
+            plan->fChunkCount += 1;
+        }
+
+        // Add as much of the extent as fits.
+
+        if (plan->fSegmentCount == plan->fSegmentCapacity) {
+            plan->fSegmentCapacity = (plan->fSegmentCapacity == 0) ? 1024 : (plan->fSegmentCapacity * 2);
+            newArray = realloc(plan->fSegments, plan->fSegmentCapacity * sizeof(Segment));
+            if (newArray == NULL) {
+                err = ENOMEM;
+                break;
+            }
+            plan->fSegments = newArray;
+        }
+        blocks = blocksPerChunk - chunk->fBlockCount;
+        if (blocks > blocksLeft) {
+            blocks = (uint32_t) blocksLeft;
+        }
+        segment = &plan->fSegments[plan->fSegmentCount];
+        segment->fFile        = file;
+        segment->fFileOffset  = fileOffset;
+        segment->fChunkOffset = chunk->fBlockCount * plan->fBlockSize;
+        if (file->fStoredExtents != NULL) {
+            assert(blocks == blocksLeft);
+            segment->fLength       = (uint32_t) bytesLeft;
+            segment->fStoredBlocks = blocks;
+            segment->fExtentIndex  = extentIndex;
+        } else {
+            segment->fLength       = (uint32_t) ( (bytesLeft < ((uint64_t) blocks * plan->fBlockSize)) ? bytesLeft : ((uint64_t) blocks * plan->fBlockSize) );
+            segment->fStoredBlocks = 0;
+            segment->fExtentIndex  = 0;
+        }
+        plan->fSegmentCount += 1;
+
+        chunk->fBlockCount   += blocks;
+        chunk->fSegmentCount += 1;
+        block      += blocks;
+        blocksLeft -= blocks;
+        fileOffset += segment->fLength;
+        bytesLeft  -= segment->fLength;
+    }
+    return err;
+}
+
+static void NanosecondsFromStat(const struct stat *sb, int64_t *modifyPtr, int64_t *changePtr, int64_t *accessPtr)
+{
+    #if defined(__APPLE__)
+        *modifyPtr = ((int64_t) sb->st_mtimespec.tv_sec * 1000000000) + sb->st_mtimespec.tv_nsec;
+        *changePtr = ((int64_t) sb->st_ctimespec.tv_sec * 1000000000) + sb->st_ctimespec.tv_nsec;
+        *accessPtr = ((int64_t) sb->st_atimespec.tv_sec * 1000000000) + sb->st_atimespec.tv_nsec;
+    #else
+        *modifyPtr = ((int64_t) sb->st_mtim.tv_sec * 1000000000) + sb->st_mtim.tv_nsec;
+        *changePtr = ((int64_t) sb->st_ctim.tv_sec * 1000000000) + sb->st_ctim.tv_nsec;
+        *accessPtr = ((int64_t) sb->st_atim.tv_sec * 1000000000) + sb->st_atim.tv_nsec;
+    #endif
+}
+
+static int CopyAttributes(EmptyFSImage *image, const Node *node)
+    // Gives the object in the image the source object's owner, permissions,
+    // flags and dates.  The source has no creation date that we can get at
+    // portably, so we use the modification date.
+{
+    int                 err;
+    EmptyFSFileRecord   rec;
+
+    err = EmptyFSImageReadFileRecord(image, node->fFileNum, &rec);
+    if (err == 0) {
+        rec.fMode = (uint16_t) ( (rec.fMode & S_IFMT) | (node->fStat.st_mode & ~S_IFMT) );
+        rec.fUID  = (uint32_t) node->fStat.st_uid;
+        rec.fGID  = (uint32_t) node->fStat.st_gid;
+        NanosecondsFromStat(&node->fStat, &rec.fModifyTime, &rec.fChangeTime, &rec.fAccessTime);
+        rec.fCreateTime = rec.fModifyTime;
+        err = EmptyFSImageWriteFileRecord(image, node->fFileNum, &rec);
+    }
+    return err;
+}
+
+static int LayOutDirectory(EmptyFSImage *image, Node *dirNode, Plan *plan)
+    // Adds the contents of dirNode, which is already in the image, to the
+    // image, depth first, in the order described at the top of this file.
+{
+    int             err;
+    uint32_t        index;
+    Node *          child;
+    EmptyFSExtent * extents;
+    uint32_t        extentCount;
+    uint32_t        extentIndex;
+    uint64_t        fileOffset;
+
+    err = 0;
+
+    // Add the files, so that the directory's blocks are allocated together.
+
+    for (index = 0; (err == 0) && (index < dirNode->fChildCount); index++) {
+        child = dirNode->fChildren[index];
+        if ( ! S_ISDIR(child->fStat.st_mode) ) {
+            err = EmptyFSImageAddFile(image, dirNode->fFileNum, child->fName, 0644, NULL, 0, &child->fFileNum);
+            if (err != 0) {
+                fprintf(stderr, "%s: ", child->fPath);
+            }
+        }
+    }
+
+    // Allocate their data, in the same order.
+
+    for (index = 0; (err == 0) && (index < dirNode->fChildCount); index++) {
+        child = dirNode->fChildren[index];
+        if ( ! S_ISDIR(child->fStat.st_mode) ) {
+            extents = NULL;
+            extentCount = 0;
+            if (child->fStoredExtents != NULL) {
+                err = EmptyFSImageAllocCompressedFileData(
+                    image,
+                    child->fFileNum,
+                    (uint64_t) child->fStat.st_size,
+                    plan->fCompressedChunkSize,
+                    child->fStoredExtents,
+                    child->fStoredExtentCount
+                );
+                if ( (err == 0) && plan->fChecksum ) {
+                    err = EmptyFSImageAllocChunkChecksums(image, child->fFileNum);
+                    if (err == 0) {
+                        child->fChecksums = calloc(child->fStoredExtentCount, sizeof(uint32_t));
+                        if (child->fChecksums == NULL) {
+                            err = ENOMEM;
+                        }
+                    }
+                }
+            } else {
+                err = EmptyFSImageAllocFileData(image, child->fFileNum, (uint64_t) child->fStat.st_size, &extents, &extentCount);
+            }
+            fileOffset = 0;
+            for (extentIndex = 0; (err == 0) && (extentIndex < extentCount); extentIndex++) {
+                err = PlanAddExtent(plan, child, fileOffset, &extents[extentIndex], extentIndex);
+                fileOffset += (uint64_t) extents[extentIndex].fBlockCount * plan->fBlockSize;
+            }
+            for (extentIndex = 0; (err == 0) && (extentIndex < child->fStoredExtentCount); extentIndex++) {
+                err = PlanAddExtent(plan, child, fileOffset, &child->fStoredExtents[extentIndex], extentIndex);
+                fileOffset += plan->fCompressedChunkSize;
+            }
+            if (err == 0) {
+                err = CopyAttributes(image, child);
+            }
+            if (err != 0) {
+                fprintf(stderr, "%s: ", child->fPath);
+            }
+            free(extents);
+        }
+    }
+
+    // Then each subdirectory, and all that it contains, in turn.
+
+    for (index = 0; (err == 0) && (index < dirNode->fChildCount); index++) {
+        child = dirNode->fChildren[index];
+        if ( S_ISDIR(child->fStat.st_mode) ) {
+            err = EmptyFSImageAddDirectory(image, dirNode->fFileNum, child->fName, 0755, &child->fFileNum);
+            if (err == 0) {
+                err = LayOutDirectory(image, child, plan);
+            } else {
+                fprintf(stderr, "%s: ", child->fPath);
+            }
+        }
+    }
+
+    // Adding entries changes the directory's dates, so do this last.
+
+    if (err == 0) {
+        err = CopyAttributes(image, dirNode);
+    }
+    return err;
+}
+
+static int ChooseVolumeSize(const ScanTotals *totals, uint32_t blockSize, uint32_t fileCount, const char *volumeName, uint64_t *volumeSizePtr)
+    // Works out how big a volume needs to be to hold the tree, with a little
+    // to spare.  Directories take a block each, plus the space for their
+    // entries (the last block of each is part empty, and index nodes and
+    // overflow blocks take a little more, which the slack covers).
+{
+    int                 err;
+    uint64_t            blocksNeeded;
+    uint64_t            volumeSize;
+    EmptyFSSuperblock   sb;
+
+    blocksNeeded  = totals->fDataBlocks;
+    blocksNeeded += totals->fDirectoryCount;
+    blocksNeeded += (totals->fEntryBytes + blockSize - 1) / blockSize;
+    blocksNeeded += (blocksNeeded / 64) + 64;
+
+    // Start with the data, and grow until there's enough room for it after
+    // the metadata.  The layout's free block count doesn't account for the
+    // metadata (that's done when the volume is created), so we work out what's
+    // left ourselves.  The journal grows with the volume, hence the loop.
+
+    volumeSize = (blocksNeeded + 1024) * blockSize;
+    do {
+        err = EmptyFSImageLayout(volumeSize, blockSize, fileCount, TRUE, volumeName, &sb);
+        if (err == EINVAL) {
+            err = EAGAIN;               // too small even for the metadata
+            volumeSize *= 2;
+        } else if ( (err == 0) && ((sb.fBlockCount - sb.fDataStart) < blocksNeeded) ) {
+            volumeSize += (blocksNeeded - (sb.fBlockCount - sb.fDataStart)) * blockSize;
+            err = EAGAIN;
+        }
+    } while (err == EAGAIN);
+
+    if (err == 0) {
+        *volumeSizePtr = volumeSize;
+    }
+    return err;
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Copying the Data
+
+// A Pipeline copies the chunks of a Plan.  Chunk n is filled in buffer
+// n % fBufferCount.  A reader can start on chunk n only once the writer has
+// written chunk n - fBufferCount; the writer writes chunk n once the buffer
+// holds it.
+
+struct Pipeline {
+    const Plan *        fPlan;
+    uint8_t **          fBuffers;
+    size_t *            fBufferChunk;       // [fLock] chunk held in each buffer, or SIZE_MAX
+    uint32_t            fBufferCount;
+    pthread_mutex_t     fLock;
+    pthread_cond_t      fCond;
+    size_t              fNextToRead;        // [fLock]
+    size_t              fNextToWrite;       // [fLock]
+    int                 fError;             // [fLock] the first error, if any, which stops everything
+};
+typedef struct Pipeline Pipeline;
+
+// A Reader is the state of one reader thread.
+
+struct Reader {
+    const Node *        fOpenFile;          // the open source file, which we keep open from one chunk to the next, because a big file spans many chunks
+    int                 fOpenFD;
+    uint8_t *           fSource;            // files stored in chunks only: a compression chunk, as read from the source
+    uint8_t *           fStored;            // ditto, as compressed
+};
+typedef struct Reader Reader;
+
+static void PipelineFail(Pipeline *pipeline, int err, const char *path)
+    // Records err, if it's the first, and wakes everyone up so that they
+    // notice.  main prints the error, so we just say where it happened.  Call
+    // with fLock held.
+{
+    if (pipeline->fError == 0) {
+        pipeline->fError = err;
+        fprintf(stderr, "%s: ", path);
+    }
+    (void) pthread_cond_broadcast(&pipeline->fCond);
+}
+
+static int FillChunk(const Plan *plan, const Chunk *chunk, uint8_t *buf, Reader *reader)
+    // Reads the data for chunk into buf, compressing and checksumming it if
+    // need be.  If this fails, reader->fOpenFile is the file that it failed
+    // on.  Each segment of a checksummed file is a different chunk of it,
+    // so no two readers ever set the same checksum.
+{
+    int             err;
+    size_t          index;
+    const Segment * segment;
+    uint32_t        compression;
+    uint32_t        storedBlocks;
+
+    memset(buf, 0, (size_t) chunk->fBlockCount * plan->fBlockSize);
+
+    err = 0;
+    for (index = 0; (err == 0) && (index < chunk->fSegmentCount); index++) {
+        segment = &plan->fSegments[chunk->fFirstSegment + index];
+        if (segment->fFile != reader->fOpenFile) {
+            if (reader->fOpenFD >= 0) {
+                (void) close(reader->fOpenFD);
+            }
+            reader->fOpenFile = segment->fFile;
+            reader->fOpenFD = open(segment->fFile->fPath, O_RDONLY);
+            if (reader->fOpenFD < 0) {
+                err = errno;
+            }
+        }
+        // EmptyFSImagePReadAll returns EIO if the file is shorter than it was
+        // when we scanned it, which means that someone's changing it under
+        // us.  We don't notice if it gets longer.
+
+        if ( (err == 0) && ( (segment->fStoredBlocks == 0) || ! plan->fCompress ) ) {
+            err = EmptyFSImagePReadAll(reader->fOpenFD, buf + segment->fChunkOffset, segment->fLength, (off_t) segment->fFileOffset);
+        } else if (err == 0) {
+            err = EmptyFSImagePReadAll(reader->fOpenFD, reader->fSource, segment->fLength, (off_t) segment->fFileOffset);
+            if (err == 0) {
+                EmptyFSImageCompressChunk(plan->fBlockSize, reader->fSource, segment->fLength, reader->fStored, &compression, &storedBlocks);
+                if (storedBlocks != segment->fStoredBlocks) {
+                    err = EIO;
+                } else {
+                    memcpy(buf + segment->fChunkOffset, reader->fStored, (size_t) storedBlocks * plan->fBlockSize);
+                }
+            }
+        }
+        if ( (err == 0) && (segment->fFile->fChecksums != NULL) ) {
+            segment->fFile->fChecksums[segment->fExtentIndex] = EmptyFSChecksum(
+                0,
+                buf + segment->fChunkOffset,
+                (size_t) segment->fStoredBlocks * plan->fBlockSize
+            );
+        }
+    }
+    return err;
+}
+
+static void * ReaderThread(void *parameter)
+    // The body of each reader thread: take the next chunk, wait for its
+    // buffer to be free, fill it, and hand it to the writer.
+{
+    int             err;
+    Pipeline *      pipeline;
+    const Plan *    plan;
+    size_t          chunkIndex;
+    uint32_t        bufferIndex;
+    Reader          reader;
+
+    pipeline = (Pipeline *) parameter;
+    plan = pipeline->fPlan;
+    memset(&reader, 0, sizeof(reader));
+    reader.fOpenFD = -1;
+
+    err = 0;
+    if ( (plan->fCompressedChunkSize != 0) && plan->fCompress ) {
+        reader.fSource = malloc(plan->fCompressedChunkSize);
+        reader.fStored = malloc(plan->fCompressedChunkSize);
+        if ( (reader.fSource == NULL) || (reader.fStored == NULL) ) {
+            err = ENOMEM;
+        }
+    }
+    (void) pthread_mutex_lock(&pipeline->fLock);
+    if (err != 0) {
+        PipelineFail(pipeline, err, "mkimage_EmptyFS");
+    }
+    while (TRUE) {
+        while (    (pipeline->fError == 0)
+                && (pipeline->fNextToRead < plan->fChunkCount)
+                && (pipeline->fNextToRead >= (pipeline->fNextToWrite + pipeline->fBufferCount)) ) {
+            (void) pthread_cond_wait(&pipeline->fCond, &pipeline->fLock);
+        }
+        if ( (pipeline->fError != 0) || (pipeline->fNextToRead == plan->fChunkCount) ) {
+            break;
+        }
+        chunkIndex = pipeline->fNextToRead;
+        pipeline->fNextToRead += 1;
+        bufferIndex = (uint32_t) (chunkIndex % pipeline->fBufferCount);
+        (void) pthread_mutex_unlock(&pipeline->fLock);
+
+        err = FillChunk(plan, &plan->fChunks[chunkIndex], pipeline->fBuffers[bufferIndex], &reader);
+
+        (void) pthread_mutex_lock(&pipeline->fLock);
+        if (err == 0) {
+            pipeline->fBufferChunk[bufferIndex] = chunkIndex;
+            (void) pthread_cond_broadcast(&pipeline->fCond);
+        } else {
+            PipelineFail(pipeline, err, reader.fOpenFile->fPath);
+        }
+    }
+    (void) pthread_mutex_unlock(&pipeline->fLock);
+
+    if (reader.fOpenFD >= 0) {
+        (void) close(reader.fOpenFD);
+    }
+    free(reader.fSource);
+    free(reader.fStored);
+    return NULL;
+}
+
+static int CopyData(const Plan *plan, const char *imagePath, int imageFD, uint32_t threadCount, uint64_t *bytesWrittenPtr)
+    // Runs the pipeline, with threadCount readers and the calling thread as
+    // the writer, until every chunk is written or something goes wrong.
+{
+    int             err;
+    Pipeline        pipeline;
+    pthread_t       threads[kMaxThreads];
+    uint32_t        started;
+    uint32_t        index;
+    size_t          chunkIndex;
+    uint32_t        bufferIndex;
+    const Chunk *   chunk;
+
+    assert( (threadCount >= 1) && (threadCount <= kMaxThreads) );
+
+    memset(&pipeline, 0, sizeof(pipeline));
+    pipeline.fPlan        = plan;
+    pipeline.fBufferCount = threadCount * kBuffersPerThread;
+    *bytesWrittenPtr = 0;
+    started = 0;
+
+    err = 0;
+    pipeline.fBuffers     = calloc(pipeline.fBufferCount, sizeof(uint8_t *));
+    pipeline.fBufferChunk = calloc(pipeline.fBufferCount, sizeof(size_t));
+    if ( (pipeline.fBuffers == NULL) || (pipeline.fBufferChunk == NULL) ) {
+        err = ENOMEM;
+    }
+    for (index = 0; (err == 0) && (index < pipeline.fBufferCount); index++) {
+        pipeline.fBufferChunk[index] = SIZE_MAX;
+        pipeline.fBuffers[index] = malloc(kChunkSize);
+        if (pipeline.fBuffers[index] == NULL) {
+            err = ENOMEM;
+        }
+    }
+    if (err == 0) {
+        err = pthread_mutex_init(&pipeline.fLock, NULL);
+        if (err == 0) {
+            err = pthread_cond_init(&pipeline.fCond, NULL);
+            if (err != 0) {
+                (void) pthread_mutex_destroy(&pipeline.fLock);
+            }
+        }
+    }
+
+    // Start the readers.  If we can't start as many as we wanted, we make do
+    // with the ones we've got.
+
+    if (err == 0) {
+        for (started = 0; started < threadCount; started++) {
+            if ( pthread_create(&threads[started], NULL, ReaderThread, &pipeline) != 0 ) {
+                break;
+            }
+        }
+        if (started == 0) {
+            err = EAGAIN;
+        }
+    }
+
+    // Write each chunk as soon as it's ready.
+
+    if (err == 0) {
+        (void) pthread_mutex_lock(&pipeline.fLock);
+        for (chunkIndex = 0; chunkIndex < plan->fChunkCount; chunkIndex++) {
+            bufferIndex = (uint32_t) (chunkIndex % pipeline.fBufferCount);
+            while ( (pipeline.fError == 0) && (pipeline.fBufferChunk[bufferIndex] != chunkIndex) ) {
+                (void) pthread_cond_wait(&pipeline.fCond, &pipeline.fLock);
+            }
+            if (pipeline.fError != 0) {
+                break;
+            }
+            (void) pthread_mutex_unlock(&pipeline.fLock);
+
+            chunk = &plan->fChunks[chunkIndex];
+            err = EmptyFSImagePWriteAll(
+                imageFD,
+                pipeline.fBuffers[bufferIndex],
+                (size_t) chunk->fBlockCount * plan->fBlockSize,
+                (off_t) (chunk->fStartBlock * plan->fBlockSize)
+            );
+            if (err == 0) {
+                *bytesWrittenPtr += (uint64_t) chunk->fBlockCount * plan->fBlockSize;
+            }
+
+            (void) pthread_mutex_lock(&pipeline.fLock);
+            if (err != 0) {
+                PipelineFail(&pipeline, err, imagePath);
+                break;
+            }
+            pipeline.fBufferChunk[bufferIndex] = SIZE_MAX;
+            pipeline.fNextToWrite = chunkIndex + 1;
+            (void) pthread_cond_broadcast(&pipeline.fCond);
+        }
+        err = pipeline.fError;
+        (void) pthread_mutex_unlock(&pipeline.fLock);
+    }
+
+    for (index = 0; index < started; index++) {
+        (void) pthread_join(threads[index], NULL);
+    }
+    if (started != 0) {
+        (void) pthread_cond_destroy(&pipeline.fCond);
+        (void) pthread_mutex_destroy(&pipeline.fLock);
+    }
+    if (pipeline.fBuffers != NULL) {
+        for (index = 0; index < pipeline.fBufferCount; index++) {
+            free(pipeline.fBuffers[index]);
+        }
+    }
+    free(pipeline.fBuffers);
+    free(pipeline.fBufferChunk);
+    return err;
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Building the Image
+
+static int WriteChecksums(EmptyFSImage *image, const Node *dirNode)
+    // Writes the checksum table of each file below dirNode that has one.
+{
+    int             err;
+    uint32_t        index;
+    const Node *    child;
+
+    err = 0;
+    for (index = 0; (err == 0) && (index < dirNode->fChildCount); index++) {
+        child = dirNode->fChildren[index];
+        if ( S_ISDIR(child->fStat.st_mode) ) {
+            err = WriteChecksums(image, child);
+        } else if (child->fChecksums != NULL) {
+            err = EmptyFSImageWriteChunkChecksums(image, child->fFileNum, child->fChecksums);
+            if (err != 0) {
+                fprintf(stderr, "%s: ", child->fPath);
+            }
+        }
+    }
+    return err;
+}
+
+static int MakeImage(
+    const char *    sourcePath,
+    const char *    imagePath,
+    uint64_t        volumeSize,
+    uint32_t        blockSize,
+    uint32_t        fileCount,
+    const char *    volumeName,
+    uint32_t        threadCount,
+    uint32_t        compressedChunkSize,
+    int             compress,
+    int             checksum
+)
+    // Builds the image.  The arguments are as described in PrintUsage; zero
+    // (or NULL) means the default.  compressedChunkSize is zero if we're
+    // neither compressing nor checksumming.
+{
+    int             err;
+    Node *          root;
+    struct stat     sb;
+    ScanTotals      totals;
+    Plan            plan;
+    EmptyFSImage *  image;
+    int             imageFD;
+    uint64_t        bytesWritten;
+    double          startTime;
+    double          scanTime;
+    double          measureTime;
+    double          layoutTime;
+    double          endTime;
+
+    root = NULL;
+    image = NULL;
+    imageFD = -1;
+    bytesWritten = 0;
+    memset(&totals, 0, sizeof(totals));
+    memset(&plan, 0, sizeof(plan));
+    if (blockSize == 0) {
+        blockSize = kEmptyFSDefaultBlockSize;
+    }
+    if (volumeName == NULL) {
+        volumeName = "EmptyFS";
+    }
+    plan.fBlockSize = blockSize;
+    plan.fCompressedChunkSize = compressedChunkSize;
+    plan.fCompress = compress;
+    plan.fChecksum = checksum;
+
+    // Pass 1: scan the source.
+
+    startTime = EmptyFSImageNow();
+    err = 0;
+    if ( stat(sourcePath, &sb) < 0 ) {
+        err = errno;
+    } else if ( ! S_ISDIR(sb.st_mode) ) {
+        err = ENOTDIR;
+    }
+    if (err != 0) {
+        fprintf(stderr, "%s: ", sourcePath);
+    }
+    if (err == 0) {
+        err = NewNode("", sourcePath, &sb, &root);
+    }
+    if (err == 0) {
+        totals.fDirectoryCount = 1;
+        err = ScanDirectory(root, blockSize, &totals);
+    }
+
+    // Pass 2: find out how well the files compress.
+
+    scanTime = EmptyFSImageNow();
+    if ( (err == 0) && (compressedChunkSize != 0) ) {
+        err = MeasureCompression(root, blockSize, compressedChunkSize, compress, checksum, threadCount, &totals);
+    }
+
+    // Size the volume, if need be.  We leave a few spare file records, in
+    // case anyone mounts the volume read/write.
+
+    if ( (err == 0) && (fileCount == 0) ) {
+        fileCount = kEmptyFSFirstFileNum + totals.fFileCount + totals.fDirectoryCount;
+        fileCount += (fileCount / 64) + 64;
+    }
+    if ( (err == 0) && (volumeSize == 0) ) {
+        err = ChooseVolumeSize(&totals, blockSize, fileCount, volumeName, &volumeSize);
+    }
+
+    // Pass 3: create the volume, and lay out the tree.
+
+    measureTime = EmptyFSImageNow();
+    if (err == 0) {
+        err = EmptyFSImageCreate(imagePath, volumeSize, blockSize, fileCount, volumeName, &image);
+        if (err != 0) {
+            fprintf(stderr, "%s: ", imagePath);
+        }
+    }
+    if (err == 0) {
+        root->fFileNum = kEmptyFSRootFileNum;
+        err = LayOutDirectory(image, root, &plan);
+    }
+
+    // Pass 4: copy the data.  The image library doesn't touch the blocks
+    // that it allocated for it, so we write them through a descriptor of our
+    // own, and let EmptyFSImageClose flush everything to the disk.
+
+    layoutTime = EmptyFSImageNow();
+    if (err == 0) {
+        imageFD = open(imagePath, O_WRONLY);
+        if (imageFD < 0) {
+            err = errno;
+            fprintf(stderr, "%s: ", imagePath);
+        }
+    }
+    if (err == 0) {
+        err = CopyData(&plan, imagePath, imageFD, threadCount, &bytesWritten);
+    }
+    if ( (err == 0) && checksum ) {
+        err = WriteChecksums(image, root);
+    }
+    if (imageFD >= 0) {
+        (void) close(imageFD);
+    }
+    if (image != NULL) {
+        if (err == 0) {
+            err = EmptyFSImageClose(image);
+        } else {
+            (void) EmptyFSImageClose(image);
+        }
+    }
+    endTime = EmptyFSImageNow();
+
+    if (err == 0) {
+        printf("%s: %u files, %u directories, %.1f MB of data, in a %.1f MB volume\n",
+            imagePath,
+            (unsigned int) totals.fFileCount,
+            (unsigned int) totals.fDirectoryCount,
+            (double) totals.fDataBytes / (1024.0 * 1024.0),
+            (double) volumeSize / (1024.0 * 1024.0)
+        );
+        if (totals.fSkipped != 0) {
+            printf("%u objects skipped\n", (unsigned int) totals.fSkipped);
+        }
+        if (checksum) {
+            printf("%u files checksummed\n", (unsigned int) totals.fChecksummedFileCount);
+        }
+        if (compress) {
+            printf("%u files compressed; the data takes %.1f MB, measured in %.3f seconds\n",
+                (unsigned int) totals.fCompressedFileCount,
+                (double) (totals.fDataBlocks * blockSize) / (1024.0 * 1024.0),
+                measureTime - scanTime
+            );
+        }
+        printf("scanned in %.3f seconds, laid out in %.3f seconds, copied in %.3f seconds (%.1f MB/s)\n",
+            scanTime - startTime,
+            layoutTime - measureTime,
+            endTime - layoutTime,
+            ((double) bytesWritten / (1024.0 * 1024.0)) / (((endTime - layoutTime) > 0.0) ? (endTime - layoutTime) : 1.0)
+        );
+    }
+
+    free(plan.fSegments);
+    free(plan.fChunks);
+    FreeNode(root);
+    return err;
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Main
+
+static void PrintUsage(const char *argv0)
+    // Print a helpful help message.
+{
+    const char *    progName;
+
+    progName = strrchr(argv0, '/');
+    if (progName == NULL) {
+        progName = argv0;
+    } else {
+        progName += 1;
+    }
+    fprintf(stderr, "usage: %s [ -b block-size ] [ -c ] [ -C chunk-size ] [ -k ] [ -n files ] [ -s size ] [ -t threads ] [ -v volume-name ] source-directory special-device-or-image\n", progName);
+    fprintf(stderr, "  -b block-size  block size in bytes; default %u\n", (unsigned int) kEmptyFSDefaultBlockSize);
+    fprintf(stderr, "  -c             compress files with LZ4\n");
+    fprintf(stderr, "  -C chunk-size  with -c or -k, store files in chunks of this many bytes (a power of two, %u..%u, bigger than the block size); default %u\n",
+        (unsigned int) kEmptyFSMinCompressedChunkSize,
+        (unsigned int) kEmptyFSMaxCompressedChunkSize,
+        (unsigned int) kEmptyFSDefaultCompressedChunkSize
+    );
+    fprintf(stderr, "  -k             checksum the data of each file, a chunk at a time\n");
+    fprintf(stderr, "  -n files       number of file records; default just more than the tree needs\n");
+    fprintf(stderr, "  -s size        volume size in bytes (k, m, g or t suffix); default just big enough\n");
+    fprintf(stderr, "  -t threads     threads to read the source with; default one per CPU, at most %u\n", (unsigned int) kMaxThreads);
+    fprintf(stderr, "  -v volume-name volume name; default \"EmptyFS\"\n");
+}
+
+extern int main(int argc, char **argv)
+{
+    int             err;
+    int             retVal;
+    int             ch;
+    uint64_t        volumeSize;
+    uint32_t        blockSize;
+    uint32_t        fileCount;
+    const char *    volumeName;
+    long            threadCount;
+    int             compress;
+    int             checksum;
+    uint32_t        chunkSize;
+    char *          end;
+
+    // Parse command line options.
+
+    volumeSize    = 0;
+    blockSize     = 0;
+    fileCount     = 0;
+    volumeName    = NULL;
+    compress      = FALSE;
+    checksum      = FALSE;
+    chunkSize     = kEmptyFSDefaultCompressedChunkSize;
+    threadCount   = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threadCount < 1) {
+        threadCount = 1;
+    } else if (threadCount > kMaxThreads) {
+        threadCount = kMaxThreads;
+    }
+
+    retVal = EXIT_SUCCESS;
+    do {
+        ch = getopt(argc, argv, "b:cC:kn:s:t:v:");
+        if (ch != -1) {
+            switch (ch) {
+                case 'b':
+                    blockSize = (uint32_t) strtoul(optarg, &end, 0);
+                    if ( (*end != 0) || (blockSize < kEmptyFSMinBlockSize) || (blockSize > kEmptyFSMaxBlockSize) || ((blockSize & (blockSize - 1)) != 0) ) {
+                        retVal = EXIT_FAILURE;
+                    }
+                    break;
+                case 'c':
+                    compress = TRUE;
+                    break;
+                case 'C':
+                    chunkSize = (uint32_t) strtoul(optarg, &end, 0);
+                    if ( (*end != 0) || (chunkSize < kEmptyFSMinCompressedChunkSize) || (chunkSize > kEmptyFSMaxCompressedChunkSize) || ((chunkSize & (chunkSize - 1)) != 0) ) {
+                        retVal = EXIT_FAILURE;
+                    }
+                    break;
+                case 'k':
+                    checksum = TRUE;
+                    break;
+                case 'n':
+                    fileCount = (uint32_t) strtoul(optarg, &end, 0);
+                    if ( (*end != 0) || (fileCount <= kEmptyFSRootFileNum) || (fileCount > kEmptyFSMaxFileCount) ) {
+                        retVal = EXIT_FAILURE;
+                    }
+                    break;
+                case 's':
+                    if ( (EmptyFSImageParseSize(optarg, &volumeSize) != 0) || (volumeSize == 0) ) {
+                        retVal = EXIT_FAILURE;
+                    }
+                    break;
+                case 't':
+                    threadCount = strtol(optarg, &end, 0);
+                    if ( (*end != 0) || (threadCount < 1) || (threadCount > kMaxThreads) ) {
+                        retVal = EXIT_FAILURE;
+                    }
+                    break;
+                case 'v':
+                    volumeName = optarg;
+                    if (strlen(volumeName) >= kEmptyFSVolumeNameSize) {
+                        retVal = EXIT_FAILURE;
+                    }
+                    break;
+                case '?':
+                default:
+                    retVal = EXIT_FAILURE;
+                    break;
+            }
+        }
+    } while ( (ch != -1) && (retVal == EXIT_SUCCESS) );
+
+    // Fail if we don't have exactly two remaining arguments, or if the
+    // chunks aren't bigger than the blocks (a chunk that's stored in one
+    // block can't be compressed, and the format doesn't allow chunks smaller
+    // than a block).
+
+    if ( (retVal == EXIT_SUCCESS) && ((argc - optind) != 2) ) {
+        retVal = EXIT_FAILURE;
+    }
+    if ( (retVal == EXIT_SUCCESS) && (compress || checksum) && (chunkSize <= ((blockSize != 0) ? blockSize : kEmptyFSDefaultBlockSize)) ) {
+        retVal = EXIT_FAILURE;
+    }
+    if (retVal != EXIT_SUCCESS) {
+        PrintUsage(argv[0]);
+    }
+
+    // If all is well, build the image.  Errors about particular objects have
+    // already been printed, so just print the error.
+
+    if (retVal == EXIT_SUCCESS) {
+        err = MakeImage(argv[optind], argv[optind + 1], volumeSize, blockSize, fileCount, volumeName, (uint32_t) threadCount, (compress || checksum) ? chunkSize : 0, compress, checksum);
+
+        if (err != 0) {
+            fprintf(stderr, "%s\n", strerror(err));
+            retVal = EXIT_FAILURE;
+        }
+    }
+
+    return retVal;
+}
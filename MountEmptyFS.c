@@ -70,10 +70,12 @@ First checked in.
 
 /////////////////////////////////////////////////////////////////////
 
-static int DoMount(const char *devNode, const char *mountPoint, uint32_t debugLevel, boolean_t forceFailure)
-	// Mount the file system on devNode at mountPoint.  debugLevel 
-	// and forceFailure are passed to the kernel as part of the mount 
-	// arguments.
+static int DoMount(const char *devNode, const char *mountPoint, int mntflags, uint32_t debugLevel, boolean_t forceFailure)
+	// Mount the file system on devNode at mountPoint.  mntflags is 
+	// passed to mount (MNT_RDONLY mounts the volume read-only, and 
+	// MNT_FORCE lets us mount a volume that wasn't cleanly unmounted 
+	// read/write).  debugLevel and forceFailure are passed to the 
+	// kernel as part of the mount arguments.
 {
     int                 err;
     EmptyFSMountArgs    mountArgs;
@@ -93,7 +95,7 @@ static int DoMount(const char *devNode, const char *mountPoint, uint32_t debugLe
         mountArgs.fDebugLevel   = debugLevel;
         mountArgs.fForceFailure = forceFailure;
         
-        err = mount("EmptyFS", realMountPoint, 0, &mountArgs);
+        err = mount("EmptyFS", realMountPoint, mntflags, &mountArgs);
         if (err < 0) {
             err = errno;
         }
@@ -113,7 +115,7 @@ static void PrintUsage(const char *argv0)
     } else {
         progName += 1;
     }
-    fprintf(stderr, "usage: %s [ -d | -F ] special-device filesystem-node\n", progName);
+    fprintf(stderr, "usage: %s [ -d | -F ] [ -r | -f ] special-device filesystem-node\n", progName);
 }
 
 extern int main(int argc, char **argv)
@@ -123,15 +125,17 @@ extern int main(int argc, char **argv)
     int			ch;
     uint32_t	debugLevel;
 	boolean_t	forceFailure;
+	int			mntflags;
     
 	// Parse command line options.
 	
 	debugLevel   = 0;
 	forceFailure = FALSE;
+	mntflags     = 0;
 	
     retVal = EXIT_SUCCESS;
     do {
-        ch = getopt(argc, argv, "dF");
+        ch = getopt(argc, argv, "dFfr");
         if (ch != -1) {
             switch (ch) {
                 case 'd':
@@ -140,6 +144,12 @@ extern int main(int argc, char **argv)
                 case 'F':
                     forceFailure = TRUE;
                     break;
+                case 'f':
+                    mntflags |= MNT_FORCE;
+                    break;
+                case 'r':
+                    mntflags |= MNT_RDONLY;
+                    break;
                 case '?':
                 default:
                     PrintUsage(argv[0]);
@@ -159,7 +169,7 @@ extern int main(int argc, char **argv)
 	// If all is well, do the mount.
 	
     if (retVal == EXIT_SUCCESS) {
-        err = DoMount(argv[optind], argv[optind + 1], debugLevel, forceFailure);
+        err = DoMount(argv[optind], argv[optind + 1], mntflags, debugLevel, forceFailure);
         
         if (err != 0) {
             errno = err;
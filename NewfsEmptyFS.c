@@ -0,0 +1,498 @@
+/*
+    File:       NewfsEmptyFS.c
+
+    Contains:   Tool to format an EmptyFS volume.
+
+    Written by: DTS
+
+    Copyright:  Copyright (c) 2006 by Apple Computer, Inc., All Rights Reserved.
+
+    Disclaimer: IMPORTANT:  This Apple software is supplied to you by Apple Computer, Inc.
+                ("Apple") in consideration of your agreement to the following terms, and your
+                use, installation, modification or redistribution of this Apple software
+                constitutes acceptance of these terms.  If you do not agree with these terms,
+                please do not use, install, modify or redistribute this Apple software.
+
+                In consideration of your agreement to abide by the following terms, and subject
+                to these terms, Apple grants you a personal, non-exclusive license, under Apple's
+                copyrights in this original Apple software (the "Apple Software"), to use,
+                reproduce, modify and redistribute the Apple Software, with or without
+                modifications, in source and/or binary forms; provided that if you redistribute
+                the Apple Software in its entirety and without modifications, you must retain
+                this notice and the following text and disclaimers in all such redistributions of
+                the Apple Software.  Neither the name, trademarks, service marks or logos of
+                Apple Computer, Inc. may be used to endorse or promote products derived from the
+                Apple Software without specific prior written permission from Apple.  Except as
+                expressly stated in this notice, no other rights or licenses, express or implied,
+                are granted by Apple herein, including but not limited to any patent rights that
+                may be infringed by your derivative works or by other works in which the Apple
+                Software may be incorporated.
+
+                The Apple Software is provided by Apple on an "AS IS" basis.  APPLE MAKES NO
+                WARRANTIES, EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION THE IMPLIED
+                WARRANTIES OF NON-INFRINGEMENT, MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+                PURPOSE, REGARDING THE APPLE SOFTWARE OR ITS USE AND OPERATION ALONE OR IN
+                COMBINATION WITH YOUR PRODUCTS.
+
+                IN NO EVENT SHALL APPLE BE LIABLE FOR ANY SPECIAL, INDIRECT, INCIDENTAL OR
+                CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+                GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+                ARISING IN ANY WAY OUT OF THE USE, REPRODUCTION, MODIFICATION AND/OR DISTRIBUTION
+                OF THE APPLE SOFTWARE, HOWEVER CAUSED AND WHETHER UNDER THEORY OF CONTRACT, TORT
+                (INCLUDING NEGLIGENCE), STRICT LIABILITY OR OTHERWISE, EVEN IF APPLE HAS BEEN
+                ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+    Change History (most recent first):
+
+$Log$
+
+*/
+
+/////////////////////////////////////////////////////////////////////
+
+// This tool formats a disk device, or a plain image file, as an empty EmptyFS
+// volume.  It's built as "newfs_EmptyFS", the name that the system's tools
+// expect.  It uses the image library ("EmptyFSImage.c") to work out the layout
+// and to write the root directory, and does the bulk of the work itself.
+//
+// On a big volume, the bulk of the work is zeroing the metadata areas.  Most
+// of it can be avoided:
+//
+// o An image file is truncated to zero length and then extended to the size
+//   of the volume, which zero fills it without writing anything (and leaves
+//   it sparse, on file systems that support that).
+//
+// o The file table, usually the biggest area, is only initialised as far as
+//   its first chunk; the KEXT and the image library initialise the rest as
+//   they need it (see "Lazy File Table" in "EmptyFSFormat.h").  -E turns
+//   this off, initialising the whole table now.
+//
+// What's left on a device (the superblock, the bitmap, the first chunk of
+// the file table and the journal) is split into 1 MB pieces, which a pool of
+// threads (-t, by default one per CPU) zeroes in parallel.  After that the
+// image library writes the few blocks that aren't zero, and flushes
+// everything to the disk.  On a device, most of the time goes on zeroing the
+// bitmap (32 MB per terabyte with 4 KB blocks); an image file of any size
+// formats in a fraction of a second.
+
+// System interfaces
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#if defined(__APPLE__)
+    #include <sys/disk.h>
+#elif defined(__linux__)
+    #include <linux/fs.h>
+#endif
+
+// The image library, and the format definitions that it shares with the kernel
+
+#include "EmptyFSImage.h"
+
+#ifndef TRUE
+    #define TRUE    1
+    #define FALSE   0
+#endif
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Parallel Zeroing
+
+enum {
+    kMaxThreads     = 16,
+    kZeroIOSize     = 1024 * 1024           // each thread zeroes this much at a time
+};
+
+// A ZeroJob describes some block ranges to zero, and how far the threads have
+// got through them.  Each thread takes the next kZeroIOSize piece with fLock
+// held, and writes it with the lock released, until there are none left or
+// one of them fails.
+
+struct ZeroRange {
+    uint64_t            fStart;             // first block
+    uint64_t            fCount;             // number of blocks
+};
+typedef struct ZeroRange ZeroRange;
+
+struct ZeroJob {
+    int                 fFD;
+    uint32_t            fBlockSize;
+    ZeroRange           fRanges[3];
+    uint32_t            fRangeCount;
+    pthread_mutex_t     fLock;
+    uint32_t            fNextRange;         // [fLock] range that the next piece comes from
+    uint64_t            fNextBlock;         // [fLock] offset of the next piece within that range, in blocks
+    int                 fError;             // [fLock] the first error, if any
+};
+typedef struct ZeroJob ZeroJob;
+
+static void ZeroJobAddRange(ZeroJob *job, uint64_t start, uint64_t count)
+    // Adds the blocks [start, start + count) to the job, if count isn't zero.
+{
+    assert(job->fRangeCount < (sizeof(job->fRanges) / sizeof(job->fRanges[0])));
+
+    if (count != 0) {
+        job->fRanges[job->fRangeCount].fStart = start;
+        job->fRanges[job->fRangeCount].fCount = count;
+        job->fRangeCount += 1;
+    }
+}
+
+static void * ZeroThread(void *parameter)
+    // The body of each zeroing thread.
+{
+    int             err;
+    ZeroJob *       job;
+    void *          zeros;
+    uint64_t        piece;
+    uint64_t        start;
+    uint64_t        count;
+    ZeroRange *     range;
+
+    job = (ZeroJob *) parameter;
+    piece = kZeroIOSize / job->fBlockSize;
+
+    err = 0;
+    zeros = calloc(1, kZeroIOSize);
+    if (zeros == NULL) {
+        err = ENOMEM;
+    }
+    while (TRUE) {
+        count = 0;
+        (void) pthread_mutex_lock(&job->fLock);
+        if ( (err != 0) && (job->fError == 0) ) {
+            job->fError = err;
+        }
+        if (job->fError == 0) {
+            if ( (job->fNextRange < job->fRangeCount) && (job->fNextBlock == job->fRanges[job->fNextRange].fCount) ) {
+                job->fNextRange += 1;
+                job->fNextBlock  = 0;
+            }
+            if (job->fNextRange < job->fRangeCount) {
+                range = &job->fRanges[job->fNextRange];
+                start = range->fStart + job->fNextBlock;
+                count = range->fCount - job->fNextBlock;
+                if (count > piece) {
+                    count = piece;
+                }
+                job->fNextBlock += count;
+            }
+        }
+        (void) pthread_mutex_unlock(&job->fLock);
+
+        if (count == 0) {
+            break;
+        }
+        err = EmptyFSImagePWriteAll(job->fFD, zeros, (size_t) (count * job->fBlockSize), (off_t) (start * job->fBlockSize));
+    }
+    free(zeros);
+    return NULL;
+}
+
+static int ZeroJobRun(ZeroJob *job, uint32_t threadCount)
+    // Zeroes the job's ranges using threadCount threads, and returns the
+    // first error that any of them hit.  If we can't start as many threads
+    // as we wanted, we make do with the ones we've got.
+{
+    int         err;
+    pthread_t   threads[kMaxThreads];
+    uint32_t    started;
+    uint32_t    index;
+
+    assert( (threadCount >= 1) && (threadCount <= kMaxThreads) );
+
+    err = pthread_mutex_init(&job->fLock, NULL);
+    if (err == 0) {
+        job->fNextRange = 0;
+        job->fNextBlock = 0;
+        job->fError     = 0;
+
+        for (started = 0; started < threadCount; started++) {
+            if ( pthread_create(&threads[started], NULL, ZeroThread, job) != 0 ) {
+                break;
+            }
+        }
+        if (started == 0) {
+            (void) ZeroThread(job);
+        }
+        for (index = 0; index < started; index++) {
+            (void) pthread_join(threads[index], NULL);
+        }
+        err = job->fError;
+        (void) pthread_mutex_destroy(&job->fLock);
+    }
+    return err;
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Formatting
+
+static int GetDeviceSize(int fd, uint64_t *sizePtr)
+    // Returns the size, in bytes, of the disk device open on fd.
+{
+    int         err;
+
+    err = 0;
+    #if defined(__APPLE__)
+        {
+            uint32_t    blockSize;
+            uint64_t    blockCount;
+
+            if (    (ioctl(fd, DKIOCGETBLOCKSIZE,  &blockSize)  < 0)
+                 || (ioctl(fd, DKIOCGETBLOCKCOUNT, &blockCount) < 0) ) {
+                err = errno;
+            } else {
+                *sizePtr = (uint64_t) blockSize * blockCount;
+            }
+        }
+    #elif defined(__linux__)
+        if ( ioctl(fd, BLKGETSIZE64, sizePtr) < 0 ) {
+            err = errno;
+        }
+    #else
+        {
+            off_t       end;
+
+            end = lseek(fd, 0, SEEK_END);
+            if (end < 0) {
+                err = errno;
+            } else {
+                *sizePtr = (uint64_t) end;
+            }
+        }
+    #endif
+    return err;
+}
+
+static int Format(const char *path, uint64_t volumeSize, uint32_t blockSize, uint32_t fileCount, int lazyFileTable, const char *volumeName, uint32_t threadCount)
+    // Formats the device or image file at path.  If volumeSize is zero, the
+    // volume fills the device, or the existing file; if it isn't, an image
+    // file is created, if necessary, and set to that size.  The other
+    // arguments are as described in PrintUsage.
+{
+    int                         err;
+    int                         fd;
+    struct stat                 sbuf;
+    uint64_t                    deviceSize;
+    EmptyFSSuperblock           sb;
+    ZeroJob                     job;
+    EmptyFSImage *              image;
+    double                      startTime;
+    const EmptyFSSuperblock *   newSB;
+
+    startTime = EmptyFSImageNow();
+
+    err = 0;
+    fd = open(path, O_RDWR | ( (volumeSize != 0) ? O_CREAT : 0 ), 0644);
+    if ( (fd < 0) || (fstat(fd, &sbuf) < 0) ) {
+        err = errno;
+    }
+
+    // Work out the size of the volume.  You can make a volume smaller than
+    // its device, but not bigger.
+
+    if (err == 0) {
+        if ( S_ISREG(sbuf.st_mode) ) {
+            if (volumeSize == 0) {
+                volumeSize = (uint64_t) sbuf.st_size;
+            }
+        } else {
+            err = GetDeviceSize(fd, &deviceSize);
+            if (err == 0) {
+                if (volumeSize == 0) {
+                    volumeSize = deviceSize;
+                } else if (volumeSize > deviceSize) {
+                    fprintf(stderr, "%s is only %llu bytes\n", path, (unsigned long long) deviceSize);
+                    err = EINVAL;
+                }
+            }
+        }
+    }
+    if (err == 0) {
+        err = EmptyFSImageLayout(volumeSize, blockSize, fileCount, lazyFileTable, volumeName, &sb);
+        if (err == EINVAL) {
+            fprintf(stderr, "%s is too small, or the block size is wrong\n", path);
+        }
+    }
+
+    // Zero the metadata areas: by truncating an image file, or by writing
+    // them in parallel on a device.
+
+    if (err == 0) {
+        if ( S_ISREG(sbuf.st_mode) ) {
+            if ( (ftruncate(fd, 0) < 0) || (ftruncate(fd, (off_t) (sb.fBlockCount * sb.fBlockSize)) < 0) ) {
+                err = errno;
+            }
+        } else {
+            memset(&job, 0, sizeof(job));
+            job.fFD        = fd;
+            job.fBlockSize = sb.fBlockSize;
+            if (sb.fROCompatFeatures & kEmptyFSROCompatLazyFileTable) {
+                ZeroJobAddRange(&job, 0, sb.fFileTableStart + sb.fFileTableInitBlocks);
+            } else {
+                ZeroJobAddRange(&job, 0, sb.fFileTableStart + sb.fFileTableBlocks);
+            }
+            ZeroJobAddRange(&job, sb.fJournalStart, sb.fJournalBlocks);
+            err = ZeroJobRun(&job, threadCount);
+        }
+    }
+
+    // Write the rest.  From here on the image owns fd.
+
+    if (err == 0) {
+        err = EmptyFSImageCreateWithLayout(fd, &sb, &image);
+        fd = -1;
+    }
+    if (err == 0) {
+        newSB = EmptyFSImageGetSuperblock(image);
+        printf("%s: %llu blocks of %u bytes, %u files, %llu journal blocks\n",
+            path,
+            (unsigned long long) newSB->fBlockCount,
+            (unsigned int) newSB->fBlockSize,
+            (unsigned int) newSB->fFileCount,
+            (unsigned long long) newSB->fJournalBlocks
+        );
+        if (newSB->fROCompatFeatures & kEmptyFSROCompatLazyFileTable) {
+            printf("file table: %llu of %llu blocks initialised\n",
+                (unsigned long long) newSB->fFileTableInitBlocks,
+                (unsigned long long) newSB->fFileTableBlocks
+            );
+        }
+        printf("formatted in %.3f seconds\n", EmptyFSImageNow() - startTime);
+
+        err = EmptyFSImageClose(image);
+    }
+    if (fd >= 0) {
+        (void) close(fd);
+    }
+    return err;
+}
+
+/////////////////////////////////////////////////////////////////////
+#pragma mark ***** Main
+
+static void PrintUsage(const char *argv0)
+    // Print a helpful help message.
+{
+    const char *    progName;
+
+    progName = strrchr(argv0, '/');
+    if (progName == NULL) {
+        progName = argv0;
+    } else {
+        progName += 1;
+    }
+    fprintf(stderr, "usage: %s [ -b block-size ] [ -n files ] [ -s size ] [ -t threads ] [ -v volume-name ] [ -E ] special-device-or-image\n", progName);
+    fprintf(stderr, "  -b block-size  block size in bytes; default %u\n", (unsigned int) kEmptyFSDefaultBlockSize);
+    fprintf(stderr, "  -n files       number of file records; default one per four blocks\n");
+    fprintf(stderr, "  -s size        volume size in bytes (k, m, g or t suffix); creates an image file if need be\n");
+    fprintf(stderr, "  -t threads     threads to zero metadata with; default one per CPU, at most %u\n", (unsigned int) kMaxThreads);
+    fprintf(stderr, "  -v volume-name volume name; default \"EmptyFS\"\n");
+    fprintf(stderr, "  -E             initialise the whole file table now, rather than lazily\n");
+}
+
+extern int main(int argc, char **argv)
+{
+    int             err;
+    int             retVal;
+    int             ch;
+    uint64_t        volumeSize;
+    uint32_t        blockSize;
+    uint32_t        fileCount;
+    int             lazyFileTable;
+    const char *    volumeName;
+    long            threadCount;
+    char *          end;
+
+    // Parse command line options.
+
+    volumeSize    = 0;
+    blockSize     = 0;
+    fileCount     = 0;
+    lazyFileTable = TRUE;
+    volumeName    = NULL;
+    threadCount   = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threadCount < 1) {
+        threadCount = 1;
+    } else if (threadCount > kMaxThreads) {
+        threadCount = kMaxThreads;
+    }
+
+    retVal = EXIT_SUCCESS;
+    do {
+        ch = getopt(argc, argv, "b:En:s:t:v:");
+        if (ch != -1) {
+            switch (ch) {
+                case 'b':
+                    blockSize = (uint32_t) strtoul(optarg, &end, 0);
+                    if ( (*end != 0) || (blockSize == 0) ) {
+                        retVal = EXIT_FAILURE;
+                    }
+                    break;
+                case 'E':
+                    lazyFileTable = FALSE;
+                    break;
+                case 'n':
+                    fileCount = (uint32_t) strtoul(optarg, &end, 0);
+                    if ( (*end != 0) || (fileCount <= kEmptyFSRootFileNum) || (fileCount > kEmptyFSMaxFileCount) ) {
+                        retVal = EXIT_FAILURE;
+                    }
+                    break;
+                case 's':
+                    if ( (EmptyFSImageParseSize(optarg, &volumeSize) != 0) || (volumeSize == 0) ) {
+                        retVal = EXIT_FAILURE;
+                    }
+                    break;
+                case 't':
+                    threadCount = strtol(optarg, &end, 0);
+                    if ( (*end != 0) || (threadCount < 1) || (threadCount > kMaxThreads) ) {
+                        retVal = EXIT_FAILURE;
+                    }
+                    break;
+                case 'v':
+                    volumeName = optarg;
+                    if (strlen(volumeName) >= kEmptyFSVolumeNameSize) {
+                        retVal = EXIT_FAILURE;
+                    }
+                    break;
+                case '?':
+                default:
+                    retVal = EXIT_FAILURE;
+                    break;
+            }
+        }
+    } while ( (ch != -1) && (retVal == EXIT_SUCCESS) );
+
+    // Fail if we don't have exactly one remaining argument.
+
+    if ( (retVal == EXIT_SUCCESS) && ((argc - optind) != 1) ) {
+        retVal = EXIT_FAILURE;
+    }
+    if (retVal != EXIT_SUCCESS) {
+        PrintUsage(argv[0]);
+    }
+
+    // If all is well, do the format.
+
+    if (retVal == EXIT_SUCCESS) {
+        err = Format(argv[optind], volumeSize, blockSize, fileCount, lazyFileTable, volumeName, (uint32_t) threadCount);
+
+        if (err != 0) {
+            errno = err;
+            perror(argv[optind]);
+            retVal = EXIT_FAILURE;
+        }
+    }
+
+    return retVal;
+}